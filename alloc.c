@@ -0,0 +1,162 @@
+// This file implements a bump-pointer allocator for the compiler's
+// data structures.
+//
+// chibicc never frees memory; everything lives until the process
+// exits. So, instead of calling calloc() for each Token or Node, we
+// carve objects out of large zero-filled chunks. Each kind of object
+// gets its own region so that objects of the same kind are packed
+// together.
+//
+// The allocator also counts how many objects and bytes are allocated
+// in each phase of compilation, which is printed by --mem-stats.
+//
+// A region can be rolled back to an earlier state with arena_mark()
+// and arena_release(). Released memory is zero-cleared and reused by
+// later allocations. This is used by -fstream-codegen to reuse the
+// memory of a function's AST once its code has been generated.
+
+#include "chibicc.h"
+
+#define CHUNK_SIZE (1 << 20)
+#define ALIGN 16
+
+// Each chunk starts with this header.
+typedef struct Chunk Chunk;
+struct Chunk {
+  Chunk *prev; // Previous chunk of the same region
+  char *used;  // End of the allocated part of a previous chunk
+};
+
+typedef struct {
+  Chunk *chunk; // Current chunk
+  char *ptr;
+  char *end;
+  Chunk *free;  // Released chunks for reuse
+  long reserved; // Total size of chunks
+  int nchunks;
+} Region;
+
+typedef struct {
+  long count;
+  long bytes;
+} MemStat;
+
+static char *kind_names[] = {
+  [ARENA_TOKEN] = "token", [ARENA_LITERAL] = "literal", [ARENA_NODE] = "node",
+  [ARENA_TYPE] = "type", [ARENA_OBJ] = "obj", [ARENA_MEMBER] = "member",
+  [ARENA_FILE] = "file", [ARENA_MISC] = "misc",
+};
+
+static char *phase_names[] = {
+  [PHASE_TOKENIZE] = "tokenize", [PHASE_PREPROCESS] = "preprocess",
+  [PHASE_PARSE] = "parse", [PHASE_CODEGEN] = "codegen",
+};
+
+static Region regions[ARENA_NKINDS];
+static MemStat stats[PHASE_NKINDS][ARENA_NKINDS];
+static Phase cur_phase;
+
+void arena_set_phase(Phase phase) {
+  cur_phase = phase;
+}
+
+// Returns zero-initialized memory for an object of a given kind.
+void *arena_alloc(ArenaKind kind, size_t size) {
+  size = align_to(size, ALIGN);
+
+  MemStat *st = &stats[cur_phase][kind];
+  st->count++;
+  st->bytes += size;
+
+  Region *r = &regions[kind];
+
+  // Large objects get their own chunks so that they don't waste
+  // the rest of the current chunk.
+  if (size > CHUNK_SIZE / 4) {
+    r->reserved += size;
+    r->nchunks++;
+    return calloc(1, size);
+  }
+
+  if (r->end - r->ptr < size) {
+    Chunk *c = r->free;
+    if (c) {
+      r->free = c->prev;
+    } else {
+      c = calloc(1, CHUNK_SIZE);
+      if (!c)
+        error("out of memory");
+      r->reserved += CHUNK_SIZE;
+      r->nchunks++;
+    }
+
+    if (r->chunk)
+      r->chunk->used = r->ptr;
+    c->prev = r->chunk;
+    r->chunk = c;
+    r->ptr = (char *)c + align_to(sizeof(Chunk), ALIGN);
+    r->end = (char *)c + CHUNK_SIZE;
+  }
+
+  void *p = r->ptr;
+  r->ptr += size;
+  return p;
+}
+
+ArenaMark arena_mark(ArenaKind kind) {
+  Region *r = &regions[kind];
+  return (ArenaMark){r->chunk, r->ptr};
+}
+
+// Frees all objects of a given kind allocated since a given mark.
+// Objects larger than a quarter of a chunk are not freed.
+void arena_release(ArenaKind kind, ArenaMark mark) {
+  Region *r = &regions[kind];
+
+  while (r->chunk != mark.chunk) {
+    Chunk *c = r->chunk;
+    char *start = (char *)c + align_to(sizeof(Chunk), ALIGN);
+    memset(start, 0, r->ptr - start);
+
+    r->chunk = c->prev;
+    r->ptr = r->chunk ? r->chunk->used : NULL;
+    r->end = r->chunk ? (char *)r->chunk + CHUNK_SIZE : NULL;
+
+    c->prev = r->free;
+    r->free = c;
+  }
+
+  if (r->chunk) {
+    memset(mark.ptr, 0, r->ptr - mark.ptr);
+    r->ptr = mark.ptr;
+  }
+}
+
+void print_mem_stats(FILE *out) {
+  fprintf(out, "%-12s %-8s %10s %12s\n", "phase", "kind", "objects", "bytes");
+
+  long total_count = 0;
+  long total_bytes = 0;
+
+  for (int i = 0; i < PHASE_NKINDS; i++) {
+    for (int j = 0; j < ARENA_NKINDS; j++) {
+      MemStat *st = &stats[i][j];
+      if (st->count == 0)
+        continue;
+      fprintf(out, "%-12s %-8s %10ld %12ld\n", phase_names[i], kind_names[j],
+              st->count, st->bytes);
+      total_count += st->count;
+      total_bytes += st->bytes;
+    }
+  }
+
+  long reserved = 0;
+  int nchunks = 0;
+  for (int i = 0; i < ARENA_NKINDS; i++) {
+    reserved += regions[i].reserved;
+    nchunks += regions[i].nchunks;
+  }
+
+  fprintf(out, "%-12s %-8s %10ld %12ld\n", "total", "", total_count, total_bytes);
+  fprintf(out, "reserved %ld bytes in %d chunks\n", reserved, nchunks);
+}
@@ -0,0 +1,2591 @@
+// This file contains a small x86-64 assembler. It reads the assembly
+// text produced by codegen() and writes an ELF64 relocatable object
+// file, so that we don't have to spawn an external assembler for each
+// translation unit.
+//
+// The assembler understands the subset of the AT&T syntax that chibicc
+// itself emits, plus common instructions that are likely to appear in
+// simple inline assembly. If it sees anything else, assemble_elf()
+// returns false without writing anything, and the caller falls back
+// to the system assembler.
+//
+// We don't write debug info. .file and .loc directives are ignored,
+// and the driver uses the system assembler instead if -g is given.
+//
+// Like GNU as, we start with 2-byte jumps for branches to labels in
+// the same section and make them longer only if the distance does not
+// fit in 8 bits (this is called "relaxation").
+
+#include "chibicc.h"
+#include <elf.h>
+
+typedef struct Section Section;
+typedef struct Symbol Symbol;
+typedef struct Frag Frag;
+typedef struct Fixup Fixup;
+typedef struct Reloc Reloc;
+
+// A location in a frag that has to be patched once the address of a
+// symbol is known.
+struct Fixup {
+  Fixup *next;
+  int offset;
+  int size;
+  int type; // R_X86_64_*
+  Symbol *sym;
+  long addend;
+};
+
+typedef enum {
+  FRAG_FIXED,
+  FRAG_JUMP,
+  FRAG_ALIGN,
+} FragKind;
+
+// A frag is a sequence of bytes whose length is known when it is
+// parsed, followed by an optional variable-length part which is either
+// a jump instruction or padding for alignment.
+struct Frag {
+  Frag *next;
+  char *buf;
+  int len;
+  int cap;
+  Fixup *fixups;
+  Fixup *last_fixup;
+
+  FragKind kind;
+  int jcc;        // Condition code of a jump, or -1 for jmp
+  Symbol *target; // Jump target
+  bool is_long;   // True if a jump needs a 32-bit displacement
+  int align;
+
+  int offset;     // Offset from the beginning of the section
+  int tail;       // Size of the variable-length part
+};
+
+struct Reloc {
+  Reloc *next;
+  long offset;
+  int type;
+  Symbol *sym;  // Target symbol, or
+  Section *sec; // the section symbol of a local target
+  long addend;
+};
+
+struct Section {
+  Section *next;
+  char *name;
+  int type;
+  long flags;
+  int align;
+  Frag *frags;
+  Frag *cur;
+  int size;
+
+  // Output
+  Reloc *relocs;
+  Reloc *last_reloc;
+  int shndx;
+  int sym_idx;
+};
+
+struct Symbol {
+  char *name;
+  bool is_temp;  // Assembler-local symbol such as .L..1 or 1:
+
+  // Location
+  Section *sec;
+  Frag *frag;
+  int offset;
+
+  bool is_global;
+  bool is_weak;
+  bool is_local;
+  bool is_used;
+  bool is_keep;  // True if it has to be in the symbol table
+  bool is_tls;
+  int type;      // STT_*
+  int visibility;
+  long size;
+
+  bool is_common;
+  long common_size;
+  int common_align;
+
+  int idx;       // Symbol table index
+};
+
+typedef enum {
+  MOD_NONE,
+  MOD_GOTPCREL,
+  MOD_PLT,
+  MOD_TPOFF,
+  MOD_TLSGD,
+  MOD_GOTTPOFF,
+  MOD_TLSLD,
+  MOD_DTPOFF,
+} Modifier;
+
+// sym@mod + val
+typedef struct {
+  Symbol *sym;
+  Modifier mod;
+  long val;
+} Expr;
+
+typedef enum {
+  OP_REG,
+  OP_XMM,
+  OP_ST,
+  OP_IMM,
+  OP_MEM,
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  bool indirect; // `*` for jmp and call
+
+  // OP_REG, OP_XMM or OP_ST
+  int reg;
+  int size;
+  bool high8;    // %ah, %ch, %dh or %bh
+
+  // OP_IMM or displacement of OP_MEM
+  Expr expr;
+
+  // OP_MEM
+  int seg;       // Segment override prefix, or 0
+  int base;      // -1 if none
+  int index;     // -1 if none
+  int scale;
+  bool rip;
+} Operand;
+
+// An instruction being encoded
+typedef struct {
+  char buf[32];
+  int len;
+  Fixup fix[2];
+  int nfix;
+  bool relax_got; // Use R_X86_64_[REX_]GOTPCRELX for @GOTPCREL
+  bool has_rex;
+} Insn;
+
+static Section *sections;
+static Section *last_section;
+static Section *cur_section;
+static HashMap symbols;
+static Symbol **symtab;
+static int nsyms;
+static HashMap num_labels;
+
+//
+// Sections, frags and symbols
+//
+
+static Frag *new_frag(Section *sec) {
+  Frag *f = calloc(1, sizeof(Frag));
+  if (sec->cur)
+    sec->cur = sec->cur->next = f;
+  else
+    sec->cur = sec->frags = f;
+  return f;
+}
+
+static Section *get_section(char *name, int type, long flags) {
+  for (Section *sec = sections; sec; sec = sec->next)
+    if (!strcmp(sec->name, name))
+      return sec;
+
+  Section *sec = calloc(1, sizeof(Section));
+  sec->name = strdup(name);
+  sec->type = type;
+  sec->flags = flags;
+  sec->align = 1;
+  new_frag(sec);
+
+  if (last_section)
+    last_section = last_section->next = sec;
+  else
+    last_section = sections = sec;
+  return sec;
+}
+
+static Symbol *get_symbol(char *name, int len) {
+  Symbol *sym = hashmap_get2(&symbols, name, len);
+  if (sym)
+    return sym;
+
+  sym = calloc(1, sizeof(Symbol));
+  sym->name = strndup(name, len);
+  sym->is_temp = !strncmp(sym->name, ".L", 2) || strchr(sym->name, '\x01');
+  hashmap_put2(&symbols, sym->name, len, sym);
+
+  if (nsyms % 64 == 0)
+    symtab = realloc(symtab, sizeof(Symbol *) * (nsyms + 64));
+  symtab[nsyms++] = sym;
+  return sym;
+}
+
+static void frag_reserve(Frag *f, int n) {
+  if (f->len + n <= f->cap)
+    return;
+  f->cap = MAX(f->cap * 2, MAX(f->len + n, 64));
+  f->buf = realloc(f->buf, f->cap);
+}
+
+static void out_bytes(char *p, int n) {
+  if (n == 0)
+    return;
+  Frag *f = cur_section->cur;
+  frag_reserve(f, n);
+  memcpy(f->buf + f->len, p, n);
+  f->len += n;
+}
+
+static void out_zero(long n) {
+  if (n == 0)
+    return;
+  Frag *f = cur_section->cur;
+  frag_reserve(f, n);
+  memset(f->buf + f->len, 0, n);
+  f->len += n;
+}
+
+static void add_frag_fixup(Frag *f, Fixup *fix) {
+  if (f->last_fixup)
+    f->last_fixup = f->last_fixup->next = fix;
+  else
+    f->last_fixup = f->fixups = fix;
+}
+
+static void out_fixup(int size, int type, Symbol *sym, long addend) {
+  Fixup *fix = calloc(1, sizeof(Fixup));
+  Frag *f = cur_section->cur;
+  fix->offset = f->len;
+  fix->size = size;
+  fix->type = type;
+  fix->sym = sym;
+  fix->addend = addend;
+  add_frag_fixup(f, fix);
+  sym->is_used = true;
+  out_zero(size);
+}
+
+static void out_align(int align) {
+  Frag *f = cur_section->cur;
+  f->kind = FRAG_ALIGN;
+  f->align = align;
+  cur_section->align = MAX(cur_section->align, align);
+  new_frag(cur_section);
+}
+
+static void out_jump(int jcc, Symbol *target) {
+  Frag *f = cur_section->cur;
+  f->kind = FRAG_JUMP;
+  f->jcc = jcc;
+  f->target = target;
+  target->is_used = true;
+  new_frag(cur_section);
+}
+
+static void define_label(Symbol *sym) {
+  sym->sec = cur_section;
+  sym->frag = cur_section->cur;
+  sym->offset = cur_section->cur->len;
+  if (cur_section->flags & SHF_TLS)
+    sym->is_tls = true;
+}
+
+//
+// Lexer
+//
+
+static char *skip_space(char *p) {
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+// Non-ASCII bytes may appear in UTF-8 identifiers.
+static bool is_sym1(char c) {
+  return isalpha(c) || c == '_' || c == '.' || c == '$' || (unsigned char)c >= 0x80;
+}
+
+static bool is_sym2(char c) {
+  return is_sym1(c) || isdigit(c);
+}
+
+// Numeric labels such as "1:" may be defined more than once. "1b"
+// refers to the most recent definition and "1f" to the next one.
+static Symbol *numeric_label(char *p, int len, bool define, bool forward) {
+  int n = (intptr_t)hashmap_get2(&num_labels, p, len);
+  if (define)
+    hashmap_put2(&num_labels, strndup(p, len), len, (void *)(intptr_t)++n);
+  else if (forward)
+    n++;
+
+  char *name = format("%.*s\x01%d", len, p, n);
+  return get_symbol(name, strlen(name));
+}
+
+static bool parse_number(char **rest, char *p, long *val) {
+  bool neg = false;
+  if (*p == '-') {
+    neg = true;
+    p = skip_space(p + 1);
+  }
+
+  if (!isdigit(*p))
+    return false;
+
+  errno = 0;
+  char *end;
+  unsigned long v = strtoul(p, &end, 0);
+  if (errno || is_sym2(*end))
+    return false;
+
+  *val = neg ? (long)-v : (long)v;
+  *rest = end;
+  return true;
+}
+
+static Modifier parse_modifier(char **rest, char *p) {
+  static char *names[] = {
+    [MOD_GOTPCREL] = "GOTPCREL", [MOD_PLT] = "PLT", [MOD_TPOFF] = "tpoff",
+    [MOD_TLSGD] = "tlsgd", [MOD_GOTTPOFF] = "gottpoff", [MOD_TLSLD] = "tlsld",
+    [MOD_DTPOFF] = "dtpoff",
+  };
+
+  for (int i = 1; i < sizeof(names) / sizeof(*names); i++) {
+    int len = strlen(names[i]);
+    if (!strncmp(p, names[i], len) && !is_sym2(p[len])) {
+      *rest = p + len;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// expr = number | symbol ("@" modifier)? (("+" | "-") number)*
+static bool parse_expr(char **rest, char *p, Expr *e) {
+  *e = (Expr){};
+  p = skip_space(p);
+
+  // Numeric label reference
+  if (isdigit(*p)) {
+    char *q = p;
+    while (isdigit(*q))
+      q++;
+    if ((*q == 'f' || *q == 'b') && !is_sym2(q[1])) {
+      e->sym = numeric_label(p, q - p, false, *q == 'f');
+      p = q + 1;
+    }
+  }
+
+  if (!e->sym) {
+    if (is_sym1(*p) && *p != '$') {
+      char *start = p;
+      while (is_sym2(*p))
+        p++;
+      e->sym = get_symbol(start, p - start);
+    } else if (!parse_number(&p, p, &e->val)) {
+      return false;
+    }
+  }
+
+  if (e->sym && *p == '@') {
+    int mod = parse_modifier(&p, p + 1);
+    if (mod == -1)
+      return false;
+    e->mod = mod;
+  }
+
+  for (;;) {
+    p = skip_space(p);
+    if (*p != '+' && *p != '-')
+      break;
+
+    // A difference of two symbols is handled by the caller.
+    if (*p == '-' && is_sym1(*skip_space(p + 1)))
+      break;
+
+    bool neg = (*p == '-');
+    long val;
+    if (!parse_number(&p, skip_space(p + 1), &val))
+      return false;
+    e->val += neg ? -val : val;
+  }
+
+  *rest = p;
+  return true;
+}
+
+typedef struct {
+  char *name;
+  OperandKind kind;
+  int num;
+  int size;
+} Register;
+
+static Register regs[] = {
+  {"rax", OP_REG, 0, 8}, {"rcx", OP_REG, 1, 8}, {"rdx", OP_REG, 2, 8},
+  {"rbx", OP_REG, 3, 8}, {"rsp", OP_REG, 4, 8}, {"rbp", OP_REG, 5, 8},
+  {"rsi", OP_REG, 6, 8}, {"rdi", OP_REG, 7, 8},
+  {"eax", OP_REG, 0, 4}, {"ecx", OP_REG, 1, 4}, {"edx", OP_REG, 2, 4},
+  {"ebx", OP_REG, 3, 4}, {"esp", OP_REG, 4, 4}, {"ebp", OP_REG, 5, 4},
+  {"esi", OP_REG, 6, 4}, {"edi", OP_REG, 7, 4},
+  {"ax", OP_REG, 0, 2}, {"cx", OP_REG, 1, 2}, {"dx", OP_REG, 2, 2},
+  {"bx", OP_REG, 3, 2}, {"sp", OP_REG, 4, 2}, {"bp", OP_REG, 5, 2},
+  {"si", OP_REG, 6, 2}, {"di", OP_REG, 7, 2},
+  {"al", OP_REG, 0, 1}, {"cl", OP_REG, 1, 1}, {"dl", OP_REG, 2, 1},
+  {"bl", OP_REG, 3, 1}, {"spl", OP_REG, 4, 1}, {"bpl", OP_REG, 5, 1},
+  {"sil", OP_REG, 6, 1}, {"dil", OP_REG, 7, 1},
+};
+
+static bool parse_register(char **rest, char *p, Operand *op) {
+  char *start = p;
+  while (isalnum(*p))
+    p++;
+  int len = p - start;
+  char *name = strndup(start, len);
+  *rest = p;
+
+  *op = (Operand){.base = -1, .index = -1};
+
+  for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++) {
+    if (!strcmp(name, regs[i].name)) {
+      op->kind = OP_REG;
+      op->reg = regs[i].num;
+      op->size = regs[i].size;
+      return true;
+    }
+  }
+
+  // %ah, %ch, %dh and %bh
+  static char *high8[] = {"ah", "ch", "dh", "bh"};
+  for (int i = 0; i < 4; i++) {
+    if (!strcmp(name, high8[i])) {
+      op->kind = OP_REG;
+      op->reg = i + 4;
+      op->size = 1;
+      op->high8 = true;
+      return true;
+    }
+  }
+
+  // %r8-%r15 with optional "d", "w" or "b" suffix
+  if (name[0] == 'r' && isdigit(name[1])) {
+    char *end;
+    int n = strtol(name + 1, &end, 10);
+    int size = 0;
+    if (!strcmp(end, ""))
+      size = 8;
+    else if (!strcmp(end, "d"))
+      size = 4;
+    else if (!strcmp(end, "w"))
+      size = 2;
+    else if (!strcmp(end, "b") || !strcmp(end, "l"))
+      size = 1;
+    if (8 <= n && n <= 15 && size) {
+      op->kind = OP_REG;
+      op->reg = n;
+      op->size = size;
+      return true;
+    }
+    return false;
+  }
+
+  if (!strncmp(name, "xmm", 3) && isdigit(name[3])) {
+    char *end;
+    int n = strtol(name + 3, &end, 10);
+    if (*end || n > 15)
+      return false;
+    op->kind = OP_XMM;
+    op->reg = n;
+    return true;
+  }
+
+  if (!strcmp(name, "st")) {
+    op->kind = OP_ST;
+    op->reg = 0;
+    p = skip_space(p);
+    if (*p == '(') {
+      p = skip_space(p + 1);
+      if (*p < '0' || '7' < *p)
+        return false;
+      op->reg = *p - '0';
+      p = skip_space(p + 1);
+      if (*p != ')')
+        return false;
+      p++;
+    }
+    *rest = p;
+    return true;
+  }
+
+  if (!strcmp(name, "rip")) {
+    op->kind = OP_MEM;
+    op->rip = true;
+    return true;
+  }
+
+  return false;
+}
+
+// Parses the "(base, index, scale)" part of a memory operand.
+static bool parse_mem(char **rest, char *p, Operand *op) {
+  op->kind = OP_MEM;
+  p = skip_space(p);
+
+  if (*p == '%') {
+    Operand base;
+    if (!parse_register(&p, p + 1, &base))
+      return false;
+    if (base.kind == OP_MEM && base.rip) {
+      op->rip = true;
+    } else {
+      if (base.kind != OP_REG || base.size != 8)
+        return false;
+      op->base = base.reg;
+    }
+    p = skip_space(p);
+  }
+
+  if (*p == ',') {
+    p = skip_space(p + 1);
+    Operand index;
+    if (*p != '%' || !parse_register(&p, p + 1, &index))
+      return false;
+    if (index.kind != OP_REG || index.size != 8 || index.reg == 4 || op->rip)
+      return false;
+    op->index = index.reg;
+    op->scale = 1;
+    p = skip_space(p);
+
+    if (*p == ',') {
+      long scale;
+      if (!parse_number(&p, skip_space(p + 1), &scale))
+        return false;
+      if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+        return false;
+      op->scale = scale;
+      p = skip_space(p);
+    }
+  }
+
+  if (*p != ')')
+    return false;
+  *rest = p + 1;
+  return true;
+}
+
+static bool parse_operand(char *p, Operand *op) {
+  *op = (Operand){.base = -1, .index = -1};
+  p = skip_space(p);
+
+  bool indirect = false;
+  if (*p == '*') {
+    indirect = true;
+    p = skip_space(p + 1);
+  }
+
+  if (*p == '$') {
+    op->kind = OP_IMM;
+    if (!parse_expr(&p, p + 1, &op->expr))
+      return false;
+    return *skip_space(p) == '\0';
+  }
+
+  int seg = 0;
+  if (*p == '%') {
+    char *q = p + 1;
+    if ((!strncmp(q, "fs", 2) || !strncmp(q, "gs", 2)) && skip_space(q + 2)[0] == ':') {
+      seg = (q[0] == 'f') ? 0x64 : 0x65;
+      p = skip_space(skip_space(q + 2) + 1);
+    } else {
+      if (!parse_register(&p, q, op) || (op->kind == OP_MEM))
+        return false;
+      op->indirect = indirect;
+      return *skip_space(p) == '\0';
+    }
+  }
+
+  // Memory operand: disp(base, index, scale)
+  op->kind = OP_MEM;
+  op->seg = seg;
+  op->indirect = indirect;
+  if (*p != '(' && !parse_expr(&p, p, &op->expr))
+    return false;
+  p = skip_space(p);
+  if (*p == '(' && !parse_mem(&p, p + 1, op))
+    return false;
+  return *skip_space(p) == '\0';
+}
+
+// Splits a string at commas which are not inside parentheses or
+// double quotes. The input string is modified.
+static int split_operands(char *p, char **ops, int max) {
+  p = skip_space(p);
+  if (*p == '\0')
+    return 0;
+
+  int n = 0;
+  int depth = 0;
+  bool in_str = false;
+  ops[n++] = p;
+
+  for (; *p; p++) {
+    if (in_str) {
+      if (*p == '\\' && p[1])
+        p++;
+      else if (*p == '"')
+        in_str = false;
+      continue;
+    }
+
+    if (*p == '"')
+      in_str = true;
+    else if (*p == '(')
+      depth++;
+    else if (*p == ')')
+      depth--;
+    else if (*p == ',' && depth == 0) {
+      if (n == max)
+        return -1;
+      *p = '\0';
+      ops[n++] = p + 1;
+    }
+  }
+
+  // Trim trailing whitespace
+  for (int i = 0; i < n; i++) {
+    char *s = ops[i] = skip_space(ops[i]);
+    int len = strlen(s);
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t'))
+      s[--len] = '\0';
+  }
+  return n;
+}
+
+//
+// Instruction encoder
+//
+
+static void emit1(Insn *in, int c) {
+  in->buf[in->len++] = c;
+}
+
+static void emit_val(Insn *in, uint64_t val, int size) {
+  for (int i = 0; i < size; i++)
+    emit1(in, val >> (i * 8));
+}
+
+static void emit_opcode(Insn *in, int op) {
+  if (op > 0xffff)
+    emit1(in, op >> 16);
+  if (op > 0xff)
+    emit1(in, op >> 8);
+  emit1(in, op);
+}
+
+static void add_fixup(Insn *in, int size, int type, Expr *e) {
+  Fixup *fix = &in->fix[in->nfix++];
+  fix->offset = in->len;
+  fix->size = size;
+  fix->type = type;
+  fix->sym = e->sym;
+  fix->addend = e->val;
+  emit_val(in, 0, size);
+}
+
+static bool is_pcrel(int type) {
+  return type == R_X86_64_PC32 || type == R_X86_64_PLT32 ||
+         type == R_X86_64_GOTPCREL || type == R_X86_64_GOTPCRELX ||
+         type == R_X86_64_REX_GOTPCRELX || type == R_X86_64_TLSGD ||
+         type == R_X86_64_GOTTPOFF || type == R_X86_64_TLSLD;
+}
+
+static bool is_int8(long val) {
+  return val == (int8_t)val;
+}
+
+static bool is_int32(long val) {
+  return val == (int32_t)val;
+}
+
+// Emits an immediate value of a given size.
+static bool emit_imm(Insn *in, Expr *e, int size, bool is64) {
+  if (!e->sym) {
+    if (size == 4 && is64 && !is_int32(e->val))
+      return false;
+    emit_val(in, e->val, size);
+    return true;
+  }
+
+  if (size == 4 && e->mod == MOD_TPOFF) {
+    add_fixup(in, 4, R_X86_64_TPOFF32, e);
+    return true;
+  }
+  if (size == 4 && e->mod == MOD_DTPOFF) {
+    add_fixup(in, 4, R_X86_64_DTPOFF32, e);
+    return true;
+  }
+  if (e->mod != MOD_NONE)
+    return false;
+
+  if (size == 8)
+    add_fixup(in, 8, R_X86_64_64, e);
+  else if (size == 4)
+    add_fixup(in, 4, is64 ? R_X86_64_32S : R_X86_64_32, e);
+  else
+    return false;
+  return true;
+}
+
+// Returns true if a given operand is %spl, %bpl, %sil or %dil, which
+// are accessible only with a REX prefix.
+static bool needs_rex(Operand *op) {
+  return op && op->kind == OP_REG && op->size == 1 && !op->high8 &&
+         4 <= op->reg && op->reg <= 7;
+}
+
+static bool is_high8(Operand *op) {
+  return op && op->kind == OP_REG && op->high8;
+}
+
+static bool emit_prefixes(Insn *in, int pfx, bool w, int rex, Operand *r, Operand *rm) {
+  if (rm && rm->kind == OP_MEM && rm->seg)
+    emit1(in, rm->seg);
+  if (pfx)
+    emit1(in, pfx);
+
+  if (w)
+    rex |= 8;
+  if (rex || needs_rex(r) || needs_rex(rm)) {
+    if (is_high8(r) || is_high8(rm))
+      return false;
+    emit1(in, 0x40 | rex);
+    in->has_rex = true;
+  }
+  return true;
+}
+
+// Encodes an instruction with a ModR/M byte. `reg` is a register
+// operand or NULL, in which case `ext` is used as the opcode
+// extension in the reg field.
+static bool encode(Insn *in, int pfx, bool w, int op, Operand *reg, int ext, Operand *rm) {
+  int r = reg ? reg->reg : ext;
+  int rex = 0;
+  if (r & 8)
+    rex |= 4;
+
+  if (rm->kind == OP_MEM) {
+    if (rm->index >= 0 && (rm->index & 8))
+      rex |= 2;
+    if (rm->base >= 0 && (rm->base & 8))
+      rex |= 1;
+  } else if (rm->reg & 8) {
+    rex |= 1;
+  }
+
+  if (!emit_prefixes(in, pfx, w, rex, reg, rm))
+    return false;
+  emit_opcode(in, op);
+
+  r &= 7;
+
+  if (rm->kind != OP_MEM) {
+    emit1(in, 0xc0 | (r << 3) | (rm->reg & 7));
+    return true;
+  }
+
+  Expr *disp = &rm->expr;
+
+  // RIP-relative
+  if (rm->rip) {
+    emit1(in, (r << 3) | 5);
+    if (!disp->sym) {
+      emit_val(in, disp->val, 4);
+      return true;
+    }
+
+    switch (disp->mod) {
+    case MOD_NONE:
+      add_fixup(in, 4, R_X86_64_PC32, disp);
+      return true;
+    case MOD_GOTPCREL:
+      if (in->relax_got)
+        add_fixup(in, 4, in->has_rex ? R_X86_64_REX_GOTPCRELX : R_X86_64_GOTPCRELX, disp);
+      else
+        add_fixup(in, 4, R_X86_64_GOTPCREL, disp);
+      return true;
+    case MOD_TLSGD:
+      add_fixup(in, 4, R_X86_64_TLSGD, disp);
+      return true;
+    case MOD_GOTTPOFF:
+      add_fixup(in, 4, R_X86_64_GOTTPOFF, disp);
+      return true;
+    case MOD_TLSLD:
+      add_fixup(in, 4, R_X86_64_TLSLD, disp);
+      return true;
+    }
+    return false;
+  }
+
+  int type = R_X86_64_32S;
+  if (disp->mod == MOD_TPOFF)
+    type = R_X86_64_TPOFF32;
+  else if (disp->mod == MOD_DTPOFF)
+    type = R_X86_64_DTPOFF32;
+  else if (disp->mod != MOD_NONE)
+    return false;
+
+  int scale = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : (rm->scale == 2) ? 1 : 0;
+
+  // Absolute address or index without base
+  if (rm->base < 0) {
+    emit1(in, (r << 3) | 4);
+    if (rm->index < 0)
+      emit1(in, 0x25);
+    else
+      emit1(in, (scale << 6) | ((rm->index & 7) << 3) | 5);
+
+    if (disp->sym)
+      add_fixup(in, 4, type, disp);
+    else
+      emit_val(in, disp->val, 4);
+    return true;
+  }
+
+  int mod;
+  if (disp->sym)
+    mod = 2;
+  else if (disp->val == 0 && (rm->base & 7) != 5)
+    mod = 0;
+  else if (is_int8(disp->val))
+    mod = 1;
+  else if (is_int32(disp->val))
+    mod = 2;
+  else
+    return false;
+
+  if (rm->index < 0 && (rm->base & 7) != 4) {
+    emit1(in, (mod << 6) | (r << 3) | (rm->base & 7));
+  } else {
+    emit1(in, (mod << 6) | (r << 3) | 4);
+    int index = (rm->index < 0) ? 4 : (rm->index & 7);
+    emit1(in, (scale << 6) | (index << 3) | (rm->base & 7));
+  }
+
+  if (mod == 1)
+    emit_val(in, disp->val, 1);
+  else if (mod == 2 && disp->sym)
+    add_fixup(in, 4, type, disp);
+  else if (mod == 2)
+    emit_val(in, disp->val, 4);
+  return true;
+}
+
+// Encodes an instruction whose register operand is encoded in the
+// low 3 bits of the opcode, such as push, pop or mov $imm, %reg.
+static bool encode_short(Insn *in, int pfx, bool w, int op, Operand *reg) {
+  if (!emit_prefixes(in, pfx, w, (reg->reg & 8) ? 1 : 0, reg, NULL))
+    return false;
+  emit_opcode(in, op + (reg->reg & 7));
+  return true;
+}
+
+static int suffix_size(char c) {
+  switch (c) {
+  case 'b': return 1;
+  case 'w': return 2;
+  case 'l': return 4;
+  case 'q': return 8;
+  }
+  return 0;
+}
+
+// Returns true if `mnem` is `base` optionally followed by an operand
+// size suffix.
+static bool match(char *mnem, char *base, int *size) {
+  int len = strlen(base);
+  if (strncmp(mnem, base, len))
+    return false;
+  if (mnem[len] == '\0')
+    return true;
+  if (mnem[len + 1] != '\0' || !suffix_size(mnem[len]))
+    return false;
+  *size = suffix_size(mnem[len]);
+  return true;
+}
+
+static bool is_reg(Operand *op) {
+  return op->kind == OP_REG;
+}
+
+static bool is_mem(Operand *op) {
+  return op->kind == OP_MEM && !op->indirect;
+}
+
+static bool is_rm(Operand *op) {
+  return is_reg(op) || is_mem(op);
+}
+
+// Returns the operand size of an instruction. Unless given by a
+// suffix, the size is inferred from register operands.
+static int operand_size(int size, Operand *ops, int nops) {
+  if (size)
+    return size;
+  for (int i = nops - 1; i >= 0; i--)
+    if (ops[i].kind == OP_REG)
+      return ops[i].size;
+  return 0;
+}
+
+static char *cond_codes[] = {
+  "o", "no", "b", "ae", "e", "ne", "be", "a",
+  "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+// Returns the condition code of a given suffix, e.g. 4 for "e", or -1.
+static int cond_code(char *s) {
+  static struct { char *name; int cc; } aliases[] = {
+    {"c", 2}, {"nae", 2}, {"nb", 3}, {"nc", 3}, {"z", 4}, {"nz", 5},
+    {"na", 6}, {"nbe", 7}, {"pe", 10}, {"po", 11}, {"nge", 12},
+    {"nl", 13}, {"ng", 14}, {"nle", 15},
+  };
+
+  for (int i = 0; i < 16; i++)
+    if (!strcmp(s, cond_codes[i]))
+      return i;
+  for (int i = 0; i < sizeof(aliases) / sizeof(*aliases); i++)
+    if (!strcmp(s, aliases[i].name))
+      return aliases[i].cc;
+  return -1;
+}
+
+static bool asm_alu(Insn *in, int n, int size, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+  size = operand_size(size, ops, nops);
+  if (!size)
+    return false;
+
+  int pfx = (size == 2) ? 0x66 : 0;
+  bool w = (size == 8);
+
+  if (src->kind == OP_IMM && is_rm(dst)) {
+    Expr *imm = &src->expr;
+    if (!imm->sym && size == 4)
+      imm->val = (int32_t)imm->val;
+    if (!imm->sym && size == 2)
+      imm->val = (int16_t)imm->val;
+
+    if (size == 1) {
+      if (is_reg(dst) && dst->reg == 0) {
+        emit_opcode(in, (n << 3) | 4);
+      } else if (!encode(in, 0, false, 0x80, NULL, n, dst)) {
+        return false;
+      }
+      return emit_imm(in, imm, 1, false);
+    }
+
+    if (!imm->sym && is_int8(imm->val)) {
+      if (!encode(in, pfx, w, 0x83, NULL, n, dst))
+        return false;
+      return emit_imm(in, imm, 1, false);
+    }
+
+    if (is_reg(dst) && dst->reg == 0) {
+      if (!emit_prefixes(in, pfx, w, 0, NULL, NULL))
+        return false;
+      emit_opcode(in, (n << 3) | 5);
+    } else if (!encode(in, pfx, w, 0x81, NULL, n, dst)) {
+      return false;
+    }
+    return emit_imm(in, imm, MIN(size, 4), w);
+  }
+
+  int op = (n << 3) | (size == 1 ? 0 : 1);
+  if (is_reg(src) && is_rm(dst))
+    return encode(in, pfx, w, op, src, 0, dst);
+  if (is_mem(src) && is_reg(dst))
+    return encode(in, pfx, w, op + 2, dst, 0, src);
+  return false;
+}
+
+static bool asm_test(Insn *in, int size, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+  size = operand_size(size, ops, nops);
+  if (!size)
+    return false;
+
+  int pfx = (size == 2) ? 0x66 : 0;
+  bool w = (size == 8);
+
+  if (src->kind == OP_IMM && is_rm(dst)) {
+    if (is_reg(dst) && dst->reg == 0) {
+      if (!emit_prefixes(in, pfx, w, 0, NULL, NULL))
+        return false;
+      emit_opcode(in, size == 1 ? 0xa8 : 0xa9);
+    } else if (!encode(in, pfx, w, size == 1 ? 0xf6 : 0xf7, NULL, 0, dst)) {
+      return false;
+    }
+    return emit_imm(in, &src->expr, MIN(size, 4), w);
+  }
+
+  if (is_reg(src) && is_rm(dst))
+    return encode(in, pfx, w, size == 1 ? 0x84 : 0x85, src, 0, dst);
+  if (is_mem(src) && is_reg(dst))
+    return encode(in, pfx, w, size == 1 ? 0x84 : 0x85, dst, 0, src);
+  return false;
+}
+
+static bool asm_mov(Insn *in, int size, bool movabs, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+  size = operand_size(size, ops, nops);
+  if (!size)
+    return false;
+
+  int pfx = (size == 2) ? 0x66 : 0;
+  bool w = (size == 8);
+
+  if (src->kind == OP_IMM) {
+    Expr *imm = &src->expr;
+
+    if (is_reg(dst)) {
+      if (size == 8 && !movabs && (imm->sym || is_int32(imm->val))) {
+        if (!encode(in, 0, true, 0xc7, NULL, 0, dst))
+          return false;
+        return emit_imm(in, imm, 4, true);
+      }
+      if (!encode_short(in, pfx, w, size == 1 ? 0xb0 : 0xb8, dst))
+        return false;
+      return emit_imm(in, imm, size, false);
+    }
+
+    if (is_mem(dst) && !movabs) {
+      if (!encode(in, pfx, w, size == 1 ? 0xc6 : 0xc7, NULL, 0, dst))
+        return false;
+      return emit_imm(in, imm, MIN(size, 4), w);
+    }
+    return false;
+  }
+
+  if (is_reg(src) && is_rm(dst))
+    return encode(in, pfx, w, size == 1 ? 0x88 : 0x89, src, 0, dst);
+
+  if (is_mem(src) && is_reg(dst)) {
+    in->relax_got = true;
+    return encode(in, pfx, w, size == 1 ? 0x8a : 0x8b, dst, 0, src);
+  }
+  return false;
+}
+
+// movsbl, movzwq, movsx, movzx, movsxd, movslq, etc.
+static bool asm_movx(Insn *in, char *mnem, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+  if (!is_rm(src) || !is_reg(dst))
+    return false;
+
+  bool sign = (mnem[3] == 's');
+  char *s = mnem + 4;
+  int from = 0;
+  int to = 0;
+
+  if (!strcmp(s, "xd")) {
+    from = 4;
+  } else if (!strcmp(s, "x")) {
+    // from is inferred from the source register.
+  } else if (s[0] && (!s[1] || !s[2])) {
+    from = suffix_size(s[0]);
+    if (!from)
+      return false;
+    if (s[1]) {
+      to = suffix_size(s[1]);
+      if (!to)
+        return false;
+    }
+  } else {
+    return false;
+  }
+
+  if (!from) {
+    if (!is_reg(src))
+      return false;
+    from = src->size;
+  }
+  if (!to)
+    to = dst->size;
+  if (to != dst->size || (is_reg(src) && src->size != from) || from >= to)
+    return false;
+
+  if (from == 4) {
+    if (!sign)
+      return false;
+    return encode(in, 0, true, 0x63, dst, 0, src);
+  }
+
+  int op = 0x0f00 | (sign ? 0xbe : 0xb6) | (from == 2);
+  return encode(in, to == 2 ? 0x66 : 0, to == 8, op, dst, 0, src);
+}
+
+static bool asm_shift(Insn *in, int n, int size, Operand *ops, int nops) {
+  Operand *dst = &ops[nops - 1];
+  if (nops < 1 || nops > 2 || !is_rm(dst))
+    return false;
+
+  size = operand_size(size, dst, 1);
+  if (!size)
+    return false;
+
+  int pfx = (size == 2) ? 0x66 : 0;
+  bool w = (size == 8);
+  bool byte = (size == 1);
+
+  if (nops == 1)
+    return encode(in, pfx, w, byte ? 0xd0 : 0xd1, NULL, n, dst);
+
+  Operand *src = &ops[0];
+  if (src->kind == OP_REG && src->reg == 1 && src->size == 1)
+    return encode(in, pfx, w, byte ? 0xd2 : 0xd3, NULL, n, dst);
+
+  if (src->kind != OP_IMM || src->expr.sym)
+    return false;
+  if (src->expr.val == 1)
+    return encode(in, pfx, w, byte ? 0xd0 : 0xd1, NULL, n, dst);
+  if (!encode(in, pfx, w, byte ? 0xc0 : 0xc1, NULL, n, dst))
+    return false;
+  return emit_imm(in, &src->expr, 1, false);
+}
+
+// Instructions of the F6/F7 and FE/FF groups which take one operand.
+static bool asm_unary(Insn *in, int op, int n, int size, Operand *ops, int nops) {
+  if (nops != 1 || !is_rm(&ops[0]))
+    return false;
+  size = operand_size(size, ops, nops);
+  if (!size)
+    return false;
+
+  if (size == 1)
+    op--;
+  return encode(in, size == 2 ? 0x66 : 0, size == 8, op, NULL, n, &ops[0]);
+}
+
+static bool asm_push_pop(Insn *in, bool push, int size, Operand *ops, int nops) {
+  if (nops != 1)
+    return false;
+
+  Operand *op = &ops[0];
+  if (is_reg(op)) {
+    if (op->size != 8 && op->size != 2)
+      return false;
+    return encode_short(in, op->size == 2 ? 0x66 : 0, false, push ? 0x50 : 0x58, op);
+  }
+
+  if (is_mem(op)) {
+    if (size != 0 && size != 8)
+      return false;
+    return encode(in, 0, false, push ? 0xff : 0x8f, NULL, push ? 6 : 0, op);
+  }
+
+  if (push && op->kind == OP_IMM) {
+    if (!op->expr.sym && is_int8(op->expr.val)) {
+      emit1(in, 0x6a);
+      return emit_imm(in, &op->expr, 1, false);
+    }
+    emit1(in, 0x68);
+    return emit_imm(in, &op->expr, 4, true);
+  }
+  return false;
+}
+
+static bool asm_imul(Insn *in, int size, Operand *ops, int nops) {
+  if (nops == 1)
+    return asm_unary(in, 0xf7, 5, size, ops, nops);
+
+  Operand *dst = &ops[nops - 1];
+  size = operand_size(size, ops, nops);
+  if (!is_reg(dst) || size < 2)
+    return false;
+
+  int pfx = (size == 2) ? 0x66 : 0;
+  bool w = (size == 8);
+
+  if (nops == 2 && is_rm(&ops[0]))
+    return encode(in, pfx, w, 0x0faf, dst, 0, &ops[0]);
+
+  // `imul $imm, %reg` is shorthand for `imul $imm, %reg, %reg`.
+  if ((nops == 3 && ops[0].kind == OP_IMM && is_rm(&ops[1])) ||
+      (nops == 2 && ops[0].kind == OP_IMM)) {
+    Expr *imm = &ops[0].expr;
+    Operand *src = (nops == 3) ? &ops[1] : dst;
+    if (!imm->sym && is_int8(imm->val)) {
+      if (!encode(in, pfx, w, 0x6b, dst, 0, src))
+        return false;
+      return emit_imm(in, imm, 1, false);
+    }
+    if (!encode(in, pfx, w, 0x69, dst, 0, src))
+      return false;
+    return emit_imm(in, imm, MIN(size, 4), w);
+  }
+  return false;
+}
+
+static bool asm_xchg(Insn *in, int opcode, int size, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+  size = operand_size(size, ops, nops);
+  if (!size)
+    return false;
+
+  int pfx = (size == 2) ? 0x66 : 0;
+  bool w = (size == 8);
+
+  // xchg with %rax has a short form.
+  if (opcode == 0x87 && size != 1 && is_reg(src) && is_reg(dst)) {
+    if (src->reg == 0)
+      return encode_short(in, pfx, w, 0x90, dst);
+    if (dst->reg == 0)
+      return encode_short(in, pfx, w, 0x90, src);
+  }
+
+  if (size == 1)
+    opcode--;
+  if (is_reg(src) && is_rm(dst))
+    return encode(in, pfx, w, opcode, src, 0, dst);
+  if (opcode <= 0x87 && is_mem(src) && is_reg(dst))
+    return encode(in, pfx, w, opcode, dst, 0, src);
+  return false;
+}
+
+// x87 instructions with a memory operand
+static struct {
+  char *name;
+  int op;
+  int ext;
+} x87_mem[] = {
+  {"flds", 0xd9, 0}, {"fldl", 0xdd, 0}, {"fldt", 0xdb, 5},
+  {"filds", 0xdf, 0}, {"fildl", 0xdb, 0}, {"fildll", 0xdf, 5}, {"fildq", 0xdf, 5},
+  {"fsts", 0xd9, 2}, {"fstl", 0xdd, 2},
+  {"fstps", 0xd9, 3}, {"fstpl", 0xdd, 3}, {"fstpt", 0xdb, 7},
+  {"fists", 0xdf, 2}, {"fistl", 0xdb, 2},
+  {"fistps", 0xdf, 3}, {"fistpl", 0xdb, 3}, {"fistpll", 0xdf, 7}, {"fistpq", 0xdf, 7},
+  {"fisttps", 0xdf, 1}, {"fisttpl", 0xdb, 1}, {"fisttpll", 0xdd, 1}, {"fisttpq", 0xdd, 1},
+  {"fadds", 0xd8, 0}, {"faddl", 0xdc, 0}, {"fmuls", 0xd8, 1}, {"fmull", 0xdc, 1},
+  {"fsubs", 0xd8, 4}, {"fsubl", 0xdc, 4}, {"fsubrs", 0xd8, 5}, {"fsubrl", 0xdc, 5},
+  {"fdivs", 0xd8, 6}, {"fdivl", 0xdc, 6}, {"fdivrs", 0xd8, 7}, {"fdivrl", 0xdc, 7},
+  {"fnstcw", 0xd9, 7}, {"fldcw", 0xd9, 5}, {"fnstsw", 0xdd, 7},
+};
+
+// x87 instructions without explicit operands
+static struct {
+  char *name;
+  int op;
+} x87_noarg[] = {
+  {"fldz", 0xd9ee}, {"fld1", 0xd9e8}, {"fchs", 0xd9e0}, {"fabs", 0xd9e1},
+  {"fsqrt", 0xd9fa}, {"fxch", 0xd9c9}, {"fwait", 0x9b}, {"fninit", 0xdbe3},
+  {"faddp", 0xdec1}, {"fmulp", 0xdec9}, {"fsubp", 0xdee1}, {"fsubrp", 0xdee9},
+  {"fdivp", 0xdef1}, {"fdivrp", 0xdef9}, {"fucomip", 0xdfe9}, {"fcomip", 0xdff1},
+  {"fucomi", 0xdbe9}, {"fcomi", 0xdbf1}, {"fucompp", 0xdae9}, {"fstp", 0xddd9},
+};
+
+// x87 instructions with a %st(i) operand
+static struct {
+  char *name;
+  int op;
+} x87_reg[] = {
+  {"fld", 0xd9c0}, {"fstp", 0xddd8}, {"fst", 0xddd0}, {"fxch", 0xd9c8},
+  {"fucomip", 0xdfe8}, {"fcomip", 0xdff0}, {"fucomi", 0xdbe8}, {"fcomi", 0xdbf0},
+  {"faddp", 0xdec0}, {"fmulp", 0xdec8},
+};
+
+static bool asm_x87(Insn *in, char *mnem, Operand *ops, int nops) {
+  if (nops == 1 && is_mem(&ops[0])) {
+    for (int i = 0; i < sizeof(x87_mem) / sizeof(*x87_mem); i++)
+      if (!strcmp(mnem, x87_mem[i].name))
+        return encode(in, 0, false, x87_mem[i].op, NULL, x87_mem[i].ext, &ops[0]);
+    return false;
+  }
+
+  if (nops == 0) {
+    for (int i = 0; i < sizeof(x87_noarg) / sizeof(*x87_noarg); i++) {
+      if (!strcmp(mnem, x87_noarg[i].name)) {
+        emit_opcode(in, x87_noarg[i].op);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // "fstp %st(1)" or "fucomip %st(1), %st"
+  if (ops[0].kind != OP_ST || (nops == 2 && (ops[1].kind != OP_ST || ops[1].reg != 0)) || nops > 2)
+    return false;
+
+  for (int i = 0; i < sizeof(x87_reg) / sizeof(*x87_reg); i++) {
+    if (!strcmp(mnem, x87_reg[i].name)) {
+      emit_opcode(in, x87_reg[i].op + ops[0].reg);
+      return true;
+    }
+  }
+  return false;
+}
+
+typedef enum {
+  SSE_RM,    // xmm <- xmm/mem
+  SSE_MOV,   // xmm <- xmm/mem, or mem <- xmm
+  SSE_I2F,   // xmm <- gp/mem (cvtsi2ss)
+  SSE_F2I,   // gp <- xmm/mem (cvttss2si)
+} SSEKind;
+
+static struct {
+  char *name;
+  int pfx;
+  int op;
+  SSEKind kind;
+  int store_op;
+} sse_insns[] = {
+  {"movss", 0xf3, 0x0f10, SSE_MOV, 0x0f11},
+  {"movsd", 0xf2, 0x0f10, SSE_MOV, 0x0f11},
+  {"movups", 0, 0x0f10, SSE_MOV, 0x0f11},
+  {"movupd", 0x66, 0x0f10, SSE_MOV, 0x0f11},
+  {"movaps", 0, 0x0f28, SSE_MOV, 0x0f29},
+  {"movapd", 0x66, 0x0f28, SSE_MOV, 0x0f29},
+  {"movdqu", 0xf3, 0x0f6f, SSE_MOV, 0x0f7f},
+  {"movdqa", 0x66, 0x0f6f, SSE_MOV, 0x0f7f},
+  {"addss", 0xf3, 0x0f58, SSE_RM}, {"addsd", 0xf2, 0x0f58, SSE_RM},
+  {"addps", 0, 0x0f58, SSE_RM}, {"addpd", 0x66, 0x0f58, SSE_RM},
+  {"subss", 0xf3, 0x0f5c, SSE_RM}, {"subsd", 0xf2, 0x0f5c, SSE_RM},
+  {"subps", 0, 0x0f5c, SSE_RM}, {"subpd", 0x66, 0x0f5c, SSE_RM},
+  {"mulss", 0xf3, 0x0f59, SSE_RM}, {"mulsd", 0xf2, 0x0f59, SSE_RM},
+  {"mulps", 0, 0x0f59, SSE_RM}, {"mulpd", 0x66, 0x0f59, SSE_RM},
+  {"divss", 0xf3, 0x0f5e, SSE_RM}, {"divsd", 0xf2, 0x0f5e, SSE_RM},
+  {"divps", 0, 0x0f5e, SSE_RM}, {"divpd", 0x66, 0x0f5e, SSE_RM},
+  {"sqrtss", 0xf3, 0x0f51, SSE_RM}, {"sqrtsd", 0xf2, 0x0f51, SSE_RM},
+  {"minss", 0xf3, 0x0f5d, SSE_RM}, {"minsd", 0xf2, 0x0f5d, SSE_RM},
+  {"maxss", 0xf3, 0x0f5f, SSE_RM}, {"maxsd", 0xf2, 0x0f5f, SSE_RM},
+  {"ucomiss", 0, 0x0f2e, SSE_RM}, {"ucomisd", 0x66, 0x0f2e, SSE_RM},
+  {"comiss", 0, 0x0f2f, SSE_RM}, {"comisd", 0x66, 0x0f2f, SSE_RM},
+  {"andps", 0, 0x0f54, SSE_RM}, {"andpd", 0x66, 0x0f54, SSE_RM},
+  {"andnps", 0, 0x0f55, SSE_RM}, {"andnpd", 0x66, 0x0f55, SSE_RM},
+  {"orps", 0, 0x0f56, SSE_RM}, {"orpd", 0x66, 0x0f56, SSE_RM},
+  {"xorps", 0, 0x0f57, SSE_RM}, {"xorpd", 0x66, 0x0f57, SSE_RM},
+  {"unpcklps", 0, 0x0f14, SSE_RM}, {"unpcklpd", 0x66, 0x0f14, SSE_RM},
+  {"pxor", 0x66, 0x0fef, SSE_RM}, {"por", 0x66, 0x0feb, SSE_RM},
+  {"pand", 0x66, 0x0fdb, SSE_RM},
+  {"paddb", 0x66, 0x0ffc, SSE_RM}, {"paddw", 0x66, 0x0ffd, SSE_RM},
+  {"paddd", 0x66, 0x0ffe, SSE_RM}, {"paddq", 0x66, 0x0fd4, SSE_RM},
+  {"psubb", 0x66, 0x0ff8, SSE_RM}, {"psubw", 0x66, 0x0ff9, SSE_RM},
+  {"psubd", 0x66, 0x0ffa, SSE_RM}, {"psubq", 0x66, 0x0ffb, SSE_RM},
+  {"pmullw", 0x66, 0x0fd5, SSE_RM}, {"pmulld", 0x66, 0x0f3840, SSE_RM},
+  {"psllw", 0x66, 0x0ff1, SSE_RM}, {"pslld", 0x66, 0x0ff2, SSE_RM},
+  {"psllq", 0x66, 0x0ff3, SSE_RM}, {"psrlw", 0x66, 0x0fd1, SSE_RM},
+  {"psrld", 0x66, 0x0fd2, SSE_RM}, {"psrlq", 0x66, 0x0fd3, SSE_RM},
+  {"psraw", 0x66, 0x0fe1, SSE_RM}, {"psrad", 0x66, 0x0fe2, SSE_RM},
+  {"pcmpeqb", 0x66, 0x0f74, SSE_RM}, {"pcmpeqw", 0x66, 0x0f75, SSE_RM},
+  {"pcmpeqd", 0x66, 0x0f76, SSE_RM}, {"pcmpeqq", 0x66, 0x0f3829, SSE_RM},
+  {"punpcklqdq", 0x66, 0x0f6c, SSE_RM},
+  {"cvtss2sd", 0xf3, 0x0f5a, SSE_RM}, {"cvtsd2ss", 0xf2, 0x0f5a, SSE_RM},
+  {"cvtsi2ss", 0xf3, 0x0f2a, SSE_I2F}, {"cvtsi2sd", 0xf2, 0x0f2a, SSE_I2F},
+  {"cvttss2si", 0xf3, 0x0f2c, SSE_F2I}, {"cvttsd2si", 0xf2, 0x0f2c, SSE_F2I},
+  {"cvtss2si", 0xf3, 0x0f2d, SSE_F2I}, {"cvtsd2si", 0xf2, 0x0f2d, SSE_F2I},
+};
+
+static bool is_xmm(Operand *op) {
+  return op->kind == OP_XMM;
+}
+
+static bool asm_sse(Insn *in, int i, int size, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+  int pfx = sse_insns[i].pfx;
+  int op = sse_insns[i].op;
+
+  switch (sse_insns[i].kind) {
+  case SSE_MOV:
+    if (is_mem(src) && is_xmm(dst))
+      return encode(in, pfx, false, op, dst, 0, src);
+    if (is_xmm(src) && is_mem(dst))
+      return encode(in, pfx, false, sse_insns[i].store_op, src, 0, dst);
+    // fallthrough
+  case SSE_RM:
+    if ((is_xmm(src) || is_mem(src)) && is_xmm(dst))
+      return encode(in, pfx, false, op, dst, 0, src);
+    return false;
+  case SSE_I2F:
+    if (!is_rm(src) || !is_xmm(dst))
+      return false;
+    size = operand_size(size, ops, nops);
+    if (size != 4 && size != 8)
+      return false;
+    return encode(in, pfx, size == 8, op, dst, 0, src);
+  case SSE_F2I:
+    if (!(is_xmm(src) || is_mem(src)) || !is_reg(dst))
+      return false;
+    if (size && size != dst->size)
+      return false;
+    if (dst->size != 4 && dst->size != 8)
+      return false;
+    return encode(in, pfx, dst->size == 8, op, dst, 0, src);
+  }
+  return false;
+}
+
+// movq and movd between general-purpose and XMM registers
+static bool asm_movq(Insn *in, bool q, Operand *ops, int nops) {
+  if (nops != 2)
+    return false;
+
+  Operand *src = &ops[0];
+  Operand *dst = &ops[1];
+
+  if (is_rm(src) && is_xmm(dst) && (!is_reg(src) || src->size == (q ? 8 : 4))) {
+    if (q && is_mem(src))
+      return encode(in, 0xf3, false, 0x0f7e, dst, 0, src);
+    return encode(in, 0x66, q, 0x0f6e, dst, 0, src);
+  }
+
+  if (is_xmm(src) && is_rm(dst) && (!is_reg(dst) || dst->size == (q ? 8 : 4))) {
+    if (q && is_mem(dst))
+      return encode(in, 0x66, false, 0x0fd6, src, 0, dst);
+    return encode(in, 0x66, q, 0x0f7e, src, 0, dst);
+  }
+
+  if (q && is_xmm(src) && is_xmm(dst))
+    return encode(in, 0xf3, false, 0x0f7e, dst, 0, src);
+  return false;
+}
+
+// Instructions without operands
+static struct {
+  char *name;
+  char *bytes;
+} noarg_insns[] = {
+  {"ret", "\xc3"}, {"leave", "\xc9"}, {"nop", "\x90"}, {"hlt", "\xf4"},
+  {"cqo", "\x48\x99"}, {"cqto", "\x48\x99"}, {"cdq", "\x99"}, {"cltd", "\x99"},
+  {"cltq", "\x48\x98"}, {"cdqe", "\x48\x98"}, {"cwtl", "\x98"}, {"cwde", "\x98"},
+  {"cbtw", "\x66\x98"}, {"cbw", "\x66\x98"}, {"cwtd", "\x66\x99"}, {"cwd", "\x66\x99"},
+  {"ud2", "\x0f\x0b"}, {"pause", "\xf3\x90"}, {"int3", "\xcc"},
+  {"mfence", "\x0f\xae\xf0"}, {"lfence", "\x0f\xae\xe8"}, {"sfence", "\x0f\xae\xf8"},
+  {"syscall", "\x0f\x05"}, {"cpuid", "\x0f\xa2"}, {"rdtsc", "\x0f\x31"},
+  {"cld", "\xfc"}, {"std", "\xfd"},
+  {"stosb", "\xaa"}, {"stosw", "\x66\xab"}, {"stosl", "\xab"}, {"stosq", "\x48\xab"},
+  {"movsb", "\xa4"}, {"movsw", "\x66\xa5"}, {"movsl", "\xa5"}, {"movsq", "\x48\xa5"},
+  {"rex64", "\x48"}, {"data16", "\x66"},
+};
+
+// Prefixes which may precede an instruction on the same line
+static struct {
+  char *name;
+  int byte;
+} prefixes[] = {
+  {"lock", 0xf0}, {"rep", 0xf3}, {"repe", 0xf3}, {"repz", 0xf3},
+  {"repne", 0xf2}, {"repnz", 0xf2}, {"data16", 0x66}, {"rex64", 0x48},
+};
+
+static struct {
+  char *name;
+  int n;
+} alu_insns[] = {
+  {"add", 0}, {"or", 1}, {"adc", 2}, {"sbb", 3},
+  {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7},
+};
+
+static struct {
+  char *name;
+  int op;
+  int n;
+} unary_insns[] = {
+  {"inc", 0xff, 0}, {"dec", 0xff, 1}, {"not", 0xf7, 2}, {"neg", 0xf7, 3},
+  {"mul", 0xf7, 4}, {"div", 0xf7, 6}, {"idiv", 0xf7, 7},
+};
+
+static struct {
+  char *name;
+  int n;
+} shift_insns[] = {
+  {"rol", 0}, {"ror", 1}, {"rcl", 2}, {"rcr", 3},
+  {"shl", 4}, {"sal", 4}, {"shr", 5}, {"sar", 7},
+};
+
+// Appends an encoded instruction to the current frag.
+static void commit(Insn *in) {
+  Frag *f = cur_section->cur;
+  int start = f->len;
+  out_bytes(in->buf, in->len);
+
+  for (int i = 0; i < in->nfix; i++) {
+    Fixup *fix = calloc(1, sizeof(Fixup));
+    *fix = in->fix[i];
+    fix->offset += start;
+
+    // A PC-relative displacement is relative to the end of the
+    // instruction, not the end of the field.
+    if (is_pcrel(fix->type))
+      fix->addend -= in->len - in->fix[i].offset;
+
+    if (fix->type == R_X86_64_TPOFF32 || fix->type == R_X86_64_TLSGD ||
+        fix->type == R_X86_64_GOTTPOFF || fix->type == R_X86_64_TLSLD ||
+        fix->type == R_X86_64_DTPOFF32)
+      fix->sym->is_tls = true;
+
+    fix->sym->is_used = true;
+    add_frag_fixup(f, fix);
+  }
+}
+
+static bool asm_jump(Insn *in, char *mnem, Operand *ops, int nops) {
+  if (nops != 1)
+    return false;
+
+  Operand *op = &ops[0];
+  bool is_call = !strcmp(mnem, "call") || !strcmp(mnem, "callq");
+  bool is_jmp = !strcmp(mnem, "jmp") || !strcmp(mnem, "jmpq");
+  int jcc = (mnem[0] == 'j' && !is_jmp) ? cond_code(mnem + 1) : -1;
+  if (!is_call && !is_jmp && jcc == -1)
+    return false;
+
+  // Indirect jump or call
+  if (op->indirect) {
+    if (jcc != -1 || (is_reg(op) && op->size != 8))
+      return false;
+    op->indirect = false;
+    if (!is_rm(op))
+      return false;
+    return encode(in, 0, false, 0xff, NULL, is_call ? 2 : 4, op);
+  }
+
+  Expr *e = &op->expr;
+  if (op->kind != OP_MEM || op->base != -1 || op->index != -1 || op->rip ||
+      op->seg || !e->sym || e->val || (e->mod != MOD_NONE && e->mod != MOD_PLT))
+    return false;
+
+  if (is_call) {
+    emit1(in, 0xe8);
+    add_fixup(in, 4, R_X86_64_PLT32, e);
+    return true;
+  }
+
+  if (in->len)
+    return false;
+  out_jump(jcc, e->sym);
+  return true;
+}
+
+static bool asm_insn(Insn *in, char *mnem, Operand *ops, int nops) {
+  int size = 0;
+
+  if (mnem[0] == 'f' && asm_x87(in, mnem, ops, nops))
+    return true;
+
+  for (int i = 0; i < sizeof(sse_insns) / sizeof(*sse_insns); i++) {
+    if (!strcmp(mnem, sse_insns[i].name))
+      return asm_sse(in, i, 0, ops, nops);
+
+    SSEKind kind = sse_insns[i].kind;
+    if ((kind == SSE_I2F || kind == SSE_F2I) && match(mnem, sse_insns[i].name, &size))
+      return asm_sse(in, i, size, ops, nops);
+  }
+
+  if (!strcmp(mnem, "movq") || !strcmp(mnem, "movd")) {
+    for (int i = 0; i < nops; i++)
+      if (is_xmm(&ops[i]))
+        return asm_movq(in, mnem[3] == 'q', ops, nops);
+  }
+
+  if (nops == 0) {
+    for (int i = 0; i < sizeof(noarg_insns) / sizeof(*noarg_insns); i++) {
+      if (!strcmp(mnem, noarg_insns[i].name)) {
+        for (char *p = noarg_insns[i].bytes; *p; p++)
+          emit1(in, *p);
+        return true;
+      }
+    }
+  }
+
+  if (mnem[0] == 'j' || !strncmp(mnem, "call", 4))
+    return asm_jump(in, mnem, ops, nops);
+
+  if (!strncmp(mnem, "set", 3) && cond_code(mnem + 3) != -1) {
+    if (nops != 1 || !is_rm(&ops[0]) || (is_reg(&ops[0]) && ops[0].size != 1))
+      return false;
+    return encode(in, 0, false, 0x0f90 + cond_code(mnem + 3), NULL, 0, &ops[0]);
+  }
+
+  if (!strncmp(mnem, "cmov", 4)) {
+    char *cc = strndup(mnem + 4, strlen(mnem + 4));
+    int sz = 0;
+    if (cond_code(cc) == -1 && strlen(cc) > 1 && suffix_size(cc[strlen(cc) - 1])) {
+      sz = suffix_size(cc[strlen(cc) - 1]);
+      cc[strlen(cc) - 1] = '\0';
+    }
+    int c = cond_code(cc);
+    if (c == -1 || nops != 2 || !is_rm(&ops[0]) || !is_reg(&ops[1]))
+      return false;
+    sz = operand_size(sz, ops, nops);
+    if (sz < 2)
+      return false;
+    return encode(in, sz == 2 ? 0x66 : 0, sz == 8, 0x0f40 + c, &ops[1], 0, &ops[0]);
+  }
+
+  for (int i = 0; i < sizeof(alu_insns) / sizeof(*alu_insns); i++)
+    if (match(mnem, alu_insns[i].name, &size))
+      return asm_alu(in, alu_insns[i].n, size, ops, nops);
+
+  for (int i = 0; i < sizeof(unary_insns) / sizeof(*unary_insns); i++)
+    if (match(mnem, unary_insns[i].name, &size))
+      return asm_unary(in, unary_insns[i].op, unary_insns[i].n, size, ops, nops);
+
+  for (int i = 0; i < sizeof(shift_insns) / sizeof(*shift_insns); i++)
+    if (match(mnem, shift_insns[i].name, &size))
+      return asm_shift(in, shift_insns[i].n, size, ops, nops);
+
+  if (match(mnem, "test", &size))
+    return asm_test(in, size, ops, nops);
+
+  if (match(mnem, "imul", &size))
+    return asm_imul(in, size, ops, nops);
+
+  if (match(mnem, "mov", &size))
+    return asm_mov(in, size, false, ops, nops);
+
+  if (!strcmp(mnem, "movabs"))
+    return asm_mov(in, 8, true, ops, nops);
+
+  if (!strncmp(mnem, "movs", 4) || !strncmp(mnem, "movz", 4))
+    return asm_movx(in, mnem, ops, nops);
+
+  if (match(mnem, "lea", &size)) {
+    if (nops != 2 || !is_mem(&ops[0]) || !is_reg(&ops[1]) || ops[1].size == 1)
+      return false;
+    int sz = ops[1].size;
+    return encode(in, sz == 2 ? 0x66 : 0, sz == 8, 0x8d, &ops[1], 0, &ops[0]);
+  }
+
+  if (match(mnem, "push", &size))
+    return asm_push_pop(in, true, size, ops, nops);
+
+  if (match(mnem, "pop", &size))
+    return asm_push_pop(in, false, size, ops, nops);
+
+  if (match(mnem, "bswap", &size)) {
+    if (nops != 1 || !is_reg(&ops[0]) || ops[0].size < 4)
+      return false;
+    return encode_short(in, 0, ops[0].size == 8, 0x0fc8, &ops[0]);
+  }
+
+  if (match(mnem, "xchg", &size))
+    return asm_xchg(in, 0x87, size, ops, nops);
+
+  if (match(mnem, "cmpxchg", &size))
+    return asm_xchg(in, 0x0fb1, size, ops, nops);
+
+  if (match(mnem, "xadd", &size))
+    return asm_xchg(in, 0x0fc1, size, ops, nops);
+
+  return false;
+}
+
+//
+// Directives
+//
+
+static bool parse_string(char *p, char **buf, int *len) {
+  p = skip_space(p);
+  if (*p != '"')
+    return false;
+  p++;
+
+  char *out = calloc(1, strlen(p) + 1);
+  int n = 0;
+
+  while (*p != '"') {
+    if (*p == '\0')
+      return false;
+    if (*p != '\\') {
+      out[n++] = *p++;
+      continue;
+    }
+
+    p++;
+    switch (*p) {
+    case 'n': out[n++] = '\n'; p++; break;
+    case 't': out[n++] = '\t'; p++; break;
+    case 'r': out[n++] = '\r'; p++; break;
+    case 'b': out[n++] = '\b'; p++; break;
+    case 'f': out[n++] = '\f'; p++; break;
+    case 'x': {
+      p++;
+      int c = 0;
+      while (isxdigit(*p)) {
+        c = c * 16 + (isdigit(*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+        p++;
+      }
+      out[n++] = c;
+      break;
+    }
+    default:
+      if ('0' <= *p && *p <= '7') {
+        int c = 0;
+        for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++)
+          c = c * 8 + *p++ - '0';
+        out[n++] = c;
+      } else {
+        out[n++] = *p++;
+      }
+    }
+  }
+
+  if (*skip_space(p + 1))
+    return false;
+  *buf = out;
+  *len = n;
+  return true;
+}
+
+static bool parse_symbol_name(char *p, Symbol **sym) {
+  p = skip_space(p);
+  char *start = p;
+  if (!is_sym1(*p))
+    return false;
+  while (is_sym2(*p))
+    p++;
+  if (*skip_space(p))
+    return false;
+  *sym = get_symbol(start, p - start);
+  return true;
+}
+
+static bool parse_const(char *p, long *val) {
+  Expr e;
+  if (!parse_expr(&p, p, &e) || e.sym || *skip_space(p))
+    return false;
+  *val = e.val;
+  return true;
+}
+
+static bool set_section(char *name, char **ops, int nops) {
+  int type = SHT_PROGBITS;
+  long flags = 0;
+
+  if (!strcmp(name, ".text") || !strncmp(name, ".text.", 6))
+    flags = SHF_ALLOC | SHF_EXECINSTR;
+  else if (!strcmp(name, ".data") || !strncmp(name, ".data.", 6))
+    flags = SHF_ALLOC | SHF_WRITE;
+  else if (!strcmp(name, ".bss") || !strncmp(name, ".bss.", 5))
+    type = SHT_NOBITS, flags = SHF_ALLOC | SHF_WRITE;
+  else if (!strcmp(name, ".rodata") || !strncmp(name, ".rodata.", 8))
+    flags = SHF_ALLOC;
+  else if (!strcmp(name, ".tdata") || !strncmp(name, ".tdata.", 7))
+    flags = SHF_ALLOC | SHF_WRITE | SHF_TLS;
+  else if (!strcmp(name, ".tbss") || !strncmp(name, ".tbss.", 6))
+    type = SHT_NOBITS, flags = SHF_ALLOC | SHF_WRITE | SHF_TLS;
+
+  if (nops >= 1) {
+    char *str;
+    int len;
+    if (!parse_string(ops[0], &str, &len))
+      return false;
+
+    flags = 0;
+    for (int i = 0; i < len; i++) {
+      switch (str[i]) {
+      case 'a': flags |= SHF_ALLOC; break;
+      case 'w': flags |= SHF_WRITE; break;
+      case 'x': flags |= SHF_EXECINSTR; break;
+      case 'T': flags |= SHF_TLS; break;
+      default: return false;
+      }
+    }
+  }
+
+  if (nops >= 2) {
+    if (!strcmp(ops[1], "@progbits"))
+      type = SHT_PROGBITS;
+    else if (!strcmp(ops[1], "@nobits"))
+      type = SHT_NOBITS;
+    else if (!strcmp(ops[1], "@init_array"))
+      type = SHT_INIT_ARRAY;
+    else if (!strcmp(ops[1], "@fini_array"))
+      type = SHT_FINI_ARRAY;
+    else
+      return false;
+  }
+
+  if (nops >= 3)
+    return false;
+
+  cur_section = get_section(name, type, flags);
+  return cur_section->type == type && cur_section->flags == flags;
+}
+
+static bool asm_data(int size, char **ops, int nops) {
+  for (int i = 0; i < nops; i++) {
+    Expr e;
+    char *p = ops[i];
+    if (!parse_expr(&p, p, &e))
+      return false;
+
+    // `sym - label`, where `label` precedes the data in the same
+    // frag, is a PC-relative reference with a known offset. This is
+    // used by jump tables.
+    p = skip_space(p);
+    if (*p == '-' && e.sym && e.mod == MOD_NONE && size == 4) {
+      p = skip_space(p + 1);
+      char *start = p;
+      while (is_sym2(*p))
+        p++;
+      Symbol *sub = get_symbol(start, p - start);
+      if (*skip_space(p) || sub->frag != cur_section->cur)
+        return false;
+      out_fixup(4, R_X86_64_PC32, e.sym, e.val + cur_section->cur->len - sub->offset);
+      continue;
+    }
+
+    if (*p)
+      return false;
+
+    if (!e.sym) {
+      char buf[8];
+      for (int j = 0; j < size; j++)
+        buf[j] = e.val >> (j * 8);
+      out_bytes(buf, size);
+      continue;
+    }
+
+    if (e.mod != MOD_NONE)
+      return false;
+    if (size == 8)
+      out_fixup(8, R_X86_64_64, e.sym, e.val);
+    else if (size == 4)
+      out_fixup(4, R_X86_64_32, e.sym, e.val);
+    else
+      return false;
+  }
+  return true;
+}
+
+static bool asm_directive(char *name, char *args) {
+  // Directives we don't need: debug info and comments.
+  if (!strcmp(name, ".file") || !strcmp(name, ".loc") || !strcmp(name, ".ident"))
+    return true;
+
+  char *ops[16];
+  int nops = split_operands(args, ops, 16);
+  if (nops < 0)
+    return false;
+
+  if (!strcmp(name, ".text") || !strcmp(name, ".data") || !strcmp(name, ".bss"))
+    return nops == 0 && set_section(name, NULL, 0);
+
+  if (!strcmp(name, ".section")) {
+    if (nops < 1)
+      return false;
+    return set_section(ops[0], ops + 1, nops - 1);
+  }
+
+  if (!strcmp(name, ".byte"))
+    return asm_data(1, ops, nops);
+  if (!strcmp(name, ".value") || !strcmp(name, ".short") || !strcmp(name, ".word") ||
+      !strcmp(name, ".2byte"))
+    return asm_data(2, ops, nops);
+  if (!strcmp(name, ".long") || !strcmp(name, ".int") || !strcmp(name, ".4byte"))
+    return asm_data(4, ops, nops);
+  if (!strcmp(name, ".quad") || !strcmp(name, ".8byte"))
+    return asm_data(8, ops, nops);
+
+  if (!strcmp(name, ".zero") || !strcmp(name, ".skip") || !strcmp(name, ".space")) {
+    long n;
+    if (nops != 1 || !parse_const(ops[0], &n) || n < 0)
+      return false;
+    out_zero(n);
+    return true;
+  }
+
+  if (!strcmp(name, ".ascii") || !strcmp(name, ".asciz") || !strcmp(name, ".string")) {
+    for (int i = 0; i < nops; i++) {
+      char *buf;
+      int len;
+      if (!parse_string(ops[i], &buf, &len))
+        return false;
+      out_bytes(buf, len);
+      if (name[3] != 'c')
+        out_zero(1);
+    }
+    return true;
+  }
+
+  if (!strcmp(name, ".align") || !strcmp(name, ".balign") || !strcmp(name, ".p2align")) {
+    long n;
+    if (nops != 1 || !parse_const(ops[0], &n))
+      return false;
+    if (name[1] == 'p')
+      n = 1L << n;
+    if (n <= 0 || (n & (n - 1)))
+      return false;
+    if (n > 1)
+      out_align(n);
+    return true;
+  }
+
+  if (!strcmp(name, ".globl") || !strcmp(name, ".global") || !strcmp(name, ".local") ||
+      !strcmp(name, ".weak") || !strcmp(name, ".hidden") || !strcmp(name, ".protected") ||
+      !strcmp(name, ".internal")) {
+    for (int i = 0; i < nops; i++) {
+      Symbol *sym;
+      if (!parse_symbol_name(ops[i], &sym))
+        return false;
+
+      if (name[1] == 'g')
+        sym->is_global = true;
+      else if (name[1] == 'l')
+        sym->is_local = true;
+      else if (name[1] == 'w')
+        sym->is_weak = true;
+      else if (name[1] == 'h')
+        sym->visibility = STV_HIDDEN;
+      else if (name[1] == 'p')
+        sym->visibility = STV_PROTECTED;
+      else
+        sym->visibility = STV_INTERNAL;
+    }
+    return true;
+  }
+
+  if (!strcmp(name, ".type")) {
+    Symbol *sym;
+    if (nops != 2 || !parse_symbol_name(ops[0], &sym))
+      return false;
+
+    char *ty = ops[1];
+    if (*ty == '@' || *ty == '%')
+      ty++;
+    if (!strcmp(ty, "function"))
+      sym->type = STT_FUNC;
+    else if (!strcmp(ty, "object"))
+      sym->type = STT_OBJECT;
+    else if (!strcmp(ty, "tls_object"))
+      sym->is_tls = true;
+    else if (strcmp(ty, "notype"))
+      return false;
+    return true;
+  }
+
+  if (!strcmp(name, ".size")) {
+    Symbol *sym;
+    if (nops != 2 || !parse_symbol_name(ops[0], &sym))
+      return false;
+    return parse_const(ops[1], &sym->size);
+  }
+
+  if (!strcmp(name, ".comm") || !strcmp(name, ".lcomm")) {
+    Symbol *sym;
+    long size, align = 1;
+    if (nops < 2 || nops > 3 || !parse_symbol_name(ops[0], &sym) ||
+        !parse_const(ops[1], &size) || (nops == 3 && !parse_const(ops[2], &align)))
+      return false;
+    if (sym->sec || align <= 0 || (align & (align - 1)))
+      return false;
+
+    sym->is_common = true;
+    sym->common_size = size;
+    sym->common_align = align;
+    if (name[1] == 'l')
+      sym->is_local = true;
+    return true;
+  }
+
+  return false;
+}
+
+//
+// Statements
+//
+
+static bool is_legacy_prefix(uint8_t c) {
+  return c == 0x66 || c == 0x67 || c == 0x26 || c == 0x2e || c == 0x36 ||
+         c == 0x3e || c == 0x64 || c == 0x65;
+}
+
+// The first `npfx` bytes of `in` are lock or rep prefixes written in
+// the source. Like GNU as, we emit segment, address-size and
+// operand-size prefixes of the instruction before them.
+static void move_prefixes(Insn *in, int npfx) {
+  int n = npfx;
+  while (n < in->len && is_legacy_prefix(in->buf[n]))
+    n++;
+  if (npfx == 0 || n == npfx)
+    return;
+
+  char tmp[32];
+  memcpy(tmp, in->buf, npfx);
+  memmove(in->buf, in->buf + npfx, n - npfx);
+  memcpy(in->buf + n - npfx, tmp, npfx);
+}
+
+static bool asm_stmt(char *p) {
+  p = skip_space(p);
+
+  // Labels
+  for (;;) {
+    char *start = p;
+    while (is_sym2(*p))
+      p++;
+    if (p == start || *skip_space(p) != ':') {
+      p = start;
+      break;
+    }
+
+    Symbol *sym;
+    if (isdigit(*start)) {
+      for (char *q = start; q < p; q++)
+        if (!isdigit(*q))
+          return false;
+      sym = numeric_label(start, p - start, true, false);
+    } else {
+      sym = get_symbol(start, p - start);
+    }
+
+    if (sym->sec || sym->is_common)
+      return false;
+    define_label(sym);
+    p = skip_space(skip_space(p) + 1);
+  }
+
+  if (*p == '\0')
+    return true;
+
+  // Mnemonic or directive
+  char *start = p;
+  while (is_sym2(*p))
+    p++;
+  char *mnem = strndup(start, p - start);
+  if (*p && *p != ' ' && *p != '\t')
+    return false;
+
+  if (mnem[0] == '.')
+    return asm_directive(mnem, p);
+
+  Insn in = {};
+
+  // Instruction prefixes
+  for (;;) {
+    int i = 0;
+    int n = sizeof(prefixes) / sizeof(*prefixes);
+    for (; i < n; i++)
+      if (!strcmp(mnem, prefixes[i].name))
+        break;
+
+    char *q = skip_space(p);
+    if (i == n || *q == '\0')
+      break;
+
+    emit1(&in, prefixes[i].byte);
+    start = q;
+    while (is_sym2(*q))
+      q++;
+    mnem = strndup(start, q - start);
+    p = q;
+  }
+
+  int npfx = in.len;
+  char *strs[4];
+  int nops = split_operands(p, strs, 4);
+  if (nops < 0)
+    return false;
+
+  Operand ops[4];
+  for (int i = 0; i < nops; i++)
+    if (!parse_operand(strs[i], &ops[i]))
+      return false;
+
+  if (!asm_insn(&in, mnem, ops, nops))
+    return false;
+  move_prefixes(&in, npfx);
+  commit(&in);
+  return true;
+}
+
+// Splits a line into statements at ';' and removes comments.
+static bool asm_line(char *line) {
+  char *p = line;
+  bool in_str = false;
+
+  for (char *q = p;; q++) {
+    if (in_str) {
+      if (*q == '\\' && q[1])
+        q++;
+      else if (*q == '"')
+        in_str = false;
+      else if (*q == '\0')
+        return false;
+      continue;
+    }
+
+    if (*q == '"') {
+      in_str = true;
+      continue;
+    }
+
+    if (*q == '#' || *q == ';' || *q == '\0') {
+      char c = *q;
+      *q = '\0';
+      if (!asm_stmt(p))
+        return false;
+      if (c != ';')
+        return true;
+      p = q + 1;
+    }
+  }
+}
+
+//
+// Layout
+//
+
+static long symbol_addr(Symbol *sym) {
+  return sym->frag->offset + sym->offset;
+}
+
+// Returns true if a jump or a PC-relative reference to a given
+// symbol can be resolved by the assembler itself.
+static bool is_resolvable(Section *sec, Symbol *sym) {
+  return sym->sec == sec && !sym->is_global && !sym->is_weak;
+}
+
+static void relax(Section *sec) {
+  for (Frag *f = sec->frags; f; f = f->next)
+    if (f->kind == FRAG_JUMP)
+      f->is_long = !is_resolvable(sec, f->target);
+
+  for (;;) {
+    long off = 0;
+    for (Frag *f = sec->frags; f; f = f->next) {
+      f->offset = off;
+      off += f->len;
+
+      if (f->kind == FRAG_JUMP)
+        f->tail = !f->is_long ? 2 : (f->jcc == -1) ? 5 : 6;
+      else if (f->kind == FRAG_ALIGN)
+        f->tail = align_to(off, f->align) - off;
+      else
+        f->tail = 0;
+      off += f->tail;
+    }
+    sec->size = off;
+
+    bool changed = false;
+    for (Frag *f = sec->frags; f; f = f->next) {
+      if (f->kind != FRAG_JUMP || f->is_long)
+        continue;
+      long disp = symbol_addr(f->target) - (f->offset + f->len + 2);
+      if (!is_int8(disp)) {
+        f->is_long = true;
+        changed = true;
+      }
+    }
+
+    if (!changed)
+      return;
+  }
+}
+
+static void add_reloc(Section *sec, long offset, int type, Symbol *sym, long addend) {
+  Reloc *rel = calloc(1, sizeof(Reloc));
+  rel->offset = offset;
+  rel->type = type;
+  rel->addend = addend;
+
+  // References to local symbols are converted to references
+  // relative to the section that defines them, as GNU as does.
+  if (sym->sec && !sym->is_global && !sym->is_weak && !sym->is_tls &&
+      (type == R_X86_64_64 || type == R_X86_64_PC32 || type == R_X86_64_PLT32 ||
+       type == R_X86_64_32 || type == R_X86_64_32S)) {
+    rel->sec = sym->sec;
+    rel->addend += symbol_addr(sym);
+    if (type == R_X86_64_PLT32)
+      rel->type = R_X86_64_PC32;
+  } else {
+    rel->sym = sym;
+    sym->is_keep = true;
+  }
+
+  if (sec->last_reloc)
+    sec->last_reloc = sec->last_reloc->next = rel;
+  else
+    sec->last_reloc = sec->relocs = rel;
+}
+
+static void put32(char *p, uint32_t val) {
+  for (int i = 0; i < 4; i++)
+    p[i] = val >> (i * 8);
+}
+
+// Builds the contents of a section and its relocations.
+static char *emit_section(Section *sec) {
+  char *buf = calloc(1, sec->size + 1);
+
+  for (Frag *f = sec->frags; f; f = f->next) {
+    if (f->len)
+      memcpy(buf + f->offset, f->buf, f->len);
+
+    for (Fixup *fix = f->fixups; fix; fix = fix->next) {
+      long off = f->offset + fix->offset;
+      if ((fix->type == R_X86_64_PC32 || fix->type == R_X86_64_PLT32) &&
+          is_resolvable(sec, fix->sym)) {
+        put32(buf + off, symbol_addr(fix->sym) + fix->addend - off);
+        continue;
+      }
+      add_reloc(sec, off, fix->type, fix->sym, fix->addend);
+    }
+
+    char *p = buf + f->offset + f->len;
+
+    if (f->kind == FRAG_ALIGN) {
+      memset(p, (sec->flags & SHF_EXECINSTR) ? 0x90 : 0, f->tail);
+      continue;
+    }
+
+    if (f->kind != FRAG_JUMP)
+      continue;
+
+    long end = f->offset + f->len + f->tail;
+
+    if (!f->is_long) {
+      p[0] = (f->jcc == -1) ? 0xeb : 0x70 + f->jcc;
+      p[1] = symbol_addr(f->target) - end;
+      continue;
+    }
+
+    if (f->jcc == -1) {
+      *p++ = 0xe9;
+    } else {
+      *p++ = 0x0f;
+      *p++ = 0x80 + f->jcc;
+    }
+
+    if (is_resolvable(sec, f->target)) {
+      put32(p, symbol_addr(f->target) - end);
+      continue;
+    }
+
+    Symbol *sym = f->target;
+    sym->is_used = true;
+    add_reloc(sec, end - 4, sym->sec ? R_X86_64_PC32 : R_X86_64_PLT32, sym, -4);
+  }
+  return buf;
+}
+
+//
+// ELF writer
+//
+
+typedef struct {
+  char *buf;
+  size_t len;
+  FILE *fp;
+} StrTab;
+
+static int strtab_add(StrTab *tab, char *s) {
+  int off = ftell(tab->fp);
+  fwrite(s, strlen(s) + 1, 1, tab->fp);
+  return off;
+}
+
+static bool write_elf(FILE *out) {
+  // Allocate local common symbols in .bss
+  for (int i = 0; i < nsyms; i++) {
+    Symbol *sym = symtab[i];
+    if (!sym->is_common || !sym->is_local)
+      continue;
+
+    cur_section = get_section(".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
+    if (sym->common_align > 1)
+      out_align(sym->common_align);
+    define_label(sym);
+    out_zero(sym->common_size);
+    sym->is_common = false;
+    if (!sym->size)
+      sym->size = sym->common_size;
+    if (!sym->type)
+      sym->type = STT_OBJECT;
+  }
+
+  get_section(".note.GNU-stack", SHT_PROGBITS, 0);
+
+  // Undefined temporary labels are errors.
+  for (int i = 0; i < nsyms; i++) {
+    Symbol *sym = symtab[i];
+    if (sym->is_temp && sym->is_used && !sym->sec)
+      return false;
+  }
+
+  int nsecs = 0;
+  for (Section *sec = sections; sec; sec = sec->next) {
+    relax(sec);
+    sec->shndx = ++nsecs;
+  }
+
+  char **data = calloc(nsecs + 1, sizeof(char *));
+  for (Section *sec = sections; sec; sec = sec->next)
+    data[sec->shndx] = emit_section(sec);
+
+  // Build the symbol table. Local symbols must precede global ones.
+  StrTab strtab = {};
+  strtab.fp = open_memstream(&strtab.buf, &strtab.len);
+  strtab_add(&strtab, "");
+
+  Elf64_Sym *syms = calloc(nsyms + nsecs + 1, sizeof(Elf64_Sym));
+  int idx = 1;
+  int first_global = 0;
+
+  for (Section *sec = sections; sec; sec = sec->next) {
+    Elf64_Sym *esym = &syms[idx];
+    esym->st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    esym->st_shndx = sec->shndx;
+    sec->sym_idx = idx++;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < nsyms; i++) {
+      Symbol *sym = symtab[i];
+      bool is_global = sym->is_global || sym->is_weak || (!sym->sec && !sym->is_local);
+
+      if (pass == 0 && is_global)
+        continue;
+      if (pass == 1 && !is_global)
+        continue;
+
+      // Skip symbols that are neither defined nor referenced.
+      if (!sym->sec && !sym->is_common && !sym->is_used && !sym->is_global && !sym->is_weak)
+        continue;
+      if (sym->is_local && !sym->sec)
+        continue;
+      if (sym->is_temp && !sym->is_keep)
+        continue;
+
+      Elf64_Sym *esym = &syms[idx];
+      int type = sym->is_tls ? STT_TLS : sym->type;
+      int bind = sym->is_weak ? STB_WEAK : is_global ? STB_GLOBAL : STB_LOCAL;
+
+      esym->st_name = strtab_add(&strtab, sym->name);
+      esym->st_info = ELF64_ST_INFO(bind, type);
+      esym->st_other = sym->visibility;
+      esym->st_size = sym->size;
+
+      if (sym->is_common) {
+        esym->st_shndx = SHN_COMMON;
+        esym->st_value = sym->common_align;
+        esym->st_size = sym->common_size;
+        if (!type)
+          esym->st_info = ELF64_ST_INFO(bind, STT_OBJECT);
+      } else if (sym->sec) {
+        esym->st_shndx = sym->sec->shndx;
+        esym->st_value = symbol_addr(sym);
+      }
+      sym->idx = idx++;
+    }
+
+    if (pass == 0)
+      first_global = idx;
+  }
+
+  fclose(strtab.fp);
+
+  // Build relocation tables.
+  Elf64_Rela **relas = calloc(nsecs + 1, sizeof(Elf64_Rela *));
+  int *nrelas = calloc(nsecs + 1, sizeof(int));
+
+  for (Section *sec = sections; sec; sec = sec->next) {
+    int n = 0;
+    for (Reloc *rel = sec->relocs; rel; rel = rel->next)
+      n++;
+
+    relas[sec->shndx] = calloc(n + 1, sizeof(Elf64_Rela));
+    for (Reloc *rel = sec->relocs; rel; rel = rel->next) {
+      Elf64_Rela *r = &relas[sec->shndx][nrelas[sec->shndx]++];
+      int symidx = rel->sec ? rel->sec->sym_idx : rel->sym->idx;
+      r->r_offset = rel->offset;
+      r->r_info = ELF64_R_INFO(symidx, rel->type);
+      r->r_addend = rel->addend;
+    }
+  }
+
+  // Section header string table
+  StrTab shstrtab = {};
+  shstrtab.fp = open_memstream(&shstrtab.buf, &shstrtab.len);
+  strtab_add(&shstrtab, "");
+
+  int nrela_secs = 0;
+  for (Section *sec = sections; sec; sec = sec->next)
+    if (nrelas[sec->shndx])
+      nrela_secs++;
+
+  int shnum = 1 + nsecs + nrela_secs + 3;
+  Elf64_Shdr *shdrs = calloc(shnum, sizeof(Elf64_Shdr));
+  int symtab_idx = 1 + nsecs + nrela_secs;
+  int strtab_idx = symtab_idx + 1;
+  int shstrtab_idx = symtab_idx + 2;
+
+  // Lay out the file.
+  long off = sizeof(Elf64_Ehdr);
+
+  for (Section *sec = sections; sec; sec = sec->next) {
+    Elf64_Shdr *sh = &shdrs[sec->shndx];
+    sh->sh_name = strtab_add(&shstrtab, sec->name);
+    sh->sh_type = sec->type;
+    sh->sh_flags = sec->flags;
+    sh->sh_addralign = sec->align;
+    sh->sh_size = sec->size;
+    off = align_to(off, sec->align);
+    sh->sh_offset = off;
+    if (sec->type != SHT_NOBITS)
+      off += sec->size;
+  }
+
+  int ridx = 1 + nsecs;
+  for (Section *sec = sections; sec; sec = sec->next) {
+    if (!nrelas[sec->shndx])
+      continue;
+    Elf64_Shdr *sh = &shdrs[ridx++];
+    sh->sh_name = strtab_add(&shstrtab, format(".rela%s", sec->name));
+    sh->sh_type = SHT_RELA;
+    sh->sh_flags = SHF_INFO_LINK;
+    sh->sh_link = symtab_idx;
+    sh->sh_info = sec->shndx;
+    sh->sh_addralign = 8;
+    sh->sh_entsize = sizeof(Elf64_Rela);
+    sh->sh_size = nrelas[sec->shndx] * sizeof(Elf64_Rela);
+    off = align_to(off, 8);
+    sh->sh_offset = off;
+    off += sh->sh_size;
+  }
+
+  Elf64_Shdr *sh = &shdrs[symtab_idx];
+  sh->sh_name = strtab_add(&shstrtab, ".symtab");
+  sh->sh_type = SHT_SYMTAB;
+  sh->sh_link = strtab_idx;
+  sh->sh_info = first_global;
+  sh->sh_addralign = 8;
+  sh->sh_entsize = sizeof(Elf64_Sym);
+  sh->sh_size = idx * sizeof(Elf64_Sym);
+  off = align_to(off, 8);
+  sh->sh_offset = off;
+  off += sh->sh_size;
+
+  sh = &shdrs[strtab_idx];
+  sh->sh_name = strtab_add(&shstrtab, ".strtab");
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_size = strtab.len;
+  sh->sh_offset = off;
+  off += sh->sh_size;
+
+  sh = &shdrs[shstrtab_idx];
+  sh->sh_name = strtab_add(&shstrtab, ".shstrtab");
+  fclose(shstrtab.fp);
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_size = shstrtab.len;
+  sh->sh_offset = off;
+  off += sh->sh_size;
+
+  off = align_to(off, 8);
+
+  Elf64_Ehdr ehdr = {};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_shoff = off;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = shnum;
+  ehdr.e_shstrndx = shstrtab_idx;
+
+  // Write everything out.
+  char *file = calloc(1, off + shnum * sizeof(Elf64_Shdr));
+  memcpy(file, &ehdr, sizeof(ehdr));
+
+  for (Section *sec = sections; sec; sec = sec->next)
+    if (sec->type != SHT_NOBITS)
+      memcpy(file + shdrs[sec->shndx].sh_offset, data[sec->shndx], sec->size);
+
+  ridx = 1 + nsecs;
+  for (Section *sec = sections; sec; sec = sec->next)
+    if (nrelas[sec->shndx])
+      memcpy(file + shdrs[ridx++].sh_offset, relas[sec->shndx],
+             nrelas[sec->shndx] * sizeof(Elf64_Rela));
+
+  memcpy(file + shdrs[symtab_idx].sh_offset, syms, idx * sizeof(Elf64_Sym));
+  memcpy(file + shdrs[strtab_idx].sh_offset, strtab.buf, strtab.len);
+  memcpy(file + shdrs[shstrtab_idx].sh_offset, shstrtab.buf, shstrtab.len);
+  memcpy(file + off, shdrs, shnum * sizeof(Elf64_Shdr));
+
+  fwrite(file, off + shnum * sizeof(Elf64_Shdr), 1, out);
+  return true;
+}
+
+// Assembles a given assembly text and writes an ELF object file to
+// `out`. Returns false if the text contains something we don't
+// support; nothing is written in that case.
+bool assemble_elf(char *text, FILE *out) {
+  sections = last_section = NULL;
+  symbols = (HashMap){};
+  num_labels = (HashMap){};
+  symtab = NULL;
+  nsyms = 0;
+  cur_section = get_section(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+  get_section(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE);
+  get_section(".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
+
+  char *line = NULL;
+  int cap = 0;
+
+  for (char *p = text; *p;) {
+    char *end = strchr(p, '\n');
+    int len = end ? end - p : strlen(p);
+
+    if (len + 1 > cap) {
+      cap = (len + 1) * 2;
+      line = realloc(line, cap);
+    }
+    memcpy(line, p, len);
+    line[len] = '\0';
+
+    if (!asm_line(line))
+      return false;
+
+    p += len;
+    if (*p == '\n')
+      p++;
+  }
+
+  return write_elf(out);
+}
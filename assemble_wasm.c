@@ -0,0 +1,1001 @@
+// This file contains a small WebAssembly assembler. It reads the WAT
+// text produced by codegen_wasm() and writes a module in the binary
+// format, so that the output can be loaded without running wat2wasm.
+//
+// The text is first read into a tree of S-expressions. A module is a
+// list of fields: memories, globals, data segments, exports and
+// functions. Function bodies may mix plain instructions such as
+// `i32.add` and folded ones such as `(i32.add (local.get $x) (i32.const
+// 1))`, in which the operands are emitted before the operator.
+//
+// We understand the subset of the text format that codegen_wasm()
+// emits. The input is generated by us, so anything else is a bug and
+// is reported with error().
+
+#include "chibicc.h"
+
+typedef struct SExpr SExpr;
+struct SExpr {
+  SExpr *next;
+  bool is_list;
+  SExpr *list; // Elements of a list
+  char *atom;  // Text of an atom, including quotes for a string
+  int len;
+  int line_no;
+};
+
+typedef struct {
+  char *data;
+  int len;
+  int cap;
+} Buf;
+
+typedef enum {
+  IMM_NONE,
+  IMM_MEMARG,
+  IMM_MEM,
+  IMM_MEM2,
+  IMM_I32,
+  IMM_I64,
+  IMM_F32,
+  IMM_F64,
+  IMM_V128,
+  IMM_LOCAL,
+  IMM_GLOBAL,
+  IMM_FUNC,
+  IMM_LABEL,
+  IMM_BR_TABLE,
+} ImmKind;
+
+typedef struct {
+  int prefix; // 0, or 0xfc, 0xfd or 0xfe for multi-byte opcodes
+  int op;
+  ImmKind imm;
+  int align;  // log2 of the natural alignment of a memory access
+} Opcode;
+
+static HashMap opcodes;
+
+static HashMap func_idx;
+static HashMap global_idx;
+static HashMap local_idx;
+static HashMap type_idx;
+
+static int nfuncs;
+
+static Buf types;
+static int ntypes;
+
+// Labels of the enclosing blocks, innermost last
+static char **labels;
+static int depth;
+static int labels_cap;
+
+static int line_no;
+
+//
+// Reader
+//
+
+static char *atom_str(SExpr *e) {
+  return format("%.*s", e->len, e->atom);
+}
+
+static bool is_atom(SExpr *e, char *s) {
+  return e && !e->is_list && e->len == strlen(s) && !strncmp(e->atom, s, e->len);
+}
+
+static bool is_form(SExpr *e, char *name) {
+  return e && e->is_list && is_atom(e->list, name);
+}
+
+static char *skip_space(char *p) {
+  for (;;) {
+    if (*p == '\n') {
+      line_no++;
+      p++;
+    } else if (isspace(*p)) {
+      p++;
+    } else if (p[0] == ';' && p[1] == ';') {
+      while (*p && *p != '\n')
+        p++;
+    } else if (p[0] == '(' && p[1] == ';') {
+      for (p += 2; *p && !(p[0] == ';' && p[1] == ')'); p++)
+        if (*p == '\n')
+          line_no++;
+      if (*p)
+        p += 2;
+    } else {
+      return p;
+    }
+  }
+}
+
+static SExpr *read_sexpr(char **rest, char *p) {
+  p = skip_space(p);
+  SExpr *e = calloc(1, sizeof(SExpr));
+  e->line_no = line_no;
+
+  if (*p == '(') {
+    e->is_list = true;
+    SExpr head = {};
+    SExpr *cur = &head;
+    p = skip_space(p + 1);
+    while (*p != ')') {
+      if (!*p)
+        error("wasm: line %d: unterminated list", e->line_no);
+      cur = cur->next = read_sexpr(&p, p);
+      p = skip_space(p);
+    }
+    e->list = head.next;
+    *rest = p + 1;
+    return e;
+  }
+
+  char *start = p;
+  if (*p == '"') {
+    for (p++; *p != '"'; p++) {
+      if (!*p)
+        error("wasm: line %d: unterminated string", e->line_no);
+      if (*p == '\\' && p[1])
+        p++;
+    }
+    p++;
+  } else {
+    while (*p && !isspace(*p) && *p != '(' && *p != ')' && *p != ';')
+      p++;
+  }
+
+  if (p == start)
+    error("wasm: line %d: unexpected character '%c'", line_no, *p);
+  e->atom = start;
+  e->len = p - start;
+  *rest = p;
+  return e;
+}
+
+// Decodes a string literal into bytes.
+static char *read_string(SExpr *e, int *len) {
+  if (e->is_list || e->atom[0] != '"')
+    error("wasm: line %d: string expected", e->line_no);
+
+  char *buf = calloc(1, e->len);
+  int n = 0;
+  for (char *p = e->atom + 1; p < e->atom + e->len - 1; p++) {
+    if (*p != '\\') {
+      buf[n++] = *p;
+      continue;
+    }
+
+    p++;
+    switch (*p) {
+    case 'n': buf[n++] = '\n'; break;
+    case 't': buf[n++] = '\t'; break;
+    case 'r': buf[n++] = '\r'; break;
+    case '"': buf[n++] = '"'; break;
+    case '\'': buf[n++] = '\''; break;
+    case '\\': buf[n++] = '\\'; break;
+    default:
+      if (!isxdigit(p[0]) || !isxdigit(p[1]))
+        error("wasm: line %d: invalid escape sequence", e->line_no);
+      buf[n++] = strtol((char[]){p[0], p[1], 0}, NULL, 16);
+      p++;
+    }
+  }
+  *len = n;
+  return buf;
+}
+
+static uint64_t read_int(SExpr *e) {
+  if (!e || e->is_list)
+    error("wasm: line %d: number expected", line_no);
+
+  char *s = atom_str(e);
+  char *p = s;
+  bool neg = (*p == '-');
+  if (*p == '-' || *p == '+')
+    p++;
+
+  // Underscores may separate digits.
+  char *digits = calloc(1, strlen(p) + 1);
+  for (int i = 0; *p; p++)
+    if (*p != '_')
+      digits[i++] = *p;
+
+  char *end;
+  uint64_t val = strtoull(digits, &end, 0);
+  if (*end || !*digits)
+    error("wasm: line %d: invalid number: %s", e->line_no, s);
+  return neg ? -val : val;
+}
+
+//
+// Output buffers
+//
+
+static void emit_byte(Buf *b, int c) {
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 64;
+    b->data = realloc(b->data, b->cap);
+  }
+  b->data[b->len++] = c;
+}
+
+static void emit_bytes(Buf *b, char *p, int n) {
+  for (int i = 0; i < n; i++)
+    emit_byte(b, p[i]);
+}
+
+static void emit_uleb(Buf *b, uint64_t val) {
+  do {
+    int c = val & 0x7f;
+    val >>= 7;
+    emit_byte(b, val ? (c | 0x80) : c);
+  } while (val);
+}
+
+static void emit_sleb(Buf *b, int64_t val) {
+  for (;;) {
+    int c = val & 0x7f;
+    val >>= 7;
+    if ((val == 0 && !(c & 0x40)) || (val == -1 && (c & 0x40))) {
+      emit_byte(b, c);
+      return;
+    }
+    emit_byte(b, c | 0x80);
+  }
+}
+
+static void emit_name(Buf *b, char *s, int len) {
+  emit_uleb(b, len);
+  emit_bytes(b, s, len);
+}
+
+static void emit_section(FILE *out, int id, Buf *sec, int count) {
+  if (!count)
+    return;
+  Buf hdr = {};
+  emit_uleb(&hdr, count);
+  fputc(id, out);
+
+  Buf size = {};
+  emit_uleb(&size, hdr.len + sec->len);
+  fwrite(size.data, size.len, 1, out);
+  fwrite(hdr.data, hdr.len, 1, out);
+  fwrite(sec->data, sec->len, 1, out);
+}
+
+//
+// Opcodes
+//
+
+static void add_op(char *name, int prefix, int op, ImmKind imm, int align) {
+  Opcode *o = calloc(1, sizeof(Opcode));
+  *o = (Opcode){prefix, op, imm, align};
+  hashmap_put(&opcodes, name, o);
+}
+
+// Numeric instructions, which take no immediates, from opcode 0x45
+static char *numeric_ops[] = {
+  "i32.eqz", "i32.eq", "i32.ne", "i32.lt_s", "i32.lt_u", "i32.gt_s",
+  "i32.gt_u", "i32.le_s", "i32.le_u", "i32.ge_s", "i32.ge_u",
+  "i64.eqz", "i64.eq", "i64.ne", "i64.lt_s", "i64.lt_u", "i64.gt_s",
+  "i64.gt_u", "i64.le_s", "i64.le_u", "i64.ge_s", "i64.ge_u",
+  "f32.eq", "f32.ne", "f32.lt", "f32.gt", "f32.le", "f32.ge",
+  "f64.eq", "f64.ne", "f64.lt", "f64.gt", "f64.le", "f64.ge",
+  "i32.clz", "i32.ctz", "i32.popcnt", "i32.add", "i32.sub", "i32.mul",
+  "i32.div_s", "i32.div_u", "i32.rem_s", "i32.rem_u", "i32.and", "i32.or",
+  "i32.xor", "i32.shl", "i32.shr_s", "i32.shr_u", "i32.rotl", "i32.rotr",
+  "i64.clz", "i64.ctz", "i64.popcnt", "i64.add", "i64.sub", "i64.mul",
+  "i64.div_s", "i64.div_u", "i64.rem_s", "i64.rem_u", "i64.and", "i64.or",
+  "i64.xor", "i64.shl", "i64.shr_s", "i64.shr_u", "i64.rotl", "i64.rotr",
+  "f32.abs", "f32.neg", "f32.ceil", "f32.floor", "f32.trunc", "f32.nearest",
+  "f32.sqrt", "f32.add", "f32.sub", "f32.mul", "f32.div", "f32.min",
+  "f32.max", "f32.copysign",
+  "f64.abs", "f64.neg", "f64.ceil", "f64.floor", "f64.trunc", "f64.nearest",
+  "f64.sqrt", "f64.add", "f64.sub", "f64.mul", "f64.div", "f64.min",
+  "f64.max", "f64.copysign",
+  "i32.wrap_i64", "i32.trunc_f32_s", "i32.trunc_f32_u", "i32.trunc_f64_s",
+  "i32.trunc_f64_u", "i64.extend_i32_s", "i64.extend_i32_u",
+  "i64.trunc_f32_s", "i64.trunc_f32_u", "i64.trunc_f64_s", "i64.trunc_f64_u",
+  "f32.convert_i32_s", "f32.convert_i32_u", "f32.convert_i64_s",
+  "f32.convert_i64_u", "f32.demote_f64", "f64.convert_i32_s",
+  "f64.convert_i32_u", "f64.convert_i64_s", "f64.convert_i64_u",
+  "f64.promote_f32", "i32.reinterpret_f32", "i64.reinterpret_f64",
+  "f32.reinterpret_i32", "f64.reinterpret_i64",
+  "i32.extend8_s", "i32.extend16_s", "i64.extend8_s", "i64.extend16_s",
+  "i64.extend32_s",
+};
+
+// Loads and stores from opcode 0x28, and their alignments
+static struct { char *name; int align; } memory_ops[] = {
+  {"i32.load", 2}, {"i64.load", 3}, {"f32.load", 2}, {"f64.load", 3},
+  {"i32.load8_s", 0}, {"i32.load8_u", 0}, {"i32.load16_s", 1},
+  {"i32.load16_u", 1}, {"i64.load8_s", 0}, {"i64.load8_u", 0},
+  {"i64.load16_s", 1}, {"i64.load16_u", 1}, {"i64.load32_s", 2},
+  {"i64.load32_u", 2}, {"i32.store", 2}, {"i64.store", 3}, {"f32.store", 2},
+  {"f64.store", 3}, {"i32.store8", 0}, {"i32.store16", 1},
+  {"i64.store8", 0}, {"i64.store16", 1}, {"i64.store32", 2},
+};
+
+// SIMD instructions without immediates, which have the 0xfd prefix
+static struct { char *name; int op; } simd_ops[] = {
+  {"v128.not", 0x4d}, {"v128.and", 0x4e}, {"v128.andnot", 0x4f},
+  {"v128.or", 0x50}, {"v128.xor", 0x51},
+  {"i8x16.splat", 0x0f}, {"i16x8.splat", 0x10}, {"i32x4.splat", 0x11},
+  {"i64x2.splat", 0x12}, {"f32x4.splat", 0x13}, {"f64x2.splat", 0x14},
+  {"i8x16.neg", 0x61}, {"i8x16.shl", 0x6b}, {"i8x16.shr_s", 0x6c},
+  {"i8x16.shr_u", 0x6d}, {"i8x16.add", 0x6e}, {"i8x16.sub", 0x71},
+  {"i16x8.neg", 0x81}, {"i16x8.shl", 0x8b}, {"i16x8.shr_s", 0x8c},
+  {"i16x8.shr_u", 0x8d}, {"i16x8.add", 0x8e}, {"i16x8.sub", 0x91},
+  {"i16x8.mul", 0x95},
+  {"i32x4.neg", 0xa1}, {"i32x4.shl", 0xab}, {"i32x4.shr_s", 0xac},
+  {"i32x4.shr_u", 0xad}, {"i32x4.add", 0xae}, {"i32x4.sub", 0xb1},
+  {"i32x4.mul", 0xb5},
+  {"i64x2.neg", 0xc1}, {"i64x2.shl", 0xcb}, {"i64x2.shr_s", 0xcc},
+  {"i64x2.shr_u", 0xcd}, {"i64x2.add", 0xce}, {"i64x2.sub", 0xd1},
+  {"i64x2.mul", 0xd5},
+  {"f32x4.neg", 0xe1}, {"f32x4.sqrt", 0xe3}, {"f32x4.add", 0xe4},
+  {"f32x4.sub", 0xe5}, {"f32x4.mul", 0xe6}, {"f32x4.div", 0xe7},
+  {"f64x2.neg", 0xed}, {"f64x2.sqrt", 0xef}, {"f64x2.add", 0xf0},
+  {"f64x2.sub", 0xf1}, {"f64x2.mul", 0xf2}, {"f64x2.div", 0xf3},
+};
+
+static void init_opcodes(void) {
+  if (opcodes.capacity)
+    return;
+
+  add_op("unreachable", 0, 0x00, IMM_NONE, 0);
+  add_op("nop", 0, 0x01, IMM_NONE, 0);
+  add_op("br", 0, 0x0c, IMM_LABEL, 0);
+  add_op("br_if", 0, 0x0d, IMM_LABEL, 0);
+  add_op("br_table", 0, 0x0e, IMM_BR_TABLE, 0);
+  add_op("return", 0, 0x0f, IMM_NONE, 0);
+  add_op("call", 0, 0x10, IMM_FUNC, 0);
+  add_op("drop", 0, 0x1a, IMM_NONE, 0);
+  add_op("select", 0, 0x1b, IMM_NONE, 0);
+  add_op("local.get", 0, 0x20, IMM_LOCAL, 0);
+  add_op("local.set", 0, 0x21, IMM_LOCAL, 0);
+  add_op("local.tee", 0, 0x22, IMM_LOCAL, 0);
+  add_op("global.get", 0, 0x23, IMM_GLOBAL, 0);
+  add_op("global.set", 0, 0x24, IMM_GLOBAL, 0);
+  add_op("memory.size", 0, 0x3f, IMM_MEM, 0);
+  add_op("memory.grow", 0, 0x40, IMM_MEM, 0);
+  add_op("i32.const", 0, 0x41, IMM_I32, 0);
+  add_op("i64.const", 0, 0x42, IMM_I64, 0);
+  add_op("f32.const", 0, 0x43, IMM_F32, 0);
+  add_op("f64.const", 0, 0x44, IMM_F64, 0);
+  add_op("memory.copy", 0xfc, 10, IMM_MEM2, 0);
+  add_op("memory.fill", 0xfc, 11, IMM_MEM, 0);
+
+  for (int i = 0; i < sizeof(memory_ops) / sizeof(*memory_ops); i++)
+    add_op(memory_ops[i].name, 0, 0x28 + i, IMM_MEMARG, memory_ops[i].align);
+
+  for (int i = 0; i < sizeof(numeric_ops) / sizeof(*numeric_ops); i++)
+    add_op(numeric_ops[i], 0, 0x45 + i, IMM_NONE, 0);
+
+  add_op("v128.load", 0xfd, 0x00, IMM_MEMARG, 4);
+  add_op("v128.store", 0xfd, 0x0b, IMM_MEMARG, 4);
+  add_op("v128.const", 0xfd, 0x0c, IMM_V128, 0);
+  for (int i = 0; i < sizeof(simd_ops) / sizeof(*simd_ops); i++)
+    add_op(simd_ops[i].name, 0xfd, simd_ops[i].op, IMM_NONE, 0);
+
+  // Atomic memory accesses. Each group has the same seven variants.
+  static char *variants[] = {"i32.%s", "i64.%s", "i32.%s8%s", "i32.%s16%s",
+                             "i64.%s8%s", "i64.%s16%s", "i64.%s32%s"};
+  static int aligns[] = {2, 3, 0, 1, 0, 1, 2};
+  static char *rmw[] = {"add", "sub", "and", "or", "xor", "xchg", "cmpxchg"};
+
+  for (int i = 0; i < 7; i++) {
+    add_op(format(variants[i], "atomic.load", "_u"), 0xfe, 0x10 + i,
+           IMM_MEMARG, aligns[i]);
+    add_op(format(variants[i], "atomic.store", ""), 0xfe, 0x17 + i,
+           IMM_MEMARG, aligns[i]);
+  }
+
+  for (int j = 0; j < sizeof(rmw) / sizeof(*rmw); j++) {
+    for (int i = 0; i < 7; i++) {
+      char *name = format(variants[i], "atomic.rmw", "");
+      name = format(i < 2 ? "%s.%s" : "%s.%s_u", name, rmw[j]);
+      add_op(name, 0xfe, 0x1e + j * 7 + i, IMM_MEMARG, aligns[i]);
+    }
+  }
+}
+
+//
+// Instructions
+//
+
+static int valtype(SExpr *e) {
+  if (is_atom(e, "i32")) return 0x7f;
+  if (is_atom(e, "i64")) return 0x7e;
+  if (is_atom(e, "f32")) return 0x7d;
+  if (is_atom(e, "f64")) return 0x7c;
+  if (is_atom(e, "v128")) return 0x7b;
+  error("wasm: line %d: value type expected", e ? e->line_no : line_no);
+}
+
+static bool is_id(SExpr *e) {
+  return e && !e->is_list && e->atom[0] == '$';
+}
+
+static bool is_index(SExpr *e) {
+  return e && !e->is_list && (e->atom[0] == '$' || isdigit(e->atom[0]));
+}
+
+static int lookup(HashMap *map, SExpr *e, char *what) {
+  if (!is_index(e))
+    error("wasm: line %d: %s expected", e ? e->line_no : line_no, what);
+  if (isdigit(e->atom[0]))
+    return read_int(e);
+
+  void *val = hashmap_get2(map, e->atom, e->len);
+  if (!val)
+    error("wasm: line %d: undefined %s: %s", e->line_no, what, atom_str(e));
+  return (intptr_t)val - 1;
+}
+
+static int label_depth(SExpr *e) {
+  if (!is_index(e))
+    error("wasm: line %d: label expected", e ? e->line_no : line_no);
+  if (isdigit(e->atom[0]))
+    return read_int(e);
+
+  for (int i = depth - 1; i >= 0; i--)
+    if (labels[i] && strlen(labels[i]) == e->len &&
+        !strncmp(labels[i], e->atom, e->len))
+      return depth - 1 - i;
+  error("wasm: line %d: undefined label: %s", e->line_no, atom_str(e));
+}
+
+static void push_label(SExpr *e) {
+  if (depth == labels_cap) {
+    labels_cap = labels_cap ? labels_cap * 2 : 16;
+    labels = realloc(labels, sizeof(char *) * labels_cap);
+  }
+  labels[depth++] = is_id(e) ? atom_str(e) : NULL;
+}
+
+// Emits the opening of a block, loop or if, whose label and type
+// start at `e`. Returns the first element after them.
+static SExpr *begin_block(Buf *b, int op, SExpr *e) {
+  emit_byte(b, op);
+  push_label(e);
+  if (is_id(e))
+    e = e->next;
+
+  if (is_form(e, "result")) {
+    emit_byte(b, valtype(e->list->next));
+    e = e->next;
+  } else {
+    emit_byte(b, 0x40);
+  }
+  return e;
+}
+
+static void emit_end(Buf *b) {
+  emit_byte(b, 0x0b);
+  depth--;
+}
+
+// Emits the immediates of an instruction, which start at `e`. Returns
+// the last element consumed, or `prev` if there are none.
+static SExpr *emit_imm(Buf *b, Opcode *o, SExpr *prev, SExpr *e) {
+  switch (o->imm) {
+  case IMM_NONE:
+    return prev;
+  case IMM_MEMARG: {
+    uint64_t offset = 0;
+    int align = o->align;
+    for (; e && !e->is_list; prev = e, e = e->next) {
+      if (!strncmp(e->atom, "offset=", 7))
+        offset = strtoull(e->atom + 7, NULL, 0);
+      else if (!strncmp(e->atom, "align=", 6))
+        for (align = 0; (1UL << align) < strtoull(e->atom + 6, NULL, 0);)
+          align++;
+      else
+        break;
+    }
+    emit_uleb(b, align);
+    emit_uleb(b, offset);
+    return prev;
+  }
+  case IMM_MEM:
+    emit_byte(b, 0);
+    return prev;
+  case IMM_MEM2:
+    emit_byte(b, 0);
+    emit_byte(b, 0);
+    return prev;
+  case IMM_I32:
+    emit_sleb(b, (int32_t)read_int(e));
+    return e;
+  case IMM_I64:
+    emit_sleb(b, (int64_t)read_int(e));
+    return e;
+  case IMM_F32: {
+    if (!e || e->is_list)
+      error("wasm: line %d: number expected", line_no);
+    float f = strtof(atom_str(e), NULL);
+    emit_bytes(b, (char *)&f, 4);
+    return e;
+  }
+  case IMM_F64: {
+    if (!e || e->is_list)
+      error("wasm: line %d: number expected", line_no);
+    double d = strtod(atom_str(e), NULL);
+    emit_bytes(b, (char *)&d, 8);
+    return e;
+  }
+  case IMM_V128: {
+    // A shape such as i32x4 followed by the values of its lanes
+    static struct { char *shape; int size; bool is_float; } shapes[] = {
+      {"i8x16", 1}, {"i16x8", 2}, {"i32x4", 4}, {"i64x2", 8},
+      {"f32x4", 4, true}, {"f64x2", 8, true},
+    };
+
+    int i = 0;
+    while (i < sizeof(shapes) / sizeof(*shapes) && !is_atom(e, shapes[i].shape))
+      i++;
+    if (i == sizeof(shapes) / sizeof(*shapes))
+      error("wasm: line %d: vector shape expected", line_no);
+
+    int sz = shapes[i].size;
+    for (int j = 0; j < 16 / sz; j++) {
+      prev = e;
+      e = e->next;
+      if (!e || e->is_list)
+        error("wasm: line %d: number expected", line_no);
+
+      if (shapes[i].is_float && sz == 4) {
+        float f = strtof(atom_str(e), NULL);
+        emit_bytes(b, (char *)&f, 4);
+      } else if (shapes[i].is_float) {
+        double d = strtod(atom_str(e), NULL);
+        emit_bytes(b, (char *)&d, 8);
+      } else {
+        uint64_t v = read_int(e);
+        emit_bytes(b, (char *)&v, sz);
+      }
+    }
+    return e;
+  }
+  case IMM_LOCAL:
+    emit_uleb(b, lookup(&local_idx, e, "local"));
+    return e;
+  case IMM_GLOBAL:
+    emit_uleb(b, lookup(&global_idx, e, "global"));
+    return e;
+  case IMM_FUNC:
+    emit_uleb(b, lookup(&func_idx, e, "function"));
+    return e;
+  case IMM_LABEL:
+    emit_uleb(b, label_depth(e));
+    return e;
+  case IMM_BR_TABLE: {
+    // The last label is the default.
+    int n = 0;
+    for (SExpr *x = e; is_index(x); x = x->next)
+      n++;
+    if (n == 0)
+      error("wasm: line %d: br_table without labels", line_no);
+
+    emit_uleb(b, n - 1);
+    for (int i = 0; i < n; i++, prev = e, e = e->next)
+      emit_uleb(b, label_depth(e));
+    return prev;
+  }
+  }
+  unreachable();
+}
+
+static Opcode *get_opcode(SExpr *e) {
+  Opcode *o = hashmap_get2(&opcodes, e->atom, e->len);
+  if (!o)
+    error("wasm: line %d: unknown instruction: %s", e->line_no, atom_str(e));
+  return o;
+}
+
+static void emit_opcode(Buf *b, Opcode *o) {
+  if (o->prefix) {
+    emit_byte(b, o->prefix);
+    emit_uleb(b, o->op);
+  } else {
+    emit_byte(b, o->op);
+  }
+}
+
+static void emit_instrs(Buf *b, SExpr *e);
+
+// Emits a folded instruction.
+static void emit_folded(Buf *b, SExpr *e) {
+  SExpr *op = e->list;
+  if (!op || op->is_list)
+    error("wasm: line %d: instruction expected", e->line_no);
+  line_no = e->line_no;
+
+  if (is_atom(op, "block") || is_atom(op, "loop")) {
+    SExpr *body = begin_block(b, is_atom(op, "block") ? 0x02 : 0x03, op->next);
+    emit_instrs(b, body);
+    emit_end(b);
+    return;
+  }
+
+  if (is_atom(op, "if")) {
+    // The condition is given by the operands before `then`.
+    SExpr *x = op->next;
+    if (is_id(x))
+      x = x->next;
+    if (is_form(x, "result"))
+      x = x->next;
+    for (; x && !is_form(x, "then"); x = x->next)
+      emit_folded(b, x);
+    if (!x)
+      error("wasm: line %d: if without then", e->line_no);
+
+    begin_block(b, 0x04, op->next);
+    emit_instrs(b, x->list->next);
+    if (is_form(x->next, "else")) {
+      emit_byte(b, 0x05);
+      emit_instrs(b, x->next->list->next);
+    }
+    emit_end(b);
+    return;
+  }
+
+  Opcode *o = get_opcode(op);
+
+  // Operands come after immediates and are evaluated first.
+  SExpr *last = emit_imm(&(Buf){}, o, op, op->next);
+  for (SExpr *x = last->next; x; x = x->next)
+    emit_folded(b, x);
+
+  emit_opcode(b, o);
+  emit_imm(b, o, op, op->next);
+}
+
+static void emit_instrs(Buf *b, SExpr *e) {
+  for (; e; e = e->next) {
+    if (e->is_list) {
+      emit_folded(b, e);
+      continue;
+    }
+
+    line_no = e->line_no;
+
+    if (is_atom(e, "block") || is_atom(e, "loop") || is_atom(e, "if")) {
+      int op = is_atom(e, "block") ? 0x02 : is_atom(e, "loop") ? 0x03 : 0x04;
+      SExpr *next = begin_block(b, op, e->next);
+
+      // Skip the label and the type.
+      while (e->next != next)
+        e = e->next;
+      continue;
+    }
+
+    if (is_atom(e, "else")) {
+      emit_byte(b, 0x05);
+      continue;
+    }
+
+    if (is_atom(e, "end")) {
+      emit_end(b);
+      continue;
+    }
+
+    Opcode *o = get_opcode(e);
+    emit_opcode(b, o);
+    e = emit_imm(b, o, e, e->next);
+  }
+}
+
+//
+// Module
+//
+
+// Returns the exported name of a field, if any.
+static SExpr *inline_export(SExpr *field) {
+  for (SExpr *e = field->list->next; e; e = e->next)
+    if (is_form(e, "export"))
+      return e->list->next;
+  return NULL;
+}
+
+// Skips the id and inline exports of a field.
+static SExpr *field_body(SExpr *field) {
+  SExpr *e = field->list->next;
+  if (is_id(e))
+    e = e->next;
+  while (is_form(e, "export"))
+    e = e->next;
+  return e;
+}
+
+// Returns the index of the type of a function, adding it to the type
+// section if it's new.
+static int get_func_type(SExpr *field) {
+  Buf params = {}, results = {};
+  int nparams = 0, nresults = 0;
+
+  for (SExpr *e = field_body(field); e; e = e->next) {
+    if (is_form(e, "param")) {
+      SExpr *x = e->list->next;
+      if (is_id(x)) {
+        emit_byte(&params, valtype(x->next));
+        nparams++;
+        continue;
+      }
+      for (; x; x = x->next, nparams++)
+        emit_byte(&params, valtype(x));
+    } else if (is_form(e, "result")) {
+      for (SExpr *x = e->list->next; x; x = x->next, nresults++)
+        emit_byte(&results, valtype(x));
+    } else {
+      break;
+    }
+  }
+
+  Buf ty = {};
+  emit_byte(&ty, 0x60);
+  emit_uleb(&ty, nparams);
+  emit_bytes(&ty, params.data, params.len);
+  emit_uleb(&ty, nresults);
+  emit_bytes(&ty, results.data, results.len);
+
+  void *idx = hashmap_get2(&type_idx, ty.data, ty.len);
+  if (idx)
+    return (intptr_t)idx - 1;
+
+  hashmap_put2(&type_idx, ty.data, ty.len, (void *)(intptr_t)(ntypes + 1));
+  emit_bytes(&types, ty.data, ty.len);
+  return ntypes++;
+}
+
+static void emit_func_body(Buf *code, SExpr *field) {
+  local_idx = (HashMap){};
+  depth = 0;
+
+  // Parameters and locals share the index space.
+  int nlocals = 0;
+  SExpr *e = field_body(field);
+  for (; is_form(e, "param"); e = e->next) {
+    SExpr *x = e->list->next;
+    if (is_id(x))
+      hashmap_put2(&local_idx, x->atom, x->len, (void *)(intptr_t)++nlocals);
+    else
+      for (; x; x = x->next)
+        nlocals++;
+  }
+  while (is_form(e, "result"))
+    e = e->next;
+
+  // Consecutive locals of the same type are encoded as one entry.
+  Buf decls = {};
+  int ndecls = 0;
+  int run_type = 0, run_len = 0;
+
+  for (; is_form(e, "local"); e = e->next) {
+    for (SExpr *x = e->list->next; x; x = x->next) {
+      if (is_id(x)) {
+        hashmap_put2(&local_idx, x->atom, x->len, (void *)(intptr_t)++nlocals);
+        x = x->next;
+      } else {
+        nlocals++;
+      }
+
+      int ty = valtype(x);
+      if (run_len && ty != run_type) {
+        emit_uleb(&decls, run_len);
+        emit_byte(&decls, run_type);
+        ndecls++;
+        run_len = 0;
+      }
+      run_type = ty;
+      run_len++;
+    }
+  }
+
+  if (run_len) {
+    emit_uleb(&decls, run_len);
+    emit_byte(&decls, run_type);
+    ndecls++;
+  }
+
+  Buf body = {};
+  emit_uleb(&body, ndecls);
+  emit_bytes(&body, decls.data, decls.len);
+  emit_instrs(&body, e);
+  emit_byte(&body, 0x0b);
+
+  if (depth)
+    error("wasm: line %d: unterminated block", field->line_no);
+
+  emit_uleb(code, body.len);
+  emit_bytes(code, body.data, body.len);
+}
+
+static void emit_export(Buf *b, SExpr *name, int kind, int idx) {
+  int len;
+  char *s = read_string(name, &len);
+  emit_name(b, s, len);
+  emit_byte(b, kind);
+  emit_uleb(b, idx);
+}
+
+static void emit_const_expr(Buf *b, SExpr *e) {
+  emit_folded(b, e);
+  emit_byte(b, 0x0b);
+}
+
+// Writes the module in a given WAT text in the binary format.
+void assemble_wasm(char *text, FILE *out) {
+  init_opcodes();
+  func_idx = global_idx = type_idx = (HashMap){};
+  types = (Buf){};
+  ntypes = 0;
+  nfuncs = 0;
+  line_no = 1;
+
+  char *p;
+  SExpr *mod = read_sexpr(&p, text);
+  if (!is_form(mod, "module"))
+    error("wasm: module expected");
+
+  // Functions may be referenced before they are defined, so assign
+  // indices first.
+  int nglobals = 0;
+  int nimports = 0;
+  for (SExpr *f = mod->list->next; f; f = f->next) {
+    if (is_form(f, "func")) {
+      SExpr *id = f->list->next;
+      if (is_id(id))
+        hashmap_put2(&func_idx, id->atom, id->len, (void *)(intptr_t)(nfuncs + 1));
+      nfuncs++;
+    } else if (is_form(f, "import")) {
+      SExpr *desc = f->list->next->next->next;
+      if (!is_form(desc, "func"))
+        error("wasm: line %d: unsupported import", f->line_no);
+      if (nfuncs > nimports)
+        error("wasm: line %d: import after a function definition", f->line_no);
+
+      SExpr *id = desc->list->next;
+      if (is_id(id))
+        hashmap_put2(&func_idx, id->atom, id->len, (void *)(intptr_t)(nfuncs + 1));
+      nfuncs++;
+      nimports++;
+    } else if (is_form(f, "global")) {
+      SExpr *id = f->list->next;
+      if (is_id(id))
+        hashmap_put2(&global_idx, id->atom, id->len, (void *)(intptr_t)(nglobals + 1));
+      nglobals++;
+    }
+  }
+
+  Buf import_sec = {}, func_sec = {}, mem_sec = {}, global_sec = {};
+  Buf export_sec = {};
+  Buf code_sec = {}, data_sec = {};
+  int nmems = 0, nexports = 0, ndata = 0;
+  nglobals = 0;
+  int fn = 0;
+
+  for (SExpr *f = mod->list->next; f; f = f->next) {
+    line_no = f->line_no;
+    SExpr *exp = f->is_list ? inline_export(f) : NULL;
+
+    if (is_form(f, "func")) {
+      emit_uleb(&func_sec, get_func_type(f));
+      emit_func_body(&code_sec, f);
+      if (exp) {
+        emit_export(&export_sec, exp, 0x00, fn);
+        nexports++;
+      }
+      fn++;
+      continue;
+    }
+
+    if (is_form(f, "import")) {
+      SExpr *names = f->list->next;
+      for (int i = 0; i < 2; i++) {
+        int len;
+        char *s = read_string(i ? names->next : names, &len);
+        emit_name(&import_sec, s, len);
+      }
+      emit_byte(&import_sec, 0x00);
+      emit_uleb(&import_sec, get_func_type(names->next->next));
+      fn++;
+      continue;
+    }
+
+    if (is_form(f, "memory")) {
+      // The limits flags have 0x04 set for a 64-bit memory.
+      SExpr *e = field_body(f);
+      int flags = 0;
+      if (is_atom(e, "i64")) {
+        flags = 0x04;
+        e = e->next;
+      } else if (is_atom(e, "i32")) {
+        e = e->next;
+      }
+
+      uint64_t min = read_int(e);
+      if (e->next && !e->next->is_list) {
+        emit_byte(&mem_sec, flags | 0x01);
+        emit_uleb(&mem_sec, min);
+        emit_uleb(&mem_sec, read_int(e->next));
+      } else {
+        emit_byte(&mem_sec, flags);
+        emit_uleb(&mem_sec, min);
+      }
+      if (exp) {
+        emit_export(&export_sec, exp, 0x02, nmems);
+        nexports++;
+      }
+      nmems++;
+      continue;
+    }
+
+    if (is_form(f, "global")) {
+      SExpr *e = field_body(f);
+      if (is_form(e, "mut")) {
+        emit_byte(&global_sec, valtype(e->list->next));
+        emit_byte(&global_sec, 0x01);
+      } else {
+        emit_byte(&global_sec, valtype(e));
+        emit_byte(&global_sec, 0x00);
+      }
+      emit_const_expr(&global_sec, e->next);
+      if (exp) {
+        emit_export(&export_sec, exp, 0x03, nglobals);
+        nexports++;
+      }
+      nglobals++;
+      continue;
+    }
+
+    if (is_form(f, "export")) {
+      SExpr *name = f->list->next;
+      SExpr *desc = name ? name->next : NULL;
+      if (is_form(desc, "func"))
+        emit_export(&export_sec, name, 0x00,
+                    lookup(&func_idx, desc->list->next, "function"));
+      else if (is_form(desc, "memory"))
+        emit_export(&export_sec, name, 0x02, read_int(desc->list->next));
+      else if (is_form(desc, "global"))
+        emit_export(&export_sec, name, 0x03,
+                    lookup(&global_idx, desc->list->next, "global"));
+      else
+        error("wasm: line %d: unsupported export", f->line_no);
+      nexports++;
+      continue;
+    }
+
+    if (is_form(f, "data")) {
+      SExpr *e = f->list->next;
+      emit_byte(&data_sec, 0x00);
+      emit_const_expr(&data_sec, e);
+
+      Buf bytes = {};
+      for (e = e->next; e; e = e->next) {
+        int len;
+        char *s = read_string(e, &len);
+        emit_bytes(&bytes, s, len);
+      }
+      emit_uleb(&data_sec, bytes.len);
+      emit_bytes(&data_sec, bytes.data, bytes.len);
+      ndata++;
+      continue;
+    }
+
+    error("wasm: line %d: unsupported module field", f->line_no);
+  }
+
+  fwrite("\0asm\1\0\0\0", 8, 1, out);
+  emit_section(out, 1, &types, ntypes);
+  emit_section(out, 2, &import_sec, nimports);
+  emit_section(out, 3, &func_sec, nfuncs - nimports);
+  emit_section(out, 5, &mem_sec, nmems);
+  emit_section(out, 6, &global_sec, nglobals);
+  emit_section(out, 7, &export_sec, nexports);
+  emit_section(out, 10, &code_sec, nfuncs - nimports);
+  emit_section(out, 11, &data_sec, ndata);
+}
@@ -0,0 +1,138 @@
+#!/bin/bash
+# Generates the synthetic inputs of the compile-time benchmark into
+# the given directory. The output is deterministic, so that timings
+# can be compared between runs.
+dir=$1
+mkdir -p $dir
+
+# An SQLite-style amalgamation: one large translation unit made of
+# many modules, each with its own types, static helpers, a vtable and
+# string tables.
+awk 'BEGIN {
+  print "#include <stdio.h>"
+  print "#include <stdlib.h>"
+  print "#include <string.h>"
+  print "#include <stdint.h>"
+  print "#include <stdarg.h>"
+  for (m = 0; m < 300; m++) {
+    print "/************** Begin file mod" m ".c **************/"
+    print "typedef struct Mod" m " Mod" m ";"
+    print "struct Mod" m " { int n; int cap; char *buf; Mod" m " *next; double w[4]; };"
+    print "typedef struct { int (*step)(Mod" m " *, int); void (*reset)(Mod" m " *); } Mod" m "Vtab;"
+    print "static const char *mod" m "_names[] = {\"open\", \"close\", \"read\", \"write\", \"seek\"};"
+    print "static int mod" m "_grow(Mod" m " *p, int n) {"
+    print "  if (p->n + n <= p->cap) return 0;"
+    print "  int cap = p->cap ? p->cap * 2 : 16;"
+    print "  while (cap < p->n + n) cap *= 2;"
+    print "  char *buf = realloc(p->buf, cap);"
+    print "  if (!buf) return -1;"
+    print "  p->buf = buf; p->cap = cap;"
+    print "  return 0;"
+    print "}"
+    print "static int mod" m "_step(Mod" m " *p, int op) {"
+    print "  int rc = 0;"
+    print "  switch (op) {"
+    print "  case 0: rc = mod" m "_grow(p, 8); break;"
+    print "  case 1: p->n = 0; break;"
+    print "  case 2: for (int i = 0; i < p->n; i++) rc += p->buf[i] * (i + " m "); break;"
+    print "  case 3: if (mod" m "_grow(p, 1) == 0) p->buf[p->n++] = (char)op; break;"
+    print "  default: rc = (int)strlen(mod" m "_names[op % 5]); break;"
+    print "  }"
+    print "  for (Mod" m " *q = p->next; q; q = q->next) rc ^= q->n << (op & 7);"
+    print "  p->w[op & 3] += rc * 0.5;"
+    print "  return rc;"
+    print "}"
+    print "static void mod" m "_reset(Mod" m " *p) { free(p->buf); memset(p, 0, sizeof(*p)); }"
+    print "static const Mod" m "Vtab mod" m "_vtab = {mod" m "_step, mod" m "_reset};"
+    print "int mod" m "_run(int n) {"
+    print "  Mod" m " m = {0};"
+    print "  int sum = 0;"
+    print "  for (int i = 0; i < n; i++) sum += mod" m "_vtab.step(&m, i % 6);"
+    print "  mod" m "_vtab.reset(&m);"
+    print "  return sum;"
+    print "}"
+  }
+}' > $dir/amalgamation.c
+
+# Macro-heavy code: an X-macro table expanded several times, nested
+# function-like macros and a header included many times.
+awk 'BEGIN {
+  print "#define CAT2(a, b) a##b"
+  print "#define CAT(a, b) CAT2(a, b)"
+  print "#define STR2(x) #x"
+  print "#define STR(x) STR2(x)"
+  print "#define MAX(a, b) ((a) > (b) ? (a) : (b))"
+  print "#define MIN(a, b) ((a) < (b) ? (a) : (b))"
+  print "#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)"
+  print "#define REP4(x) x x x x"
+  print "#define REP16(x) REP4(REP4(x))"
+  print "#define OPS(X) \\"
+  for (i = 0; i < 400; i++)
+    print "  X(op" i ", " i ", CLAMP(" i " * 3, 10, 900)) \\"
+  print ""
+  print "#define ENUM(name, val, w) CAT(OP_, name) = val,"
+  print "enum { OPS(ENUM) };"
+  print "#define NAME(name, val, w) STR(name),"
+  print "const char *op_names[] = { OPS(NAME) };"
+  print "#define WEIGHT(name, val, w) [val] = w,"
+  print "int op_weights[] = { OPS(WEIGHT) };"
+  print "#define CASE(name, val, w) case CAT(OP_, name): return MAX(w, x);"
+  print "int weigh(int op, int x) { switch (op) { OPS(CASE) } return 0; }"
+  print "int sum(int x) { int s = 0; REP16(REP16(s += CLAMP(x, 0, 100);)) return s; }"
+  for (i = 0; i < 50; i++) {
+    print "#define ITER " i
+    print "#include \"macros.h\""
+    print "#undef ITER"
+  }
+}' > $dir/macros.c
+cat > $dir/macros.h <<'EOF'
+#include <stddef.h>
+#include <limits.h>
+int CAT(iter_, ITER)(int x) { return CLAMP(x, ITER, INT_MAX / 2) + (int)sizeof(size_t); }
+EOF
+
+# A large table of initialized structs.
+awk 'BEGIN {
+  print "struct entry { const char *name; int id; double w; unsigned char bytes[4]; struct { short lo, hi; } r; };"
+  print "struct entry table[] = {"
+  for (i = 0; i < 20000; i++)
+    printf "  {\"entry%d\", %d, %d.25, {%d, %d, %d, %d}, {%d, %d}},\n", i, i, i % 97, i % 256, (i * 7) % 256, (i * 13) % 256, (i * 31) % 256, -i % 1000, i % 1000
+  print "};"
+  print "int codes[] = {"
+  for (i = 0; i < 50000; i++)
+    printf "%d,%s", (i * 2654435761) % 65536, (i % 16 == 15) ? "\n" : " "
+  print "};"
+}' > $dir/table.c
+
+# Deeply nested and very long expressions.
+awk 'BEGIN {
+  for (f = 0; f < 20; f++) {
+    printf "int nest%d(int a, int b) {\n  return ", f
+    for (i = 0; i < 200; i++)
+      printf "(a %s ", (i % 3 == 0) ? "+" : (i % 3 == 1) ? "*" : "^"
+    printf "b"
+    for (i = 0; i < 200; i++)
+      printf " + %d)", i
+    print ";\n}"
+    printf "int chain%d(int a, int b) {\n  return a", f
+    for (i = 0; i < 2000; i++)
+      printf " %s %s", (i % 4 == 0) ? "+" : (i % 4 == 1) ? "-" : (i % 4 == 2) ? "|" : "&", (i % 2) ? "a" : "b"
+    print ";\n}"
+    printf "int cond%d(int a) {\n  return ", f
+    for (i = 0; i < 100; i++)
+      printf "a == %d ? %d : ", i, i * i
+    print "-1;\n}"
+  }
+}' > $dir/nested.c
+
+# Thousands of small functions.
+awk 'BEGIN {
+  print "struct point { int x, y; };"
+  for (i = 0; i < 5000; i++) {
+    if (i == 0) {
+      print "int f0(int x) { return x; }"
+      continue
+    }
+    printf "int f%d(int x) { struct point p = {x, %d}; if (p.x > p.y) return f%d(x - 1) + p.y; return p.x * %d; }\n", i, i, i - 1, i % 13
+  }
+}' > $dir/funcs.c
@@ -0,0 +1,110 @@
+#!/bin/bash
+# Measures how fast chibicc compiles the benchmark inputs.
+#
+#   bench/run.sh ./chibicc
+#
+# Each input is compiled to assembly BENCH_RUNS times, and the fastest
+# run is reported with its per-phase times, peak RSS and the size of
+# the .s file. A run fails if the total time or the peak RSS of any
+# input is more than BENCH_THRESHOLD percent over bench/baseline.
+#
+# Timings depend on the machine, so the baseline is not checked in.
+# The first run records it, and BENCH_UPDATE=1 records it again, e.g.
+# before starting work on a change.
+chibicc=$(realpath $1)
+runs=${BENCH_RUNS:-5}
+threshold=${BENCH_THRESHOLD:-10}
+baseline=bench/baseline
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+bench/gen.sh $tmp/src
+
+# Prints "tokenize preprocess parse codegen total rss" for one
+# compilation, read from -ftime-report=json.
+compile() {
+    $chibicc $BENCH_CFLAGS -S -o $tmp/out.s -ftime-report=json "$@" 2>&1 >/dev/null |
+        grep '^{"phases"' |
+        awk '{
+          n = split("tokenize preprocess parse codegen", ph, " ")
+          for (i = 1; i <= n; i++) {
+            t = 0
+            if (match($0, "\"" ph[i] "\":\\{\"time_ms\":[0-9.]+,\"peak_rss_kb\":[0-9]+")) {
+              split(substr($0, RSTART, RLENGTH), f, ":")
+              t = f[3] + 0
+              r = f[4] + 0
+              if (r > rss) rss = r
+            }
+            printf "%.1f ", t
+          }
+          match($0, /"total_ms":[0-9.]+/)
+          printf "%.1f %d\n", substr($0, RSTART + 11, RLENGTH - 11), rss
+        }'
+}
+
+# Compiles each of the given files `runs` times and prints the phase
+# times of the fastest runs summed over all files, the largest peak
+# RSS and the total .s bytes.
+measure() {
+    name=$1
+    shift
+    for f in "$@"; do
+        for i in $(seq $runs); do
+            line=$(compile $f)
+            [ -n "$line" ] || { echo "bench: failed to compile $f" >&2; exit 1; }
+            echo $line $(wc -c < $tmp/out.s)
+        done | sort -n -k5 | head -1
+    done | awk -v name=$name '{
+      for (i = 1; i <= 5; i++) s[i] += $i
+      if ($6 > rss) rss = $6
+      bytes += $7
+    } END {
+      printf "%s %.1f %.1f %.1f %.1f %.1f %d %d\n", name, s[1], s[2], s[3], s[4], s[5], rss, bytes
+    }'
+}
+
+{
+    measure amalgamation $tmp/src/amalgamation.c
+    measure macros $tmp/src/macros.c
+    measure table $tmp/src/table.c
+    measure nested $tmp/src/nested.c
+    measure funcs $tmp/src/funcs.c
+    # chibicc's own sources, as compiled for stage2
+    measure self $(ls *.c)
+} > $tmp/results || exit 1
+
+if [ "$BENCH_UPDATE" = 1 ] || [ ! -f $baseline ]; then
+    {
+        echo "# name total_ms peak_rss_kb asm_bytes"
+        awk '{ print $1, $6, $7, $8 }' $tmp/results
+    } > $baseline
+    echo "bench: wrote $baseline"
+    baseline=/dev/null
+fi
+
+awk -v threshold=$threshold -v baseline=$baseline '
+  BEGIN {
+    while ((getline line < baseline) > 0) {
+      split(line, f, " ")
+      if (f[1] !~ /^#/) { base_ms[f[1]] = f[2]; base_rss[f[1]] = f[3]; base_bytes[f[1]] = f[4] }
+    }
+  }
+  NR == 1 {
+    printf "%-14s %9s %10s %8s %8s %9s %9s %11s  %s\n", "input", "tokenize",
+           "preprocess", "parse", "codegen", "total ms", "RSS (KB)", ".s bytes", "vs baseline"
+  }
+  {
+    cmp = "-"
+    if ($1 in base_ms) {
+      dt = ($6 - base_ms[$1]) * 100 / base_ms[$1]
+      dr = ($7 - base_rss[$1]) * 100 / base_rss[$1]
+      cmp = sprintf("time %+.1f%% rss %+.1f%% .s %+d", dt, dr, $8 - base_bytes[$1])
+      if (dt > threshold || dr > threshold) {
+        cmp = cmp "  REGRESSION"
+        failed = 1
+      }
+    }
+    printf "%-14s %9s %10s %8s %8s %9s %9s %11s  %s\n", $1, $2, $3, $4, $5, $6, $7, $8, cmp
+  }
+  END { exit failed }
+' $tmp/results
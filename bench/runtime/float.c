@@ -0,0 +1,68 @@
+// Floating-point loops: a Mandelbrot set and a small n-body step.
+
+typedef struct {
+  double x, y, z, vx, vy, vz, m;
+} Body;
+
+static Body bodies[5] = {
+  {0, 0, 0, 0, 0, 0, 39.47},
+  {4.84, -1.16, -0.10, 0.60, 2.81, -0.02, 0.037},
+  {8.34, 4.12, -0.40, -1.01, 1.82, 0.008, 0.011},
+  {12.89, -15.11, -0.22, 1.08, 0.86, -0.01, 0.0017},
+  {15.37, -25.91, 0.17, 0.97, 0.59, -0.03, 0.002},
+};
+
+static double sqrt_newton(double x) {
+  double r = x > 1 ? x : 1;
+  for (int i = 0; i < 20; i++)
+    r = 0.5 * (r + x / r);
+  return r;
+}
+
+static void advance(double dt) {
+  for (int i = 0; i < 5; i++)
+    for (int j = i + 1; j < 5; j++) {
+      double dx = bodies[i].x - bodies[j].x;
+      double dy = bodies[i].y - bodies[j].y;
+      double dz = bodies[i].z - bodies[j].z;
+      double d2 = dx * dx + dy * dy + dz * dz;
+      double mag = dt / (d2 * sqrt_newton(d2));
+      bodies[i].vx -= dx * bodies[j].m * mag;
+      bodies[i].vy -= dy * bodies[j].m * mag;
+      bodies[i].vz -= dz * bodies[j].m * mag;
+      bodies[j].vx += dx * bodies[i].m * mag;
+      bodies[j].vy += dy * bodies[i].m * mag;
+      bodies[j].vz += dz * bodies[i].m * mag;
+    }
+  for (int i = 0; i < 5; i++) {
+    bodies[i].x += dt * bodies[i].vx;
+    bodies[i].y += dt * bodies[i].vy;
+    bodies[i].z += dt * bodies[i].vz;
+  }
+}
+
+static int mandel(int w, int h) {
+  int count = 0;
+  for (int py = 0; py < h; py++)
+    for (int px = 0; px < w; px++) {
+      double cr = 2.0 * px / w - 1.5, ci = 2.0 * py / h - 1.0;
+      double zr = 0, zi = 0;
+      int i = 0;
+      while (i < 100 && zr * zr + zi * zi < 4) {
+        double t = zr * zr - zi * zi + cr;
+        zi = 2 * zr * zi + ci;
+        zr = t;
+        i++;
+      }
+      count += i;
+    }
+  return count;
+}
+
+int main() {
+  int sum = mandel(200, 150);
+  for (int i = 0; i < 20000; i++)
+    advance(0.01);
+  sum += (int)(bodies[0].x * 1000);
+  return sum & 0xff;
+}
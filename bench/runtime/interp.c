@@ -0,0 +1,51 @@
+// A switch-dispatch bytecode interpreter.
+
+enum { PUSH, LOAD, STORE, ADD, SUB, MUL, MOD, LT, JZ, JMP, DUP, POP, HALT };
+
+// s = 0; for (i = 0; i < n; i++) s = (s + i * i) % 1000003;
+static int program[] = {
+  PUSH, 0, STORE, 1,          // s = 0
+  PUSH, 0, STORE, 2,          // i = 0
+  LOAD, 2, LOAD, 0, LT,       // 8: i < n
+  JZ, 40,
+  LOAD, 1, LOAD, 2, LOAD, 2,
+  MUL, ADD, PUSH, 1000003, MOD,
+  STORE, 1,                   // s = (s + i * i) % 1000003
+  LOAD, 2, PUSH, 1, ADD,
+  STORE, 2,                   // i++
+  JMP, 8,
+  HALT, HALT, HALT,
+  LOAD, 1, HALT,              // 40
+};
+
+static int run(int n) {
+  int stack[64];
+  int vars[4] = {n};
+  int sp = 0;
+  int pc = 0;
+
+  for (;;) {
+    switch (program[pc++]) {
+    case PUSH: stack[sp++] = program[pc++]; break;
+    case LOAD: stack[sp++] = vars[program[pc++]]; break;
+    case STORE: vars[program[pc++]] = stack[--sp]; break;
+    case ADD: sp--; stack[sp - 1] += stack[sp]; break;
+    case SUB: sp--; stack[sp - 1] -= stack[sp]; break;
+    case MUL: sp--; stack[sp - 1] *= stack[sp]; break;
+    case MOD: sp--; stack[sp - 1] %= stack[sp]; break;
+    case LT: sp--; stack[sp - 1] = stack[sp - 1] < stack[sp]; break;
+    case JZ: if (!stack[--sp]) pc = program[pc]; else pc++; break;
+    case JMP: pc = program[pc]; break;
+    case DUP: stack[sp] = stack[sp - 1]; sp++; break;
+    case POP: sp--; break;
+    case HALT: return sp ? stack[sp - 1] : 0;
+    }
+  }
+}
+
+int main() {
+  int sum = 0;
+  for (int i = 0; i < 20; i++)
+    sum += run(50000 + i);
+  return sum & 0xff;
+}
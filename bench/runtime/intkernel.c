@@ -0,0 +1,60 @@
+// Integer kernels: a sieve, CRC-32 and a small matrix multiply.
+
+static char sieve[8192];
+static unsigned char buf[1024];
+static int a[16][16], b[16][16], c[16][16];
+
+static int count_primes(int n) {
+  for (int i = 0; i < n; i++)
+    sieve[i] = 1;
+  sieve[0] = sieve[1] = 0;
+  for (int i = 2; i * i < n; i++)
+    if (sieve[i])
+      for (int j = i * i; j < n; j += i)
+        sieve[j] = 0;
+  int count = 0;
+  for (int i = 0; i < n; i++)
+    count += sieve[i];
+  return count;
+}
+
+static unsigned crc32(unsigned char *p, int len) {
+  unsigned crc = 0xffffffff;
+  for (int i = 0; i < len; i++) {
+    crc ^= p[i];
+    for (int k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static int matmul(void) {
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++) {
+      int sum = 0;
+      for (int k = 0; k < 16; k++)
+        sum += a[i][k] * b[k][j];
+      c[i][j] = sum;
+    }
+  return c[5][7];
+}
+
+int main() {
+  for (int i = 0; i < sizeof(buf); i++)
+    buf[i] = i * 7 + 3;
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++) {
+      a[i][j] = i + j;
+      b[i][j] = i - j;
+    }
+
+  unsigned sum = 0;
+  for (int iter = 0; iter < 800; iter++) {
+    sum += count_primes(sizeof(sieve));
+    buf[iter % sizeof(buf)]++;
+    sum ^= crc32(buf, sizeof(buf));
+    a[iter % 16][3] = iter;
+    sum += matmul();
+  }
+  return sum & 0xff;
+}
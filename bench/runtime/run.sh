@@ -0,0 +1,68 @@
+#!/bin/bash
+# Measures how fast code generated by chibicc runs.
+#
+#   bench/runtime/run.sh ./chibicc
+#
+# Each kernel in bench/runtime is compiled with gcc -O0, gcc -O1,
+# chibicc for x86-64 and chibicc --emit-wasm. The wasm module is run
+# with node. Every program is run BENCH_RUNS times and the fastest
+# run is reported, along with its time relative to gcc -O0 and -O1.
+# BENCH_CFLAGS is passed to chibicc for both targets. The programs'
+# exit codes are checksums, and a run fails if they disagree.
+chibicc=$(realpath $1)
+runs=${BENCH_RUNS:-5}
+dir=bench/runtime
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+# Prints "checksum ms" of the fastest of `runs` runs of a command.
+run_native() {
+    for i in $(seq $runs); do
+        start=$(date +%s%N)
+        "$@"
+        sum=$?
+        echo $sum $(( ($(date +%s%N) - start) / 1000 )) | awk '{ printf "%d %.1f\n", $1, $2 / 1000 }'
+    done | sort -n -k2 | head -1
+}
+
+run_wasm() {
+    for i in $(seq $runs); do
+        node $dir/wasm.js "$@" || exit 1
+    done | sort -n -k2 | head -1
+}
+
+for src in $dir/*.c; do
+    name=$(basename $src .c)
+    gcc -O0 -o $tmp/$name.O0 $src &&
+        gcc -O1 -o $tmp/$name.O1 $src &&
+        $chibicc $BENCH_CFLAGS -o $tmp/$name $src &&
+        $chibicc $BENCH_CFLAGS --emit-wasm -S -o $tmp/$name.wasm $src || exit 1
+
+    set -- $(run_native $tmp/$name.O0) $(run_native $tmp/$name.O1) \
+        $(run_native $tmp/$name) $(run_wasm $tmp/$name.wasm)
+    if [ "$1 $1 $1" != "$3 $5 $7" ]; then
+        echo "$name: checksums differ: gcc -O0 $1, gcc -O1 $3, chibicc $5, wasm $7"
+        exit 1
+    fi
+    echo $name $2 $4 $6 $8 >> $tmp/results
+done
+
+awk '
+  NR == 1 {
+    printf "%-12s %8s %8s %8s %7s %7s %8s %7s %7s\n", "kernel", "gcc -O0", "gcc -O1",
+           "chibicc", "vs -O0", "vs -O1", "wasm", "vs -O0", "vs -O1"
+  }
+  {
+    printf "%-12s %8.1f %8.1f %8.1f %6.2fx %6.2fx %8.1f %6.2fx %6.2fx\n", $1, $2, $3, $4,
+           $4 / $2, $4 / $3, $5, $5 / $2, $5 / $3
+    n++
+    for (i = 2; i <= 5; i++) logsum[i] += log($i)
+  }
+  END {
+    if (n == 0)
+      exit
+    for (i = 2; i <= 5; i++) g[i] = exp(logsum[i] / n)
+    printf "%-12s %8.1f %8.1f %8.1f %6.2fx %6.2fx %8.1f %6.2fx %6.2fx\n", "geomean", g[2], g[3],
+           g[4], g[4] / g[2], g[4] / g[3], g[5], g[5] / g[2], g[5] / g[3]
+  }' $tmp/results
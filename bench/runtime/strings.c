@@ -0,0 +1,75 @@
+// String processing: length, comparison, hashing, reversal and word
+// splitting on a static buffer. No libc, so that it also runs as wasm.
+
+static char text[4096];
+static char *words[1024];
+
+static int my_strlen(char *s) {
+  int n = 0;
+  while (s[n])
+    n++;
+  return n;
+}
+
+static int my_strcmp(char *a, char *b) {
+  while (*a && *a == *b)
+    a++, b++;
+  return (unsigned char)*a - (unsigned char)*b;
+}
+
+static unsigned hash(char *s) {
+  unsigned h = 2166136261u;
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+}
+
+static void reverse(char *s, int n) {
+  for (int i = 0, j = n - 1; i < j; i++, j--) {
+    char c = s[i];
+    s[i] = s[j];
+    s[j] = c;
+  }
+}
+
+static int split(char *s) {
+  int n = 0;
+  while (*s) {
+    while (*s == ' ')
+      *s++ = '\0';
+    if (*s)
+      words[n++] = s;
+    while (*s && *s != ' ')
+      s++;
+  }
+  return n;
+}
+
+static void fill(void) {
+  static char *vocab[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"};
+  int pos = 0;
+  for (int i = 0; pos + 10 < sizeof(text); i++) {
+    char *w = vocab[(i * 5 + i / 3) % 8];
+    while (*w)
+      text[pos++] = *w++;
+    text[pos++] = ' ';
+  }
+  text[pos] = '\0';
+}
+
+int main() {
+  unsigned sum = 0;
+  for (int iter = 0; iter < 1200; iter++) {
+    fill();
+    int len = my_strlen(text);
+    reverse(text, len);
+    reverse(text, len);
+    int n = split(text);
+    for (int i = 0; i < n; i++) {
+      sum += hash(words[i]);
+      if (i && my_strcmp(words[i - 1], words[i]) < 0)
+        sum++;
+    }
+  }
+  return sum & 0xff;
+}
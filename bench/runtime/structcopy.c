@@ -0,0 +1,45 @@
+// Code that copies structs around: by value arguments, return values
+// and assignments.
+
+typedef struct {
+  int id;
+  short kind;
+  char tag[6];
+  double weight;
+  long next;
+} Item;
+
+static Item items[256];
+
+static Item make(int i) {
+  Item it = {i, i % 7, "item", i * 0.5, i + 1};
+  it.tag[4] = 'a' + i % 26;
+  return it;
+}
+
+static Item heavier(Item a, Item b) {
+  return a.weight >= b.weight ? a : b;
+}
+
+static void swap(Item *a, Item *b) {
+  Item t = *a;
+  *a = *b;
+  *b = t;
+}
+
+int main() {
+  for (int i = 0; i < 256; i++)
+    items[i] = make(i * 37 % 256);
+
+  long sum = 0;
+  for (int iter = 0; iter < 20000; iter++) {
+    Item best = items[0];
+    for (int i = 1; i < 256; i++)
+      best = heavier(best, items[i]);
+    sum += best.id + best.tag[4];
+    for (int i = 0; i + 1 < 256; i += 2)
+      swap(&items[i], &items[i + 1]);
+    items[iter % 256].weight += 1;
+  }
+  return sum & 0xff;
+}
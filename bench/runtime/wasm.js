@@ -0,0 +1,19 @@
+// Runs a wasm module made by chibicc --emit-wasm and prints the value
+// returned by its main function and the time it took in milliseconds.
+// Compilation and instantiation are not included in the time.
+//
+//   node bench/runtime/wasm.js foo.wasm
+'use strict';
+const fs = require('fs');
+
+const bytes = fs.readFileSync(process.argv[2]);
+const env = new Proxy({}, {
+  get: (_, name) => () => { throw new Error(`import ${String(name)} called`); },
+});
+
+WebAssembly.instantiate(bytes, { env }).then(({ instance }) => {
+  const start = performance.now();
+  const ret = instance.exports._start();
+  const ms = performance.now() - start;
+  console.log(`${Number(ret) & 0xff} ${ms.toFixed(1)}`);
+});
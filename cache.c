@@ -0,0 +1,248 @@
+// This file implements a content-addressed compilation cache.
+//
+// If -fcache-dir=<dir> is given, cc1 computes a hash of the
+// preprocessed token stream and the flags that affect code
+// generation. If a file with that name exists in the cache directory,
+// it is the output of a previous compilation of the same input, so
+// cc1 copies it instead of running the parser and the code generator.
+//
+// The cache directory also contains a "stats" file to keep hit/miss
+// counts. If the total size of the cached files exceeds the limit
+// given by -fcache-max-size, the least recently used files are
+// removed.
+
+#include "chibicc.h"
+#include <dirent.h>
+#include <fcntl.h>
+
+char *opt_cache_dir;
+long opt_cache_max_size = 256 * 1024 * 1024;
+
+// We use two independent 64-bit hashes to make collisions
+// practically impossible.
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+} Hasher;
+
+static void hash_bytes(Hasher *h, void *buf, int len) {
+  unsigned char *p = buf;
+  for (int i = 0; i < len; i++) {
+    h->h1 = (h->h1 ^ p[i]) * 0x100000001b3;
+    h->h2 = (h->h2 ^ p[i]) * 0x9e3779b97f4a7c15;
+    h->h2 ^= h->h2 >> 29;
+  }
+}
+
+static void hash_int(Hasher *h, long val) {
+  hash_bytes(h, &val, sizeof(val));
+}
+
+static void hash_str(Hasher *h, char *s) {
+  int len = strlen(s);
+  hash_int(h, len);
+  hash_bytes(h, s, len);
+}
+
+// The compiler binary itself is a part of every hash, so that a new
+// build of chibicc doesn't reuse old results.
+static Hasher new_hasher(void) {
+  Hasher h = {0xcbf29ce484222325, 0x6a09e667f3bcc908};
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0) {
+    hash_int(&h, st.st_ino);
+    hash_int(&h, st.st_size);
+    hash_int(&h, st.st_mtime);
+  }
+  return h;
+}
+
+// Returns a hash of a given string. Also used by precompiled headers.
+char *compiler_hash(char *str) {
+  Hasher h = new_hasher();
+  hash_str(&h, str);
+  return format("%016lx%016lx", h.h1, h.h2);
+}
+
+// Returns a cache key for a given token stream. `flags` should
+// contain everything other than the tokens that affects the output.
+char *cache_key(Token *tok, char *flags) {
+  Hasher h = new_hasher();
+  hash_str(&h, flags);
+
+  // File names and line numbers are part of the output because of
+  // .file and .loc directives.
+  File **files = get_input_files();
+  for (int i = 0; files[i]; i++)
+    hash_str(&h, files[i]->name);
+
+  for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
+    hash_int(&h, t->kind);
+    hash_int(&h, t->file ? t->file->file_no : 0);
+    hash_int(&h, t->line_no);
+    hash_int(&h, t->len);
+    hash_bytes(&h, t->loc, t->len);
+  }
+
+  return format("%016lx%016lx", h.h1, h.h2);
+}
+
+static char *cache_path(char *name) {
+  return format("%s/%s", opt_cache_dir, name);
+}
+
+// Adds given numbers to the hit/miss counters in the stats file.
+static void update_stats(long hits, long misses) {
+  int fd = open(cache_path("stats"), O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return;
+
+  struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (fcntl(fd, F_SETLKW, &lock) == 0) {
+    char buf[64] = {};
+    read(fd, buf, sizeof(buf) - 1);
+
+    long h = 0, m = 0;
+    sscanf(buf, "%ld %ld", &h, &m);
+
+    char *s = format("%ld %ld\n", h + hits, m + misses);
+    lseek(fd, 0, SEEK_SET);
+    ftruncate(fd, 0);
+    write(fd, s, strlen(s));
+  }
+  close(fd);
+}
+
+// Returns the contents of a cache entry, or NULL if not found.
+char *cache_lookup(char *key, size_t *len) {
+  mkdir(opt_cache_dir, 0755);
+
+  char *path = cache_path(key);
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    update_stats(0, 1);
+    return NULL;
+  }
+
+  char *buf;
+  FILE *out = open_memstream(&buf, len);
+  for (;;) {
+    char buf2[4096];
+    int n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
+  }
+  fclose(fp);
+  fclose(out);
+
+  // Update the timestamp for LRU eviction.
+  utimensat(AT_FDCWD, path, NULL, 0);
+  update_stats(1, 0);
+  return buf;
+}
+
+typedef struct {
+  char *path;
+  long size;
+  long mtime;
+} Entry;
+
+static bool is_entry_name(char *name) {
+  if (strlen(name) != 32)
+    return false;
+  for (int i = 0; i < 32; i++)
+    if (!isxdigit(name[i]))
+      return false;
+  return true;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  long x = ((Entry *)a)->mtime;
+  long y = ((Entry *)b)->mtime;
+  return (x > y) - (x < y);
+}
+
+// Reads the list of cache entries. Returns the number of entries.
+static int read_entries(Entry **entries, long *total) {
+  DIR *dir = opendir(opt_cache_dir);
+  if (!dir)
+    return 0;
+
+  int n = 0;
+  *entries = NULL;
+  *total = 0;
+
+  for (struct dirent *de; (de = readdir(dir));) {
+    if (!is_entry_name(de->d_name))
+      continue;
+
+    char *path = cache_path(de->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0)
+      continue;
+
+    if (n % 64 == 0)
+      *entries = realloc(*entries, sizeof(Entry) * (n + 64));
+    (*entries)[n++] = (Entry){path, st.st_size, st.st_mtime};
+    *total += st.st_size;
+  }
+
+  closedir(dir);
+  return n;
+}
+
+// Removes the least recently used entries until the total size
+// gets below the limit.
+static void evict(void) {
+  Entry *entries;
+  long total;
+  int n = read_entries(&entries, &total);
+  if (total <= opt_cache_max_size)
+    return;
+
+  qsort(entries, n, sizeof(Entry), compare_entries);
+  for (int i = 0; i < n && total > opt_cache_max_size; i++)
+    if (unlink(entries[i].path) == 0)
+      total -= entries[i].size;
+}
+
+void cache_store(char *key, char *buf, size_t len) {
+  // Write to a temporary file first and rename it, so that other
+  // processes never see a partially-written entry.
+  char *tmp = cache_path("tmp.XXXXXX");
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    return;
+
+  FILE *out = fdopen(fd, "w");
+  bool ok = fwrite(buf, 1, len, out) == len;
+  ok = (fclose(out) == 0) && ok;
+
+  if (!ok || rename(tmp, cache_path(key)) != 0) {
+    unlink(tmp);
+    return;
+  }
+
+  evict();
+}
+
+void print_cache_stats(FILE *out) {
+  long hits = 0, misses = 0;
+  FILE *fp = fopen(cache_path("stats"), "r");
+  if (fp) {
+    fscanf(fp, "%ld %ld", &hits, &misses);
+    fclose(fp);
+  }
+
+  Entry *entries;
+  long total = 0;
+  int n = read_entries(&entries, &total);
+
+  fprintf(out, "cache directory: %s\n", opt_cache_dir);
+  fprintf(out, "hits:            %ld\n", hits);
+  fprintf(out, "misses:          %ld\n", misses);
+  fprintf(out, "entries:         %d\n", n);
+  fprintf(out, "size:            %ld bytes\n", total);
+  fprintf(out, "max size:        %ld bytes\n", opt_cache_max_size);
+}
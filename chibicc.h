@@ -6,6 +6,7 @@
 #include <libgen.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +45,61 @@ typedef struct {
 void strarray_push(StringArray *arr, char *s);
 char *format(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
+//
+// stats.c
+//
+
+typedef enum {
+  PHASE_TOKENIZE,
+  PHASE_PREPROCESS,
+  PHASE_PARSE,
+  PHASE_CODEGEN,
+  PHASE_NKINDS,
+} Phase;
+
+typedef struct {
+  long tokens;
+  long macro_expansions;
+  long nodes;
+  long asm_bytes;
+} Counters;
+
+extern Counters counters;
+
+Phase phase_enter(Phase phase);
+void phase_leave(Phase prev);
+double now_ms(void);
+double phase_time(Phase phase);
+long phase_peak_rss(Phase phase);
+void print_time_report(FILE *out, bool json);
+
+//
+// alloc.c
+//
+
+typedef enum {
+  ARENA_TOKEN,
+  ARENA_LITERAL,
+  ARENA_NODE,
+  ARENA_TYPE,
+  ARENA_OBJ,
+  ARENA_MEMBER,
+  ARENA_FILE,
+  ARENA_MISC,
+  ARENA_NKINDS,
+} ArenaKind;
+
+typedef struct {
+  void *chunk;
+  char *ptr;
+} ArenaMark;
+
+void *arena_alloc(ArenaKind kind, size_t size);
+ArenaMark arena_mark(ArenaKind kind);
+void arena_release(ArenaKind kind, ArenaMark mark);
+void arena_set_phase(Phase phase);
+void print_mem_stats(FILE *out);
+
 //
 // tokenize.c
 //
@@ -57,53 +113,104 @@ typedef enum {
   TK_NUM,     // Numeric literals
   TK_PP_NUM,  // Preprocessing numbers
   TK_EOF,     // End-of-file markers
+  TK_LAZY,    // Rest of a file that is not tokenized yet
 } TokenKind;
 
 typedef struct {
   char *name;
   int file_no;
   char *contents;
+  char *end; // End of contents
+  bool cache_tokens; // True if this file has been tokenized before
+  long ntokens;      // Number of tokens in this file, counted only
+                     // when it is first tokenized
+  long mtime;        // Modification time in nanoseconds, or 0 if unknown
 
   // For #line directive
   char *display_name;
   int line_delta;
 } File;
 
+// Identifiers, keywords and punctuators are interned, so all tokens
+// with the same spelling share one Atom. The preprocessor and the
+// parser keep their per-name data in it instead of in hash maps.
+typedef struct Atom Atom;
+struct Atom {
+  char *name;          // NUL-terminated spelling
+  int len;
+  int hideset_id;      // Index in hidesets plus one, or 0
+  bool is_keyword;
+  struct Macro *macro; // Macro defined with this name
+  struct Ident *ident; // Scope bindings of this name
+};
+
+Atom *intern_atom(char *name, int len);
+Atom *next_atom(int *idx);
+
 // Token type
 typedef struct Token Token;
-struct Token {
-  TokenKind kind;   // Token kind
-  Token *next;      // Next token
-  int64_t val;      // If kind is TK_NUM, its value
-  long double fval; // If kind is TK_NUM, its value
-  char *loc;        // Token location
-  int len;          // Token length
+// The value of a number or string literal token. Most tokens are
+// identifiers or punctuators, so values are kept out of line to keep
+// Token small.
+typedef struct {
+  int64_t val;      // If TK_NUM, its value
+  long double fval; // If TK_NUM, its value
   Type *ty;         // Used if TK_NUM or TK_STR
   char *str;        // String literal contents including terminating '\0'
+} Literal;
 
+struct Token {
+  Token *next;      // Next token
+  char *loc;        // Token location
   File *file;       // Source location
   char *filename;   // Filename
+  Hideset *hideset; // For macro expansion
+  Atom *atom;       // If TK_IDENT, TK_KEYWORD or TK_PUNCT, its spelling
+
+  union {
+    // If kind is TK_NUM or TK_STR, its value
+    Literal *lit;
+
+    // If kind is TK_IDENT and this is expanded from a macro,
+    // the original token
+    Token *origin;
+
+    // If kind is TK_LAZY, tokens that follow the end of the file
+    Token *rest;
+  };
+
+  int len;          // Token length
   int line_no;      // Line number
   int line_delta;   // Line number
+  uint8_t kind;     // Token kind
   bool at_bol;      // True if this token is at beginning of line
   bool has_space;   // True if this token follows a space character
-  Hideset *hideset; // For macro expansion
-  Token *origin;    // If this is expanded from a macro, the original token
 };
 
 noreturn void error(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 noreturn void error_at(char *loc, char *fmt, ...) __attribute__((format(printf, 2, 3)));
 noreturn void error_tok(Token *tok, char *fmt, ...) __attribute__((format(printf, 2, 3)));
 void warn_tok(Token *tok, char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int column_of(Token *tok);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
 void convert_pp_tokens(Token *tok);
+extern bool cache_all_tokens;
+
 File **get_input_files(void);
 File *new_file(char *name, int file_no, char *contents);
-Token *tokenize_string_literal(Token *tok, Type *basety);
+File *add_input_file(char *path, char *contents);
+int transcode_string_literal(Token *tok, Type *basety, void *buf);
 Token *tokenize(File *file);
 Token *tokenize_file(char *filename);
+void set_file_contents(char *path, char *p, size_t len);
+void print_token_cache(FILE *out, bool (*filter)(char *path));
+void preload_tokens(char *path, long offset);
+Token *tokenize_rest(Token *tok);
+Token *skip_cond_text(Token *tok);
+bool is_include_guard(Token *tok, char *macro);
+Token *append_tokens(Token *tok1, Token *tok2);
 
 #define unreachable() \
   error("internal error at %s:%d", __FILE__, __LINE__)
@@ -117,6 +224,11 @@ void init_macros(void);
 void define_macro(char *name, char *buf);
 void undef_macro(char *name);
 Token *preprocess(Token *tok);
+void write_pch(Token *tok, FILE *out);
+Token *read_pch(char *path);
+void print_pp_stats(FILE *out);
+
+extern bool opt_pp_stats;
 
 //
 // parse.c
@@ -134,6 +246,8 @@ struct Obj {
 
   // Local variable
   int offset;
+  int reg;            // Register assigned by -O1, or 0 if in memory
+  bool is_addr_taken; // Set by -O1 and the wasm backend if `&var` appears
 
   // Global variable or function
   bool is_function;
@@ -153,11 +267,16 @@ struct Obj {
   Obj *locals;
   Obj *va_area;
   Obj *alloca_bottom;
+  bool uses_alloca;
   int stack_size;
+  int nregs;          // Callee-saved registers used by -O1
+  int regsave_offset; // Where they are saved
+  int tls_base_offset; // Where the local-dynamic TLS block address is kept
+  char *asm_text; // Code generated by -fstream-codegen
+  size_t asm_len;
 
-  // Static inline function
+  // Reachability from non-static globals
   bool is_live;
-  bool is_root;
   StringArray refs;
 };
 
@@ -222,77 +341,135 @@ typedef enum {
   ND_ASM,       // "asm"
   ND_CAS,       // Atomic compare-and-swap
   ND_EXCH,      // Atomic exchange
+  ND_ATOMIC_OP, // Atomic read-modify-write, e.g. `A += B` for atomic A
 } NodeKind;
 
 // AST node type
+// AST node. Only the common header is allocated for every node;
+// the rest depends on the kind, so new_node() allocates only as many
+// bytes as the kind needs. A field may only be accessed if the node
+// is of a kind that has it.
 struct Node {
-  NodeKind kind; // Node kind
-  Node *next;    // Next node
-  Type *ty;      // Type, e.g. int or pointer to int
-  Token *tok;    // Representative token
-
-  Node *lhs;     // Left-hand side
-  Node *rhs;     // Right-hand side
-
-  // "if" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
-
-  // "break" and "continue" labels
-  char *brk_label;
-  char *cont_label;
-
-  // Block or statement expression
-  Node *body;
+  NodeKind kind;      // Node kind
+  bool pass_by_stack; // Function call argument passed on the stack
+  int8_t expect;      // __builtin_expect: 1 if likely non-zero, -1 if likely zero
+  Node *next;         // Next node
+  Type *ty;           // Type, e.g. int or pointer to int
+  Token *tok;         // Representative token
+
+  Node *lhs;          // Left-hand side
+  Node *rhs;          // Right-hand side
+
+  union {
+    // "if", "for", "do", "switch" and "?:"
+    struct {
+      Node *cond;
+      Node *then;
+      Node *els;
+      Node *init;
+      Node *inc;
+
+      // "break" and "continue" labels
+      char *brk_label;
+      char *cont_label;
+
+      // Switch
+      Node *cases;
+      Node *default_case;
+    };
+
+    // Goto or labeled statement, labels-as-values or case
+    struct {
+      char *label;
+      char *unique_label;
+      Node *goto_next;
+
+      // Case
+      Node *case_next;
+      long begin;
+      long end;
+    };
+
+    // Function call
+    struct {
+      Type *func_ty;
+      Node *args;
+      Obj *ret_buffer;
+    };
+
+    // Atomic compare-and-swap
+    struct {
+      Node *cas_addr;
+      Node *cas_old;
+      Node *cas_new;
+    };
+
+    // Atomic read-modify-write. `lhs` is the address and `rhs` is
+    // the operand.
+    NodeKind atomic_op;
+
+    // Numeric literal
+    struct {
+      int64_t val;
+      long double fval;
+    };
+
+    // Block or statement expression
+    Node *body;
+
+    // Struct member access
+    Member *member;
+
+    // Variable
+    Obj *var;
+
+    // "asm" string literal
+    char *asm_str;
+  };
+};
 
-  // Struct member access
-  Member *member;
+Node *new_node(NodeKind kind, Token *tok);
+Node *new_cast(Node *expr, Type *ty);
+bool is_builtin_call(Node *node, char *name, int nargs);
+int64_t const_expr(Token **rest, Token *tok);
+Obj *parse(Token *tok);
+void mark_reachable(Obj *prog);
 
-  // Function call
-  Type *func_ty;
-  Node *args;
-  bool pass_by_stack;
-  Obj *ret_buffer;
+//
+// fold.c
+//
 
-  // Goto or labeled statement, or labels-as-values
-  char *label;
-  char *unique_label;
-  Node *goto_next;
+void fold(Obj *prog);
+void fold_function(Obj *fn);
+
+//
+// inline.c
+//
 
-  // Switch
-  Node *case_next;
-  Node *default_case;
+void inline_functions(Obj *prog);
 
-  // Case
-  long begin;
-  long end;
+//
+// cse.c
+//
 
-  // "asm" string literal
-  char *asm_str;
+void cse(Obj *prog);
+void cse_function(Obj *fn);
 
-  // Atomic compare-and-swap
-  Node *cas_addr;
-  Node *cas_old;
-  Node *cas_new;
+//
+// vectorize.c
+//
 
-  // Atomic op= operators
-  Obj *atomic_addr;
-  Node *atomic_expr;
+void vectorize(Obj *prog);
+void vectorize_function(Obj *fn);
 
-  // Variable
-  Obj *var;
+//
+// optimize.c
+//
 
-  // Numeric literal
-  int64_t val;
-  long double fval;
-};
+extern bool opt_dump_passes;
 
-Node *new_cast(Node *expr, Type *ty);
-int64_t const_expr(Token **rest, Token *tok);
-Obj *parse(Token *tok);
+void optimize(Obj *prog);
+void optimize_function(Obj *fn);
 
 //
 // type.c
@@ -315,6 +492,7 @@ typedef enum {
   TY_VLA, // variable-length array
   TY_STRUCT,
   TY_UNION,
+  TY_VECTOR, // GCC vector extension, e.g. `__attribute__((vector_size(16)))`
 } TypeKind;
 
 struct Type {
@@ -323,7 +501,9 @@ struct Type {
   int align;          // alignment
   bool is_unsigned;   // unsigned or signed
   bool is_atomic;     // true if _Atomic
+  bool is_volatile;   // true if volatile
   Type *origin;       // for type compatibility check
+  Type *pointer;      // cached pointer_to() of this type
 
   // Pointer-to or array-of type. We intentionally use the same member
   // to represent pointer/array duality in C.
@@ -342,6 +522,10 @@ struct Type {
   // Array
   int array_len;
 
+  // Vector. Unlike arrays, vectors don't decay to pointers, so the
+  // element type is not in `base`. `array_len` is the # of elements.
+  Type *elem;
+
   // Variable-length array
   Node *vla_len; // # of elements
   Obj *vla_size; // sizeof() value
@@ -396,10 +580,12 @@ bool is_flonum(Type *ty);
 bool is_numeric(Type *ty);
 bool is_compatible(Type *t1, Type *t2);
 Type *copy_type(Type *ty);
+Type *volatile_of(Type *ty);
 Type *pointer_to(Type *base);
 Type *func_type(Type *return_ty);
 Type *array_of(Type *base, int size);
 Type *vla_of(Type *base, Node *expr);
+Type *vector_of(Type *elem, int size);
 Type *enum_type(void);
 Type *struct_type(void);
 void add_type(Node *node);
@@ -408,16 +594,90 @@ void add_type(Node *node);
 // dump.c
 //
 
-void dump_tokens(Token *tok);
-void dump_ast(Obj *prog);
+extern int opt_dump_ast_depth;
+extern int opt_dump_ast_node;
+
+void dump_tokens(Token *tok, FILE *out);
+void dump_ast(Obj *prog, FILE *out);
+void dump_tokens_bin(Token *tok, FILE *out);
+void dump_ast_bin(Obj *prog, FILE *out);
+void dump_stage_tokens(FILE *out, Token *tok);
+void dump_stage_preprocessed(FILE *out, char *preprocessed);
+void dump_stage_ast(FILE *out, Obj *prog);
+void dump_stage_assembly(FILE *out, char *assembly);
 
 //
 // codegen.c
 //
 
 void codegen(Obj *prog, FILE *out);
+void codegen_function(Obj *fn);
 void codegen_wasm(Obj *prog, FILE *out);
 int align_to(int n, int align);
+long case_key(Node *sw, long val);
+Node **sort_cases(Node *sw, int *len);
+bool use_jump_table(Node *sw, Node **cases, int n);
+
+//
+// regalloc.c
+//
+
+int alloc_regs(Obj *fn, int nregs);
+
+//
+// peephole.c
+//
+
+typedef struct InsnBuf InsnBuf;
+
+InsnBuf *new_insn_buf(void);
+void insn_add(InsnBuf *buf, char *line);
+void peephole(InsnBuf *buf);
+void insn_emit(InsnBuf *buf, FILE *out);
+char *reg_name(char *reg, int sz);
+
+//
+// parallel.c
+//
+
+extern int opt_codegen_threads;
+
+void gen_functions(Obj *prog, FILE *out, void (*gen)(Obj *fn, FILE *out));
+
+//
+// profile.c
+//
+
+extern char *opt_profile_use;
+
+char *read_profile(char *path);
+bool has_profile(Obj *fn);
+long profile_count(Obj *fn, Node *node, char *kind);
+
+//
+// cache.c
+//
+
+extern char *opt_cache_dir;
+extern long opt_cache_max_size;
+
+char *compiler_hash(char *str);
+char *cache_key(Token *tok, char *flags);
+char *cache_lookup(char *key, size_t *len);
+void cache_store(char *key, char *buf, size_t len);
+void print_cache_stats(FILE *out);
+
+//
+// assemble.c
+//
+
+bool assemble_elf(char *text, FILE *out);
+
+//
+// assemble_wasm.c
+//
+
+void assemble_wasm(char *text, FILE *out);
 
 //
 // unicode.c
@@ -436,6 +696,7 @@ int display_width(char *p, int len);
 typedef struct {
   char *key;
   int keylen;
+  uint64_t hash;
   void *val;
 } HashEntry;
 
@@ -451,6 +712,7 @@ void hashmap_put(HashMap *map, char *key, void *val);
 void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
 void hashmap_delete(HashMap *map, char *key);
 void hashmap_delete2(HashMap *map, char *key, int keylen);
+HashEntry *hashmap_next(HashMap *map, int *idx);
 void hashmap_test(void);
 
 //
@@ -459,7 +721,28 @@ void hashmap_test(void);
 
 bool file_exists(char *path);
 
+// -ftls-model=, from the most general model to the cheapest one
+typedef enum {
+  TLS_GLOBAL_DYNAMIC,
+  TLS_LOCAL_DYNAMIC,
+  TLS_INITIAL_EXEC,
+  TLS_LOCAL_EXEC,
+} TLSModel;
+
 extern StringArray include_paths;
 extern bool opt_fpic;
+extern bool opt_long_double_64;
+extern TLSModel opt_tls_model;
 extern bool opt_fcommon;
+extern bool opt_finline;
+extern bool opt_fcse;
+extern bool opt_ftree_vectorize;
+extern bool opt_fbuiltin;
+extern int opt_O;
+extern bool opt_stream_codegen;
+extern bool opt_bulk_memory;
+extern bool opt_memory64;
+extern bool opt_pg;
+extern bool opt_instrument_functions;
+extern bool opt_profile_generate;
 extern char *base_file;
@@ -1,36 +1,136 @@
 #include "chibicc.h"
+#include <fcntl.h>
 
 #define GP_MAX 6
 #define FP_MAX 8
 
-static FILE *output_file;
-static int depth;
+// Functions may be generated in parallel (see parallel.c), so the
+// state of the function being generated is thread-local.
+static _Thread_local FILE *output_file;
+static _Thread_local InsnBuf *insn_buf;
+static _Thread_local int depth;
+static _Thread_local Obj *current_fn;
+static _Thread_local int label_count;
+
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
 static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
 static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Obj *current_fn;
+
+// With -O1, local variables may live in callee-saved registers
+// (see regalloc.c). Temporaries live in caller-saved registers while
+// an expression that doesn't clobber them is evaluated (see
+// is_simple()).
+#define NUM_REGS 5
+#define NUM_TMPS 5
+#define NUM_FTMPS 8
+
+// Aggregates at least this large are copied with `rep movsb`.
+#define REP_MOVS_MIN 256
+
+static char *calleereg[] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
+static char *tmpreg[] = {"%r11", "%r10", "%r9", "%r8", "%rsi"};
+
+static _Thread_local int ntmps;
+static _Thread_local int nftmps;
+
+// With -O1, a leaf function with a small frame doesn't set up %rbp.
+// Its locals live in the red zone, the 128 bytes below %rsp that
+// signal handlers leave alone, below a scratch area that conversions
+// use. This works only as long as nothing moves %rsp, which
+// `frame_needed` records.
+#define RED_ZONE 128
+#define RED_ZONE_SCRATCH 24
+
+static _Thread_local bool frameless;
+static _Thread_local bool frame_needed;
+
+// With -fprofile-generate, each function has a table of 64-bit
+// counters in .bss. Counter 0 counts calls, the others count how many
+// times an arm of a statement was entered. This holds a description
+// of each counter of the current function, which is written next to
+// the count when the program exits (see emit_profile_runtime()).
+static _Thread_local StringArray prof_names;
+
+// With -fprofile-use or __builtin_expect, an arm of an if statement
+// that is unlikely to run is moved out of line to .text.unlikely, after
+// the rest of the function. This is such an arm along with the state
+// of the code generator at the point where it is jumped to.
+typedef struct ColdBlock ColdBlock;
+struct ColdBlock {
+  ColdBlock *next;
+  Node *node;
+  bool is_then;
+  char *label;
+  char *end;
+  int depth;
+  int ntmps;
+  int nftmps;
+};
+
+static _Thread_local ColdBlock *cold_blocks;
 
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
+static void gen_cond(Node *node, char *t, char *f);
 
 __attribute__((format(printf, 1, 2)))
 static void println(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
+
+  // With -O1, code of a function goes to the peephole optimizer.
+  if (insn_buf) {
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    vfprintf(out, fmt, ap);
+    fclose(out);
+    va_end(ap);
+    insn_add(insn_buf, buf);
+    return;
+  }
+
   vfprintf(output_file, fmt, ap);
   va_end(ap);
   fprintf(output_file, "\n");
 }
 
+// Returns a new label number. Numbers are unique only within a
+// function, so labels also contain the function name.
 static int count(void) {
-  static int i = 1;
-  return i++;
+  return ++label_count;
+}
+
+// Counts how many times the code at this point runs. `kind` tells
+// which part of `node` the point is in.
+static void prof_count(Node *node, char *kind) {
+  if (!opt_profile_generate)
+    return;
+  int i = prof_names.len;
+  strarray_push(&prof_names, format("%s %d %s %d %d %s", current_fn->name, i, kind,
+                                    node->tok->line_no, column_of(node->tok),
+                                    node->tok->file->name));
+  println("  incq .L.prof.ctr.%s+%d(%%rip)", current_fn->name, i * 8);
+}
+
+// Returns a memory operand for a given offset from the frame base,
+// which is %rbp unless the function is frameless. Stack-passed
+// parameters are then just above the return address, and locals are
+// below the scratch area. %rsp is 8 off a 16-byte boundary at entry,
+// so locals keep their alignment.
+static char *local_addr(int offset) {
+  if (!frameless)
+    return format("%d(%%rbp)", offset);
+  if (offset > 0)
+    return format("%d(%%rsp)", offset - 8);
+  return format("%d(%%rsp)", offset - RED_ZONE_SCRATCH);
 }
 
 static void push(void) {
   println("  push %%rax");
   depth++;
+  frame_needed = true;
 }
 
 static void pop(char *arg) {
@@ -42,6 +142,7 @@ static void pushf(void) {
   println("  sub $8, %%rsp");
   println("  movsd %%xmm0, (%%rsp)");
   depth++;
+  frame_needed = true;
 }
 
 static void popf(int reg) {
@@ -50,6 +151,20 @@ static void popf(int reg) {
   depth--;
 }
 
+// A vector value lives in %xmm0.
+static void pushv(void) {
+  println("  sub $16, %%rsp");
+  println("  movdqu %%xmm0, (%%rsp)");
+  depth += 2;
+  frame_needed = true;
+}
+
+static void popv(int reg) {
+  println("  movdqu (%%rsp), %%xmm%d", reg);
+  println("  add $16, %%rsp");
+  depth -= 2;
+}
+
 // Round up `n` to the nearest multiple of `align`. For instance,
 // align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
 int align_to(int n, int align) {
@@ -76,6 +191,172 @@ static char *reg_ax(int sz) {
   unreachable();
 }
 
+static bool is_scalar(Type *ty) {
+  return is_numeric(ty) || ty->kind == TY_PTR;
+}
+
+// Returns how a thread-local variable is accessed. Like GCC, we use the
+// cheapest model that works for the variable unless -ftls-model= asks
+// for a cheaper one. A variable binds locally if it's defined in this
+// TU and can't be preempted, which outside of -fpic is always the case.
+//
+//  - global-dynamic: __tls_get_addr() for each access
+//  - local-dynamic: __tls_get_addr() once per function for the TLS
+//    block of this module, plus a link-time offset for each access
+//  - initial-exec: the offset from %fs is loaded from the GOT
+//  - local-exec: the offset from %fs is a link-time constant
+static TLSModel tls_model(Obj *var) {
+  bool is_local = var->is_definition && (var->is_static || !opt_fpic);
+  TLSModel model;
+  if (opt_fpic)
+    model = is_local ? TLS_LOCAL_DYNAMIC : TLS_GLOBAL_DYNAMIC;
+  else
+    model = is_local ? TLS_LOCAL_EXEC : TLS_INITIAL_EXEC;
+
+  model = MAX(model, opt_tls_model);
+
+  // The TLS block of this module doesn't contain variables of others.
+  if (model == TLS_LOCAL_DYNAMIC && !is_local)
+    return TLS_GLOBAL_DYNAMIC;
+  return model;
+}
+
+// Returns a variable that a node accesses with the local-dynamic TLS
+// model, or NULL if there's none.
+static Obj *local_dynamic_var(Node *node);
+
+static Obj *local_dynamic_var_list(Node *node) {
+  for (Node *n = node; n; n = n->next) {
+    Obj *var = local_dynamic_var(n);
+    if (var)
+      return var;
+  }
+  return NULL;
+}
+
+static Obj *local_dynamic_var(Node *node) {
+  if (!node)
+    return NULL;
+
+  if (node->kind == ND_VAR && node->var->is_tls &&
+      tls_model(node->var) == TLS_LOCAL_DYNAMIC)
+    return node->var;
+
+  Obj *var = local_dynamic_var(node->lhs);
+  if (var)
+    return var;
+  var = local_dynamic_var(node->rhs);
+  if (var)
+    return var;
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND: {
+    Node *kids[] = {node->cond, node->then, node->els, node->init, node->inc};
+    for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+      var = local_dynamic_var(kids[i]);
+      if (var)
+        return var;
+    }
+    return NULL;
+  }
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return local_dynamic_var_list(node->body);
+  case ND_FUNCALL:
+    return local_dynamic_var_list(node->args);
+  case ND_CAS:
+    var = local_dynamic_var(node->cas_addr);
+    var = var ? var : local_dynamic_var(node->cas_old);
+    return var ? var : local_dynamic_var(node->cas_new);
+  }
+  return NULL;
+}
+
+// Returns a memory operand for a variable if it can be accessed
+// without computing its address first.
+static char *var_operand(Obj *var) {
+  if (var->ty->kind == TY_VLA)
+    return NULL;
+  if (var->is_local)
+    return local_addr(var->offset);
+  if (opt_fpic || var->is_tls || var->is_function)
+    return NULL;
+  return format("%s(%%rip)", var->name);
+}
+
+// Moves a value in `src` to a register variable of a given type,
+// extending it the same way as load() does.
+static void store_reg(Type *ty, char *src, char *dst) {
+  char *insn = ty->is_unsigned ? "movz" : "movs";
+
+  if (ty->size == 1)
+    println("  %sbl %s, %s", insn, reg_name(src, 1), reg_name(dst, 4));
+  else if (ty->size == 2)
+    println("  %swl %s, %s", insn, reg_name(src, 2), reg_name(dst, 4));
+  else if (ty->size == 4)
+    println("  movsxd %s, %s", reg_name(src, 4), dst);
+  else
+    println("  mov %s, %s", src, dst);
+}
+
+// Returns true if evaluating a given expression clobbers no registers
+// other than %rax, %rdi, %rdx, %rcx, %xmm0, %xmm1 and the x87 stack,
+// so that temporaries can be kept in other registers meanwhile.
+static bool is_simple(Node *node) {
+  if (!node)
+    return true;
+
+  switch (node->kind) {
+  case ND_NULL_EXPR:
+  case ND_NUM:
+  case ND_LABEL_VAL:
+    return true;
+  case ND_VAR:
+    // A thread-local variable may need a call to __tls_get_addr().
+    return !(node->var->is_tls && tls_model(node->var) == TLS_GLOBAL_DYNAMIC);
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_MEMBER:
+  case ND_CAST:
+  case ND_NEG:
+  case ND_NOT:
+  case ND_BITNOT:
+    return is_simple(node->lhs);
+  case ND_ASSIGN:
+    if (node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION)
+      return false;
+    if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield)
+      return false;
+    return is_simple(node->lhs) && is_simple(node->rhs);
+  case ND_COND:
+    return is_simple(node->cond) && is_simple(node->then) &&
+           is_simple(node->els);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_COMMA:
+  case ND_LOGAND:
+  case ND_LOGOR:
+    return is_simple(node->lhs) && is_simple(node->rhs);
+  }
+  return false;
+}
+
 // Compute the absolute address of a given node.
 // It's an error if a given node does not reside in memory.
 static void gen_addr(Node *node) {
@@ -83,35 +364,46 @@ static void gen_addr(Node *node) {
   case ND_VAR:
     // Variable-length array, which is always local.
     if (node->var->ty->kind == TY_VLA) {
-      println("  mov %d(%%rbp), %%rax", node->var->offset);
+      println("  mov %s, %%rax", local_addr(node->var->offset));
       return;
     }
 
     // Local variable
     if (node->var->is_local) {
-      println("  lea %d(%%rbp), %%rax", node->var->offset);
+      if (node->var->reg)
+        unreachable();
+      println("  lea %s, %%rax", local_addr(node->var->offset));
       return;
     }
 
-    if (opt_fpic) {
-      // Thread-local variable
-      if (node->var->is_tls) {
+    // Thread-local variable
+    if (node->var->is_tls) {
+      switch (tls_model(node->var)) {
+      case TLS_GLOBAL_DYNAMIC:
         println("  data16 lea %s@tlsgd(%%rip), %%rdi", node->var->name);
         println("  .value 0x6666");
         println("  rex64");
         println("  call __tls_get_addr@PLT");
+        frame_needed = true;
+        return;
+      case TLS_LOCAL_DYNAMIC:
+        println("  mov %s, %%rax", local_addr(current_fn->tls_base_offset));
+        println("  add $%s@dtpoff, %%rax", node->var->name);
+        return;
+      case TLS_INITIAL_EXEC:
+        println("  mov %%fs:0, %%rax");
+        println("  add %s@gottpoff(%%rip), %%rax", node->var->name);
+        return;
+      case TLS_LOCAL_EXEC:
+        println("  mov %%fs:0, %%rax");
+        println("  add $%s@tpoff, %%rax", node->var->name);
         return;
       }
-
-      // Function or global variable
-      println("  mov %s@GOTPCREL(%%rip), %%rax", node->var->name);
-      return;
     }
 
-    // Thread-local variable
-    if (node->var->is_tls) {
-      println("  mov %%fs:0, %%rax");
-      println("  add $%s@tpoff, %%rax", node->var->name);
+    // Function or global variable
+    if (opt_fpic) {
+      println("  mov %s@GOTPCREL(%%rip), %%rax", node->var->name);
       return;
     }
 
@@ -138,9 +430,10 @@ static void gen_addr(Node *node) {
     // address of a stuff that may be in a shared object file from the
     // Global Offset Table using `@GOTPCREL(%rip)` notation.
 
-    // Function
+    // Function. A static function is always defined in the same TU,
+    // though it may not have been parsed yet with -fstream-codegen.
     if (node->ty->kind == TY_FUNC) {
-      if (node->var->is_definition)
+      if (node->var->is_definition || node->var->is_static)
         println("  lea %s(%%rip), %%rax", node->var->name);
       else
         println("  mov %s@GOTPCREL(%%rip), %%rax", node->var->name);
@@ -175,15 +468,15 @@ static void gen_addr(Node *node) {
     }
     break;
   case ND_VLA_PTR:
-    println("  lea %d(%%rbp), %%rax", node->var->offset);
+    println("  lea %s, %%rax", local_addr(node->var->offset));
     return;
   }
 
   error_tok(node->tok, "not an lvalue");
 }
 
-// Load a value from where %rax is pointing to.
-static void load(Type *ty) {
+// Load a value from a given memory operand.
+static void load_from(Type *ty, char *addr) {
   switch (ty->kind) {
   case TY_ARRAY:
   case TY_STRUCT:
@@ -198,13 +491,16 @@ static void load(Type *ty) {
     // the first element of the array in C" occurs.
     return;
   case TY_FLOAT:
-    println("  movss (%%rax), %%xmm0");
+    println("  movss %s, %%xmm0", addr);
     return;
   case TY_DOUBLE:
-    println("  movsd (%%rax), %%xmm0");
+    println("  movsd %s, %%xmm0", addr);
     return;
   case TY_LDOUBLE:
-    println("  fldt (%%rax)");
+    println("  fldt %s", addr);
+    return;
+  case TY_VECTOR:
+    println("  movdqu %s, %%xmm0", addr);
     return;
   }
 
@@ -216,46 +512,81 @@ static void load(Type *ty) {
   // register for char, short and int may contain garbage. When we load
   // a long value to a register, it simply occupies the entire register.
   if (ty->size == 1)
-    println("  %sbl (%%rax), %%eax", insn);
+    println("  %sbl %s, %%eax", insn, addr);
   else if (ty->size == 2)
-    println("  %swl (%%rax), %%eax", insn);
+    println("  %swl %s, %%eax", insn, addr);
   else if (ty->size == 4)
-    println("  movsxd (%%rax), %%rax");
+    println("  movsxd %s, %%rax", addr);
   else
-    println("  mov (%%rax), %%rax");
+    println("  mov %s, %%rax", addr);
 }
 
-// Store %rax to an address that the stack top is pointing to.
-static void store(Type *ty) {
-  pop("%rdi");
+// Load a value from where %rax is pointing to.
+static void load(Type *ty) {
+  load_from(ty, "(%rax)");
+}
 
+// Store %rax to a given memory operand. `ty` must be a scalar type.
+static void store_to(Type *ty, char *addr) {
   switch (ty->kind) {
-  case TY_STRUCT:
-  case TY_UNION:
-    for (int i = 0; i < ty->size; i++) {
-      println("  mov %d(%%rax), %%r8b", i);
-      println("  mov %%r8b, %d(%%rdi)", i);
-    }
-    return;
   case TY_FLOAT:
-    println("  movss %%xmm0, (%%rdi)");
+    println("  movss %%xmm0, %s", addr);
     return;
   case TY_DOUBLE:
-    println("  movsd %%xmm0, (%%rdi)");
+    println("  movsd %%xmm0, %s", addr);
     return;
   case TY_LDOUBLE:
-    println("  fstpt (%%rdi)");
+    println("  fstpt %s", addr);
+    return;
+  case TY_VECTOR:
+    println("  movdqu %%xmm0, %s", addr);
     return;
   }
 
-  if (ty->size == 1)
-    println("  mov %%al, (%%rdi)");
-  else if (ty->size == 2)
-    println("  mov %%ax, (%%rdi)");
-  else if (ty->size == 4)
-    println("  mov %%eax, (%%rdi)");
-  else
-    println("  mov %%rax, (%%rdi)");
+  println("  mov %s, %s", reg_ax(ty->size), addr);
+}
+
+// Copies a `size`-byte object from the address in %rax to `off(dst)`
+// using the widest moves that fit, or `rep movsb` for a large object.
+// Clobbers %rcx, %rdx, %rsi, %rdi and %xmm0, which is fine because
+// copies are never part of a simple expression.
+static void copy_mem(char *dst, int off, int size) {
+  if (size >= REP_MOVS_MIN) {
+    println("  lea %d(%s), %%rdi", off, dst);
+    println("  mov %%rax, %%rsi");
+    println("  mov $%d, %%ecx", size);
+    println("  rep movsb");
+    return;
+  }
+
+  int i = 0;
+  for (; i + 16 <= size; i += 16) {
+    println("  movdqu %d(%%rax), %%xmm0", i);
+    println("  movdqu %%xmm0, %d(%s)", off + i, dst);
+  }
+
+  while (i < size) {
+    int n = 8;
+    while (i + n > size)
+      n /= 2;
+    println("  mov %d(%%rax), %s", i, reg_name("%rdx", n));
+    println("  mov %s, %d(%s)", reg_name("%rdx", n), off + i, dst);
+    i += n;
+  }
+}
+
+// Store %rax to an address that the stack top is pointing to.
+static void store(Type *ty) {
+  pop("%rdi");
+
+  switch (ty->kind) {
+  case TY_STRUCT:
+  case TY_UNION:
+    copy_mem("%rdi", 0, ty->size);
+    return;
+  }
+
+  store_to(ty, "(%rdi)");
 }
 
 static void cmp_zero(Type *ty) {
@@ -322,7 +653,13 @@ static char i64f32[] = "cvtsi2ssq %rax, %xmm0";
 static char i64f64[] = "cvtsi2sdq %rax, %xmm0";
 static char i64f80[] = "movq %rax, -8(%rsp); fildll -8(%rsp)";
 
-static char u64f32[] = "cvtsi2ssq %rax, %xmm0";
+// cvtsi2ss and cvtsi2sd take signed operands, so a value with the top
+// bit set is halved, keeping the lowest bit for rounding, and doubled
+// after the conversion.
+static char u64f32[] =
+  "test %rax,%rax; js 1f; pxor %xmm0,%xmm0; cvtsi2ss %rax,%xmm0; jmp 2f; "
+  "1: mov %rax,%rdi; and $1,%eax; pxor %xmm0,%xmm0; shr %rdi; "
+  "or %rax,%rdi; cvtsi2ss %rdi,%xmm0; addss %xmm0,%xmm0; 2:";
 static char u64f64[] =
   "test %rax,%rax; js 1f; pxor %xmm0,%xmm0; cvtsi2sd %rax,%xmm0; jmp 2f; "
   "1: mov %rax,%rdi; and $1,%eax; pxor %xmm0,%xmm0; shr %rdi; "
@@ -338,7 +675,13 @@ static char f32u16[] = "cvttss2sil %xmm0, %eax; movzwl %ax, %eax";
 static char f32i32[] = "cvttss2sil %xmm0, %eax";
 static char f32u32[] = "cvttss2siq %xmm0, %rax";
 static char f32i64[] = "cvttss2siq %xmm0, %rax";
-static char f32u64[] = "cvttss2siq %xmm0, %rax";
+// Likewise, cvttss2si and cvttsd2si return signed values, so 2^63 is
+// subtracted from a value at least that large before the conversion
+// and added back to the result.
+static char f32u64[] =
+  "mov $0x5f000000,%edi; movd %edi,%xmm1; ucomiss %xmm1,%xmm0; jae 1f; "
+  "cvttss2siq %xmm0,%rax; jmp 2f; 1: subss %xmm1,%xmm0; cvttss2siq %xmm0,%rax; "
+  "mov $0x8000000000000000,%rdi; xor %rdi,%rax; 2:";
 static char f32f64[] = "cvtss2sd %xmm0, %xmm0";
 static char f32f80[] = "movss %xmm0, -4(%rsp); flds -4(%rsp)";
 
@@ -349,7 +692,10 @@ static char f64u16[] = "cvttsd2sil %xmm0, %eax; movzwl %ax, %eax";
 static char f64i32[] = "cvttsd2sil %xmm0, %eax";
 static char f64u32[] = "cvttsd2siq %xmm0, %rax";
 static char f64i64[] = "cvttsd2siq %xmm0, %rax";
-static char f64u64[] = "cvttsd2siq %xmm0, %rax";
+static char f64u64[] =
+  "mov $0x43e0000000000000,%rdi; movq %rdi,%xmm1; ucomisd %xmm1,%xmm0; jae 1f; "
+  "cvttsd2siq %xmm0,%rax; jmp 2f; 1: subsd %xmm1,%xmm0; cvttsd2siq %xmm0,%rax; "
+  "mov $0x8000000000000000,%rdi; xor %rdi,%rax; 2:";
 static char f64f32[] = "cvtsd2ss %xmm0, %xmm0";
 static char f64f80[] = "movsd %xmm0, -8(%rsp); fldl -8(%rsp)";
 
@@ -447,10 +793,7 @@ static void push_struct(Type *ty) {
   println("  sub $%d, %%rsp", sz);
   depth += sz / 8;
 
-  for (int i = 0; i < ty->size; i++) {
-    println("  mov %d(%%rax), %%r10b", i);
-    println("  mov %%r10b, %d(%%rsp)", i);
-  }
+  copy_mem("%rsp", 0, ty->size);
 }
 
 static void push_args2(Node *args, bool first_pass) {
@@ -501,7 +844,9 @@ static void push_args2(Node *args, bool first_pass) {
 //
 // - If a function is variadic, set the number of floating-point type
 //   arguments to RAX.
-static int push_args(Node *node) {
+// Marks the arguments of a function call that are passed on the stack
+// and returns the number of stack slots they take.
+static int classify_args(Node *node) {
   int stack = 0, gp = 0, fp = 0;
 
   // If the return type is a large struct/union, the caller passes
@@ -512,6 +857,8 @@ static int push_args(Node *node) {
   // Load as many arguments to the registers as possible.
   for (Node *arg = node->args; arg; arg = arg->next) {
     Type *ty = arg->ty;
+    if (ty->kind == TY_VECTOR)
+      error_tok(arg->tok, "passing a vector to a function is not supported");
 
     switch (ty->kind) {
     case TY_STRUCT:
@@ -550,6 +897,11 @@ static int push_args(Node *node) {
       }
     }
   }
+  return stack;
+}
+
+static int push_args(Node *node) {
+  int stack = classify_args(node);
 
   if ((depth + stack) % 2 == 1) {
     println("  sub $8, %%rsp");
@@ -563,13 +915,27 @@ static int push_args(Node *node) {
   // If the return type is a large struct/union, the caller passes
   // a pointer to a buffer as if it were the first argument.
   if (node->ret_buffer && node->ty->size > 16) {
-    println("  lea %d(%%rbp), %%rax", node->ret_buffer->offset);
+    println("  lea %s, %%rax", local_addr(node->ret_buffer->offset));
     push();
   }
 
   return stack;
 }
 
+// Stores the low `sz` bytes of a general-purpose register to a frame
+// slot using the widest moves that fit.
+static void store_bytes(char *reg, int offset, int sz) {
+  for (int i = 0; i < sz;) {
+    int n = 8;
+    while (i + n > sz)
+      n /= 2;
+    println("  mov %s, %s", reg_name(reg, n), local_addr(offset + i));
+    i += n;
+    if (i < sz)
+      println("  shr $%d, %s", n * 8, reg);
+  }
+}
+
 static void copy_ret_buffer(Obj *var) {
   Type *ty = var->ty;
   int gp = 0, fp = 0;
@@ -577,15 +943,12 @@ static void copy_ret_buffer(Obj *var) {
   if (has_flonum1(ty)) {
     assert(ty->size == 4 || 8 <= ty->size);
     if (ty->size == 4)
-      println("  movss %%xmm0, %d(%%rbp)", var->offset);
+      println("  movss %%xmm0, %s", local_addr(var->offset));
     else
-      println("  movsd %%xmm0, %d(%%rbp)", var->offset);
+      println("  movsd %%xmm0, %s", local_addr(var->offset));
     fp++;
   } else {
-    for (int i = 0; i < MIN(8, ty->size); i++) {
-      println("  mov %%al, %d(%%rbp)", var->offset + i);
-      println("  shr $8, %%rax");
-    }
+    store_bytes("%rax", var->offset, MIN(8, ty->size));
     gp++;
   }
 
@@ -593,20 +956,41 @@ static void copy_ret_buffer(Obj *var) {
     if (has_flonum2(ty)) {
       assert(ty->size == 12 || ty->size == 16);
       if (ty->size == 12)
-        println("  movss %%xmm%d, %d(%%rbp)", fp, var->offset + 8);
+        println("  movss %%xmm%d, %s", fp, local_addr(var->offset + 8));
       else
-        println("  movsd %%xmm%d, %d(%%rbp)", fp, var->offset + 8);
+        println("  movsd %%xmm%d, %s", fp, local_addr(var->offset + 8));
     } else {
-      char *reg1 = (gp == 0) ? "%al" : "%dl";
-      char *reg2 = (gp == 0) ? "%rax" : "%rdx";
-      for (int i = 8; i < MIN(16, ty->size); i++) {
-        println("  mov %s, %d(%%rbp)", reg1, var->offset + i);
-        println("  shr $8, %s", reg2);
-      }
+      char *reg = (gp == 0) ? "%rax" : "%rdx";
+      store_bytes(reg, var->offset + 8, MIN(16, ty->size) - 8);
     }
   }
 }
 
+// Loads `sz` bytes at `offset(%rdi)` into the low bytes of a
+// general-purpose register, zeroing the rest.
+static void load_bytes(char *reg, int offset, int sz) {
+  switch (sz) {
+  case 1:
+    println("  movzbl %d(%%rdi), %s", offset, reg_name(reg, 4));
+    return;
+  case 2:
+    println("  movzwl %d(%%rdi), %s", offset, reg_name(reg, 4));
+    return;
+  case 4:
+    println("  mov %d(%%rdi), %s", offset, reg_name(reg, 4));
+    return;
+  case 8:
+    println("  mov %d(%%rdi), %s", offset, reg);
+    return;
+  }
+
+  println("  mov $0, %s", reg);
+  for (int i = sz - 1; i >= 0; i--) {
+    println("  shl $8, %s", reg);
+    println("  mov %d(%%rdi), %s", offset + i, reg_name(reg, 1));
+  }
+}
+
 static void copy_struct_reg(void) {
   Type *ty = current_fn->ty->return_ty;
   int gp = 0, fp = 0;
@@ -621,11 +1005,7 @@ static void copy_struct_reg(void) {
       println("  movsd (%%rdi), %%xmm0");
     fp++;
   } else {
-    println("  mov $0, %%rax");
-    for (int i = MIN(8, ty->size) - 1; i >= 0; i--) {
-      println("  shl $8, %%rax");
-      println("  mov %d(%%rdi), %%al", i);
-    }
+    load_bytes("%rax", 0, MIN(8, ty->size));
     gp++;
   }
 
@@ -637,13 +1017,8 @@ static void copy_struct_reg(void) {
       else
         println("  movsd 8(%%rdi), %%xmm%d", fp);
     } else {
-      char *reg1 = (gp == 0) ? "%al" : "%dl";
-      char *reg2 = (gp == 0) ? "%rax" : "%rdx";
-      println("  mov $0, %s", reg2);
-      for (int i = MIN(16, ty->size) - 1; i >= 8; i--) {
-        println("  shl $8, %s", reg2);
-        println("  mov %d(%%rdi), %s", i, reg1);
-      }
+      char *reg = (gp == 0) ? "%rax" : "%rdx";
+      load_bytes(reg, 8, MIN(16, ty->size) - 8);
     }
   }
 }
@@ -651,13 +1026,18 @@ static void copy_struct_reg(void) {
 static void copy_struct_mem(void) {
   Type *ty = current_fn->ty->return_ty;
   Obj *var = current_fn->params;
+  char *buf;
+
+  if (var->reg)
+    buf = calleereg[var->reg - 1];
+  else
+    buf = local_addr(var->offset);
 
-  println("  mov %d(%%rbp), %%rdi", var->offset);
+  println("  mov %s, %%rdi", buf);
+  copy_mem("%rdi", 0, ty->size);
 
-  for (int i = 0; i < ty->size; i++) {
-    println("  mov %d(%%rax), %%dl", i);
-    println("  mov %%dl, %d(%%rdi)", i);
-  }
+  // The buffer's address is returned in %rax.
+  println("  mov %s, %%rax", buf);
 }
 
 static void builtin_alloca(void) {
@@ -688,70 +1068,817 @@ static void builtin_alloca(void) {
   println("  mov %%rax, %d(%%rbp)", current_fn->alloca_bottom->offset);
 }
 
-// Generate code for a given node.
-static void gen_expr(Node *node) {
-  println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+// Generates an assignment to a scalar without pushing the address of
+// the lhs to the stack. Returns false if it can't for a given node.
+static bool gen_assign(Node *node) {
+  Node *lhs = node->lhs;
+  Type *ty = node->ty;
 
-  switch (node->kind) {
-  case ND_NULL_EXPR:
-    return;
-  case ND_NUM: {
-    switch (node->ty->kind) {
-    case TY_FLOAT: {
-      union { float f32; uint32_t u32; } u = { node->fval };
-      println("  mov $%u, %%eax  # float %Lf", u.u32, node->fval);
-      println("  movq %%rax, %%xmm0");
-      return;
+  if (!is_scalar(ty))
+    return false;
+
+  if (lhs->kind == ND_VAR) {
+    if (lhs->var->reg) {
+      gen_expr(node->rhs);
+      store_reg(ty, "%rax", calleereg[lhs->var->reg - 1]);
+      return true;
     }
-    case TY_DOUBLE: {
-      union { double f64; uint64_t u64; } u = { node->fval };
-      println("  mov $%lu, %%rax  # double %Lf", u.u64, node->fval);
-      println("  movq %%rax, %%xmm0");
-      return;
+
+    char *addr = var_operand(lhs->var);
+    if (!addr)
+      return false;
+    gen_expr(node->rhs);
+    store_to(ty, addr);
+    return true;
+  }
+
+  if (lhs->kind == ND_MEMBER && lhs->member->is_bitfield)
+    return false;
+
+  if ((lhs->kind == ND_DEREF || lhs->kind == ND_MEMBER) &&
+      ntmps < NUM_TMPS && is_simple(node->rhs)) {
+    char *reg = tmpreg[ntmps];
+    gen_addr(lhs);
+    println("  mov %%rax, %s", reg);
+    ntmps++;
+    gen_expr(node->rhs);
+    ntmps--;
+    store_to(ty, format("(%s)", reg));
+    return true;
+  }
+  return false;
+}
+
+// Evaluates the lhs of an integer binary operator to %rax and returns
+// an operand of size `sz` holding the rhs. The operand is %rdi unless
+// the rhs is available without using the stack.
+static char *gen_operands(Node *node, int sz) {
+  Node *rhs = node->rhs;
+
+  if (opt_O) {
+    if (rhs->kind == ND_NUM && !is_flonum(rhs->ty) &&
+        rhs->val == (int32_t)rhs->val) {
+      gen_expr(node->lhs);
+      return format("$%ld", rhs->val);
     }
-    case TY_LDOUBLE: {
-      union { long double f80; uint64_t u64[2]; } u;
-      memset(&u, 0, sizeof(u));
-      u.f80 = node->fval;
-      println("  mov $%lu, %%rax  # long double %Lf", u.u64[0], node->fval);
-      println("  mov %%rax, -16(%%rsp)");
-      println("  mov $%lu, %%rax", u.u64[1]);
-      println("  mov %%rax, -8(%%rsp)");
-      println("  fldt -16(%%rsp)");
-      return;
+
+    if (rhs->kind == ND_VAR && rhs->var->reg) {
+      gen_expr(node->lhs);
+      return reg_name(calleereg[rhs->var->reg - 1], sz);
     }
+
+    if (rhs->kind == ND_VAR && is_scalar(rhs->ty) && rhs->ty->size == sz &&
+        !is_flonum(rhs->ty)) {
+      char *addr = var_operand(rhs->var);
+      if (addr) {
+        gen_expr(node->lhs);
+        return addr;
+      }
     }
 
-    println("  mov $%ld, %%rax", node->val);
-    return;
+    if (ntmps < NUM_TMPS && is_simple(node->lhs)) {
+      char *reg = tmpreg[ntmps];
+      gen_expr(rhs);
+      println("  mov %%rax, %s", reg);
+      ntmps++;
+      gen_expr(node->lhs);
+      ntmps--;
+      return reg_name(reg, sz);
+    }
   }
-  case ND_NEG:
+
+  gen_expr(rhs);
+  push();
+  gen_expr(node->lhs);
+  pop("%rdi");
+  return reg_name("%rdi", sz);
+}
+
+// Evaluates the lhs of a float or double binary operator to %xmm0 and
+// returns the register holding the rhs.
+static char *gen_float_operands(Node *node) {
+  if (opt_O && nftmps < NUM_FTMPS && is_simple(node->lhs)) {
+    char *xmm = format("%%xmm%d", 8 + nftmps);
+    gen_expr(node->rhs);
+    println("  movaps %%xmm0, %s", xmm);
+    nftmps++;
     gen_expr(node->lhs);
+    nftmps--;
+    return xmm;
+  }
 
-    switch (node->ty->kind) {
-    case TY_FLOAT:
-      println("  mov $1, %%rax");
-      println("  shl $31, %%rax");
-      println("  movq %%rax, %%xmm1");
-      println("  xorps %%xmm1, %%xmm0");
-      return;
-    case TY_DOUBLE:
-      println("  mov $1, %%rax");
-      println("  shl $63, %%rax");
-      println("  movq %%rax, %%xmm1");
-      println("  xorpd %%xmm1, %%xmm0");
-      return;
-    case TY_LDOUBLE:
-      println("  fchs");
-      return;
+  gen_expr(node->rhs);
+  pushf();
+  gen_expr(node->lhs);
+  popf(1);
+  return "%xmm1";
+}
+
+// Returns k if val is 2^k, or -1 otherwise.
+static int log2_exact(uint64_t val) {
+  if (val == 0 || (val & (val - 1)))
+    return -1;
+  int k = 0;
+  while (val >>= 1)
+    k++;
+  return k;
+}
+
+// Returns the smallest k such that 2^k >= val.
+static int log2_ceil(uint64_t val) {
+  int k = 0;
+  while (k < 64 && ((uint64_t)1 << k) < val)
+    k++;
+  return k;
+}
+
+// Computes a magic number M and a shift s such that, for any signed
+// `bits`-wide x, x / d == (mulhs(x, M) (+ x if M < 0)) >> s, rounded
+// towards zero. d must be in [2, 2^(bits-1)). This is the algorithm
+// from Hacker's Delight, section 10-4.
+static void signed_magic(uint64_t d, int bits, int64_t *mp, int *sp) {
+  uint64_t mask = (bits == 64) ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+  uint64_t top = (uint64_t)1 << (bits - 1);
+  uint64_t anc = top - 1 - top % d;
+  uint64_t q1 = top / anc, r1 = top - q1 * anc;
+  uint64_t q2 = top / d, r2 = top - q2 * d;
+  uint64_t delta;
+  int p = bits - 1;
+
+  do {
+    p++;
+    q1 = (q1 * 2) & mask;
+    r1 = (r1 * 2) & mask;
+    if (r1 >= anc) {
+      q1 = (q1 + 1) & mask;
+      r1 -= anc;
+    }
+    q2 = (q2 * 2) & mask;
+    r2 = (r2 * 2) & mask;
+    if (r2 >= d) {
+      q2 = (q2 + 1) & mask;
+      r2 -= d;
+    }
+    delta = d - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  uint64_t m = (q2 + 1) & mask;
+  if (bits == 32)
+    *mp = (int32_t)m;
+  else
+    *mp = m;
+  *sp = p - bits;
+}
+
+// Computes a magic number m and returns l = ceil(log2(d)) such that,
+// for any unsigned `bits`-wide x, with t = mulhu(x, m),
+// x / d == (t + ((x - t) >> 1)) >> (l - 1). d must be at least 2.
+static uint64_t unsigned_magic(uint64_t d, int bits, int *lp) {
+  uint64_t mask = (bits == 64) ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+  int l = log2_ceil(d);
+  uint64_t r = (((l == 64) ? 0 : (uint64_t)1 << l) - d) & mask;
+
+  // m = floor(2^bits * (2^l - d) / d) + 1, by long division.
+  uint64_t q = 0;
+  for (int i = 0; i < bits; i++) {
+    bool carry = (r >> (bits - 1)) & 1;
+    r = (r << 1) & mask;
+    q <<= 1;
+    if (carry || r >= d) {
+      r = (r - d) & mask;
+      q |= 1;
+    }
+  }
+
+  *lp = l;
+  return (q + 1) & mask;
+}
+
+// Emits `and $mask, %rax`, going through %rcx if the mask does not
+// fit in an immediate.
+static void gen_and_imm(uint64_t mask, int sz) {
+  if (mask <= INT32_MAX) {
+    println("  and $%lu, %s", mask, reg_name("%rax", sz));
+    return;
+  }
+  println("  mov $%lu, %%rcx", mask);
+  println("  and %%rcx, %%rax");
+}
+
+// Emits `imul $d, %rax`, going through %rdx if d does not fit in
+// an immediate.
+static void gen_imul_imm(uint64_t d, int sz) {
+  if (sz == 4) {
+    println("  imul $%d, %%eax", (int32_t)d);
+    return;
+  }
+  if (d <= INT32_MAX) {
+    println("  imul $%lu, %%rax", d);
+    return;
+  }
+  println("  mov $%lu, %%rdx", d);
+  println("  imul %%rdx, %%rax");
+}
+
+// Lowers multiplication, division and modulo by a constant to shifts,
+// lea or multiplication by a magic number instead of imul or div.
+// Returns false if the node has no such form.
+static bool gen_muldiv_const(Node *node, int sz) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+
+  if (node->kind == ND_MUL && lhs->kind == ND_NUM) {
+    lhs = node->rhs;
+    rhs = node->lhs;
+  }
+
+  if (node->kind != ND_MUL && node->kind != ND_DIV && node->kind != ND_MOD)
+    return false;
+  if (rhs->kind != ND_NUM || is_flonum(rhs->ty))
+    return false;
+
+  int bits = sz * 8;
+  bool is_unsigned = node->ty->is_unsigned;
+  char *ax = reg_name("%rax", sz);
+  char *cx = reg_name("%rcx", sz);
+  char *dx = reg_name("%rdx", sz);
+
+  // The divisor as a value of the operation's type.
+  uint64_t d = rhs->val;
+  if (sz == 4) {
+    if (is_unsigned)
+      d = (uint32_t)d;
+    else
+      d = (int32_t)d;
+  }
+
+  if (node->kind == ND_MUL) {
+    int k = log2_exact(d);
+    if (k >= 0) {
+      gen_expr(lhs);
+      if (k > 0)
+        println("  shl $%d, %s", k, ax);
+      return true;
+    }
+    if (d == 3 || d == 5 || d == 9) {
+      gen_expr(lhs);
+      println("  lea (%%rax,%%rax,%lu), %s", d - 1, ax);
+      return true;
+    }
+    return false;
+  }
+
+  // Negative divisors and 1 are left to idiv, and so is 0 so that
+  // it still traps at runtime.
+  if (d < 2 || (!is_unsigned && (int64_t)d < 0))
+    return false;
+
+  int k = log2_exact(d);
+  gen_expr(lhs);
+
+  if (k >= 0 && is_unsigned) {
+    if (node->kind == ND_DIV)
+      println("  shr $%d, %s", k, ax);
+    else
+      gen_and_imm(d - 1, sz);
+    return true;
+  }
+
+  if (k >= 0) {
+    // Bias negative dividends by d-1 so that the shift rounds
+    // towards zero.
+    println("  mov %s, %s", ax, dx);
+    if (k > 1)
+      println("  sar $%d, %s", bits - 1, dx);
+    println("  shr $%d, %s", bits - k, dx);
+    println("  add %s, %s", dx, ax);
+    if (node->kind == ND_DIV) {
+      println("  sar $%d, %s", k, ax);
+    } else {
+      gen_and_imm(d - 1, sz);
+      println("  sub %s, %s", dx, ax);
+    }
+    return true;
+  }
+
+  println("  mov %s, %s", ax, cx);
+
+  if (is_unsigned) {
+    int l;
+    uint64_t m = unsigned_magic(d, bits, &l);
+    if (sz == 4) {
+      println("  mov $%lu, %%eax", m);
+      println("  imul %%rcx, %%rax");
+      println("  shr $32, %%rax");
+      println("  mov %%rax, %%rdx");
+    } else {
+      println("  mov $%lu, %%rdx", m);
+      println("  mul %%rdx");
+    }
+    println("  mov %s, %s", cx, ax);
+    println("  sub %s, %s", dx, ax);
+    println("  shr $1, %s", ax);
+    println("  add %s, %s", dx, ax);
+    if (l > 1)
+      println("  shr $%d, %s", l - 1, ax);
+  } else {
+    int64_t m;
+    int s;
+    signed_magic(d, bits, &m, &s);
+    if (sz == 4) {
+      println("  movsxd %%eax, %%rax");
+      println("  imul $%ld, %%rax", m);
+      println("  sar $32, %%rax");
+      println("  mov %%eax, %%edx");
+    } else {
+      println("  mov $%ld, %%rdx", m);
+      println("  imul %%rdx");
+    }
+    if (m < 0)
+      println("  add %s, %s", cx, dx);
+    if (s > 0)
+      println("  sar $%d, %s", s, dx);
+    println("  mov %s, %s", dx, ax);
+    println("  shr $%d, %s", bits - 1, ax);
+    println("  add %s, %s", dx, ax);
+  }
+
+  if (node->kind == ND_MOD) {
+    gen_imul_imm(d, sz);
+    println("  sub %s, %s", ax, cx);
+    println("  mov %s, %s", cx, ax);
+  }
+  return true;
+}
+
+// Evaluates the arguments and the callee of a function call. The
+// arguments are left in registers or on the stack and the callee's
+// address in %r10. Returns the number of stack slots used.
+static int gen_call_args(Node *node) {
+  int stack_args = push_args(node);
+  gen_expr(node->lhs);
+
+  int gp = 0, fp = 0;
+
+  // If the return type is a large struct/union, the caller passes
+  // a pointer to a buffer as if it were the first argument.
+  if (node->ret_buffer && node->ty->size > 16)
+    pop(argreg64[gp++]);
+
+  for (Node *arg = node->args; arg; arg = arg->next) {
+    Type *ty = arg->ty;
+
+    switch (ty->kind) {
+    case TY_STRUCT:
+    case TY_UNION:
+      if (ty->size > 16)
+        continue;
+
+      bool fp1 = has_flonum1(ty);
+      bool fp2 = has_flonum2(ty);
+
+      if (fp + fp1 + fp2 < FP_MAX && gp + !fp1 + !fp2 < GP_MAX) {
+        if (fp1)
+          popf(fp++);
+        else
+          pop(argreg64[gp++]);
+
+        if (ty->size > 8) {
+          if (fp2)
+            popf(fp++);
+          else
+            pop(argreg64[gp++]);
+        }
+      }
+      break;
+    case TY_FLOAT:
+    case TY_DOUBLE:
+      if (fp < FP_MAX)
+        popf(fp++);
+      break;
+    case TY_LDOUBLE:
+      break;
+    default:
+      if (gp < GP_MAX)
+        pop(argreg64[gp++]);
+    }
+  }
+
+  println("  mov %%rax, %%r10");
+  println("  mov $%d, %%rax", fp);
+  return stack_args;
+}
+
+// Generate code for a given node.
+static char *atomic_insn(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD: return "add";
+  case ND_SUB: return "sub";
+  case ND_BITAND: return "and";
+  case ND_BITOR: return "or";
+  case ND_BITXOR: return "xor";
+  }
+  unreachable();
+}
+
+// Atomically applies an ND_ATOMIC_OP to memory, leaving the new value
+// in %rax. `+=` and `-=` use `lock xadd`, which returns the old value.
+// The other operators have no instruction that returns a value, so
+// they use a compare-and-swap loop.
+static void gen_atomic_op(Node *node) {
+  gen_expr(node->lhs);
+  push();
+  gen_expr(node->rhs);
+  pop("%rdi");
+
+  int sz = node->ty->size;
+  char *ax = reg_ax(sz);
+  char *dx = reg_dx(sz);
+
+  switch (node->atomic_op) {
+  case ND_SUB:
+    println("  neg %%rax");
+    // fallthrough
+  case ND_ADD:
+    println("  mov %%rax, %%rdx");
+    println("  lock xadd %s, (%%rdi)", dx);
+    println("  add %%rdx, %%rax");
+    break;
+  default: {
+    char *insn = atomic_insn(node->atomic_op);
+    println("  mov %%rax, %%rcx");
+    println("  mov (%%rdi), %s", ax);
+    println("1:");
+    println("  mov %%rax, %%rdx");
+    println("  %s %%rcx, %%rdx", insn);
+    println("  lock cmpxchg %s, (%%rdi)", dx);
+    println("  jne 1b");
+    println("  mov %%rdx, %%rax");
+  }
+  }
+
+  cast(ty_long, node->ty);
+}
+
+// Generates code for an expression whose value is unused. An atomic
+// operation then doesn't need its result, so it can be a single
+// lock-prefixed instruction. `A++` is `(A += 1) - 1`, so we look
+// through the subtraction.
+static void gen_void_expr(Node *node) {
+  Node *n = node;
+  while (n->kind == ND_CAST ||
+         ((n->kind == ND_ADD || n->kind == ND_SUB) && n->rhs->kind == ND_NUM))
+    n = n->lhs;
+
+  if (n->kind != ND_ATOMIC_OP) {
+    gen_expr(node);
+    return;
+  }
+
+  gen_expr(n->lhs);
+  push();
+  gen_expr(n->rhs);
+  pop("%rdi");
+  println("  lock %s %s, (%%rdi)", atomic_insn(n->atomic_op),
+          reg_ax(n->ty->size));
+}
+
+// Returns the SSE instruction for an operator on vectors of a given
+// element type, or NULL if SSE4.1 has no such instruction.
+static char *vector_insn(NodeKind kind, Type *elem) {
+  if (elem->kind == TY_FLOAT || elem->kind == TY_DOUBLE) {
+    char *sfx = (elem->kind == TY_FLOAT) ? "ps" : "pd";
+    switch (kind) {
+    case ND_ADD: return format("add%s", sfx);
+    case ND_SUB: return format("sub%s", sfx);
+    case ND_MUL: return format("mul%s", sfx);
+    case ND_DIV: return format("div%s", sfx);
+    case ND_BITAND: return format("and%s", sfx);
+    case ND_BITOR: return format("or%s", sfx);
+    case ND_BITXOR: return format("xor%s", sfx);
+    }
+    return NULL;
+  }
+
+  int sz = elem->size;
+  char c = (sz == 1) ? 'b' : (sz == 2) ? 'w' : (sz == 4) ? 'd' : 'q';
+
+  switch (kind) {
+  case ND_ADD: return format("padd%c", c);
+  case ND_SUB: return format("psub%c", c);
+  case ND_MUL:
+    if (c == 'w')
+      return "pmullw";
+    if (c == 'd')
+      return "pmulld";
+    return NULL;
+  case ND_BITAND: return "pand";
+  case ND_BITOR: return "por";
+  case ND_BITXOR: return "pxor";
+  case ND_EQ:
+  case ND_NE:
+    return format("pcmpeq%c", c);
+  case ND_SHL:
+    return (c == 'b') ? NULL : format("psll%c", c);
+  case ND_SHR:
+    if (c == 'b')
+      return NULL;
+    if (elem->is_unsigned)
+      return format("psrl%c", c);
+    return (c == 'q') ? NULL : format("psra%c", c);
+  }
+  return NULL;
+}
+
+// Computes an operator on vectors in %xmm0.
+static void gen_vector_op(Node *node) {
+  Type *elem = node->lhs->ty->elem;
+
+  switch (node->kind) {
+  case ND_NEG:
+    gen_expr(node->lhs);
+    if (is_flonum(elem)) {
+      // Flip the sign bits.
+      println("  mov $1, %%rax");
+      println("  shl $%d, %%rax", elem->size * 8 - 1);
+      if (elem->size == 4) {
+        println("  mov %%rax, %%rdx");
+        println("  shl $32, %%rdx");
+        println("  or %%rdx, %%rax");
+      }
+      println("  movq %%rax, %%xmm1");
+      println("  punpcklqdq %%xmm1, %%xmm1");
+      println("  xorps %%xmm1, %%xmm0");
+      return;
+    }
+    println("  pxor %%xmm1, %%xmm1");
+    println("  %s %%xmm0, %%xmm1", vector_insn(ND_SUB, elem));
+    println("  movdqa %%xmm1, %%xmm0");
+    return;
+  case ND_BITNOT:
+    gen_expr(node->lhs);
+    println("  pcmpeqd %%xmm1, %%xmm1");
+    println("  pxor %%xmm1, %%xmm0");
+    return;
+  }
+
+  char *insn = vector_insn(node->kind, elem);
+  if (!insn)
+    error_tok(node->tok, "vector operation is not supported");
+
+  // The shift count is a scalar and is taken from %xmm1.
+  if (node->kind == ND_SHL || node->kind == ND_SHR) {
+    gen_expr(node->rhs);
+    push();
+    gen_expr(node->lhs);
+    pop("%rax");
+    if (node->rhs->ty->size == 8)
+      println("  movq %%rax, %%xmm1");
+    else
+      println("  movd %%eax, %%xmm1");
+    println("  %s %%xmm1, %%xmm0", insn);
+    return;
+  }
+
+  gen_expr(node->rhs);
+  pushv();
+  gen_expr(node->lhs);
+  popv(1);
+  println("  %s %%xmm1, %%xmm0", insn);
+
+  if (node->kind == ND_NE) {
+    println("  pcmpeqd %%xmm1, %%xmm1");
+    println("  pxor %%xmm1, %%xmm0");
+  }
+}
+
+// memcpy(dst, src, n) with a constant `n`.
+static void gen_memcpy(Node *dst, Node *src, int n) {
+  Node pair = {.lhs = src, .rhs = dst};
+  char *op = gen_operands(&pair, 8);
+  if (strcmp(op, "%rdi"))
+    println("  mov %s, %%rdi", op);
+
+  copy_mem("%rdi", 0, n);
+
+  // `rep movsb` advances %rdi.
+  if (n >= REP_MOVS_MIN)
+    println("  lea -%d(%%rdi), %%rax", n);
+  else
+    println("  mov %%rdi, %%rax");
+}
+
+// memset(dst, c, n) with a constant `n`. Small objects are filled
+// with copies of the byte in %rax and %xmm0.
+static void gen_memset(Node *dst, Node *c, int n) {
+  if (c->kind == ND_NUM) {
+    gen_expr(dst);
+    println("  mov %%rax, %%rdi");
+    uint64_t val = (uint8_t)c->val * 0x0101010101010101UL;
+    if (val)
+      println("  mov $%lu, %%rax", val);
+    else
+      println("  xor %%eax, %%eax");
+  } else {
+    Node pair = {.lhs = c, .rhs = dst};
+    char *op = gen_operands(&pair, 8);
+    if (strcmp(op, "%rdi"))
+      println("  mov %s, %%rdi", op);
+    println("  movzbl %%al, %%eax");
+    if (n < REP_MOVS_MIN) {
+      println("  mov $%lu, %%rdx", 0x0101010101010101UL);
+      println("  imul %%rdx, %%rax");
+    }
+  }
+
+  if (n >= REP_MOVS_MIN) {
+    println("  mov %%rdi, %%rdx");
+    println("  mov $%d, %%ecx", n);
+    println("  rep stosb");
+    println("  mov %%rdx, %%rax");
+    return;
+  }
+
+  int i = 0;
+  if (n >= 16) {
+    println("  movq %%rax, %%xmm0");
+    println("  punpcklqdq %%xmm0, %%xmm0");
+    for (; i + 16 <= n; i += 16)
+      println("  movdqu %%xmm0, %d(%%rdi)", i);
+  }
+
+  while (i < n) {
+    int k = 8;
+    while (i + k > n)
+      k /= 2;
+    println("  mov %s, %d(%%rdi)", reg_name("%rax", k), i);
+    i += k;
+  }
+  println("  mov %%rdi, %%rax");
+}
+
+// memcmp(a, b, n) with a small constant `n`. Chunks of the operands
+// are loaded in big-endian order, so that the first differing byte
+// decides an unsigned comparison of the chunks.
+static void gen_memcmp(Node *a, Node *b, int n) {
+  Node pair = {.lhs = a, .rhs = b};
+  char *op = gen_operands(&pair, 8);
+  println("  mov %s, %%rsi", op);
+  println("  mov %%rax, %%rdi");
+
+  if (n == 0) {
+    println("  xor %%eax, %%eax");
+    return;
+  }
+
+  int c = count();
+  for (int i = 0; i < n;) {
+    int k = 8;
+    while (i + k > n)
+      k /= 2;
+
+    char *ax = (k == 8) ? "%rax" : "%eax";
+    char *dx = (k == 8) ? "%rdx" : "%edx";
+    char *insn = (k == 1) ? "movzbl" : (k == 2) ? "movzwl" : "mov";
+    println("  %s %d(%%rdi), %s", insn, i, ax);
+    println("  %s %d(%%rsi), %s", insn, i, dx);
+    if (k > 1) {
+      println("  bswap %s", ax);
+      println("  bswap %s", dx);
+    }
+    println("  cmp %s, %s", dx, ax);
+    println("  jne .L.memcmp.%s.%d", current_fn->name, c);
+    i += k;
+  }
+
+  println("  xor %%eax, %%eax");
+  println("  jmp .L.end.%s.%d", current_fn->name, c);
+  println(".L.memcmp.%s.%d:", current_fn->name, c);
+  println("  sbb %%eax, %%eax");
+  println("  or $1, %%eax");
+  println(".L.end.%s.%d:", current_fn->name, c);
+}
+
+// Returns the value of a constant size argument of a builtin, or -1.
+static int builtin_size(Node *node) {
+  if (node->kind != ND_NUM || node->val < 0 || node->val >= (1 << 30))
+    return -1;
+  return node->val;
+}
+
+// Expands calls of memcpy(), memset() and memcmp() with constant sizes
+// inline. Large objects are copied or filled with `rep movsb` and
+// `rep stosb`. Returns false if a call isn't expanded.
+static bool gen_builtin_call(Node *node) {
+  Node *arg = node->args;
+
+  if (is_builtin_call(node, "memcpy", 3)) {
+    int n = builtin_size(arg->next->next);
+    if (n < 0)
+      return false;
+    gen_memcpy(arg, arg->next, n);
+    return true;
+  }
+
+  if (is_builtin_call(node, "memset", 3)) {
+    int n = builtin_size(arg->next->next);
+    if (n < 0)
+      return false;
+    gen_memset(arg, arg->next, n);
+    return true;
+  }
+
+  if (is_builtin_call(node, "memcmp", 3)) {
+    int n = builtin_size(arg->next->next);
+    if (n < 0 || n > 16)
+      return false;
+    gen_memcmp(arg, arg->next, n);
+    return true;
+  }
+  return false;
+}
+
+static void gen_expr(Node *node) {
+  println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+
+  switch (node->kind) {
+  case ND_NULL_EXPR:
+    return;
+  case ND_NUM: {
+    switch (node->ty->kind) {
+    case TY_FLOAT: {
+      union { float f32; uint32_t u32; } u = { node->fval };
+      println("  mov $%u, %%eax  # float %Lf", u.u32, node->fval);
+      println("  movq %%rax, %%xmm0");
+      return;
+    }
+    case TY_DOUBLE: {
+      union { double f64; uint64_t u64; } u = { node->fval };
+      println("  mov $%lu, %%rax  # double %Lf", u.u64, node->fval);
+      println("  movq %%rax, %%xmm0");
+      return;
+    }
+    case TY_LDOUBLE: {
+      union { long double f80; uint64_t u64[2]; } u;
+      memset(&u, 0, sizeof(u));
+      u.f80 = node->fval;
+      println("  mov $%lu, %%rax  # long double %Lf", u.u64[0], node->fval);
+      println("  mov %%rax, -16(%%rsp)");
+      println("  mov $%lu, %%rax", u.u64[1]);
+      println("  mov %%rax, -8(%%rsp)");
+      println("  fldt -16(%%rsp)");
+      return;
+    }
+    }
+
+    println("  mov $%ld, %%rax", node->val);
+    return;
+  }
+  case ND_NEG:
+    if (node->ty->kind == TY_VECTOR) {
+      gen_vector_op(node);
+      return;
+    }
+
+    gen_expr(node->lhs);
+
+    switch (node->ty->kind) {
+    case TY_FLOAT:
+      println("  mov $1, %%rax");
+      println("  shl $31, %%rax");
+      println("  movq %%rax, %%xmm1");
+      println("  xorps %%xmm1, %%xmm0");
+      return;
+    case TY_DOUBLE:
+      println("  mov $1, %%rax");
+      println("  shl $63, %%rax");
+      println("  movq %%rax, %%xmm1");
+      println("  xorpd %%xmm1, %%xmm0");
+      return;
+    case TY_LDOUBLE:
+      println("  fchs");
+      return;
+    }
+
+    println("  neg %%rax");
+    return;
+  case ND_VAR: {
+    Obj *var = node->var;
+    if (var->reg) {
+      println("  mov %s, %%rax", calleereg[var->reg - 1]);
+      return;
+    }
+
+    char *addr;
+    if (opt_O && is_scalar(node->ty) && (addr = var_operand(var))) {
+      load_from(node->ty, addr);
+      return;
     }
 
-    println("  neg %%rax");
-    return;
-  case ND_VAR:
     gen_addr(node);
     load(node->ty);
     return;
+  }
   case ND_MEMBER: {
     gen_addr(node);
     load(node->ty);
@@ -774,6 +1901,9 @@ static void gen_expr(Node *node) {
     gen_addr(node->lhs);
     return;
   case ND_ASSIGN:
+    if (opt_O && gen_assign(node))
+      return;
+
     gen_addr(node->lhs);
     push();
     gen_expr(node->rhs);
@@ -803,8 +1933,15 @@ static void gen_expr(Node *node) {
     store(node->ty);
     return;
   case ND_STMT_EXPR:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+    // The value of the last statement is the value of the expression.
+    for (Node *n = node->body; n; n = n->next) {
+      if (n->next) {
+        gen_stmt(n);
+      } else {
+        println("  .loc %d %d", n->tok->file->file_no, n->tok->line_no);
+        gen_expr(n->lhs);
+      }
+    }
     return;
   case ND_COMMA:
     gen_expr(node->lhs);
@@ -812,25 +1949,31 @@ static void gen_expr(Node *node) {
     return;
   case ND_CAST:
     gen_expr(node->lhs);
-    cast(node->lhs->ty, node->ty);
+    // A cast between vectors reinterprets the bits.
+    if (node->ty->kind != TY_VECTOR)
+      cast(node->lhs->ty, node->ty);
     return;
   case ND_MEMZERO:
+    if (node->var->reg) {
+      char *reg = reg_name(calleereg[node->var->reg - 1], 4);
+      println("  xor %s, %s", reg, reg);
+      return;
+    }
+
     // `rep stosb` is equivalent to `memset(%rdi, %al, %rcx)`.
     println("  mov $%d, %%rcx", node->var->ty->size);
-    println("  lea %d(%%rbp), %%rdi", node->var->offset);
+    println("  lea %s, %%rdi", local_addr(node->var->offset));
     println("  mov $0, %%al");
     println("  rep stosb");
     return;
   case ND_COND: {
     int c = count();
-    gen_expr(node->cond);
-    cmp_zero(node->cond->ty);
-    println("  je .L.else.%d", c);
+    gen_cond(node->cond, NULL, format(".L.else.%s.%d", current_fn->name, c));
     gen_expr(node->then);
-    println("  jmp .L.end.%d", c);
-    println(".L.else.%d:", c);
+    println("  jmp .L.end.%s.%d", current_fn->name, c);
+    println(".L.else.%s.%d:", current_fn->name, c);
     gen_expr(node->els);
-    println(".L.end.%d:", c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_NOT:
@@ -840,40 +1983,40 @@ static void gen_expr(Node *node) {
     println("  movzx %%al, %%rax");
     return;
   case ND_BITNOT:
+    if (node->ty->kind == TY_VECTOR) {
+      gen_vector_op(node);
+      return;
+    }
+
     gen_expr(node->lhs);
     println("  not %%rax");
     return;
   case ND_LOGAND: {
     int c = count();
-    gen_expr(node->lhs);
-    cmp_zero(node->lhs->ty);
-    println("  je .L.false.%d", c);
-    gen_expr(node->rhs);
-    cmp_zero(node->rhs->ty);
-    println("  je .L.false.%d", c);
+    gen_cond(node, NULL, format(".L.false.%s.%d", current_fn->name, c));
     println("  mov $1, %%rax");
-    println("  jmp .L.end.%d", c);
-    println(".L.false.%d:", c);
+    println("  jmp .L.end.%s.%d", current_fn->name, c);
+    println(".L.false.%s.%d:", current_fn->name, c);
     println("  mov $0, %%rax");
-    println(".L.end.%d:", c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_LOGOR: {
     int c = count();
-    gen_expr(node->lhs);
-    cmp_zero(node->lhs->ty);
-    println("  jne .L.true.%d", c);
-    gen_expr(node->rhs);
-    cmp_zero(node->rhs->ty);
-    println("  jne .L.true.%d", c);
+    gen_cond(node, format(".L.true.%s.%d", current_fn->name, c), NULL);
     println("  mov $0, %%rax");
-    println("  jmp .L.end.%d", c);
-    println(".L.true.%d:", c);
+    println("  jmp .L.end.%s.%d", current_fn->name, c);
+    println(".L.true.%s.%d:", current_fn->name, c);
     println("  mov $1, %%rax");
-    println(".L.end.%d:", c);
+    println(".L.end.%s.%d:", current_fn->name, c);
     return;
   }
   case ND_FUNCALL: {
+    if (gen_builtin_call(node))
+      return;
+
+    frame_needed = true;
+
     if (node->lhs->kind == ND_VAR && !strcmp(node->lhs->var->name, "alloca")) {
       gen_expr(node->args);
       println("  mov %%rax, %%rdi");
@@ -881,57 +2024,7 @@ static void gen_expr(Node *node) {
       return;
     }
 
-    int stack_args = push_args(node);
-    gen_expr(node->lhs);
-
-    int gp = 0, fp = 0;
-
-    // If the return type is a large struct/union, the caller passes
-    // a pointer to a buffer as if it were the first argument.
-    if (node->ret_buffer && node->ty->size > 16)
-      pop(argreg64[gp++]);
-
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      Type *ty = arg->ty;
-
-      switch (ty->kind) {
-      case TY_STRUCT:
-      case TY_UNION:
-        if (ty->size > 16)
-          continue;
-
-        bool fp1 = has_flonum1(ty);
-        bool fp2 = has_flonum2(ty);
-
-        if (fp + fp1 + fp2 < FP_MAX && gp + !fp1 + !fp2 < GP_MAX) {
-          if (fp1)
-            popf(fp++);
-          else
-            pop(argreg64[gp++]);
-
-          if (ty->size > 8) {
-            if (fp2)
-              popf(fp++);
-            else
-              pop(argreg64[gp++]);
-          }
-        }
-        break;
-      case TY_FLOAT:
-      case TY_DOUBLE:
-        if (fp < FP_MAX)
-          popf(fp++);
-        break;
-      case TY_LDOUBLE:
-        break;
-      default:
-        if (gp < GP_MAX)
-          pop(argreg64[gp++]);
-      }
-    }
-
-    println("  mov %%rax, %%r10");
-    println("  mov $%d, %%rax", fp);
+    int stack_args = gen_call_args(node);
     println("  call *%%r10");
     println("  add $%d, %%rsp", stack_args * 8);
 
@@ -962,7 +2055,7 @@ static void gen_expr(Node *node) {
     // using up to two registers.
     if (node->ret_buffer && node->ty->size <= 16) {
       copy_ret_buffer(node->ret_buffer);
-      println("  lea %d(%%rbp), %%rax", node->ret_buffer->offset);
+      println("  lea %s, %%rax", local_addr(node->ret_buffer->offset));
     }
 
     return;
@@ -1000,36 +2093,40 @@ static void gen_expr(Node *node) {
     println("  xchg %s, (%%rdi)", reg_ax(sz));
     return;
   }
+  case ND_ATOMIC_OP:
+    gen_atomic_op(node);
+    return;
+  }
+
+  if (node->ty->kind == TY_VECTOR) {
+    gen_vector_op(node);
+    return;
   }
 
   switch (node->lhs->ty->kind) {
   case TY_FLOAT:
   case TY_DOUBLE: {
-    gen_expr(node->rhs);
-    pushf();
-    gen_expr(node->lhs);
-    popf(1);
-
+    char *xmm = gen_float_operands(node);
     char *sz = (node->lhs->ty->kind == TY_FLOAT) ? "ss" : "sd";
 
     switch (node->kind) {
     case ND_ADD:
-      println("  add%s %%xmm1, %%xmm0", sz);
+      println("  add%s %s, %%xmm0", sz, xmm);
       return;
     case ND_SUB:
-      println("  sub%s %%xmm1, %%xmm0", sz);
+      println("  sub%s %s, %%xmm0", sz, xmm);
       return;
     case ND_MUL:
-      println("  mul%s %%xmm1, %%xmm0", sz);
+      println("  mul%s %s, %%xmm0", sz, xmm);
       return;
     case ND_DIV:
-      println("  div%s %%xmm1, %%xmm0", sz);
+      println("  div%s %s, %%xmm0", sz, xmm);
       return;
     case ND_EQ:
     case ND_NE:
     case ND_LT:
     case ND_LE:
-      println("  ucomi%s %%xmm0, %%xmm1", sz);
+      println("  ucomi%s %%xmm0, %s", sz, xmm);
 
       if (node->kind == ND_EQ) {
         println("  sete %%al");
@@ -1076,113 +2173,545 @@ static void gen_expr(Node *node) {
       println("  fcomip");
       println("  fstp %%st(0)");
 
-      if (node->kind == ND_EQ)
+      if (node->kind == ND_EQ) {
         println("  sete %%al");
-      else if (node->kind == ND_NE)
+        println("  setnp %%dl");
+        println("  and %%dl, %%al");
+      } else if (node->kind == ND_NE) {
         println("  setne %%al");
-      else if (node->kind == ND_LT)
+        println("  setp %%dl");
+        println("  or %%dl, %%al");
+      } else if (node->kind == ND_LT) {
         println("  seta %%al");
-      else
+      } else {
         println("  setae %%al");
+      }
+
+      println("  movzb %%al, %%rax");
+      return;
+    }
+
+    error_tok(node->tok, "invalid expression");
+  }
+  }
+
+  int sz = (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base) ? 8 : 4;
+  if (gen_muldiv_const(node, sz))
+    return;
+
+  char *di = gen_operands(node, sz);
+  char *ax = reg_name("%rax", sz);
+  char *dx = reg_name("%rdx", sz);
+
+  switch (node->kind) {
+  case ND_ADD:
+    println("  add %s, %s", di, ax);
+    return;
+  case ND_SUB:
+    println("  sub %s, %s", di, ax);
+    return;
+  case ND_MUL:
+    println("  imul %s, %s", di, ax);
+    return;
+  case ND_DIV:
+  case ND_MOD:
+    // div and idiv take no immediate, and a memory operand would
+    // need a size suffix.
+    if (di[0] != '%') {
+      println("  mov %s, %s", di, reg_name("%rdi", sz));
+      di = reg_name("%rdi", sz);
+    }
+
+    if (node->ty->is_unsigned) {
+      println("  mov $0, %s", dx);
+      println("  div %s", di);
+    } else {
+      if (node->lhs->ty->size == 8)
+        println("  cqo");
+      else
+        println("  cdq");
+      println("  idiv %s", di);
+    }
+
+    if (node->kind == ND_MOD)
+      println("  mov %%rdx, %%rax");
+    return;
+  case ND_BITAND:
+    println("  and %s, %s", di, ax);
+    return;
+  case ND_BITOR:
+    println("  or %s, %s", di, ax);
+    return;
+  case ND_BITXOR:
+    println("  xor %s, %s", di, ax);
+    return;
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    println("  cmp %s, %s", di, ax);
+
+    if (node->kind == ND_EQ) {
+      println("  sete %%al");
+    } else if (node->kind == ND_NE) {
+      println("  setne %%al");
+    } else if (node->kind == ND_LT) {
+      if (node->lhs->ty->is_unsigned)
+        println("  setb %%al");
+      else
+        println("  setl %%al");
+    } else if (node->kind == ND_LE) {
+      if (node->lhs->ty->is_unsigned)
+        println("  setbe %%al");
+      else
+        println("  setle %%al");
+    }
+
+    println("  movzb %%al, %%rax");
+    return;
+  case ND_SHL:
+  case ND_SHR: {
+    char *insn = node->kind == ND_SHL ? "shl"
+      : node->lhs->ty->is_unsigned ? "shr" : "sar";
+
+    if (di[0] == '$') {
+      println("  %s %s, %s", insn, di, ax);
+      return;
+    }
+
+    println("  mov %s, %s", di, reg_name("%rcx", sz));
+    println("  %s %%cl, %s", insn, ax);
+    return;
+  }
+  }
+
+  error_tok(node->tok, "invalid expression");
+}
+
+// Emits a conditional jump, given the condition codes for which the
+// condition is true and false.
+static void jump_cond(char *cc, char *ncc, char *t, char *f) {
+  if (t) {
+    println("  j%s %s", cc, t);
+    if (f)
+      println("  jmp %s", f);
+  } else {
+    println("  j%s %s", ncc, f);
+  }
+}
+
+// Generates code that jumps to `t` if a given condition is true and
+// to `f` otherwise. One of the labels may be NULL, which means falling
+// through. Comparisons and logical operators are compiled to
+// conditional jumps without materializing their values.
+static void gen_cond(Node *node, char *t, char *f) {
+  println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+
+  switch (node->kind) {
+  case ND_NOT:
+    gen_cond(node->lhs, f, t);
+    return;
+  case ND_LOGAND: {
+    char *false_label = f ? f : format(".L.false.%s.%d", current_fn->name, count());
+    gen_cond(node->lhs, NULL, false_label);
+    gen_cond(node->rhs, t, f);
+    if (!f)
+      println("%s:", false_label);
+    return;
+  }
+  case ND_LOGOR: {
+    char *true_label = t ? t : format(".L.true.%s.%d", current_fn->name, count());
+    gen_cond(node->lhs, true_label, NULL);
+    gen_cond(node->rhs, t, f);
+    if (!t)
+      println("%s:", true_label);
+    return;
+  }
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    gen_cond(node->rhs, t, f);
+    return;
+  case ND_NUM:
+    if (is_integer(node->ty)) {
+      char *label = node->val ? t : f;
+      if (label)
+        println("  jmp %s", label);
+      return;
+    }
+    break;
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    Type *ty = node->lhs->ty;
+
+    // Unordered operands make EQ and NE depend on the parity flag,
+    // so we leave them to gen_expr().
+    if (ty->kind == TY_FLOAT || ty->kind == TY_DOUBLE) {
+      if (node->kind == ND_EQ || node->kind == ND_NE)
+        break;
+
+      char *xmm = gen_float_operands(node);
+      char *sz = (ty->kind == TY_FLOAT) ? "ss" : "sd";
+      println("  ucomi%s %%xmm0, %s", sz, xmm);
+      if (node->kind == ND_LT)
+        jump_cond("a", "be", t, f);
+      else
+        jump_cond("ae", "b", t, f);
+      return;
+    }
+
+    if (ty->kind == TY_LDOUBLE)
+      break;
+
+    int sz = (ty->kind == TY_LONG || ty->base) ? 8 : 4;
+    char *di = gen_operands(node, sz);
+    println("  cmp %s, %s", di, reg_name("%rax", sz));
+
+    if (node->kind == ND_EQ)
+      jump_cond("e", "ne", t, f);
+    else if (node->kind == ND_NE)
+      jump_cond("ne", "e", t, f);
+    else if (node->kind == ND_LT && ty->is_unsigned)
+      jump_cond("b", "ae", t, f);
+    else if (node->kind == ND_LT)
+      jump_cond("l", "ge", t, f);
+    else if (ty->is_unsigned)
+      jump_cond("be", "a", t, f);
+    else
+      jump_cond("le", "g", t, f);
+    return;
+  }
+  }
+
+  gen_expr(node);
+  cmp_zero(node->ty);
+  jump_cond("ne", "e", t, f);
+}
+
+// Switch statements whose case values are dense enough are compiled
+// to jump tables. Others are compiled to binary decision trees.
+#define MAX_JUMP_TABLE 4096
+#define MIN_JUMP_TABLE 4
+
+// Returns a value that has the same order as a case value `val` when
+// compared as a signed 64-bit integer.
+long case_key(Node *sw, long val) {
+  Type *ty = sw->cond->ty;
+  if (ty->size == 8)
+    return ty->is_unsigned ? val ^ (1L << 63) : val;
+  if (ty->is_unsigned)
+    return (uint32_t)val;
+  return (int32_t)val;
+}
+
+static _Thread_local Node *sort_switch;
+
+static int cmp_case(const void *a, const void *b) {
+  long x = case_key(sort_switch, (*(Node **)a)->begin);
+  long y = case_key(sort_switch, (*(Node **)b)->begin);
+  return (x > y) - (x < y);
+}
+
+// Returns the cases of a switch statement sorted by their values.
+Node **sort_cases(Node *sw, int *len) {
+  int n = 0;
+  for (Node *c = sw->cases; c; c = c->case_next)
+    n++;
+
+  Node **cases = calloc(n + 1, sizeof(Node *));
+  int i = 0;
+  for (Node *c = sw->cases; c; c = c->case_next)
+    cases[i++] = c;
+
+  sort_switch = sw;
+  qsort(cases, n, sizeof(Node *), cmp_case);
+  *len = n;
+  return cases;
+}
+
+// Returns true if sorted cases should be compiled to a jump table.
+bool use_jump_table(Node *sw, Node **cases, int n) {
+  if (n < MIN_JUMP_TABLE)
+    return false;
+
+  long lo = case_key(sw, cases[0]->begin);
+  long hi = case_key(sw, cases[n - 1]->end);
+  unsigned long range = (unsigned long)hi - lo + 1;
+  if (range > MAX_JUMP_TABLE)
+    return false;
+
+  // At least one third of the entries must be used.
+  unsigned long nvals = 0;
+  for (int i = 0; i < n; i++)
+    nvals += case_key(sw, cases[i]->end) - case_key(sw, cases[i]->begin) + 1;
+  return range <= nvals * 3;
+}
+
+static char *switch_default(Node *sw) {
+  return sw->default_case ? sw->default_case->label : sw->brk_label;
+}
+
+// Emits a binary decision tree for cases[lo..hi), assuming that the
+// switch value is in %rax.
+static void gen_switch_tree(Node *sw, Node **cases, int lo, int hi) {
+  char *ax = (sw->cond->ty->size == 8) ? "%rax" : "%eax";
+  char *di = (sw->cond->ty->size == 8) ? "%rdi" : "%edi";
+
+  if (hi - lo > 3) {
+    int mid = (lo + hi) / 2;
+    int c = count();
+    println("  cmp $%ld, %s", cases[mid]->begin, ax);
+    println("  %s .L.switch.%s.%d", sw->cond->ty->is_unsigned ? "jb" : "jl",
+            current_fn->name, c);
+    gen_switch_tree(sw, cases, mid, hi);
+    println(".L.switch.%s.%d:", current_fn->name, c);
+    gen_switch_tree(sw, cases, lo, mid);
+    return;
+  }
+
+  for (int i = lo; i < hi; i++) {
+    Node *n = cases[i];
+    if (n->begin == n->end) {
+      println("  cmp $%ld, %s", n->begin, ax);
+      println("  je %s", n->label);
+      continue;
+    }
+
+    // [GNU] Case ranges
+    println("  mov %s, %s", ax, di);
+    println("  sub $%ld, %s", n->begin, di);
+    println("  cmp $%ld, %s", n->end - n->begin, di);
+    println("  jbe %s", n->label);
+  }
+  println("  jmp %s", switch_default(sw));
+}
+
+// With -fprofile-use, tests the value in %rax for the cases that ran
+// most often before the usual dispatch, as long as each of them covers
+// at least half of the remaining executions of the switch.
+static void gen_hot_cases(Node *sw) {
+  if (!has_profile(current_fn))
+    return;
+
+  long total = 0;
+  if (sw->default_case)
+    total = profile_count(current_fn, sw->default_case, "case");
+
+  int n;
+  Node **cases = sort_cases(sw, &n);
+  long *counts = calloc(n + 1, sizeof(long));
+  for (int i = 0; i < n; i++) {
+    counts[i] = profile_count(current_fn, cases[i], "case");
+    total += counts[i];
+  }
 
-      println("  movzb %%al, %%rax");
-      return;
+  char *ax = (sw->cond->ty->size == 8) ? "%rax" : "%eax";
+  char *di = (sw->cond->ty->size == 8) ? "%rdi" : "%edi";
+
+  for (int k = 0; k < 4; k++) {
+    int hot = -1;
+    for (int i = 0; i < n; i++)
+      if (counts[i] > 0 && (hot == -1 || counts[i] > counts[hot]))
+        hot = i;
+    if (hot == -1 || counts[hot] * 2 < total)
+      break;
+
+    Node *c = cases[hot];
+    if (c->begin == c->end) {
+      println("  cmp $%ld, %s", c->begin, ax);
+      println("  je %s", c->label);
+    } else {
+      println("  mov %s, %s", ax, di);
+      println("  sub $%ld, %s", c->begin, di);
+      println("  cmp $%ld, %s", c->end - c->begin, di);
+      println("  jbe %s", c->label);
     }
+    total -= counts[hot];
+    counts[hot] = 0;
+  }
 
-    error_tok(node->tok, "invalid expression");
+  free(counts);
+  free(cases);
+}
+
+// Emits a jump to the case label for the value in %rax.
+static void gen_switch(Node *sw) {
+  gen_hot_cases(sw);
+
+  int n;
+  Node **cases = sort_cases(sw, &n);
+
+  if (!use_jump_table(sw, cases, n)) {
+    gen_switch_tree(sw, cases, 0, n);
+    free(cases);
+    return;
   }
+
+  char *ax = (sw->cond->ty->size == 8) ? "%rax" : "%eax";
+  long lo = case_key(sw, cases[0]->begin);
+  long hi = case_key(sw, cases[n - 1]->end);
+  int c = count();
+
+  println("  sub $%ld, %s", cases[0]->begin, ax);
+  println("  cmp $%ld, %s", hi - lo, ax);
+  println("  ja %s", switch_default(sw));
+  println("  lea .L.jtab.%s.%d(%%rip), %%rdi", current_fn->name, c);
+  println("  movslq (%%rdi,%%rax,4), %%rax");
+  println("  add %%rdi, %%rax");
+  println("  jmp *%%rax");
+
+  println("  .section .rodata");
+  println("  .align 4");
+  println(".L.jtab.%s.%d:", current_fn->name, c);
+  for (int i = 0; i < n; i++) {
+    long begin = case_key(sw, cases[i]->begin);
+    long end = case_key(sw, cases[i]->end);
+    for (long v = lo; v < begin; v++)
+      println("  .long %s-.L.jtab.%s.%d", switch_default(sw), current_fn->name, c);
+    for (long v = begin; v <= end; v++)
+      println("  .long %s-.L.jtab.%s.%d", cases[i]->label, current_fn->name, c);
+    lo = end + 1;
   }
+  println("  .text");
+  free(cases);
+}
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("%rdi");
+// Returns the call if a return statement's value is a call that can
+// reuse the caller's frame. Its arguments must be passed in registers,
+// its value must need no conversion, and no local of the caller may
+// be reachable from the callee, since the caller's frame goes away.
+static Node *tail_call(Node *node) {
+  // The exit hook of -finstrument-functions runs in the epilogue.
+  if (!opt_O || !node || depth || opt_instrument_functions)
+    return NULL;
 
-  char *ax, *di, *dx;
+  Type *ty = current_fn->ty->return_ty;
+  if (node->kind == ND_CAST)
+    node = node->lhs;
+  if (node->kind != ND_FUNCALL || node->ret_buffer)
+    return NULL;
+  if (node->lhs->kind == ND_VAR && !strcmp(node->lhs->var->name, "alloca"))
+    return NULL;
+
+  if (ty->kind != TY_VOID &&
+      !(ty->kind == node->ty->kind && ty->size == node->ty->size &&
+        ty->is_unsigned == node->ty->is_unsigned))
+    return NULL;
+
+  if (classify_args(node))
+    return NULL;
+
+  if (current_fn->uses_alloca || current_fn->va_area)
+    return NULL;
+  for (Obj *var = current_fn->locals; var; var = var->next)
+    if (var->is_addr_taken || !is_scalar(var->ty))
+      return NULL;
+  return node;
+}
 
-  if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base) {
-    ax = "%rax";
-    di = "%rdi";
-    dx = "%rdx";
-  } else {
-    ax = "%eax";
-    di = "%edi";
-    dx = "%edx";
+static bool is_self_call(Node *node) {
+  Node *fn = node->lhs;
+  return fn->kind == ND_VAR && fn->var->is_function &&
+         !strcmp(fn->var->name, current_fn->name);
+}
+
+static void gen_epilogue(Obj *fn);
+
+// Emits a call in tail position as a jump. A call to the function
+// itself jumps back to the start of its body.
+static void gen_tail_call(Node *node) {
+  println("  .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+  gen_call_args(node);
+
+  if (is_self_call(node)) {
+    println("  jmp .L.tail.%s", current_fn->name);
+    return;
   }
 
+  gen_epilogue(current_fn);
+  println("  jmp *%%r10");
+}
+
+// Returns 1 if __builtin_expect says that a condition is likely true,
+// -1 if it is likely false, or 0 if there's no hint.
+static int expected_value(Node *node) {
   switch (node->kind) {
-  case ND_ADD:
-    println("  add %s, %s", di, ax);
-    return;
-  case ND_SUB:
-    println("  sub %s, %s", di, ax);
-    return;
-  case ND_MUL:
-    println("  imul %s, %s", di, ax);
-    return;
-  case ND_DIV:
-  case ND_MOD:
-    if (node->ty->is_unsigned) {
-      println("  mov $0, %s", dx);
-      println("  div %s", di);
-    } else {
-      if (node->lhs->ty->size == 8)
-        println("  cqo");
-      else
-        println("  cdq");
-      println("  idiv %s", di);
-    }
+  case ND_CAST:
+    return node->expect ? node->expect : expected_value(node->lhs);
+  case ND_NOT:
+    return -expected_value(node->lhs);
+  case ND_COMMA:
+    return expected_value(node->rhs);
+  }
+  return 0;
+}
 
-    if (node->kind == ND_MOD)
-      println("  mov %%rdx, %%rax");
-    return;
-  case ND_BITAND:
-    println("  and %s, %s", di, ax);
-    return;
-  case ND_BITOR:
-    println("  or %s, %s", di, ax);
-    return;
-  case ND_BITXOR:
-    println("  xor %s, %s", di, ax);
-    return;
-  case ND_EQ:
-  case ND_NE:
-  case ND_LT:
-  case ND_LE:
-    println("  cmp %s, %s", di, ax);
+typedef enum {
+  IF_NORMAL,    // No hint, or the then arm is the likely one
+  IF_HOT_ELSE,  // The else arm is more likely
+  IF_COLD_THEN, // The then arm is unlikely to run
+  IF_COLD_ELSE, // The else arm is unlikely to run
+} IfLayout;
+
+// Decides how to lay out an if statement. The likely arm falls
+// through from the condition, and an arm that never ran in the
+// profile or that __builtin_expect says is unlikely goes out of line.
+static IfLayout if_layout(Node *node) {
+  long then_n = profile_count(current_fn, node, "then");
+  long else_n = profile_count(current_fn, node, "else");
+
+  if (then_n >= 0 && then_n + else_n > 0) {
+    if (then_n == 0)
+      return IF_COLD_THEN;
+    if (else_n == 0)
+      return node->els ? IF_COLD_ELSE : IF_NORMAL;
+    return (node->els && else_n > then_n) ? IF_HOT_ELSE : IF_NORMAL;
+  }
 
-    if (node->kind == ND_EQ) {
-      println("  sete %%al");
-    } else if (node->kind == ND_NE) {
-      println("  setne %%al");
-    } else if (node->kind == ND_LT) {
-      if (node->lhs->ty->is_unsigned)
-        println("  setb %%al");
-      else
-        println("  setl %%al");
-    } else if (node->kind == ND_LE) {
-      if (node->lhs->ty->is_unsigned)
-        println("  setbe %%al");
-      else
-        println("  setle %%al");
-    }
+  switch (expected_value(node->cond)) {
+  case 1:
+    return node->els ? IF_COLD_ELSE : IF_NORMAL;
+  case -1:
+    return IF_COLD_THEN;
+  }
+  return IF_NORMAL;
+}
 
-    println("  movzb %%al, %%rax");
-    return;
-  case ND_SHL:
-    println("  mov %%rdi, %%rcx");
-    println("  shl %%cl, %s", ax);
-    return;
-  case ND_SHR:
-    println("  mov %%rdi, %%rcx");
-    if (node->lhs->ty->is_unsigned)
-      println("  shr %%cl, %s", ax);
-    else
-      println("  sar %%cl, %s", ax);
+static void add_cold_block(Node *node, bool is_then, char *label, char *end) {
+  ColdBlock *b = calloc(1, sizeof(ColdBlock));
+  b->node = node;
+  b->is_then = is_then;
+  b->label = label;
+  b->end = end;
+  b->depth = depth;
+  b->ntmps = ntmps;
+  b->nftmps = nftmps;
+  b->next = cold_blocks;
+  cold_blocks = b;
+}
+
+// Emits the arms that add_cold_block() moved out of line. They may
+// contain more such arms, which are emitted too.
+static void emit_cold_blocks(void) {
+  if (!cold_blocks)
     return;
-  }
 
-  error_tok(node->tok, "invalid expression");
+  println("  .section .text.unlikely,\"ax\",@progbits");
+  while (cold_blocks) {
+    ColdBlock *b = cold_blocks;
+    cold_blocks = b->next;
+    depth = b->depth;
+    ntmps = b->ntmps;
+    nftmps = b->nftmps;
+
+    println("%s:", b->label);
+    prof_count(b->node, b->is_then ? "then" : "else");
+    gen_stmt(b->is_then ? b->node->then : b->node->els);
+    println("  jmp %s", b->end);
+  }
+  depth = ntmps = nftmps = 0;
+  println("  .text");
 }
 
 static void gen_stmt(Node *node) {
@@ -1191,75 +2720,84 @@ static void gen_stmt(Node *node) {
   switch (node->kind) {
   case ND_IF: {
     int c = count();
-    gen_expr(node->cond);
-    cmp_zero(node->cond->ty);
-    println("  je  .L.else.%d", c);
+    char *then = format(".L.then.%s.%d", current_fn->name, c);
+    char *els = format(".L.else.%s.%d", current_fn->name, c);
+    char *end = format(".L.end.%s.%d", current_fn->name, c);
+
+    switch (if_layout(node)) {
+    case IF_COLD_THEN:
+      gen_cond(node->cond, then, NULL);
+      prof_count(node, "else");
+      if (node->els)
+        gen_stmt(node->els);
+      println("%s:", end);
+      add_cold_block(node, true, then, end);
+      return;
+    case IF_COLD_ELSE:
+      gen_cond(node->cond, NULL, els);
+      prof_count(node, "then");
+      gen_stmt(node->then);
+      println("%s:", end);
+      add_cold_block(node, false, els, end);
+      return;
+    case IF_HOT_ELSE:
+      gen_cond(node->cond, then, NULL);
+      prof_count(node, "else");
+      gen_stmt(node->els);
+      println("  jmp %s", end);
+      println("%s:", then);
+      prof_count(node, "then");
+      gen_stmt(node->then);
+      println("%s:", end);
+      return;
+    }
+
+    gen_cond(node->cond, NULL, els);
+    prof_count(node, "then");
     gen_stmt(node->then);
-    println("  jmp .L.end.%d", c);
-    println(".L.else.%d:", c);
+    println("  jmp %s", end);
+    println("%s:", els);
+    prof_count(node, "else");
     if (node->els)
       gen_stmt(node->els);
-    println(".L.end.%d:", c);
+    println("%s:", end);
     return;
   }
   case ND_FOR: {
     int c = count();
     if (node->init)
       gen_stmt(node->init);
-    println(".L.begin.%d:", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      cmp_zero(node->cond->ty);
-      println("  je %s", node->brk_label);
-    }
+    println(".L.begin.%s.%d:", current_fn->name, c);
+    if (node->cond)
+      gen_cond(node->cond, NULL, node->brk_label);
+    prof_count(node, "loop");
     gen_stmt(node->then);
     println("%s:", node->cont_label);
     if (node->inc)
-      gen_expr(node->inc);
-    println("  jmp .L.begin.%d", c);
+      gen_void_expr(node->inc);
+    println("  jmp .L.begin.%s.%d", current_fn->name, c);
     println("%s:", node->brk_label);
     return;
   }
   case ND_DO: {
     int c = count();
-    println(".L.begin.%d:", c);
+    println(".L.begin.%s.%d:", current_fn->name, c);
+    prof_count(node, "loop");
     gen_stmt(node->then);
     println("%s:", node->cont_label);
-    gen_expr(node->cond);
-    cmp_zero(node->cond->ty);
-    println("  jne .L.begin.%d", c);
+    gen_cond(node->cond, format(".L.begin.%s.%d", current_fn->name, c), NULL);
     println("%s:", node->brk_label);
     return;
   }
   case ND_SWITCH:
     gen_expr(node->cond);
-
-    for (Node *n = node->case_next; n; n = n->case_next) {
-      char *ax = (node->cond->ty->size == 8) ? "%rax" : "%eax";
-      char *di = (node->cond->ty->size == 8) ? "%rdi" : "%edi";
-
-      if (n->begin == n->end) {
-        println("  cmp $%ld, %s", n->begin, ax);
-        println("  je %s", n->label);
-        continue;
-      }
-
-      // [GNU] Case ranges
-      println("  mov %s, %s", ax, di);
-      println("  sub $%ld, %s", n->begin, di);
-      println("  cmp $%ld, %s", n->end - n->begin, di);
-      println("  jbe %s", n->label);
-    }
-
-    if (node->default_case)
-      println("  jmp %s", node->default_case->label);
-
-    println("  jmp %s", node->brk_label);
+    gen_switch(node);
     gen_stmt(node->then);
     println("%s:", node->brk_label);
     return;
   case ND_CASE:
     println("%s:", node->label);
+    prof_count(node, "case");
     gen_stmt(node->lhs);
     return;
   case ND_BLOCK:
@@ -1277,7 +2815,13 @@ static void gen_stmt(Node *node) {
     println("%s:", node->unique_label);
     gen_stmt(node->lhs);
     return;
-  case ND_RETURN:
+  case ND_RETURN: {
+    Node *call = tail_call(node->lhs);
+    if (call) {
+      gen_tail_call(call);
+      return;
+    }
+
     if (node->lhs) {
       gen_expr(node->lhs);
       Type *ty = node->lhs->ty;
@@ -1295,10 +2839,13 @@ static void gen_stmt(Node *node) {
 
     println("  jmp .L.return.%s", current_fn->name);
     return;
+  }
   case ND_EXPR_STMT:
-    gen_expr(node->lhs);
+    gen_void_expr(node->lhs);
     return;
   case ND_ASM:
+    // Inline assembly may use the stack or %rbp.
+    frame_needed = true;
     println("  %s", node->asm_str);
     return;
   }
@@ -1309,7 +2856,7 @@ static void gen_stmt(Node *node) {
 // Assign offsets to local variables.
 static void assign_lvar_offsets(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function)
+    if (!fn->is_function || fn->asm_text)
       continue;
 
     // If a function has many parameters, some parameters are
@@ -1320,6 +2867,8 @@ static void assign_lvar_offsets(Obj *prog) {
 
     int gp = 0, fp = 0;
 
+    fn->nregs = (opt_O && fn->body) ? alloc_regs(fn, NUM_REGS) : 0;
+
     // Assign offsets to pass-by-stack parameters.
     for (Obj *var = fn->params; var; var = var->next) {
       Type *ty = var->ty;
@@ -1356,7 +2905,7 @@ static void assign_lvar_offsets(Obj *prog) {
 
     // Assign offsets to pass-by-register parameters and local variables.
     for (Obj *var = fn->locals; var; var = var->next) {
-      if (var->offset)
+      if (var->offset || var->reg)
         continue;
 
       // AMD64 System V ABI has a special alignment rule for an array of
@@ -1371,13 +2920,121 @@ static void assign_lvar_offsets(Obj *prog) {
       var->offset = -bottom;
     }
 
+    // The address of the TLS block for the local-dynamic model is
+    // computed once in the prologue.
+    fn->tls_base_offset = 0;
+    if (local_dynamic_var(fn->body)) {
+      bottom = align_to(bottom, 8) + 8;
+      fn->tls_base_offset = -bottom;
+    }
+
+    // Callee-saved registers used for local variables are saved below
+    // the locals.
+    bottom = align_to(bottom, 8) + fn->nregs * 8;
+    fn->regsave_offset = -bottom;
+
     fn->stack_size = align_to(bottom, 16);
   }
 }
 
+// Returns true if a byte can be written as is inside a string
+// directive, possibly with a backslash escape.
+static bool is_string_char(char c) {
+  return (' ' <= c && c <= '~') || c == '\n' || c == '\t';
+}
+
+typedef enum { DATA_ZERO, DATA_STRING, DATA_NUM } DataKind;
+
+// Decides how to emit the bytes at the beginning of a given buffer.
+// Long runs of zeros become .zero, and printable runs become .ascii or
+// .string. Everything else is written as numbers. This looks at no
+// more than a fixed number of bytes.
+static DataKind classify_data(char *p, int len) {
+  int n = 0;
+  while (n < len && n < 16 && p[n] == 0)
+    n++;
+  if (n == 16)
+    return DATA_ZERO;
+
+  n = 0;
+  while (n < len && n < 8 && is_string_char(p[n]))
+    n++;
+  if (n == 8 || (n >= 4 && n < len && p[n] == 0))
+    return DATA_STRING;
+  return DATA_NUM;
+}
+
+static void emit_string_data(char *p, int len, bool nul) {
+  fprintf(output_file, "  %s \"", nul ? ".string" : ".ascii");
+  for (int i = 0; i < len; i++) {
+    switch (p[i]) {
+    case '"': fprintf(output_file, "\\\""); break;
+    case '\\': fprintf(output_file, "\\\\"); break;
+    case '\n': fprintf(output_file, "\\n"); break;
+    case '\t': fprintf(output_file, "\\t"); break;
+    default: fputc(p[i], output_file);
+    }
+  }
+  fprintf(output_file, "\"\n");
+}
+
+static uint64_t read_data(char *p, int sz) {
+  switch (sz) {
+  case 1: return *(uint8_t *)p;
+  case 4: return *(uint32_t *)p;
+  }
+  return *(uint64_t *)p;
+}
+
+// Writes init_data[pos, end) of a global variable. The range
+// doesn't contain relocations.
+static void emit_data_range(char *data, int pos, int end) {
+  while (pos < end) {
+    DataKind kind = classify_data(data + pos, end - pos);
+
+    if (kind == DATA_ZERO) {
+      int n = 0;
+      while (pos + n < end && data[pos + n] == 0)
+        n++;
+      println("  .zero %d", n);
+      pos += n;
+      continue;
+    }
+
+    if (kind == DATA_STRING) {
+      int n = 0;
+      while (pos + n < end && n < 64 && is_string_char(data[pos + n]))
+        n++;
+      bool nul = (pos + n < end && data[pos + n] == 0);
+      emit_string_data(data + pos, n, nul);
+      pos += n + nul;
+      continue;
+    }
+
+    // Write up to 8 numbers of the widest size that the
+    // current position is aligned to.
+    int sz = 1;
+    if (pos % 8 == 0 && end - pos >= 8)
+      sz = 8;
+    else if (pos % 4 == 0 && end - pos >= 4)
+      sz = 4;
+
+    fprintf(output_file, "  %s ", (sz == 8) ? ".quad" : (sz == 4) ? ".long" : ".byte");
+    for (int i = 0; i < 8 && end - pos >= sz; i++) {
+      if (i > 0 && classify_data(data + pos, end - pos) != DATA_NUM)
+        break;
+      fprintf(output_file, "%s%lu", i ? "," : "", read_data(data + pos, sz));
+      pos += sz;
+      if (sz == 1 && pos % 4 == 0 && end - pos >= 4)
+        break;
+    }
+    fprintf(output_file, "\n");
+  }
+}
+
 static void emit_data(Obj *prog) {
   for (Obj *var = prog; var; var = var->next) {
-    if (var->is_function || !var->is_definition)
+    if (var->is_function || !var->is_definition || !var->is_live)
       continue;
 
     if (var->is_static)
@@ -1413,9 +3070,12 @@ static void emit_data(Obj *prog) {
           println("  .quad %s%+ld", *rel->label, rel->addend);
           rel = rel->next;
           pos += 8;
-        } else {
-          println("  .byte %d", var->init_data[pos++]);
+          continue;
         }
+
+        int end = rel ? rel->offset : var->ty->size;
+        emit_data_range(var->init_data, pos, end);
+        pos = end;
       }
       continue;
     }
@@ -1435,10 +3095,10 @@ static void emit_data(Obj *prog) {
 static void store_fp(int r, int offset, int sz) {
   switch (sz) {
   case 4:
-    println("  movss %%xmm%d, %d(%%rbp)", r, offset);
+    println("  movss %%xmm%d, %s", r, local_addr(offset));
     return;
   case 8:
-    println("  movsd %%xmm%d, %d(%%rbp)", r, offset);
+    println("  movsd %%xmm%d, %s", r, local_addr(offset));
     return;
   }
   unreachable();
@@ -1447,139 +3107,382 @@ static void store_fp(int r, int offset, int sz) {
 static void store_gp(int r, int offset, int sz) {
   switch (sz) {
   case 1:
-    println("  mov %s, %d(%%rbp)", argreg8[r], offset);
+    println("  mov %s, %s", argreg8[r], local_addr(offset));
     return;
   case 2:
-    println("  mov %s, %d(%%rbp)", argreg16[r], offset);
+    println("  mov %s, %s", argreg16[r], local_addr(offset));
     return;
   case 4:
-    println("  mov %s, %d(%%rbp)", argreg32[r], offset);
+    println("  mov %s, %s", argreg32[r], local_addr(offset));
     return;
   case 8:
-    println("  mov %s, %d(%%rbp)", argreg64[r], offset);
+    println("  mov %s, %s", argreg64[r], local_addr(offset));
     return;
   default:
-    for (int i = 0; i < sz; i++) {
-      println("  mov %s, %d(%%rbp)", argreg8[r], offset + i);
-      println("  shr $8, %s", argreg64[r]);
-    }
+    store_bytes(argreg64[r], offset, sz);
     return;
   }
 }
 
-static void emit_text(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function || !fn->is_definition)
-      continue;
+// Restores callee-saved registers and tears down the frame.
+static void gen_epilogue(Obj *fn) {
+  for (int i = 0; i < fn->nregs; i++)
+    println("  mov %s, %s", local_addr(fn->regsave_offset + i * 8), calleereg[i]);
+  if (!frameless) {
+    println("  mov %%rbp, %%rsp");
+    println("  pop %%rbp");
+  }
+}
 
-    // No code is emitted for "static inline" functions
-    // if no one is referencing them.
-    if (!fn->is_live)
-      continue;
+// With -finstrument-functions, calls `hook(this_fn, call_site)` like
+// GCC does. This needs %rbp to find the return address.
+static void gen_instrument_call(Obj *fn, char *hook) {
+  if (opt_fpic && !fn->is_static)
+    println("  mov %s@GOTPCREL(%%rip), %%rdi", fn->name);
+  else
+    println("  lea %s(%%rip), %%rdi", fn->name);
+  println("  mov 8(%%rbp), %%rsi");
+  println("  call %s@PLT", hook);
+}
 
-    if (fn->is_static)
-      println("  .local %s", fn->name);
-    else
-      println("  .globl %s", fn->name);
+// Calls the exit hook of -finstrument-functions, keeping the return
+// value, which may be in %rax, %rdx, %xmm0, %xmm1 or on the x87 stack.
+static void gen_exit_hook(Obj *fn) {
+  if (fn->ty->return_ty->kind == TY_LDOUBLE) {
+    println("  sub $16, %%rsp");
+    println("  fstpt (%%rsp)");
+    gen_instrument_call(fn, "__cyg_profile_func_exit");
+    println("  fldt (%%rsp)");
+    println("  add $16, %%rsp");
+    return;
+  }
+
+  println("  push %%rax");
+  println("  push %%rdx");
+  println("  sub $32, %%rsp");
+  println("  movdqu %%xmm0, (%%rsp)");
+  println("  movdqu %%xmm1, 16(%%rsp)");
+  gen_instrument_call(fn, "__cyg_profile_func_exit");
+  println("  movdqu (%%rsp), %%xmm0");
+  println("  movdqu 16(%%rsp), %%xmm1");
+  println("  add $32, %%rsp");
+  println("  pop %%rdx");
+  println("  pop %%rax");
+}
+
+static void emit_function(Obj *fn) {
+  label_count = 0;
+  frame_needed = false;
+  prof_names = (StringArray){};
+  cold_blocks = NULL;
+
+  if (opt_O)
+    insn_buf = new_insn_buf();
+
+  if (fn->is_static)
+    println("  .local %s", fn->name);
+  else
+    println("  .globl %s", fn->name);
 
-    println("  .text");
-    println("  .type %s, @function", fn->name);
-    println("%s:", fn->name);
-    current_fn = fn;
+  println("  .text");
+  println("  .type %s, @function", fn->name);
+  println("%s:", fn->name);
 
-    // Prologue
+  // Prologue
+  if (!frameless) {
     println("  push %%rbp");
     println("  mov %%rsp, %%rbp");
+    // mcount finds its caller through %rbp and preserves the
+    // argument registers.
+    if (opt_pg)
+      println("  call mcount@PLT");
     println("  sub $%d, %%rsp", fn->stack_size);
-    println("  mov %%rsp, %d(%%rbp)", fn->alloca_bottom->offset);
-
-    // Save arg registers if function is variadic
-    if (fn->va_area) {
-      int gp = 0, fp = 0;
-      for (Obj *var = fn->params; var; var = var->next) {
-        if (is_flonum(var->ty))
-          fp++;
-        else
-          gp++;
-      }
+  }
 
-      int off = fn->va_area->offset;
-
-      // va_elem
-      println("  movl $%d, %d(%%rbp)", gp * 8, off);          // gp_offset
-      println("  movl $%d, %d(%%rbp)", fp * 8 + 48, off + 4); // fp_offset
-      println("  movq %%rbp, %d(%%rbp)", off + 8);            // overflow_arg_area
-      println("  addq $16, %d(%%rbp)", off + 8);
-      println("  movq %%rbp, %d(%%rbp)", off + 16);           // reg_save_area
-      println("  addq $%d, %d(%%rbp)", off + 24, off + 16);
-
-      // __reg_save_area__
-      println("  movq %%rdi, %d(%%rbp)", off + 24);
-      println("  movq %%rsi, %d(%%rbp)", off + 32);
-      println("  movq %%rdx, %d(%%rbp)", off + 40);
-      println("  movq %%rcx, %d(%%rbp)", off + 48);
-      println("  movq %%r8, %d(%%rbp)", off + 56);
-      println("  movq %%r9, %d(%%rbp)", off + 64);
-      println("  movsd %%xmm0, %d(%%rbp)", off + 72);
-      println("  movsd %%xmm1, %d(%%rbp)", off + 80);
-      println("  movsd %%xmm2, %d(%%rbp)", off + 88);
-      println("  movsd %%xmm3, %d(%%rbp)", off + 96);
-      println("  movsd %%xmm4, %d(%%rbp)", off + 104);
-      println("  movsd %%xmm5, %d(%%rbp)", off + 112);
-      println("  movsd %%xmm6, %d(%%rbp)", off + 120);
-      println("  movsd %%xmm7, %d(%%rbp)", off + 128);
-    }
-
-    // Save passed-by-register arguments to the stack
+  if (fn->uses_alloca)
+    println("  mov %%rsp, %s", local_addr(fn->alloca_bottom->offset));
+
+  for (int i = 0; i < fn->nregs; i++)
+    println("  mov %s, %s", calleereg[i], local_addr(fn->regsave_offset + i * 8));
+
+  // Save arg registers if function is variadic
+  if (fn->va_area) {
     int gp = 0, fp = 0;
     for (Obj *var = fn->params; var; var = var->next) {
-      if (var->offset > 0)
-        continue;
+      if (is_flonum(var->ty))
+        fp++;
+      else
+        gp++;
+    }
 
-      Type *ty = var->ty;
+    int off = fn->va_area->offset;
+
+    // va_elem
+    println("  movl $%d, %d(%%rbp)", gp * 8, off);          // gp_offset
+    println("  movl $%d, %d(%%rbp)", fp * 8 + 48, off + 4); // fp_offset
+    println("  movq %%rbp, %d(%%rbp)", off + 8);            // overflow_arg_area
+    println("  addq $16, %d(%%rbp)", off + 8);
+    println("  movq %%rbp, %d(%%rbp)", off + 16);           // reg_save_area
+    println("  addq $%d, %d(%%rbp)", off + 24, off + 16);
+
+    // __reg_save_area__
+    println("  movq %%rdi, %d(%%rbp)", off + 24);
+    println("  movq %%rsi, %d(%%rbp)", off + 32);
+    println("  movq %%rdx, %d(%%rbp)", off + 40);
+    println("  movq %%rcx, %d(%%rbp)", off + 48);
+    println("  movq %%r8, %d(%%rbp)", off + 56);
+    println("  movq %%r9, %d(%%rbp)", off + 64);
+    println("  movsd %%xmm0, %d(%%rbp)", off + 72);
+    println("  movsd %%xmm1, %d(%%rbp)", off + 80);
+    println("  movsd %%xmm2, %d(%%rbp)", off + 88);
+    println("  movsd %%xmm3, %d(%%rbp)", off + 96);
+    println("  movsd %%xmm4, %d(%%rbp)", off + 104);
+    println("  movsd %%xmm5, %d(%%rbp)", off + 112);
+    println("  movsd %%xmm6, %d(%%rbp)", off + 120);
+    println("  movsd %%xmm7, %d(%%rbp)", off + 128);
+  }
 
-      switch (ty->kind) {
-      case TY_STRUCT:
-      case TY_UNION:
-        assert(ty->size <= 16);
-        if (has_flonum(ty, 0, 8, 0))
-          store_fp(fp++, var->offset, MIN(8, ty->size));
-        else
-          store_gp(gp++, var->offset, MIN(8, ty->size));
+  // A self-recursive tail call sets up new arguments and jumps here.
+  if (opt_O)
+    println(".L.tail.%s:", fn->name);
 
-        if (ty->size > 8) {
-          if (has_flonum(ty, 8, 16, 0))
-            store_fp(fp++, var->offset + 8, ty->size - 8);
-          else
-            store_gp(gp++, var->offset + 8, ty->size - 8);
-        }
-        break;
-      case TY_FLOAT:
-      case TY_DOUBLE:
-        store_fp(fp++, var->offset, ty->size);
-        break;
-      default:
-        store_gp(gp++, var->offset, ty->size);
+  // Save passed-by-register arguments to the stack
+  int gp = 0, fp = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    if (var->offset > 0) {
+      if (var->reg) {
+        load_from(var->ty, local_addr(var->offset));
+        println("  mov %%rax, %s", calleereg[var->reg - 1]);
       }
+      continue;
     }
 
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+    Type *ty = var->ty;
+
+    switch (ty->kind) {
+    case TY_STRUCT:
+    case TY_UNION:
+      assert(ty->size <= 16);
+      if (has_flonum(ty, 0, 8, 0))
+        store_fp(fp++, var->offset, MIN(8, ty->size));
+      else
+        store_gp(gp++, var->offset, MIN(8, ty->size));
 
-    // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
-    // a special rule for the main function. Reaching the end of the
-    // main function is equivalent to returning 0, even though the
-    // behavior is undefined for the other functions.
-    if (strcmp(fn->name, "main") == 0)
-      println("  mov $0, %%rax");
+      if (ty->size > 8) {
+        if (has_flonum(ty, 8, 16, 0))
+          store_fp(fp++, var->offset + 8, ty->size - 8);
+        else
+          store_gp(gp++, var->offset + 8, ty->size - 8);
+      }
+      break;
+    case TY_FLOAT:
+    case TY_DOUBLE:
+      store_fp(fp++, var->offset, ty->size);
+      break;
+    default:
+      if (var->reg)
+        store_reg(ty, argreg64[gp++], calleereg[var->reg - 1]);
+      else
+        store_gp(gp++, var->offset, ty->size);
+    }
+  }
 
-    // Epilogue
-    println(".L.return.%s:", fn->name);
-    println("  mov %%rbp, %%rsp");
-    println("  pop %%rbp");
-    println("  ret");
+  // @tlsld refers to the TLS block of the module that defines the
+  // variable, which is this one.
+  if (fn->tls_base_offset) {
+    println("  lea %s@tlsld(%%rip), %%rdi", local_dynamic_var(fn->body)->name);
+    println("  call __tls_get_addr@PLT");
+    println("  mov %%rax, %s", local_addr(fn->tls_base_offset));
+    frame_needed = true;
   }
+
+  if (opt_instrument_functions)
+    gen_instrument_call(fn, "__cyg_profile_func_enter");
+  prof_count(fn->body, "entry");
+
+  // Emit code
+  gen_stmt(fn->body);
+  assert(depth == 0);
+
+  // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
+  // a special rule for the main function. Reaching the end of the
+  // main function is equivalent to returning 0, even though the
+  // behavior is undefined for the other functions.
+  if (strcmp(fn->name, "main") == 0)
+    println("  mov $0, %%rax");
+
+  // Epilogue
+  println(".L.return.%s:", fn->name);
+  if (opt_instrument_functions)
+    gen_exit_hook(fn);
+  gen_epilogue(fn);
+  println("  ret");
+
+  emit_cold_blocks();
+}
+
+// Writes the counters of -fprofile-generate for the current function
+// and their descriptions. A (counters, descriptions, count) triple for
+// each function goes to the chibicc_prof section, which the linker
+// concatenates and brackets with __start_ and __stop_ symbols.
+static void emit_profile_data(Obj *fn) {
+  if (prof_names.len == 0)
+    return;
+
+  println("  .bss");
+  println("  .align 8");
+  println(".L.prof.ctr.%s:", fn->name);
+  println("  .zero %d", prof_names.len * 8);
+
+  println("  .data");
+  for (int i = 0; i < prof_names.len; i++) {
+    println(".L.prof.str.%s.%d:", fn->name, i);
+    emit_data_range(prof_names.data[i], 0, strlen(prof_names.data[i]) + 1);
+  }
+  println("  .align 8");
+  println(".L.prof.name.%s:", fn->name);
+  for (int i = 0; i < prof_names.len; i++)
+    println("  .quad .L.prof.str.%s.%d", fn->name, i);
+
+  println("  .section chibicc_prof,\"aw\",@progbits");
+  println("  .align 8");
+  println("  .quad .L.prof.ctr.%s, .L.prof.name.%s, %d", fn->name, fn->name,
+          prof_names.len);
+}
+
+// The runtime for -fprofile-generate. Each translation unit has a
+// hidden weak copy of __chibicc_prof_dump, so that one of them is
+// used in each executable or shared object, and registers it as a
+// destructor. The first call appends a line of
+//
+//   <count> <function> <index> <kind> <line> <column> <file>
+//
+// for each non-zero counter of the executable or shared object to
+// the file named by $CHIBICC_PROFILE, or to chibicc.prof if it is not
+// set. `kind` is one of entry, then, else, loop and case. The
+// counters are incremented without synchronization, so counts of
+// multithreaded programs are approximate.
+static void emit_profile_runtime(void) {
+  println("  .section .fini_array,\"aw\",@fini_array");
+  println("  .align 8");
+  println("  .quad __chibicc_prof_dump");
+
+  println("  .data");
+  println(".L.prof_dump.env:");
+  println("  .string \"CHIBICC_PROFILE\"");
+  println(".L.prof_dump.file:");
+  println("  .string \"chibicc.prof\"");
+  println(".L.prof_dump.fmt:");
+  println("  .string \"%%lu %%s\\n\"");
+  println("  .bss");
+  println(".L.prof_dump.done:");
+  println("  .zero 1");
+
+  println("  .text");
+  println("  .weak __chibicc_prof_dump");
+  println("  .hidden __chibicc_prof_dump");
+  println("  .hidden __start_chibicc_prof");
+  println("  .hidden __stop_chibicc_prof");
+  println("  .type __chibicc_prof_dump, @function");
+  println("__chibicc_prof_dump:");
+  println("  cmpb $0, .L.prof_dump.done(%%rip)");
+  println("  jne .L.prof_dump.ret");
+  println("  movb $1, .L.prof_dump.done(%%rip)");
+  println("  push %%rbx");
+  println("  push %%r12");
+  println("  push %%r13");
+  println("  lea .L.prof_dump.env(%%rip), %%rdi");
+  println("  call getenv@PLT");
+  println("  lea .L.prof_dump.file(%%rip), %%rdi");
+  println("  test %%rax, %%rax");
+  println("  cmovne %%rax, %%rdi");
+  println("  mov $%d, %%esi", O_WRONLY | O_CREAT | O_APPEND);
+  println("  mov $0644, %%edx");
+  println("  mov $0, %%eax");
+  println("  call open@PLT");
+  println("  test %%eax, %%eax");
+  println("  js .L.prof_dump.out");
+  println("  mov %%eax, %%r12d");
+  println("  lea __start_chibicc_prof(%%rip), %%rbx");
+  println(".L.prof_dump.fn:");
+  println("  lea __stop_chibicc_prof(%%rip), %%rax");
+  println("  cmp %%rax, %%rbx");
+  println("  jae .L.prof_dump.close");
+  println("  mov $0, %%r13");
+  println(".L.prof_dump.ctr:");
+  println("  cmp 16(%%rbx), %%r13");
+  println("  jae .L.prof_dump.next");
+  println("  mov (%%rbx), %%rax");
+  println("  mov (%%rax,%%r13,8), %%rdx");
+  println("  test %%rdx, %%rdx");
+  println("  je .L.prof_dump.skip");
+  println("  mov 8(%%rbx), %%rax");
+  println("  mov (%%rax,%%r13,8), %%rcx");
+  println("  mov %%r12d, %%edi");
+  println("  lea .L.prof_dump.fmt(%%rip), %%rsi");
+  println("  mov $0, %%eax");
+  println("  call dprintf@PLT");
+  println(".L.prof_dump.skip:");
+  println("  add $1, %%r13");
+  println("  jmp .L.prof_dump.ctr");
+  println(".L.prof_dump.next:");
+  println("  add $24, %%rbx");
+  println("  jmp .L.prof_dump.fn");
+  println(".L.prof_dump.close:");
+  println("  mov %%r12d, %%edi");
+  println("  call close@PLT");
+  println(".L.prof_dump.out:");
+  println("  pop %%r13");
+  println("  pop %%r12");
+  println("  pop %%rbx");
+  println(".L.prof_dump.ret:");
+  println("  ret");
+}
+
+static void gen_function(Obj *fn, FILE *out) {
+  output_file = out;
+  current_fn = fn;
+
+  // Whether the code moves %rsp is known only after it's generated,
+  // so a frameless attempt that turns out to need a frame is thrown
+  // away and the function is generated again.
+  frameless = opt_O && !fn->uses_alloca && !fn->va_area && !opt_pg &&
+              !opt_instrument_functions &&
+              fn->stack_size + RED_ZONE_SCRATCH <= RED_ZONE;
+  if (frameless) {
+    emit_function(fn);
+    if (frame_needed) {
+      frameless = false;
+      emit_function(fn);
+    }
+  } else {
+    emit_function(fn);
+  }
+
+  if (insn_buf) {
+    peephole(insn_buf);
+    insn_emit(insn_buf, out);
+    insn_buf = NULL;
+  }
+
+  emit_profile_data(fn);
+}
+
+// Generates code for a function as soon as it is parsed. Used by
+// -fstream-codegen. Whether the function is live is not known until
+// the end of the TU, so the code is kept until codegen() is called.
+void codegen_function(Obj *fn) {
+  Phase prev = phase_enter(PHASE_CODEGEN);
+
+  Obj *next = fn->next;
+  fn->next = NULL;
+  assign_lvar_offsets(fn);
+  fn->next = next;
+
+  FILE *out = open_memstream(&fn->asm_text, &fn->asm_len);
+  gen_function(fn, out);
+  fclose(out);
+  phase_leave(prev);
 }
 
 void codegen(Obj *prog, FILE *out) {
@@ -1591,5 +3494,14 @@ void codegen(Obj *prog, FILE *out) {
 
   assign_lvar_offsets(prog);
   emit_data(prog);
-  emit_text(prog);
+  gen_functions(prog, out, gen_function);
+
+  if (opt_profile_generate) {
+    for (Obj *fn = prog; fn; fn = fn->next) {
+      if (fn->is_function && fn->is_definition && fn->is_live) {
+        emit_profile_runtime();
+        break;
+      }
+    }
+  }
 }
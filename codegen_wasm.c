@@ -1,9 +1,14 @@
 #include "chibicc.h"
 
-static FILE *output_file;
-static Obj *current_fn;
-static int indent_level;
-static int wasm_label_count;
+// Functions may be generated in parallel (see parallel.c), so the
+// state of the function being generated is thread-local.
+static _Thread_local FILE *output_file;
+static _Thread_local Obj *current_fn;
+static _Thread_local int indent_level;
+static _Thread_local int wasm_label_count;
+
+// True if the module has vector values, so that it needs SIMD128
+static _Thread_local bool uses_simd;
 
 __attribute__((format(printf, 1, 2)))
 static void println(char *fmt, ...) {
@@ -16,6 +21,15 @@ static void println(char *fmt, ...) {
   fprintf(output_file, "\n");
 }
 
+// Labels of enclosing blocks that `break` may branch to
+typedef struct BreakTarget BreakTarget;
+struct BreakTarget {
+  char *label;
+  BreakTarget *next;
+};
+
+static _Thread_local BreakTarget *brk_targets;
+
 static void indent(void) { indent_level++; }
 static void dedent(void) { indent_level--; }
 
@@ -23,22 +37,35 @@ static int wasm_count(void) {
   return wasm_label_count++;
 }
 
-// Map C type to wasm value type
+// The type of an address. Pointers are 64 bits with -mmemory64, in
+// which case the linear memory may be larger than 4 GiB.
+static char *wasm_ptr(void) {
+  return opt_memory64 ? "i64" : "i32";
+}
+
+// Map C type to wasm value type. The data model is LP64 like on
+// x86-64, so long is i64 and the memory layout of types is the same;
+// only pointers may be narrower than in memory.
 static char *wasm_type(Type *ty) {
   if (!ty) return "i32";
   switch (ty->kind) {
   case TY_FLOAT: return "f32";
+  case TY_VECTOR: return "v128";
   case TY_DOUBLE:
   case TY_LDOUBLE: return "f64";
-  case TY_LONG:
-    if (ty->size == 8) return "i64";
-    return "i32";
-  default: return "i32";
+  case TY_PTR:
+  case TY_ARRAY:
+  case TY_FUNC:
+  case TY_STRUCT:
+  case TY_UNION:
+    return wasm_ptr();
+  default:
+    return ty->size == 8 ? "i64" : "i32";
   }
 }
 
 static bool is_wasm_i64(Type *ty) {
-  return ty && ty->kind == TY_LONG && ty->size == 8;
+  return !strcmp(wasm_type(ty), "i64");
 }
 
 static bool is_wasm_f32(Type *ty) {
@@ -53,11 +80,27 @@ static bool is_wasm_float(Type *ty) {
   return is_wasm_f32(ty) || is_wasm_f64(ty);
 }
 
-// Get the effective wasm size for a type (pointers are always 4 bytes in wasm32)
+static bool is_wasm_v128(Type *ty) {
+  return ty && ty->kind == TY_VECTOR;
+}
+
+// Returns the lane interpretation of a vector, e.g. "i32x4".
+static char *vector_shape(Type *ty) {
+  Type *elem = ty->elem;
+  if (elem->kind == TY_FLOAT)
+    return "f32x4";
+  if (elem->kind == TY_DOUBLE)
+    return "f64x2";
+  return format("i%dx%d", elem->size * 8, ty->array_len);
+}
+
+// Returns the number of bytes that a load or a store of a type
+// accesses. A pointer takes 8 bytes in memory, but only the low 4
+// bytes are used unless -mmemory64 is given.
 static int wasm_size(Type *ty) {
   if (!ty) return 4;
-  if (ty->kind == TY_PTR || ty->kind == TY_FUNC) return 4;
-  if (ty->kind == TY_LONG) return 4; // treat long as i32 in wasm32
+  if (ty->kind == TY_PTR || ty->kind == TY_FUNC)
+    return opt_memory64 ? 8 : 4;
   return ty->size;
 }
 
@@ -71,6 +114,11 @@ static void wasm_load(Type *ty) {
     return;
   }
 
+  if (ty->kind == TY_VECTOR) {
+    println("(v128.load)");
+    return;
+  }
+
   if (ty->kind == TY_FLOAT) {
     println("(f32.load)");
     return;
@@ -80,31 +128,80 @@ static void wasm_load(Type *ty) {
     return;
   }
 
-  // Integer types (including pointers as i32)
-  int sz = wasm_size(ty);
-  switch (sz) {
+  // Integer types (including pointers)
+  char *t = wasm_type(ty);
+  switch (wasm_size(ty)) {
   case 1:
-    println(ty->is_unsigned ? "(i32.load8_u)" : "(i32.load8_s)");
+    println(ty->is_unsigned ? "(%s.load8_u)" : "(%s.load8_s)", t);
     break;
   case 2:
-    println(ty->is_unsigned ? "(i32.load16_u)" : "(i32.load16_s)");
+    println(ty->is_unsigned ? "(%s.load16_u)" : "(%s.load16_s)", t);
     break;
   default:
-    println("(i32.load)");
+    println("(%s.load)", t);
     break;
   }
 }
 
+// Emits a byte-at-a-time loop over $__cp_n bytes for engines without
+// the bulk memory instructions. If `copy` is true, it copies from
+// $__cp_s to $__cp_d; otherwise it fills $__cp_d with the byte $__cp_v.
+static void gen_byte_loop(bool copy) {
+  char *p = wasm_ptr();
+  int c = wasm_count();
+  println("(local.set $__cp_n)");
+  println(copy ? "(local.set $__cp_s)" : "(local.set $__cp_v)");
+  println("(local.set $__cp_d)");
+  println("(block $__mem%d", c);
+  indent();
+  println("(loop $__mem%d_loop", c);
+  indent();
+  println("(br_if $__mem%d (%s.eqz (local.get $__cp_n)))", c, p);
+  if (copy) {
+    println("(i32.store8 (local.get $__cp_d) (i32.load8_u (local.get $__cp_s)))");
+    println("(local.set $__cp_s (%s.add (local.get $__cp_s) (%s.const 1)))", p, p);
+  } else {
+    println("(i32.store8 (local.get $__cp_d) (local.get $__cp_v))");
+  }
+  println("(local.set $__cp_d (%s.add (local.get $__cp_d) (%s.const 1)))", p, p);
+  println("(local.set $__cp_n (%s.sub (local.get $__cp_n) (%s.const 1)))", p, p);
+  println("(br $__mem%d_loop)", c);
+  dedent();
+  println(")");
+  dedent();
+  println(")");
+}
+
+// Stack: [... dst src len] -> [...]
+static void gen_copy(void) {
+  if (opt_bulk_memory)
+    println("(memory.copy)");
+  else
+    gen_byte_loop(true);
+}
+
+// Stack: [... dst val len] -> [...]
+static void gen_fill(void) {
+  if (opt_bulk_memory)
+    println("(memory.fill)");
+  else
+    gen_byte_loop(false);
+}
+
 // Store to address (addr is 2nd on stack, value is top)
 // Stack: [... addr val] -> [...]
 static void wasm_store(Type *ty) {
   if (!ty) return;
 
+  // A struct value is its address, so copy it with memory.copy.
   if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    // TODO: memcpy for struct assignment
-    println(";; TODO: struct store (size=%d)", ty->size);
-    println("(drop)");
-    println("(drop)");
+    println("(%s.const %d)", wasm_ptr(), ty->size);
+    gen_copy();
+    return;
+  }
+
+  if (ty->kind == TY_VECTOR) {
+    println("(v128.store)");
     return;
   }
 
@@ -117,28 +214,212 @@ static void wasm_store(Type *ty) {
     return;
   }
 
-  int sz = wasm_size(ty);
-  switch (sz) {
-  case 1: println("(i32.store8)"); break;
-  case 2: println("(i32.store16)"); break;
-  default: println("(i32.store)"); break;
+  char *t = wasm_type(ty);
+  switch (wasm_size(ty)) {
+  case 1: println("(%s.store8)", t); break;
+  case 2: println("(%s.store16)", t); break;
+  default: println("(%s.store)", t); break;
   }
 }
 
+// Pushes the address of a slot in the current stack frame.
+static void gen_frame_addr(int offset) {
+  char *p = wasm_ptr();
+  println("(%s.add (local.get $__bp) (%s.const %d))", p, p, offset);
+}
+
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
 static void gen_addr(Node *node);
 
+static bool has_value(Node *node) {
+  return node && node->ty && node->ty->kind != TY_VOID;
+}
+
+// Pushes the value of an integer expression as a given wasm type. The
+// operands of pointer arithmetic are i64 even if pointers are i32.
+static void gen_expr_as(Node *node, char *t) {
+  gen_expr(node);
+
+  char *from = wasm_type(node->ty);
+  if (!strcmp(from, t) || is_wasm_float(node->ty))
+    return;
+  if (!strcmp(t, "i32"))
+    println("(i32.wrap_i64)");
+  else if (!strcmp(t, "i64"))
+    println(node->ty->is_unsigned ? "(i64.extend_i32_u)" : "(i64.extend_i32_s)");
+}
+
+// Pushes an i32 that is nonzero if the value of a scalar expression
+// is nonzero, for use as a condition.
+static void gen_cond(Node *node) {
+  gen_expr(node);
+
+  char *t = wasm_type(node->ty);
+  if (strcmp(t, "i32")) {
+    println("(%s.const 0)", t);
+    println("(%s.ne)", t);
+  }
+}
+
+//
+// memcpy, memmove and memset
+//
+// With bulk memory, calls to these libc functions are lowered to
+// memory.copy and memory.fill, so that they don't need to be imported.
+// memory.copy allows the regions to overlap, so it implements memmove
+// as well.
+//
+
+static bool is_mem_builtin_name(char *name) {
+  return opt_bulk_memory &&
+         (!strcmp(name, "memcpy") || !strcmp(name, "memmove") ||
+          !strcmp(name, "memset"));
+}
+
+static bool is_mem_builtin(Node *node) {
+  if (node->lhs->kind != ND_VAR || node->lhs->var->is_definition)
+    return false;
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  return nargs == 3 && is_mem_builtin_name(node->lhs->var->name);
+}
+
+static void gen_mem_builtin(Node *node) {
+  Node *dst = node->args;
+  Node *src = dst->next;
+  Node *len = src->next;
+
+  // The byte to fill with is an i32 even with -mmemory64.
+  bool is_fill = !strcmp(node->lhs->var->name, "memset");
+  char *s = is_fill ? "$__cp_v" : "$__cp_s";
+
+  gen_expr_as(dst, wasm_ptr());
+  gen_expr_as(src, is_fill ? "i32" : wasm_ptr());
+  gen_expr_as(len, wasm_ptr());
+
+  // Each function returns its first argument.
+  println("(local.set $__cp_n)");
+  println("(local.set %s)", s);
+  println("(local.tee $__cp_d)");
+  println("(local.get %s)", s);
+  println("(local.get $__cp_n)");
+  if (is_fill)
+    gen_fill();
+  else
+    gen_copy();
+  println("(local.get $__cp_d)");
+}
+
+//
+// Promotion of locals to wasm locals
+//
+// A local scalar whose address is never taken lives in a wasm local
+// instead of the shadow stack frame in linear memory, so that the
+// engine can keep it in a register. Its `offset` is then the index of
+// the wasm local.
+//
+
+static bool is_promotable(Type *ty) {
+  switch (ty->kind) {
+  case TY_BOOL:
+  case TY_CHAR:
+  case TY_SHORT:
+  case TY_INT:
+  case TY_LONG:
+  case TY_ENUM:
+  case TY_PTR:
+  case TY_FLOAT:
+  case TY_DOUBLE:
+  case TY_LDOUBLE:
+    return true;
+  }
+  return false;
+}
+
+static bool is_wasm_local(Obj *var) {
+  return var->is_local && !var->is_addr_taken && is_promotable(var->ty);
+}
+
+static char *local_name(Obj *var) {
+  for (Obj *p = current_fn->params; p; p = p->next)
+    if (p == var)
+      return format("$p_%s", var->name);
+  return format("$l%d", var->offset);
+}
+
+static void mark_escaped(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    node->var->is_addr_taken = true;
+    return;
+  case ND_MEMBER:
+    mark_escaped(node->lhs);
+    return;
+  case ND_COMMA:
+    mark_escaped(node->rhs);
+    return;
+  }
+}
+
+// Marks the locals whose address is taken in a given node.
+static void find_escapes(Node *node) {
+  if (!node)
+    return;
+
+  if (is_wasm_v128(node->ty))
+    uses_simd = true;
+  if (node->kind == ND_ADDR)
+    mark_escaped(node->lhs);
+  if (node->kind == ND_ASSIGN && node->lhs->kind == ND_COMMA)
+    mark_escaped(node->lhs);
+
+  find_escapes(node->lhs);
+  find_escapes(node->rhs);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    find_escapes(node->cond);
+    find_escapes(node->then);
+    find_escapes(node->els);
+    find_escapes(node->init);
+    find_escapes(node->inc);
+    return;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      find_escapes(n);
+    return;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      find_escapes(n);
+    return;
+  case ND_CAS:
+    find_escapes(node->cas_addr);
+    find_escapes(node->cas_old);
+    find_escapes(node->cas_new);
+    return;
+  }
+}
+
 // Push the address of a node onto the wasm stack
 static void gen_addr(Node *node) {
   switch (node->kind) {
   case ND_VAR:
+    if (is_wasm_local(node->var))
+      error_tok(node->tok, "internal error: address of a wasm local");
     if (node->var->is_local) {
       // local address = $__bp + offset
-      println("(i32.add (local.get $__bp) (i32.const %d))", node->var->offset);
+      gen_frame_addr(node->var->offset);
     } else {
       // global variable: address in data segment
-      println("(i32.const %d) ;; &%s", node->var->offset, node->var->name);
+      println("(%s.const %d) ;; &%s", wasm_ptr(), node->var->offset, node->var->name);
     }
     return;
   case ND_DEREF:
@@ -151,27 +432,93 @@ static void gen_addr(Node *node) {
     return;
   case ND_MEMBER:
     gen_addr(node->lhs);
-    println("(i32.const %d)", node->member->offset);
-    println("(i32.add)");
+    println("(%s.const %d)", wasm_ptr(), node->member->offset);
+    println("(%s.add)", wasm_ptr());
     return;
   default:
     error_tok(node->tok, "not an lvalue (wasm gen_addr)");
   }
 }
 
+// Vector arithmetic maps to the SIMD128 instructions of the vector's
+// shape. The type checker has already rejected operations that GCC
+// doesn't allow on vectors.
+static void gen_vector_op(Node *node) {
+  char *shape = vector_shape(node->ty);
+  Type *elem = node->ty->elem;
+  bool is_float = is_flonum(elem);
+
+  gen_expr(node->lhs);
+
+  switch (node->kind) {
+  case ND_NEG:
+    println("(%s.neg)", shape);
+    return;
+  case ND_BITNOT:
+    println("(v128.not)");
+    return;
+  case ND_SHL:
+  case ND_SHR:
+    // The shift count is a scalar i32.
+    gen_expr_as(node->rhs, "i32");
+    if (node->kind == ND_SHL)
+      println("(%s.shl)", shape);
+    else
+      println(elem->is_unsigned ? "(%s.shr_u)" : "(%s.shr_s)", shape);
+    return;
+  }
+
+  gen_expr(node->rhs);
+
+  switch (node->kind) {
+  case ND_ADD:
+    println("(%s.add)", shape);
+    return;
+  case ND_SUB:
+    println("(%s.sub)", shape);
+    return;
+  case ND_MUL:
+    if (elem->size == 1)
+      break;
+    println("(%s.mul)", shape);
+    return;
+  case ND_DIV:
+    if (!is_float)
+      break;
+    println("(%s.div)", shape);
+    return;
+  case ND_BITAND:
+    println("(v128.and)");
+    return;
+  case ND_BITOR:
+    println("(v128.or)");
+    return;
+  case ND_BITXOR:
+    println("(v128.xor)");
+    return;
+  case ND_EQ:
+    println("(%s.eq)", vector_shape(node->lhs->ty));
+    return;
+  case ND_NE:
+    println("(%s.ne)", vector_shape(node->lhs->ty));
+    return;
+  }
+
+  error_tok(node->tok, "vector operation is not supported by the wasm backend");
+}
+
 static void gen_expr(Node *node) {
   if (!node) return;
 
   switch (node->kind) {
   case ND_NULL_EXPR:
-    println("(i32.const 0)");
     return;
 
   case ND_NUM:
     if (is_wasm_f32(node->ty)) {
-      println("(f32.const %f)", (float)node->fval);
+      println("(f32.const %a)", (float)node->fval);
     } else if (is_wasm_f64(node->ty)) {
-      println("(f64.const %f)", (double)node->fval);
+      println("(f64.const %a)", (double)node->fval);
     } else if (is_wasm_i64(node->ty)) {
       println("(i64.const %lld)", (long long)node->val);
     } else {
@@ -180,6 +527,10 @@ static void gen_expr(Node *node) {
     return;
 
   case ND_VAR:
+    if (is_wasm_local(node->var)) {
+      println("(local.get %s)", local_name(node->var));
+      return;
+    }
     gen_addr(node);
     wasm_load(node->ty);
     return;
@@ -199,55 +550,62 @@ static void gen_expr(Node *node) {
     return;
 
   case ND_NEG:
-    if (is_wasm_f32(node->ty)) {
+    if (is_wasm_v128(node->ty)) {
+      gen_vector_op(node);
+    } else if (is_wasm_f32(node->ty)) {
       gen_expr(node->lhs);
       println("(f32.neg)");
     } else if (is_wasm_f64(node->ty)) {
       gen_expr(node->lhs);
       println("(f64.neg)");
     } else {
-      println("(i32.const 0)");
+      char *t = wasm_type(node->ty);
+      println("(%s.const 0)", t);
       gen_expr(node->lhs);
-      println("(i32.sub)");
+      println("(%s.sub)", t);
     }
     return;
 
   case ND_NOT:
-    gen_expr(node->lhs);
+    gen_cond(node->lhs);
     println("(i32.eqz)");
     return;
 
   case ND_BITNOT:
+    if (is_wasm_v128(node->ty)) {
+      gen_vector_op(node);
+      return;
+    }
     gen_expr(node->lhs);
-    println("(i32.const -1)");
-    println("(i32.xor)");
+    println("(%s.const -1)", wasm_type(node->ty));
+    println("(%s.xor)", wasm_type(node->ty));
     return;
 
   case ND_ASSIGN: {
+    if (node->lhs->kind == ND_VAR && is_wasm_local(node->lhs->var)) {
+      gen_expr(node->rhs);
+      println("(local.tee %s)", local_name(node->lhs->var));
+      return;
+    }
+
     // Need: addr on stack, then value, then store
     // But also need to leave the value as result
     gen_addr(node->lhs);
     gen_expr(node->rhs);
     // Tee pattern: store to addr but keep value
     // Use a local temp
-    if (is_wasm_float(node->ty)) {
-      char *wt = wasm_type(node->ty);
-      println("(local.set $__tmp_%s)", wt);
-      println("(local.get $__tmp_%s)", wt);
-      wasm_store(node->ty);
-      println("(local.get $__tmp_%s)", wt);
-    } else {
-      println("(local.set $__tmp_i32)");
-      println("(local.get $__tmp_i32)");
-      wasm_store(node->ty);
-      println("(local.get $__tmp_i32)");
-    }
+    char *wt = wasm_type(node->ty);
+    println("(local.set $__tmp_%s)", wt);
+    println("(local.get $__tmp_%s)", wt);
+    wasm_store(node->ty);
+    println("(local.get $__tmp_%s)", wt);
     return;
   }
 
   case ND_COMMA:
     gen_expr(node->lhs);
-    println("(drop)");
+    if (has_value(node->lhs))
+      println("(drop)");
     gen_expr(node->rhs);
     return;
 
@@ -257,58 +615,81 @@ static void gen_expr(Node *node) {
     Type *to = node->ty;
     if (!from || !to) return;
 
-    // Same type family - may need truncation for smaller types
-    if (!is_wasm_float(from) && !is_wasm_float(to) &&
-        !is_wasm_i64(from) && !is_wasm_i64(to)) {
-      // i32 -> i32, possibly with truncation
-      if (to->kind == TY_BOOL) {
-        println("(i32.const 0)");
-        println("(i32.ne)");
-      } else if (to->size == 1) {
-        println(to->is_unsigned ? "(i32.const 255) (i32.and)" : "(i32.extend8_s)");
-      } else if (to->size == 2) {
-        println(to->is_unsigned ? "(i32.const 65535) (i32.and)" : "(i32.extend16_s)");
+    if (to->kind == TY_VOID) {
+      if (has_value(node->lhs))
+        println("(drop)");
+      return;
+    }
+
+    // A cast between vectors reinterprets the bits.
+    if (is_wasm_v128(to))
+      return;
+
+    char *ft = wasm_type(from);
+    char *tt = wasm_type(to);
+
+    if (to->kind == TY_BOOL) {
+      if (from->kind != TY_BOOL) {
+        println("(%s.const 0)", ft);
+        println("(%s.ne)", ft);
       }
       return;
     }
 
-    // float conversions
-    if (is_wasm_f32(from) && is_wasm_f64(to)) {
-      println("(f64.promote_f32)");
-    } else if (is_wasm_f64(from) && is_wasm_f32(to)) {
-      println("(f32.demote_f64)");
-    } else if (is_wasm_float(from) && !is_wasm_float(to)) {
-      // float -> int
-      if (is_wasm_f32(from))
-        println(to->is_unsigned ? "(i32.trunc_f32_u)" : "(i32.trunc_f32_s)");
-      else
-        println(to->is_unsigned ? "(i32.trunc_f64_u)" : "(i32.trunc_f64_s)");
-    } else if (!is_wasm_float(from) && is_wasm_float(to)) {
+    if (is_wasm_float(from) && is_wasm_float(to)) {
+      if (is_wasm_f32(from) && is_wasm_f64(to))
+        println("(f64.promote_f32)");
+      else if (is_wasm_f64(from) && is_wasm_f32(to))
+        println("(f32.demote_f64)");
+      return;
+    }
+
+    if (is_wasm_float(to)) {
       // int -> float
-      if (is_wasm_f32(to))
-        println(from->is_unsigned ? "(f32.convert_i32_u)" : "(f32.convert_i32_s)");
+      println("(%s.convert_%s_%s)", tt, ft, from->is_unsigned ? "u" : "s");
+      return;
+    }
+
+    if (is_wasm_float(from)) {
+      // float -> int
+      println("(%s.trunc_%s_%s)", tt, ft, to->is_unsigned ? "u" : "s");
+    } else if (strcmp(ft, tt)) {
+      // i32 <-> i64
+      if (!strcmp(tt, "i32"))
+        println("(i32.wrap_i64)");
       else
-        println(from->is_unsigned ? "(f64.convert_i32_u)" : "(f64.convert_i32_s)");
+        println(from->is_unsigned ? "(i64.extend_i32_u)" : "(i64.extend_i32_s)");
     }
+
+    // Truncate to a narrower integer type
+    if (to->size == 1)
+      println(to->is_unsigned ? "(i32.const 255) (i32.and)" : "(i32.extend8_s)");
+    else if (to->size == 2)
+      println(to->is_unsigned ? "(i32.const 65535) (i32.and)" : "(i32.extend16_s)");
     return;
   }
 
   case ND_COND: {
-    char *wt = wasm_type(node->ty);
-    gen_expr(node->cond);
-    println("(if (result %s)", wt);
+    // If the result is void, a branch of another type is discarded.
+    bool is_void = !has_value(node);
+    gen_cond(node->cond);
+    if (is_void)
+      println("(if");
+    else
+      println("(if (result %s)", wasm_type(node->ty));
     indent();
     println("(then");
     indent();
     gen_expr(node->then);
+    if (is_void && has_value(node->then))
+      println("(drop)");
     dedent();
     println(")");
     println("(else");
     indent();
-    if (node->els)
-      gen_expr(node->els);
-    else
-      println("(%s.const 0)", wt);
+    gen_expr(node->els);
+    if (is_void && has_value(node->els))
+      println("(drop)");
     dedent();
     println(")");
     dedent();
@@ -318,12 +699,12 @@ static void gen_expr(Node *node) {
 
   case ND_LOGAND: {
     // Short-circuit: if lhs is 0, result is 0
-    gen_expr(node->lhs);
+    gen_cond(node->lhs);
     println("(if (result i32)");
     indent();
     println("(then");
     indent();
-    gen_expr(node->rhs);
+    gen_cond(node->rhs);
     println("(i32.const 0)");
     println("(i32.ne)");
     dedent();
@@ -335,13 +716,13 @@ static void gen_expr(Node *node) {
   }
 
   case ND_LOGOR: {
-    gen_expr(node->lhs);
+    gen_cond(node->lhs);
     println("(if (result i32)");
     indent();
     println("(then (i32.const 1))");
     println("(else");
     indent();
-    gen_expr(node->rhs);
+    gen_cond(node->rhs);
     println("(i32.const 0)");
     println("(i32.ne)");
     dedent();
@@ -352,6 +733,17 @@ static void gen_expr(Node *node) {
   }
 
   case ND_FUNCALL: {
+    if (is_mem_builtin(node)) {
+      gen_mem_builtin(node);
+      return;
+    }
+
+    // A buffer for a large struct return value is passed as the
+    // hidden first argument.
+    Obj *buf = node->ret_buffer;
+    if (buf && buf->ty->size > 16)
+      gen_frame_addr(buf->offset);
+
     // Push arguments
     int nargs = 0;
     for (Node *arg = node->args; arg; arg = arg->next) {
@@ -361,6 +753,17 @@ static void gen_expr(Node *node) {
     // Get function name
     if (node->lhs->kind == ND_VAR) {
       println("(call $%s)", node->lhs->var->name);
+
+      // A small struct is returned as an address in the callee's
+      // frame, which the next call will overwrite.
+      if (buf && buf->ty->size <= 16) {
+        println("(local.set $__cp_s)");
+        gen_frame_addr(buf->offset);
+        println("(local.get $__cp_s)");
+        println("(%s.const %d)", wasm_ptr(), buf->ty->size);
+        gen_copy();
+        gen_frame_addr(buf->offset);
+      }
     } else {
       // Indirect call - skip for now
       println(";; TODO: indirect call");
@@ -390,15 +793,53 @@ static void gen_expr(Node *node) {
     return;
   }
 
+  case ND_ATOMIC_OP: {
+    // The atomic read-modify-write instructions return the old value,
+    // so we apply the operation once more to get the new one.
+    char *t = wasm_type(node->ty);
+    char *op;
+    switch (node->atomic_op) {
+    case ND_ADD: op = "add"; break;
+    case ND_SUB: op = "sub"; break;
+    case ND_BITAND: op = "and"; break;
+    case ND_BITOR: op = "or"; break;
+    default: op = "xor"; break;
+    }
+
+    gen_expr(node->lhs);
+    gen_expr_as(node->rhs, t);
+    println("(local.tee $__tmp_%s)", t);
+
+    int sz = wasm_size(node->ty);
+    if (sz == 1 || sz == 2)
+      println("(%s.atomic.rmw%d.%s_u)", t, sz * 8, op);
+    else
+      println("(%s.atomic.rmw.%s)", t, op);
+
+    println("(local.get $__tmp_%s)", t);
+    println("(%s.%s)", t, op);
+
+    if (sz == 1)
+      println(node->ty->is_unsigned ? "(i32.const 255) (i32.and)" : "(i32.extend8_s)");
+    else if (sz == 2)
+      println(node->ty->is_unsigned ? "(i32.const 65535) (i32.and)" : "(i32.extend16_s)");
+    return;
+  }
+
   case ND_MEMZERO: {
+    if (is_wasm_local(node->var)) {
+      println("(%s.const 0)", wasm_type(node->var->ty));
+      println("(local.set %s)", local_name(node->var));
+      return;
+    }
+
     // Zero out a memory region
     int size = node->var->ty->size;
     println(";; memzero %s (%d bytes)", node->var->name, size);
-    // Use memory.fill if available, otherwise loop
-    println("(i32.add (local.get $__bp) (i32.const %d))", node->var->offset);
+    gen_frame_addr(node->var->offset);
     println("(i32.const 0)");
-    println("(i32.const %d)", size);
-    println("(memory.fill)");
+    println("(%s.const %d)", wasm_ptr(), size);
+    gen_fill();
     return;
   }
 
@@ -406,16 +847,23 @@ static void gen_expr(Node *node) {
     break;
   }
 
+  if (is_wasm_v128(node->ty)) {
+    gen_vector_op(node);
+    return;
+  }
+
   // Binary operations
   if (node->lhs && node->rhs) {
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
-
-    char *t = "i32";
+    // Comparisons are done in the type of the operands.
+    bool is_cmp = node->kind == ND_EQ || node->kind == ND_NE ||
+                  node->kind == ND_LT || node->kind == ND_LE;
+    Type *ty = is_cmp ? node->lhs->ty : node->ty;
+    char *t = wasm_type(ty);
     bool is_unsigned_int = node->lhs->ty && node->lhs->ty->is_unsigned;
-    bool is_float = is_wasm_float(node->ty);
-    if (is_float)
-      t = wasm_type(node->ty);
+    bool is_float = is_wasm_float(ty);
+
+    gen_expr_as(node->lhs, t);
+    gen_expr_as(node->rhs, t);
 
     switch (node->kind) {
     case ND_ADD:
@@ -477,13 +925,189 @@ static void gen_expr(Node *node) {
   error_tok(node->tok, "unsupported expression in wasm codegen (kind=%d)", node->kind);
 }
 
+// Returns the block label for a case of a switch. Only cases that
+// label statements directly in the body of a switch are supported,
+// because the body is split into a sequence of blocks at them.
+static char *case_block(Node *sw, Node *c) {
+  for (Node *s = sw->then->body; s; s = s->next)
+    for (Node *n = s; n->kind == ND_CASE; n = n->lhs)
+      if (n == c)
+        return s->label;
+  error_tok(c->tok, "case label inside a nested statement is not supported in wasm codegen");
+}
+
+static char *switch_default(Node *sw) {
+  return sw->default_case ? case_block(sw, sw->default_case) : sw->brk_label;
+}
+
+// Emits a binary decision tree for cases[lo..hi), assuming that the
+// switch value is in $__tmp_i32 or $__tmp_i64. Every path ends with
+// a branch.
+static void gen_switch_tree(Node *sw, Node **cases, int lo, int hi) {
+  bool is64 = is_wasm_i64(sw->cond->ty);
+  char *t = is64 ? "i64" : "i32";
+
+  if (hi - lo > 3) {
+    int mid = (lo + hi) / 2;
+    println("(local.get $__tmp_%s)", t);
+    println("(%s.const %ld)", t, cases[mid]->begin);
+    println("(%s.lt_%s)", t, sw->cond->ty->is_unsigned ? "u" : "s");
+    println("(if");
+    indent();
+    println("(then");
+    indent();
+    gen_switch_tree(sw, cases, lo, mid);
+    dedent();
+    println(")");
+    println("(else");
+    indent();
+    gen_switch_tree(sw, cases, mid, hi);
+    dedent();
+    println(")");
+    dedent();
+    println(")");
+    return;
+  }
+
+  for (int i = lo; i < hi; i++) {
+    Node *n = cases[i];
+    println("(local.get $__tmp_%s)", t);
+    println("(%s.const %ld)", t, n->begin);
+    if (n->begin == n->end) {
+      println("(%s.eq)", t);
+    } else {
+      // [GNU] Case ranges
+      println("(%s.sub)", t);
+      println("(%s.const %ld)", t, n->end - n->begin);
+      println("(%s.le_u)", t);
+    }
+    println("(br_if $%s)", case_block(sw, n));
+  }
+  println("(br $%s)", switch_default(sw));
+}
+
+// A switch body is compiled to nested blocks, one for each statement
+// with a case label:
+//
+//   (block $brk
+//     (block $case2
+//       (block $case1
+//         <dispatch>)
+//       <statements of case 1>)
+//     <statements of case 2>)
+//
+// so that a branch to $caseN continues at the statements of the case,
+// and falling through a case continues at the next one.
+static void gen_switch(Node *sw) {
+  if (sw->then->kind != ND_BLOCK)
+    error_tok(sw->tok, "switch without a block is not supported in wasm codegen");
+
+  int n;
+  Node **cases = sort_cases(sw, &n);
+  bool is64 = is_wasm_i64(sw->cond->ty);
+  char *t = is64 ? "i64" : "i32";
+
+  gen_expr(sw->cond);
+  println("(local.set $__tmp_%s)", t);
+
+  println("(block $%s ;; break target", sw->brk_label);
+  indent();
+  BreakTarget brk = {sw->brk_label, brk_targets};
+  brk_targets = &brk;
+
+  // Open a block for each labeled statement, the last one first.
+  int nblocks = 0;
+  for (Node *s = sw->then->body; s; s = s->next)
+    if (s->kind == ND_CASE)
+      nblocks++;
+
+  Node **blocks = calloc(nblocks + 1, sizeof(Node *));
+  int i = 0;
+  for (Node *s = sw->then->body; s; s = s->next)
+    if (s->kind == ND_CASE)
+      blocks[i++] = s;
+  for (i = nblocks - 1; i >= 0; i--) {
+    println("(block $%s", blocks[i]->label);
+    indent();
+  }
+
+  if (use_jump_table(sw, cases, n)) {
+    long lo = case_key(sw, cases[0]->begin);
+    long hi = case_key(sw, cases[n - 1]->end);
+
+    println("(local.get $__tmp_%s)", t);
+    if (cases[0]->begin) {
+      println("(%s.const %ld)", t, cases[0]->begin);
+      println("(%s.sub)", t);
+    }
+
+    // br_table takes an i32 index.
+    if (is64) {
+      println("(local.set $__tmp_i64)");
+      println("(local.get $__tmp_i64)");
+      println("(i64.const %ld)", hi - lo);
+      println("(i64.gt_u)");
+      println("(br_if $%s)", switch_default(sw));
+      println("(local.get $__tmp_i64)");
+      println("(i32.wrap_i64)");
+    }
+
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    fprintf(out, "(br_table");
+    long v = lo;
+    for (int i = 0; i < n; i++) {
+      for (; v < case_key(sw, cases[i]->begin); v++)
+        fprintf(out, " $%s", switch_default(sw));
+      for (; v <= case_key(sw, cases[i]->end); v++)
+        fprintf(out, " $%s", case_block(sw, cases[i]));
+    }
+    fprintf(out, " $%s)", switch_default(sw));
+    fclose(out);
+    println("%s", buf);
+  } else {
+    gen_switch_tree(sw, cases, 0, n);
+  }
+
+  // Statements before the first case are unreachable.
+  Node *s = sw->then->body;
+  while (s && s->kind != ND_CASE)
+    s = s->next;
+
+  for (; s; s = s->next) {
+    if (s->kind == ND_CASE) {
+      dedent();
+      println(") ;; %s", s->label);
+    }
+    gen_stmt(s);
+  }
+
+  brk_targets = brk.next;
+  dedent();
+  println(") ;; end break block");
+  free(blocks);
+  free(cases);
+}
+
 static void gen_stmt(Node *node) {
   if (!node) return;
 
   switch (node->kind) {
   case ND_RETURN:
     if (node->lhs) {
-      gen_expr(node->lhs);
+      Type *ty = node->lhs->ty;
+      if ((ty->kind == TY_STRUCT || ty->kind == TY_UNION) && ty->size > 16) {
+        // Copy the value to the caller's buffer and return its address.
+        char *buf = local_name(current_fn->params);
+        println("(local.get %s)", buf);
+        gen_expr(node->lhs);
+        println("(%s.const %d)", wasm_ptr(), ty->size);
+        gen_copy();
+        println("(local.get %s)", buf);
+      } else {
+        gen_expr(node->lhs);
+      }
     }
     println("(br $__return)");
     return;
@@ -491,7 +1115,7 @@ static void gen_stmt(Node *node) {
   case ND_EXPR_STMT:
     gen_expr(node->lhs);
     // Drop the value since this is a statement
-    if (node->lhs && node->lhs->ty && node->lhs->ty->kind != TY_VOID)
+    if (has_value(node->lhs))
       println("(drop)");
     return;
 
@@ -501,7 +1125,7 @@ static void gen_stmt(Node *node) {
     return;
 
   case ND_IF: {
-    gen_expr(node->cond);
+    gen_cond(node->cond);
     println("(if");
     indent();
     println("(then");
@@ -531,9 +1155,11 @@ static void gen_stmt(Node *node) {
     indent();
     println("(loop $%s ;; continue target", node->cont_label);
     indent();
+    BreakTarget brk = {node->brk_label, brk_targets};
+    brk_targets = &brk;
 
     if (node->cond) {
-      gen_expr(node->cond);
+      gen_cond(node->cond);
       println("(i32.eqz)");
       println("(br_if $%s)", node->brk_label);
     }
@@ -546,6 +1172,7 @@ static void gen_stmt(Node *node) {
     }
 
     println("(br $%s)", node->cont_label);
+    brk_targets = brk.next;
     dedent();
     println(") ;; end loop");
     dedent();
@@ -558,11 +1185,14 @@ static void gen_stmt(Node *node) {
     indent();
     println("(loop $%s ;; continue target", node->cont_label);
     indent();
+    BreakTarget brk = {node->brk_label, brk_targets};
+    brk_targets = &brk;
 
     gen_stmt(node->then);
 
-    gen_expr(node->cond);
+    gen_cond(node->cond);
     println("(br_if $%s)", node->cont_label);
+    brk_targets = brk.next;
 
     dedent();
     println(") ;; end loop");
@@ -571,50 +1201,25 @@ static void gen_stmt(Node *node) {
     return;
   }
 
-  case ND_SWITCH: {
-    gen_expr(node->cond);
-    println("(local.set $__tmp_i32)");
-
-    // Emit chained if/else for each case
-    // First, wrap everything in a block for break
-    println("(block $%s ;; break target", node->brk_label);
-    indent();
-
-    // Emit case tests as nested blocks with br
-    // We'll use a simpler approach: chained if/else
-    for (Node *n = node->case_next; n; n = n->case_next) {
-      println("(local.get $__tmp_i32)");
-      println("(i32.const %ld)", n->begin);
-      println("(i32.eq)");
-      println("(if (then");
-      indent();
-    }
-
-    // Default or fall through
-    if (node->default_case) {
-      // Will be handled by the then body below
-    }
-
-    // Generate the body (which contains ND_CASE labels)
-    gen_stmt(node->then);
-
-    // Close all the if blocks
-    for (Node *n = node->case_next; n; n = n->case_next) {
-      dedent();
-      println("))");
-    }
-
-    dedent();
-    println(") ;; end break block");
+  case ND_SWITCH:
+    gen_switch(node);
     return;
-  }
 
   case ND_CASE:
-    // In our simplified model, just generate the body
+    // The dispatch code of the switch branches to the end of the
+    // block before the case (see gen_switch()).
     gen_stmt(node->lhs);
     return;
 
   case ND_GOTO:
+    // `break` is a branch to an enclosing block.
+    for (BreakTarget *t = brk_targets; t; t = t->next) {
+      if (!strcmp(t->label, node->unique_label)) {
+        println("(br $%s)", node->unique_label);
+        return;
+      }
+    }
+
     // TODO: goto support needs a state machine pattern
     println(";; TODO: goto %s", node->unique_label);
     return;
@@ -629,15 +1234,28 @@ static void gen_stmt(Node *node) {
   }
 }
 
-// Assign memory offsets to local variables
+// Assign memory offsets to local variables that are not promoted to
+// wasm locals
 static void assign_wasm_offsets(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
     if (!fn->is_function)
       continue;
 
+    for (Obj *var = fn->locals; var; var = var->next)
+      var->is_addr_taken = false;
+    find_escapes(fn->body);
+
     int offset = 0;
+    int nlocals = 0;
     for (Obj *var = fn->locals; var; var = var->next) {
-      offset = align_to(offset, var->ty->align > 0 ? var->ty->align : 1);
+      if (is_wasm_local(var)) {
+        var->offset = nlocals++;
+        continue;
+      }
+      // Use the same alignment as the x86-64 backend.
+      int align = (var->ty->kind == TY_ARRAY && var->ty->size >= 16)
+        ? MAX(16, var->align) : var->align;
+      offset = align_to(offset, align > 0 ? align : 1);
       var->offset = offset;
       offset += var->ty->size;
     }
@@ -649,9 +1267,9 @@ static void assign_wasm_offsets(Obj *prog) {
 static int assign_global_offsets(Obj *prog) {
   int offset = 0; // globals start at address 0 in linear memory
   for (Obj *var = prog; var; var = var->next) {
-    if (var->is_function)
+    if (var->is_function || !var->is_live)
       continue;
-    offset = align_to(offset, var->ty->align > 0 ? var->ty->align : 1);
+    offset = align_to(offset, var->align > 0 ? var->align : 1);
     var->offset = offset;
     offset += var->ty->size;
   }
@@ -659,17 +1277,31 @@ static int assign_global_offsets(Obj *prog) {
 }
 
 static void emit_data(Obj *prog) {
+  HashMap globals = {};
+  for (Obj *var = prog; var; var = var->next)
+    if (!var->is_function && var->is_live)
+      hashmap_put(&globals, var->name, var);
+
   for (Obj *var = prog; var; var = var->next) {
-    if (var->is_function)
+    if (var->is_function || !var->is_live)
       continue;
     if (!var->init_data)
       continue;
 
+    // Resolve pointers to other globals, which are at fixed addresses.
+    char *data = calloc(1, var->ty->size);
+    memcpy(data, var->init_data, var->ty->size);
+    for (Relocation *rel = var->rel; rel; rel = rel->next) {
+      Obj *target = hashmap_get(&globals, *rel->label);
+      long addr = (target ? target->offset : 0) + rel->addend;
+      memcpy(data + rel->offset, &addr, 8);
+    }
+
     println(";; global: %s (offset=%d, size=%d)", var->name, var->offset, var->ty->size);
     // Emit as data segment
-    fprintf(output_file, "  (data (i32.const %d) \"", var->offset);
+    fprintf(output_file, "  (data (%s.const %d) \"", wasm_ptr(), var->offset);
     for (int i = 0; i < var->ty->size; i++) {
-      unsigned char c = var->init_data[i];
+      unsigned char c = data[i];
       if (c >= 32 && c < 127 && c != '"' && c != '\\')
         fprintf(output_file, "%c", c);
       else
@@ -679,88 +1311,137 @@ static void emit_data(Obj *prog) {
   }
 }
 
-static void emit_functions(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function || !fn->is_definition)
-      continue;
-    if (!fn->is_live)
-      continue;
-
-    current_fn = fn;
-    wasm_label_count = 0;
-
-    // Function signature
-    fprintf(output_file, "  (func $%s", fn->name);
-
-    // Export main as _start
-    if (strcmp(fn->name, "main") == 0)
-      fprintf(output_file, " (export \"_start\")");
+static void gen_function(Obj *fn, FILE *out) {
+  output_file = out;
+  current_fn = fn;
+  wasm_label_count = 0;
 
-    // Parameters
-    for (Obj *param = fn->params; param; param = param->next) {
-      fprintf(output_file, " (param $p_%s %s)", param->name, wasm_type(param->ty));
-    }
+  // Function signature
+  fprintf(output_file, "  (func $%s", fn->name);
 
-    // Return type
-    Type *ret = fn->ty->return_ty;
-    bool has_return = ret && ret->kind != TY_VOID;
-    if (has_return) {
-      fprintf(output_file, " (result %s)", wasm_type(ret));
-    }
-    fprintf(output_file, "\n");
+  // Export main as _start
+  if (strcmp(fn->name, "main") == 0)
+    fprintf(output_file, " (export \"_start\")");
 
-    indent_level = 2;
+  // Parameters
+  for (Obj *param = fn->params; param; param = param->next) {
+    fprintf(output_file, " (param $p_%s %s)", param->name, wasm_type(param->ty));
+  }
 
-    // Local variables
-    println("(local $__bp i32)  ;; base pointer");
-    println("(local $__tmp_i32 i32)");
-    println("(local $__tmp_f32 f32)");
-    println("(local $__tmp_f64 f64)");
+  // Return type
+  Type *ret = fn->ty->return_ty;
+  bool has_return = ret && ret->kind != TY_VOID;
+  if (has_return) {
+    fprintf(output_file, " (result %s)", wasm_type(ret));
+  }
+  fprintf(output_file, "\n");
 
-    // Prologue: allocate stack frame
+  indent_level = 2;
+
+  // Local variables
+  char *p = wasm_ptr();
+  println("(local $__bp %s)  ;; base pointer", p);
+  println("(local $__tmp_i32 i32)");
+  println("(local $__tmp_i64 i64)");
+  println("(local $__tmp_f32 f32)");
+  println("(local $__tmp_f64 f64)");
+  if (uses_simd)
+    println("(local $__tmp_v128 v128)");
+  println("(local $__cp_d %s)", p);
+  println("(local $__cp_s %s)", p);
+  println("(local $__cp_n %s)", p);
+  println("(local $__cp_v i32)");
+
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (is_wasm_local(var) && strncmp(local_name(var), "$p_", 3))
+      println("(local %s %s) ;; %s", local_name(var), wasm_type(var->ty), var->name);
+
+  // Prologue: allocate stack frame if any variable lives in memory
+  if (fn->stack_size) {
     println(";; prologue: allocate %d bytes", fn->stack_size);
-    println("(global.set $__sp (i32.sub (global.get $__sp) (i32.const %d)))",
-            fn->stack_size);
+    println("(global.set $__sp (%s.sub (global.get $__sp) (%s.const %d)))",
+            p, p, fn->stack_size);
     println("(local.set $__bp (global.get $__sp))");
+  }
 
-    // Copy parameters to their stack slots
-    for (Obj *param = fn->params; param; param = param->next) {
-      println(";; store param %s at bp+%d", param->name, param->offset);
-      println("(i32.add (local.get $__bp) (i32.const %d))", param->offset);
-      println("(local.get $p_%s)", param->name);
-      wasm_store(param->ty);
-    }
+  // Copy parameters whose address is taken to their stack slots
+  for (Obj *param = fn->params; param; param = param->next) {
+    if (is_wasm_local(param))
+      continue;
+    println(";; store param %s at bp+%d", param->name, param->offset);
+    gen_frame_addr(param->offset);
+    println("(local.get $p_%s)", param->name);
+    wasm_store(param->ty);
+  }
 
-    // Body wrapped in a block for return jumps
-    if (has_return) {
-      println("(block $__return (result %s)", wasm_type(ret));
-    } else {
-      println("(block $__return");
-    }
-    indent();
+  // Body wrapped in a block for return jumps
+  if (has_return) {
+    println("(block $__return (result %s)", wasm_type(ret));
+  } else {
+    println("(block $__return");
+  }
+  indent();
 
-    // Generate function body
-    gen_stmt(fn->body);
+  // Generate function body
+  gen_stmt(fn->body);
 
-    // Default return value (for main, return 0)
-    if (has_return) {
-      if (strcmp(fn->name, "main") == 0)
-        println("(i32.const 0)");
-      else
-        println("(%s.const 0) ;; implicit return", wasm_type(ret));
-    }
+  // Default return value (for main, return 0)
+  if (has_return) {
+    if (strcmp(fn->name, "main") == 0)
+      println("(i32.const 0)");
+    else if (is_wasm_v128(ret))
+      println("(v128.const i32x4 0 0 0 0) ;; implicit return");
+    else
+      println("(%s.const 0) ;; implicit return", wasm_type(ret));
+  }
 
-    dedent();
-    println(") ;; end block $__return");
+  dedent();
+  println(") ;; end block $__return");
 
-    // Epilogue: restore stack pointer
+  // Epilogue: restore stack pointer
+  if (fn->stack_size) {
     println(";; epilogue");
-    println("(global.set $__sp (i32.add (local.get $__bp) (i32.const %d)))",
-            fn->stack_size);
+    println("(global.set $__sp (%s.add (local.get $__bp) (%s.const %d)))",
+            p, p, fn->stack_size);
+  }
 
-    indent_level = 1;
-    println(") ;; end func $%s", fn->name);
-    fprintf(output_file, "\n");
+  indent_level = 1;
+  println(") ;; end func $%s", fn->name);
+  fprintf(output_file, "\n");
+}
+
+// Functions that are called but not defined in this translation unit
+// are imported from the "env" module. Variadic functions can't be
+// called in wasm, so they are left undefined.
+static void emit_imports(Obj *prog) {
+  HashMap funcs = {};
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && (fn->is_definition || !hashmap_get(&funcs, fn->name)))
+      hashmap_put(&funcs, fn->name, fn);
+
+  HashMap imported = {};
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition || !fn->is_live)
+      continue;
+
+    for (int i = 0; i < fn->refs.len; i++) {
+      char *name = fn->refs.data[i];
+      Obj *decl = hashmap_get(&funcs, name);
+      if (!decl || decl->is_definition || decl->ty->is_variadic ||
+          hashmap_get(&imported, name) || is_mem_builtin_name(name))
+        continue;
+      hashmap_put(&imported, name, decl);
+
+      fprintf(output_file, "  (import \"env\" \"%s\" (func $%s", name, name);
+      Type *rty = decl->ty->return_ty;
+      if ((rty->kind == TY_STRUCT || rty->kind == TY_UNION) && rty->size > 16)
+        fprintf(output_file, " (param %s)", wasm_ptr());
+      for (Type *t = decl->ty->params; t; t = t->next)
+        fprintf(output_file, " (param %s)", wasm_type(t));
+      if (decl->ty->return_ty->kind != TY_VOID)
+        fprintf(output_file, " (result %s)", wasm_type(decl->ty->return_ty));
+      fprintf(output_file, "))\n");
+    }
   }
 }
 
@@ -770,6 +1451,7 @@ void codegen_wasm(Obj *prog, FILE *out) {
 
   // Assign memory layout
   int data_size = assign_global_offsets(prog);
+  uses_simd = false;
   assign_wasm_offsets(prog);
 
   // Stack starts after global data, aligned to 64KB
@@ -780,13 +1462,15 @@ void codegen_wasm(Obj *prog, FILE *out) {
   println("(module");
   indent();
 
+  emit_imports(prog);
+
   // Memory: 2 pages (128KB) - enough for basic programs
-  println("(memory (export \"memory\") 2)");
+  println("(memory (export \"memory\")%s 2)", opt_memory64 ? " i64" : "");
   fprintf(output_file, "\n");
 
   // Stack pointer global
   println(";; Stack pointer (grows downward from %d)", stack_start);
-  println("(global $__sp (mut i32) (i32.const %d))", stack_start);
+  println("(global $__sp (mut %s) (%s.const %d))", wasm_ptr(), wasm_ptr(), stack_start);
   fprintf(output_file, "\n");
 
   // Data segments for initialized globals
@@ -794,7 +1478,7 @@ void codegen_wasm(Obj *prog, FILE *out) {
   fprintf(output_file, "\n");
 
   // Functions
-  emit_functions(prog);
+  gen_functions(prog, out, gen_function);
 
   dedent();
   println(")");
@@ -0,0 +1,625 @@
+// This file implements common subexpression elimination within
+// straight-line code, which runs with -O1 after the inliner.
+//
+// The code generators compute the address and load the value of an
+// lvalue each time it is used, so `p->a->b + p->a->c` loads `p->a`
+// twice, and `a[i] * a[i]` computes `a + i * 4` and loads from it
+// twice. This pass finds such duplicated loads and address
+// computations and evaluates them once into a fresh local variable,
+// which -O1 usually keeps in a register:
+//
+//   (t = p->a, t->b + t->c)
+//
+// A run of statements that we optimize is a sequence of expression
+// statements in a block that don't store to memory, call functions or
+// access volatile or atomic objects. They may assign to local scalars
+// whose address is never taken, because nothing else can observe or
+// modify such variables; an expression that reads such a variable is
+// just not shared across an assignment to it. A statement that stores
+// to memory with its outermost assignment, or an `if`, `switch` or
+// `return`, ends a run, and may still use the values computed before.
+//
+// A value is computed at the beginning of the first statement of the
+// run that evaluates it unconditionally, i.e. not only in an arm of
+// `?:`, `&&` or `||`, so that we never load from an address that the
+// original program wouldn't have loaded from.
+
+#include "chibicc.h"
+
+// Maximum number of distinct expressions tracked in a run
+#define MAX_EXPRS 256
+
+typedef struct {
+  Node **slot; // Where the occurrence is in the AST
+  int stmt;    // Index of the statement in the run
+  int start;   // Range of the occurrence in a pre-order walk
+  int end;
+  bool is_cond;
+  bool removed;
+} Use;
+
+typedef struct {
+  Node *expr;
+  uint64_t hash;
+  int size;
+  bool is_dead; // Set if a variable it reads has been assigned
+  Use *uses;
+  int nuses;
+  int cap;
+} Expr;
+
+static Obj *current_fn;
+
+static Expr exprs[MAX_EXPRS];
+static int nexprs;
+
+// Expression slots of the statements in the current run
+static Node ***stmts;
+static int nstmts;
+static int stmts_cap;
+
+// Position in a pre-order walk of the current run
+static int pos;
+
+// Local variables assigned by the current statement
+static Obj **assigned;
+static int nassigned;
+static int assigned_cap;
+
+// Calls visit() for each node of a given tree.
+static void walk(Node *node, void (*visit)(Node *)) {
+  if (!node)
+    return;
+
+  visit(node);
+  walk(node->lhs, visit);
+  walk(node->rhs, visit);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    walk(node->cond, visit);
+    walk(node->then, visit);
+    walk(node->els, visit);
+    walk(node->init, visit);
+    walk(node->inc, visit);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      walk(n, visit);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      walk(n, visit);
+    break;
+  case ND_CAS:
+    walk(node->cas_addr, visit);
+    walk(node->cas_old, visit);
+    walk(node->cas_new, visit);
+    break;
+  }
+}
+
+static void take_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    node->var->is_addr_taken = true;
+    return;
+  case ND_MEMBER:
+    take_addr(node->lhs);
+    return;
+  case ND_COMMA:
+    take_addr(node->rhs);
+    return;
+  case ND_COND:
+    take_addr(node->then);
+    take_addr(node->els);
+    return;
+  }
+}
+
+static void find_addr_taken(Node *node) {
+  if (node->kind == ND_ADDR)
+    take_addr(node->lhs);
+}
+
+static bool is_qualified(Type *ty) {
+  return ty && (ty->is_volatile || ty->is_atomic);
+}
+
+// Returns true if a variable can't be accessed through a pointer.
+static bool is_private(Obj *var) {
+  Type *ty = var->ty;
+  return var->is_local && !var->is_addr_taken && !is_qualified(ty) &&
+         (is_integer(ty) || ty->kind == TY_PTR);
+}
+
+static void record_assign(Obj *var) {
+  if (nassigned == assigned_cap) {
+    assigned_cap = assigned_cap ? assigned_cap * 2 : 8;
+    assigned = realloc(assigned, sizeof(Obj *) * assigned_cap);
+  }
+  assigned[nassigned++] = var;
+}
+
+// Returns true if a given expression has no side effects other than
+// assignments to private variables, which are recorded in `assigned`.
+static bool is_pure(Node *node) {
+  if (!node)
+    return true;
+  if (is_qualified(node->ty))
+    return false;
+
+  switch (node->kind) {
+  case ND_ASSIGN:
+    if (node->lhs->kind != ND_VAR || !is_private(node->lhs->var))
+      return false;
+    record_assign(node->lhs->var);
+    return is_pure(node->rhs);
+  case ND_COND:
+    return is_pure(node->cond) && is_pure(node->then) && is_pure(node->els);
+  case ND_MEMBER:
+    return !is_qualified(node->lhs->ty) && is_pure(node->lhs);
+  case ND_VAR:
+    return !is_qualified(node->var->ty);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_NEG:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_COMMA:
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_NOT:
+  case ND_BITNOT:
+  case ND_LOGAND:
+  case ND_LOGOR:
+  case ND_CAST:
+    return is_pure(node->lhs) && is_pure(node->rhs);
+  case ND_MEMZERO:
+    if (!is_private(node->var))
+      return false;
+    record_assign(node->var);
+    return true;
+  case ND_NUM:
+  case ND_NULL_EXPR:
+    return true;
+  }
+  return false;
+}
+
+static bool reads_var(Node *node, Obj *var) {
+  if (!node)
+    return false;
+  if (node->kind == ND_VAR)
+    return node->var == var;
+  if (node->kind == ND_COND && reads_var(node->cond, var))
+    return true;
+  return reads_var(node->lhs, var) || reads_var(node->rhs, var);
+}
+
+static bool reads_assigned(Node *node) {
+  for (int i = 0; i < nassigned; i++)
+    if (reads_var(node, assigned[i]))
+      return true;
+  return false;
+}
+
+// Returns true if an expression may be worth computing only once:
+// a load from memory or an address computation of integer or pointer
+// type.
+static bool is_candidate(Node *node) {
+  Type *ty = node->ty;
+  if (!ty || (!is_integer(ty) && ty->kind != TY_PTR))
+    return false;
+
+  switch (node->kind) {
+  case ND_DEREF:
+    return true;
+  case ND_MEMBER:
+    return !node->member->is_bitfield;
+  case ND_ADD:
+  case ND_SUB:
+    return ty->kind == TY_PTR;
+  case ND_CAST:
+    return is_candidate(node->lhs);
+  }
+  return false;
+}
+
+static bool same_type(Type *t1, Type *t2) {
+  if (!t1 || !t2)
+    return t1 == t2;
+  return t1->kind == t2->kind && t1->size == t2->size &&
+         t1->is_unsigned == t2->is_unsigned;
+}
+
+static bool same_expr(Node *a, Node *b) {
+  if (!a || !b)
+    return a == b;
+  if (a->kind != b->kind || !same_type(a->ty, b->ty))
+    return false;
+
+  switch (a->kind) {
+  case ND_NUM:
+    return a->val == b->val && a->fval == b->fval;
+  case ND_VAR:
+    return a->var == b->var;
+  case ND_MEMBER:
+    if (a->member != b->member)
+      return false;
+    break;
+  case ND_COND:
+    if (!same_expr(a->cond, b->cond) || !same_expr(a->then, b->then) ||
+        !same_expr(a->els, b->els))
+      return false;
+    break;
+  case ND_ASSIGN:
+    return false;
+  }
+  return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+}
+
+static uint64_t mix(uint64_t h, uint64_t x) {
+  return (h ^ x) * 0x100000001b3;
+}
+
+static void add_use(Node **slot, uint64_t hash, int size, int start, bool is_cond) {
+  Node *node = *slot;
+
+  Expr *e = NULL;
+  for (int i = 0; i < nexprs; i++) {
+    if (exprs[i].hash == hash && !exprs[i].is_dead && same_expr(exprs[i].expr, node)) {
+      e = &exprs[i];
+      break;
+    }
+  }
+
+  if (!e) {
+    if (nexprs == MAX_EXPRS)
+      return;
+    e = &exprs[nexprs++];
+    *e = (Expr){node, hash, size};
+  }
+
+  if (e->nuses == e->cap) {
+    e->cap = e->cap ? e->cap * 2 : 4;
+    e->uses = realloc(e->uses, sizeof(Use) * e->cap);
+  }
+  e->uses[e->nuses++] = (Use){slot, nstmts, start, pos, is_cond};
+}
+
+// Records the candidates in a given expression and returns its hash.
+// `*size` is incremented by the number of its nodes.
+static uint64_t collect(Node **slot, bool is_cond, bool is_lvalue, int *size) {
+  Node *node = *slot;
+  if (!node)
+    return 0;
+
+  int start = pos++;
+  int n = 1;
+  uint64_t h = mix(0xcbf29ce484222325, node->kind);
+  h = mix(h, node->ty ? node->ty->kind : 0);
+
+  switch (node->kind) {
+  case ND_NUM:
+    h = mix(h, node->val);
+    break;
+  case ND_VAR:
+    h = mix(h, (uintptr_t)node->var);
+    break;
+  case ND_MEMBER:
+    h = mix(h, node->member->offset);
+    h = mix(h, collect(&node->lhs, is_cond, true, &n));
+    break;
+  case ND_ADDR:
+    h = mix(h, collect(&node->lhs, is_cond, true, &n));
+    break;
+  case ND_ASSIGN:
+    h = mix(h, collect(&node->rhs, is_cond, false, &n));
+    break;
+  case ND_LOGAND:
+  case ND_LOGOR:
+    h = mix(h, collect(&node->lhs, is_cond, false, &n));
+    h = mix(h, collect(&node->rhs, true, false, &n));
+    break;
+  case ND_COND:
+    h = mix(h, collect(&node->cond, is_cond, false, &n));
+    h = mix(h, collect(&node->then, true, false, &n));
+    h = mix(h, collect(&node->els, true, false, &n));
+    break;
+  default:
+    h = mix(h, collect(&node->lhs, is_cond, false, &n));
+    h = mix(h, collect(&node->rhs, is_cond, false, &n));
+  }
+
+  *size += n;
+  if (!is_lvalue && is_candidate(node) && !reads_assigned(node))
+    add_use(slot, h, n, start, is_cond);
+  return h;
+}
+
+static void add_stmt(Node **slot, bool is_store) {
+  if (nstmts == stmts_cap) {
+    stmts_cap = stmts_cap ? stmts_cap * 2 : 16;
+    stmts = realloc(stmts, sizeof(Node **) * stmts_cap);
+  }
+
+  int size = 0;
+  Node *node = *slot;
+  if (is_store) {
+    // The target of the store is not a value, but the computation
+    // of its address is.
+    pos++;
+    Node *lhs = node->lhs;
+    if (lhs->kind == ND_DEREF)
+      collect(&lhs->lhs, false, false, &size);
+    else
+      collect(&lhs->lhs, false, true, &size);
+    collect(&node->rhs, false, false, &size);
+  } else {
+    collect(slot, false, false, &size);
+  }
+  stmts[nstmts++] = slot;
+
+  for (int i = 0; i < nexprs; i++)
+    if (!exprs[i].is_dead && reads_assigned(exprs[i].expr))
+      exprs[i].is_dead = true;
+}
+
+static bool is_nested(Use *u, Use *outer) {
+  return outer->start <= u->start && u->start < outer->end;
+}
+
+// Removes uses of other expressions nested in a given use, which is
+// about to be replaced.
+static void remove_nested(Use *outer) {
+  for (int i = 0; i < nexprs; i++)
+    for (int j = 0; j < exprs[i].nuses; j++)
+      if (is_nested(&exprs[i].uses[j], outer))
+        exprs[i].uses[j].removed = true;
+}
+
+static Node *new_var(Obj *var, Token *tok) {
+  Node *node = new_node(ND_VAR, tok);
+  node->var = var;
+  node->ty = var->ty;
+  return node;
+}
+
+static void eliminate(Expr *e) {
+  // Find the first unconditional use. Uses in earlier statements run
+  // only conditionally and are left alone.
+  int first = -1;
+  for (int i = 0; i < e->nuses; i++) {
+    if (!e->uses[i].removed && !e->uses[i].is_cond) {
+      first = i;
+      break;
+    }
+  }
+  if (first == -1)
+    return;
+
+  int nuses = 0;
+  for (int i = 0; i < e->nuses; i++)
+    if (!e->uses[i].removed && e->uses[i].stmt >= e->uses[first].stmt)
+      nuses++;
+  if (nuses < 2)
+    return;
+
+  Use *def = &e->uses[first];
+  Node *expr = *def->slot;
+
+  Obj *var = arena_alloc(ARENA_OBJ, sizeof(Obj));
+  var->name = "";
+  var->ty = expr->ty;
+  var->tok = expr->tok;
+  var->is_local = true;
+  var->align = expr->ty->align;
+  var->next = current_fn->locals;
+  current_fn->locals = var;
+
+  for (int i = 0; i < e->nuses; i++) {
+    Use *u = &e->uses[i];
+    if (u->removed || u->stmt < def->stmt)
+      continue;
+    if (u != def)
+      remove_nested(u);
+    *u->slot = new_var(var, expr->tok);
+  }
+
+  Node *assign = new_node(ND_ASSIGN, expr->tok);
+  assign->lhs = new_var(var, expr->tok);
+  assign->rhs = expr;
+  assign->ty = var->ty;
+
+  Node **stmt = stmts[def->stmt];
+  Node *comma = new_node(ND_COMMA, expr->tok);
+  comma->lhs = assign;
+  comma->rhs = *stmt;
+  comma->ty = comma->rhs->ty;
+  *stmt = comma;
+}
+
+// Replaces the expressions used more than once in the current run.
+// Larger expressions go first; since their definitions are inserted
+// at the front of a statement, the definitions of smaller ones that
+// they use end up before them.
+static void end_run(void) {
+  for (;;) {
+    Expr *e = NULL;
+    for (int i = 0; i < nexprs; i++)
+      if (exprs[i].nuses >= 2 && (!e || exprs[i].size > e->size))
+        e = &exprs[i];
+    if (!e)
+      break;
+    eliminate(e);
+    e->nuses = 0;
+  }
+
+  for (int i = 0; i < nexprs; i++)
+    free(exprs[i].uses);
+  nexprs = 0;
+  nstmts = 0;
+  pos = 0;
+}
+
+// Returns the expression slot of a statement that may be part of
+// a run, or NULL if it ends a run without being part of it.
+static Node **expr_slot(Node *node) {
+  switch (node->kind) {
+  case ND_EXPR_STMT:
+  case ND_RETURN:
+    return &node->lhs;
+  case ND_IF:
+  case ND_SWITCH:
+    return &node->cond;
+  }
+  return NULL;
+}
+
+static bool is_store_to_memory(Node *node) {
+  if (node->kind != ND_ASSIGN || is_qualified(node->lhs->ty))
+    return false;
+
+  Node *lhs = node->lhs;
+  if (lhs->kind == ND_DEREF)
+    return true;
+  return lhs->kind == ND_MEMBER && !lhs->member->is_bitfield &&
+         !is_qualified(lhs->lhs->ty);
+}
+
+static void cse_stmt(Node *node);
+static void cse_expr(Node *node);
+
+// Adds a statement to the current run if possible. Returns false if
+// the statement ends the run.
+static bool add_to_run(Node *node) {
+  Node **slot = expr_slot(node);
+  Node *expr = slot ? *slot : NULL;
+  if (!expr || (expr->ty && (expr->ty->kind == TY_STRUCT || expr->ty->kind == TY_UNION)))
+    return false;
+
+  nassigned = 0;
+  bool is_store = false;
+  bool ok = is_pure(expr);
+
+  // `x = y` where x is in memory may end a run.
+  if (!ok && node->kind == ND_EXPR_STMT && is_store_to_memory(expr)) {
+    nassigned = 0;
+    is_store = is_pure(expr->lhs->lhs) && is_pure(expr->rhs);
+    ok = is_store;
+  }
+
+  if (!ok)
+    return false;
+  add_stmt(slot, is_store);
+  return !is_store && node->kind == ND_EXPR_STMT;
+}
+
+// Optimizes a list of statements. Declarations are blocks of their
+// own, so a run continues into nested blocks.
+static void cse_list(Node *list) {
+  for (Node *node = list; node; node = node->next) {
+    if (node->kind == ND_BLOCK) {
+      cse_list(node->body);
+      continue;
+    }
+
+    if (add_to_run(node))
+      continue;
+    end_run();
+    cse_stmt(node);
+  }
+}
+
+// Looks for runs in the statements nested in a given statement.
+static void cse_stmt(Node *node) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_BLOCK:
+    cse_list(node->body);
+    end_run();
+    return;
+  case ND_IF:
+    cse_expr(node->cond);
+    cse_stmt(node->then);
+    cse_stmt(node->els);
+    return;
+  case ND_FOR:
+    cse_stmt(node->init);
+    cse_expr(node->cond);
+    cse_expr(node->inc);
+    cse_stmt(node->then);
+    return;
+  case ND_DO:
+  case ND_SWITCH:
+    cse_expr(node->cond);
+    cse_stmt(node->then);
+    return;
+  case ND_CASE:
+  case ND_LABEL:
+    cse_stmt(node->lhs);
+    return;
+  }
+  cse_expr(node->lhs);
+}
+
+// Looks for statement expressions in a given expression.
+static void cse_expr(Node *node) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_STMT_EXPR:
+    cse_list(node->body);
+    end_run();
+    return;
+  case ND_COND:
+    cse_expr(node->cond);
+    cse_expr(node->then);
+    cse_expr(node->els);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      cse_expr(n);
+    break;
+  case ND_CAS:
+    cse_expr(node->cas_addr);
+    cse_expr(node->cas_old);
+    cse_expr(node->cas_new);
+    break;
+  }
+  cse_expr(node->lhs);
+  cse_expr(node->rhs);
+}
+
+void cse_function(Obj *fn) {
+  current_fn = fn;
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->is_addr_taken = false;
+  walk(fn->body, find_addr_taken);
+  cse_stmt(fn->body);
+}
+
+void cse(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && fn->body)
+      cse_function(fn);
+}
@@ -109,6 +109,7 @@ static const char *node_kind_name(NodeKind kind) {
   case ND_ASM:       return "ND_ASM";
   case ND_CAS:       return "ND_CAS";
   case ND_EXCH:      return "ND_EXCH";
+  case ND_ATOMIC_OP: return "ND_ATOMIC_OP";
   }
   return "ND_UNKNOWN";
 }
@@ -165,6 +166,13 @@ static char *type_to_str(Type *ty) {
     free(base);
     return buf;
   }
+  case TY_VECTOR: {
+    char *elem = type_to_str(ty->elem);
+    char *buf = calloc(1, strlen(elem) + 32);
+    sprintf(buf, "%s vector(%d)", elem, ty->size);
+    free(elem);
+    return buf;
+  }
   case TY_FUNC: {
     char *ret = type_to_str(ty->return_ty);
     // Just show "ret_type (*)(...)"
@@ -181,41 +189,56 @@ static char *type_to_str(Type *ty) {
 // --dump-tokens
 //
 
-void dump_tokens(Token *tok) {
-  printf("[\n");
+void dump_tokens(Token *tok, FILE *out) {
+  fprintf(out, "[\n");
   bool first = true;
   for (Token *t = tok; t; t = t->next) {
     if (t->kind == TK_EOF)
       break;
     if (!first)
-      printf(",\n");
+      fprintf(out, ",\n");
     first = false;
 
-    printf("  {\"kind\":");
-    json_print_str(stdout, token_kind_name(t->kind));
-    printf(",\"text\":");
-    json_print_escaped(stdout, t->loc, t->len);
-    printf(",\"line\":%d", t->line_no);
-    printf(",\"file\":");
-    json_print_str(stdout, t->filename);
+    fprintf(out, "  {\"kind\":");
+    json_print_str(out, token_kind_name(t->kind));
+    fprintf(out, ",\"text\":");
+    json_print_escaped(out, t->loc, t->len);
+    fprintf(out, ",\"line\":%d", t->line_no);
+    fprintf(out, ",\"file\":");
+    json_print_str(out, t->filename);
 
     // For numeric tokens, include the value
     if (t->kind == TK_NUM) {
-      if (t->ty && (t->ty->kind == TY_FLOAT || t->ty->kind == TY_DOUBLE || t->ty->kind == TY_LDOUBLE))
-        printf(",\"fval\":%Lg", t->fval);
+      if (is_flonum(t->lit->ty))
+        fprintf(out, ",\"fval\":%Lg", t->lit->fval);
       else
-        printf(",\"val\":%ld", (long)t->val);
+        fprintf(out, ",\"val\":%ld", (long)t->lit->val);
     }
 
-    printf("}");
+    fprintf(out, "}");
   }
-  printf("\n]\n");
+  fprintf(out, "\n]\n");
 }
 
 //
 // --dump-ast
 //
 
+// Every node has an ID, which is its position in a preorder walk of
+// the whole program, so that a client can ask for a subtree by ID with
+// --dump-ast-node. Subtrees deeper than --dump-ast-depth (or MAX_DEPTH)
+// below the dumped root are replaced with {"id":...,"kind":...,
+// "collapsed":true}. To keep the IDs stable, the parts that are not
+// dumped are still walked and written to /dev/null.
+int opt_dump_ast_depth;
+int opt_dump_ast_node = -1;
+
+static FILE *ast_out;
+static FILE *null_out;
+static int next_id;
+static int root_depth;
+static bool found_root;
+
 static void dump_node(FILE *out, Node *node, int depth);
 
 static void dump_node_list(FILE *out, const char *key, Node *node, int depth) {
@@ -243,12 +266,27 @@ static void dump_node(FILE *out, Node *node, int depth) {
     return;
   }
 
-  if (depth > MAX_DEPTH) {
-    fputs("{\"kind\":\"...(truncated)\"}", out);
-    return;
+  int id = next_id++;
+  if (id == opt_dump_ast_node) {
+    out = ast_out;
+    root_depth = depth;
+    found_root = true;
+  }
+
+  if (out != null_out) {
+    int limit = MAX_DEPTH;
+    if (opt_dump_ast_depth && opt_dump_ast_depth < limit)
+      limit = opt_dump_ast_depth;
+
+    if (depth - root_depth >= limit) {
+      fprintf(out, "{\"id\":%d,\"kind\":", id);
+      json_print_str(out, node_kind_name(node->kind));
+      fputs(",\"collapsed\":true}", out);
+      out = null_out;
+    }
   }
 
-  fputs("{\"kind\":", out);
+  fprintf(out, "{\"id\":%d,\"kind\":", id);
   json_print_str(out, node_kind_name(node->kind));
 
   // Type
@@ -385,6 +423,12 @@ static void dump_node(FILE *out, Node *node, int depth) {
     dump_node_field(out, "rhs", node->rhs, depth + 1);
     break;
 
+  case ND_ATOMIC_OP:
+    fprintf(out, ",\"op\":\"%s\"", node_kind_name(node->atomic_op));
+    dump_node_field(out, "lhs", node->lhs, depth + 1);
+    dump_node_field(out, "rhs", node->rhs, depth + 1);
+    break;
+
   case ND_COND:
     dump_node_field(out, "cond", node->cond, depth + 1);
     dump_node_field(out, "then", node->then, depth + 1);
@@ -425,8 +469,18 @@ static void dump_type_json(FILE *out, Type *ty) {
   free(ts);
 }
 
-void dump_ast(Obj *prog) {
-  FILE *out = stdout;
+void dump_ast(Obj *prog, FILE *out) {
+  if (!null_out)
+    null_out = fopen("/dev/null", "w");
+  ast_out = out;
+  next_id = 0;
+  root_depth = 0;
+  found_root = false;
+
+  // If a subtree is requested, dump only that subtree.
+  if (opt_dump_ast_node >= 0)
+    out = null_out;
+
   fputs("{\"globals\":[\n", out);
 
   bool first = true;
@@ -504,5 +558,637 @@ void dump_ast(Obj *prog) {
     fputs("}", out);
   }
 
-  fputs("\n]}\n", out);
+  fprintf(out, "\n],\"nodes\":%d}\n", next_id);
+
+  if (opt_dump_ast_node >= 0)
+    fputs(found_root ? "\n" : "null\n", ast_out);
+}
+
+//
+// --dump-format=binary
+//
+// The binary format is a set of tables of fixed-size records, so that
+// a reader can load a dump without parsing and follow references by
+// index. All integers are little-endian.
+//
+//   header:  "CBIN" version:u32 what:u32 root:u32
+//            nstrings:u32 ntypes:u32 nmembers:u32 nnodes:u32 nobjs:u32
+//            ntokens:u32
+//   strings: len:u32 bytes[len] ...
+//   types:   kind size align flags base array_len members return_ty
+//            params next name (u32 each)
+//   members: name type offset next (u32 each)
+//   nodes:   kind type line lhs rhs next ch0 ch1 ch2 ch3 ch4 obj str
+//            (u32 each) val:i64 val2:i64 fval:f64
+//   objs:    name type flags offset next params locals body (u32 each)
+//   tokens:  kind text file line (u32 each) val:i64 fval:f64
+//
+// `what` is 1 for --dump-tokens and 2 for --dump-ast. `root` is the
+// first token or the first global object. Record 0 of each table is a
+// dummy, so that index 0 can mean "none". Every reference to a table
+// is an index into that table, and kinds are indices of their names,
+// e.g. "ND_ADD", in the string table.
+//
+// The meaning of the node fields depends on the kind:
+//
+//   ND_IF, ND_FOR, ND_DO, ND_SWITCH, ND_COND: ch0-4 = cond, then, els,
+//     init, inc
+//   ND_BLOCK, ND_STMT_EXPR: ch0 = first statement
+//   ND_FUNCALL: ch0 = first argument, obj = return buffer
+//   ND_CAS: ch0-2 = addr, old, new
+//   ND_CASE: val = begin, val2 = end
+//   ND_ATOMIC_OP: val = kind of the operation
+//   ND_NUM: val or fval
+//   ND_MEMBER: str = member name, val = member offset
+//   ND_GOTO, ND_LABEL, ND_LABEL_VAL: str = label
+//   ND_VAR, ND_MEMZERO, ND_VLA_PTR: obj = variable
+//   ND_ASM: str = assembly
+//
+// Lists are linked by `next`. Object flags are is_function,
+// is_definition, is_static, is_local, is_tentative, is_tls,
+// has_init_data and is_live from bit 0 up. Type flags are
+// is_unsigned, is_atomic, is_variadic, is_flexible and is_packed.
+// Floating-point values are stored as doubles.
+
+#define BIN_VERSION 1
+
+typedef struct {
+  uint32_t kind, size, align, flags, base, array_len, members, return_ty;
+  uint32_t params, next, name;
+} BinType;
+
+typedef struct {
+  uint32_t name, type, offset, next;
+} BinMember;
+
+typedef struct {
+  char *str;
+  int len;
+} BinString;
+
+typedef struct {
+  uint32_t kind, type, line, lhs, rhs, next, ch[5], obj, str;
+  int64_t val, val2;
+  double fval;
+} BinNode;
+
+typedef struct {
+  uint32_t name, type, flags, offset, next, params, locals, body;
+} BinObj;
+
+typedef struct {
+  uint32_t kind, text, file, line;
+  int64_t val;
+  double fval;
+} BinToken;
+
+// A growable array of records. Record 0 is a dummy.
+typedef struct {
+  char *data;
+  int size;
+  int len;
+  int capacity;
+} Table;
+
+static Table strings, types, members, nodes, objs, tokens;
+
+// Number of bytes of strings.
+static long strings_size;
+
+static HashMap string_idx;
+static HashMap type_idx;
+static HashMap obj_idx;
+
+static void table_init(Table *t, int size) {
+  *t = (Table){calloc(64, size), size, 1, 64};
+}
+
+static uint32_t table_add(Table *t) {
+  if (t->len == t->capacity) {
+    t->capacity *= 2;
+    t->data = realloc(t->data, (size_t)t->size * t->capacity);
+  }
+  memset(t->data + (size_t)t->size * t->len, 0, t->size);
+  return t->len++;
+}
+
+static void *table_get(Table *t, uint32_t idx) {
+  return t->data + (size_t)t->size * idx;
+}
+
+// Returns the index of a pointer recorded by ptr_put(). Keys are the
+// bytes of the pointers themselves.
+static uint32_t ptr_get(HashMap *map, void *ptr) {
+  return (uint32_t)(intptr_t)hashmap_get2(map, (char *)&ptr, sizeof(ptr));
+}
+
+static void ptr_put(HashMap *map, void *ptr, uint32_t idx) {
+  void **key = malloc(sizeof(ptr));
+  *key = ptr;
+  hashmap_put2(map, (char *)key, sizeof(ptr), (void *)(intptr_t)idx);
+}
+
+static uint32_t intern2(char *s, int len) {
+  if (!s)
+    return 0;
+
+  uint32_t idx = (uint32_t)(intptr_t)hashmap_get2(&string_idx, s, len);
+  if (idx)
+    return idx;
+
+  idx = table_add(&strings);
+  *(BinString *)table_get(&strings, idx) = (BinString){s, len};
+  strings_size += len;
+  hashmap_put2(&string_idx, s, len, (void *)(intptr_t)idx);
+  return idx;
+}
+
+static uint32_t intern(char *s) {
+  return s ? intern2(s, strlen(s)) : 0;
+}
+
+static uint32_t intern_tok(Token *tok) {
+  return tok ? intern2(tok->loc, tok->len) : 0;
+}
+
+static const char *type_kind_name(TypeKind kind) {
+  switch (kind) {
+  case TY_VOID:    return "TY_VOID";
+  case TY_BOOL:    return "TY_BOOL";
+  case TY_CHAR:    return "TY_CHAR";
+  case TY_SHORT:   return "TY_SHORT";
+  case TY_INT:     return "TY_INT";
+  case TY_LONG:    return "TY_LONG";
+  case TY_FLOAT:   return "TY_FLOAT";
+  case TY_DOUBLE:  return "TY_DOUBLE";
+  case TY_LDOUBLE: return "TY_LDOUBLE";
+  case TY_ENUM:    return "TY_ENUM";
+  case TY_PTR:     return "TY_PTR";
+  case TY_FUNC:    return "TY_FUNC";
+  case TY_ARRAY:   return "TY_ARRAY";
+  case TY_VLA:     return "TY_VLA";
+  case TY_STRUCT:  return "TY_STRUCT";
+  case TY_UNION:   return "TY_UNION";
+  case TY_VECTOR:  return "TY_VECTOR";
+  }
+  return "TY_UNKNOWN";
+}
+
+static uint32_t bin_type(Type *ty) {
+  if (!ty)
+    return 0;
+
+  uint32_t idx = ptr_get(&type_idx, ty);
+  if (idx)
+    return idx;
+
+  // Register the type before visiting its components, since
+  // a struct may refer to itself.
+  idx = table_add(&types);
+  ptr_put(&type_idx, ty, idx);
+
+  uint32_t base = bin_type(ty->kind == TY_VECTOR ? ty->elem : ty->base);
+  uint32_t return_ty = bin_type(ty->return_ty);
+  uint32_t params = bin_type(ty->params);
+  uint32_t next = bin_type(ty->next);
+
+  uint32_t first = 0;
+  uint32_t prev = 0;
+  for (Member *mem = ty->members; mem; mem = mem->next) {
+    uint32_t m = table_add(&members);
+    uint32_t mty = bin_type(mem->ty);
+
+    BinMember *bm = table_get(&members, m);
+    bm->name = intern_tok(mem->name);
+    bm->type = mty;
+    bm->offset = mem->offset;
+
+    if (prev)
+      ((BinMember *)table_get(&members, prev))->next = m;
+    else
+      first = m;
+    prev = m;
+  }
+
+  BinType *bt = table_get(&types, idx);
+  bt->kind = intern((char *)type_kind_name(ty->kind));
+  bt->size = ty->size;
+  bt->align = ty->align;
+  bt->flags = ty->is_unsigned | ty->is_atomic << 1 | ty->is_variadic << 2 |
+              ty->is_flexible << 3 | ty->is_packed << 4;
+  bt->base = base;
+  bt->array_len = ty->array_len;
+  bt->members = first;
+  bt->return_ty = return_ty;
+  bt->params = params;
+  bt->next = next;
+  bt->name = intern_tok(ty->name);
+  return idx;
+}
+
+static uint32_t bin_node(Node *node);
+static uint32_t bin_obj(Obj *var);
+
+static uint32_t bin_node_list(Node *list) {
+  uint32_t first = 0;
+  uint32_t prev = 0;
+  for (Node *n = list; n; n = n->next) {
+    uint32_t idx = bin_node(n);
+    if (prev)
+      ((BinNode *)table_get(&nodes, prev))->next = idx;
+    else
+      first = idx;
+    prev = idx;
+  }
+  return first;
+}
+
+static uint32_t bin_obj_list(Obj *list) {
+  uint32_t first = 0;
+  uint32_t prev = 0;
+  for (Obj *var = list; var; var = var->next) {
+    uint32_t idx = bin_obj(var);
+    if (prev)
+      ((BinObj *)table_get(&objs, prev))->next = idx;
+    else
+      first = idx;
+    prev = idx;
+  }
+  return first;
+}
+
+static uint32_t bin_node(Node *node) {
+  if (!node)
+    return 0;
+
+  uint32_t idx = table_add(&nodes);
+  uint32_t ch[5] = {};
+  uint32_t obj = 0;
+  uint32_t str = 0;
+  int64_t val = 0;
+  int64_t val2 = 0;
+  double fval = 0;
+
+  uint32_t lhs = bin_node(node->lhs);
+  uint32_t rhs = bin_node(node->rhs);
+  uint32_t type = bin_type(node->ty);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    ch[0] = bin_node(node->cond);
+    ch[1] = bin_node(node->then);
+    ch[2] = bin_node(node->els);
+    ch[3] = bin_node(node->init);
+    ch[4] = bin_node(node->inc);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    ch[0] = bin_node_list(node->body);
+    break;
+  case ND_FUNCALL:
+    ch[0] = bin_node_list(node->args);
+    obj = bin_obj(node->ret_buffer);
+    break;
+  case ND_CAS:
+    ch[0] = bin_node(node->cas_addr);
+    ch[1] = bin_node(node->cas_old);
+    ch[2] = bin_node(node->cas_new);
+    break;
+  case ND_CASE:
+    val = node->begin;
+    val2 = node->end;
+    break;
+  case ND_ATOMIC_OP:
+    val = node->atomic_op;
+    break;
+  case ND_NUM:
+    val = node->val;
+    fval = node->fval;
+    break;
+  case ND_MEMBER:
+    str = intern_tok(node->member->name);
+    val = node->member->offset;
+    break;
+  case ND_GOTO:
+  case ND_LABEL:
+  case ND_LABEL_VAL:
+    str = intern(node->label);
+    break;
+  case ND_VAR:
+  case ND_MEMZERO:
+  case ND_VLA_PTR:
+    obj = bin_obj(node->var);
+    break;
+  case ND_ASM:
+    str = intern(node->asm_str);
+    break;
+  }
+
+  BinNode *bn = table_get(&nodes, idx);
+  bn->kind = intern((char *)node_kind_name(node->kind));
+  bn->type = type;
+  bn->line = node->tok ? node->tok->line_no : 0;
+  bn->lhs = lhs;
+  bn->rhs = rhs;
+  memcpy(bn->ch, ch, sizeof(ch));
+  bn->obj = obj;
+  bn->str = str;
+  bn->val = val;
+  bn->val2 = val2;
+  bn->fval = fval;
+  return idx;
+}
+
+// The `next` field of an object is set by bin_obj_list().
+static uint32_t bin_obj(Obj *var) {
+  if (!var)
+    return 0;
+
+  uint32_t idx = ptr_get(&obj_idx, var);
+  if (idx)
+    return idx;
+
+  idx = table_add(&objs);
+  ptr_put(&obj_idx, var, idx);
+
+  uint32_t type = bin_type(var->ty);
+  uint32_t params = 0, locals = 0, body = 0;
+  if (var->is_function) {
+    // Parameters are a tail of the list of locals.
+    locals = bin_obj_list(var->locals);
+    params = bin_obj_list(var->params);
+    body = bin_node(var->body);
+  }
+
+  BinObj *bo = table_get(&objs, idx);
+  bo->name = intern(var->name);
+  bo->type = type;
+  bo->flags = var->is_function | var->is_definition << 1 |
+              var->is_static << 2 | var->is_local << 3 |
+              var->is_tentative << 4 | var->is_tls << 5 |
+              (var->init_data != NULL) << 6 | var->is_live << 7;
+  bo->offset = var->offset;
+  bo->params = params;
+  bo->locals = locals;
+  bo->body = body;
+  return idx;
+}
+
+//
+// Writing the tables
+//
+
+typedef struct {
+  char *buf;
+  char *p;
+} Writer;
+
+static void put32(Writer *w, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    *w->p++ = v >> (i * 8);
+}
+
+static void put64(Writer *w, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    *w->p++ = v >> (i * 8);
+}
+
+static void putf64(Writer *w, double d) {
+  uint64_t v;
+  memcpy(&v, &d, 8);
+  put64(w, v);
+}
+
+static void bin_init(void) {
+  table_init(&strings, sizeof(BinString));
+  table_init(&types, sizeof(BinType));
+  table_init(&members, sizeof(BinMember));
+  table_init(&nodes, sizeof(BinNode));
+  table_init(&objs, sizeof(BinObj));
+  table_init(&tokens, sizeof(BinToken));
+  strings_size = 0;
+  string_idx = (HashMap){};
+  type_idx = (HashMap){};
+  obj_idx = (HashMap){};
+}
+
+static void bin_write(FILE *out, int what, uint32_t root) {
+  size_t size = 4 + 9 * 4 + strings.len * 4 + strings_size +
+                types.len * 11 * 4 + members.len * 4 * 4 +
+                nodes.len * (13 * 4 + 3 * 8) + objs.len * 8 * 4 +
+                tokens.len * (4 * 4 + 2 * 8);
+
+  Writer w = {malloc(size)};
+  w.p = w.buf;
+
+  memcpy(w.p, "CBIN", 4);
+  w.p += 4;
+  put32(&w, BIN_VERSION);
+  put32(&w, what);
+  put32(&w, root);
+  put32(&w, strings.len);
+  put32(&w, types.len);
+  put32(&w, members.len);
+  put32(&w, nodes.len);
+  put32(&w, objs.len);
+  put32(&w, tokens.len);
+
+  for (int i = 0; i < strings.len; i++) {
+    BinString *s = table_get(&strings, i);
+    put32(&w, s->len);
+    memcpy(w.p, s->str, s->len);
+    w.p += s->len;
+  }
+
+  for (int i = 0; i < types.len; i++) {
+    BinType *t = table_get(&types, i);
+    put32(&w, t->kind);
+    put32(&w, t->size);
+    put32(&w, t->align);
+    put32(&w, t->flags);
+    put32(&w, t->base);
+    put32(&w, t->array_len);
+    put32(&w, t->members);
+    put32(&w, t->return_ty);
+    put32(&w, t->params);
+    put32(&w, t->next);
+    put32(&w, t->name);
+  }
+
+  for (int i = 0; i < members.len; i++) {
+    BinMember *m = table_get(&members, i);
+    put32(&w, m->name);
+    put32(&w, m->type);
+    put32(&w, m->offset);
+    put32(&w, m->next);
+  }
+
+  for (int i = 0; i < nodes.len; i++) {
+    BinNode *n = table_get(&nodes, i);
+    put32(&w, n->kind);
+    put32(&w, n->type);
+    put32(&w, n->line);
+    put32(&w, n->lhs);
+    put32(&w, n->rhs);
+    put32(&w, n->next);
+    for (int j = 0; j < 5; j++)
+      put32(&w, n->ch[j]);
+    put32(&w, n->obj);
+    put32(&w, n->str);
+    put64(&w, n->val);
+    put64(&w, n->val2);
+    putf64(&w, n->fval);
+  }
+
+  for (int i = 0; i < objs.len; i++) {
+    BinObj *o = table_get(&objs, i);
+    put32(&w, o->name);
+    put32(&w, o->type);
+    put32(&w, o->flags);
+    put32(&w, o->offset);
+    put32(&w, o->next);
+    put32(&w, o->params);
+    put32(&w, o->locals);
+    put32(&w, o->body);
+  }
+
+  for (int i = 0; i < tokens.len; i++) {
+    BinToken *t = table_get(&tokens, i);
+    put32(&w, t->kind);
+    put32(&w, t->text);
+    put32(&w, t->file);
+    put32(&w, t->line);
+    put64(&w, t->val);
+    putf64(&w, t->fval);
+  }
+
+  assert(w.p == w.buf + size);
+  fwrite(w.buf, size, 1, out);
+  free(w.buf);
+}
+
+void dump_tokens_bin(Token *tok, FILE *out) {
+  bin_init();
+
+  for (Token *t = tok; t && t->kind != TK_EOF; t = t->next) {
+    uint32_t idx = table_add(&tokens);
+    BinToken *bt = table_get(&tokens, idx);
+    bt->kind = intern((char *)token_kind_name(t->kind));
+    bt->text = intern2(t->loc, t->len);
+    bt->file = intern(t->filename);
+    bt->line = t->line_no;
+
+    if (t->kind == TK_NUM) {
+      bt->val = t->lit->val;
+      bt->fval = t->lit->fval;
+    }
+  }
+
+  bin_write(out, 1, tokens.len > 1);
+}
+
+void dump_ast_bin(Obj *prog, FILE *out) {
+  bin_init();
+  uint32_t root = bin_obj_list(prog);
+  bin_write(out, 2, root);
+}
+
+//
+// --emit-all-json
+//
+// The result of each stage is written as a line of JSON as soon as
+// the stage is done, and the line is flushed, so that a client reading
+// the output as it comes can show the tokens while the later stages
+// are still running. A stage that fails has no line.
+//
+
+static int count_lines(char *s) {
+  int n = 0;
+  for (; *s; s++)
+    if (*s == '\n')
+      n++;
+  return n;
+}
+
+// Starts the line of a stage with the stats common to all stages.
+// The caller writes the rest of the stats and then the result.
+static void begin_stage(FILE *out, Phase phase, char *name) {
+  fprintf(out, "{\"stage\":\"%s\",\"stats\":{\"time_ms\":%.3f,\"peak_rss_kb\":%ld",
+          name, phase_time(phase), phase_peak_rss(phase));
+}
+
+static void end_stage(FILE *out) {
+  fprintf(out, "}\n");
+  fflush(out);
+}
+
+// Writes a JSON dump without its newlines, which are only whitespace
+// between elements, so that it fits on the line of its stage.
+static void print_unwrapped(FILE *out, char *buf) {
+  for (char *p = buf; *p; p++)
+    if (*p != '\n')
+      fputc(*p, out);
+  free(buf);
+}
+
+void dump_stage_tokens(FILE *out, Token *tok) {
+  int ntokens = 0;
+  for (Token *t = tok; t && t->kind != TK_EOF; t = t->next)
+    ntokens++;
+
+  char *buf;
+  size_t len;
+  FILE *mem = open_memstream(&buf, &len);
+  dump_tokens(tok, mem);
+  fclose(mem);
+
+  begin_stage(out, PHASE_TOKENIZE, "tokenize");
+  fprintf(out, ",\"count\":%d},\"tokens\":", ntokens);
+  print_unwrapped(out, buf);
+  end_stage(out);
+}
+
+void dump_stage_preprocessed(FILE *out, char *preprocessed) {
+  begin_stage(out, PHASE_PREPROCESS, "preprocess");
+  fprintf(out, ",\"lines\":%d,\"macros\":%ld},\"preprocessed\":",
+          count_lines(preprocessed), counters.macro_expansions);
+  json_print_str(out, preprocessed);
+  end_stage(out);
+}
+
+// The stats are taken before the AST is dumped, so that the time of
+// the parse stage doesn't include the dump.
+void dump_stage_ast(FILE *out, Obj *prog) {
+  int functions = 0;
+  int globals = 0;
+  for (Obj *obj = prog; obj; obj = obj->next) {
+    if (obj->is_function)
+      functions++;
+    else
+      globals++;
+  }
+
+  begin_stage(out, PHASE_PARSE, "parse");
+  fprintf(out, ",\"functions\":%d,\"globals\":%d,\"nodes\":%ld},\"ast\":",
+          functions, globals, counters.nodes);
+
+  char *buf;
+  size_t len;
+  FILE *mem = open_memstream(&buf, &len);
+  dump_ast(prog, mem);
+  fclose(mem);
+  print_unwrapped(out, buf);
+  end_stage(out);
+}
+
+void dump_stage_assembly(FILE *out, char *assembly) {
+  begin_stage(out, PHASE_CODEGEN, "codegen");
+  fprintf(out, ",\"lines\":%d,\"bytes\":%zu},\"assembly\":",
+          count_lines(assembly), strlen(assembly));
+  json_print_str(out, assembly);
+  end_stage(out);
 }
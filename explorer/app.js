@@ -150,7 +150,7 @@ async function compile() {
 
   try {
     const start = performance.now();
-    const resp = await fetch('/api/compile', {
+    const resp = await fetch('/api/compile/stream', {
       method: 'POST',
       headers: { 'Content-Type': 'application/json' },
       body: JSON.stringify({ code }),
@@ -161,20 +161,46 @@ async function compile() {
       throw new Error(text);
     }
 
-    lastResult = await resp.json();
-    const elapsed = performance.now() - start;
-    status.textContent = `${elapsed.toFixed(0)}ms`;
+    // The server sends a line of JSON per stage as soon as it is done,
+    // followed by a "done" line.
+    lastResult = { tokens: null, preprocessed: '', ast: null, assembly: '', error: null, stages: {} };
+    renderPipeline();
+    let first = null;
+    const errors = [];
+
+    await readLines(resp, (line) => {
+      const msg = JSON.parse(line);
+      const elapsed = performance.now() - start;
+
+      if (msg.stage === 'done') {
+        lastResult.error = msg.error || null;
+        lastResult.ast_key = msg.ast_key;
+        status.textContent = `${(first ?? elapsed).toFixed(0)}ms first stage · ${elapsed.toFixed(0)}ms`;
+        if (lastResult.error) showError(lastResult.error);
+        return;
+      }
 
-    if (lastResult.error) {
-      showError(lastResult.error);
-    }
+      if (first === null) first = elapsed;
+      switch (msg.stage) {
+        case 'tokenize':   lastResult.tokens = msg.tokens || null; break;
+        case 'preprocess': lastResult.preprocessed = msg.preprocessed || ''; break;
+        case 'parse':      lastResult.ast = msg.ast || null; break;
+        case 'codegen':    lastResult.assembly = msg.assembly || ''; break;
+      }
+      if (msg.stats) lastResult.stages[msg.stage] = msg.stats;
+      if (msg.error) {
+        errors.push(msg.error);
+        showError(errors.join('\n'));
+      }
+      status.textContent = `${elapsed.toFixed(0)}ms`;
 
-    renderPipeline();
+      renderPipeline();
 
-    // Re-render active detail if open
-    if (activeStage) {
-      renderDetail(activeStage);
-    }
+      // Re-render active detail if open
+      if (activeStage === msg.stage) {
+        renderDetail(activeStage);
+      }
+    });
 
   } catch (err) {
     showError(err.message);
@@ -184,6 +210,25 @@ async function compile() {
   }
 }
 
+// Calls fn with each line of a streamed response body.
+async function readLines(resp, fn) {
+  const reader = resp.body.getReader();
+  const decoder = new TextDecoder();
+  let buf = '';
+  for (;;) {
+    const { done, value } = await reader.read();
+    if (done) break;
+    buf += decoder.decode(value, { stream: true });
+    let nl;
+    while ((nl = buf.indexOf('\n')) >= 0) {
+      const line = buf.slice(0, nl);
+      buf = buf.slice(nl + 1);
+      if (line) fn(line);
+    }
+  }
+  if (buf) fn(buf);
+}
+
 // ── Error display ──
 
 function showError(msg) {
@@ -330,6 +375,9 @@ function renderTokens() {
     TK_PP_NUM: '#b07040',
   };
 
+  // The server sends only the first tokens. The stats have the total.
+  const total = (lastResult.stages.tokenize && lastResult.stages.tokenize.count) || tokens.length;
+
   const rows = tokens.slice(0, 500).map(t => {
     const kind = t.kind.replace('TK_', '');
     const color = kindColors[t.kind] || '#3a3530';
@@ -341,7 +389,7 @@ function renderTokens() {
     </div>`;
   }).join('');
 
-  const overflow = tokens.length > 500 ? `<div style="padding:8px 10px;color:var(--text-dim);font-size:11px">…and ${tokens.length - 500} more tokens</div>` : '';
+  const overflow = total > 500 ? `<div style="padding:8px 10px;color:var(--text-dim);font-size:11px">…and ${total - 500} more tokens</div>` : '';
 
   return `<div class="token-grid">
     <div class="token-header"><span>Kind</span><span>Text</span><span>Line</span></div>
@@ -386,8 +434,14 @@ function renderASTNode(obj, depth) {
     return `<span class="ast-toggle" data-target="${id}" data-collapsed="${id}-hint" onclick="toggleAST(this)">[▼</span><span id="${id}">\n${items}\n${'  '.repeat(depth)}</span><span id="${id}-hint" class="hidden ast-collapsed-hint">${hint}</span><span class="ast-bracket">]</span>`;
   }
 
+  // Subtrees below the depth the server sends are stubs, which are
+  // fetched when clicked.
+  if (typeof obj === 'object' && obj.collapsed) {
+    return `<span class="ast-stub"><span class="ast-toggle" data-node="${obj.id}" data-depth="${depth}" onclick="expandAST(this)">{▶</span><span class="ast-collapsed-hint">${escapeHTML(obj.kind)}</span><span class="ast-bracket">}</span></span>`;
+  }
+
   if (typeof obj === 'object') {
-    const keys = Object.keys(obj);
+    const keys = Object.keys(obj).filter(k => k !== 'id');
     if (keys.length === 0) return '<span class="ast-bracket">{}</span>';
 
     // Show kind prominently if present
@@ -422,6 +476,22 @@ window.toggleAST = function(el) {
   }
 };
 
+window.expandAST = async function(el) {
+  const stub = el.parentElement;
+  const depth = Number(el.dataset.depth);
+  el.textContent = '{…';
+  try {
+    const resp = await fetch(`/api/ast/${el.dataset.node}/children?key=${encodeURIComponent(lastResult.ast_key)}`);
+    if (!resp.ok) throw new Error(await resp.text());
+    const node = await resp.json();
+    if (!node || node.error) throw new Error(node ? node.error : 'node not found');
+    stub.outerHTML = renderASTNode(node, depth);
+  } catch (err) {
+    el.textContent = '{▶';
+    showError(err.message);
+  }
+};
+
 function renderAssembly() {
   if (!lastResult || !lastResult.assembly) {
     return '<div class="detail-content">No assembly output</div>';
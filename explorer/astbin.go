@@ -0,0 +1,132 @@
+package main
+
+// A reader for the output of `chibicc --dump-format=binary`. See the
+// comment in dump.c for the layout.
+
+import (
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+)
+
+const binDumpVersion = 1
+
+const (
+	BinTokens = 1
+	BinAST    = 2
+)
+
+type BinType struct {
+	Kind, Size, Align, Flags, Base, ArrayLen, Members, ReturnTy uint32
+	Params, Next, Name                                          uint32
+}
+
+type BinMember struct {
+	Name, Type, Offset, Next uint32
+}
+
+type BinNode struct {
+	Kind, Type, Line, Lhs, Rhs, Next uint32
+	Ch                               [5]uint32
+	Obj, Str                         uint32
+	Val, Val2                        int64
+	Fval                             float64
+}
+
+type BinObj struct {
+	Name, Type, Flags, Offset, Next, Params, Locals, Body uint32
+}
+
+type BinToken struct {
+	Kind, Text, File, Line uint32
+	Val                    int64
+	Fval                   float64
+}
+
+// Object flags
+const (
+	ObjFunction = 1 << iota
+	ObjDefinition
+	ObjStatic
+	ObjLocal
+	ObjTentative
+	ObjTLS
+	ObjInitData
+	ObjLive
+)
+
+// BinDump holds the tables of a dump. Index 0 of each table is a dummy
+// record, so a zero reference means "none". Kind fields are indices
+// into Strings.
+type BinDump struct {
+	What    uint32
+	Root    uint32
+	Strings []string
+	Types   []BinType
+	Members []BinMember
+	Nodes   []BinNode
+	Objs    []BinObj
+	Tokens  []BinToken
+}
+
+type binHeader struct {
+	Magic                                              [4]byte
+	Version, What, Root                                uint32
+	NStrings, NTypes, NMembers, NNodes, NObjs, NTokens uint32
+}
+
+func ReadBinDump(data []byte) (*BinDump, error) {
+	r := bytes.NewReader(data)
+
+	var h binHeader
+	if err := binary.Read(r, binary.LittleEndian, &h); err != nil {
+		return nil, err
+	}
+	if string(h.Magic[:]) != "CBIN" {
+		return nil, errors.New("not a chibicc binary dump")
+	}
+	if h.Version != binDumpVersion {
+		return nil, fmt.Errorf("unsupported binary dump version %d", h.Version)
+	}
+
+	d := &BinDump{What: h.What, Root: h.Root}
+
+	d.Strings = make([]string, h.NStrings)
+	for i := range d.Strings {
+		var n uint32
+		if err := binary.Read(r, binary.LittleEndian, &n); err != nil {
+			return nil, err
+		}
+		if int64(n) > int64(r.Len()) {
+			return nil, errors.New("truncated string table")
+		}
+		buf := make([]byte, n)
+		r.Read(buf)
+		d.Strings[i] = string(buf)
+	}
+
+	d.Types = make([]BinType, h.NTypes)
+	d.Members = make([]BinMember, h.NMembers)
+	d.Nodes = make([]BinNode, h.NNodes)
+	d.Objs = make([]BinObj, h.NObjs)
+	d.Tokens = make([]BinToken, h.NTokens)
+
+	for _, table := range []any{d.Types, d.Members, d.Nodes, d.Objs, d.Tokens} {
+		if err := binary.Read(r, binary.LittleEndian, table); err != nil {
+			return nil, err
+		}
+	}
+	if r.Len() != 0 {
+		return nil, errors.New("trailing data after binary dump")
+	}
+	return d, nil
+}
+
+// Str returns the string at a given index or "" for index 0.
+func (d *BinDump) Str(idx uint32) string {
+	if int(idx) >= len(d.Strings) {
+		return ""
+	}
+	return d.Strings[idx]
+}
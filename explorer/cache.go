@@ -0,0 +1,287 @@
+package main
+
+// A bounded LRU cache of compile responses. Concurrent requests for
+// the same key are coalesced, so that a burst of identical requests
+// compiles the code only once. A compilation can also publish parts of
+// its response as it goes, which are streamed to all the requests
+// waiting for it.
+
+import (
+	"container/list"
+	"context"
+	"crypto/sha256"
+	"encoding/hex"
+	"encoding/json"
+	"fmt"
+	"io"
+	"os"
+	"sync"
+)
+
+const cacheEntries = 256
+
+type cacheEntry struct {
+	key  string
+	body []byte
+}
+
+// flight is a compilation in progress. Requests for the same key
+// wait for done and share body. The parts published so far are kept
+// in parts, and more is closed and replaced whenever one is added.
+type flight struct {
+	done  chan struct{}
+	body  []byte
+	parts [][]byte
+	more  chan struct{}
+
+	// refs counts the requests reading the flight. When the last one
+	// goes away, cancel stops the compilation.
+	refs   int
+	cancel context.CancelFunc
+}
+
+// reader is a request reading a flight.
+type reader struct {
+	left bool
+}
+
+type resultCache struct {
+	mu       sync.Mutex
+	max      int
+	lru      *list.List
+	entries  map[string]*list.Element
+	inflight map[string]*flight
+
+	hits, misses, coalesced int64
+}
+
+func newResultCache(max int) *resultCache {
+	return &resultCache{
+		max:      max,
+		lru:      list.New(),
+		entries:  make(map[string]*list.Element),
+		inflight: make(map[string]*flight),
+	}
+}
+
+// lookup returns the cached body for key if exists.
+func (c *resultCache) lookup(key string) ([]byte, bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if e, ok := c.entries[key]; ok {
+		c.lru.MoveToFront(e)
+		c.hits++
+		return e.Value.(*cacheEntry).body, true
+	}
+	return nil, false
+}
+
+// get returns the cached body for key, or calls compute to make one.
+// The result is cached only if compute says it is cacheable.
+func (c *resultCache) get(key string, compute func() ([]byte, bool)) []byte {
+	body, _ := c.stream(context.Background(), key, func(context.Context, func([]byte)) ([]byte, bool) {
+		return compute()
+	}, nil)
+	return body
+}
+
+// stream is like get, but compute may publish parts of the body as it
+// makes it, and send, if not nil, is called with each of them. A
+// request that joins a compilation in progress is sent the parts
+// published before it joined, too. The request stops reading if send
+// returns false or ctx is done, and then stream returns nil. The
+// context of compute is cancelled when no request is reading it.
+// stream also returns whether the body was in the cache, in which case
+// nothing is sent.
+func (c *resultCache) stream(ctx context.Context, key string,
+	compute func(ctx context.Context, publish func([]byte)) ([]byte, bool),
+	send func([]byte) bool) ([]byte, bool) {
+	c.mu.Lock()
+	if e, ok := c.entries[key]; ok {
+		c.lru.MoveToFront(e)
+		c.hits++
+		c.mu.Unlock()
+		return e.Value.(*cacheEntry).body, true
+	}
+	r := &reader{}
+	if f, ok := c.inflight[key]; ok {
+		c.coalesced++
+		f.refs++
+		c.mu.Unlock()
+		return c.follow(ctx, key, f, r, send), false
+	}
+	computeCtx, cancel := context.WithCancel(context.Background())
+	f := &flight{done: make(chan struct{}), more: make(chan struct{}), refs: 1, cancel: cancel}
+	c.inflight[key] = f
+	c.misses++
+	c.mu.Unlock()
+
+	// We run compute, so we are sent the parts as they are published
+	// rather than through follow.
+	stop := context.AfterFunc(ctx, func() { c.leave(key, f, r) })
+	defer stop()
+	publish := func(part []byte) {
+		c.mu.Lock()
+		f.parts = append(f.parts, part)
+		close(f.more)
+		f.more = make(chan struct{})
+		reading := !r.left
+		c.mu.Unlock()
+		if reading && send != nil && !send(part) {
+			c.leave(key, f, r)
+		}
+	}
+
+	// The waiters must be released even if compute panics. They get
+	// an error response, and the panic goes on to our caller.
+	ok := false
+	defer func() {
+		rec := recover()
+		if rec != nil {
+			f.body, _ = json.Marshal(map[string]string{"error": fmt.Sprintf("internal error: %v", rec)})
+			f.body = append(f.body, '\n')
+			ok = false
+		}
+		c.mu.Lock()
+		if c.inflight[key] == f {
+			delete(c.inflight, key)
+		}
+		if ok {
+			c.add(key, f.body)
+		}
+		c.mu.Unlock()
+		close(f.done)
+		cancel()
+		if rec != nil {
+			panic(rec)
+		}
+	}()
+
+	f.body, ok = compute(computeCtx, publish)
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if r.left {
+		return nil, false
+	}
+	return f.body, false
+}
+
+// follow sends the parts of f to send as they are published and
+// returns its body, or nil if the request stopped reading first.
+func (c *resultCache) follow(ctx context.Context, key string, f *flight, r *reader, send func([]byte) bool) []byte {
+	defer c.leave(key, f, r)
+	for i := 0; ; {
+		// All the parts are published before done is closed.
+		finished := false
+		select {
+		case <-f.done:
+			finished = true
+		default:
+		}
+
+		c.mu.Lock()
+		parts := f.parts[i:]
+		more := f.more
+		c.mu.Unlock()
+		for _, part := range parts {
+			if send != nil && !send(part) {
+				return nil
+			}
+		}
+		i += len(parts)
+		if finished {
+			return f.body
+		}
+
+		select {
+		case <-more:
+		case <-f.done:
+		case <-ctx.Done():
+			return nil
+		}
+	}
+}
+
+// leave records that r stopped reading f. If it was the last reader
+// of an unfinished flight, the compilation is cancelled, and later
+// requests start a new one rather than waiting for its error.
+func (c *resultCache) leave(key string, f *flight, r *reader) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if r.left {
+		return
+	}
+	r.left = true
+	if f.refs--; f.refs == 0 {
+		f.cancel()
+		if c.inflight[key] == f {
+			delete(c.inflight, key)
+		}
+	}
+}
+
+// put adds body for key unless there is an entry for it.
+func (c *resultCache) put(key string, body []byte) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if _, ok := c.entries[key]; !ok {
+		c.add(key, body)
+	}
+}
+
+func (c *resultCache) add(key string, body []byte) {
+	c.entries[key] = c.lru.PushFront(&cacheEntry{key, body})
+	if c.lru.Len() > c.max {
+		e := c.lru.Back()
+		c.lru.Remove(e)
+		delete(c.entries, e.Value.(*cacheEntry).key)
+	}
+}
+
+type CacheStats struct {
+	Entries   int     `json:"entries"`
+	Hits      int64   `json:"hits"`
+	Misses    int64   `json:"misses"`
+	Coalesced int64   `json:"coalesced"`
+	HitRate   float64 `json:"hit_rate"`
+}
+
+// stats is published through expvar at /debug/vars. Coalesced
+// requests count as hits because they don't compile either.
+func (c *resultCache) stats() interface{} {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	s := CacheStats{
+		Entries:   c.lru.Len(),
+		Hits:      c.hits,
+		Misses:    c.misses,
+		Coalesced: c.coalesced,
+	}
+	if total := c.hits + c.misses + c.coalesced; total > 0 {
+		s.HitRate = float64(c.hits+c.coalesced) / float64(total)
+	}
+	return s
+}
+
+// binaryVersion returns a hash of the chibicc binary, so that cached
+// results are not reused after chibicc is rebuilt.
+func binaryVersion(path string) (string, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return "", err
+	}
+	defer f.Close()
+	h := sha256.New()
+	if _, err := io.Copy(h, f); err != nil {
+		return "", err
+	}
+	return hex.EncodeToString(h.Sum(nil)), nil
+}
+
+func cacheKey(version, code string) string {
+	h := sha256.New()
+	io.WriteString(h, version)
+	h.Write([]byte{0})
+	io.WriteString(h, code)
+	return hex.EncodeToString(h.Sum(nil))
+}
@@ -0,0 +1,69 @@
+package main
+
+// Responses are gzip-compressed for clients that accept it. The AST
+// and token dumps are repetitive JSON, which gzip shrinks by an order
+// of magnitude.
+
+import (
+	"compress/gzip"
+	"net/http"
+	"strings"
+	"sync"
+)
+
+var gzipWriters = sync.Pool{
+	New: func() interface{} { return gzip.NewWriter(nil) },
+}
+
+type gzipResponseWriter struct {
+	http.ResponseWriter
+	gz    *gzip.Writer
+	plain bool
+}
+
+func (w *gzipResponseWriter) Write(b []byte) (int, error) {
+	if w.plain {
+		return w.ResponseWriter.Write(b)
+	}
+	return w.gz.Write(b)
+}
+
+// Errors written by http.Error are sent uncompressed.
+func (w *gzipResponseWriter) WriteHeader(status int) {
+	if status != http.StatusOK {
+		w.Header().Del("Content-Encoding")
+		w.plain = true
+	}
+	w.ResponseWriter.WriteHeader(status)
+}
+
+// Flush sends what has been written so far, for streamed responses.
+func (w *gzipResponseWriter) Flush() {
+	if !w.plain {
+		w.gz.Flush()
+	}
+	if f, ok := w.ResponseWriter.(http.Flusher); ok {
+		f.Flush()
+	}
+}
+
+func withGzip(h http.Handler) http.Handler {
+	return http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Add("Vary", "Accept-Encoding")
+		if !strings.Contains(r.Header.Get("Accept-Encoding"), "gzip") {
+			h.ServeHTTP(w, r)
+			return
+		}
+
+		gz := gzipWriters.Get().(*gzip.Writer)
+		gz.Reset(w)
+		defer gzipWriters.Put(gz)
+
+		w.Header().Set("Content-Encoding", "gzip")
+		gw := &gzipResponseWriter{ResponseWriter: w, gz: gz}
+		h.ServeHTTP(gw, r)
+		if !gw.plain {
+			gz.Close()
+		}
+	})
+}
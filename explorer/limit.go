@@ -0,0 +1,91 @@
+package main
+
+// Admission control. Each client may send clientRate requests per
+// second with bursts of up to clientBurst, and at most queuePerWorker
+// requests per worker may wait for or run on the workers at a time.
+// Requests over either limit are rejected right away, so that a
+// traffic spike doesn't pile up behind the workers.
+
+import (
+	"net"
+	"net/http"
+	"sync"
+	"time"
+)
+
+const (
+	clientRate     = 5.0
+	clientBurst    = 20.0
+	queuePerWorker = 8
+)
+
+var queue chan struct{}
+
+func startQueue(depth int) {
+	queue = make(chan struct{}, depth)
+}
+
+// enterQueue takes a queue slot, or returns false if the queue is full.
+func enterQueue() bool {
+	select {
+	case queue <- struct{}{}:
+		return true
+	default:
+		return false
+	}
+}
+
+func leaveQueue() {
+	<-queue
+}
+
+type bucket struct {
+	tokens float64
+	last   time.Time
+}
+
+var (
+	bucketsMu sync.Mutex
+	buckets   = make(map[string]*bucket)
+)
+
+func clientAddr(r *http.Request) string {
+	host, _, err := net.SplitHostPort(r.RemoteAddr)
+	if err != nil {
+		return r.RemoteAddr
+	}
+	return host
+}
+
+// allowClient takes a token from the client's bucket.
+func allowClient(addr string) bool {
+	bucketsMu.Lock()
+	defer bucketsMu.Unlock()
+
+	now := time.Now()
+	b, ok := buckets[addr]
+	if !ok {
+		// Buckets that have refilled are the same as new ones, so
+		// they are dropped to keep the map small.
+		if len(buckets) >= 10000 {
+			for k, b := range buckets {
+				if now.Sub(b.last).Seconds()*clientRate >= clientBurst {
+					delete(buckets, k)
+				}
+			}
+		}
+		b = &bucket{tokens: clientBurst, last: now}
+		buckets[addr] = b
+	}
+
+	b.tokens += now.Sub(b.last).Seconds() * clientRate
+	if b.tokens > clientBurst {
+		b.tokens = clientBurst
+	}
+	b.last = now
+	if b.tokens < 1 {
+		return false
+	}
+	b.tokens--
+	return true
+}
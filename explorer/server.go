@@ -1,16 +1,22 @@
 package main
 
 import (
+	"bufio"
+	"bytes"
 	"context"
 	"encoding/json"
+	"errors"
+	"expvar"
 	"fmt"
+	"io"
 	"log"
 	"net/http"
 	"os"
-	"path/filepath"
+	"os/exec"
+	"runtime"
+	"strconv"
 	"strings"
 	"time"
-	"os/exec"
 )
 
 const (
@@ -18,8 +24,17 @@ const (
 	staticDir   = "/home/exedev/chibicc/explorer"
 	listenAddr  = ":8001"
 	cmdTimeout  = 5 * time.Second
+	srcFile     = "input.c"
+
+	// The AST is sent down to astDepth levels below each function.
+	// Deeper subtrees are fetched from /api/ast/{id}/children when
+	// they are expanded.
+	astDepth  = 4
+	maxTokens = 500
 )
 
+var astDepthArg = fmt.Sprintf("--dump-ast-depth=%d", astDepth)
+
 // --- Request / Response types ---
 
 type CompileRequest struct {
@@ -30,7 +45,8 @@ type StageStats struct {
 	// tokenize
 	Count int `json:"count,omitempty"`
 	// preprocess
-	Lines int `json:"lines,omitempty"`
+	Lines  int `json:"lines,omitempty"`
+	Macros int `json:"macros,omitempty"`
 	// parse
 	Functions int `json:"functions,omitempty"`
 	Globals   int `json:"globals,omitempty"`
@@ -38,7 +54,11 @@ type StageStats struct {
 	// codegen
 	Bytes int `json:"bytes,omitempty"`
 	// common
-	TimeMs float64 `json:"time_ms"`
+	TimeMs    float64 `json:"time_ms"`
+	// Time spent waiting for a worker. In a single-job compilation,
+	// all stages report the wait of that job.
+	QueueMs   float64 `json:"queue_ms"`
+	PeakRSSKB int     `json:"peak_rss_kb,omitempty"`
 }
 
 type CompileResponse struct {
@@ -48,228 +68,556 @@ type CompileResponse struct {
 	Assembly     string             `json:"assembly"`
 	Error        *string            `json:"error"`
 	Stages       map[string]*StageStats `json:"stages"`
+	// ASTKey identifies the code for /api/ast/{id}/children.
+	ASTKey string `json:"ast_key"`
+
+	// transient is set if a stage failed for a reason other than the
+	// code itself, such as a timeout, so the response must not be
+	// cached.
+	transient bool
 }
 
-// --- Helpers ---
+// fail records a failed stage.
+func (resp *CompileResponse) fail(err error) {
+	var exit *exitError
+	if !errors.As(err, &exit) {
+		resp.transient = true
+	}
+}
+
+// --- Worker pool ---
 
-// runCmd executes a command with a timeout and returns stdout, stderr, error.
-func runCmd(ctx context.Context, name string, args ...string) (string, string, error) {
-	cmd := exec.CommandContext(ctx, name, args...)
-	var stdout, stderr strings.Builder
-	cmd.Stdout = &stdout
-	cmd.Stderr = &stderr
-	err := cmd.Run()
-	return stdout.String(), stderr.String(), err
+// worker is a `chibicc --serve` process. It runs one job at a time,
+// forking a fresh compiler for each one, and keeps the tokens of the
+// system headers cached across jobs.
+type worker struct {
+	cmd    *exec.Cmd
+	stdin  io.WriteCloser
+	stdout *bufio.Reader
 }
 
-// countASTNodes recursively counts objects with a "kind" field.
-func countASTNodes(v interface{}) int {
-	count := 0
-	switch val := v.(type) {
-	case map[string]interface{}:
-		if _, ok := val["kind"]; ok {
-			count++
-		}
-		for _, child := range val {
-			count += countASTNodes(child)
-		}
-	case []interface{}:
-		for _, item := range val {
-			count += countASTNodes(item)
+// pool holds the idle workers. A nil entry is a worker that died and
+// is restarted when it is taken.
+var pool chan *worker
+
+func startWorker() (*worker, error) {
+	cmd := exec.Command(chibiccBin, "--serve")
+	stdin, err := cmd.StdinPipe()
+	if err != nil {
+		return nil, err
+	}
+	stdout, err := cmd.StdoutPipe()
+	if err != nil {
+		return nil, err
+	}
+	cmd.Stderr = os.Stderr
+	if err := cmd.Start(); err != nil {
+		return nil, err
+	}
+	return &worker{cmd: cmd, stdin: stdin, stdout: bufio.NewReader(stdout)}, nil
+}
+
+func (w *worker) kill() {
+	w.cmd.Process.Kill()
+	w.cmd.Wait()
+}
+
+func startPool(n int) error {
+	pool = make(chan *worker, n)
+	for i := 0; i < n; i++ {
+		w, err := startWorker()
+		if err != nil {
+			return err
 		}
+		pool <- w
 	}
-	return count
+	return nil
 }
 
-// countFunctionsAndGlobals counts top-level entries in the AST.
-func countFunctionsAndGlobals(astObj map[string]interface{}) (functions, globals int) {
-	globalsList, ok := astObj["globals"]
-	if !ok {
-		return
+// run sends a job to the worker and waits for its result. The job
+// frame is the NUL-terminated arguments, an empty argument and the
+// source text. The stdout of the job is copied to out as the worker
+// forwards it.
+func (w *worker) run(src string, args []string, out io.Writer) (status int, stderr string, err error) {
+	var frame strings.Builder
+	for _, arg := range args {
+		frame.WriteString(arg)
+		frame.WriteByte(0)
 	}
-	arr, ok := globalsList.([]interface{})
-	if !ok {
+	frame.WriteByte(0)
+	frame.WriteString(src)
+	if _, err = fmt.Fprintf(w.stdin, "%d\n%s", frame.Len(), frame.String()); err != nil {
 		return
 	}
-	for _, item := range arr {
-		obj, ok := item.(map[string]interface{})
-		if !ok {
+
+	for {
+		var line string
+		if line, err = w.stdout.ReadString('\n'); err != nil {
+			return
+		}
+		if n, ok := strings.CutPrefix(line, "+"); ok {
+			var outLen int64
+			if outLen, err = strconv.ParseInt(strings.TrimSuffix(n, "\n"), 10, 64); err != nil {
+				return
+			}
+			if _, err = io.CopyN(out, w.stdout, outLen); err != nil {
+				return
+			}
 			continue
 		}
-		isFunc, _ := obj["is_function"].(bool)
-		if isFunc {
-			functions++
-		} else {
-			globals++
+
+		var errLen int
+		if _, err = fmt.Sscanf(line, "%d %d\n", &status, &errLen); err != nil {
+			return
+		}
+		buf := make([]byte, errLen)
+		if _, err = io.ReadFull(w.stdout, buf); err != nil {
+			return
+		}
+		return status, string(buf), nil
+	}
+}
+
+// exitError is returned by runJob if chibicc rejected the code.
+type exitError struct {
+	status int
+}
+
+func (e *exitError) Error() string {
+	return fmt.Sprintf("exit status %d", e.status)
+}
+
+// takeWorker waits for an idle worker and returns it with the time
+// it waited.
+func takeWorker(ctx context.Context) (*worker, time.Duration, error) {
+	start := time.Now()
+	var w *worker
+	select {
+	case w = <-pool:
+	case <-ctx.Done():
+		return nil, time.Since(start), ctx.Err()
+	}
+	wait := time.Since(start)
+	if w == nil {
+		var err error
+		if w, err = startWorker(); err != nil {
+			pool <- nil
+			return nil, wait, err
+		}
+	}
+	return w, wait, nil
+}
+
+// runJob compiles src as input.c on w, which it puts back into the
+// pool, with the given -cc1 arguments. It copies stdout to out as the
+// job writes it and returns stderr and error. A worker that times out
+// or fails is killed and replaced.
+func runJob(ctx context.Context, w *worker, out io.Writer, src string, args ...string) (string, error) {
+	type result struct {
+		status int
+		stderr string
+		err    error
+	}
+	done := make(chan result, 1)
+	go func() {
+		status, stderr, err := w.run(src, args, out)
+		done <- result{status, stderr, err}
+	}()
+
+	select {
+	case r := <-done:
+		if r.err != nil {
+			w.kill()
+			pool <- nil
+			return "", r.err
+		}
+		pool <- w
+		if r.status != 0 {
+			return r.stderr, &exitError{r.status}
 		}
+		return r.stderr, nil
+	case <-ctx.Done():
+		// Wait for run to return, so that out is not written to after
+		// we have returned.
+		w.kill()
+		<-done
+		pool <- nil
+		return "", ctx.Err()
+	}
+}
+
+func ms(d time.Duration) float64 {
+	return float64(d.Microseconds()) / 1000.0
+}
+
+// truncateTokens returns at most maxTokens elements of a JSON array of
+// tokens and the length of the array. The client shows only that many,
+// so there's no point in sending the rest.
+func truncateTokens(raw json.RawMessage) (json.RawMessage, int) {
+	var tokens []json.RawMessage
+	if json.Unmarshal(raw, &tokens) != nil {
+		return raw, 0
+	}
+	if len(tokens) <= maxTokens {
+		return raw, len(tokens)
+	}
+	out, err := json.Marshal(tokens[:maxTokens])
+	if err != nil {
+		return raw, len(tokens)
+	}
+	return out, len(tokens)
+}
+
+// lineWriter calls line with each line written to it, without the
+// newline.
+type lineWriter struct {
+	buf  []byte
+	line func([]byte)
+}
+
+func (lw *lineWriter) Write(p []byte) (int, error) {
+	lw.buf = append(lw.buf, p...)
+	for {
+		i := bytes.IndexByte(lw.buf, '\n')
+		if i < 0 {
+			return len(p), nil
+		}
+		lw.line(lw.buf[:i])
+		lw.buf = lw.buf[i+1:]
 	}
-	return
 }
 
 // --- Compile handler ---
 
-func handleCompile(w http.ResponseWriter, r *http.Request) {
+var (
+	chibiccVersion string
+	cache          *resultCache
+
+	// sources maps AST keys to code.
+	sources *resultCache
+)
+
+// readCompileRequest checks and decodes a compile request. If it fails,
+// it writes the error response and returns false.
+func readCompileRequest(w http.ResponseWriter, r *http.Request) (CompileRequest, bool) {
+	var req CompileRequest
 	if r.Method != http.MethodPost {
 		http.Error(w, "method not allowed", http.StatusMethodNotAllowed)
-		return
+		return req, false
+	}
+
+	if !allowClient(clientAddr(r)) {
+		w.Header().Set("Retry-After", "1")
+		http.Error(w, "too many requests", http.StatusTooManyRequests)
+		return req, false
 	}
 
-	var req CompileRequest
 	if err := json.NewDecoder(r.Body).Decode(&req); err != nil {
 		http.Error(w, "invalid JSON: "+err.Error(), http.StatusBadRequest)
-		return
+		return req, false
 	}
 	if req.Code == "" {
 		http.Error(w, "empty code", http.StatusBadRequest)
-		return
+		return req, false
 	}
+	return req, true
+}
 
-	// Create temp directory for this compilation.
-	tmpDir, err := os.MkdirTemp("", "chibicc-explorer-*")
-	if err != nil {
-		http.Error(w, "failed to create temp dir", http.StatusInternalServerError)
+func handleCompile(w http.ResponseWriter, r *http.Request) {
+	req, ok := readCompileRequest(w, r)
+	if !ok {
 		return
 	}
-	defer os.RemoveAll(tmpDir)
 
-	srcFile := filepath.Join(tmpDir, "input.c")
-	if err := os.WriteFile(srcFile, []byte(req.Code), 0644); err != nil {
-		http.Error(w, "failed to write temp file", http.StatusInternalServerError)
-		return
+	// Cached results don't need a worker, so they are served even if
+	// the queue is full.
+	key := cacheKey(chibiccVersion, req.Code)
+	sources.get(key, func() ([]byte, bool) { return []byte(req.Code), true })
+	body, hit := cache.lookup(key)
+	if !hit {
+		if !enterQueue() {
+			w.Header().Set("Retry-After", "1")
+			http.Error(w, "server is busy", http.StatusServiceUnavailable)
+			return
+		}
+		hit = true
+		body, _ = cache.stream(r.Context(), key, func(ctx context.Context, publish func([]byte)) ([]byte, bool) {
+			hit = false
+			return compile(ctx, key, req.Code, publish)
+		}, nil)
+		leaveQueue()
+		if body == nil {
+			return
+		}
 	}
 
-	resp := CompileResponse{
+	w.Header().Set("Content-Type", "application/json")
+	w.Header().Set("Access-Control-Allow-Origin", "*")
+	if hit {
+		w.Header().Set("X-Cache", "HIT")
+	} else {
+		w.Header().Set("X-Cache", "MISS")
+	}
+	w.Write(body)
+}
+
+func newCompileResponse(key string) CompileResponse {
+	return CompileResponse{
 		Tokens: json.RawMessage("null"),
 		AST:    json.RawMessage("null"),
 		Stages: make(map[string]*StageStats),
+		ASTKey: key,
 	}
+}
 
-	var errors []string
+// encodeResponse combines the errors into resp and encodes it.
+// It also returns whether the response may be cached.
+func encodeResponse(resp *CompileResponse, errors []string) ([]byte, bool) {
+	if len(errors) > 0 {
+		combined := strings.Join(errors, "\n")
+		resp.Error = &combined
+	}
 
-	// Stage 1: Tokenize (--dump-tokens)
-	{
-		ctx, cancel := context.WithTimeout(context.Background(), cmdTimeout)
-		defer cancel()
-		start := time.Now()
-		stdout, stderr, err := runCmd(ctx, chibiccBin,
-			"--dump-tokens", "-cc1", "-cc1-input", srcFile, "-cc1-output", "/dev/null", srcFile)
-		elapsed := time.Since(start)
+	body, err := json.Marshal(resp)
+	if err != nil {
+		body, _ = json.Marshal(map[string]string{"error": err.Error()})
+		return append(body, '\n'), false
+	}
+	return append(body, '\n'), !resp.transient
+}
 
-		stats := &StageStats{TimeMs: float64(elapsed.Microseconds()) / 1000.0}
-		if err != nil {
-			msg := fmt.Sprintf("tokenize: %s", strings.TrimSpace(stderr))
-			if msg == "tokenize: " {
-				msg = fmt.Sprintf("tokenize: %v", err)
-			}
-			errors = append(errors, msg)
-		} else {
-			// stdout has the JSON token array
-			var tokens []interface{}
-			if jsonErr := json.Unmarshal([]byte(stdout), &tokens); jsonErr == nil {
-				stats.Count = len(tokens)
-				resp.Tokens = json.RawMessage(stdout)
-			} else {
-				// Maybe it's valid JSON but not an array; store raw
-				resp.Tokens = json.RawMessage(stdout)
-			}
-		}
-		resp.Stages["tokenize"] = stats
+// compile runs all stages on code in a single chibicc job, which
+// writes the result of each stage as a line of JSON as soon as it is
+// done. Each is passed to publish as a line of the output of
+// /api/compile/stream as it is read, and a line with the error is
+// passed for the stage that failed, if any. compile returns the JSON
+// response and whether it may be cached.
+func compile(ctx context.Context, key, code string, publish func([]byte)) ([]byte, bool) {
+	resp := newCompileResponse(key)
+	send := func(res StageResult) {
+		line, _ := json.Marshal(res)
+		publish(append(line, '\n'))
 	}
 
-	// Stage 2: Preprocess (-E)
-	{
-		ctx, cancel := context.WithTimeout(context.Background(), cmdTimeout)
-		defer cancel()
-		start := time.Now()
-		stdout, stderr, err := runCmd(ctx, chibiccBin,
-			"-E", "-cc1", "-cc1-input", srcFile, "-cc1-output", "/dev/stdout", srcFile)
-		elapsed := time.Since(start)
+	ctx, cancel := context.WithTimeout(ctx, cmdTimeout)
+	defer cancel()
+	w, wait, err := takeWorker(ctx)
+	if err != nil {
+		resp.fail(err)
+		return encodeResponse(&resp, []string{err.Error()})
+	}
 
-		stats := &StageStats{TimeMs: float64(elapsed.Microseconds()) / 1000.0}
-		if err != nil {
-			msg := fmt.Sprintf("preprocess: %s", strings.TrimSpace(stderr))
-			if msg == "preprocess: " {
-				msg = fmt.Sprintf("preprocess: %v", err)
-			}
-			errors = append(errors, msg)
-		} else {
-			resp.Preprocessed = stdout
-			stats.Lines = len(strings.Split(strings.TrimRight(stdout, "\n"), "\n"))
+	// The stages come in the order of stageNames, and the first one
+	// that is missing is the one that failed.
+	next := 0
+	var invalid error
+	out := &lineWriter{line: func(line []byte) {
+		var res StageResult
+		if invalid != nil {
+			return
+		}
+		if err := json.Unmarshal(line, &res); err != nil || res.Stats == nil {
+			invalid = fmt.Errorf("invalid output: %q", line)
+			return
+		}
+		res.Stats.QueueMs = ms(wait)
+		switch res.Stage {
+		case "tokenize":
+			res.Tokens, _ = truncateTokens(res.Tokens)
+			resp.Tokens = res.Tokens
+		case "preprocess":
+			resp.Preprocessed = res.Preprocessed
+		case "parse":
+			resp.AST = res.AST
+		case "codegen":
+			resp.Assembly = res.Assembly
 		}
-		resp.Stages["preprocess"] = stats
+		resp.Stages[res.Stage] = res.Stats
+		next++
+		send(res)
+	}}
+
+	stderr, err := runJob(ctx, w, out, code,
+		"--emit-all-json", astDepthArg, "-cc1-input", srcFile, "-cc1-output", "/dev/null", srcFile)
+	if err == nil {
+		err = invalid
+	}
+	if err == nil {
+		return encodeResponse(&resp, nil)
 	}
 
-	// Stage 3: Parse / AST (--dump-ast)
-	{
-		ctx, cancel := context.WithTimeout(context.Background(), cmdTimeout)
-		defer cancel()
-		start := time.Now()
-		stdout, stderr, err := runCmd(ctx, chibiccBin,
-			"--dump-ast", "-cc1", "-cc1-input", srcFile, "-cc1-output", "/dev/null", srcFile)
-		elapsed := time.Since(start)
+	resp.fail(err)
+	msg := strings.TrimSpace(stderr)
+	if msg == "" {
+		msg = err.Error()
+	}
+	stage := stageNames[len(stageNames)-1]
+	if next < len(stageNames) {
+		stage = stageNames[next]
+	}
+	msg = fmt.Sprintf("%s: %s", stage, msg)
+	send(StageResult{Stage: stage, Error: &msg})
+	return encodeResponse(&resp, []string{msg})
+}
 
-		stats := &StageStats{TimeMs: float64(elapsed.Microseconds()) / 1000.0}
-		if err != nil {
-			msg := fmt.Sprintf("parse: %s", strings.TrimSpace(stderr))
-			if msg == "parse: " {
-				msg = fmt.Sprintf("parse: %v", err)
-			}
-			errors = append(errors, msg)
-		} else {
-			var astObj map[string]interface{}
-			if jsonErr := json.Unmarshal([]byte(stdout), &astObj); jsonErr == nil {
-				functions, globals := countFunctionsAndGlobals(astObj)
-				stats.Functions = functions
-				stats.Globals = globals
-				stats.Nodes = countASTNodes(astObj)
-				resp.AST = json.RawMessage(stdout)
-			} else {
-				// Store raw even if we can't parse
-				resp.AST = json.RawMessage(stdout)
-			}
+// StageResult is a line of the output of /api/compile/stream: the
+// result of a stage, or a final line of stage "done" with the combined
+// error and the AST key.
+type StageResult struct {
+	Stage        string          `json:"stage"`
+	Tokens       json.RawMessage `json:"tokens,omitempty"`
+	Preprocessed string          `json:"preprocessed,omitempty"`
+	AST          json.RawMessage `json:"ast,omitempty"`
+	Assembly     string          `json:"assembly,omitempty"`
+	Stats        *StageStats     `json:"stats,omitempty"`
+	Error        *string         `json:"error,omitempty"`
+	ASTKey       string          `json:"ast_key,omitempty"`
+}
+
+func stageResult(resp *CompileResponse, stage, errMsg string) StageResult {
+	res := StageResult{Stage: stage, Stats: resp.Stages[stage]}
+	if errMsg != "" {
+		res.Error = &errMsg
+	}
+	switch stage {
+	case "tokenize":
+		res.Tokens = resp.Tokens
+	case "preprocess":
+		res.Preprocessed = resp.Preprocessed
+	case "parse":
+		res.AST = resp.AST
+	case "codegen":
+		res.Assembly = resp.Assembly
+	}
+	return res
+}
+
+var stageNames = []string{"tokenize", "preprocess", "parse", "codegen"}
+
+// handleCompileStream serves POST /api/compile/stream. It sends the
+// result of each stage as a line of NDJSON as soon as the compiler has
+// written it, so that the client can show the tokens while the later
+// stages are still running. Requests for the same code are streamed
+// from the same compilation.
+func handleCompileStream(w http.ResponseWriter, r *http.Request) {
+	req, ok := readCompileRequest(w, r)
+	if !ok {
+		return
+	}
+
+	key := cacheKey(chibiccVersion, req.Code)
+	sources.get(key, func() ([]byte, bool) { return []byte(req.Code), true })
+	body, hit := cache.lookup(key)
+	if !hit && !enterQueue() {
+		w.Header().Set("Retry-After", "1")
+		http.Error(w, "server is busy", http.StatusServiceUnavailable)
+		return
+	}
+
+	w.Header().Set("Content-Type", "application/x-ndjson")
+	w.Header().Set("Access-Control-Allow-Origin", "*")
+	flusher, _ := w.(http.Flusher)
+	write := func(line []byte) bool {
+		if _, err := w.Write(line); err != nil {
+			return false
+		}
+		if flusher != nil {
+			flusher.Flush()
 		}
-		resp.Stages["parse"] = stats
+		return r.Context().Err() == nil
+	}
+	send := func(res StageResult) bool {
+		line, _ := json.Marshal(res)
+		return write(append(line, '\n'))
 	}
 
-	// Stage 4: Codegen (-S)
-	{
-		asmFile := filepath.Join(tmpDir, "output.s")
-		ctx, cancel := context.WithTimeout(context.Background(), cmdTimeout)
-		defer cancel()
-		start := time.Now()
-		_, stderr, err := runCmd(ctx, chibiccBin,
-			"-S", "-o", asmFile, srcFile)
-		elapsed := time.Since(start)
+	if hit {
+		w.Header().Set("X-Cache", "HIT")
+	} else {
+		w.Header().Set("X-Cache", "MISS")
+		body, hit = cache.stream(r.Context(), key, func(ctx context.Context, publish func([]byte)) ([]byte, bool) {
+			return compile(ctx, key, req.Code, publish)
+		}, write)
+		leaveQueue()
+		if body == nil {
+			return
+		}
+	}
 
-		stats := &StageStats{TimeMs: float64(elapsed.Microseconds()) / 1000.0}
-		if err != nil {
-			msg := fmt.Sprintf("codegen: %s", strings.TrimSpace(stderr))
-			if msg == "codegen: " {
-				msg = fmt.Sprintf("codegen: %v", err)
-			}
-			errors = append(errors, msg)
-		} else {
-			asmBytes, readErr := os.ReadFile(asmFile)
-			if readErr == nil {
-				resp.Assembly = string(asmBytes)
-				stats.Lines = len(strings.Split(strings.TrimRight(string(asmBytes), "\n"), "\n"))
-				stats.Bytes = len(asmBytes)
-			} else {
-				errors = append(errors, fmt.Sprintf("codegen: failed to read output: %v", readErr))
+	// A cached response is replayed stage by stage.
+	var resp CompileResponse
+	json.Unmarshal(body, &resp)
+	if hit {
+		for _, stage := range stageNames {
+			if resp.Stages[stage] != nil && !send(stageResult(&resp, stage, "")) {
+				return
 			}
 		}
-		resp.Stages["codegen"] = stats
 	}
+	send(StageResult{Stage: "done", Error: resp.Error, ASTKey: key})
+}
 
-	// Combine errors
-	if len(errors) > 0 {
-		combined := strings.Join(errors, "\n")
-		resp.Error = &combined
+// handleASTChildren serves GET /api/ast/{id}/children?key=<ast_key>.
+// It returns the AST node with the given ID, with its subtree down to
+// astDepth levels, for the client to replace a collapsed node with.
+func handleASTChildren(w http.ResponseWriter, r *http.Request) {
+	if r.Method != http.MethodGet {
+		http.Error(w, "method not allowed", http.StatusMethodNotAllowed)
+		return
+	}
+
+	path := strings.TrimPrefix(r.URL.Path, "/api/ast/")
+	idStr, ok := strings.CutSuffix(path, "/children")
+	id, err := strconv.Atoi(idStr)
+	if !ok || err != nil || id < 0 {
+		http.NotFound(w, r)
+		return
+	}
+
+	if !allowClient(clientAddr(r)) {
+		w.Header().Set("Retry-After", "1")
+		http.Error(w, "too many requests", http.StatusTooManyRequests)
+		return
+	}
+
+	astKey := r.URL.Query().Get("key")
+	code, ok := sources.lookup(astKey)
+	if !ok {
+		http.Error(w, "unknown or expired key", http.StatusNotFound)
+		return
+	}
+
+	key := cacheKey(chibiccVersion, fmt.Sprintf("ast %d\x00%s", id, code))
+	body, hit := cache.lookup(key)
+	if !hit {
+		if !enterQueue() {
+			w.Header().Set("Retry-After", "1")
+			http.Error(w, "server is busy", http.StatusServiceUnavailable)
+			return
+		}
+		body = cache.get(key, func() ([]byte, bool) {
+			ctx, cancel := context.WithTimeout(context.Background(), cmdTimeout)
+			defer cancel()
+			wk, _, err := takeWorker(ctx)
+			if err != nil {
+				msg, _ := json.Marshal(map[string]string{"error": err.Error()})
+				return append(msg, '\n'), false
+			}
+			var stdout bytes.Buffer
+			stderr, err := runJob(ctx, wk, &stdout, string(code), "--dump-ast", astDepthArg,
+				fmt.Sprintf("--dump-ast-node=%d", id), "-cc1-input", srcFile, srcFile)
+			if err != nil {
+				msg, _ := json.Marshal(map[string]string{"error": strings.TrimSpace(stderr)})
+				return append(msg, '\n'), false
+			}
+			return stdout.Bytes(), true
+		})
+		leaveQueue()
 	}
 
 	w.Header().Set("Content-Type", "application/json")
 	w.Header().Set("Access-Control-Allow-Origin", "*")
-	json.NewEncoder(w).Encode(resp)
+	w.Write(body)
 }
 
 func main() {
@@ -278,15 +626,34 @@ func main() {
 		log.Fatalf("chibicc binary not found at %s", chibiccBin)
 	}
 
+	// Cached results are keyed on the binary as well as the code.
+	version, err := binaryVersion(chibiccBin)
+	if err != nil {
+		log.Fatalf("failed to read chibicc binary: %v", err)
+	}
+	chibiccVersion = version
+	cache = newResultCache(cacheEntries)
+	sources = newResultCache(cacheEntries)
+	expvar.Publish("cache", expvar.Func(cache.stats))
+
+	// Each worker compiles one job at a time, so run as many of them
+	// as there are CPUs.
+	if err := startPool(runtime.NumCPU()); err != nil {
+		log.Fatalf("failed to start chibicc workers: %v", err)
+	}
+	startQueue(queuePerWorker * runtime.NumCPU())
+
 	// API endpoint
-	http.HandleFunc("/api/compile", handleCompile)
+	http.Handle("/api/compile", withGzip(http.HandlerFunc(handleCompile)))
+	http.Handle("/api/compile/stream", withGzip(http.HandlerFunc(handleCompileStream)))
+	http.Handle("/api/ast/", withGzip(http.HandlerFunc(handleASTChildren)))
 
 	// Static file server (for index.html, etc.)
 	fs := http.FileServer(http.Dir(staticDir))
 	http.Handle("/", fs)
 
 	log.Printf("chibicc explorer server starting on http://localhost%s", listenAddr)
-	log.Printf("  chibicc binary: %s", chibiccBin)
+	log.Printf("  chibicc binary: %s (%d workers)", chibiccBin, cap(pool))
 	log.Printf("  static files:   %s", staticDir)
 	if err := http.ListenAndServe(listenAddr, nil); err != nil {
 		log.Fatal(err)
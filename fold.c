@@ -0,0 +1,529 @@
+// This file implements a constant folding pass that runs between the
+// parser and the code generators.
+//
+// The parser evaluates constant expressions only where the language
+// requires them, such as array sizes and case labels. Other
+// expressions, e.g. `x * (4 * 1024)` or `sizeof(T) * N`, reach the
+// code generator as trees. This pass replaces constant subexpressions
+// with their values and removes arithmetic identities such as `x + 0`.
+//
+// Values are computed the way the generated code would compute them:
+// integers wrap around at the width of their type, and floating-point
+// results are rounded to their type after each operation. Expressions
+// that would trap or whose result is undefined, such as division by
+// zero or oversized shifts, are left alone.
+
+#include "chibicc.h"
+
+static Node *fold_expr(Node *node);
+
+static bool is_int_const(Node *node) {
+  return node->kind == ND_NUM && node->ty &&
+         (is_integer(node->ty) || node->ty->kind == TY_PTR);
+}
+
+static bool is_flo_const(Node *node) {
+  return node->kind == ND_NUM && node->ty && is_flonum(node->ty);
+}
+
+// Truncates a value to a given integer type and extends it back
+// to 64 bits, as values of that type are represented in ND_NUM.
+static int64_t wrap(Type *ty, uint64_t val) {
+  if (ty->kind == TY_BOOL)
+    return val != 0;
+
+  if (ty->is_unsigned) {
+    switch (ty->size) {
+    case 1: return (uint8_t)val;
+    case 2: return (uint16_t)val;
+    case 4: return (uint32_t)val;
+    }
+    return val;
+  }
+
+  switch (ty->size) {
+  case 1: return (int8_t)val;
+  case 2: return (int16_t)val;
+  case 4: return (int32_t)val;
+  }
+  return val;
+}
+
+// Returns the value of an integer constant. The parser doesn't always
+// truncate ND_NUM values to their type, e.g. U'\xffffffff' may be
+// stored as -1, so we normalize them here.
+static int64_t int_val(Node *node) {
+  return wrap(node->ty, node->val);
+}
+
+static long double round_flo(Type *ty, long double val) {
+  if (ty->kind == TY_FLOAT)
+    return (float)val;
+  if (ty->kind == TY_DOUBLE)
+    return (double)val;
+  return val;
+}
+
+static Node *new_int(Node *orig, int64_t val) {
+  Node *node = new_node(ND_NUM, orig->tok);
+  node->ty = orig->ty;
+  node->val = wrap(orig->ty, val);
+  return node;
+}
+
+static Node *new_flo(Node *orig, long double val) {
+  Node *node = new_node(ND_NUM, orig->tok);
+  node->ty = orig->ty;
+  node->fval = round_flo(orig->ty, val);
+  return node;
+}
+
+// Returns true if two types are integer types with the same
+// representation, so that a value of one can stand for the other.
+static bool same_int_repr(Type *t1, Type *t2) {
+  return is_integer(t1) && is_integer(t2) && t1->size == t2->size &&
+         t1->is_unsigned == t2->is_unsigned &&
+         (t1->kind == TY_BOOL) == (t2->kind == TY_BOOL);
+}
+
+// Returns true if evaluating a given expression has no effect other
+// than computing its value, so that it can be dropped.
+static bool is_pure(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return true;
+  case ND_CAST:
+  case ND_NEG:
+  case ND_NOT:
+  case ND_BITNOT:
+    return is_pure(node->lhs);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return is_pure(node->lhs) && is_pure(node->rhs);
+  }
+  return false;
+}
+
+// Converts a floating-point value to an integer type. Returns false
+// if the value is out of range, in which case the conversion is
+// undefined.
+static bool flo_to_int(Type *ty, long double f, int64_t *val) {
+  if (ty->kind == TY_BOOL) {
+    *val = (f != 0);
+    return true;
+  }
+
+  long double half = (long double)(1UL << (ty->size * 8 - 1));
+  long double lo = ty->is_unsigned ? -1 : -half - 1;
+  long double hi = ty->is_unsigned ? half * 2 : half;
+
+  // This also rejects NaN.
+  if (!(lo < f && f < hi))
+    return false;
+
+  // Values above INT64_MAX are converted by subtracting 2^63 first
+  // so that we don't depend on the host's conversion to unsigned long.
+  if (ty->is_unsigned && f >= (long double)(1UL << 63))
+    *val = (int64_t)(f - (long double)(1UL << 63)) + (1UL << 63);
+  else if (ty->is_unsigned)
+    *val = (uint64_t)f;
+  else
+    *val = (int64_t)f;
+  return true;
+}
+
+static long double int_to_flo(Type *to, Type *from, int64_t val) {
+  bool u = from->is_unsigned && from->size == 8;
+
+  switch (to->kind) {
+  case TY_FLOAT:
+    return u ? (float)(uint64_t)val : (float)val;
+  case TY_DOUBLE:
+    return u ? (double)(uint64_t)val : (double)val;
+  }
+  return u ? (long double)(uint64_t)val : (long double)val;
+}
+
+static Node *fold_cast(Node *node) {
+  Node *lhs = node->lhs;
+  Type *ty = node->ty;
+  bool to_int = is_integer(ty) || ty->kind == TY_PTR;
+
+  if (is_int_const(lhs)) {
+    if (to_int)
+      return new_int(node, int_val(lhs));
+    if (is_flonum(ty))
+      return new_flo(node, int_to_flo(ty, lhs->ty, int_val(lhs)));
+    return node;
+  }
+
+  if (is_flo_const(lhs)) {
+    int64_t val;
+    if (to_int && ty->kind != TY_PTR && flo_to_int(ty, lhs->fval, &val))
+      return new_int(node, val);
+    if (is_flonum(ty))
+      return new_flo(node, lhs->fval);
+    return node;
+  }
+
+  // Remove a cast that doesn't change the representation of a value,
+  // such as the int-to-int casts inserted by the usual arithmetic
+  // conversion. The cast made by __builtin_expect is kept for its hint.
+  if (lhs->ty && same_int_repr(lhs->ty, ty) && !node->expect)
+    return lhs;
+  return node;
+}
+
+static Node *fold_unary(Node *node) {
+  Node *lhs = node->lhs;
+
+  if (is_int_const(lhs)) {
+    switch (node->kind) {
+    case ND_NEG:
+      return new_int(node, -(uint64_t)int_val(lhs));
+    case ND_NOT:
+      return new_int(node, !int_val(lhs));
+    case ND_BITNOT:
+      // The parser doesn't promote the operand of `~`, but the
+      // generated code computes it in a 32-bit register, so we
+      // leave small types alone.
+      if (node->ty->size < 4)
+        return node;
+      return new_int(node, ~int_val(lhs));
+    }
+  }
+
+  if (is_flo_const(lhs)) {
+    switch (node->kind) {
+    case ND_NEG:
+      return new_flo(node, -lhs->fval);
+    case ND_NOT:
+      return new_int(node, !lhs->fval);
+    }
+  }
+  return node;
+}
+
+// Evaluates an integer binary operator. Returns false if the
+// operation must be left to the runtime.
+static bool eval_int(Node *node, int64_t *res) {
+  Type *ty = node->lhs->ty;
+  int64_t a = int_val(node->lhs);
+  int64_t b = int_val(node->rhs);
+  int bits = ty->size * 8;
+  int64_t min = wrap(ty, 1UL << (bits - 1));
+
+  switch (node->kind) {
+  case ND_ADD: *res = (uint64_t)a + b; return true;
+  case ND_SUB: *res = (uint64_t)a - b; return true;
+  case ND_MUL: *res = (uint64_t)a * b; return true;
+  case ND_BITAND: *res = a & b; return true;
+  case ND_BITOR: *res = a | b; return true;
+  case ND_BITXOR: *res = a ^ b; return true;
+  case ND_DIV:
+  case ND_MOD:
+    if (b == 0)
+      return false;
+    if (ty->is_unsigned) {
+      *res = (node->kind == ND_DIV) ? (uint64_t)a / b : (uint64_t)a % b;
+      return true;
+    }
+    if (a == min && b == -1)
+      return false;
+    *res = (node->kind == ND_DIV) ? a / b : a % b;
+    return true;
+  case ND_SHL:
+  case ND_SHR:
+    // See the comment for ND_BITNOT.
+    if (bits < 32 || b < 0 || b >= bits)
+      return false;
+    if (node->kind == ND_SHL)
+      *res = (uint64_t)a << b;
+    else if (ty->is_unsigned)
+      *res = (uint64_t)a >> b;
+    else
+      *res = a >> b;
+    return true;
+  case ND_EQ: *res = (a == b); return true;
+  case ND_NE: *res = (a != b); return true;
+  case ND_LT:
+    *res = ty->is_unsigned ? (uint64_t)a < b : a < b;
+    return true;
+  case ND_LE:
+    *res = ty->is_unsigned ? (uint64_t)a <= b : a <= b;
+    return true;
+  case ND_LOGAND: *res = a && b; return true;
+  case ND_LOGOR: *res = a || b; return true;
+  }
+  return false;
+}
+
+// Evaluates a floating-point arithmetic operator in the precision
+// of a given type.
+static bool eval_flo(NodeKind kind, Type *ty, long double x, long double y,
+                     long double *res) {
+  if (ty->kind == TY_FLOAT) {
+    float a = x, b = y;
+    switch (kind) {
+    case ND_ADD: *res = a + b; return true;
+    case ND_SUB: *res = a - b; return true;
+    case ND_MUL: *res = a * b; return true;
+    case ND_DIV: *res = a / b; return true;
+    }
+    return false;
+  }
+
+  if (ty->kind == TY_DOUBLE) {
+    double a = x, b = y;
+    switch (kind) {
+    case ND_ADD: *res = a + b; return true;
+    case ND_SUB: *res = a - b; return true;
+    case ND_MUL: *res = a * b; return true;
+    case ND_DIV: *res = a / b; return true;
+    }
+    return false;
+  }
+
+  switch (kind) {
+  case ND_ADD: *res = x + y; return true;
+  case ND_SUB: *res = x - y; return true;
+  case ND_MUL: *res = x * y; return true;
+  case ND_DIV: *res = x / y; return true;
+  }
+  return false;
+}
+
+static Node *fold_flo_binary(Node *node) {
+  long double x = node->lhs->fval;
+  long double y = node->rhs->fval;
+
+  switch (node->kind) {
+  case ND_EQ: return new_int(node, x == y);
+  case ND_NE: return new_int(node, x != y);
+  case ND_LT: return new_int(node, x < y);
+  case ND_LE: return new_int(node, x <= y);
+  }
+
+  long double res;
+  if (eval_flo(node->kind, node->ty, x, y, &res))
+    return new_flo(node, res);
+  return node;
+}
+
+// Simplifies `x op c` or `c op x` where `c` is a constant.
+static Node *fold_identity(Node *node) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  bool lc = is_int_const(lhs);
+  bool rc = is_int_const(rhs);
+  if (lc == rc || (!is_integer(node->ty) && node->ty->kind != TY_PTR))
+    return node;
+
+  Node *x = lc ? rhs : lhs;
+  int64_t c = int_val(lc ? lhs : rhs);
+  if (x->ty != node->ty && !same_int_repr(x->ty, node->ty))
+    return node;
+
+  bool commutative = false;
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_MUL:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+    commutative = true;
+  }
+  if (lc && !commutative)
+    return node;
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+    if (c == 0)
+      return x;
+    break;
+  case ND_MUL:
+    if (c == 1)
+      return x;
+    if (c == 0 && is_pure(x))
+      return new_int(node, 0);
+    break;
+  case ND_DIV:
+    if (c == 1)
+      return x;
+    break;
+  case ND_BITAND:
+    if (c == wrap(node->ty, -1))
+      return x;
+    if (c == 0 && is_pure(x))
+      return new_int(node, 0);
+    break;
+  }
+  return node;
+}
+
+static Node *fold_binary(Node *node) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+
+  if (is_int_const(lhs) && is_int_const(rhs)) {
+    int64_t val;
+    if (eval_int(node, &val))
+      return new_int(node, val);
+    return node;
+  }
+
+  if (is_flo_const(lhs) && is_flo_const(rhs))
+    return fold_flo_binary(node);
+
+  return fold_identity(node);
+}
+
+// Returns 1 or 0 if a given node is a constant that is true
+// or false, respectively. Otherwise, returns -1.
+static int const_truth(Node *node) {
+  if (is_int_const(node))
+    return int_val(node) != 0;
+  if (is_flo_const(node))
+    return node->fval != 0;
+  return -1;
+}
+
+static Node *fold_logical(Node *node) {
+  int l = const_truth(node->lhs);
+  int r = const_truth(node->rhs);
+
+  // `0 && x` and `1 || x` don't evaluate `x`.
+  if (node->kind == ND_LOGAND && l == 0)
+    return new_int(node, 0);
+  if (node->kind == ND_LOGOR && l == 1)
+    return new_int(node, 1);
+
+  if (l != -1 && r != -1)
+    return new_int(node, node->kind == ND_LOGAND ? (l && r) : (l || r));
+  return node;
+}
+
+static void fold_list(Node **list) {
+  for (Node **p = list; *p;) {
+    Node *next = (*p)->next;
+    *p = fold_expr(*p);
+    (*p)->next = next;
+    p = &(*p)->next;
+  }
+}
+
+// strlen() of a string literal is a constant. The contents of other
+// arrays may change at runtime.
+static Node *fold_strlen(Node *node) {
+  Node *arg = node->args;
+  if (arg->kind == ND_CAST)
+    arg = arg->lhs;
+
+  if (arg->kind != ND_VAR || arg->tok->kind != TK_STR || !is_integer(node->ty) ||
+      arg->ty->kind != TY_ARRAY || arg->ty->base->size != 1)
+    return node;
+  return new_int(node, strnlen(arg->var->init_data, arg->ty->size));
+}
+
+static Node *fold_expr(Node *node) {
+  if (!node)
+    return NULL;
+
+  node->lhs = fold_expr(node->lhs);
+  node->rhs = fold_expr(node->rhs);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    node->cond = fold_expr(node->cond);
+    node->then = fold_expr(node->then);
+    node->els = fold_expr(node->els);
+    node->init = fold_expr(node->init);
+    node->inc = fold_expr(node->inc);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    fold_list(&node->body);
+    break;
+  case ND_FUNCALL:
+    fold_list(&node->args);
+    break;
+  case ND_CAS:
+    node->cas_addr = fold_expr(node->cas_addr);
+    node->cas_old = fold_expr(node->cas_old);
+    node->cas_new = fold_expr(node->cas_new);
+    break;
+  }
+
+  if (!node->ty)
+    return node;
+
+  switch (node->kind) {
+  case ND_CAST:
+    return fold_cast(node);
+  case ND_NEG:
+  case ND_NOT:
+  case ND_BITNOT:
+    return fold_unary(node);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return fold_binary(node);
+  case ND_LOGAND:
+  case ND_LOGOR:
+    return fold_logical(node);
+  case ND_COND: {
+    int c = const_truth(node->cond);
+    if (c == -1 || !(is_numeric(node->ty) || node->ty->kind == TY_PTR))
+      return node;
+    return c ? node->then : node->els;
+  }
+  case ND_COMMA:
+    if (node->lhs->kind == ND_NUM || node->lhs->kind == ND_NULL_EXPR)
+      return node->rhs;
+    return node;
+  case ND_FUNCALL:
+    if (is_builtin_call(node, "strlen", 1))
+      return fold_strlen(node);
+    return node;
+  }
+  return node;
+}
+
+void fold_function(Obj *fn) {
+  fn->body = fold_expr(fn->body);
+}
+
+void fold(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      fold_function(fn);
+}
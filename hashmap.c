@@ -14,17 +14,35 @@
 // Represents a deleted hash entry
 #define TOMBSTONE ((void *)-1)
 
-static uint64_t fnv_hash(char *s, int len) {
-  uint64_t hash = 0xcbf29ce484222325;
-  for (int i = 0; i < len; i++) {
-    hash *= 0x100000001b3;
-    hash ^= (unsigned char)s[i];
+// Hashes a key a word at a time. Each word is mixed in with a
+// multiplication, and the final mix makes the low bits, which are used
+// as a bucket index, depend on all the others.
+static uint64_t hash_key(char *s, int len) {
+  uint64_t k = 0x517cc1b727220a95;
+  uint64_t hash = len * k;
+  uint64_t w;
+
+  for (; len >= 8; s += 8, len -= 8) {
+    memcpy(&w, s, 8);
+    hash = ((hash << 5 | hash >> 59) ^ w) * k;
   }
+
+  if (len > 0) {
+    w = 0;
+    for (int i = 0; i < len; i++)
+      w |= (uint64_t)(unsigned char)s[i] << (i * 8);
+    hash = ((hash << 5 | hash >> 59) ^ w) * k;
+  }
+
+  hash ^= hash >> 32;
+  hash *= 0xd6e8feb86659fd93;
+  hash ^= hash >> 32;
   return hash;
 }
 
 // Make room for new entires in a given hashmap by removing
-// tombstones and possibly extending the bucket size.
+// tombstones and possibly extending the bucket size. The bucket size
+// is always a power of two, so that a hash can be masked to an index.
 static void rehash(HashMap *map) {
   // Compute the size of the new hashmap.
   int nkeys = 0;
@@ -37,23 +55,28 @@ static void rehash(HashMap *map) {
     cap = cap * 2;
   assert(cap > 0);
 
-  // Create a new hashmap and copy all key-values.
-  HashMap map2 = {};
-  map2.buckets = calloc(cap, sizeof(HashEntry));
-  map2.capacity = cap;
+  // Move all key-values to new buckets. The hashes are kept in the
+  // entries, so the keys don't need to be hashed again.
+  HashEntry *buckets = calloc(cap, sizeof(HashEntry));
 
   for (int i = 0; i < map->capacity; i++) {
     HashEntry *ent = &map->buckets[i];
-    if (ent->key && ent->key != TOMBSTONE)
-      hashmap_put2(&map2, ent->key, ent->keylen, ent->val);
+    if (!ent->key || ent->key == TOMBSTONE)
+      continue;
+
+    uint64_t j = ent->hash;
+    while (buckets[j & (cap - 1)].key)
+      j++;
+    buckets[j & (cap - 1)] = *ent;
   }
 
-  assert(map2.used == nkeys);
-  *map = map2;
+  map->buckets = buckets;
+  map->capacity = cap;
+  map->used = nkeys;
 }
 
-static bool match(HashEntry *ent, char *key, int keylen) {
-  return ent->key && ent->key != TOMBSTONE &&
+static bool match(HashEntry *ent, uint64_t hash, char *key, int keylen) {
+  return ent->hash == hash && ent->key && ent->key != TOMBSTONE &&
          ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0;
 }
 
@@ -61,11 +84,12 @@ static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
   if (!map->buckets)
     return NULL;
 
-  uint64_t hash = fnv_hash(key, keylen);
+  uint64_t hash = hash_key(key, keylen);
+  uint64_t mask = map->capacity - 1;
 
-  for (int i = 0; i < map->capacity; i++) {
-    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
-    if (match(ent, key, keylen))
+  for (uint64_t i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) & mask];
+    if (match(ent, hash, key, keylen))
       return ent;
     if (ent->key == NULL)
       return NULL;
@@ -81,23 +105,26 @@ static HashEntry *get_or_insert_entry(HashMap *map, char *key, int keylen) {
     rehash(map);
   }
 
-  uint64_t hash = fnv_hash(key, keylen);
+  uint64_t hash = hash_key(key, keylen);
+  uint64_t mask = map->capacity - 1;
 
-  for (int i = 0; i < map->capacity; i++) {
-    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+  for (uint64_t i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) & mask];
 
-    if (match(ent, key, keylen))
+    if (match(ent, hash, key, keylen))
       return ent;
 
     if (ent->key == TOMBSTONE) {
       ent->key = key;
       ent->keylen = keylen;
+      ent->hash = hash;
       return ent;
     }
 
     if (ent->key == NULL) {
       ent->key = key;
       ent->keylen = keylen;
+      ent->hash = hash;
       map->used++;
       return ent;
     }
@@ -133,6 +160,52 @@ void hashmap_delete2(HashMap *map, char *key, int keylen) {
     ent->key = TOMBSTONE;
 }
 
+// Returns the next live entry at or after `*idx`, or NULL if there
+// are no more entries. `*idx` should be initialized with 0.
+HashEntry *hashmap_next(HashMap *map, int *idx) {
+  while (*idx < map->capacity) {
+    HashEntry *ent = &map->buckets[(*idx)++];
+    if (ent->key && ent->key != TOMBSTONE)
+      return ent;
+  }
+  return NULL;
+}
+
+// A microbenchmark with identifier-like keys, which is what the
+// compiler mostly looks up.
+static void hashmap_bench(void) {
+  enum { NKEYS = 20000, ROUNDS = 20 };
+  char **keys = calloc(NKEYS, sizeof(char *));
+  char **misses = calloc(NKEYS, sizeof(char *));
+  char *prefixes[] = {"", "x", "__builtin_", "pthread_mutex_", "SIZE_"};
+  for (int i = 0; i < NKEYS; i++) {
+    keys[i] = format("%s%d", prefixes[i % 5], i);
+    misses[i] = format("%s%d_", prefixes[i % 5], i);
+  }
+
+  HashMap map = {};
+  double start = now_ms();
+  for (int i = 0; i < NKEYS; i++)
+    hashmap_put(&map, keys[i], keys[i]);
+  double put = now_ms() - start;
+
+  start = now_ms();
+  for (int r = 0; r < ROUNDS; r++)
+    for (int i = 0; i < NKEYS; i++)
+      assert(hashmap_get(&map, keys[i]) == keys[i]);
+  double get = now_ms() - start;
+
+  start = now_ms();
+  for (int r = 0; r < ROUNDS; r++)
+    for (int i = 0; i < NKEYS; i++)
+      assert(hashmap_get(&map, misses[i]) == NULL);
+  double miss = now_ms() - start;
+
+  printf("hashmap: put %.1f ns, get %.1f ns, miss %.1f ns\n",
+         put * 1e6 / NKEYS, get * 1e6 / (NKEYS * ROUNDS),
+         miss * 1e6 / (NKEYS * ROUNDS));
+}
+
 void hashmap_test(void) {
   HashMap *map = calloc(1, sizeof(HashMap));
 
@@ -161,5 +234,7 @@ void hashmap_test(void) {
     hashmap_put(map, format("key %d", i), (void *)(size_t)i);
 
   assert(hashmap_get(map, "no such key") == NULL);
+
+  hashmap_bench();
   printf("OK\n");
 }
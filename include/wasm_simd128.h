@@ -0,0 +1,116 @@
+#ifndef __WASM_SIMD128_H
+#define __WASM_SIMD128_H
+
+// A subset of the clang header of the same name. The types are GCC
+// vectors, so the operators work on them as well as these functions.
+
+typedef int v128_t __attribute((vector_size(16)));
+
+typedef signed char __i8x16 __attribute((vector_size(16)));
+typedef unsigned char __u8x16 __attribute((vector_size(16)));
+typedef short __i16x8 __attribute((vector_size(16)));
+typedef unsigned short __u16x8 __attribute((vector_size(16)));
+typedef int __i32x4 __attribute((vector_size(16)));
+typedef unsigned int __u32x4 __attribute((vector_size(16)));
+typedef long long __i64x2 __attribute((vector_size(16)));
+typedef unsigned long long __u64x2 __attribute((vector_size(16)));
+typedef float __f32x4 __attribute((vector_size(16)));
+typedef double __f64x2 __attribute((vector_size(16)));
+
+static inline v128_t wasm_v128_load(const void *p) { return *(v128_t *)p; }
+static inline void wasm_v128_store(void *p, v128_t a) { *(v128_t *)p = a; }
+
+static inline v128_t wasm_v128_not(v128_t a) { return ~a; }
+static inline v128_t wasm_v128_and(v128_t a, v128_t b) { return a & b; }
+static inline v128_t wasm_v128_or(v128_t a, v128_t b) { return a | b; }
+static inline v128_t wasm_v128_xor(v128_t a, v128_t b) { return a ^ b; }
+static inline v128_t wasm_v128_andnot(v128_t a, v128_t b) { return a & ~b; }
+
+static inline v128_t wasm_i32x4_make(int a, int b, int c, int d) {
+  return (v128_t)(__i32x4){a, b, c, d};
+}
+static inline v128_t wasm_i32x4_splat(int a) {
+  return (v128_t)(__i32x4){a, a, a, a};
+}
+static inline int wasm_i32x4_extract_lane(v128_t a, int i) {
+  return ((__i32x4)a)[i];
+}
+static inline v128_t wasm_f32x4_make(float a, float b, float c, float d) {
+  return (v128_t)(__f32x4){a, b, c, d};
+}
+static inline v128_t wasm_f32x4_splat(float a) {
+  return (v128_t)(__f32x4){a, a, a, a};
+}
+static inline float wasm_f32x4_extract_lane(v128_t a, int i) {
+  return ((__f32x4)a)[i];
+}
+
+#define __WASM_INT_OPS(s, t)                                            \
+  static inline v128_t wasm_##s##_add(v128_t a, v128_t b) {             \
+    return (v128_t)((t)a + (t)b);                                       \
+  }                                                                     \
+  static inline v128_t wasm_##s##_sub(v128_t a, v128_t b) {             \
+    return (v128_t)((t)a - (t)b);                                       \
+  }                                                                     \
+  static inline v128_t wasm_##s##_neg(v128_t a) {                       \
+    return (v128_t)(-(t)a);                                             \
+  }                                                                     \
+  static inline v128_t wasm_##s##_shl(v128_t a, int n) {                \
+    return (v128_t)((t)a << n);                                         \
+  }                                                                     \
+  static inline v128_t wasm_##s##_shr(v128_t a, int n) {                \
+    return (v128_t)((t)a >> n);                                         \
+  }
+
+__WASM_INT_OPS(i8x16, __i8x16)
+__WASM_INT_OPS(i16x8, __i16x8)
+__WASM_INT_OPS(i32x4, __i32x4)
+__WASM_INT_OPS(i64x2, __i64x2)
+
+static inline v128_t wasm_u8x16_shr(v128_t a, int n) {
+  return (v128_t)((__u8x16)a >> n);
+}
+static inline v128_t wasm_u16x8_shr(v128_t a, int n) {
+  return (v128_t)((__u16x8)a >> n);
+}
+static inline v128_t wasm_u32x4_shr(v128_t a, int n) {
+  return (v128_t)((__u32x4)a >> n);
+}
+static inline v128_t wasm_u64x2_shr(v128_t a, int n) {
+  return (v128_t)((__u64x2)a >> n);
+}
+
+static inline v128_t wasm_i16x8_mul(v128_t a, v128_t b) {
+  return (v128_t)((__i16x8)a * (__i16x8)b);
+}
+static inline v128_t wasm_i32x4_mul(v128_t a, v128_t b) {
+  return (v128_t)((__i32x4)a * (__i32x4)b);
+}
+static inline v128_t wasm_i64x2_mul(v128_t a, v128_t b) {
+  return (v128_t)((__i64x2)a * (__i64x2)b);
+}
+
+#define __WASM_FLOAT_OPS(s, t)                                          \
+  static inline v128_t wasm_##s##_add(v128_t a, v128_t b) {             \
+    return (v128_t)((t)a + (t)b);                                       \
+  }                                                                     \
+  static inline v128_t wasm_##s##_sub(v128_t a, v128_t b) {             \
+    return (v128_t)((t)a - (t)b);                                       \
+  }                                                                     \
+  static inline v128_t wasm_##s##_mul(v128_t a, v128_t b) {             \
+    return (v128_t)((t)a * (t)b);                                       \
+  }                                                                     \
+  static inline v128_t wasm_##s##_div(v128_t a, v128_t b) {             \
+    return (v128_t)((t)a / (t)b);                                       \
+  }                                                                     \
+  static inline v128_t wasm_##s##_neg(v128_t a) {                       \
+    return (v128_t)(-(t)a);                                             \
+  }
+
+__WASM_FLOAT_OPS(f32x4, __f32x4)
+__WASM_FLOAT_OPS(f64x2, __f64x2)
+
+#undef __WASM_INT_OPS
+#undef __WASM_FLOAT_OPS
+
+#endif
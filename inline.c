@@ -0,0 +1,479 @@
+// This file implements an inliner that runs after parse() and fold().
+//
+// A call to a small static function is replaced with a copy of the
+// callee's body, so that we don't pay for pushing arguments and
+// shuffling registers. A call `f(x, y)` to a function returning a
+// value becomes a statement expression
+//
+//   ({ p1 = x; p2 = y; S...; e; })
+//
+// where p1 and p2 are fresh copies of f's parameters, S are the
+// statements of f's body and e is the operand of its final `return`.
+// A call to a void function is inlined only if it is an expression
+// statement, in which case it becomes a block.
+//
+// We inline only non-recursive, non-variadic functions whose only
+// `return` is their last statement and whose body is no larger than
+// a fixed number of nodes. Calls in an inlined copy are not inlined
+// again, so the expansion always terminates.
+
+#include "chibicc.h"
+
+#define INLINE_BUDGET 40
+
+static Obj *current_fn;
+
+// Locals of the callee and their copies in the caller
+static Obj **var_from;
+static Obj **var_to;
+static int nvars;
+
+// Labels of the callee and their renamed copies
+static HashMap labels;
+
+// The switch statement being copied and its copy
+static Node *orig_switch;
+static Node *new_switch;
+
+// Calls visit() for a given node and all its descendants.
+static void walk(Node *node, void (*visit)(Node *)) {
+  if (!node)
+    return;
+
+  visit(node);
+  walk(node->lhs, visit);
+  walk(node->rhs, visit);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    walk(node->cond, visit);
+    walk(node->then, visit);
+    walk(node->els, visit);
+    walk(node->init, visit);
+    walk(node->inc, visit);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      walk(n, visit);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      walk(n, visit);
+    break;
+  case ND_CAS:
+    walk(node->cas_addr, visit);
+    walk(node->cas_old, visit);
+    walk(node->cas_new, visit);
+    break;
+  }
+}
+
+//
+// Deciding whether a function can be inlined
+//
+
+static Obj *candidate;
+static int body_size;
+static bool inlinable;
+
+static void check_node(Node *node) {
+  body_size++;
+
+  switch (node->kind) {
+  case ND_RETURN:
+  case ND_ASM:
+  case ND_VLA_PTR:
+  case ND_LABEL_VAL:
+  case ND_GOTO_EXPR:
+    inlinable = false;
+    return;
+  case ND_VAR:
+    if (node->var == candidate || !strcmp(node->var->name, "alloca"))
+      inlinable = false;
+    return;
+  }
+}
+
+// Returns the last statement of a function body.
+static Node *last_stmt(Obj *fn) {
+  Node *n = fn->body->body;
+  while (n && n->next)
+    n = n->next;
+  return n;
+}
+
+static bool can_inline(Obj *fn) {
+  if (!fn->is_function || !fn->is_definition || !fn->is_static ||
+      fn == current_fn || !fn->body || fn->ty->is_variadic)
+    return false;
+
+  Type *ty = fn->ty->return_ty;
+  if (ty->kind != TY_VOID && !is_numeric(ty) && ty->kind != TY_PTR)
+    return false;
+
+  Node *last = last_stmt(fn);
+  if (ty->kind != TY_VOID && (!last || last->kind != ND_RETURN))
+    return false;
+
+  candidate = fn;
+  body_size = 0;
+  inlinable = true;
+
+  for (Node *n = fn->body->body; n && inlinable; n = n->next) {
+    if (n == last && n->kind == ND_RETURN)
+      walk(n->lhs, check_node);
+    else
+      walk(n, check_node);
+  }
+  return inlinable && body_size <= INLINE_BUDGET;
+}
+
+//
+// Copying a function body
+//
+
+static Obj *copy_var(Obj *var) {
+  for (int i = 0; i < nvars; i++)
+    if (var_from[i] == var)
+      return var_to[i];
+  return var;
+}
+
+static char *copy_label(char *label) {
+  static int id;
+
+  if (!label)
+    return NULL;
+
+  char *label2 = hashmap_get(&labels, label);
+  if (!label2) {
+    label2 = format(".L..inline.%d", id++);
+    hashmap_put(&labels, label, label2);
+  }
+  return label2;
+}
+
+static Node *copy_node(Node *node);
+
+static Node *copy_list(Node *list) {
+  Node head = {};
+  Node *cur = &head;
+  for (Node *n = list; n; n = n->next)
+    cur = cur->next = copy_node(n);
+  return head.next;
+}
+
+static Node *copy_node(Node *node) {
+  if (!node)
+    return NULL;
+
+  Node *n = new_node(node->kind, node->tok);
+  n->ty = node->ty;
+  n->expect = node->expect;
+  n->lhs = copy_node(node->lhs);
+  n->rhs = copy_node(node->rhs);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND: {
+    Node *orig_sw = orig_switch;
+    Node *new_sw = new_switch;
+    if (node->kind == ND_SWITCH) {
+      orig_switch = node;
+      new_switch = n;
+    }
+
+    n->cond = copy_node(node->cond);
+    n->then = copy_node(node->then);
+    n->els = copy_node(node->els);
+    n->init = copy_node(node->init);
+    n->inc = copy_node(node->inc);
+    n->brk_label = copy_label(node->brk_label);
+    n->cont_label = copy_label(node->cont_label);
+
+    orig_switch = orig_sw;
+    new_switch = new_sw;
+    break;
+  }
+  case ND_CASE:
+    n->label = copy_label(node->label);
+    n->begin = node->begin;
+    n->end = node->end;
+
+    // Cases are linked in the same order as the parser links them.
+    if (node == orig_switch->default_case) {
+      new_switch->default_case = n;
+    } else {
+      n->case_next = new_switch->cases;
+      new_switch->cases = n;
+    }
+    break;
+  case ND_GOTO:
+  case ND_LABEL:
+    n->label = node->label;
+    n->unique_label = copy_label(node->unique_label);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    n->body = copy_list(node->body);
+    break;
+  case ND_FUNCALL:
+    n->func_ty = node->func_ty;
+    n->args = copy_list(node->args);
+    if (node->ret_buffer)
+      n->ret_buffer = copy_var(node->ret_buffer);
+    break;
+  case ND_CAS:
+    n->cas_addr = copy_node(node->cas_addr);
+    n->cas_old = copy_node(node->cas_old);
+    n->cas_new = copy_node(node->cas_new);
+    break;
+  case ND_ATOMIC_OP:
+    n->atomic_op = node->atomic_op;
+    break;
+  case ND_NUM:
+    n->val = node->val;
+    n->fval = node->fval;
+    break;
+  case ND_MEMBER:
+    n->member = node->member;
+    break;
+  case ND_VAR:
+  case ND_MEMZERO:
+    n->var = copy_var(node->var);
+    break;
+  }
+  return n;
+}
+
+static Node *new_expr_stmt(Node *expr) {
+  Node *node = new_node(ND_EXPR_STMT, expr->tok);
+  node->lhs = expr;
+  return node;
+}
+
+// Returns a copy of the body of a given function in which the
+// parameters are initialized with the arguments of a given call.
+static Node *inline_call(Node *call, Obj *fn) {
+  nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    nvars++;
+
+  var_from = calloc(nvars, sizeof(Obj *));
+  var_to = calloc(nvars, sizeof(Obj *));
+  labels = (HashMap){};
+  nvars = 0;
+
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (var == fn->alloca_bottom)
+      continue;
+
+    Obj *var2 = arena_alloc(ARENA_OBJ, sizeof(Obj));
+    *var2 = *var;
+    var2->next = current_fn->locals;
+    current_fn->locals = var2;
+
+    var_from[nvars] = var;
+    var_to[nvars] = var2;
+    nvars++;
+  }
+
+  Node head = {};
+  Node *cur = &head;
+
+  Node *arg = call->args;
+  for (Obj *param = fn->params; param; param = param->next) {
+    Node *next = arg->next;
+
+    Node *var = new_node(ND_VAR, call->tok);
+    var->var = copy_var(param);
+
+    Node *node = new_node(ND_ASSIGN, call->tok);
+    node->lhs = var;
+    node->rhs = arg;
+    add_type(node);
+
+    cur = cur->next = new_expr_stmt(node);
+    arg = next;
+  }
+
+  Node *last = last_stmt(fn);
+  for (Node *n = fn->body->body; n; n = n->next) {
+    if (n == last && n->kind == ND_RETURN) {
+      if (n->lhs)
+        cur = cur->next = new_expr_stmt(copy_node(n->lhs));
+      break;
+    }
+    cur = cur->next = copy_node(n);
+  }
+
+  Node *node = new_node(call->ty->kind == TY_VOID ? ND_BLOCK : ND_STMT_EXPR,
+                        call->tok);
+  node->ty = call->ty;
+  node->body = head.next;
+  return node;
+}
+
+// How many times the code being visited ran according to the profile
+// given by -fprofile-use, or -1 if unknown
+static long site_count;
+
+// Returns the function that a given call calls if it can be inlined.
+// With a profile, calls that never ran aren't inlined, because that
+// would only make the code bigger.
+static Obj *inline_target(Node *node) {
+  if (node->kind != ND_FUNCALL || node->lhs->kind != ND_VAR || site_count == 0)
+    return NULL;
+
+  Obj *fn = node->lhs->var;
+  if (!can_inline(fn))
+    return NULL;
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+
+  int nparams = 0;
+  for (Obj *param = fn->params; param; param = param->next)
+    nparams++;
+
+  return (nargs == nparams) ? fn : NULL;
+}
+
+//
+// Inlining calls in a function
+//
+
+static Node *inline_expr(Node *node);
+
+// Inlines calls in an arm of a statement, which is counted as `kind`
+// in the profile.
+static Node *inline_arm(Node *node, Node *arm, char *kind) {
+  long count = site_count;
+  site_count = profile_count(current_fn, node, kind);
+  arm = inline_expr(arm);
+  site_count = count;
+  return arm;
+}
+
+static void inline_list(Node **list) {
+  for (Node **p = list; *p;) {
+    Node *next = (*p)->next;
+    *p = inline_expr(*p);
+    (*p)->next = next;
+    p = &(*p)->next;
+  }
+}
+
+static Node *inline_expr(Node *node) {
+  if (!node)
+    return NULL;
+
+  if (node->kind == ND_CASE)
+    node->lhs = inline_arm(node, node->lhs, "case");
+  else
+    node->lhs = inline_expr(node->lhs);
+  node->rhs = inline_expr(node->rhs);
+
+  switch (node->kind) {
+  case ND_IF:
+    node->cond = inline_expr(node->cond);
+    node->then = inline_arm(node, node->then, "then");
+    node->els = inline_arm(node, node->els, "else");
+    break;
+  case ND_FOR:
+  case ND_DO:
+    node->init = inline_expr(node->init);
+    node->cond = inline_expr(node->cond);
+    node->then = inline_arm(node, node->then, "loop");
+    node->inc = inline_arm(node, node->inc, "loop");
+    break;
+  case ND_SWITCH:
+  case ND_COND:
+    node->cond = inline_expr(node->cond);
+    node->then = inline_expr(node->then);
+    node->els = inline_expr(node->els);
+    node->init = inline_expr(node->init);
+    node->inc = inline_expr(node->inc);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    inline_list(&node->body);
+    break;
+  case ND_FUNCALL:
+    inline_list(&node->args);
+    break;
+  case ND_CAS:
+    node->cas_addr = inline_expr(node->cas_addr);
+    node->cas_old = inline_expr(node->cas_old);
+    node->cas_new = inline_expr(node->cas_new);
+    break;
+  }
+
+  // A call to a void function can be inlined only as a statement.
+  if (node->kind == ND_EXPR_STMT && node->lhs->kind == ND_FUNCALL &&
+      node->lhs->ty->kind == TY_VOID) {
+    Obj *fn = inline_target(node->lhs);
+    if (fn)
+      return inline_call(node->lhs, fn);
+    return node;
+  }
+
+  if (node->kind == ND_FUNCALL && node->ty->kind != TY_VOID) {
+    Obj *fn = inline_target(node);
+    if (fn)
+      return inline_call(node, fn);
+  }
+  return node;
+}
+
+// Since inlining changes which functions call which, we recompute
+// the references of each function from its body.
+static void add_ref(Node *node) {
+  if (node->kind == ND_VAR && !node->var->is_local)
+    strarray_push(&current_fn->refs, node->var->name);
+}
+
+void inline_functions(Obj *prog) {
+  if (!opt_finline)
+    return;
+
+  // Visit functions in the order of definition, which is the reverse
+  // order of `prog`. Since a static function usually precedes its
+  // callers, its body has already been inlined into when it is copied.
+  int nfuncs = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    nfuncs++;
+
+  Obj **funcs = calloc(nfuncs, sizeof(Obj *));
+  int i = nfuncs;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    funcs[--i] = fn;
+
+  for (i = 0; i < nfuncs; i++) {
+    Obj *fn = funcs[i];
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+    current_fn = fn;
+    site_count = profile_count(fn, fn->body, "entry");
+    fn->body = inline_expr(fn->body);
+  }
+
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+    current_fn = fn;
+    fn->refs = (StringArray){};
+    walk(fn->body, add_ref);
+  }
+
+  mark_reachable(prog);
+}
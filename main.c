@@ -1,16 +1,36 @@
 #include "chibicc.h"
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+
+extern char **environ;
 
 typedef enum {
-  FILE_NONE, FILE_C, FILE_ASM, FILE_OBJ, FILE_AR, FILE_DSO,
+  FILE_NONE, FILE_C, FILE_C_HEADER, FILE_ASM, FILE_OBJ, FILE_AR, FILE_DSO,
 } FileType;
 
 StringArray include_paths;
 bool opt_fcommon = true;
+bool opt_finline = true;
+bool opt_fcse = true;
+bool opt_ftree_vectorize = true;
+bool opt_fbuiltin = true;
+int opt_O;
+bool opt_stream_codegen;
+bool opt_bulk_memory = true;
+bool opt_memory64;
 bool opt_fpic;
+bool opt_long_double_64;
+TLSModel opt_tls_model;
+bool opt_pg;
+bool opt_instrument_functions;
+bool opt_profile_generate;
 
 static FileType opt_x;
 static StringArray opt_include;
 static bool opt_E;
+static bool opt_P;
+static bool opt_pp_compact;
 static bool opt_M;
 static bool opt_MD;
 static bool opt_MMD;
@@ -18,15 +38,29 @@ static bool opt_MP;
 static bool opt_S;
 static bool opt_c;
 static bool opt_cc1;
+static bool opt_cc1_emit_obj;
+static bool opt_cc1_emit_pch;
+static bool opt_integrated_as = true;
+static bool opt_g;
+static bool opt_pipe;
 static bool opt_hash_hash_hash;
 static bool opt_static;
 static bool opt_shared;
 static bool opt_dump_tokens;
 static bool opt_dump_ast;
+static bool opt_dump_binary;
+static bool opt_emit_all_json;
+static bool opt_mem_stats;
+static bool opt_time_report;
+static bool opt_time_report_json;
+static bool opt_cache_stats;
 static bool opt_emit_wat;
+static bool opt_emit_wasm;
+static bool opt_serve;
 static char *opt_MF;
 static char *opt_MT;
 static char *opt_o;
+static int opt_j = 1;
 
 static StringArray ld_extra_args;
 static StringArray std_include_paths;
@@ -45,6 +79,7 @@ static void usage(int status) {
 static bool take_arg(char *arg) {
   char *x[] = {
     "-o", "-I", "-idirafter", "-include", "-x", "-MF", "-MT", "-Xlinker",
+    "-j",
   };
 
   for (int i = 0; i < sizeof(x) / sizeof(*x); i++)
@@ -79,6 +114,8 @@ static void define(char *str) {
 static FileType parse_opt_x(char *s) {
   if (!strcmp(s, "c"))
     return FILE_C;
+  if (!strcmp(s, "c-header"))
+    return FILE_C_HEADER;
   if (!strcmp(s, "assembler"))
     return FILE_ASM;
   if (!strcmp(s, "none"))
@@ -86,6 +123,46 @@ static FileType parse_opt_x(char *s) {
   error("<command line>: unknown argument for -x: %s", s);
 }
 
+// Parses a size with an optional K, M or G suffix.
+static long parse_opt_cache_max_size(char *s) {
+  char *end;
+  long n = strtol(s, &end, 10);
+  if (*end == 'K' || *end == 'k')
+    n <<= 10, end++;
+  else if (*end == 'M' || *end == 'm')
+    n <<= 20, end++;
+  else if (*end == 'G' || *end == 'g')
+    n <<= 30, end++;
+
+  if (*s == '\0' || *end != '\0' || n < 0)
+    error("<command line>: invalid argument for -fcache-max-size: %s", s);
+  return n;
+}
+
+static int parse_opt_codegen_threads(char *s) {
+  char *end;
+  long n = strtol(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || n < 0 || n > 1024)
+    error("<command line>: invalid argument for -fcodegen-threads: %s", s);
+  return n;
+}
+
+static int parse_opt_j(char *s) {
+  char *end;
+  long n = strtol(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || n < 1 || n > 1024)
+    error("<command line>: invalid argument for -j: %s", s);
+  return n;
+}
+
+static int parse_opt_dump_ast(char *s, char *opt) {
+  char *end;
+  long n = strtol(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || n < 0 || n > 1 << 30)
+    error("<command line>: invalid argument for %s: %s", opt, s);
+  return n;
+}
+
 static char *quote_makefile(char *s) {
   char *buf = calloc(1, strlen(s) * 2 + 1);
 
@@ -145,11 +222,110 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strncmp(argv[i], "--dump-ast-depth=", 17)) {
+      opt_dump_ast_depth = parse_opt_dump_ast(argv[i] + 17, "--dump-ast-depth");
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--dump-ast-node=", 16)) {
+      opt_dump_ast_node = parse_opt_dump_ast(argv[i] + 16, "--dump-ast-node");
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--dump-format=json")) {
+      opt_dump_binary = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--dump-format=binary")) {
+      opt_dump_binary = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--dump-format=", 14))
+      error("unknown dump format: %s", argv[i] + 14);
+
+    if (!strcmp(argv[i], "--serve")) {
+      opt_serve = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--emit-all-json")) {
+      opt_emit_all_json = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report")) {
+      opt_time_report = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report=json")) {
+      opt_time_report = opt_time_report_json = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcache-dir=", 12)) {
+      opt_cache_dir = argv[i] + 12;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcache-max-size=", 17)) {
+      opt_cache_max_size = parse_opt_cache_max_size(argv[i] + 17);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcodegen-threads=", 18)) {
+      opt_codegen_threads = parse_opt_codegen_threads(argv[i] + 18);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--cache-stats")) {
+      opt_cache_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--pp-stats")) {
+      opt_pp_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--mem-stats")) {
+      opt_mem_stats = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "--emit-wat")) {
       opt_emit_wat = true;
       continue;
     }
 
+    if (!strcmp(argv[i], "--emit-wasm")) {
+      opt_emit_wat = true;
+      opt_emit_wasm = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mbulk-memory")) {
+      opt_bulk_memory = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mno-bulk-memory")) {
+      opt_bulk_memory = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mmemory64")) {
+      opt_memory64 = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mno-memory64")) {
+      opt_memory64 = false;
+      continue;
+    }
+
     if (!strcmp(argv[i], "--help"))
       usage(0);
 
@@ -163,6 +339,16 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-j")) {
+      opt_j = parse_opt_j(argv[++i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      opt_j = parse_opt_j(argv[i] + 2);
+      continue;
+    }
+
     if (!strcmp(argv[i], "-S")) {
       opt_S = true;
       continue;
@@ -178,6 +364,77 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-fdump-passes")) {
+      opt_dump_passes = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-finline")) {
+      opt_finline = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-inline")) {
+      opt_finline = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fcse")) {
+      opt_fcse = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-cse")) {
+      opt_fcse = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftree-vectorize")) {
+      opt_ftree_vectorize = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-tree-vectorize")) {
+      opt_ftree_vectorize = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fbuiltin")) {
+      opt_fbuiltin = true;
+      continue;
+    }
+
+    // A freestanding program may define its own memcpy() and so on.
+    if (!strcmp(argv[i], "-fno-builtin") || !strcmp(argv[i], "-ffreestanding")) {
+      opt_fbuiltin = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fstream-codegen")) {
+      opt_stream_codegen = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-stream-codegen")) {
+      opt_stream_codegen = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fintegrated-as")) {
+      opt_integrated_as = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-integrated-as")) {
+      opt_integrated_as = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-pipe")) {
+      opt_pipe = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-c")) {
       opt_c = true;
       continue;
@@ -188,6 +445,16 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-P")) {
+      opt_P = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--pp-compact")) {
+      opt_pp_compact = true;
+      continue;
+    }
+
     if (!strncmp(argv[i], "-I", 2)) {
       strarray_push(&include_paths, argv[i] + 2);
       continue;
@@ -289,6 +556,59 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-ftls-model=global-dynamic")) {
+      opt_tls_model = TLS_GLOBAL_DYNAMIC;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftls-model=local-dynamic")) {
+      opt_tls_model = TLS_LOCAL_DYNAMIC;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftls-model=initial-exec")) {
+      opt_tls_model = TLS_INITIAL_EXEC;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftls-model=local-exec")) {
+      opt_tls_model = TLS_LOCAL_EXEC;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-ftls-model=", 12))
+      error("unknown TLS model: %s", argv[i] + 12);
+
+    if (!strcmp(argv[i], "-mlong-double-64")) {
+      opt_long_double_64 = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-mlong-double-80")) {
+      opt_long_double_64 = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-pg")) {
+      opt_pg = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-finstrument-functions")) {
+      opt_instrument_functions = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-generate")) {
+      opt_profile_generate = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+      opt_profile_use = argv[i] + 14;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-cc1-input")) {
       base_file = argv[++i];
       continue;
@@ -299,6 +619,16 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-cc1-emit-obj")) {
+      opt_cc1_emit_obj = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-cc1-emit-pch")) {
+      opt_cc1_emit_pch = true;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-idirafter")) {
       strarray_push(&idirafter, argv[i++]);
       continue;
@@ -333,13 +663,31 @@ static void parse_args(int argc, char **argv) {
       exit(0);
     }
 
+    if (!strcmp(argv[i], "-O")) {
+      opt_O = 1;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-O", 2)) {
+      if (!strcmp(argv[i], "-Os") || !strcmp(argv[i], "-Oz"))
+        opt_O = 2;
+      else if (!strcmp(argv[i], "-Ofast"))
+        opt_O = 3;
+      else if (isdigit(argv[i][2]) && !argv[i][3])
+        opt_O = argv[i][2] - '0';
+      else
+        error("unknown argument: %s", argv[i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-g", 2)) {
+      opt_g = strcmp(argv[i], "-g0");
+      continue;
+    }
+
     // These options are ignored for now.
-    if (!strncmp(argv[i], "-O", 2) ||
-        !strncmp(argv[i], "-W", 2) ||
-        !strncmp(argv[i], "-g", 2) ||
+    if (!strncmp(argv[i], "-W", 2) ||
         !strncmp(argv[i], "-std=", 5) ||
-        !strcmp(argv[i], "-ffreestanding") ||
-        !strcmp(argv[i], "-fno-builtin") ||
         !strcmp(argv[i], "-fno-omit-frame-pointer") ||
         !strcmp(argv[i], "-fno-stack-protector") ||
         !strcmp(argv[i], "-fno-strict-aliasing") ||
@@ -357,12 +705,17 @@ static void parse_args(int argc, char **argv) {
   for (int i = 0; i < idirafter.len; i++)
     strarray_push(&include_paths, idirafter.data[i]);
 
-  if (input_paths.len == 0)
+  if (input_paths.len == 0 && !opt_cache_stats && !opt_serve)
     error("no input files");
 
   // -E implies that the input is the C macro language.
   if (opt_E)
     opt_x = FILE_C;
+
+  // The integrated assembler ignores .file and .loc, so we leave
+  // building line number tables from them to the system assembler.
+  if (opt_g)
+    opt_integrated_as = false;
 }
 
 static FILE *open_file(char *path) {
@@ -406,30 +759,195 @@ static char *create_tmpfile(void) {
   return path;
 }
 
+// If -### is given, dump the subprocess's command line.
+static void print_command(char **argv) {
+  if (!opt_hash_hash_hash)
+    return;
+  fprintf(stderr, "%s", argv[0]);
+  for (int i = 1; argv[i]; i++)
+    fprintf(stderr, " %s", argv[i]);
+  fprintf(stderr, "\n");
+}
+
+// Creates a pipe. Both ends are closed on exec, so that only
+// the ends passed to spawn() are inherited by a command.
+static void open_pipe(int fds[2]) {
+  if (pipe(fds) == -1)
+    error("pipe failed: %s", strerror(errno));
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+// Starts a command with its stdin and stdout connected to given file
+// descriptors, and returns its pid. -1 means inheriting ours.
+// posix_spawn doesn't copy our address space like fork does, so
+// starting a command is cheap even if the driver has grown large.
+static pid_t spawn(char **argv, int in, int out) {
+  print_command(argv);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (in != -1)
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  if (out != -1)
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+
+  pid_t pid;
+  int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err)
+    error("exec failed: %s: %s", argv[0], strerror(err));
+  return pid;
+}
+
+static bool wait_for(pid_t pid) {
+  int status;
+  return waitpid(pid, &status, 0) == pid && status == 0;
+}
+
 static void run_subprocess(char **argv) {
-  // If -### is given, dump the subprocess's command line.
-  if (opt_hash_hash_hash) {
-    fprintf(stderr, "%s", argv[0]);
-    for (int i = 1; argv[i]; i++)
-      fprintf(stderr, " %s", argv[i]);
-    fprintf(stderr, "\n");
-  }
+  if (!wait_for(spawn(argv, -1, -1)))
+    exit(1);
+}
+
+// The number of translation units the driver compiles. If it is one,
+// cc1 runs in the driver process. Otherwise each runs in a forked
+// copy of the driver, so that it starts from a clean compiler state.
+// Either way, the arguments are not parsed again and the predefined
+// macros are not defined again as they would be after an exec.
+static int nr_tus;
+
+// Batch mode is used if the driver compiles more than one translation
+// unit. After compiling a translation unit, the cc1 process reports
+// the parts of headers in its token cache, and the driver tokenizes
+// them too, so that cc1 processes forked after that find the tokens
+// in their inherited token cache. Macros, conditional inclusion and
+// the parser's scopes are still per translation unit, because every
+// unit starts from a fresh fork.
+static FILE *token_report;
+
+static bool is_not_base_file(char *path) {
+  return strcmp(path, base_file);
+}
+
+// Creates a file for a cc1 process to write its token report to.
+static FILE *new_token_report(void) {
+  FILE *fp = tmpfile();
+  if (!fp)
+    error("tmpfile failed: %s", strerror(errno));
+  return fp;
+}
 
-  if (fork() == 0) {
-    // Child process. Run a new command.
-    execvp(argv[0], argv);
-    fprintf(stderr, "exec failed: %s: %s\n", argv[0], strerror(errno));
-    _exit(1);
+// Tokenizes the parts of files listed in a token report.
+static void preload_token_report(FILE *fp) {
+  char *line = NULL;
+  size_t cap = 0;
+  rewind(fp);
+  while (getline(&line, &cap, fp) != -1) {
+    char *path;
+    long offset = strtol(line, &path, 10);
+    path[strlen(path) - 1] = '\0';
+    preload_tokens(path + 1, offset);
   }
+  free(line);
+}
 
-  // Wait for the child process to finish.
+// With -j N, the driver runs up to N cc1+as pipelines at once.
+// Each pipeline runs in a forked copy of the driver, so that
+// run_subprocess() in the child only waits for its own commands.
+typedef struct Job Job;
+struct Job {
+  Job *next;
+  pid_t pid;
+  char *input;
+  FILE *report;
+};
+
+static Job *jobs;
+static int nr_jobs;
+static char *failed_input;
+
+static void wait_job(void) {
   int status;
-  while (wait(&status) > 0);
-  if (status != 0)
-    exit(1);
+  pid_t pid = wait(&status);
+  if (pid == -1)
+    error("wait failed: %s", strerror(errno));
+
+  for (Job **cur = &jobs; *cur; cur = &(*cur)->next) {
+    Job *job = *cur;
+    if (job->pid != pid)
+      continue;
+
+    // Remember the first input that failed to compile.
+    if (status != 0 && !failed_input)
+      failed_input = job->input;
+    if (job->report) {
+      if (status == 0)
+        preload_token_report(job->report);
+      fclose(job->report);
+    }
+    *cur = job->next;
+    nr_jobs--;
+    return;
+  }
+}
+
+// Returns true if the caller should run the job for a given input
+// itself. That is the case if we are not running jobs in parallel,
+// or if we are the newly forked child process.
+static bool start_job(char *input) {
+  if (opt_j <= 1)
+    return true;
+
+  while (nr_jobs >= opt_j)
+    wait_job();
+
+  // Do not start new jobs once one of them has failed.
+  if (failed_input)
+    return false;
+
+  FILE *report = (nr_tus > 1) ? new_token_report() : NULL;
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == -1)
+    error("fork failed: %s", strerror(errno));
+
+  if (pid == 0) {
+    // Temporary files are owned by the parent. Do not let the
+    // child's cleanup() remove files other jobs are still using.
+    tmpfiles.len = 0;
+    nr_tus = 1;
+    token_report = report;
+    return true;
+  }
+
+  Job *job = calloc(1, sizeof(Job));
+  job->pid = pid;
+  job->input = input;
+  job->report = report;
+  job->next = jobs;
+  jobs = job;
+  nr_jobs++;
+  return false;
 }
 
-static void run_cc1(int argc, char **argv, char *input, char *output) {
+static void end_job(void) {
+  if (opt_j > 1)
+    _exit(0);
+}
+
+static void wait_all_jobs(void) {
+  while (nr_jobs > 0)
+    wait_job();
+  if (failed_input)
+    error("%s: compilation failed", failed_input);
+}
+
+// `mode` is an optional extra flag such as -cc1-emit-obj.
+static char **cc1_args(int argc, char **argv, char *input, char *output, char *mode) {
   char **args = calloc(argc + 10, sizeof(char *));
   memcpy(args, argv, argc * sizeof(char *));
   args[argc++] = "-cc1";
@@ -444,23 +962,129 @@ static void run_cc1(int argc, char **argv, char *input, char *output) {
     args[argc++] = output;
   }
 
-  run_subprocess(args);
+  if (mode)
+    args[argc++] = mode;
+  return args;
+}
+
+// Print tokens to a given file. Used for -E.
+// -E output goes through a large buffer, because writing tokens one
+// by one with fprintf() makes chibicc output-bound when it is used as
+// a standalone preprocessor.
+typedef struct {
+  FILE *fp;
+  int len;
+  char buf[1 << 16];
+} OutBuf;
+
+static void out_flush(OutBuf *b) {
+  fwrite(b->buf, 1, b->len, b->fp);
+  b->len = 0;
+}
+
+static void out_write(OutBuf *b, char *s, int len) {
+  if (b->len + len > sizeof(b->buf)) {
+    out_flush(b);
+    if (len > sizeof(b->buf)) {
+      fwrite(s, 1, len, b->fp);
+      return;
+    }
+  }
+  memcpy(b->buf + b->len, s, len);
+  b->len += len;
 }
 
-// Print tokens to stdout. Used for -E.
-static void print_tokens(Token *tok) {
-  FILE *out = open_file(opt_o ? opt_o : "-");
+static void out_char(OutBuf *b, char c) {
+  if (b->len == sizeof(b->buf))
+    out_flush(b);
+  b->buf[b->len++] = c;
+}
 
-  int line = 1;
-  for (; tok->kind != TK_EOF; tok = tok->next) {
-    if (line > 1 && tok->at_bol)
-      fprintf(out, "\n");
-    if (tok->has_space && !tok->at_bol)
-      fprintf(out, " ");
-    fprintf(out, "%.*s", tok->len, tok->loc);
-    line++;
+static void print_line_marker(OutBuf *b, Token *tok) {
+  char num[32];
+  out_write(b, num, snprintf(num, sizeof(num), "# %d \"", tok->line_no));
+  for (char *p = tok->filename; *p; p++) {
+    if (*p == '\\' || *p == '"')
+      out_char(b, '\\');
+    out_char(b, *p);
   }
-  fprintf(out, "\n");
+  out_write(b, "\"\n", 2);
+}
+
+static bool is_word_char(char c) {
+  return isalnum(c) || c == '_' || c == '$' || (unsigned char)c >= 0x80;
+}
+
+// Returns true if two adjacent tokens might be read as different
+// tokens if we didn't print a space between them.
+static bool needs_space(Token *prev, Token *tok) {
+  char a = prev->loc[prev->len - 1];
+  char b = tok->loc[0];
+
+  if ((prev->kind == TK_NUM || prev->kind == TK_PP_NUM) &&
+      (b == '.' || b == '+' || b == '-'))
+    return true;
+  if (is_word_char(a))
+    return is_word_char(b) || b == '"' || b == '\'';
+  if (a == '.' && isdigit(b))
+    return true;
+
+  // Two punctuators need a space if their last and first characters
+  // would start a longer punctuator or a comment.
+  static char *pairs[] = {
+    "==", "!=", "<=", ">=", "->", "+=", "-=", "*=", "/=", "%=", "&=", "|=",
+    "^=", "++", "--", "&&", "||", "<<", ">>", "##", "..", "//", "/*", "<:",
+    ":>", "<%", "%>", "%:",
+  };
+  for (int i = 0; i < sizeof(pairs) / sizeof(*pairs); i++)
+    if (pairs[i][0] == a && pairs[i][1] == b)
+      return true;
+  return false;
+}
+
+// Print tokens as C source. If `line_markers` is true, `# <line>
+// "<file>"` lines are inserted so that the output can be mapped back
+// to the source. If `compact` is true, whitespace is printed only
+// where it is needed to separate tokens. Lines are joined in that
+// mode, so line markers only tell which file tokens come from.
+static void print_tokens(Token *tok, FILE *out, bool line_markers, bool compact) {
+  static OutBuf b;
+  b.fp = out;
+  b.len = 0;
+
+  char *file = NULL;
+  int line = 0;
+  Token *prev = NULL;
+
+  for (; tok->kind != TK_EOF; prev = tok, tok = tok->next) {
+    // Tokens from macro expansions have the locations of the macro
+    // definitions, so only other tokens are used for line markers.
+    bool has_loc = line_markers && tok->at_bol && !tok->hideset;
+
+    if (has_loc && (!file || strcmp(file, tok->filename) ||
+                    (!compact && (tok->line_no < line || tok->line_no > line + 8)))) {
+      if (prev)
+        out_char(&b, '\n');
+      print_line_marker(&b, tok);
+      file = tok->filename;
+      line = tok->line_no;
+    } else if (prev && tok->at_bol && !compact) {
+      int n = has_loc ? MAX(1, tok->line_no - line) : 1;
+      for (int i = 0; i < n; i++)
+        out_char(&b, '\n');
+      line += n;
+    } else if (compact) {
+      if (prev && (tok->has_space || tok->at_bol) && needs_space(prev, tok))
+        out_char(&b, ' ');
+    } else if (tok->has_space && !tok->at_bol) {
+      out_char(&b, ' ');
+    }
+
+    out_write(&b, tok->loc, tok->len);
+  }
+
+  out_char(&b, '\n');
+  out_flush(&b);
 }
 
 static bool in_std_include_path(char *path) {
@@ -519,19 +1143,67 @@ static Token *must_tokenize_file(char *path) {
   return tok;
 }
 
-static Token *append_tokens(Token *tok1, Token *tok2) {
-  if (!tok1 || tok1->kind == TK_EOF)
-    return tok2;
+static void assemble(char *input, char *output) {
+  char *cmd[] = {"as", "-c", input, "-o", output, NULL};
+  run_subprocess(cmd);
+}
 
-  Token *t = tok1;
-  while (t->next->kind != TK_EOF)
-    t = t->next;
-  t->next = tok2;
-  return tok1;
+// Assembles text in memory by writing it to the assembler's stdin.
+static void assemble_buf(char *buf, size_t len, char *output) {
+  int fds[2];
+  open_pipe(fds);
+
+  char *cmd[] = {"as", "-c", "-o", output, NULL};
+  pid_t pid = spawn(cmd, fds[0], -1);
+  close(fds[0]);
+
+  FILE *out = fdopen(fds[1], "w");
+  fwrite(buf, len, 1, out);
+  fclose(out);
+  if (!wait_for(pid))
+    exit(1);
+}
+
+// Run parse and codegen on preprocessed tokens and write the output
+// of each stage to stdout as a line of JSON as soon as it is done.
+// Used for --emit-all-json.
+static void emit_all_json(Token *tok) {
+  dump_stage_tokens(stdout, tok);
+
+  char *pp;
+  size_t pplen;
+  FILE *pp_buf = open_memstream(&pp, &pplen);
+  print_tokens(tok, pp_buf, false, false);
+  fclose(pp_buf);
+  dump_stage_preprocessed(stdout, pp);
+
+  phase_enter(PHASE_PARSE);
+  Obj *prog = parse(tok);
+  optimize(prog);
+  dump_stage_ast(stdout, prog);
+
+  char *buf;
+  size_t buflen;
+  FILE *output_buf = open_memstream(&buf, &buflen);
+  phase_enter(PHASE_CODEGEN);
+  codegen(prog, output_buf);
+  fclose(output_buf);
+  counters.asm_bytes = buflen;
+  dump_stage_assembly(stdout, buf);
 }
 
 static void cc1(void) {
   Token *tok = NULL;
+  Token *pch = NULL;
+  bool use_pch = !opt_cc1_emit_pch;
+  phase_enter(PHASE_TOKENIZE);
+
+  // With -mlong-double-64, long double is the same as double, so it
+  // lives in SSE registers rather than on the x87 stack.
+  if (opt_long_double_64) {
+    ty_ldouble = ty_double;
+    define_macro("__LONG_DOUBLE_64__", "1");
+  }
 
   // Process -include option
   for (int i = 0; i < opt_include.len; i++) {
@@ -546,6 +1218,20 @@ static void cc1(void) {
         error("-include: %s: %s", incl, strerror(errno));
     }
 
+    // If there's an up-to-date precompiled header, use it instead.
+    // A precompiled header depends on the preprocessor state before
+    // the header, so that works only for leading -include files.
+    if (use_pch) {
+      Phase prev = phase_enter(PHASE_PREPROCESS);
+      Token *tok2 = read_pch(path);
+      phase_leave(prev);
+      if (tok2) {
+        pch = append_tokens(pch, tok2);
+        continue;
+      }
+      use_pch = false;
+    }
+
     Token *tok2 = must_tokenize_file(path);
     tok = append_tokens(tok, tok2);
   }
@@ -553,7 +1239,19 @@ static void cc1(void) {
   // Tokenize and parse.
   Token *tok2 = must_tokenize_file(base_file);
   tok = append_tokens(tok, tok2);
-  tok = preprocess(tok);
+
+  phase_enter(PHASE_PREPROCESS);
+
+  // If -cc1-emit-pch is given, save the preprocessor state
+  // after reading the input header file.
+  if (opt_cc1_emit_pch) {
+    FILE *out = open_file(output_file);
+    write_pch(tok, out);
+    fclose(out);
+    return;
+  }
+
+  tok = append_tokens(pch, preprocess(tok));
 
   // If -M or -MD are given, print file dependencies.
   if (opt_M || opt_MD) {
@@ -564,21 +1262,98 @@ static void cc1(void) {
 
   // If -E is given, print out preprocessed C code as a result.
   if (opt_E) {
-    print_tokens(tok);
+    print_tokens(tok, open_file(opt_o ? opt_o : "-"), !opt_P, opt_pp_compact);
+    return;
+  }
+
+  // -fstream-codegen discards function bodies as soon as they are
+  // compiled, so it is incompatible with modes that need the whole AST.
+  // The inliner needs callee bodies too, so it is disabled.
+  if (opt_emit_wat || opt_dump_ast || opt_emit_all_json)
+    opt_stream_codegen = false;
+  if (opt_stream_codegen)
+    opt_finline = false;
+
+  // The vectorizer emits SSE2 code. SIMD is an optional feature of
+  // WebAssembly, so we leave it off for the wasm backend.
+  if (opt_emit_wat)
+    opt_ftree_vectorize = false;
+
+  // If --emit-all-json is given, run the remaining stages and dump
+  // the result of each as a line of JSON.
+  if (opt_emit_all_json) {
+    emit_all_json(tok);
     return;
   }
 
-  // If --dump-tokens is given, dump tokens as JSON and exit.
+  // If --dump-tokens is given, dump tokens as JSON or in the binary
+  // format and exit.
   if (opt_dump_tokens) {
-    dump_tokens(tok);
+    if (opt_dump_binary)
+      dump_tokens_bin(tok, stdout);
+    else
+      dump_tokens(tok, stdout);
     return;
   }
 
+  // If the compilation cache is enabled, reuse the output of a
+  // previous compilation of the same token stream if exists.
+  char *key = NULL;
+  bool emit_obj = opt_cc1_emit_obj && !opt_emit_wat;
+  char *profile = opt_profile_use ? read_profile(opt_profile_use) : "";
+
+  if (opt_cache_dir && !opt_dump_ast) {
+    key = cache_key(tok, format("fpic=%d tls=%d ld64=%d fcommon=%d finline=%d "
+                                "fcse=%d vectorize=%d builtin=%d stream=%d O=%d "
+                                "wat=%d wasm=%d bulk=%d mem64=%d obj=%d pg=%d "
+                                "instrument=%d profile=%d use=%s",
+                                opt_fpic, opt_tls_model, opt_long_double_64,
+                                opt_fcommon, opt_finline, opt_fcse,
+                                opt_ftree_vectorize, opt_fbuiltin,
+                                opt_stream_codegen, opt_O, opt_emit_wat,
+                                opt_emit_wasm, opt_bulk_memory, opt_memory64,
+                                emit_obj, opt_pg, opt_instrument_functions,
+                                opt_profile_generate, profile));
+    size_t len;
+    char *data = cache_lookup(key, &len);
+    if (data) {
+      FILE *out = open_file(output_file);
+      fwrite(data, len, 1, out);
+      fclose(out);
+      return;
+    }
+  }
+
+  phase_enter(PHASE_PARSE);
   Obj *prog = parse(tok);
+  optimize(prog);
 
-  // If --dump-ast is given, dump the AST as JSON and exit.
+  // If --dump-ast is given, dump the AST as JSON or in the binary
+  // format and exit.
   if (opt_dump_ast) {
-    dump_ast(prog);
+    if (opt_dump_binary)
+      dump_ast_bin(prog, stdout);
+    else
+      dump_ast(prog, stdout);
+    return;
+  }
+
+  // If the output is just assembly text that we don't need to keep
+  // in memory, stream it to the output file. If the output is a pipe
+  // to the assembler (-pipe), the assembler can run at the same time.
+  phase_enter(PHASE_CODEGEN);
+  if (!emit_obj && !key && !opt_emit_wasm) {
+    FILE *out = open_file(output_file);
+    if (opt_emit_wat)
+      codegen_wasm(prog, out);
+    else
+      codegen(prog, out);
+
+    // The size is unknown if the output is a pipe.
+    long len = ftell(out);
+    if (len > 0)
+      counters.asm_bytes = len;
+    fclose(out);
     return;
   }
 
@@ -593,16 +1368,52 @@ static void cc1(void) {
   else
     codegen(prog, output_buf);
   fclose(output_buf);
+  counters.asm_bytes = buflen;
+
+  // Assemble the text into an object file ourselves. If the text
+  // contains something our assembler doesn't support (which can
+  // happen with inline assembly), use the system assembler instead.
+  if (emit_obj) {
+    char *obj;
+    size_t objlen;
+    FILE *obj_buf = open_memstream(&obj, &objlen);
+    bool ok = assemble_elf(buf, obj_buf);
+    fclose(obj_buf);
+
+    if (ok) {
+      FILE *out = open_file(output_file);
+      fwrite(obj, objlen, 1, out);
+      fclose(out);
+      if (key)
+        cache_store(key, obj, objlen);
+      return;
+    }
+
+    assemble_buf(buf, buflen, output_file);
+    return;
+  }
+
+  // If --emit-wasm is given, encode the WAT text as a binary module.
+  if (opt_emit_wasm) {
+    char *wasm;
+    size_t wasmlen;
+    FILE *wasm_buf = open_memstream(&wasm, &wasmlen);
+    assemble_wasm(buf, wasm_buf);
+    fclose(wasm_buf);
+
+    FILE *out = open_file(output_file);
+    fwrite(wasm, wasmlen, 1, out);
+    fclose(out);
+    if (key)
+      cache_store(key, wasm, wasmlen);
+    return;
+  }
 
   // Write the asembly text to a file.
   FILE *out = open_file(output_file);
   fwrite(buf, buflen, 1, out);
   fclose(out);
-}
-
-static void assemble(char *input, char *output) {
-  char *cmd[] = {"as", "-c", input, "-o", output, NULL};
-  run_subprocess(cmd);
+  cache_store(key, buf, buflen);
 }
 
 static char *find_file(char *pattern) {
@@ -661,7 +1472,8 @@ static void run_linker(StringArray *inputs, char *output) {
     strarray_push(&arr, format("%s/crti.o", libpath));
     strarray_push(&arr, format("%s/crtbeginS.o", gcc_libpath));
   } else {
-    strarray_push(&arr, format("%s/crt1.o", libpath));
+    // gcrt1.o starts and stops the profiler of -pg.
+    strarray_push(&arr, format("%s/%s", libpath, opt_pg ? "gcrt1.o" : "crt1.o"));
     strarray_push(&arr, format("%s/crti.o", libpath));
     strarray_push(&arr, format("%s/crtbegin.o", gcc_libpath));
   }
@@ -712,6 +1524,300 @@ static void run_linker(StringArray *inputs, char *output) {
   run_subprocess(arr.data);
 }
 
+// Runs the compiler proper, as requested by -cc1.
+static void cc1_main(char *argv0) {
+  add_default_include_paths(argv0);
+  cc1();
+  if (opt_time_report)
+    print_time_report(stderr, opt_time_report_json);
+  if (opt_mem_stats)
+    print_mem_stats(stderr);
+  if (opt_pp_stats)
+    print_pp_stats(stderr);
+}
+
+// Runs the compiler proper in this process for one translation unit.
+// `mode` is an optional extra flag such as -cc1-emit-obj.
+static void cc1_in_process(char *argv0, char *input, char *output, char *mode) {
+  base_file = input;
+  output_file = output;
+  opt_cc1_emit_obj = mode && !strcmp(mode, "-cc1-emit-obj");
+  opt_cc1_emit_pch = mode && !strcmp(mode, "-cc1-emit-pch");
+  if (token_report)
+    cache_all_tokens = true;
+  cc1_main(argv0);
+  if (token_report)
+    print_token_cache(token_report, is_not_base_file);
+}
+
+// Forks a copy of the driver that runs cc1 and exits. Its stdout is
+// connected to `out` unless it is -1.
+static pid_t fork_cc1(char *argv0, char *input, char *output, char *mode, int out,
+                      FILE *report) {
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == -1)
+    error("fork failed: %s", strerror(errno));
+
+  if (pid == 0) {
+    // Temporary files are owned by the parent.
+    tmpfiles.len = 0;
+    token_report = report;
+    if (out != -1)
+      dup2(out, STDOUT_FILENO);
+    cc1_in_process(argv0, input, output, mode);
+    exit(0);
+  }
+  return pid;
+}
+
+static void run_cc1(int argc, char **argv, char *input, char *output, char *mode) {
+  print_command(cc1_args(argc, argv, input, output, mode));
+
+  if (nr_tus == 1) {
+    cc1_in_process(argv[0], input, output, mode);
+    return;
+  }
+
+  FILE *report = new_token_report();
+  if (!wait_for(fork_cc1(argv[0], input, output, mode, -1, report)))
+    exit(1);
+  preload_token_report(report);
+  fclose(report);
+}
+
+// Runs cc1 and the assembler at the same time. cc1 writes assembly
+// text to a pipe and the assembler reads it from the other end, so
+// no temporary file is needed. Used for -pipe.
+// Returns a temporary file in the same directory as `path`, so that
+// it can be renamed to `path`. If `path` is not a regular file, e.g.
+// /dev/null, it is returned as is.
+static char *create_tmpfile_for(char *path) {
+  struct stat st;
+  if (stat(path, &st) == 0 && !S_ISREG(st.st_mode))
+    return path;
+
+  char *tmp = format("%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    error("mkstemp failed: %s", strerror(errno));
+  close(fd);
+
+  strarray_push(&tmpfiles, tmp);
+  return tmp;
+}
+
+// The assembler reads the output of cc1 while it is being generated.
+// `as` writes a temporary file that replaces the output only if both
+// processes succeed, so that a compile error doesn't leave an object
+// file of a partial stream behind.
+static void run_cc1_pipe(int argc, char **argv, char *input, char *output) {
+  int fds[2];
+  open_pipe(fds);
+
+  char *tmp = create_tmpfile_for(output);
+  char *as[] = {"as", "-c", "-o", tmp, NULL};
+  print_command(cc1_args(argc, argv, input, "-", NULL));
+  pid_t pid1 = fork_cc1(argv[0], input, "-", NULL, fds[1], token_report);
+  pid_t pid2 = spawn(as, fds[0], -1);
+  close(fds[0]);
+  close(fds[1]);
+
+  bool ok1 = wait_for(pid1);
+  bool ok2 = wait_for(pid2);
+  if (!ok1 || !ok2)
+    exit(1);
+  if (tmp != output && rename(tmp, output))
+    error("cannot rename %s to %s: %s", tmp, output, strerror(errno));
+}
+
+// Compile service
+//
+// With --serve, chibicc reads compile jobs from stdin and writes the
+// results to stdout until the end of input. A job is a frame of
+// "<length>\n" followed by that many bytes of NUL-terminated -cc1
+// arguments. If an empty argument follows them, the rest of the frame
+// is the source text of the -cc1-input file.
+//
+// The stdout of a job is forwarded as it is written, in frames of
+// "+<length>\n" followed by that many bytes, so that a client can use
+// the output of a stage while the job is still running. The result
+// is then "<status> <stderr-length>\n" followed by the stderr.
+//
+// Each job runs in a forked process, so that it starts from the
+// pristine global state of the server. The server in turn tokenizes
+// the system headers the jobs have used, so that the jobs forked
+// after them find their tokens in the token cache.
+
+static bool read_full(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads a frame from stdin. stdio is not used, so that nothing is
+// left in a buffer at the end of a frame. Returns NULL at the end of
+// input.
+static char *read_frame(size_t *len) {
+  char hdr[32];
+  int i = 0;
+  for (;;) {
+    if (!read_full(0, hdr + i, 1)) {
+      if (i == 0)
+        return NULL;
+      error("--serve: unexpected end of input");
+    }
+    if (hdr[i] == '\n' && i > 0)
+      break;
+    if (!isdigit(hdr[i]) || ++i == sizeof(hdr))
+      error("--serve: malformed frame header");
+  }
+  hdr[i] = '\0';
+
+  *len = strtoul(hdr, NULL, 10);
+  char *buf = malloc(*len + 1);
+  if (!buf)
+    error("out of memory");
+  if (!read_full(0, buf, *len))
+    error("--serve: unexpected end of input");
+  buf[*len] = '\0';
+  return buf;
+}
+
+static char *read_tmpfile(FILE *fp, long *len) {
+  fseek(fp, 0, SEEK_END);
+  *len = ftell(fp);
+  rewind(fp);
+  char *buf = malloc(*len + 1);
+  if (!buf || fread(buf, 1, *len, fp) != *len)
+    error("--serve: cannot read job output");
+  return buf;
+}
+
+// Copies the output of a job from fd to stdout in frames until the
+// job closes it.
+static void forward_output(int fd) {
+  char buf[65536];
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      error("--serve: cannot read job output: %s", strerror(errno));
+    if (n == 0)
+      return;
+    printf("+%zd\n", n);
+    fwrite(buf, 1, n, stdout);
+    fflush(stdout);
+  }
+}
+
+static void run_serve_job(StringArray *args, char *src, size_t src_len,
+                          int out, FILE *err, FILE *cache) {
+  // The client kills the server if a job takes too long, and the job
+  // must not go on without it.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  int fd = open("/dev/null", O_RDONLY);
+  dup2(fd, 0);
+  dup2(out, 1);
+  dup2(fileno(err), 2);
+  close(fd);
+  close(out);
+
+  opt_serve = false;
+  cache_all_tokens = true;
+  strarray_push(args, NULL);
+  parse_args(args->len - 1, args->data);
+
+  if (src) {
+    if (!base_file)
+      error("--serve: source text requires -cc1-input");
+    set_file_contents(base_file, src, src_len);
+  }
+
+  cc1_main(args->data[0]);
+  print_token_cache(cache, in_std_include_path);
+  exit(0);
+}
+
+static void serve(char *argv0) {
+  for (;;) {
+    size_t len;
+    char *buf = read_frame(&len);
+    if (!buf)
+      return;
+
+    StringArray args = {};
+    strarray_push(&args, argv0);
+    strarray_push(&args, "-cc1");
+
+    char *src = NULL;
+    size_t src_len = 0;
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+      if (!*p) {
+        src = p + 1;
+        src_len = buf + len - src;
+        break;
+      }
+      strarray_push(&args, p);
+    }
+
+    int out[2];
+    if (pipe(out) == -1)
+      error("--serve: pipe failed: %s", strerror(errno));
+    FILE *err = tmpfile();
+    FILE *cache = tmpfile();
+    if (!err || !cache)
+      error("--serve: tmpfile failed: %s", strerror(errno));
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == -1)
+      error("--serve: fork failed: %s", strerror(errno));
+    if (pid == 0) {
+      close(out[0]);
+      run_serve_job(&args, src, src_len, out[1], err, cache);
+    }
+
+    close(out[1]);
+    forward_output(out[0]);
+    close(out[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+      if (errno != EINTR)
+        error("--serve: waitpid failed: %s", strerror(errno));
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    long err_len;
+    char *err_buf = read_tmpfile(err, &err_len);
+    printf("%d %ld\n", code, err_len);
+    fwrite(err_buf, 1, err_len, stdout);
+    fflush(stdout);
+
+    if (code == 0)
+      preload_token_report(cache);
+
+    fclose(err);
+    fclose(cache);
+    free(err_buf);
+    free(args.data);
+    free(buf);
+  }
+}
+
 static FileType get_file_type(char *filename) {
   if (opt_x != FILE_NONE)
     return opt_x;
@@ -724,6 +1830,8 @@ static FileType get_file_type(char *filename) {
     return FILE_OBJ;
   if (endswith(filename, ".c"))
     return FILE_C;
+  if (endswith(filename, ".h"))
+    return FILE_C_HEADER;
   if (endswith(filename, ".s"))
     return FILE_ASM;
 
@@ -735,9 +1843,20 @@ int main(int argc, char **argv) {
   init_macros();
   parse_args(argc, argv);
 
+  if (opt_cache_stats) {
+    if (!opt_cache_dir)
+      error("--cache-stats requires -fcache-dir");
+    print_cache_stats(stdout);
+    return 0;
+  }
+
+  if (opt_serve) {
+    serve(argv[0]);
+    return 0;
+  }
+
   if (opt_cc1) {
-    add_default_include_paths(argv[0]);
-    cc1();
+    cc1_main(argv[0]);
     return 0;
   }
 
@@ -746,6 +1865,15 @@ int main(int argc, char **argv) {
 
   StringArray ld_args = {};
 
+  for (int i = 0; i < input_paths.len; i++) {
+    char *input = input_paths.data[i];
+    if (strncmp(input, "-l", 2) && strncmp(input, "-Wl,", 4)) {
+      FileType type = get_file_type(input);
+      if (type == FILE_C || type == FILE_C_HEADER)
+        nr_tus++;
+    }
+  }
+
   for (int i = 0; i < input_paths.len; i++) {
     char *input = input_paths.data[i];
 
@@ -782,42 +1910,78 @@ int main(int argc, char **argv) {
 
     // Handle .s
     if (type == FILE_ASM) {
-      if (!opt_S)
+      if (!opt_S && start_job(input)) {
         assemble(input, output);
+        end_job();
+      }
+      continue;
+    }
+
+    // Precompile a header. With -M, a header is just a C file.
+    if (type == FILE_C_HEADER && !opt_M) {
+      if (start_job(input)) {
+        run_cc1(argc, argv, input, opt_o ? opt_o : format("%s.pch", input),
+                "-cc1-emit-pch");
+        end_job();
+      }
       continue;
     }
 
-    assert(type == FILE_C);
+    assert(type == FILE_C || type == FILE_C_HEADER);
 
     // Just preprocess
     if (opt_E || opt_M) {
-      run_cc1(argc, argv, input, NULL);
+      wait_all_jobs();
+      run_cc1(argc, argv, input, NULL, NULL);
       continue;
     }
 
     // Compile
     if (opt_S) {
-      run_cc1(argc, argv, input, output);
+      if (start_job(input)) {
+        run_cc1(argc, argv, input, output, NULL);
+        end_job();
+      }
       continue;
     }
 
     // Compile and assemble
     if (opt_c) {
-      char *tmp = create_tmpfile();
-      run_cc1(argc, argv, input, tmp);
-      assemble(tmp, output);
+      char *tmp = (opt_integrated_as || opt_pipe) ? NULL : create_tmpfile();
+      if (start_job(input)) {
+        if (opt_integrated_as) {
+          run_cc1(argc, argv, input, output, "-cc1-emit-obj");
+        } else if (opt_pipe) {
+          run_cc1_pipe(argc, argv, input, output);
+        } else {
+          run_cc1(argc, argv, input, tmp, NULL);
+          assemble(tmp, output);
+        }
+        end_job();
+      }
       continue;
     }
 
     // Compile, assemble and link
-    char *tmp1 = create_tmpfile();
+    char *tmp1 = (opt_integrated_as || opt_pipe) ? NULL : create_tmpfile();
     char *tmp2 = create_tmpfile();
-    run_cc1(argc, argv, input, tmp1);
-    assemble(tmp1, tmp2);
+    if (start_job(input)) {
+      if (opt_integrated_as) {
+        run_cc1(argc, argv, input, tmp2, "-cc1-emit-obj");
+      } else if (opt_pipe) {
+        run_cc1_pipe(argc, argv, input, tmp2);
+      } else {
+        run_cc1(argc, argv, input, tmp1, NULL);
+        assemble(tmp1, tmp2);
+      }
+      end_job();
+    }
     strarray_push(&ld_args, tmp2);
     continue;
   }
 
+  wait_all_jobs();
+
   if (ld_args.len > 0)
     run_linker(&ld_args, opt_o ? opt_o : "a.out");
   return 0;
@@ -0,0 +1,59 @@
+// This file implements the pass manager that runs the middle-end passes
+// between parse() and the code generators.
+//
+// Both backends consume the AST, so the passes are AST-to-AST
+// transformations. Each pass is listed in `passes` in the order it
+// runs, together with the lowest -O level at which it is enabled and
+// an optional flag such as -fno-inline that turns it off. A pass may
+// also provide a per-function entry point, which is used by
+// -fstream-codegen to optimize a function right before it is compiled;
+// passes that need to see the whole program don't run in that mode.
+
+#include "chibicc.h"
+
+bool opt_dump_passes;
+
+typedef struct {
+  char *name;
+  int level;
+  bool *flag;
+  void (*run)(Obj *prog);
+  void (*run_fn)(Obj *fn);
+} Pass;
+
+static Pass passes[] = {
+  {"fold", 0, NULL, fold, fold_function},
+  {"inline", 0, &opt_finline, inline_functions, NULL},
+  {"vectorize", 2, &opt_ftree_vectorize, vectorize, vectorize_function},
+  {"cse", 1, &opt_fcse, cse, cse_function},
+};
+
+static bool is_enabled(Pass *p) {
+  return opt_O >= p->level && (!p->flag || *p->flag);
+}
+
+static void dump_passes(void) {
+  bool streaming = opt_stream_codegen;
+  for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++) {
+    Pass *p = &passes[i];
+    if (is_enabled(p) && (!streaming || p->run_fn))
+      fprintf(stderr, "%s\n", p->name);
+  }
+}
+
+// In streaming mode, this is called after the functions have been
+// compiled with optimize_function().
+void optimize(Obj *prog) {
+  if (opt_dump_passes)
+    dump_passes();
+
+  for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++)
+    if (is_enabled(&passes[i]))
+      passes[i].run(prog);
+}
+
+void optimize_function(Obj *fn) {
+  for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++)
+    if (is_enabled(&passes[i]) && passes[i].run_fn)
+      passes[i].run_fn(fn);
+}
@@ -0,0 +1,110 @@
+// This file generates code for functions on a pool of threads.
+//
+// The code generators don't share state between functions, so we can
+// compile functions independently. Each function is written to its
+// own memory buffer, and the buffers are concatenated in the original
+// order, so the output is the same regardless of how many threads are
+// used or how they are scheduled.
+
+#include "chibicc.h"
+#include <pthread.h>
+
+// We don't spawn threads for TUs with fewer functions than this
+// because it wouldn't pay off.
+#define MIN_PARALLEL_FUNCS 64
+#define MAX_AUTO_THREADS 8
+
+// The number of threads for code generation. 0 means automatic.
+int opt_codegen_threads;
+
+typedef struct {
+  Obj *fn;
+  char *buf;
+  size_t len;
+} Task;
+
+static Task *tasks;
+static int ntasks;
+static int next_task;
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*gen_task)(Obj *fn, FILE *out);
+
+static void *worker(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&task_lock);
+    int i = next_task++;
+    pthread_mutex_unlock(&task_lock);
+
+    if (i >= ntasks)
+      return NULL;
+
+    Task *t = &tasks[i];
+    if (t->buf)
+      continue;
+
+    FILE *out = open_memstream(&t->buf, &t->len);
+    gen_task(t->fn, out);
+    fclose(out);
+  }
+}
+
+static int num_threads(int nfuncs) {
+  if (opt_codegen_threads)
+    return MIN(opt_codegen_threads, nfuncs);
+  if (nfuncs < MIN_PARALLEL_FUNCS)
+    return 1;
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  return MAX(1, MIN(ncpu, MAX_AUTO_THREADS));
+}
+
+// Calls gen() for each live function definition in `prog` and writes
+// the results to `out` in order.
+void gen_functions(Obj *prog, FILE *out, void (*gen)(Obj *fn, FILE *out)) {
+  int nfuncs = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && fn->is_live)
+      nfuncs++;
+
+  int nthreads = num_threads(nfuncs);
+  if (nthreads <= 1) {
+    for (Obj *fn = prog; fn; fn = fn->next) {
+      if (!fn->is_function || !fn->is_definition || !fn->is_live)
+        continue;
+      if (fn->asm_text)
+        fwrite(fn->asm_text, fn->asm_len, 1, out);
+      else
+        gen(fn, out);
+    }
+    return;
+  }
+
+  tasks = calloc(nfuncs, sizeof(Task));
+  ntasks = 0;
+  next_task = 0;
+  gen_task = gen;
+
+  // Functions generated by -fstream-codegen already have their code.
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition || !fn->is_live)
+      continue;
+    Task *t = &tasks[ntasks++];
+    t->fn = fn;
+    t->buf = fn->asm_text;
+    t->len = fn->asm_len;
+  }
+
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, worker, NULL))
+      error("pthread_create failed: %s", strerror(errno));
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < ntasks; i++) {
+    fwrite(tasks[i].buf, tasks[i].len, 1, out);
+    free(tasks[i].buf);
+  }
+  free(tasks);
+  free(threads);
+}
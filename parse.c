@@ -27,15 +27,25 @@ typedef struct {
   int enum_val;
 } VarScope;
 
-// Represents a block scope.
-typedef struct Scope Scope;
-struct Scope {
-  Scope *next;
-
-  // C has two block scopes; one is for variables/typedefs and
-  // the other is for struct/union/enum tags.
-  HashMap vars;
-  HashMap tags;
+// All identifiers live in a single table regardless of the block
+// they are declared in. Each identifier has a stack of bindings; the
+// top of the stack is the innermost declaration, which shadows the
+// ones below it. So a lookup is one hash probe no matter how deeply
+// blocks are nested.
+typedef struct Binding Binding;
+struct Binding {
+  Binding *next; // Shadowed binding in an outer scope
+  int depth;     // Block nesting depth of the declaration
+  void *val;     // VarScope or Type
+};
+
+// C has two name spaces for ordinary identifiers; one is for
+// variables/typedefs and the other is for struct/union/enum tags.
+typedef struct Ident Ident;
+struct Ident {
+  Binding *var;
+  Binding *tag;
+  bool is_type_keyword; // True if this is a keyword that begins a type
 };
 
 // Variable attributes such as typedef or extern.
@@ -48,9 +58,26 @@ typedef struct {
   int align;
 } VarAttr;
 
+// The contents of a global variable being initialized. Values are
+// written to `buf` as soon as they are parsed.
+typedef struct {
+  char *buf;
+  int size;       // Allocated size of `buf`
+  int end;        // End of the written part of `buf`
+  Relocation *rels;
+  int nrels;
+  int cap;
+  bool is_sorted; // True if `rels` are in the order of offsets
+} GvarData;
+
 // This struct represents a variable initializer. Since initializers
 // can be nested (e.g. `int x[2][2] = {{1, 2}, {3, 4}}`), this struct
 // is a tree data structure.
+//
+// Children are created only for the elements and members that are
+// actually initialized, so `char x[1 << 24] = {[5] = 1}` needs only
+// two nodes. Scalars of global variables are written to GvarData right
+// away and aren't kept in the tree at all.
 typedef struct Initializer Initializer;
 struct Initializer {
   Initializer *next;
@@ -58,17 +85,27 @@ struct Initializer {
   Token *tok;
   bool is_flexible;
 
+  int idx;          // Index of the element or member in the parent
+  int offset;       // Offset from the beginning of the variable
+  Member *bitfield; // Set if it initializes a bitfield
+
   // If it's not an aggregate type and has an initializer,
   // `expr` has an initialization expression.
   Node *expr;
 
   // If it's an initializer for an aggregate type (e.g. array or struct),
-  // `children` has initializers for its children.
+  // `children` has initializers for its children in the order of
+  // their indices.
   Initializer **children;
+  int nchildren;
+  int cap;
 
   // Only one member can be initialized for a union.
   // `mem` is used to clarify which member is initialized.
   Member *mem;
+
+  // Set if it initializes a global variable
+  GvarData *data;
 };
 
 // For local variable initializer.
@@ -87,7 +124,17 @@ static Obj *locals;
 // Likewise, global variables are accumulated to this list.
 static Obj *globals;
 
-static Scope *scope = &(Scope){};
+// The current block nesting depth. 0 is the file scope.
+static int scope_depth;
+
+// Bindings pushed to the identifier table, in order. On leaving a
+// block, the bindings made in it are popped using this log.
+static Binding ***undo_log;
+static int undo_len;
+static int undo_cap;
+
+// Popped bindings are recycled.
+static Binding *free_bindings;
 
 // Points to the function object the parser is currently parsing.
 static Obj *current_fn;
@@ -117,7 +164,8 @@ static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr);
 static void array_initializer2(Token **rest, Token *tok, Initializer *init, int i);
 static void struct_initializer2(Token **rest, Token *tok, Initializer *init, Member *mem);
 static void initializer2(Token **rest, Token *tok, Initializer *init);
-static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_ty);
+static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_ty,
+                               GvarData *data);
 static Node *lvar_initializer(Token **rest, Token *tok, Obj *var);
 static void gvar_initializer(Token **rest, Token *tok, Obj *var);
 static Node *compound_stmt(Token **rest, Token *tok);
@@ -142,6 +190,7 @@ static Node *shift(Token **rest, Token *tok);
 static Node *add(Token **rest, Token *tok);
 static Node *new_add(Node *lhs, Node *rhs, Token *tok);
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok);
+static Node *vector_elem(Node *vec, Node *idx, Token *tok);
 static Node *mul(Token **rest, Token *tok);
 static Node *cast(Token **rest, Token *tok);
 static Member *get_struct_member(Type *ty, Token *tok);
@@ -161,36 +210,119 @@ static int align_down(int n, int align) {
 }
 
 static void enter_scope(void) {
-  Scope *sc = calloc(1, sizeof(Scope));
-  sc->next = scope;
-  scope = sc;
+  scope_depth++;
 }
 
 static void leave_scope(void) {
-  scope = scope->next;
+  scope_depth--;
+
+  while (undo_len > 0) {
+    Binding **slot = undo_log[undo_len - 1];
+    Binding *b = *slot;
+    if (b->depth <= scope_depth)
+      break;
+    *slot = b->next;
+    b->next = free_bindings;
+    free_bindings = b;
+    undo_len--;
+  }
+}
+
+static Ident *ident_entry(Atom *name) {
+  if (!name->ident)
+    name->ident = arena_alloc(ARENA_MISC, sizeof(Ident));
+  return name->ident;
+}
+
+static Ident *find_ident(Token *tok) {
+  return tok->atom ? tok->atom->ident : NULL;
+}
+
+// Binds a value to a name in the current scope. A binding in the same
+// scope is overwritten.
+static void bind(Binding **slot, void *val) {
+  if (*slot && (*slot)->depth == scope_depth) {
+    (*slot)->val = val;
+    return;
+  }
+
+  Binding *b = free_bindings;
+  if (b)
+    free_bindings = b->next;
+  else
+    b = arena_alloc(ARENA_MISC, sizeof(Binding));
+
+  *b = (Binding){*slot, scope_depth, val};
+  *slot = b;
+
+  if (undo_len == undo_cap) {
+    undo_cap = undo_cap ? undo_cap * 2 : 64;
+    undo_log = realloc(undo_log, sizeof(*undo_log) * undo_cap);
+  }
+  undo_log[undo_len++] = slot;
 }
 
 // Find a variable by name.
 static VarScope *find_var(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next) {
-    VarScope *sc2 = hashmap_get2(&sc->vars, tok->loc, tok->len);
-    if (sc2)
-      return sc2;
-  }
-  return NULL;
+  Ident *id = find_ident(tok);
+  return (id && id->var) ? id->var->val : NULL;
 }
 
 static Type *find_tag(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next) {
-    Type *ty = hashmap_get2(&sc->tags, tok->loc, tok->len);
-    if (ty)
-      return ty;
-  }
+  Ident *id = find_ident(tok);
+  return (id && id->tag) ? id->tag->val : NULL;
+}
+
+// Find a struct/union/enum tag declared in the current scope.
+static Type *find_tag_in_scope(Token *tok) {
+  Ident *id = find_ident(tok);
+  if (id && id->tag && id->tag->depth == scope_depth)
+    return id->tag->val;
   return NULL;
 }
 
-static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+#define NODE_SIZE(field) (offsetof(Node, field) + sizeof(((Node *)0)->field))
+
+// Returns the number of bytes a node of a given kind needs.
+static int node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    return NODE_SIZE(default_case);
+  case ND_CASE:
+  case ND_GOTO:
+  case ND_LABEL:
+  case ND_LABEL_VAL:
+    return NODE_SIZE(end);
+  case ND_FUNCALL:
+    return NODE_SIZE(ret_buffer);
+  case ND_CAS:
+    return NODE_SIZE(cas_new);
+  case ND_ATOMIC_OP:
+    return NODE_SIZE(atomic_op);
+  case ND_NUM:
+    return NODE_SIZE(fval);
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return NODE_SIZE(body);
+  case ND_MEMBER:
+    return NODE_SIZE(member);
+  case ND_VAR:
+  case ND_VLA_PTR:
+  case ND_MEMZERO:
+    return NODE_SIZE(var);
+  case ND_ASM:
+    return NODE_SIZE(asm_str);
+  }
+  return NODE_SIZE(rhs);
+}
+
+Node *new_node(NodeKind kind, Token *tok) {
+  Node *node = arena_alloc(ARENA_NODE, node_size(kind));
+  counters.nodes++;
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -230,6 +362,11 @@ static Node *new_ulong(long val, Token *tok) {
 }
 
 static Node *new_var_node(Obj *var, Token *tok) {
+  // Remember which globals a function refers to, so that we can
+  // omit unreachable ones. See mark_live().
+  if (!var->is_local && current_fn)
+    strarray_push(&current_fn->refs, var->name);
+
   Node *node = new_node(ND_VAR, tok);
   node->var = var;
   return node;
@@ -244,7 +381,15 @@ static Node *new_vla_ptr(Obj *var, Token *tok) {
 Node *new_cast(Node *expr, Type *ty) {
   add_type(expr);
 
-  Node *node = calloc(1, sizeof(Node));
+  // A vector can only be reinterpreted as another vector of the
+  // same size.
+  if ((expr->ty->kind == TY_VECTOR || ty->kind == TY_VECTOR) &&
+      ty->kind != TY_VOID &&
+      (expr->ty->kind != ty->kind || expr->ty->size != ty->size))
+    error_tok(expr->tok, "invalid conversion of a vector");
+
+  Node *node = arena_alloc(ARENA_NODE, node_size(ND_CAST));
+  counters.nodes++;
   node->kind = ND_CAST;
   node->tok = expr->tok;
   node->lhs = expr;
@@ -253,53 +398,233 @@ Node *new_cast(Node *expr, Type *ty) {
 }
 
 static VarScope *push_scope(char *name) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
-  hashmap_put(&scope->vars, name, sc);
+  VarScope *sc = arena_alloc(ARENA_MISC, sizeof(VarScope));
+  bind(&ident_entry(intern_atom(name, strlen(name)))->var, sc);
   return sc;
 }
 
+// If `is_flexible` is true, an array of unknown length gets its
+// length from the initializer, and so does the flexible array member
+// of a struct.
 static Initializer *new_initializer(Type *ty, bool is_flexible) {
-  Initializer *init = calloc(1, sizeof(Initializer));
+  Initializer *init = arena_alloc(ARENA_MISC, sizeof(Initializer));
   init->ty = ty;
 
-  if (ty->kind == TY_ARRAY) {
-    if (is_flexible && ty->size < 0) {
-      init->is_flexible = true;
-      return init;
-    }
+  if (ty->kind == TY_ARRAY)
+    init->is_flexible = is_flexible && ty->size < 0;
+  else if (ty->kind == TY_STRUCT || ty->kind == TY_UNION)
+    init->is_flexible = is_flexible && ty->is_flexible;
+  return init;
+}
 
-    init->children = calloc(ty->array_len, sizeof(Initializer *));
-    for (int i = 0; i < ty->array_len; i++)
-      init->children[i] = new_initializer(ty->base, false);
-    return init;
+static bool is_aggregate(Type *ty) {
+  TypeKind k = ty->kind;
+  return k == TY_ARRAY || k == TY_STRUCT || k == TY_UNION || k == TY_VECTOR;
+}
+
+// Returns the position of the child with a given index in `children`,
+// or where it would be inserted.
+static int find_child_pos(Initializer *init, int idx) {
+  int lo = 0, hi = init->nchildren;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (init->children[mid]->idx < idx)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return lo;
+}
 
-  if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    // Count the number of struct members.
-    int len = 0;
-    for (Member *mem = ty->members; mem; mem = mem->next)
-      len++;
+static Initializer *find_child(Initializer *init, int idx) {
+  int i = find_child_pos(init, idx);
+  if (i < init->nchildren && init->children[i]->idx == idx)
+    return init->children[i];
+  return NULL;
+}
 
-    init->children = calloc(len, sizeof(Initializer *));
+// Returns the initializer of a child of an aggregate, creating it on
+// first use.
+static Initializer *get_child(Initializer *init, int idx, Type *ty, int offset,
+                              bool is_flexible) {
+  int i = find_child_pos(init, idx);
+  if (i < init->nchildren && init->children[i]->idx == idx)
+    return init->children[i];
 
-    for (Member *mem = ty->members; mem; mem = mem->next) {
-      if (is_flexible && ty->is_flexible && !mem->next) {
-        Initializer *child = calloc(1, sizeof(Initializer));
-        child->ty = mem->ty;
-        child->is_flexible = true;
-        init->children[mem->idx] = child;
-      } else {
-        init->children[mem->idx] = new_initializer(mem->ty, false);
-      }
+  Initializer *child = new_initializer(ty, false);
+  child->idx = idx;
+  child->offset = init->offset + offset;
+  child->is_flexible = is_flexible;
+  child->data = init->data;
+  if (init->data && !is_aggregate(ty))
+    return child;
+
+  if (init->nchildren == init->cap) {
+    init->cap = init->cap ? init->cap * 2 : 4;
+    init->children = realloc(init->children, sizeof(Initializer *) * init->cap);
+  }
+  memmove(init->children + i + 1, init->children + i,
+          sizeof(Initializer *) * (init->nchildren - i));
+  init->children[i] = child;
+  init->nchildren++;
+  return child;
+}
+
+static Initializer *elem_init(Initializer *init, int i) {
+  Type *elem = (init->ty->kind == TY_ARRAY) ? init->ty->base : init->ty->elem;
+  return get_child(init, i, elem, elem->size * i, false);
+}
+
+static Initializer *member_init(Initializer *init, Member *mem) {
+  Initializer *child = get_child(init, mem->idx, mem->ty, mem->offset,
+                                 init->is_flexible && !mem->next);
+  if (mem->is_bitfield)
+    child->bitfield = mem;
+  return child;
+}
+
+// Gives an array of unknown length a length.
+static void set_array_len(Initializer *init, int len) {
+  init->ty = array_of(init->ty->base, len);
+  init->is_flexible = false;
+}
+
+static uint64_t read_buf(char *buf, int sz) {
+  if (sz == 1)
+    return *buf;
+  if (sz == 2)
+    return *(uint16_t *)buf;
+  if (sz == 4)
+    return *(uint32_t *)buf;
+  if (sz == 8)
+    return *(uint64_t *)buf;
+  unreachable();
+}
+
+static void write_buf(char *buf, uint64_t val, int sz) {
+  if (sz == 1)
+    *buf = val;
+  else if (sz == 2)
+    *(uint16_t *)buf = val;
+  else if (sz == 4)
+    *(uint32_t *)buf = val;
+  else if (sz == 8)
+    *(uint64_t *)buf = val;
+  else
+    unreachable();
+}
+
+static void grow_gvar_data(GvarData *data, int size) {
+  if (data->size < size) {
+    size = MAX(size, data->size * 2);
+    data->buf = realloc(data->buf, size);
+    memset(data->buf + data->size, 0, size - data->size);
+    data->size = size;
+  }
+}
+
+// Makes `len` bytes at `offset` of a global variable writable. Since
+// designators may go back, a range may have been written before, in
+// which case relocations in it are removed. Relocations are 8 bytes.
+static void reserve_gvar_data(GvarData *data, int offset, int len) {
+  int end = offset + len;
+  grow_gvar_data(data, end);
+
+  Relocation *last = data->nrels ? &data->rels[data->nrels - 1] : NULL;
+  bool overlaps = last && (!data->is_sorted || offset < last->offset + 8);
+
+  if (offset < data->end && overlaps) {
+    int n = 0;
+    for (int i = 0; i < data->nrels; i++) {
+      Relocation *rel = &data->rels[i];
+      if (rel->offset + 8 <= offset || end <= rel->offset)
+        data->rels[n++] = *rel;
     }
-    return init;
+    data->nrels = n;
   }
+  data->end = MAX(data->end, end);
+}
 
-  return init;
+static void add_gvar_reloc(GvarData *data, int offset, char **label, long addend) {
+  if (data->nrels == data->cap) {
+    data->cap = data->cap ? data->cap * 2 : 16;
+    data->rels = realloc(data->rels, sizeof(Relocation) * data->cap);
+  }
+  if (data->nrels && offset < data->rels[data->nrels - 1].offset)
+    data->is_sorted = false;
+  data->rels[data->nrels++] = (Relocation){NULL, offset, label, addend};
+}
+
+// Initializers for global variables are evaluated at compile-time and
+// embedded to .data section. This function writes the value of a
+// scalar to the variable's data. It is a compile error if the value
+// is not a constant expression.
+static void write_gvar_scalar(Initializer *init) {
+  GvarData *data = init->data;
+  Type *ty = init->ty;
+  reserve_gvar_data(data, init->offset, ty->size);
+  char *loc = data->buf + init->offset;
+
+  if (init->bitfield) {
+    Member *mem = init->bitfield;
+    uint64_t mask = ((1L << mem->bit_width) - 1) << mem->bit_offset;
+    uint64_t val = eval(init->expr) << mem->bit_offset;
+    write_buf(loc, (read_buf(loc, ty->size) & ~mask) | (val & mask), ty->size);
+    return;
+  }
+
+  if (ty->kind == TY_FLOAT) {
+    *(float *)loc = eval_double(init->expr);
+    return;
+  }
+
+  if (ty->kind == TY_DOUBLE) {
+    *(double *)loc = eval_double(init->expr);
+    return;
+  }
+
+  char **label = NULL;
+  uint64_t val = eval2(init->expr, &label);
+
+  if (label) {
+    memset(loc, 0, ty->size);
+    add_gvar_reloc(data, init->offset, label, val);
+    return;
+  }
+  write_buf(loc, val, ty->size);
 }
 
+// Only one member of a union has a value. If an initializer switches
+// to another member, the value of the previous one is discarded.
+static void set_union_member(Initializer *init, Member *mem) {
+  if (init->data && init->mem && init->mem != mem) {
+    reserve_gvar_data(init->data, init->offset, init->ty->size);
+    memset(init->data->buf + init->offset, 0, init->ty->size);
+  }
+  init->mem = mem;
+}
+
+static int reloc_offset_cmp(const void *a, const void *b) {
+  return ((Relocation *)a)->offset - ((Relocation *)b)->offset;
+}
+
+static void gvar_initializer(Token **rest, Token *tok, Obj *var) {
+  GvarData data = {.is_sorted = true};
+  initializer(rest, tok, var->ty, &var->ty, &data);
+
+  grow_gvar_data(&data, MAX(var->ty->size, 1));
+  var->init_data = data.buf;
+
+  if (!data.is_sorted)
+    qsort(data.rels, data.nrels, sizeof(Relocation), reloc_offset_cmp);
+  for (int i = 0; i + 1 < data.nrels; i++)
+    data.rels[i].next = &data.rels[i + 1];
+  var->rel = data.nrels ? data.rels : NULL;
+}
+
+
 static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+  Obj *var = arena_alloc(ARENA_OBJ, sizeof(Obj));
   var->name = name;
   var->ty = ty;
   var->align = ty->align;
@@ -355,7 +680,7 @@ static Type *find_typedef(Token *tok) {
 }
 
 static void push_tag_scope(Token *tok, Type *ty) {
-  hashmap_put2(&scope->tags, tok->loc, tok->len, ty);
+  bind(&ident_entry(tok->atom)->tag, ty);
 }
 
 // declspec = ("void" | "_Bool" | "char" | "short" | "int" | "long"
@@ -400,6 +725,7 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
   Type *ty = ty_int;
   int counter = 0;
   bool is_atomic = false;
+  bool is_volatile = false;
 
   while (is_typename(tok)) {
     // Handle storage class specifiers.
@@ -427,9 +753,13 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
       continue;
     }
 
+    if (consume(&tok, tok, "volatile")) {
+      is_volatile = true;
+      continue;
+    }
+
     // These keywords are recognized but ignored.
-    if (consume(&tok, tok, "const") || consume(&tok, tok, "volatile") ||
-        consume(&tok, tok, "auto") || consume(&tok, tok, "register") ||
+    if (consume(&tok, tok, "const") || consume(&tok, tok, "auto") || consume(&tok, tok, "register") ||
         consume(&tok, tok, "restrict") || consume(&tok, tok, "__restrict") ||
         consume(&tok, tok, "__restrict__") || consume(&tok, tok, "_Noreturn"))
       continue;
@@ -575,6 +905,9 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
     ty->is_atomic = true;
   }
 
+  if (is_volatile)
+    ty = volatile_of(ty);
+
   *rest = tok;
   return ty;
 }
@@ -669,17 +1002,67 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 static Type *pointers(Token **rest, Token *tok, Type *ty) {
   while (consume(&tok, tok, "*")) {
     ty = pointer_to(ty);
-    while (equal(tok, "const") || equal(tok, "volatile") || equal(tok, "restrict") ||
-           equal(tok, "__restrict") || equal(tok, "__restrict__"))
-      tok = tok->next;
+    for (;;) {
+      if (consume(&tok, tok, "volatile"))
+        ty = volatile_of(ty);
+      else if (equal(tok, "const") || equal(tok, "restrict") ||
+               equal(tok, "__restrict") || equal(tok, "__restrict__"))
+        tok = tok->next;
+      else
+        break;
+    }
   }
   *rest = tok;
   return ty;
 }
 
-// declarator = pointers ("(" ident ")" | "(" declarator ")" | ident) type-suffix
+// vector-attribute = ("__attribute__" | "__attribute")
+//                    "(" "(" "vector_size" "(" const-expr ")" ")" ")"
+//
+// Since glibc's <sys/cdefs.h> defines `__attribute__` away for
+// compilers other than GCC and Clang, headers should use the
+// `__attribute` spelling instead.
+static Type *vector_attribute(Token **rest, Token *tok, Type *ty) {
+  if (!equal(tok, "__attribute__") && !equal(tok, "__attribute")) {
+    *rest = tok;
+    return ty;
+  }
+
+  tok = skip(tok->next, "(");
+  tok = skip(tok, "(");
+  if (!equal(tok, "vector_size") && !equal(tok, "__vector_size__"))
+    error_tok(tok, "unknown attribute");
+  tok = skip(tok->next, "(");
+
+  Token *start = tok;
+  int size = const_expr(&tok, tok);
+  tok = skip(tok, ")");
+  tok = skip(tok, ")");
+  *rest = skip(tok, ")");
+
+  switch (ty->kind) {
+  case TY_CHAR:
+  case TY_SHORT:
+  case TY_INT:
+  case TY_LONG:
+  case TY_FLOAT:
+  case TY_DOUBLE:
+    break;
+  default:
+    error_tok(start, "invalid vector element type");
+  }
+
+  if (size != 16)
+    error_tok(start, "only 16-byte vectors are supported");
+  return vector_of(ty, size);
+}
+
+// declarator = pointers vector-attribute?
+//              ("(" ident ")" | "(" declarator ")" | ident)
+//              type-suffix vector-attribute?
 static Type *declarator(Token **rest, Token *tok, Type *ty) {
   ty = pointers(&tok, tok, ty);
+  ty = vector_attribute(&tok, tok, ty);
 
   if (equal(tok, "(")) {
     Token *start = tok;
@@ -698,7 +1081,8 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
     tok = tok->next;
   }
 
-  ty = type_suffix(rest, tok, ty);
+  ty = type_suffix(&tok, tok, ty);
+  ty = vector_attribute(rest, tok, ty);
   ty->name = name;
   ty->name_pos = name_pos;
   return ty;
@@ -837,6 +1221,7 @@ static Node *new_alloca(Node *sz) {
   node->ty = builtin_alloca->ty->return_ty;
   node->args = sz;
   add_type(sz);
+  current_fn->uses_alloca = true;
   return node;
 }
 
@@ -921,31 +1306,21 @@ static Token *skip_excess_element(Token *tok) {
 // string-initializer = string-literal
 static void string_initializer(Token **rest, Token *tok, Initializer *init) {
   if (init->is_flexible)
-    *init = *new_initializer(array_of(init->ty->base, tok->ty->array_len), false);
-
-  int len = MIN(init->ty->array_len, tok->ty->array_len);
-
-  switch (init->ty->base->size) {
-  case 1: {
-    char *str = tok->str;
-    for (int i = 0; i < len; i++)
-      init->children[i]->expr = new_num(str[i], tok);
-    break;
-  }
-  case 2: {
-    uint16_t *str = (uint16_t *)tok->str;
-    for (int i = 0; i < len; i++)
-      init->children[i]->expr = new_num(str[i], tok);
-    break;
-  }
-  case 4: {
-    uint32_t *str = (uint32_t *)tok->str;
-    for (int i = 0; i < len; i++)
-      init->children[i]->expr = new_num(str[i], tok);
-    break;
-  }
-  default:
-    unreachable();
+    set_array_len(init, tok->lit->ty->array_len);
+
+  int len = MIN(init->ty->array_len, tok->lit->ty->array_len);
+  int sz = init->ty->base->size;
+  GvarData *data = init->data;
+
+  for (int i = 0; i < len; i++) {
+    uint64_t c = read_buf(tok->lit->str + sz * i, sz);
+    if (data) {
+      int offset = init->offset + sz * i;
+      reserve_gvar_data(data, offset, sz);
+      write_buf(data->buf + offset, c, sz);
+    } else {
+      elem_init(init, i)->expr = new_num(c, tok);
+    }
   }
 
   *rest = tok->next;
@@ -1032,14 +1407,14 @@ static void designation(Token **rest, Token *tok, Initializer *init) {
 
     Token *tok2;
     for (int i = begin; i <= end; i++)
-      designation(&tok2, tok, init->children[i]);
+      designation(&tok2, tok, elem_init(init, i));
     array_initializer2(rest, tok2, init, begin + 1);
     return;
   }
 
   if (equal(tok, ".") && init->ty->kind == TY_STRUCT) {
     Member *mem = struct_designator(&tok, tok, init->ty);
-    designation(&tok, tok, init->children[mem->idx]);
+    designation(&tok, tok, member_init(init, mem));
     init->expr = NULL;
     struct_initializer2(rest, tok, init, mem->next);
     return;
@@ -1047,8 +1422,8 @@ static void designation(Token **rest, Token *tok, Initializer *init) {
 
   if (equal(tok, ".") && init->ty->kind == TY_UNION) {
     Member *mem = struct_designator(&tok, tok, init->ty);
-    init->mem = mem;
-    designation(rest, tok, init->children[mem->idx]);
+    set_union_member(init, mem);
+    designation(rest, tok, member_init(init, mem));
     return;
   }
 
@@ -1094,18 +1469,11 @@ static int count_array_init_elements(Token *tok, Type *ty) {
 static void array_initializer1(Token **rest, Token *tok, Initializer *init) {
   tok = skip(tok, "{");
 
-  if (init->is_flexible) {
-    int len = count_array_init_elements(tok, init->ty);
-    *init = *new_initializer(array_of(init->ty->base, len), false);
-  }
+  if (init->is_flexible)
+    set_array_len(init, count_array_init_elements(tok, init->ty));
 
   bool first = true;
 
-  if (init->is_flexible) {
-    int len = count_array_init_elements(tok, init->ty);
-    *init = *new_initializer(array_of(init->ty->base, len), false);
-  }
-
   for (int i = 0; !consume_end(rest, tok); i++) {
     if (!first)
       tok = skip(tok, ",");
@@ -1117,14 +1485,14 @@ static void array_initializer1(Token **rest, Token *tok, Initializer *init) {
 
       Token *tok2;
       for (int j = begin; j <= end; j++)
-        designation(&tok2, tok, init->children[j]);
+        designation(&tok2, tok, elem_init(init, j));
       tok = tok2;
       i = end;
       continue;
     }
 
     if (i < init->ty->array_len)
-      initializer2(&tok, tok, init->children[i]);
+      initializer2(&tok, tok, elem_init(init, i));
     else
       tok = skip_excess_element(tok);
   }
@@ -1132,10 +1500,8 @@ static void array_initializer1(Token **rest, Token *tok, Initializer *init) {
 
 // array-initializer2 = initializer ("," initializer)*
 static void array_initializer2(Token **rest, Token *tok, Initializer *init, int i) {
-  if (init->is_flexible) {
-    int len = count_array_init_elements(tok, init->ty);
-    *init = *new_initializer(array_of(init->ty->base, len), false);
-  }
+  if (init->is_flexible)
+    set_array_len(init, count_array_init_elements(tok, init->ty));
 
   for (; i < init->ty->array_len && !is_end(tok); i++) {
     Token *start = tok;
@@ -1147,11 +1513,26 @@ static void array_initializer2(Token **rest, Token *tok, Initializer *init, int
       return;
     }
 
-    initializer2(&tok, tok, init->children[i]);
+    initializer2(&tok, tok, elem_init(init, i));
   }
   *rest = tok;
 }
 
+// vector-initializer = "{" initializer ("," initializer)* ","? "}"
+static void vector_initializer(Token **rest, Token *tok, Initializer *init) {
+  tok = skip(tok, "{");
+
+  for (int i = 0; !consume_end(rest, tok); i++) {
+    if (i > 0)
+      tok = skip(tok, ",");
+
+    if (i < init->ty->array_len)
+      initializer2(&tok, tok, elem_init(init, i));
+    else
+      tok = skip_excess_element(tok);
+  }
+}
+
 // struct-initializer1 = "{" initializer ("," initializer)* ","? "}"
 static void struct_initializer1(Token **rest, Token *tok, Initializer *init) {
   tok = skip(tok, "{");
@@ -1166,13 +1547,13 @@ static void struct_initializer1(Token **rest, Token *tok, Initializer *init) {
 
     if (equal(tok, ".")) {
       mem = struct_designator(&tok, tok, init->ty);
-      designation(&tok, tok, init->children[mem->idx]);
+      designation(&tok, tok, member_init(init, mem));
       mem = mem->next;
       continue;
     }
 
     if (mem) {
-      initializer2(&tok, tok, init->children[mem->idx]);
+      initializer2(&tok, tok, member_init(init, mem));
       mem = mem->next;
     } else {
       tok = skip_excess_element(tok);
@@ -1196,7 +1577,7 @@ static void struct_initializer2(Token **rest, Token *tok, Initializer *init, Mem
       return;
     }
 
-    initializer2(&tok, tok, init->children[mem->idx]);
+    initializer2(&tok, tok, member_init(init, mem));
   }
   *rest = tok;
 }
@@ -1207,20 +1588,21 @@ static void union_initializer(Token **rest, Token *tok, Initializer *init) {
   // You can initialize other member using a designated initializer.
   if (equal(tok, "{") && equal(tok->next, ".")) {
     Member *mem = struct_designator(&tok, tok->next, init->ty);
-    init->mem = mem;
-    designation(&tok, tok, init->children[mem->idx]);
+    set_union_member(init, mem);
+    designation(&tok, tok, member_init(init, mem));
     *rest = skip(tok, "}");
     return;
   }
 
-  init->mem = init->ty->members;
+  Member *mem = init->ty->members;
+  set_union_member(init, mem);
 
   if (equal(tok, "{")) {
-    initializer2(&tok, tok->next, init->children[0]);
+    initializer2(&tok, tok->next, member_init(init, mem));
     consume(&tok, tok, ",");
     *rest = skip(tok, "}");
   } else {
-    initializer2(rest, tok, init->children[0]);
+    initializer2(rest, tok, member_init(init, mem));
   }
 }
 
@@ -1266,6 +1648,19 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
     return;
   }
 
+  // A vector is initialized either with another vector or with a
+  // brace-enclosed list of elements.
+  if (init->ty->kind == TY_VECTOR) {
+    if (equal(tok, "{")) {
+      vector_initializer(rest, tok, init);
+      return;
+    }
+    init->expr = assign(rest, tok);
+    if (init->data)
+      error_tok(init->expr->tok, "initializer element is not constant");
+    return;
+  }
+
   if (equal(tok, "{")) {
     // An initializer for a scalar variable can be surrounded by
     // braces. E.g. `int x = {3};`. Handle that case.
@@ -1275,6 +1670,8 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
   }
 
   init->expr = assign(rest, tok);
+  if (init->data)
+    write_gvar_scalar(init);
 }
 
 static Type *copy_struct_type(Type *ty) {
@@ -1283,7 +1680,7 @@ static Type *copy_struct_type(Type *ty) {
   Member head = {};
   Member *cur = &head;
   for (Member *mem = ty->members; mem; mem = mem->next) {
-    Member *m = calloc(1, sizeof(Member));
+    Member *m = arena_alloc(ARENA_MEMBER, sizeof(Member));
     *m = *mem;
     cur = cur->next = m;
   }
@@ -1292,8 +1689,10 @@ static Type *copy_struct_type(Type *ty) {
   return ty;
 }
 
-static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_ty) {
+static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_ty,
+                               GvarData *data) {
   Initializer *init = new_initializer(ty, true);
+  init->data = data;
   initializer2(rest, tok, init);
 
   if ((ty->kind == TY_STRUCT || ty->kind == TY_UNION) && ty->is_flexible) {
@@ -1302,7 +1701,9 @@ static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_t
     Member *mem = ty->members;
     while (mem->next)
       mem = mem->next;
-    mem->ty = init->children[mem->idx]->ty;
+    Initializer *child = find_child(init, mem->idx);
+    if (child)
+      mem->ty = child->ty;
     ty->size += mem->ty->size;
 
     *new_ty = ty;
@@ -1325,15 +1726,20 @@ static Node *init_desg_expr(InitDesg *desg, Token *tok) {
 
   Node *lhs = init_desg_expr(desg->next, tok);
   Node *rhs = new_num(desg->idx, tok);
+  add_type(lhs);
+  if (lhs->ty->kind == TY_VECTOR)
+    return vector_elem(lhs, rhs, tok);
   return new_unary(ND_DEREF, new_add(lhs, rhs, tok), tok);
 }
 
 static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token *tok) {
-  if (ty->kind == TY_ARRAY) {
+  if (ty->kind == TY_ARRAY || (ty->kind == TY_VECTOR && !init->expr)) {
+    Type *elem = (ty->kind == TY_ARRAY) ? ty->base : ty->elem;
     Node *node = new_node(ND_NULL_EXPR, tok);
-    for (int i = 0; i < ty->array_len; i++) {
-      InitDesg desg2 = {desg, i};
-      Node *rhs = create_lvar_init(init->children[i], ty->base, &desg2, tok);
+    for (int i = 0; i < init->nchildren; i++) {
+      Initializer *child = init->children[i];
+      InitDesg desg2 = {desg, child->idx};
+      Node *rhs = create_lvar_init(child, elem, &desg2, tok);
       node = new_binary(ND_COMMA, node, rhs, tok);
     }
     return node;
@@ -1343,8 +1749,11 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
     Node *node = new_node(ND_NULL_EXPR, tok);
 
     for (Member *mem = ty->members; mem; mem = mem->next) {
+      Initializer *child = find_child(init, mem->idx);
+      if (!child)
+        continue;
       InitDesg desg2 = {desg, 0, mem};
-      Node *rhs = create_lvar_init(init->children[mem->idx], mem->ty, &desg2, tok);
+      Node *rhs = create_lvar_init(child, mem->ty, &desg2, tok);
       node = new_binary(ND_COMMA, node, rhs, tok);
     }
     return node;
@@ -1352,8 +1761,11 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
 
   if (ty->kind == TY_UNION) {
     Member *mem = init->mem ? init->mem : ty->members;
+    Initializer *child = find_child(init, mem->idx);
+    if (!child)
+      return new_node(ND_NULL_EXPR, tok);
     InitDesg desg2 = {desg, 0, mem};
-    return create_lvar_init(init->children[mem->idx], mem->ty, &desg2, tok);
+    return create_lvar_init(child, mem->ty, &desg2, tok);
   }
 
   if (!init->expr)
@@ -1374,7 +1786,7 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
 //   x[1][0] = 8;
 //   x[1][1] = 9;
 static Node *lvar_initializer(Token **rest, Token *tok, Obj *var) {
-  Initializer *init = initializer(rest, tok, var->ty, &var->ty);
+  Initializer *init = initializer(rest, tok, var->ty, &var->ty, NULL);
   InitDesg desg = {NULL, 0, NULL, var};
 
   // If a partial initializer list is given, the standard requires
@@ -1388,116 +1800,11 @@ static Node *lvar_initializer(Token **rest, Token *tok, Obj *var) {
   return new_binary(ND_COMMA, lhs, rhs, tok);
 }
 
-static uint64_t read_buf(char *buf, int sz) {
-  if (sz == 1)
-    return *buf;
-  if (sz == 2)
-    return *(uint16_t *)buf;
-  if (sz == 4)
-    return *(uint32_t *)buf;
-  if (sz == 8)
-    return *(uint64_t *)buf;
-  unreachable();
-}
-
-static void write_buf(char *buf, uint64_t val, int sz) {
-  if (sz == 1)
-    *buf = val;
-  else if (sz == 2)
-    *(uint16_t *)buf = val;
-  else if (sz == 4)
-    *(uint32_t *)buf = val;
-  else if (sz == 8)
-    *(uint64_t *)buf = val;
-  else
-    unreachable();
-}
-
-static Relocation *
-write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int offset) {
-  if (ty->kind == TY_ARRAY) {
-    int sz = ty->base->size;
-    for (int i = 0; i < ty->array_len; i++)
-      cur = write_gvar_data(cur, init->children[i], ty->base, buf, offset + sz * i);
-    return cur;
-  }
-
-  if (ty->kind == TY_STRUCT) {
-    for (Member *mem = ty->members; mem; mem = mem->next) {
-      if (mem->is_bitfield) {
-        Node *expr = init->children[mem->idx]->expr;
-        if (!expr)
-          break;
-
-        char *loc = buf + offset + mem->offset;
-        uint64_t oldval = read_buf(loc, mem->ty->size);
-        uint64_t newval = eval(expr);
-        uint64_t mask = (1L << mem->bit_width) - 1;
-        uint64_t combined = oldval | ((newval & mask) << mem->bit_offset);
-        write_buf(loc, combined, mem->ty->size);
-      } else {
-        cur = write_gvar_data(cur, init->children[mem->idx], mem->ty, buf,
-                              offset + mem->offset);
-      }
-    }
-    return cur;
-  }
-
-  if (ty->kind == TY_UNION) {
-    if (!init->mem)
-      return cur;
-    return write_gvar_data(cur, init->children[init->mem->idx],
-                           init->mem->ty, buf, offset);
-  }
-
-  if (!init->expr)
-    return cur;
-
-  if (ty->kind == TY_FLOAT) {
-    *(float *)(buf + offset) = eval_double(init->expr);
-    return cur;
-  }
-
-  if (ty->kind == TY_DOUBLE) {
-    *(double *)(buf + offset) = eval_double(init->expr);
-    return cur;
-  }
-
-  char **label = NULL;
-  uint64_t val = eval2(init->expr, &label);
-
-  if (!label) {
-    write_buf(buf + offset, val, ty->size);
-    return cur;
-  }
-
-  Relocation *rel = calloc(1, sizeof(Relocation));
-  rel->offset = offset;
-  rel->label = label;
-  rel->addend = val;
-  cur->next = rel;
-  return cur->next;
-}
-
-// Initializers for global variables are evaluated at compile-time and
-// embedded to .data section. This function serializes Initializer
-// objects to a flat byte array. It is a compile error if an
-// initializer list contains a non-constant expression.
-static void gvar_initializer(Token **rest, Token *tok, Obj *var) {
-  Initializer *init = initializer(rest, tok, var->ty, &var->ty);
-
-  Relocation head = {};
-  char *buf = calloc(1, var->ty->size);
-  write_gvar_data(&head, init, var->ty, buf, 0);
-  var->init_data = buf;
-  var->rel = head.next;
-}
-
 // Returns true if a given token represents a type.
 static bool is_typename(Token *tok) {
-  static HashMap map;
+  static bool init;
 
-  if (map.capacity == 0) {
+  if (!init) {
     static char *kw[] = {
       "void", "_Bool", "char", "short", "int", "long", "struct", "union",
       "typedef", "enum", "static", "extern", "_Alignas", "signed", "unsigned",
@@ -1507,10 +1814,14 @@ static bool is_typename(Token *tok) {
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-      hashmap_put(&map, kw[i], (void *)1);
+      ident_entry(intern_atom(kw[i], strlen(kw[i])))->is_type_keyword = true;
+    init = true;
   }
 
-  return hashmap_get2(&map, tok->loc, tok->len) || find_typedef(tok);
+  Ident *id = find_ident(tok);
+  if (id && id->is_type_keyword)
+    return true;
+  return find_typedef(tok);
 }
 
 // asm-stmt = "asm" ("volatile" | "inline")* "(" string-literal ")"
@@ -1522,9 +1833,9 @@ static Node *asm_stmt(Token **rest, Token *tok) {
     tok = tok->next;
 
   tok = skip(tok, "(");
-  if (tok->kind != TK_STR || tok->ty->base->kind != TY_CHAR)
+  if (tok->kind != TK_STR || tok->lit->ty->base->kind != TY_CHAR)
     error_tok(tok, "expected string literal");
-  node->asm_str = tok->str;
+  node->asm_str = tok->lit->str;
   *rest = skip(tok->next, ")");
   return node;
 }
@@ -1615,8 +1926,8 @@ static Node *stmt(Token **rest, Token *tok) {
     node->lhs = stmt(rest, tok);
     node->begin = begin;
     node->end = end;
-    node->case_next = current_switch->case_next;
-    current_switch->case_next = node;
+    node->case_next = current_switch->cases;
+    current_switch->cases = node;
     return node;
   }
 
@@ -2026,6 +2337,29 @@ static double eval_double(Node *node) {
 
 // Convert op= operators to expressions containing an assignment.
 //
+static bool is_native_atomic_op(Node *binary) {
+  Node *lhs = binary->lhs;
+  if (!lhs->ty->is_atomic)
+    return false;
+  if (lhs->kind == ND_MEMBER && lhs->member->is_bitfield)
+    return false;
+
+  if (lhs->ty->kind == TY_PTR)
+    return binary->kind == ND_ADD || binary->kind == ND_SUB;
+  if (!is_integer(lhs->ty) || lhs->ty->kind == TY_BOOL)
+    return false;
+
+  switch (binary->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+    return true;
+  }
+  return false;
+}
+
 // In general, `A op= C` is converted to ``tmp = &A, *tmp = *tmp op B`.
 // However, if a given expression is of form `A.x op= C`, the input is
 // converted to `tmp = &A, (*tmp).x = (*tmp).x op C` to handle assignments
@@ -2035,6 +2369,16 @@ static Node *to_assign(Node *binary) {
   add_type(binary->rhs);
   Token *tok = binary->tok;
 
+  // If A is an atomic integer or pointer and there is a native
+  // read-modify-write instruction for `op`, convert `A op= B` to an
+  // ND_ATOMIC_OP node.
+  if (is_native_atomic_op(binary)) {
+    Node *node = new_binary(ND_ATOMIC_OP, new_unary(ND_ADDR, binary->lhs, tok),
+                            new_cast(binary->rhs, binary->lhs->ty), tok);
+    node->atomic_op = binary->kind;
+    return node;
+  }
+
   // Convert `A.x op= C` to `tmp = &A, (*tmp).x = (*tmp).x op C`.
   if (binary->lhs->kind == ND_MEMBER) {
     Obj *var = new_lvar("", pointer_to(binary->lhs->lhs->ty));
@@ -2121,6 +2465,13 @@ static Node *to_assign(Node *binary) {
     return node;
   }
 
+  // If A is a variable, convert `A op= B` to `A = A op B` so that
+  // A's address is not taken.
+  if (binary->lhs->kind == ND_VAR) {
+    Node *lhs = new_var_node(binary->lhs->var, tok);
+    return new_binary(ND_ASSIGN, lhs, binary, tok);
+  }
+
   // Convert `A op= B` to ``tmp = &A, *tmp = *tmp op B`.
   Obj *var = new_lvar("", pointer_to(binary->lhs->ty));
 
@@ -2355,6 +2706,10 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
   if (is_numeric(lhs->ty) && is_numeric(rhs->ty))
     return new_binary(ND_ADD, lhs, rhs, tok);
 
+  // vector + vector
+  if (lhs->ty->kind == TY_VECTOR || rhs->ty->kind == TY_VECTOR)
+    return new_binary(ND_ADD, lhs, rhs, tok);
+
   if (lhs->ty->base && rhs->ty->base)
     error_tok(tok, "invalid operands");
 
@@ -2376,6 +2731,20 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
   return new_binary(ND_ADD, lhs, rhs, tok);
 }
 
+// `v[i]` for a vector `v` is `((T *)&v)[i]` where T is its element type.
+// If `v` is not an lvalue, it is stored to a temporary variable first.
+static Node *vector_elem(Node *vec, Node *idx, Token *tok) {
+  add_type(vec);
+  if (vec->kind == ND_VAR || vec->kind == ND_DEREF || vec->kind == ND_MEMBER) {
+    Node *ptr = new_cast(new_unary(ND_ADDR, vec, tok), pointer_to(vec->ty->elem));
+    return new_unary(ND_DEREF, new_add(ptr, idx, tok), tok);
+  }
+
+  Obj *var = new_lvar("", vec->ty);
+  Node *expr = new_binary(ND_ASSIGN, new_var_node(var, tok), vec, tok);
+  return new_binary(ND_COMMA, expr, vector_elem(new_var_node(var, tok), idx, tok), tok);
+}
+
 // Like `+`, `-` is overloaded for the pointer type.
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   add_type(lhs);
@@ -2385,6 +2754,10 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   if (is_numeric(lhs->ty) && is_numeric(rhs->ty))
     return new_binary(ND_SUB, lhs, rhs, tok);
 
+  // vector - vector
+  if (lhs->ty->kind == TY_VECTOR || rhs->ty->kind == TY_VECTOR)
+    return new_binary(ND_SUB, lhs, rhs, tok);
+
   // VLA + num
   if (lhs->ty->base->kind == TY_VLA) {
     rhs = new_binary(ND_MUL, rhs, new_var_node(lhs->ty->base->vla_size, tok), tok);
@@ -2554,7 +2927,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
     // Anonymous struct member
     if ((basety->kind == TY_STRUCT || basety->kind == TY_UNION) &&
         consume(&tok, tok, ";")) {
-      Member *mem = calloc(1, sizeof(Member));
+      Member *mem = arena_alloc(ARENA_MEMBER, sizeof(Member));
       mem->ty = basety;
       mem->idx = idx++;
       mem->align = attr.align ? attr.align : mem->ty->align;
@@ -2568,7 +2941,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
         tok = skip(tok, ",");
       first = false;
 
-      Member *mem = calloc(1, sizeof(Member));
+      Member *mem = arena_alloc(ARENA_MEMBER, sizeof(Member));
       mem->ty = declarator(&tok, tok, basety);
       mem->name = mem->ty->name;
       mem->idx = idx++;
@@ -2662,9 +3035,11 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
   if (tag) {
     // If this is a redefinition, overwrite a previous type.
     // Otherwise, register the struct type.
-    Type *ty2 = hashmap_get2(&scope->tags, tag->loc, tag->len);
+    Type *ty2 = find_tag_in_scope(tag);
     if (ty2) {
+      Type *ptr = ty2->pointer;
       *ty2 = *ty;
+      ty2->pointer = ptr;
       return ty2;
     }
 
@@ -2811,7 +3186,7 @@ static Node *postfix(Token **rest, Token *tok) {
     Type *ty = typename(&tok, tok->next);
     tok = skip(tok, ")");
 
-    if (scope->next == NULL) {
+    if (scope_depth == 0) {
       Obj *var = new_anon_gvar(ty);
       gvar_initializer(rest, tok, var);
       return new_var_node(var, start);
@@ -2836,7 +3211,11 @@ static Node *postfix(Token **rest, Token *tok) {
       Token *start = tok;
       Node *idx = expr(&tok, tok->next);
       tok = skip(tok, "]");
-      node = new_unary(ND_DEREF, new_add(node, idx, start), start);
+      add_type(node);
+      if (node->ty->kind == TY_VECTOR)
+        node = vector_elem(node, idx, start);
+      else
+        node = new_unary(ND_DEREF, new_add(node, idx, start), start);
       continue;
     }
 
@@ -2882,6 +3261,9 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
   Type *ty = (fn->ty->kind == TY_FUNC) ? fn->ty : fn->ty->base;
   Type *param_ty = ty->params;
 
+  if (current_fn && fn->kind == ND_VAR && !strcmp(fn->var->name, "alloca"))
+    current_fn->uses_alloca = true;
+
   Node head = {};
   Node *cur = &head;
 
@@ -2925,6 +3307,24 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
   return node;
 }
 
+// Returns true if a node calls a given C library function, such as
+// memcpy(), with `nargs` arguments. Such calls may be expanded inline
+// unless -fno-builtin is given. A function defined in this TU is not
+// the library one.
+bool is_builtin_call(Node *node, char *name, int nargs) {
+  if (!opt_fbuiltin || node->kind != ND_FUNCALL || node->lhs->kind != ND_VAR)
+    return false;
+
+  Obj *fn = node->lhs->var;
+  if (!fn->is_function || fn->is_definition || fn->is_static || strcmp(fn->name, name))
+    return false;
+
+  int n = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    n++;
+  return n == nargs;
+}
+
 // generic-selection = "(" assign "," generic-assoc ("," generic-assoc)* ")"
 //
 // generic-assoc = type-name ":" assign
@@ -2977,6 +3377,7 @@ static Node *generic_selection(Token **rest, Token *tok) {
 //         | "_Generic" generic-selection
 //         | "__builtin_types_compatible_p" "(" type-name, type-name, ")"
 //         | "__builtin_reg_class" "(" type-name ")"
+//         | "__builtin_expect" "(" assign "," assign ")"
 //         | ident
 //         | str
 //         | num
@@ -3057,6 +3458,19 @@ static Node *primary(Token **rest, Token *tok) {
     return new_num(2, start);
   }
 
+  // __builtin_expect(x, c) is x converted to long. If c is a
+  // constant, code generators lay out branches on x for its value.
+  if (equal(tok, "__builtin_expect")) {
+    tok = skip(tok->next, "(");
+    Node *node = new_cast(assign(&tok, tok), ty_long);
+    tok = skip(tok, ",");
+    Node *expected = assign(&tok, tok);
+    *rest = skip(tok, ")");
+    if (is_const_expr(expected))
+      node->expect = eval(expected) ? 1 : -1;
+    return node;
+  }
+
   if (equal(tok, "__builtin_compare_and_swap")) {
     Node *node = new_node(ND_CAS, tok);
     tok = skip(tok->next, "(");
@@ -3084,14 +3498,6 @@ static Node *primary(Token **rest, Token *tok) {
     VarScope *sc = find_var(tok);
     *rest = tok->next;
 
-    // For "static inline" function
-    if (sc && sc->var && sc->var->is_function) {
-      if (current_fn)
-        strarray_push(&current_fn->refs, sc->var->name);
-      else
-        sc->var->is_root = true;
-    }
-
     if (sc) {
       if (sc->var)
         return new_var_node(sc->var, tok);
@@ -3105,21 +3511,21 @@ static Node *primary(Token **rest, Token *tok) {
   }
 
   if (tok->kind == TK_STR) {
-    Obj *var = new_string_literal(tok->str, tok->ty);
+    Obj *var = new_string_literal(tok->lit->str, tok->lit->ty);
     *rest = tok->next;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_NUM) {
     Node *node;
-    if (is_flonum(tok->ty)) {
+    if (is_flonum(tok->lit->ty)) {
       node = new_node(ND_NUM, tok);
-      node->fval = tok->fval;
+      node->fval = tok->lit->fval;
     } else {
-      node = new_num(tok->val, tok);
+      node = new_num(tok->lit->val, tok);
     }
 
-    node->ty = tok->ty;
+    node->ty = tok->lit->ty;
     *rest = tok->next;
     return node;
   }
@@ -3174,28 +3580,69 @@ static void resolve_goto_labels(void) {
 }
 
 static Obj *find_func(char *name) {
-  Scope *sc = scope;
-  while (sc->next)
-    sc = sc->next;
-
-  VarScope *sc2 = hashmap_get(&sc->vars, name);
-  if (sc2 && sc2->var && sc2->var->is_function)
-    return sc2->var;
+  Ident *id = intern_atom(name, strlen(name))->ident;
+  if (!id)
+    return NULL;
+
+  // Look up the file scope binding, which is at the bottom of the stack.
+  Binding *b = id->var;
+  while (b && b->next)
+    b = b->next;
+  if (!b || b->depth != 0)
+    return NULL;
+
+  VarScope *sc = b->val;
+  if (sc->var && sc->var->is_function)
+    return sc->var;
   return NULL;
 }
 
-static void mark_live(Obj *var) {
-  if (!var->is_function || var->is_live)
+// A static function or variable is emitted only if it is reachable
+// from a non-static one. An object refers to the globals that appear
+// in its function body or in the relocations of its initializer.
+//
+// A global variable may be declared more than once, each time with
+// its own Obj. We merge the references of such objects into the
+// first one and keep the liveness there.
+static void mark_live(HashMap *map, Obj *var) {
+  if (var->is_live)
     return;
   var->is_live = true;
 
   for (int i = 0; i < var->refs.len; i++) {
-    Obj *fn = find_func(var->refs.data[i]);
-    if (fn)
-      mark_live(fn);
+    Obj *var2 = hashmap_get(map, var->refs.data[i]);
+    if (var2)
+      mark_live(map, var2);
   }
 }
 
+void mark_reachable(Obj *prog) {
+  HashMap map = {};
+
+  for (Obj *var = prog; var; var = var->next) {
+    var->is_live = false;
+
+    Obj *first = hashmap_get(&map, var->name);
+    if (!first) {
+      first = var;
+      hashmap_put(&map, var->name, var);
+    } else {
+      for (int i = 0; i < var->refs.len; i++)
+        strarray_push(&first->refs, var->refs.data[i]);
+    }
+
+    for (Relocation *rel = var->rel; rel; rel = rel->next)
+      strarray_push(&first->refs, *rel->label);
+  }
+
+  for (Obj *var = prog; var; var = var->next)
+    if (!var->is_static)
+      mark_live(&map, hashmap_get(&map, var->name));
+
+  for (Obj *var = prog; var; var = var->next)
+    var->is_live = ((Obj *)hashmap_get(&map, var->name))->is_live;
+}
+
 static Token *function(Token *tok, Type *basety, VarAttr *attr) {
   Type *ty = declarator(&tok, tok, basety);
   if (!ty->name)
@@ -3220,13 +3667,13 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
     fn->is_inline = attr->is_inline;
   }
 
-  fn->is_root = !(fn->is_static && fn->is_inline);
-
   if (consume(&tok, tok, ";"))
     return tok;
 
   current_fn = fn;
   locals = NULL;
+  ArenaMark mark = arena_mark(ARENA_NODE);
+  Obj *globals_before = globals;
   enter_scope();
   create_param_lvars(ty->params);
 
@@ -3258,6 +3705,25 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
   fn->locals = locals;
   leave_scope();
   resolve_goto_labels();
+
+  // In streaming mode, we generate code for the function right away
+  // and reuse the memory of its AST for the next function.
+  if (opt_stream_codegen) {
+    optimize_function(fn);
+    codegen_function(fn);
+    fn->body = NULL;
+
+    // Relocations of static locals may point to labels in AST nodes,
+    // e.g. `static void *p = &&L;`, so move the labels out of the AST.
+    for (Obj *var = globals; var != globals_before; var = var->next) {
+      for (Relocation *rel = var->rel; rel; rel = rel->next) {
+        char **label = arena_alloc(ARENA_MISC, sizeof(char *));
+        *label = *rel->label;
+        rel->label = label;
+      }
+    }
+    arena_release(ARENA_NODE, mark);
+  }
   return tok;
 }
 
@@ -3358,9 +3824,7 @@ Obj *parse(Token *tok) {
     tok = global_variable(tok, basety, &attr);
   }
 
-  for (Obj *var = globals; var; var = var->next)
-    if (var->is_root)
-      mark_live(var);
+  mark_reachable(globals);
 
   // Remove redundant tentative definitions.
   scan_globals();
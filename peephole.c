@@ -0,0 +1,533 @@
+// This file implements a peephole optimizer for the x86-64 backend,
+// which is enabled by -O1.
+//
+// With the optimizer enabled, the code generator writes the assembly
+// of a function to an instruction buffer instead of to the output
+// file. Each line is split into a mnemonic and operands, and a set of
+// rules rewrites short sequences of instructions. The rules only look
+// at adjacent instructions (ignoring .loc directives), so they don't
+// need any knowledge about the control flow of a function other than
+// that a label is a point where control flow merges.
+//
+// The code generator emits code in a few fixed patterns, and the rules
+// take advantage of it. In particular, the value in %rax tested by a
+// conditional jump is never used after the jump.
+
+#include "chibicc.h"
+
+typedef enum {
+  INSN_OP,        // Instruction
+  INSN_LABEL,     // Label
+  INSN_DIRECTIVE, // Assembler directive
+  INSN_OTHER,     // Anything else, e.g. multi-line inline assembly
+} InsnKind;
+
+typedef struct {
+  InsnKind kind;
+  char *text;   // The line as written, or NULL if it was rewritten
+  char *op;     // Mnemonic, label name or directive name
+  char *arg[2]; // Operands, or NULL
+  int nargs;
+  bool deleted;
+} Insn;
+
+struct InsnBuf {
+  Insn *data;
+  int len;
+  int cap;
+};
+
+// The 16 general-purpose registers. The index of a register in this
+// table is its ID.
+static char *regs[][4] = {
+  {"%rax", "%eax", "%ax", "%al"},      {"%rcx", "%ecx", "%cx", "%cl"},
+  {"%rdx", "%edx", "%dx", "%dl"},      {"%rbx", "%ebx", "%bx", "%bl"},
+  {"%rsp", "%esp", "%sp", "%spl"},     {"%rbp", "%ebp", "%bp", "%bpl"},
+  {"%rsi", "%esi", "%si", "%sil"},     {"%rdi", "%edi", "%di", "%dil"},
+  {"%r8", "%r8d", "%r8w", "%r8b"},     {"%r9", "%r9d", "%r9w", "%r9b"},
+  {"%r10", "%r10d", "%r10w", "%r10b"}, {"%r11", "%r11d", "%r11w", "%r11b"},
+  {"%r12", "%r12d", "%r12w", "%r12b"}, {"%r13", "%r13d", "%r13w", "%r13b"},
+  {"%r14", "%r14d", "%r14w", "%r14b"}, {"%r15", "%r15d", "%r15w", "%r15b"},
+};
+
+#define NUM_GP_REGS (sizeof(regs) / sizeof(*regs))
+
+enum { REG_AX = 0, REG_DX = 2, REG_SP = 4 };
+
+static int size_index(int sz) {
+  switch (sz) {
+  case 8: return 0;
+  case 4: return 1;
+  case 2: return 2;
+  case 1: return 3;
+  }
+  unreachable();
+}
+
+// Returns the ID of a register and its size, or -1 if `name` is not
+// a general-purpose register.
+static int reg_id(char *name, int len, int *sz) {
+  static int sizes[] = {8, 4, 2, 1};
+
+  if (len == 3 && name[0] == '%' && name[2] == 'h' && strchr("abcd", name[1])) {
+    *sz = 1;
+    return strchr("acdb", name[1]) - "acdb";
+  }
+
+  for (int i = 0; i < NUM_GP_REGS; i++) {
+    for (int j = 0; j < 4; j++) {
+      if (strlen(regs[i][j]) == len && !strncmp(regs[i][j], name, len)) {
+        *sz = sizes[j];
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+// Returns the name of the low `sz` bytes of a 64-bit register.
+char *reg_name(char *reg, int sz) {
+  int dummy;
+  int i = reg_id(reg, strlen(reg), &dummy);
+  if (i < 0)
+    unreachable();
+  return regs[i][size_index(sz)];
+}
+
+InsnBuf *new_insn_buf(void) {
+  return calloc(1, sizeof(InsnBuf));
+}
+
+static char *skip_space(char *p) {
+  while (*p == ' ')
+    p++;
+  return p;
+}
+
+// Splits a line into a mnemonic and operands.
+static void parse_insn(Insn *in, char *line) {
+  // We don't try to understand comments or multiple instructions
+  // in a line.
+  if (strpbrk(line, "\n;#")) {
+    in->kind = INSN_OTHER;
+    return;
+  }
+
+  if (line[0] != ' ') {
+    int len = strlen(line);
+    if (len > 0 && line[len - 1] == ':') {
+      in->kind = INSN_LABEL;
+      in->op = strndup(line, len - 1);
+    } else {
+      in->kind = INSN_OTHER;
+    }
+    return;
+  }
+
+  char *p = skip_space(line);
+  char *q = p;
+  while (*q && *q != ' ')
+    q++;
+
+  in->op = strndup(p, q - p);
+  in->kind = (*p == '.') ? INSN_DIRECTIVE : INSN_OP;
+  if (in->kind == INSN_DIRECTIVE)
+    return;
+
+  // Operands are separated by commas outside parentheses.
+  p = skip_space(q);
+  while (*p) {
+    if (in->nargs == 2) {
+      in->kind = INSN_OTHER;
+      return;
+    }
+
+    int depth = 0;
+    for (q = p; *q && (depth || *q != ','); q++) {
+      if (*q == '(')
+        depth++;
+      else if (*q == ')')
+        depth--;
+    }
+
+    char *end = q;
+    while (end > p && end[-1] == ' ')
+      end--;
+    in->arg[in->nargs++] = strndup(p, end - p);
+    p = *q ? skip_space(q + 1) : q;
+  }
+}
+
+void insn_add(InsnBuf *buf, char *line) {
+  if (buf->len == buf->cap) {
+    buf->cap = buf->cap ? buf->cap * 2 : 256;
+    buf->data = realloc(buf->data, sizeof(Insn) * buf->cap);
+  }
+
+  Insn *in = &buf->data[buf->len++];
+  *in = (Insn){.text = line};
+  parse_insn(in, line);
+}
+
+static bool is_op(Insn *in, char *op) {
+  return in->kind == INSN_OP && !strcmp(in->op, op);
+}
+
+static bool startswith(char *p, char *q) {
+  return strncmp(p, q, strlen(q)) == 0;
+}
+
+static void rewrite(Insn *in, char *op, char *arg0, char *arg1) {
+  in->text = NULL;
+  in->op = op;
+  in->arg[0] = arg0;
+  in->arg[1] = arg1;
+  in->nargs = !!arg0 + !!arg1;
+}
+
+// Returns the index of the next instruction, label or directive
+// after `i` other than .loc, or `buf->len` if there's none.
+static int next(InsnBuf *buf, int i) {
+  for (i++; i < buf->len; i++) {
+    Insn *in = &buf->data[i];
+    if (in->deleted)
+      continue;
+    if (in->kind == INSN_DIRECTIVE && !strcmp(in->op, ".loc"))
+      continue;
+    return i;
+  }
+  return buf->len;
+}
+
+// Returns the register ID of an operand if it is a register.
+static int arg_reg(char *arg, int *sz) {
+  if (!arg || arg[0] != '%')
+    return -1;
+  return reg_id(arg, strlen(arg), sz);
+}
+
+// Returns true if an operand mentions a given register, either as
+// a register operand or as a part of an address.
+static bool arg_uses(char *arg, int reg) {
+  if (!arg)
+    return false;
+
+  for (char *p = strchr(arg, '%'); p; p = strchr(p + 1, '%')) {
+    int len = 1;
+    while (isalnum(p[len]))
+      len++;
+    int sz;
+    if (reg_id(p, len, &sz) == reg)
+      return true;
+  }
+  return false;
+}
+
+// Instructions whose only effects on registers are via their
+// explicit operands, except for the ones listed in implicit_use().
+static bool is_plain(Insn *in) {
+  static char *ops[] = {
+    "mov", "movl", "movq", "movabs", "movsbl", "movzbl", "movswl", "movzwl",
+    "movsxd", "movsx", "movzx", "movzb", "movss", "movsd", "movaps", "lea",
+    "add", "sub", "imul", "and", "or", "xor", "not", "neg", "shl", "shr",
+    "sar", "cmp", "test", "cqo", "cdq", "div", "idiv", "addss", "addsd",
+    "subss", "subsd", "mulss", "mulsd", "divss", "divsd", "xorps", "xorpd",
+    "ucomiss", "ucomisd", "fld", "fldt", "fstp", "fstpt", "fldz", "fchs",
+    "faddp", "fsubrp", "fmulp", "fdivrp", "fcomip", "fucomip", "fild",
+    "fildl", "fildll", "fistp", "fistpl", "fistpll", "fnstcw", "fldcw",
+  };
+
+  if (in->kind != INSN_OP)
+    return false;
+
+  // `movsd` without operands is a string instruction.
+  if (!strcmp(in->op, "movsd") && in->nargs == 0)
+    return false;
+
+  if (startswith(in->op, "set") || startswith(in->op, "cvt"))
+    return true;
+  for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++)
+    if (!strcmp(in->op, ops[i]))
+      return true;
+  return false;
+}
+
+static bool implicit_use(Insn *in, int reg) {
+  if (is_op(in, "cqo") || is_op(in, "cdq") || is_op(in, "div") ||
+      is_op(in, "idiv") || (is_op(in, "imul") && in->nargs == 1))
+    return reg == REG_AX || reg == REG_DX;
+  return false;
+}
+
+static bool insn_uses(Insn *in, int reg) {
+  return arg_uses(in->arg[0], reg) || arg_uses(in->arg[1], reg) ||
+         implicit_use(in, reg);
+}
+
+// Rewrites `push %rax; ...; pop %reg` to `mov %rax, %reg; ...` if
+// the instructions in between don't touch the stack or %reg.
+static bool push_pop(InsnBuf *buf, int i) {
+  Insn *push = &buf->data[i];
+  if (!is_op(push, "push") || push->nargs != 1 || strcmp(push->arg[0], "%rax"))
+    return false;
+
+  for (int j = next(buf, i); j < buf->len; j = next(buf, j)) {
+    Insn *in = &buf->data[j];
+
+    if (is_op(in, "pop") && in->nargs == 1) {
+      int sz;
+      int reg = arg_reg(in->arg[0], &sz);
+      if (reg < 0 || reg == REG_SP)
+        return false;
+      for (int k = next(buf, i); k < j; k = next(buf, k))
+        if (insn_uses(&buf->data[k], reg))
+          return false;
+
+      if (reg == REG_AX)
+        push->deleted = true;
+      else
+        rewrite(push, "mov", "%rax", in->arg[0]);
+      in->deleted = true;
+      return true;
+    }
+
+    if (!is_plain(in) || insn_uses(in, REG_SP))
+      return false;
+  }
+  return false;
+}
+
+// Returns true if the flags may be read before they are overwritten
+// after instruction `i`.
+static bool flags_live(InsnBuf *buf, int i) {
+  static char *writers[] = {
+    "add", "sub", "and", "or", "xor", "cmp", "test", "neg", "imul",
+    "ucomiss", "ucomisd", "fcomip", "fucomip",
+  };
+
+  for (int j = next(buf, i); j < buf->len; j = next(buf, j)) {
+    Insn *in = &buf->data[j];
+
+    if (in->kind == INSN_LABEL)
+      continue;
+    if (in->kind != INSN_OP)
+      return true;
+    if (is_op(in, "jmp") || is_op(in, "call") || is_op(in, "ret"))
+      return false;
+    for (int k = 0; k < sizeof(writers) / sizeof(*writers); k++)
+      if (is_op(in, writers[k]))
+        return false;
+    if (in->op[0] == 'j' || startswith(in->op, "set") ||
+        startswith(in->op, "cmov") || is_op(in, "adc") || is_op(in, "sbb"))
+      return true;
+    if (!is_plain(in))
+      return true;
+  }
+  return false;
+}
+
+// Rewrites `mov $0, %reg` to `xor %reg, %reg`.
+static bool zero_reg(InsnBuf *buf, int i) {
+  Insn *in = &buf->data[i];
+  if (!is_op(in, "mov") || in->nargs != 2 || strcmp(in->arg[0], "$0"))
+    return false;
+
+  int sz;
+  int reg = arg_reg(in->arg[1], &sz);
+  if (reg < 0 || sz < 4 || flags_live(buf, i))
+    return false;
+
+  char *r32 = regs[reg][size_index(4)];
+  rewrite(in, "xor", r32, r32);
+  return true;
+}
+
+// Returns the size of a memory operand read by a load instruction,
+// or 0 if `in` is not a load into a register.
+static int load_size(Insn *in) {
+  if (in->kind != INSN_OP || in->nargs != 2)
+    return 0;
+
+  int sz;
+  if (arg_reg(in->arg[1], &sz) < 0)
+    return 0;
+
+  if (!strcmp(in->op, "mov"))
+    return sz;
+  if (!strcmp(in->op, "movsbl") || !strcmp(in->op, "movzbl"))
+    return 1;
+  if (!strcmp(in->op, "movswl") || !strcmp(in->op, "movzwl"))
+    return 2;
+  if (!strcmp(in->op, "movsxd"))
+    return 4;
+  return 0;
+}
+
+// Rewrites `mov %reg, X(%rbp); load X(%rbp), %reg2` so that the load
+// takes %reg instead. The load is removed if it's a no-op. Frameless
+// functions address their locals by %rsp, which can't change between
+// two adjacent instructions either.
+static bool store_load(InsnBuf *buf, int i) {
+  Insn *st = &buf->data[i];
+  if (!is_op(st, "mov") && !is_op(st, "movss") && !is_op(st, "movsd"))
+    return false;
+  if (st->nargs != 2 ||
+      (!strstr(st->arg[1], "(%rbp)") && !strstr(st->arg[1], "(%rsp)")))
+    return false;
+
+  int j = next(buf, i);
+  if (j == buf->len)
+    return false;
+  Insn *ld = &buf->data[j];
+  if (ld->nargs != 2 || strcmp(ld->arg[0], st->arg[1]))
+    return false;
+
+  // Floating-point values
+  if (!is_op(st, "mov")) {
+    if (!strcmp(ld->op, st->op) && !strcmp(ld->arg[1], st->arg[0])) {
+      ld->deleted = true;
+      return true;
+    }
+    return false;
+  }
+
+  int sz;
+  if (arg_reg(st->arg[0], &sz) < 0 || load_size(ld) != sz)
+    return false;
+
+  if (!strcmp(ld->op, "mov") && !strcmp(ld->arg[1], st->arg[0]))
+    ld->deleted = true;
+  else
+    rewrite(ld, ld->op, st->arg[0], ld->arg[1]);
+  return true;
+}
+
+// Removes `jmp L` immediately followed by `L:`.
+static bool jump_to_next(InsnBuf *buf, int i) {
+  Insn *in = &buf->data[i];
+  if (!is_op(in, "jmp") || in->nargs != 1 || in->arg[0][0] == '*')
+    return false;
+
+  for (int j = next(buf, i); j < buf->len; j = next(buf, j)) {
+    Insn *label = &buf->data[j];
+    if (label->kind != INSN_LABEL)
+      return false;
+    if (!strcmp(label->op, in->arg[0])) {
+      in->deleted = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+static char *negate_cond(char *cc) {
+  static char *pairs[][2] = {
+    {"e", "ne"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"},
+    {"p", "np"}, {"s", "ns"}, {"o", "no"},
+  };
+
+  for (int i = 0; i < sizeof(pairs) / sizeof(*pairs); i++) {
+    if (!strcmp(cc, pairs[i][0]))
+      return pairs[i][1];
+    if (!strcmp(cc, pairs[i][1]))
+      return pairs[i][0];
+  }
+  return NULL;
+}
+
+// Rewrites `setCC %al; movzb %al, %rax; cmp $0, %rax; je L` to
+// `jNCC L`, and likewise for `jne`.
+static bool set_cmp_jump(InsnBuf *buf, int i) {
+  Insn *set = &buf->data[i];
+  if (set->kind != INSN_OP || !startswith(set->op, "set") ||
+      set->nargs != 1 || strcmp(set->arg[0], "%al"))
+    return false;
+
+  int j = next(buf, i);
+  if (j == buf->len)
+    return false;
+  Insn *ext = &buf->data[j];
+  if (!(is_op(ext, "movzb") || is_op(ext, "movzx") || is_op(ext, "movzbl")) ||
+      ext->nargs != 2 || strcmp(ext->arg[0], "%al"))
+    return false;
+
+  int k = next(buf, j);
+  if (k == buf->len)
+    return false;
+  Insn *cmp = &buf->data[k];
+  if (!is_op(cmp, "cmp") || cmp->nargs != 2 || strcmp(cmp->arg[0], "$0") ||
+      (strcmp(cmp->arg[1], "%eax") && strcmp(cmp->arg[1], "%rax")))
+    return false;
+
+  int l = next(buf, k);
+  if (l == buf->len)
+    return false;
+  Insn *jmp = &buf->data[l];
+
+  char *cc = set->op + 3;
+  if (is_op(jmp, "je"))
+    cc = negate_cond(cc);
+  else if (!is_op(jmp, "jne"))
+    return false;
+  if (!cc)
+    return false;
+
+  set->deleted = ext->deleted = cmp->deleted = true;
+  rewrite(jmp, format("j%s", cc), jmp->arg[0], NULL);
+  return true;
+}
+
+// Removes `mov %reg, %reg` of 64-bit registers.
+static bool self_move(InsnBuf *buf, int i) {
+  Insn *in = &buf->data[i];
+  if (!is_op(in, "mov") || in->nargs != 2 || strcmp(in->arg[0], in->arg[1]))
+    return false;
+
+  int sz;
+  if (arg_reg(in->arg[0], &sz) < 0 || sz != 8)
+    return false;
+  in->deleted = true;
+  return true;
+}
+
+static bool (*rules[])(InsnBuf *, int) = {
+  push_pop, zero_reg, store_load, jump_to_next, set_cmp_jump, self_move,
+};
+
+void peephole(InsnBuf *buf) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < buf->len; i++) {
+      if (buf->data[i].deleted)
+        continue;
+      for (int j = 0; j < sizeof(rules) / sizeof(*rules); j++) {
+        if (buf->data[i].deleted)
+          break;
+        if (rules[j](buf, i))
+          changed = true;
+      }
+    }
+  }
+}
+
+// Writes the instructions to `out` and frees the buffer.
+void insn_emit(InsnBuf *buf, FILE *out) {
+  for (int i = 0; i < buf->len; i++) {
+    Insn *in = &buf->data[i];
+    if (in->deleted)
+      continue;
+
+    if (in->text)
+      fprintf(out, "%s\n", in->text);
+    else if (in->nargs == 2)
+      fprintf(out, "  %s %s, %s\n", in->op, in->arg[0], in->arg[1]);
+    else if (in->nargs == 1)
+      fprintf(out, "  %s %s\n", in->op, in->arg[0]);
+    else
+      fprintf(out, "  %s\n", in->op);
+  }
+
+  free(buf->data);
+  free(buf);
+}
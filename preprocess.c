@@ -23,6 +23,8 @@
 // https://github.com/rui314/chibicc/wiki/cpp.algo.pdf
 
 #include "chibicc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
 
 typedef struct MacroParam MacroParam;
 struct MacroParam {
@@ -36,6 +38,7 @@ struct MacroArg {
   char *name;
   bool is_va_args;
   Token *tok;
+  Token *expanded; // Macro-expanded `tok`, computed on first use
 };
 
 typedef Token *macro_handler_fn(Token *);
@@ -59,19 +62,26 @@ struct CondIncl {
   bool included;
 };
 
+// A hideset is a bitmap indexed by macro name IDs. Hidesets are
+// hash-consed, so there is exactly one Hideset object for each set
+// and two sets are equal if and only if their pointers are equal.
+// The empty set is represented by NULL.
 typedef struct Hideset Hideset;
 struct Hideset {
-  Hideset *next;
-  char *name;
+  int nwords;
+  uint64_t bits[];
 };
 
-static HashMap macros;
 static CondIncl *cond_incl;
 static HashMap pragma_once;
+static HashMap include_guards;
 static int include_next_idx;
 
 static Token *preprocess2(Token *tok);
 static Macro *find_macro(Token *tok);
+static void pp_enter(File *file);
+static void pp_include(char *path, File *from, File *to, bool once);
+static void pp_expand(Macro *m, Token *body);
 
 static bool is_hash(Token *tok) {
   return tok->at_bol && equal(tok, "#");
@@ -89,7 +99,7 @@ static Token *skip_line(Token *tok) {
 }
 
 static Token *copy_token(Token *tok) {
-  Token *t = calloc(1, sizeof(Token));
+  Token *t = arena_alloc(ARENA_TOKEN, sizeof(Token));
   *t = *tok;
   t->next = NULL;
   return t;
@@ -102,67 +112,163 @@ static Token *new_eof(Token *tok) {
   return t;
 }
 
-static Hideset *new_hideset(char *name) {
-  Hideset *hs = calloc(1, sizeof(Hideset));
-  hs->name = name;
+// Macro names in hidesets are numbered with small integers.
+static int hideset_nids;
+
+static int hideset_id(Atom *name) {
+  if (!name->hideset_id)
+    name->hideset_id = ++hideset_nids;
+  return name->hideset_id - 1;
+}
+
+// Returns the canonical Hideset object for a given bitmap.
+static Hideset *intern_hideset(uint64_t *bits, int nwords) {
+  static HashMap sets;
+
+  while (nwords > 0 && !bits[nwords - 1])
+    nwords--;
+  if (nwords == 0)
+    return NULL;
+
+  int size = nwords * sizeof(uint64_t);
+  Hideset *hs = hashmap_get2(&sets, (char *)bits, size);
+  if (hs)
+    return hs;
+
+  hs = arena_alloc(ARENA_MISC, sizeof(Hideset) + size);
+  hs->nwords = nwords;
+  memcpy(hs->bits, bits, size);
+  hashmap_put2(&sets, (char *)hs->bits, size, hs);
   return hs;
 }
 
+static Hideset *new_hideset(Atom *name) {
+  int id = hideset_id(name);
+  int nwords = id / 64 + 1;
+  uint64_t bits[nwords];
+  memset(bits, 0, sizeof(bits));
+  bits[id / 64] = 1ul << (id % 64);
+  return intern_hideset(bits, nwords);
+}
+
+// Because hidesets are canonical, set operations can be memoized by
+// the pointers of their operands.
+typedef struct {
+  Hideset *hs1;
+  Hideset *hs2;
+} HidesetPair;
+
+static Hideset *memo_get(HashMap *memo, Hideset *hs1, Hideset *hs2) {
+  HidesetPair key = {hs1, hs2};
+  return hashmap_get2(memo, (char *)&key, sizeof(key));
+}
+
+static void memo_put(HashMap *memo, Hideset *hs1, Hideset *hs2, Hideset *hs) {
+  HidesetPair *key = arena_alloc(ARENA_MISC, sizeof(HidesetPair));
+  *key = (HidesetPair){hs1, hs2};
+  hashmap_put2(memo, (char *)key, sizeof(*key), hs);
+}
+
 static Hideset *hideset_union(Hideset *hs1, Hideset *hs2) {
-  Hideset head = {};
-  Hideset *cur = &head;
+  if (!hs1 || hs1 == hs2)
+    return hs2;
+  if (!hs2)
+    return hs1;
+
+  // Union is commutative, so order operands to share memo entries.
+  if (hs1 > hs2) {
+    Hideset *tmp = hs1;
+    hs1 = hs2;
+    hs2 = tmp;
+  }
 
-  for (; hs1; hs1 = hs1->next)
-    cur = cur->next = new_hideset(hs1->name);
-  cur->next = hs2;
-  return head.next;
+  static HashMap memo;
+  Hideset *hs = memo_get(&memo, hs1, hs2);
+  if (hs)
+    return hs;
+
+  int nwords = MAX(hs1->nwords, hs2->nwords);
+  uint64_t bits[nwords];
+  for (int i = 0; i < nwords; i++)
+    bits[i] = (i < hs1->nwords ? hs1->bits[i] : 0) |
+              (i < hs2->nwords ? hs2->bits[i] : 0);
+
+  hs = intern_hideset(bits, nwords);
+  memo_put(&memo, hs1, hs2, hs);
+  return hs;
 }
 
-static bool hideset_contains(Hideset *hs, char *s, int len) {
-  for (; hs; hs = hs->next)
-    if (strlen(hs->name) == len && !strncmp(hs->name, s, len))
-      return true;
-  return false;
+static bool hideset_contains(Hideset *hs, Atom *name) {
+  if (!hs || !name->hideset_id)
+    return false;
+
+  int id = name->hideset_id - 1;
+  return id / 64 < hs->nwords && (hs->bits[id / 64] >> (id % 64)) & 1;
 }
 
 static Hideset *hideset_intersection(Hideset *hs1, Hideset *hs2) {
-  Hideset head = {};
-  Hideset *cur = &head;
+  if (!hs1 || !hs2)
+    return NULL;
+  if (hs1 == hs2)
+    return hs1;
 
-  for (; hs1; hs1 = hs1->next)
-    if (hideset_contains(hs2, hs1->name, strlen(hs1->name)))
-      cur = cur->next = new_hideset(hs1->name);
-  return head.next;
+  if (hs1 > hs2) {
+    Hideset *tmp = hs1;
+    hs1 = hs2;
+    hs2 = tmp;
+  }
+
+  static HashMap memo;
+  Hideset *hs = memo_get(&memo, hs1, hs2);
+  if (hs)
+    return hs;
+
+  int nwords = MIN(hs1->nwords, hs2->nwords);
+  uint64_t bits[nwords];
+  for (int i = 0; i < nwords; i++)
+    bits[i] = hs1->bits[i] & hs2->bits[i];
+
+  hs = intern_hideset(bits, nwords);
+  memo_put(&memo, hs1, hs2, hs);
+  return hs;
 }
 
-static Token *add_hideset(Token *tok, Hideset *hs) {
+// Copies tokens up to the next EOF. The EOF itself is shared.
+static Token *copy_tokens(Token *tok) {
   Token head = {};
   Token *cur = &head;
 
-  for (; tok; tok = tok->next) {
-    Token *t = copy_token(tok);
-    t->hideset = hideset_union(t->hideset, hs);
-    cur = cur->next = t;
-  }
+  for (; tok->kind != TK_EOF; tok = tok->next)
+    cur = cur->next = copy_token(tok);
+  cur->next = tok;
   return head.next;
 }
 
-// Append tok2 to the end of tok1.
-static Token *append(Token *tok1, Token *tok2) {
-  if (tok1->kind == TK_EOF)
-    return tok2;
-
-  Token head = {};
+// Attaches a hideset and the origin to the tokens of a macro
+// expansion and links them to `rest`. `body` is modified in place, so
+// it must be a fresh list. Together with copy_tokens() and subst(),
+// each token of an expansion is copied exactly once.
+static Token *finish_expansion(Token *body, Hideset *hs, Token *origin,
+                               Token *rest) {
+  Token head = {.next = body};
   Token *cur = &head;
 
-  for (; tok1->kind != TK_EOF; tok1 = tok1->next)
-    cur = cur->next = copy_token(tok1);
-  cur->next = tok2;
+  for (; cur->next->kind != TK_EOF; cur = cur->next) {
+    Token *t = cur->next;
+    t->hideset = hideset_union(t->hideset, hs);
+    if (t->kind == TK_IDENT)
+      t->origin = origin;
+  }
+  cur->next = rest;
   return head.next;
 }
 
 static Token *skip_cond_incl2(Token *tok) {
   while (tok->kind != TK_EOF) {
+    if (tok->kind == TK_LAZY) {
+      tok = tokenize_rest(skip_cond_text(tok));
+      continue;
+    }
     if (is_hash(tok) &&
         (equal(tok->next, "if") || equal(tok->next, "ifdef") ||
          equal(tok->next, "ifndef"))) {
@@ -180,6 +286,12 @@ static Token *skip_cond_incl2(Token *tok) {
 // Nested `#if` and `#endif` are skipped.
 static Token *skip_cond_incl(Token *tok) {
   while (tok->kind != TK_EOF) {
+    // If the group hasn't been tokenized yet, skip it as raw text.
+    if (tok->kind == TK_LAZY) {
+      tok = tokenize_rest(skip_cond_text(tok));
+      continue;
+    }
+
     if (is_hash(tok) &&
         (equal(tok->next, "if") || equal(tok->next, "ifdef") ||
          equal(tok->next, "ifndef"))) {
@@ -205,7 +317,7 @@ static char *quote_string(char *str) {
     bufsize++;
   }
 
-  char *buf = calloc(1, bufsize);
+  char *buf = arena_alloc(ARENA_MISC, bufsize);
   char *p = buf;
   *p++ = '"';
   for (int i = 0; str[i]; i++) {
@@ -308,7 +420,7 @@ static long eval_const_expr(Token **rest, Token *tok) {
 }
 
 static CondIncl *push_cond_incl(Token *tok, bool included) {
-  CondIncl *ci = calloc(1, sizeof(CondIncl));
+  CondIncl *ci = arena_alloc(ARENA_MISC, sizeof(CondIncl));
   ci->next = cond_incl;
   ci->ctx = IN_THEN;
   ci->tok = tok;
@@ -320,15 +432,15 @@ static CondIncl *push_cond_incl(Token *tok, bool included) {
 static Macro *find_macro(Token *tok) {
   if (tok->kind != TK_IDENT)
     return NULL;
-  return hashmap_get2(&macros, tok->loc, tok->len);
+  return tok->atom->macro;
 }
 
 static Macro *add_macro(char *name, bool is_objlike, Token *body) {
-  Macro *m = calloc(1, sizeof(Macro));
+  Macro *m = arena_alloc(ARENA_MISC, sizeof(Macro));
   m->name = name;
   m->is_objlike = is_objlike;
   m->body = body;
-  hashmap_put(&macros, name, m);
+  intern_atom(name, strlen(name))->macro = m;
   return m;
 }
 
@@ -355,7 +467,7 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, char **va_args_na
       return head.next;
     }
 
-    MacroParam *m = calloc(1, sizeof(MacroParam));
+    MacroParam *m = arena_alloc(ARENA_MISC, sizeof(MacroParam));
     m->name = strndup(tok->loc, tok->len);
     cur = cur->next = m;
     tok = tok->next;
@@ -399,6 +511,11 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
     if (tok->kind == TK_EOF)
       error_tok(tok, "premature end of input");
 
+    if (tok->kind == TK_LAZY) {
+      tok = tokenize_rest(tok);
+      continue;
+    }
+
     if (equal(tok, "("))
       level++;
     else if (equal(tok, ")"))
@@ -410,7 +527,7 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
 
   cur->next = new_eof(tok);
 
-  MacroArg *arg = calloc(1, sizeof(MacroArg));
+  MacroArg *arg = arena_alloc(ARENA_MISC, sizeof(MacroArg));
   arg->tok = head.next;
   *rest = tok;
   return arg;
@@ -435,7 +552,7 @@ read_macro_args(Token **rest, Token *tok, MacroParam *params, char *va_args_name
   if (va_args_name) {
     MacroArg *arg;
     if (equal(tok, ")")) {
-      arg = calloc(1, sizeof(MacroArg));
+      arg = arena_alloc(ARENA_MISC, sizeof(MacroArg));
       arg->tok = new_eof(tok);
     } else {
       if (pp != params)
@@ -471,7 +588,7 @@ static char *join_tokens(Token *tok, Token *end) {
     len += t->len;
   }
 
-  char *buf = calloc(1, len);
+  char *buf = arena_alloc(ARENA_MISC, len);
 
   // Copy token texts.
   int pos = 0;
@@ -605,12 +722,18 @@ static Token *subst(Token *tok, MacroArg *args) {
 
     // Handle a macro token. Macro arguments are completely macro-expanded
     // before they are substituted into a macro body.
+    // An argument is expanded only once even if used more than once.
     if (arg) {
-      Token *t = preprocess2(arg->tok);
-      t->at_bol = tok->at_bol;
-      t->has_space = tok->has_space;
+      if (!arg->expanded)
+        arg->expanded = preprocess2(arg->tok);
+
+      Token *t = copy_tokens(arg->expanded);
+      if (t->kind != TK_EOF) {
+        t->at_bol = tok->at_bol;
+        t->has_space = tok->has_space;
+      }
       for (; t->kind != TK_EOF; t = t->next)
-        cur = cur->next = copy_token(t);
+        cur = cur->next = t;
       tok = tok->next;
       continue;
     }
@@ -628,29 +751,29 @@ static Token *subst(Token *tok, MacroArg *args) {
 // If tok is a macro, expand it and return true.
 // Otherwise, do nothing and return false.
 static bool expand_macro(Token **rest, Token *tok) {
-  if (hideset_contains(tok->hideset, tok->loc, tok->len))
-    return false;
-
   Macro *m = find_macro(tok);
-  if (!m)
+  if (!m || hideset_contains(tok->hideset, tok->atom))
     return false;
 
   // Built-in dynamic macro application such as __LINE__
   if (m->handler) {
     *rest = m->handler(tok);
     (*rest)->next = tok->next;
+    if (opt_pp_stats)
+      pp_expand(m, NULL);
+    counters.macro_expansions++;
     return true;
   }
 
   // Object-like macro application
   if (m->is_objlike) {
-    Hideset *hs = hideset_union(tok->hideset, new_hideset(m->name));
-    Token *body = add_hideset(m->body, hs);
-    for (Token *t = body; t->kind != TK_EOF; t = t->next)
-      t->origin = tok;
-    *rest = append(body, tok->next);
+    Hideset *hs = hideset_union(tok->hideset, new_hideset(tok->atom));
+    if (opt_pp_stats)
+      pp_expand(m, m->body);
+    *rest = finish_expansion(copy_tokens(m->body), hs, tok, tok->next);
     (*rest)->at_bol = tok->at_bol;
     (*rest)->has_space = tok->has_space;
+    counters.macro_expansions++;
     return true;
   }
 
@@ -670,46 +793,76 @@ static bool expand_macro(Token **rest, Token *tok) {
   // macro token and the closing parenthesis and use it as a new hideset
   // as explained in the Dave Prossor's algorithm.
   Hideset *hs = hideset_intersection(macro_token->hideset, rparen->hideset);
-  hs = hideset_union(hs, new_hideset(m->name));
+  hs = hideset_union(hs, new_hideset(macro_token->atom));
 
   Token *body = subst(m->body, args);
-  body = add_hideset(body, hs);
-  for (Token *t = body; t->kind != TK_EOF; t = t->next)
-    t->origin = macro_token;
-  *rest = append(body, tok->next);
+  if (opt_pp_stats)
+    pp_expand(m, body);
+  *rest = finish_expansion(body, hs, macro_token, tok->next);
   (*rest)->at_bol = macro_token->at_bol;
   (*rest)->has_space = macro_token->has_space;
+  counters.macro_expansions++;
   return true;
 }
 
-char *search_include_paths(char *filename) {
-  if (filename[0] == '/')
-    return filename;
+#define FILE_FOUND ((void *)1)
+#define FILE_NOT_FOUND ((void *)2)
 
+// Returns true if a given file exists. A translation unit searches
+// the same include directories for many files, and most of the
+// lookups fail, so both positive and negative results are cached for
+// the lifetime of the process.
+static bool file_exists_cached(char *path) {
   static HashMap cache;
-  char *cached = hashmap_get(&cache, filename);
-  if (cached)
-    return cached;
-
-  // Search a file from the include paths.
-  for (int i = 0; i < include_paths.len; i++) {
-    char *path = format("%s/%s", include_paths.data[i], filename);
-    if (!file_exists(path))
-      continue;
-    hashmap_put(&cache, filename, path);
-    include_next_idx = i + 1;
-    return path;
+  void *val = hashmap_get(&cache, path);
+  if (!val) {
+    val = file_exists(path) ? FILE_FOUND : FILE_NOT_FOUND;
+    hashmap_put(&cache, path, val);
   }
-  return NULL;
+  return val == FILE_FOUND;
 }
 
-static char *search_include_next(char *filename) {
-  for (; include_next_idx < include_paths.len; include_next_idx++) {
-    char *path = format("%s/%s", include_paths.data[include_next_idx], filename);
-    if (file_exists(path))
-      return path;
+typedef struct {
+  char *path;   // Found path, or NULL
+  int next_idx; // Where #include_next continues the search
+} IncludeHit;
+
+// Search a file from the include paths starting from the i'th one.
+// Results are memoized on the file name and i, so that a repeated
+// #include or #include_next takes a single hash lookup.
+static char *search_include_paths2(char *filename, int i) {
+  static HashMap cache;
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), "%d %s", i, filename);
+  char *key = (len < sizeof(buf)) ? buf : format("%d %s", i, filename);
+
+  IncludeHit *hit = hashmap_get2(&cache, key, len);
+  if (!hit) {
+    hit = calloc(1, sizeof(IncludeHit));
+    for (int j = i; j < include_paths.len; j++) {
+      char *path = format("%s/%s", include_paths.data[j], filename);
+      if (file_exists_cached(path)) {
+        hit->path = path;
+        hit->next_idx = j + 1;
+        break;
+      }
+    }
+    hashmap_put2(&cache, strndup(key, len), len, hit);
   }
-  return NULL;
+
+  if (hit->path)
+    include_next_idx = hit->next_idx;
+  return hit->path;
+}
+
+char *search_include_paths(char *filename) {
+  if (filename[0] == '/')
+    return filename;
+  return search_include_paths2(filename, 0);
+}
+
+static char *search_include_next(char *filename) {
+  return search_include_paths2(filename, include_next_idx);
 }
 
 // Read an #include argument.
@@ -759,61 +912,52 @@ static char *read_include_filename(Token **rest, Token *tok, bool *is_dquote) {
 //   #define FOO_H
 //   ...
 //   #endif
+// A file is guarded by an include guard if it starts with
+// `#ifndef X` and `#define X` and ends with the matching `#endif`.
+// `tok` is the first part of a lazily-tokenized file.
 static char *detect_include_guard(Token *tok) {
-  // Detect the first two lines.
   if (!is_hash(tok) || !equal(tok->next, "ifndef"))
     return NULL;
   tok = tok->next->next;
 
-  if (tok->kind != TK_IDENT)
+  if (tok->kind != TK_IDENT || tok->next->kind != TK_LAZY)
     return NULL;
 
   char *macro = strndup(tok->loc, tok->len);
-  tok = tok->next;
-
-  if (!is_hash(tok) || !equal(tok->next, "define") || !equal(tok->next->next, macro))
-    return NULL;
-
-  // Read until the end of the file.
-  while (tok->kind != TK_EOF) {
-    if (!is_hash(tok)) {
-      tok = tok->next;
-      continue;
-    }
-
-    if (equal(tok->next, "endif") && tok->next->next->kind == TK_EOF)
-      return macro;
-
-    if (equal(tok, "if") || equal(tok, "ifdef") || equal(tok, "ifndef"))
-      tok = skip_cond_incl(tok->next);
-    else
-      tok = tok->next;
-  }
+  if (is_include_guard(tok->next, macro))
+    return macro;
   return NULL;
 }
 
 static Token *include_file(Token *tok, char *path, Token *filename_tok) {
   // Check for "#pragma once"
-  if (hashmap_get(&pragma_once, path))
+  if (hashmap_get(&pragma_once, path)) {
+    if (opt_pp_stats)
+      pp_include(path, filename_tok->file, NULL, true);
     return tok;
+  }
 
   // If we read the same file before, and if the file was guarded
   // by the usual #ifndef ... #endif pattern, we may be able to
   // skip the file without opening it.
-  static HashMap include_guards;
   char *guard_name = hashmap_get(&include_guards, path);
-  if (guard_name && hashmap_get(&macros, guard_name))
+  if (guard_name && intern_atom(guard_name, strlen(guard_name))->macro) {
+    if (opt_pp_stats)
+      pp_include(path, filename_tok->file, NULL, false);
     return tok;
+  }
 
   Token *tok2 = tokenize_file(path);
   if (!tok2)
     error_tok(filename_tok, "%s: cannot open file: %s", path, strerror(errno));
+  if (opt_pp_stats)
+    pp_include(path, filename_tok->file, tok2->file, false);
 
   guard_name = detect_include_guard(tok2);
   if (guard_name)
     hashmap_put(&include_guards, path, guard_name);
 
-  return append(tok2, tok);
+  return append_tokens(tok2, tok);
 }
 
 // Read #line arguments
@@ -821,9 +965,9 @@ static void read_line_marker(Token **rest, Token *tok) {
   Token *start = tok;
   tok = preprocess(copy_line(rest, tok));
 
-  if (tok->kind != TK_NUM || tok->ty->kind != TY_INT)
+  if (tok->kind != TK_NUM || tok->lit->ty->kind != TY_INT)
     error_tok(tok, "invalid line marker");
-  start->file->line_delta = tok->val - start->line_no;
+  start->file->line_delta = tok->lit->val - start->line_no;
 
   tok = tok->next;
   if (tok->kind == TK_EOF)
@@ -831,7 +975,7 @@ static void read_line_marker(Token **rest, Token *tok) {
 
   if (tok->kind != TK_STR)
     error_tok(tok, "filename expected");
-  start->file->display_name = tok->str;
+  start->file->display_name = tok->lit->str;
 }
 
 // Visit all tokens in `tok` while evaluating preprocessing
@@ -841,6 +985,14 @@ static Token *preprocess2(Token *tok) {
   Token *cur = &head;
 
   while (tok->kind != TK_EOF) {
+    if (opt_pp_stats && !tok->hideset)
+      pp_enter(tok->file);
+
+    if (tok->kind == TK_LAZY) {
+      tok = tokenize_rest(tok);
+      continue;
+    }
+
     // If it is a macro, expand it.
     if (expand_macro(&tok, tok))
       continue;
@@ -863,7 +1015,7 @@ static Token *preprocess2(Token *tok) {
 
       if (filename[0] != '/' && is_dquote) {
         char *path = format("%s/%s", dirname(strdup(start->file->name)), filename);
-        if (file_exists(path)) {
+        if (file_exists_cached(path)) {
           tok = include_file(tok, path, start->next->next);
           continue;
         }
@@ -996,7 +1148,7 @@ void define_macro(char *name, char *buf) {
 }
 
 void undef_macro(char *name) {
-  hashmap_delete(&macros, name);
+  intern_atom(name, strlen(name))->macro = NULL;
 }
 
 static Macro *add_builtin(char *name, macro_handler_fn *fn) {
@@ -1057,48 +1209,56 @@ static char *format_time(struct tm *tm) {
   return format("\"%02d:%02d:%02d\"", tm->tm_hour, tm->tm_min, tm->tm_sec);
 }
 
+// Predefined macros, one per line. They are tokenized in one go at
+// startup rather than one by one.
+static char predefined_macros[] =
+  "_LP64 1\n"
+  "__C99_MACRO_WITH_VA_ARGS 1\n"
+  "__ELF__ 1\n"
+  "__LP64__ 1\n"
+  "__SIZEOF_DOUBLE__ 8\n"
+  "__SIZEOF_FLOAT__ 4\n"
+  "__SIZEOF_INT__ 4\n"
+  "__SIZEOF_LONG_DOUBLE__ 8\n"
+  "__SIZEOF_LONG_LONG__ 8\n"
+  "__SIZEOF_LONG__ 8\n"
+  "__SIZEOF_POINTER__ 8\n"
+  "__SIZEOF_PTRDIFF_T__ 8\n"
+  "__SIZEOF_SHORT__ 2\n"
+  "__SIZEOF_SIZE_T__ 8\n"
+  "__SIZE_TYPE__ unsigned long\n"
+  "__STDC_HOSTED__ 1\n"
+  "__STDC_NO_COMPLEX__ 1\n"
+  "__STDC_UTF_16__ 1\n"
+  "__STDC_UTF_32__ 1\n"
+  "__STDC_VERSION__ 201112L\n"
+  "__STDC__ 1\n"
+  "__USER_LABEL_PREFIX__\n"
+  "__alignof__ _Alignof\n"
+  "__amd64 1\n"
+  "__amd64__ 1\n"
+  "__chibicc__ 1\n"
+  "__const__ const\n"
+  "__gnu_linux__ 1\n"
+  "__inline__ inline\n"
+  "__linux 1\n"
+  "__linux__ 1\n"
+  "__signed__ signed\n"
+  "__typeof__ typeof\n"
+  "__unix 1\n"
+  "__unix__ 1\n"
+  "__volatile__ volatile\n"
+  "__x86_64 1\n"
+  "__x86_64__ 1\n"
+  "linux 1\n"
+  "unix 1\n";
+
 void init_macros(void) {
-  // Define predefined macros
-  define_macro("_LP64", "1");
-  define_macro("__C99_MACRO_WITH_VA_ARGS", "1");
-  define_macro("__ELF__", "1");
-  define_macro("__LP64__", "1");
-  define_macro("__SIZEOF_DOUBLE__", "8");
-  define_macro("__SIZEOF_FLOAT__", "4");
-  define_macro("__SIZEOF_INT__", "4");
-  define_macro("__SIZEOF_LONG_DOUBLE__", "8");
-  define_macro("__SIZEOF_LONG_LONG__", "8");
-  define_macro("__SIZEOF_LONG__", "8");
-  define_macro("__SIZEOF_POINTER__", "8");
-  define_macro("__SIZEOF_PTRDIFF_T__", "8");
-  define_macro("__SIZEOF_SHORT__", "2");
-  define_macro("__SIZEOF_SIZE_T__", "8");
-  define_macro("__SIZE_TYPE__", "unsigned long");
-  define_macro("__STDC_HOSTED__", "1");
-  define_macro("__STDC_NO_COMPLEX__", "1");
-  define_macro("__STDC_UTF_16__", "1");
-  define_macro("__STDC_UTF_32__", "1");
-  define_macro("__STDC_VERSION__", "201112L");
-  define_macro("__STDC__", "1");
-  define_macro("__USER_LABEL_PREFIX__", "");
-  define_macro("__alignof__", "_Alignof");
-  define_macro("__amd64", "1");
-  define_macro("__amd64__", "1");
-  define_macro("__chibicc__", "1");
-  define_macro("__const__", "const");
-  define_macro("__gnu_linux__", "1");
-  define_macro("__inline__", "inline");
-  define_macro("__linux", "1");
-  define_macro("__linux__", "1");
-  define_macro("__signed__", "signed");
-  define_macro("__typeof__", "typeof");
-  define_macro("__unix", "1");
-  define_macro("__unix__", "1");
-  define_macro("__volatile__", "volatile");
-  define_macro("__x86_64", "1");
-  define_macro("__x86_64__", "1");
-  define_macro("linux", "1");
-  define_macro("unix", "1");
+  Token *tok = tokenize(new_file("<built-in>", 1, predefined_macros));
+  while (tok->kind != TK_EOF) {
+    Token *name = tok;
+    add_macro(name->atom->name, true, copy_line(&tok, name->next));
+  }
 
   add_builtin("__FILE__", file_macro);
   add_builtin("__LINE__", line_macro);
@@ -1117,7 +1277,7 @@ typedef enum {
 } StringKind;
 
 static StringKind getStringKind(Token *tok) {
-  if (!strcmp(tok->loc, "u8"))
+  if (!strncmp(tok->loc, "u8", 2))
     return STR_UTF8;
 
   switch (tok->loc[0]) {
@@ -1131,10 +1291,13 @@ static StringKind getStringKind(Token *tok) {
 
 // Concatenate adjacent string literals into a single string literal
 // as per the C spec.
+//
+// If regular string literals are adjacent to wide string literals,
+// regular string literals are converted to the wide type before
+// concatenation. Each run of literals is joined in a single pass: we
+// first find the element type and an upper bound of the length, and
+// then write all the characters into one buffer.
 static void join_adjacent_string_literals(Token *tok) {
-  // First pass: If regular string literals are adjacent to wide
-  // string literals, regular string literals are converted to a wide
-  // type before concatenation. In this pass, we do the conversion.
   for (Token *tok1 = tok; tok1->kind != TK_EOF;) {
     if (tok1->kind != TK_STR || tok1->next->kind != TK_STR) {
       tok1 = tok1->next;
@@ -1142,53 +1305,40 @@ static void join_adjacent_string_literals(Token *tok) {
     }
 
     StringKind kind = getStringKind(tok1);
-    Type *basety = tok1->ty->base;
+    Type *basety = tok1->lit->ty->base;
+    int cap = tok1->lit->ty->array_len;
 
-    for (Token *t = tok1->next; t->kind == TK_STR; t = t->next) {
-      StringKind k = getStringKind(t);
+    Token *tok2 = tok1->next;
+    for (; tok2->kind == TK_STR; tok2 = tok2->next) {
+      StringKind k = getStringKind(tok2);
       if (kind == STR_NONE) {
         kind = k;
-        basety = t->ty->base;
+        basety = tok2->lit->ty->base;
       } else if (k != STR_NONE && kind != k) {
-        error_tok(t, "unsupported non-standard concatenation of string literals");
+        error_tok(tok2, "unsupported non-standard concatenation of string literals");
       }
+      cap += tok2->lit->ty->array_len - 1;
     }
 
-    if (basety->size > 1)
-      for (Token *t = tok1; t->kind == TK_STR; t = t->next)
-        if (t->ty->base->size == 1)
-          *t = *tokenize_string_literal(t, basety);
-
-    while (tok1->kind == TK_STR)
-      tok1 = tok1->next;
-  }
-
-  // Second pass: concatenate adjacent string literals.
-  for (Token *tok1 = tok; tok1->kind != TK_EOF;) {
-    if (tok1->kind != TK_STR || tok1->next->kind != TK_STR) {
-      tok1 = tok1->next;
-      continue;
-    }
-
-    Token *tok2 = tok1->next;
-    while (tok2->kind == TK_STR)
-      tok2 = tok2->next;
+    int sz = basety->size;
+    char *buf = arena_alloc(ARENA_MISC, sz * cap);
+    int len = 0;
 
-    int len = tok1->ty->array_len;
-    for (Token *t = tok1->next; t != tok2; t = t->next)
-      len = len + t->ty->array_len - 1;
-
-    char *buf = calloc(tok1->ty->base->size, len);
-
-    int i = 0;
     for (Token *t = tok1; t != tok2; t = t->next) {
-      memcpy(buf + i, t->str, t->ty->size);
-      i = i + t->ty->size - t->ty->base->size;
+      if (t->lit->ty->base->size == sz) {
+        int n = t->lit->ty->array_len - 1;
+        memcpy(buf + len * sz, t->lit->str, n * sz);
+        len += n;
+      } else {
+        len += transcode_string_literal(t, basety, buf + len * sz);
+      }
     }
 
-    *tok1 = *copy_token(tok1);
-    tok1->ty = array_of(tok1->ty->base, len);
-    tok1->str = buf;
+    // The literal may be shared with a macro body, so make a new one.
+    Literal *lit = arena_alloc(ARENA_LITERAL, sizeof(Literal));
+    lit->ty = array_of(basety, len + 1);
+    lit->str = buf;
+    tok1->lit = lit;
     tok1->next = tok2;
     tok1 = tok2;
   }
@@ -1206,3 +1356,758 @@ Token *preprocess(Token *tok) {
     t->line_no += t->line_delta;
   return tok;
 }
+
+//
+// Preprocessor statistics
+//
+// If --pp-stats is given, we record the include tree, how often each
+// header is included or skipped, and how much each macro expands. Time
+// is charged to the file whose tokens the preprocessor is working on,
+// which changes at #include boundaries. Tokens from macro expansions
+// are ignored for that purpose because they carry the location of
+// the macro definition.
+//
+
+bool opt_pp_stats;
+
+typedef struct PPFile PPFile;
+struct PPFile {
+  File *file;
+  PPFile *parent;
+  PPFile *children;
+  PPFile *next;
+  double self_ms;
+};
+
+typedef struct {
+  char *path;
+  int includes;
+  int once_skips;
+  int guard_skips;
+} PPHeader;
+
+typedef struct {
+  char *name;
+  long expansions;
+  long tokens;
+} PPMacro;
+
+static PPFile **pp_files; // Indexed by file_no
+static int pp_files_cap;
+static File *pp_cur_file;
+static PPFile *pp_cur;
+static double pp_start;
+static HashMap pp_headers;
+static HashMap pp_macros;
+
+static PPFile *pp_file(File *file) {
+  if (file->file_no >= pp_files_cap) {
+    int cap = MAX(file->file_no + 1, pp_files_cap * 2);
+    pp_files = realloc(pp_files, sizeof(PPFile *) * cap);
+    memset(pp_files + pp_files_cap, 0, sizeof(PPFile *) * (cap - pp_files_cap));
+    pp_files_cap = cap;
+  }
+
+  if (!pp_files[file->file_no]) {
+    PPFile *pf = arena_alloc(ARENA_MISC, sizeof(PPFile));
+    pf->file = file;
+    pp_files[file->file_no] = pf;
+  }
+  return pp_files[file->file_no];
+}
+
+// Starts charging time to a given file.
+static void pp_enter(File *file) {
+  if (file == pp_cur_file)
+    return;
+
+  double now = now_ms();
+  if (pp_cur)
+    pp_cur->self_ms += now - pp_start;
+  pp_start = now;
+  pp_cur_file = file;
+  pp_cur = file ? pp_file(file) : NULL;
+}
+
+// Records an #include of `path` from `from`. `to` is the file that
+// was read, or NULL if the file was skipped.
+static void pp_include(char *path, File *from, File *to, bool once) {
+  PPHeader *h = hashmap_get(&pp_headers, path);
+  if (!h) {
+    h = arena_alloc(ARENA_MISC, sizeof(PPHeader));
+    h->path = path;
+    hashmap_put(&pp_headers, path, h);
+  }
+  h->includes++;
+
+  if (!to) {
+    if (once)
+      h->once_skips++;
+    else
+      h->guard_skips++;
+    return;
+  }
+
+  PPFile *parent = pp_file(from);
+  PPFile *child = pp_file(to);
+  child->parent = parent;
+
+  PPFile **p = &parent->children;
+  while (*p)
+    p = &(*p)->next;
+  *p = child;
+}
+
+static void pp_expand(Macro *m, Token *body) {
+  PPMacro *pm = hashmap_get(&pp_macros, m->name);
+  if (!pm) {
+    pm = arena_alloc(ARENA_MISC, sizeof(PPMacro));
+    pm->name = m->name;
+    hashmap_put(&pp_macros, m->name, pm);
+  }
+
+  pm->expansions++;
+  for (Token *t = body; t && t->kind != TK_EOF; t = t->next)
+    pm->tokens++;
+}
+
+static double pp_total_ms(PPFile *pf) {
+  double ms = pf->self_ms;
+  for (PPFile *c = pf->children; c; c = c->next)
+    ms += pp_total_ms(c);
+  return ms;
+}
+
+static void print_pp_file(FILE *out, PPFile *pf, int depth) {
+  fprintf(out, "%*s%-*s %10ld %10.3f\n", depth * 2, "", 56 - depth * 2,
+          pf->file->name, pf->file->ntokens, pp_total_ms(pf));
+  for (PPFile *c = pf->children; c; c = c->next)
+    print_pp_file(out, c, depth + 1);
+}
+
+static int compare_pp_headers(const void *a, const void *b) {
+  PPHeader *x = *(PPHeader **)a;
+  PPHeader *y = *(PPHeader **)b;
+  if (x->includes != y->includes)
+    return y->includes - x->includes;
+  return strcmp(x->path, y->path);
+}
+
+static int compare_pp_macros(const void *a, const void *b) {
+  PPMacro *x = *(PPMacro **)a;
+  PPMacro *y = *(PPMacro **)b;
+  if (x->expansions != y->expansions)
+    return (y->expansions > x->expansions) - (y->expansions < x->expansions);
+  return strcmp(x->name, y->name);
+}
+
+// Returns the values of a hashmap as an array.
+static void **hashmap_values(HashMap *map, int *len) {
+  void **vals = calloc(map->used + 1, sizeof(void *));
+  *len = 0;
+  int idx = 0;
+  for (HashEntry *ent; (ent = hashmap_next(map, &idx));)
+    vals[(*len)++] = ent->val;
+  return vals;
+}
+
+void print_pp_stats(FILE *out) {
+  pp_enter(NULL);
+
+  fprintf(out, "%-56s %10s %10s\n", "include tree", "tokens", "time (ms)");
+  for (int i = 0; i < pp_files_cap; i++)
+    if (pp_files[i] && !pp_files[i]->parent)
+      print_pp_file(out, pp_files[i], 0);
+
+  int n;
+  PPHeader **headers = (PPHeader **)hashmap_values(&pp_headers, &n);
+  qsort(headers, n, sizeof(*headers), compare_pp_headers);
+
+  fprintf(out, "\n%-56s %8s %8s %8s %8s\n", "header", "includes", "read",
+          "guard", "once");
+  for (int i = 0; i < n; i++) {
+    PPHeader *h = headers[i];
+    fprintf(out, "%-56s %8d %8d %8d %8d\n", h->path, h->includes,
+            h->includes - h->guard_skips - h->once_skips, h->guard_skips,
+            h->once_skips);
+  }
+
+  PPMacro **macros = (PPMacro **)hashmap_values(&pp_macros, &n);
+  qsort(macros, n, sizeof(*macros), compare_pp_macros);
+
+  fprintf(out, "\n%-40s %12s %12s\n", "macro", "expansions", "tokens");
+  for (int i = 0; i < n && i < 30; i++)
+    fprintf(out, "%-40s %12ld %12ld\n", macros[i]->name,
+            macros[i]->expansions, macros[i]->tokens);
+}
+
+//
+// Precompiled headers
+//
+// A precompiled header is a snapshot of the preprocessor state right
+// after reading a header file: the macro table, the #pragma once and
+// include guard tables, and the preprocessed tokens of the header.
+// If a file given by -include has a ".pch" file next to it, cc1 loads
+// the snapshot instead of preprocessing the header again.
+//
+// A snapshot is valid only for the same compiler binary, the same
+// include paths and the same macros defined before the header, so
+// we save a hash of them and compare it on load. We also record the
+// size and mtime of every file that the header read.
+//
+// A .pch file consists of a PchHeader, arrays of PchToken, PchFile,
+// PchMacro, #pragma once paths and PchGuard, a string table and the
+// token text. Everything refers to each other by index or offset, so
+// we can use a memory-mapped file as-is.
+//
+
+#define PCH_MAGIC "CHIBPCH1"
+
+typedef struct {
+  char magic[8];
+  char key[32];
+  int ntoks;
+  int nfiles;
+  int nmacros;
+  int nonce;
+  int nguards;
+  int strs_len;
+  int text_len;
+} PchHeader;
+
+typedef struct {
+  long double fval;
+  int64_t val;
+  int kind;
+  int file;      // Index into the file table, or -1
+  int filename;  // String offset, or -1
+  int line_no;
+  int loc;       // Offset into the token text
+  int len;
+  int ty;        // Index into pch_types, or 0
+  int array_len; // Array length if string literal
+  int str;       // String offset, or -1
+  bool at_bol;
+  bool has_space;
+} PchToken;
+
+typedef struct {
+  int name;
+  int display_name;
+  int file_no;
+  bool is_input; // True if it should be listed for .file directives
+  long mtime;
+  long size;
+} PchFile;
+
+typedef struct {
+  int name;
+  bool is_objlike;
+  int params;       // Space-separated parameter names
+  int va_args_name; // String offset, or -1
+  int body;         // Index of the first body token
+} PchMacro;
+
+typedef struct {
+  int path;
+  int macro;
+} PchGuard;
+
+// Types that a token can have.
+static Type **pch_types[] = {
+  NULL, &ty_char, &ty_ushort, &ty_int, &ty_uint, &ty_long, &ty_ulong,
+  &ty_float, &ty_double, &ty_ldouble,
+};
+
+// __DATE__ and __TIME__ are defined for each compilation, and builtin
+// macros are defined by the compiler, so they are not saved.
+static bool is_pch_macro(Macro *m) {
+  return m && !m->handler && strcmp(m->name, "__DATE__") && strcmp(m->name, "__TIME__");
+}
+
+static char *describe_macro(Macro *m) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  fprintf(out, "%s %d", m->name, m->is_objlike);
+  for (MacroParam *mp = m->params; mp; mp = mp->next)
+    fprintf(out, " %s", mp->name);
+  fprintf(out, " %s =", m->va_args_name ? m->va_args_name : "");
+  for (Token *t = m->body; t && t->kind != TK_EOF; t = t->next)
+    fprintf(out, " %.*s", t->len, t->loc);
+  fclose(out);
+  return buf;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+// Returns a hash of everything other than the header itself that
+// affects the result of preprocessing a header.
+static char *pch_key(void) {
+  StringArray arr = {};
+  int i = 0;
+  for (Atom *a; (a = next_atom(&i));)
+    if (is_pch_macro(a->macro))
+      strarray_push(&arr, format("macro %s", describe_macro(a->macro)));
+
+  i = 0;
+  for (HashEntry *ent; (ent = hashmap_next(&pragma_once, &i));)
+    strarray_push(&arr, format("once %.*s", ent->keylen, ent->key));
+
+  i = 0;
+  for (HashEntry *ent; (ent = hashmap_next(&include_guards, &i));)
+    strarray_push(&arr, format("guard %.*s %s", ent->keylen, ent->key,
+                               (char *)ent->val));
+
+  // Hash tables are not ordered by insertion, so sort the lines.
+  qsort(arr.data, arr.len, sizeof(char *), compare_strings);
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  for (int i = 0; i < include_paths.len; i++)
+    fprintf(out, "include %s\n", include_paths.data[i]);
+  for (int i = 0; i < arr.len; i++)
+    fprintf(out, "%s\n", arr.data[i]);
+  fclose(out);
+  return compiler_hash(buf);
+}
+
+static FILE *pch_toks;
+static FILE *pch_strs;
+static FILE *pch_text;
+static HashMap pch_str_map;
+static File **pch_files;
+static int pch_nfiles;
+static int pch_ntoks;
+
+static int pch_str(char *s) {
+  if (!s)
+    return -1;
+
+  long off = (long)hashmap_get(&pch_str_map, s);
+  if (off)
+    return off - 1;
+
+  off = ftell(pch_strs);
+  fwrite(s, strlen(s) + 1, 1, pch_strs);
+  hashmap_put(&pch_str_map, s, (void *)(off + 1));
+  return off;
+}
+
+static int pch_file(File *file) {
+  if (!file)
+    return -1;
+
+  for (int i = pch_nfiles - 1; i >= 0; i--)
+    if (pch_files[i] == file)
+      return i;
+
+  pch_files = realloc(pch_files, sizeof(File *) * (pch_nfiles + 1));
+  pch_files[pch_nfiles] = file;
+  return pch_nfiles++;
+}
+
+static int pch_type(Type *ty) {
+  if (!ty)
+    return 0;
+  for (int i = 1; i < sizeof(pch_types) / sizeof(*pch_types); i++)
+    if (*pch_types[i] == ty)
+      return i;
+  error("internal error: unknown token type");
+}
+
+// Writes tokens up to and including TK_EOF, and returns
+// the index of the first one.
+static int write_pch_tokens(Token *tok) {
+  int start = pch_ntoks;
+
+  for (;; tok = tok->next) {
+    PchToken t;
+    memset(&t, 0, sizeof(t));
+    t.kind = tok->kind;
+    t.file = pch_file(tok->file);
+    t.filename = pch_str(tok->filename);
+    t.line_no = tok->line_no;
+    t.len = tok->len;
+    t.str = -1;
+    t.at_bol = tok->at_bol;
+    t.has_space = tok->has_space;
+
+    // Token text is laid out like source code so that error messages
+    // can show the line containing a token.
+    if (tok->at_bol)
+      fputc('\n', pch_text);
+    else if (tok->has_space)
+      fputc(' ', pch_text);
+    t.loc = ftell(pch_text);
+    fwrite(tok->loc, tok->len, 1, pch_text);
+
+    if (tok->kind == TK_NUM) {
+      t.fval = tok->lit->fval;
+      t.val = tok->lit->val;
+      t.ty = pch_type(tok->lit->ty);
+    } else if (tok->kind == TK_STR) {
+      t.ty = pch_type(tok->lit->ty->base);
+      t.array_len = tok->lit->ty->array_len;
+      t.str = ftell(pch_strs);
+      fwrite(tok->lit->str, tok->lit->ty->size, 1, pch_strs);
+    }
+
+    fwrite(&t, sizeof(t), 1, pch_toks);
+    pch_ntoks++;
+    if (tok->kind == TK_EOF)
+      return start;
+  }
+}
+
+static bool is_input_file(File *file) {
+  File **files = get_input_files();
+  for (int i = 0; files && files[i]; i++)
+    if (files[i] == file)
+      return true;
+  return false;
+}
+
+// Write a section padded to 16 bytes, so that every section
+// of a mapped file is properly aligned.
+static void write_pch_section(FILE *out, void *buf, size_t len) {
+  static char zero[16];
+  fwrite(buf, len, 1, out);
+  fwrite(zero, align_to(len, 16) - len, 1, out);
+}
+
+// Preprocesses a given header and writes the result and the
+// resulting preprocessor state to `out`.
+void write_pch(Token *tok, FILE *out) {
+  char *key = pch_key();
+  tok = preprocess(tok);
+
+  char *toks, *strs, *text, *macs, *once, *guards;
+  size_t toks_len, strs_len, text_len, macs_len, once_len, guards_len;
+  pch_toks = open_memstream(&toks, &toks_len);
+  pch_strs = open_memstream(&strs, &strs_len);
+  pch_text = open_memstream(&text, &text_len);
+
+  PchHeader hdr = {};
+  memcpy(hdr.magic, PCH_MAGIC, sizeof(hdr.magic));
+  memcpy(hdr.key, key, sizeof(hdr.key));
+
+  write_pch_tokens(tok);
+
+  FILE *fp = open_memstream(&macs, &macs_len);
+  int i = 0;
+  for (Atom *a; (a = next_atom(&i));) {
+    Macro *m = a->macro;
+    if (!is_pch_macro(m))
+      continue;
+
+    char *params;
+    size_t params_len;
+    FILE *fp2 = open_memstream(&params, &params_len);
+    for (MacroParam *mp = m->params; mp; mp = mp->next)
+      fprintf(fp2, "%s%s", mp == m->params ? "" : " ", mp->name);
+    fclose(fp2);
+
+    PchMacro pm = {};
+    pm.name = pch_str(m->name);
+    pm.is_objlike = m->is_objlike;
+    pm.params = pch_str(params);
+    pm.va_args_name = pch_str(m->va_args_name);
+    pm.body = write_pch_tokens(m->body);
+    fwrite(&pm, sizeof(pm), 1, fp);
+    hdr.nmacros++;
+  }
+  fclose(fp);
+
+  fp = open_memstream(&once, &once_len);
+  i = 0;
+  for (HashEntry *ent; (ent = hashmap_next(&pragma_once, &i));) {
+    int off = pch_str(format("%.*s", ent->keylen, ent->key));
+    fwrite(&off, sizeof(off), 1, fp);
+    hdr.nonce++;
+  }
+  fclose(fp);
+
+  fp = open_memstream(&guards, &guards_len);
+  i = 0;
+  for (HashEntry *ent; (ent = hashmap_next(&include_guards, &i));) {
+    PchGuard g = {pch_str(format("%.*s", ent->keylen, ent->key)), pch_str(ent->val)};
+    fwrite(&g, sizeof(g), 1, fp);
+    hdr.nguards++;
+  }
+  fclose(fp);
+
+  // The file table must be written last because the functions
+  // above add new files to it.
+  char *files;
+  size_t files_len;
+  fp = open_memstream(&files, &files_len);
+  for (int i = 0; i < pch_nfiles; i++) {
+    File *file = pch_files[i];
+    PchFile pf = {};
+    pf.name = pch_str(file->name);
+    pf.display_name = pch_str(file->display_name);
+    pf.file_no = file->file_no;
+    pf.is_input = is_input_file(file);
+
+    struct stat st;
+    if (pf.is_input && stat(file->name, &st) == 0) {
+      pf.mtime = st.st_mtime;
+      pf.size = st.st_size;
+    }
+    fwrite(&pf, sizeof(pf), 1, fp);
+  }
+  fclose(fp);
+
+  fputc('\0', pch_text);
+  fclose(pch_toks);
+  fclose(pch_strs);
+  fclose(pch_text);
+
+  hdr.ntoks = pch_ntoks;
+  hdr.nfiles = pch_nfiles;
+  hdr.strs_len = strs_len;
+  hdr.text_len = text_len;
+
+  write_pch_section(out, &hdr, sizeof(hdr));
+  write_pch_section(out, toks, toks_len);
+  write_pch_section(out, files, files_len);
+  write_pch_section(out, macs, macs_len);
+  write_pch_section(out, once, once_len);
+  write_pch_section(out, guards, guards_len);
+  write_pch_section(out, strs, strs_len);
+  write_pch_section(out, text, text_len);
+}
+
+// Section sizes are computed in size_t, so that a corrupted count
+// cannot make them wrap around.
+static size_t pch_section_size(size_t len) {
+  return (len + 15) / 16 * 16;
+}
+
+static void *next_pch_section(char **p, size_t len) {
+  void *ret = *p;
+  *p += pch_section_size(len);
+  return ret;
+}
+
+static bool pch_is_valid(PchHeader *hdr, size_t size) {
+  if (size < sizeof(PchHeader) || memcmp(hdr->magic, PCH_MAGIC, sizeof(hdr->magic)))
+    return false;
+  if (hdr->ntoks <= 0 || hdr->nfiles < 0 || hdr->nmacros < 0 || hdr->nonce < 0 ||
+      hdr->nguards < 0 || hdr->strs_len < 0 || hdr->text_len <= 0)
+    return false;
+
+  size_t len = pch_section_size(sizeof(PchHeader)) +
+               pch_section_size(sizeof(PchToken) * hdr->ntoks) +
+               pch_section_size(sizeof(PchFile) * hdr->nfiles) +
+               pch_section_size(sizeof(PchMacro) * hdr->nmacros) +
+               pch_section_size(sizeof(int) * hdr->nonce) +
+               pch_section_size(sizeof(PchGuard) * hdr->nguards) +
+               pch_section_size(hdr->strs_len) + pch_section_size(hdr->text_len);
+  if (len != size)
+    return false;
+  return !memcmp(hdr->key, pch_key(), sizeof(hdr->key));
+}
+
+// Returns true if `off` is the offset of a NUL-terminated string in
+// the string table, or -1 if `nullable` is true.
+static bool pch_str_ok(char *strs, int strs_len, int off, bool nullable) {
+  if (off == -1)
+    return nullable;
+  return 0 <= off && off < strs_len && memchr(strs + off, '\0', strs_len - off);
+}
+
+// A .pch file may be truncated or corrupted, so we check every index
+// and offset in it before using any of them.
+static bool pch_is_consistent(PchHeader *hdr, PchToken *ptoks, PchFile *pfiles,
+                              PchMacro *pmacs, int *ponce, PchGuard *pguards,
+                              char *strs, char *text) {
+  int n = hdr->strs_len;
+  int ntypes = sizeof(pch_types) / sizeof(*pch_types);
+
+  if (text[hdr->text_len - 1] != '\0' || ptoks[hdr->ntoks - 1].kind != TK_EOF)
+    return false;
+
+  for (int i = 0; i < hdr->ntoks; i++) {
+    PchToken *pt = &ptoks[i];
+    if (pt->kind < 0 || pt->kind > TK_EOF || pt->file < -1 || pt->file >= hdr->nfiles ||
+        !pch_str_ok(strs, n, pt->filename, true) || pt->loc < 0 || pt->len < 0 ||
+        (long)pt->loc + pt->len >= hdr->text_len || pt->ty < 0 || pt->ty >= ntypes)
+      return false;
+
+    if (pt->kind == TK_NUM && pt->ty == 0)
+      return false;
+    if (pt->kind == TK_STR) {
+      if (pt->ty == 0 || pt->array_len < 0 || pt->str < 0 ||
+          pt->str + (long)(*pch_types[pt->ty])->size * pt->array_len > n)
+        return false;
+    }
+  }
+
+  for (int i = 0; i < hdr->nfiles; i++)
+    if (!pch_str_ok(strs, n, pfiles[i].name, false) ||
+        !pch_str_ok(strs, n, pfiles[i].display_name, true))
+      return false;
+
+  for (int i = 0; i < hdr->nmacros; i++) {
+    PchMacro *pm = &pmacs[i];
+    if (!pch_str_ok(strs, n, pm->name, false) || !pch_str_ok(strs, n, pm->params, false) ||
+        !pch_str_ok(strs, n, pm->va_args_name, true) || pm->body < 0 ||
+        pm->body >= hdr->ntoks)
+      return false;
+  }
+
+  for (int i = 0; i < hdr->nonce; i++)
+    if (!pch_str_ok(strs, n, ponce[i], false))
+      return false;
+
+  for (int i = 0; i < hdr->nguards; i++)
+    if (!pch_str_ok(strs, n, pguards[i].path, false) ||
+        !pch_str_ok(strs, n, pguards[i].macro, false))
+      return false;
+  return true;
+}
+
+static int compare_pch_files(const void *a, const void *b) {
+  return (*(PchFile **)a)->file_no - (*(PchFile **)b)->file_no;
+}
+
+static char *pch_string(char *strs, int off) {
+  return off == -1 ? NULL : strs + off;
+}
+
+// Loads "<path>.pch" made from a header file `path`. Returns NULL if
+// the file doesn't exist or is out of date.
+Token *read_pch(char *path) {
+  int fd = open(format("%s.pch", path), O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(PchHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  // Token strings are mutable, so map the file privately.
+  size_t size = st.st_size;
+  char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  PchHeader *hdr = (PchHeader *)buf;
+  if (!pch_is_valid(hdr, size)) {
+    munmap(buf, size);
+    return NULL;
+  }
+
+  char *p = buf;
+  next_pch_section(&p, sizeof(PchHeader));
+  PchToken *ptoks = next_pch_section(&p, sizeof(PchToken) * hdr->ntoks);
+  PchFile *pfiles = next_pch_section(&p, sizeof(PchFile) * hdr->nfiles);
+  PchMacro *pmacs = next_pch_section(&p, sizeof(PchMacro) * hdr->nmacros);
+  int *ponce = next_pch_section(&p, sizeof(int) * hdr->nonce);
+  PchGuard *pguards = next_pch_section(&p, sizeof(PchGuard) * hdr->nguards);
+  char *strs = next_pch_section(&p, hdr->strs_len);
+  char *text = next_pch_section(&p, hdr->text_len);
+
+  if (!pch_is_consistent(hdr, ptoks, pfiles, pmacs, ponce, pguards, strs, text)) {
+    munmap(buf, size);
+    return NULL;
+  }
+
+  // Make sure that the files haven't been modified.
+  for (int i = 0; i < hdr->nfiles; i++) {
+    PchFile *pf = &pfiles[i];
+    if (!pf->is_input)
+      continue;
+    if (stat(strs + pf->name, &st) != 0 || st.st_mtime != pf->mtime ||
+        st.st_size != pf->size) {
+      munmap(buf, size);
+      return NULL;
+    }
+  }
+
+  // Register files in the original order, which is visible
+  // in .file directives and -M output.
+  PchFile **sorted = calloc(hdr->nfiles, sizeof(PchFile *));
+  for (int i = 0; i < hdr->nfiles; i++)
+    sorted[i] = &pfiles[i];
+  qsort(sorted, hdr->nfiles, sizeof(PchFile *), compare_pch_files);
+
+  File **files = calloc(hdr->nfiles, sizeof(File *));
+  for (int j = 0; j < hdr->nfiles; j++) {
+    PchFile *pf = sorted[j];
+    int i = pf - pfiles;
+    if (pf->is_input)
+      files[i] = add_input_file(strs + pf->name, text);
+    else
+      files[i] = new_file(strs + pf->name, pf->file_no, text);
+    if (pf->display_name != -1)
+      files[i]->display_name = strs + pf->display_name;
+  }
+
+  Token *toks = arena_alloc(ARENA_TOKEN, sizeof(Token) * hdr->ntoks);
+  for (int i = 0; i < hdr->ntoks; i++) {
+    PchToken *pt = &ptoks[i];
+    Token *t = &toks[i];
+    t->kind = pt->kind;
+    t->next = (pt->kind == TK_EOF) ? NULL : t + 1;
+    t->loc = text + pt->loc;
+    t->len = pt->len;
+    t->file = (pt->file == -1) ? NULL : files[pt->file];
+    t->filename = pch_string(strs, pt->filename);
+    t->line_no = pt->line_no;
+    t->at_bol = pt->at_bol;
+    t->has_space = pt->has_space;
+    if (pt->kind == TK_IDENT || pt->kind == TK_KEYWORD || pt->kind == TK_PUNCT)
+      t->atom = intern_atom(t->loc, t->len);
+
+    if (pt->kind == TK_NUM || pt->kind == TK_STR) {
+      Literal *lit = arena_alloc(ARENA_LITERAL, sizeof(Literal));
+      lit->val = pt->val;
+      lit->fval = pt->fval;
+      lit->str = pch_string(strs, pt->str);
+      if (pt->kind == TK_STR)
+        lit->ty = array_of(*pch_types[pt->ty], pt->array_len);
+      else
+        lit->ty = *pch_types[pt->ty];
+      t->lit = lit;
+    }
+  }
+
+  // Replace the macro table with the saved one.
+  int idx = 0;
+  for (Atom *a; (a = next_atom(&idx));)
+    if (is_pch_macro(a->macro))
+      a->macro = NULL;
+
+  for (int i = 0; i < hdr->nmacros; i++) {
+    PchMacro *pm = &pmacs[i];
+    Macro *m = add_macro(strs + pm->name, pm->is_objlike, &toks[pm->body]);
+    m->va_args_name = pch_string(strs, pm->va_args_name);
+
+    MacroParam head = {};
+    MacroParam *cur = &head;
+    char *s = strtok(strdup(strs + pm->params), " ");
+    for (; s; s = strtok(NULL, " ")) {
+      cur = cur->next = arena_alloc(ARENA_MISC, sizeof(MacroParam));
+      cur->name = s;
+    }
+    m->params = head.next;
+  }
+
+  for (int i = 0; i < hdr->nonce; i++)
+    hashmap_put(&pragma_once, strs + ponce[i], (void *)1);
+  for (int i = 0; i < hdr->nguards; i++)
+    hashmap_put(&include_guards, strs + pguards[i].path, strs + pguards[i].macro);
+
+  return toks;
+}
@@ -0,0 +1,86 @@
+// This file reads the profile given by -fprofile-use, which is the
+// output of a program compiled with -fprofile-generate (see
+// emit_profile_runtime() in codegen.c). Each line of it is
+//
+//   <count> <function> <index> <kind> <line> <column> <file>
+//
+// Counters are matched by function, kind, position and file, but not
+// by index, because inlining decisions that depend on the profile change
+// the numbering. Counts of lines with the same key are added up, so
+// profiles of several runs can simply be concatenated.
+//
+// Counters that are zero aren't written, so a function that isn't in
+// the profile at all may as well have been compiled differently. We
+// know nothing about such functions, whereas parts of a function that
+// ran but don't appear in the profile never ran.
+
+#include "chibicc.h"
+
+char *opt_profile_use;
+
+// Counts keyed by "<function> <kind> <line> <column> <file>"
+static HashMap counts;
+
+// Functions that ran, keyed by "<function> <file>"
+static HashMap functions;
+
+// Reads a profile and returns a hash of its contents, so that the
+// compilation cache doesn't reuse code compiled with another profile.
+char *read_profile(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char *buf;
+  size_t buflen;
+  FILE *contents = open_memstream(&buf, &buflen);
+
+  char *line = NULL;
+  size_t cap = 0;
+  for (int line_no = 1; getline(&line, &cap, fp) != -1; line_no++) {
+    fputs(line, contents);
+    line[strcspn(line, "\n")] = '\0';
+
+    long n;
+    int lineno = 0, col = 0, off = 0;
+    char fn[256], kind[16];
+    if (sscanf(line, "%ld %255s %*d %15s %d %d %n", &n, fn, kind, &lineno, &col, &off) != 5 ||
+        !line[off])
+      error("%s:%d: invalid profile line", path, line_no);
+
+    char *file = line + off;
+    char *key = format("%s %s %d %d %s", fn, kind, lineno, col, file);
+    long *count = hashmap_get(&counts, key);
+    if (!count) {
+      count = calloc(1, sizeof(long));
+      hashmap_put(&counts, key, count);
+    }
+    *count += n;
+
+    if (!strcmp(kind, "entry"))
+      hashmap_put(&functions, format("%s %s", fn, file), (void *)1);
+  }
+
+  free(line);
+  fclose(fp);
+  fclose(contents);
+  return compiler_hash(buf);
+}
+
+// Returns true if a given function ran in the profile.
+bool has_profile(Obj *fn) {
+  return opt_profile_use &&
+         hashmap_get(&functions, format("%s %s", fn->name, fn->body->tok->file->name));
+}
+
+// Returns how many times the part `kind` of `node` in a function ran,
+// or -1 if there's no profile for the function.
+long profile_count(Obj *fn, Node *node, char *kind) {
+  if (!has_profile(fn))
+    return -1;
+
+  long *count = hashmap_get(&counts, format("%s %s %d %d %s", fn->name, kind,
+                                            node->tok->line_no, column_of(node->tok),
+                                            node->tok->file->name));
+  return count ? *count : 0;
+}
@@ -0,0 +1,379 @@
+// This file implements a linear-scan register allocator for local
+// variables, which is used by the x86-64 backend with -O1.
+//
+// A local variable can live in a register if it is a scalar of integer
+// or pointer type and its address is never taken. We give each such
+// variable a live interval, which is the range of positions of the
+// nodes that refer to it in a pre-order walk of the function body, and
+// then assign registers to intervals in the order of their start
+// positions. If we run out of registers, the variable with the least
+// uses is kept in memory.
+//
+// The intervals don't need to be precise as long as they are
+// conservative. The order of evaluation within an expression doesn't
+// necessarily match the order of the walk, so an interval that
+// overlaps an expression is extended to the whole expression. Likewise,
+// an interval that overlaps a loop is extended to the whole loop,
+// since a value may flow from the end of the loop body to its
+// beginning. Jumps other than loops are forward jumps, except for
+// `goto`s to preceding labels, which we treat as loops, and computed
+// `goto`s, for which we make the whole function a loop.
+
+#include "chibicc.h"
+
+typedef struct {
+  Obj *var;
+  int start;
+  int end;
+  long weight;
+} Interval;
+
+typedef struct {
+  int start;
+  int end;
+} Range;
+
+static Interval *intervals;
+static int nintervals;
+
+// Ranges of loops and expressions
+static Range *ranges;
+static int nranges;
+static int ranges_cap;
+
+// Positions of labels and gotos
+static HashMap label_pos;
+static Node **gotos;
+static int *goto_pos;
+static int ngotos;
+static int gotos_cap;
+
+static int pos;
+static int loop_depth;
+static bool has_goto_expr;
+static bool disabled;
+
+static void add_range(int start, int end) {
+  if (nranges == ranges_cap) {
+    ranges_cap = ranges_cap ? ranges_cap * 2 : 16;
+    ranges = realloc(ranges, sizeof(Range) * ranges_cap);
+  }
+  ranges[nranges++] = (Range){start, end};
+}
+
+// During the analysis, `reg` of a candidate variable holds its index
+// in `intervals` plus one. Other locals have -1.
+static Interval *get_interval(Obj *var) {
+  if (!var->is_local || var->reg <= 0)
+    return NULL;
+  return &intervals[var->reg - 1];
+}
+
+static void use_var(Obj *var) {
+  Interval *in = get_interval(var);
+  if (!in)
+    return;
+
+  if (in->start < 0)
+    in->start = pos;
+  in->end = pos;
+  in->weight += 1L << MIN(loop_depth * 3, 30);
+}
+
+// Marks a variable whose address is taken by `&node`.
+static void take_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    if (node->var->is_local) {
+      node->var->reg = -1;
+      node->var->is_addr_taken = true;
+    }
+    return;
+  case ND_MEMBER:
+    take_addr(node->lhs);
+    return;
+  case ND_COMMA:
+    take_addr(node->rhs);
+    return;
+  }
+}
+
+static void walk(Node *node);
+
+static void walk_list(Node *node) {
+  for (Node *n = node; n; n = n->next)
+    walk(n);
+}
+
+// Walks an expression that is executed as a whole.
+static void walk_expr(Node *node) {
+  if (!node)
+    return;
+  int start = pos;
+  walk(node);
+  add_range(start, pos);
+}
+
+static void walk(Node *node) {
+  if (!node)
+    return;
+
+  pos++;
+
+  switch (node->kind) {
+  case ND_VAR:
+  case ND_MEMZERO:
+    use_var(node->var);
+    return;
+  case ND_ADDR:
+    take_addr(node->lhs);
+    break;
+  case ND_ASSIGN:
+    // `(x, y) = z` is compiled by taking the address of the lhs.
+    if (node->lhs->kind == ND_COMMA)
+      take_addr(node->lhs);
+    break;
+  case ND_ASM:
+    disabled = true;
+    return;
+  case ND_GOTO_EXPR:
+    has_goto_expr = true;
+    break;
+  case ND_LABEL:
+    hashmap_put(&label_pos, node->unique_label, (void *)(intptr_t)pos);
+    break;
+  case ND_GOTO:
+    if (ngotos == gotos_cap) {
+      gotos_cap = gotos_cap ? gotos_cap * 2 : 16;
+      gotos = realloc(gotos, sizeof(Node *) * gotos_cap);
+      goto_pos = realloc(goto_pos, sizeof(int) * gotos_cap);
+    }
+    gotos[ngotos] = node;
+    goto_pos[ngotos++] = pos;
+    return;
+  case ND_FUNCALL:
+    // Values in callee-saved registers are not restored by longjmp().
+    if (node->lhs->kind == ND_VAR && strstr(node->lhs->var->name, "setjmp"))
+      disabled = true;
+    break;
+  }
+
+  switch (node->kind) {
+  case ND_IF:
+    walk_expr(node->cond);
+    walk(node->then);
+    walk(node->els);
+    return;
+  case ND_FOR: {
+    walk(node->init);
+    int start = pos;
+    loop_depth++;
+    walk_expr(node->cond);
+    walk(node->then);
+    walk_expr(node->inc);
+    loop_depth--;
+    add_range(start, pos);
+    return;
+  }
+  case ND_DO: {
+    int start = pos;
+    loop_depth++;
+    walk(node->then);
+    walk_expr(node->cond);
+    loop_depth--;
+    add_range(start, pos);
+    return;
+  }
+  case ND_SWITCH:
+    walk_expr(node->cond);
+    walk(node->then);
+    return;
+  case ND_BLOCK:
+    walk_list(node->body);
+    return;
+  case ND_CASE:
+  case ND_LABEL:
+    walk(node->lhs);
+    return;
+  case ND_EXPR_STMT:
+  case ND_RETURN:
+  case ND_GOTO_EXPR:
+    walk_expr(node->lhs);
+    return;
+  }
+
+  // Expressions
+  walk(node->lhs);
+  walk(node->rhs);
+
+  switch (node->kind) {
+  case ND_COND:
+    walk(node->cond);
+    walk(node->then);
+    walk(node->els);
+    return;
+  case ND_STMT_EXPR:
+    walk_list(node->body);
+    return;
+  case ND_FUNCALL:
+    walk_list(node->args);
+    return;
+  case ND_CAS:
+    walk(node->cas_addr);
+    walk(node->cas_old);
+    walk(node->cas_new);
+    return;
+  }
+}
+
+static bool is_candidate(Obj *fn, Obj *var) {
+  if (var == fn->alloca_bottom || var == fn->va_area || var->ty->is_atomic)
+    return false;
+
+  switch (var->ty->kind) {
+  case TY_BOOL:
+  case TY_CHAR:
+  case TY_SHORT:
+  case TY_INT:
+  case TY_LONG:
+  case TY_ENUM:
+  case TY_PTR:
+    return true;
+  }
+  return false;
+}
+
+// Extends intervals so that each of them covers the loops and
+// expressions it overlaps.
+static void extend_intervals(void) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < nintervals; i++) {
+      Interval *in = &intervals[i];
+      if (in->start < 0)
+        continue;
+
+      for (int j = 0; j < nranges; j++) {
+        Range *r = &ranges[j];
+        if (in->end < r->start || r->end < in->start)
+          continue;
+        if (r->start < in->start || in->end < r->end) {
+          in->start = MIN(in->start, r->start);
+          in->end = MAX(in->end, r->end);
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+static int cmp_start(const void *a, const void *b) {
+  const Interval *x = a, *y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+// Assigns registers 1 to `nregs` to the locals of a given function
+// and returns the number of registers used. Locals that stay in memory
+// get 0.
+int alloc_regs(Obj *fn, int nregs) {
+  nintervals = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    nintervals++;
+
+  intervals = calloc(nintervals, sizeof(Interval));
+  nintervals = 0;
+
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (is_candidate(fn, var)) {
+      intervals[nintervals] = (Interval){var, -1, -1, 0};
+      var->reg = ++nintervals;
+    } else {
+      var->reg = -1;
+    }
+  }
+
+  nranges = 0;
+  ngotos = 0;
+  label_pos = (HashMap){};
+  pos = 0;
+  loop_depth = 0;
+  has_goto_expr = false;
+  disabled = false;
+
+  // Parameters are defined at the beginning of the function.
+  for (Obj *var = fn->params; var; var = var->next)
+    use_var(var);
+
+  walk(fn->body);
+
+  // The hidden buffer for a large struct/union return value is read
+  // by every return statement, so it lives until the end.
+  Type *rty = fn->ty->return_ty;
+  if ((rty->kind == TY_STRUCT || rty->kind == TY_UNION) && rty->size > 16)
+    use_var(fn->params);
+
+  for (int i = 0; i < ngotos; i++) {
+    int label = (intptr_t)hashmap_get(&label_pos, gotos[i]->unique_label);
+    if (label && label < goto_pos[i])
+      add_range(label, goto_pos[i]);
+  }
+
+  if (has_goto_expr)
+    add_range(0, pos);
+
+  // Drop unused variables and variables whose address is taken.
+  int n = 0;
+  for (int i = 0; i < nintervals; i++)
+    if (intervals[i].start >= 0 && intervals[i].var->reg > 0)
+      intervals[n++] = intervals[i];
+  nintervals = n;
+
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->reg = 0;
+
+  if (disabled) {
+    free(intervals);
+    return 0;
+  }
+
+  extend_intervals();
+  qsort(intervals, n, sizeof(Interval), cmp_start);
+
+  // Linear scan. `active[r]` is the interval occupying register r+1.
+  Interval **active = calloc(nregs, sizeof(Interval *));
+  int used = 0;
+
+  for (int i = 0; i < n; i++) {
+    Interval *in = &intervals[i];
+
+    for (int r = 0; r < nregs; r++)
+      if (active[r] && active[r]->end < in->start)
+        active[r] = NULL;
+
+    int r = 0;
+    while (r < nregs && active[r])
+      r++;
+
+    if (r == nregs) {
+      // Evict the variable with the least weight, or skip this one
+      // if it has the least weight.
+      int victim = 0;
+      for (int j = 1; j < nregs; j++)
+        if (active[j]->weight < active[victim]->weight)
+          victim = j;
+      if (active[victim]->weight >= in->weight)
+        continue;
+      active[victim]->var->reg = 0;
+      r = victim;
+    }
+
+    active[r] = in;
+    in->var->reg = r + 1;
+    used = MAX(used, r + 1);
+  }
+
+  free(active);
+  free(intervals);
+  return used;
+}
@@ -0,0 +1,116 @@
+// This file measures how much time and memory each phase of the
+// compiler takes. It is used by -ftime-report and --emit-all-json.
+//
+// The phases are not strictly sequential because the preprocessor
+// tokenizes header files on the fly. phase_enter() and phase_leave()
+// therefore nest, and time is charged to the innermost phase.
+
+#include "chibicc.h"
+#include <sys/resource.h>
+
+Counters counters;
+
+static char *phase_names[] = {
+  [PHASE_TOKENIZE] = "tokenize", [PHASE_PREPROCESS] = "preprocess",
+  [PHASE_PARSE] = "parse", [PHASE_CODEGEN] = "codegen",
+};
+
+static double phase_times[PHASE_NKINDS];
+static long phase_rss[PHASE_NKINDS];
+static bool phase_used[PHASE_NKINDS];
+
+static Phase cur_phase;
+static bool in_phase;
+static double phase_start;
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Returns the peak resident set size of this process in KiB.
+static long peak_rss(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static void stop_clock(void) {
+  if (!in_phase)
+    return;
+  phase_times[cur_phase] += now_ms() - phase_start;
+  phase_rss[cur_phase] = peak_rss();
+}
+
+// Starts a new phase and returns the current one, which
+// should be passed to phase_leave() when the new phase is over.
+Phase phase_enter(Phase phase) {
+  Phase prev = cur_phase;
+  stop_clock();
+
+  cur_phase = phase;
+  in_phase = true;
+  phase_used[phase] = true;
+  phase_start = now_ms();
+  arena_set_phase(phase);
+  return prev;
+}
+
+void phase_leave(Phase prev) {
+  stop_clock();
+  cur_phase = prev;
+  phase_start = now_ms();
+  arena_set_phase(prev);
+}
+
+double phase_time(Phase phase) {
+  if (phase == cur_phase && in_phase)
+    return phase_times[phase] + now_ms() - phase_start;
+  return phase_times[phase];
+}
+
+long phase_peak_rss(Phase phase) {
+  if (phase == cur_phase && in_phase)
+    return peak_rss();
+  return phase_rss[phase];
+}
+
+void print_time_report(FILE *out, bool json) {
+  double total = 0;
+  for (int i = 0; i < PHASE_NKINDS; i++)
+    total += phase_time(i);
+
+  if (json) {
+    fprintf(out, "{\"phases\":{");
+    bool first = true;
+    for (int i = 0; i < PHASE_NKINDS; i++) {
+      if (!phase_used[i])
+        continue;
+      fprintf(out, "%s\"%s\":{\"time_ms\":%.3f,\"peak_rss_kb\":%ld}",
+              first ? "" : ",", phase_names[i], phase_time(i), phase_peak_rss(i));
+      first = false;
+    }
+    fprintf(out, "},\"total_ms\":%.3f", total);
+    fprintf(out, ",\"counters\":{\"tokens\":%ld,\"macro_expansions\":%ld,"
+            "\"nodes\":%ld,\"asm_bytes\":%ld}}\n",
+            counters.tokens, counters.macro_expansions, counters.nodes,
+            counters.asm_bytes);
+    return;
+  }
+
+  fprintf(out, "%-12s %12s %6s %14s\n", "phase", "time (ms)", "%", "peak RSS (KB)");
+  for (int i = 0; i < PHASE_NKINDS; i++) {
+    if (!phase_used[i])
+      continue;
+    double t = phase_time(i);
+    fprintf(out, "%-12s %12.3f %5.1f%% %14ld\n", phase_names[i], t,
+            total > 0 ? t * 100 / total : 0, phase_peak_rss(i));
+  }
+  fprintf(out, "%-12s %12.3f\n", "total", total);
+  fprintf(out, "\n");
+  fprintf(out, "%-18s %12ld\n", "tokens", counters.tokens);
+  fprintf(out, "%-18s %12ld\n", "macro expansions", counters.macro_expansions);
+  fprintf(out, "%-18s %12ld\n", "nodes", counters.nodes);
+  fprintf(out, "%-18s %12ld\n", "asm bytes", counters.asm_bytes);
+}
@@ -139,6 +139,44 @@ int main() {
   ASSERT(6, (long double)3*2);
   ASSERT(5, (long double)3+2.0);
 
+  ASSERT(-3, ({ int x=-7; x/2; }));
+  ASSERT(-1, ({ int x=-7; x%2; }));
+  ASSERT(-1, ({ int x=-7; x/4; }));
+  ASSERT(-3, ({ int x=-7; x%4; }));
+  ASSERT(-268435456, ({ int x=-2147483648; x/8; }));
+  ASSERT(0, ({ int x=-2147483648; x%8; }));
+  ASSERT(-306783378, ({ int x=-2147483648; x/7; }));
+  ASSERT(-2, ({ int x=-2147483648; x%7; }));
+  ASSERT(306783378, ({ int x=2147483647; x/7; }));
+  ASSERT(1, ({ int x=2147483647; x%7; }));
+  ASSERT(-14, ({ int x=-100; x/7; }));
+  ASSERT(-2, ({ int x=-100; x%7; }));
+  ASSERT(536870911, ({ unsigned x=-1; x/8; }));
+  ASSERT(1023, ({ unsigned x=-1; x%1024; }));
+  ASSERT(613566756, ({ unsigned x=-1; x/7; }));
+  ASSERT(3, ({ unsigned x=-1; x%7; }));
+  ASSERT(1, ({ unsigned x=-1; x/4294967295u; }));
+  ASSERT(0, ({ unsigned x=4294967294u; x/4294967295u; }));
+  ASSERT(-1428571428571428L, ({ long x=-10000000000000000L; x/7; }));
+  ASSERT(-4, ({ long x=-10000000000000000L; x%7; }));
+  ASSERT(-1152921504606846976L, ({ long x=-9223372036854775807L-1; x/8; }));
+  ASSERT(-1317624576693539401L, ({ long x=-9223372036854775807L-1; x/7; }));
+  ASSERT(-1, ({ long x=-9223372036854775807L-1; x%7; }));
+  ASSERT(-1099511627775L, ({ long x=-1099511627775L; x%(1L<<40); }));
+  ASSERT(1844674407370955161L, ({ unsigned long x=-1; x/10; }));
+  ASSERT(5, ({ unsigned long x=-1; x%10; }));
+  ASSERT(1, ({ unsigned long x=-1; x/9223372036854775809ul; }));
+  ASSERT(9223372036854775806L, ({ unsigned long x=-1; x%9223372036854775809ul; }));
+  ASSERT(4095, ({ unsigned long x=-1; x%4096; }));
+  ASSERT(-28, ({ int x=-7; x*4; }));
+  ASSERT(-28, ({ int x=-7; 4*x; }));
+  ASSERT(-63, ({ int x=-7; x*9; }));
+  ASSERT(15, ({ int x=5; x*3; }));
+  ASSERT(-2147483648, ({ int x=1; x*-2147483648; }));
+  ASSERT(40000000000L, ({ long x=1000000000; x*40; }));
+  ASSERT(5000000000L, ({ long x=1000000000; x*5; }));
+  ASSERT(3, ({ int a[10]; int i=3; &a[i]-a; }));
+
   printf("OK\n");
   return 0;
 }
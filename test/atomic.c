@@ -52,8 +52,47 @@ static int add_millions(void) {
   return x;
 }
 
+static int set_bits(void *arg) {
+  _Atomic long *x = arg;
+  for (int i = 0; i < 32; i++)
+    *x |= 1L << (i * 2);
+  for (int i = 0; i < 32; i++)
+    *x ^= 1L << (i * 2 + 1);
+  return 0;
+}
+
+static long or_xor(void) {
+  _Atomic long x = 0;
+
+  pthread_t thr;
+  pthread_create(&thr, NULL, set_bits, &x);
+
+  for (int i = 0; i < 32; i++)
+    x ^= 1L << (i * 2 + 1);
+  for (int i = 0; i < 32; i++)
+    x |= 1L << (i * 2);
+
+  pthread_join(thr, NULL);
+  return x;
+}
+
 int main() {
   ASSERT(6*1000*1000, add_millions());
+  ASSERT(0x5555555555555555L == or_xor(), 1);
+
+  ASSERT(8, ({ _Atomic int x=3; x += 5; }));
+  ASSERT(-2, ({ _Atomic int x=3; x -= 5; }));
+  ASSERT(3, ({ _Atomic int x=3; x++; }));
+  ASSERT(2, ({ _Atomic int x=3; --x; }));
+  ASSERT(-126, ({ _Atomic char x=120; x += 10; }));
+  ASSERT(1, ({ _Atomic unsigned short x=65535; x += 2; }));
+  ASSERT(7, ({ _Atomic int x=3; x |= 4; }));
+  ASSERT(2, ({ _Atomic int x=3; x &= 6; }));
+  ASSERT(5, ({ _Atomic int x=3; x ^= 6; }));
+  ASSERT(5, ({ _Atomic int x=3; x ^= 6; x; }));
+  ASSERT(12, ({ _Atomic int x=3; x *= 4; }));
+  ASSERT(3, ({ int a[5]; _Atomic(int *) p=a; p += 4; --p; p - a; }));
+  ASSERT(9, ({ struct { _Atomic int m; } s={4}; s.m += 5; s.m; }));
 
   ASSERT(3, ({ int x=3; atomic_exchange(&x, 5); }));
   ASSERT(5, ({ int x=3; atomic_exchange(&x, 5); x; }));
@@ -28,6 +28,27 @@ int main() {
 
   ASSERT(1, ({ struct {int a; int b;} x; __builtin_types_compatible_p(typeof(x.a), typeof(x.b)); }));
 
+  ASSERT(3, __builtin_expect(3, 0));
+  ASSERT(0, ({ int x = 5; __builtin_expect(x == 3, 1); }));
+  ASSERT(7, ({ int x = 5; int y = 0; if (__builtin_expect(x == 5, 0)) y = 7; y; }));
+  ASSERT(2, ({ int x = 5; int y = 0; if (__builtin_expect(x, 1)) y = 2; else y = 9; y; }));
+  ASSERT(9, ({ int x = 0; int y = 0; if (!__builtin_expect(x, 0)) y = 9; y; }));
+
+  ASSERT(5, strlen("hello"));
+  ASSERT(1, strlen("a\0b"));
+  ASSERT(36, ({ char x[40], y[40]; for (int i = 0; i < 40; i++) y[i] = i; memcpy(x, y, 37); x[36]; }));
+  ASSERT(0, ({ char x[40] = {0}, y[40] = {1}; memcpy(x + 1, y, 3) == x + 1 ? x[0] + x[4] : 1; }));
+  ASSERT(7, ({ char x[300], y[300]; y[299] = 7; memcpy(x, y, 300) == x ? x[299] : 0; }));
+  ASSERT(120, ({ char x[30] = {0}; memset(x + 3, 'x', 21) == x + 3 ? x[23] + x[24] + x[2] : 0; }));
+  ASSERT(97, ({ char x[300]; int c = 'a'; memset(x, c, 280); x[279]; }));
+  ASSERT(0, ({ char x[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1}; memset(x, 0, 8); x[7]; }));
+  ASSERT(1, memcmp("abcdefghijklmnop", "abcdefghijklmnoq", 16) < 0);
+  ASSERT(1, memcmp("abcdefghijklmnoq", "abcdefghijklmnop", 16) > 0);
+  ASSERT(0, memcmp("abcdefghijklmnop", "abcdefghijklmnoq", 15));
+  ASSERT(1, memcmp("ab\xff", "ab\x01", 3) > 0);
+  ASSERT(1, memcmp("a\x01" "bcdefgh", "a\xff" "bcdefgh", 9) < 0);
+  ASSERT(0, memcmp("abc", "abd", 0));
+
   printf("OK\n");
   return 0;
 }
@@ -0,0 +1,72 @@
+#include "test.h"
+
+int zero(void) { return 0; }
+int calls;
+int count(void) { calls++; return 1; }
+
+int main() {
+  int x = 7;
+  unsigned u = 7;
+  char c = 1;
+  float f = 3.5;
+
+  ASSERT(28672, x * (4 * 1024));
+  ASSERT(7, x + 0);
+  ASSERT(7, 0 + x);
+  ASSERT(7, x * 1);
+  ASSERT(7, x / 1);
+  ASSERT(7, x - 0);
+  ASSERT(7, x | 0);
+  ASSERT(7, x ^ 0);
+  ASSERT(7, x << 0);
+  ASSERT(7, x & -1);
+  ASSERT(0, x * 0);
+  ASSERT(0, x & 0);
+  ASSERT(0, count() * 0);
+  ASSERT(1, calls);
+
+  ASSERT(-2147483648, 2147483647 + 1);
+  ASSERT(0, 4294967295U + 1);
+  ASSERT(1, 0xffffffffffffffffUL + 2 == 1);
+  ASSERT(-1, -1 >> 1);
+  ASSERT(2147483647, -1U >> 1);
+  ASSERT(1, -1 < 0);
+  ASSERT(0, -1 < 0U);
+  ASSERT(1, (-1L >> 63) == -1);
+  ASSERT(-3, -7 / 2);
+  ASSERT(-1, -7 % 2);
+  ASSERT(3, 7 / 2);
+
+  ASSERT(256, c << 8);
+  ASSERT(1, (c << 8) != 0);
+  ASSERT(-2, ~c);
+  ASSERT(1, ~u == 4294967288U);
+  ASSERT(1, (char)255 == -1);
+  ASSERT(255, (unsigned char)-1);
+  ASSERT(1, (_Bool)256);
+  ASSERT(0, (_Bool)0.0);
+  ASSERT(3, (int)3.9);
+  ASSERT(-3, (int)-3.9);
+  ASSERT(1, (unsigned long)1e19 == 10000000000000000000UL);
+  ASSERT(1, (double)0xffffffffffffffffUL == 18446744073709551616.0);
+
+  ASSERT(1, 0.1f + 0.2f == (float)0.3);
+  ASSERT(0, 0.1 + 0.2 == 0.3);
+  ASSERT(1, 1.0f / 3 == (float)(1.0 / 3));
+  ASSERT(7, f * 2);
+  ASSERT(1, -0.0 == 0.0);
+  ASSERT(0, 0.0L/0.0L == 0.0L/0.0L);
+  ASSERT(1, 0.0L/0.0L != 0.0L/0.0L);
+  ASSERT(0, ({ long double z = 0; z/z == z/z; }));
+  ASSERT(1, ({ long double z = 0; z/z != z/z; }));
+
+  ASSERT(0, 0 && zero() / zero());
+  ASSERT(1, 1 || zero() / zero());
+  ASSERT(0, 1 && 0.0);
+  ASSERT(3, 1 ? 3 : zero());
+  ASSERT(5, (1, 2, 5));
+  ASSERT(1, sizeof(int) * 2 == 8);
+
+  printf("OK\n");
+  return 0;
+}
@@ -1,5 +1,52 @@
 #include "test.h"
 
+int dense_switch(int x) {
+  switch (x) {
+  case -2: return 1;
+  case -1: return 2;
+  case 0: case 1: return 3;
+  case 3 ... 5: return 4;
+  case 7: return 5;
+  default: return 6;
+  }
+}
+
+int sparse_switch(int x) {
+  switch (x) {
+  case -100000: return 1;
+  case -5: return 2;
+  case 10: return 3;
+  case 1000 ... 1010: return 4;
+  case 20000: return 5;
+  case 300000: return 6;
+  case 4000000: return 7;
+  }
+  return 0;
+}
+
+int unsigned_switch(unsigned x) {
+  switch (x) {
+  case 0: return 1;
+  case 100: return 2;
+  case 0x7fffffff: return 3;
+  case 0x80000000: return 4;
+  case 0xfffffff0 ... 0xfffffffe: return 5;
+  case 0xffffffff: return 6;
+  }
+  return 0;
+}
+
+int long_switch(long x) {
+  switch (x) {
+  case 1: return 1;
+  case 2: return 2;
+  case 3: return 3;
+  case 4: return 4;
+  case 6: return 6;
+  }
+  return 0;
+}
+
 /*
  * This is a block comment.
  */
@@ -87,6 +134,45 @@ int main() {
   ASSERT(1, ({ int i=0; switch(7) { case 0 ... 7: i=1; break; case 8 ... 10: i=2; break; } i; }));
   ASSERT(1, ({ int i=0; switch(7) { case 0: i=1; break; case 7 ... 7: i=1; break; } i; }));
 
+  ASSERT(6, dense_switch(-3));
+  ASSERT(1, dense_switch(-2));
+  ASSERT(3, dense_switch(1));
+  ASSERT(6, dense_switch(2));
+  ASSERT(4, dense_switch(4));
+  ASSERT(6, dense_switch(6));
+  ASSERT(5, dense_switch(7));
+  ASSERT(6, dense_switch(8));
+  ASSERT(1, sparse_switch(-100000));
+  ASSERT(2, sparse_switch(-5));
+  ASSERT(0, sparse_switch(0));
+  ASSERT(3, sparse_switch(10));
+  ASSERT(4, sparse_switch(1005));
+  ASSERT(0, sparse_switch(1011));
+  ASSERT(5, sparse_switch(20000));
+  ASSERT(6, sparse_switch(300000));
+  ASSERT(7, sparse_switch(4000000));
+  ASSERT(1, unsigned_switch(0));
+  ASSERT(2, unsigned_switch(100));
+  ASSERT(3, unsigned_switch(0x7fffffff));
+  ASSERT(4, unsigned_switch(0x80000000));
+  ASSERT(5, unsigned_switch(0xfffffff5));
+  ASSERT(6, unsigned_switch(-1));
+  ASSERT(0, unsigned_switch(5));
+  ASSERT(0, long_switch(0));
+  ASSERT(4, long_switch(4));
+  ASSERT(0, long_switch(5));
+  ASSERT(6, long_switch(6));
+  ASSERT(0, long_switch(0x100000001));
+
+  ASSERT(1, ({ int x=3, y=5, r=0; if (x < y && !(y <= x) && (x == 3 || y == 0)) r=1; r; }));
+  ASSERT(0, ({ int x=3, y=5, r=0; if (!(x < y) || x != 3 && y) r=1; r; }));
+  ASSERT(5, ({ int i=0; while (i < 10 && !(i == 5)) i++; i; }));
+  ASSERT(10, ({ unsigned i=0; do i++; while (i < 10 || i == -1); i; }));
+  ASSERT(1, ({ long x=-1; unsigned long y=1; x < 0 && y > 0 ? 1 : 2; }));
+  ASSERT(0, ({ double z=0, n=z/z; n < 1 || n <= 1 || n > 1 || n >= 1; }));
+  ASSERT(1, ({ double z=0, n=z/z; int r=0; if (!(n < 1)) r=1; r; }));
+  ASSERT(1, ({ float x=1.5; int r=0; if (x < 2 && x >= 1.5) r=1; r; }));
+
   ASSERT(3, ({ void *p = &&v11; int i=0; goto *p; v11:i++; v12:i++; v13:i++; i; }));
   ASSERT(2, ({ void *p = &&v22; int i=0; goto *p; v21:i++; v22:i++; v23:i++; i; }));
   ASSERT(1, ({ void *p = &&v33; int i=0; goto *p; v31:i++; v32:i++; v33:i++; i; }));
@@ -54,6 +54,21 @@ echo 'int y;' > $tmp/bar.c
 [ -f $tmp/foo.s ] && [ -f $tmp/bar.s ]
 check 'multiple input files'
 
+# Each translation unit starts from a clean state
+printf '#define X 1\nstatic int x = X;\n' > $tmp/foo.c
+printf '#ifdef X\n#error X\n#endif\nstatic int x;\n' > $tmp/bar.c
+(cd $tmp; $OLDPWD/$chibicc -c $tmp/foo.c $tmp/bar.c)
+check 'separate translation units'
+
+# Headers shared by translation units are preprocessed for each of them
+printf '#ifndef FOO_H\n#define FOO_H\n#ifdef X\nint x;\n#else\nint y;\n#endif\n#endif\n' > $tmp/foo.h
+printf '#define X\n#include "foo.h"\n#include "foo.h"\n' > $tmp/foo.c
+printf '#include "foo.h"\n' > $tmp/bar.c
+(cd $tmp; $OLDPWD/$chibicc -S $tmp/foo.c $tmp/bar.c)
+grep -q 'globl x' $tmp/foo.s && ! grep -q 'globl y' $tmp/foo.s &&
+  grep -q 'globl y' $tmp/bar.s && ! grep -q 'globl x' $tmp/bar.s
+check 'shared headers'
+
 # Run linker
 rm -f $tmp/foo
 echo 'int main() { return 0; }' | $chibicc -o $tmp/foo -xc -xc -
@@ -218,6 +233,43 @@ echo 'void foo(); void bar(); int main() { foo(); bar(); }' > $tmp/main.c
 $chibicc -o $tmp/foo $tmp/main.c $tmp/foo.so
 check '.so'
 
+# -fprofile-generate
+echo 'int f(int x) { if (x > 2) return 1; return 0; } int main() { int n = 0; for (int i = 0; i < 5; i++) n += f(i); return n - 2; }' > $tmp/prof.c
+$chibicc -fprofile-generate -o $tmp/prof $tmp/prof.c
+rm -f $tmp/out.prof
+CHIBICC_PROFILE=$tmp/out.prof $tmp/prof &&
+  grep -q "^5 f 0 entry 1 16 $tmp/prof.c" $tmp/out.prof &&
+  grep -q "^2 f 1 then 1 16 $tmp/prof.c" $tmp/out.prof &&
+  grep -q "^3 f 2 else 1 16 $tmp/prof.c" $tmp/out.prof &&
+  grep -q "^5 main 1 loop 1 73 $tmp/prof.c" $tmp/out.prof
+check -fprofile-generate
+
+# -fprofile-use
+echo 'int k(int c) { switch (c) { case 1: return 2; case 7: return 3; } return 0; }' > $tmp/use.c
+echo 'int main() { int n = 0; for (int i = 0; i < 10; i++) { if (i < 0) return 1; n += k(7); } return n != 30; }' >> $tmp/use.c
+$chibicc -fprofile-generate -o $tmp/use $tmp/use.c
+rm -f $tmp/out.prof
+CHIBICC_PROFILE=$tmp/out.prof $tmp/use &&
+  $chibicc -fprofile-use=$tmp/out.prof -S -o $tmp/use.s $tmp/use.c &&
+  grep -q 'text.unlikely' $tmp/use.s &&
+  grep -q 'cmp $7,' $tmp/use.s &&
+  $chibicc -fprofile-use=$tmp/out.prof -o $tmp/use $tmp/use.c && $tmp/use
+check -fprofile-use
+
+# -finstrument-functions
+echo 'int n; void __cyg_profile_func_enter(void *f, void *c) { n++; } void __cyg_profile_func_exit(void *f, void *c) { n += 10; }' > $tmp/hooks.c
+echo 'int n; double f(double x) { return x * 2; } int main() { int m = f(1.5) == 3.0; return n == 12 ? 0 : 1; }' > $tmp/main.c
+cc -c -o $tmp/hooks.o $tmp/hooks.c
+$chibicc -finstrument-functions -o $tmp/foo $tmp/main.c $tmp/hooks.o
+$tmp/foo
+check -finstrument-functions
+
+# -pg
+echo 'int main() { return 0; }' > $tmp/main.c
+rm -f $tmp/gmon.out
+$chibicc -pg -o $tmp/foo $tmp/main.c && (cd $tmp; ./foo) && [ -f $tmp/gmon.out ]
+check -pg
+
 $chibicc -hashmap-test
 check 'hashmap'
 
@@ -274,6 +326,17 @@ echo 'foo' > $tmp/next3/file2.h
 $chibicc -I$tmp/next1 -I$tmp/next2 -I$tmp/next3 -E $tmp/file.c | grep -q foo
 check '#include_next'
 
+# A repeated #include must not make #include_next start from where
+# the previous lookup of another file stopped.
+echo '#include_next <bar.h>' > $tmp/next1/bar.h
+echo 'from_next2' > $tmp/next2/bar.h
+echo 'from_next3' > $tmp/next3/bar.h
+echo 'other' > $tmp/next3/other.h
+printf '#include <bar.h>\n#include <other.h>\n#include <bar.h>\n' > $tmp/file.c
+$chibicc -I$tmp/next1 -I$tmp/next2 -I$tmp/next3 -E $tmp/file.c > $tmp/file.i &&
+  [ $(grep -c from_next2 $tmp/file.i) = 2 ] && ! grep -q from_next3 $tmp/file.i
+check '#include_next after a repeated #include'
+
 # -static
 echo 'extern int bar; int foo() { return bar; }' > $tmp/foo.c
 echo 'int foo(); int bar=3; int main() { foo(); }' > $tmp/bar.c
@@ -288,6 +351,29 @@ echo 'int foo(); int bar=3; int main() { foo(); }' > $tmp/bar.c
 $chibicc -fPIC -shared -o $tmp/foo.so $tmp/foo.c $tmp/bar.c
 check -shared
 
+# -ftls-model
+cat <<EOF > $tmp/foo.c
+static _Thread_local int s = 3;
+_Thread_local int g = 5;
+int foo(int n) { for (int i = 0; i < n; i++) s += i; return s + s; }
+int baz(void) { return g; }
+EOF
+echo 'extern _Thread_local int g; int foo(int); int main() { return foo(4) + g != 23; }' > $tmp/bar.c
+$chibicc -fPIC -S -o $tmp/foo.s $tmp/foo.c
+[ $(grep -c '__tls_get_addr' $tmp/foo.s) = 2 ] && grep -q 's@tlsld' $tmp/foo.s &&
+  grep -q 's@dtpoff' $tmp/foo.s && grep -q 'g@tlsgd' $tmp/foo.s
+check '-ftls-model (local-dynamic)'
+$chibicc -fPIC -ftls-model=initial-exec -S -o $tmp/foo.s $tmp/foo.c
+! grep -q '__tls_get_addr' $tmp/foo.s && grep -q 'g@gottpoff' $tmp/foo.s
+check -ftls-model=initial-exec
+for model in global-dynamic local-dynamic initial-exec; do
+  $chibicc -fPIC -ftls-model=$model -shared -o $tmp/libfoo.so $tmp/foo.c &&
+    $chibicc -o $tmp/foo $tmp/bar.c -L$tmp -lfoo && LD_LIBRARY_PATH=$tmp $tmp/foo
+  check "-ftls-model=$model -shared"
+done
+$chibicc -ftls-model=foo -S -o $tmp/foo.s $tmp/foo.c 2>&1 | grep -q 'unknown TLS model: foo'
+check '-ftls-model=foo'
+
 # -L
 echo 'extern int bar; int foo() { return bar; }' > $tmp/foo.c
 $chibicc -fPIC -shared -o $tmp/libfoobar.so $tmp/foo.c
@@ -309,4 +395,510 @@ echo 'int main() {}' | $chibicc -c -o $tmp/baz.o -xc -
 cc -Xlinker -z -Xlinker muldefs -Xlinker --gc-sections -o $tmp/foo $tmp/foo.o $tmp/bar.o $tmp/baz.o
 check -Xlinker
 
+# -j
+rm -f $tmp/foo
+echo 'int bar(); int baz(); int main() { return bar() + baz(); }' > $tmp/foo.c
+echo 'int bar() { return 40; }' > $tmp/bar.c
+echo 'int baz() { return 2; }' > $tmp/baz.c
+$chibicc -j 4 -o $tmp/foo $tmp/foo.c $tmp/bar.c $tmp/baz.c
+$tmp/foo
+[ "$?" = 42 ]
+check -j
+
+rm -f $tmp/foo.o $tmp/bar.o $tmp/baz.o
+(cd $tmp; $OLDPWD/$chibicc -j2 -c $tmp/foo.c $tmp/bar.c $tmp/baz.c)
+[ -f $tmp/foo.o ] && [ -f $tmp/bar.o ] && [ -f $tmp/baz.o ]
+check -j
+
+echo 'int x = ;' > $tmp/bad.c
+$chibicc -j 2 -c -o /dev/null $tmp/bad.c 2>&1 | grep -q 'bad.c: compilation failed'
+check -j
+
+# -fintegrated-as
+echo 'int main() { return 0; }' > $tmp/foo.c
+$chibicc -### -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^ *as '
+[ $? -ne 0 ]
+check -fintegrated-as
+
+$chibicc -### -fno-integrated-as -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^ *as '
+check -fno-integrated-as
+
+$chibicc -g -c -o $tmp/foo.o $tmp/foo.c
+readelf -S $tmp/foo.o | grep -q debug_line
+check '-g has line numbers'
+
+cat <<'EOF' > $tmp/foo.c
+void f(void) { asm("lock xaddw %ax, (%rdi)\nlock addw %ax, %fs:(%rdi)\nrep stosw\nlock xaddq %rax, (%r8)"); }
+EOF
+$chibicc -c -o $tmp/foo.o $tmp/foo.c
+$chibicc -fno-integrated-as -c -o $tmp/foo2.o $tmp/foo.c
+objcopy -O binary -j .text $tmp/foo.o $tmp/foo.bin
+objcopy -O binary -j .text $tmp/foo2.o $tmp/foo2.bin
+cmp -s $tmp/foo.bin $tmp/foo2.bin
+check 'instruction prefixes in the GNU as order'
+
+echo 'int main() { asm("bswap %eax"); return 3; }' > $tmp/foo.c
+$chibicc -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 3 ]
+check -fintegrated-as
+
+# --emit-all-json
+echo 'int main() { return 0; }' > $tmp/foo.c
+$chibicc -cc1 -cc1-input $tmp/foo.c --emit-all-json $tmp/foo.c > $tmp/out
+cut -d'"' -f4 $tmp/out | tr '\n' ' ' | grep -q '^tokenize preprocess parse codegen $' &&
+  ! grep -qv '^{"stage":"[a-z]*","stats":{.*}$' $tmp/out
+check --emit-all-json
+
+# --mem-stats
+echo 'int main() { return 0; }' > $tmp/foo.c
+$chibicc --mem-stats -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^parse *node'
+check --mem-stats
+
+# -ftime-report
+echo 'int main() { return 0; }' > $tmp/foo.c
+$chibicc -ftime-report -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '^parse '
+check -ftime-report
+
+$chibicc -ftime-report=json -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q '"counters":{"tokens":'
+check -ftime-report=json
+
+# -fcache-dir
+rm -rf $tmp/cache
+echo 'int main() { return 5; }' > $tmp/foo.c
+$chibicc -fcache-dir=$tmp/cache -o $tmp/foo $tmp/foo.c
+$chibicc -fcache-dir=$tmp/cache -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 5 ] && $chibicc -fcache-dir=$tmp/cache --cache-stats | grep -q 'hits: *1$'
+check -fcache-dir
+
+echo 'int main() { return 6; }' > $tmp/bar.c
+$chibicc -fcache-dir=$tmp/cache -fcache-max-size=0 -c -o $tmp/bar.o $tmp/bar.c
+$chibicc -fcache-dir=$tmp/cache --cache-stats | grep -q 'entries: *0$'
+check -fcache-max-size
+
+# Precompiled headers
+echo '#define N 7' > $tmp/pch.h
+echo 'static int sq(int x) { return x * x; }' >> $tmp/pch.h
+echo 'int main() { return sq(N) - 42; }' > $tmp/foo.c
+rm -f $tmp/pch.h.pch
+$chibicc $tmp/pch.h
+[ -f $tmp/pch.h.pch ]
+check 'precompiled header'
+
+$chibicc -include $tmp/pch.h -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 7 ]
+check '-include with precompiled header'
+
+n1=$($chibicc -include $tmp/pch.h -ftime-report -S -o- $tmp/foo.c 2>&1 >/dev/null | grep '^tokens' | awk '{print $2}')
+rm -f $tmp/pch.h.pch
+n2=$($chibicc -include $tmp/pch.h -ftime-report -S -o- $tmp/foo.c 2>&1 >/dev/null | grep '^tokens' | awk '{print $2}')
+[ "$n1" -lt "$n2" ]
+check 'precompiled header is used'
+
+$chibicc $tmp/pch.h
+printf '\020' | dd of=$tmp/pch.h.pch bs=1 seek=43 conv=notrunc 2> /dev/null
+$chibicc -include $tmp/pch.h -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 7 ]
+check 'corrupted precompiled header is ignored'
+
+$chibicc -x c-header -o $tmp/foo.pch $tmp/pch.h
+[ -f $tmp/foo.pch ]
+check '-x c-header'
+
+# -pipe
+echo 'int main() { return 8; }' > $tmp/foo.c
+$chibicc -pipe -fno-integrated-as -o $tmp/foo $tmp/foo.c
+$tmp/foo
+[ "$?" = 8 ]
+check -pipe
+
+$chibicc -### -pipe -fno-integrated-as -c -o $tmp/foo.o $tmp/foo.c 2>&1 | grep -q 'as -c -o'
+check '-pipe runs the assembler on stdin'
+
+rm -f $tmp/bad.o
+echo 'int f( {' > $tmp/bad.c
+! $chibicc -pipe -fno-integrated-as -c -o $tmp/bad.o $tmp/bad.c 2> /dev/null &&
+  [ ! -e $tmp/bad.o ] && [ -z "$(ls $tmp/bad.o.* 2> /dev/null)" ]
+check '-pipe leaves no output on error'
+
+# Line markers
+printf '\n\n\n\n\n\n\n\n\n\nint x;\n' > $tmp/foo.c
+$chibicc -E $tmp/foo.c | grep -q "^# 11 \"$tmp/foo.c\""
+check 'line markers'
+
+$chibicc -E -P $tmp/foo.c | grep -q '^#'
+[ "$?" = 1 ]
+check -P
+
+printf 'int  x = - -1 ,\n  y ;\n' > $tmp/foo.c
+[ "$($chibicc -E -P --pp-compact $tmp/foo.c)" = 'int x=- -1,y;' ]
+check --pp-compact
+
+# --pp-stats
+printf '#pragma once\n#define N 1\n' > $tmp/pp1.h
+printf '#include "pp1.h"\n#include "pp1.h"\nint x = N;\n' > $tmp/foo.c
+$chibicc --pp-stats -c -o /dev/null $tmp/foo.c 2> $tmp/log
+grep -q 'include tree' $tmp/log && grep -q '^N  *1 ' $tmp/log &&
+  grep -Eq 'pp1.h +2 +1 +0 +1$' $tmp/log
+check --pp-stats
+
+printf 'int a; int b; int c;\n' > $tmp/pp2.h
+printf '#include "pp2.h"\n#include "pp2.h"\n' > $tmp/foo.c
+$chibicc --pp-stats -c -o /dev/null $tmp/foo.c 2> $tmp/log
+[ $(grep -Ec 'pp2.h +9 ' $tmp/log) = 2 ]
+check '--pp-stats counts the tokens of a file once'
+
+# Dense data directives
+printf 'char s[8] = "hello";\nint t[64] = {1, 2, 3};\n' > $tmp/foo.c
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+grep -q '^  .string "hello"$' $tmp/foo.s && grep -q '^  .quad 8589934593,3$' $tmp/foo.s &&
+  grep -q '^  .zero 240$' $tmp/foo.s
+check 'dense data directives'
+
+# Unreachable static functions and variables
+printf 'static int v1 = 1, v2 = 2, v3;\nstatic int f1(void) { return v1; }\nstatic int *p = &v2;\nstatic int f2(void) { return *p; }\nint main() { return f2(); }\n' > $tmp/foo.c
+$chibicc -fno-inline -S -o $tmp/foo.s $tmp/foo.c
+grep -q '^v2:' $tmp/foo.s && grep -q '^p:' $tmp/foo.s && grep -q '^f2:' $tmp/foo.s &&
+  ! grep -Eq '^(v1|v3|f1):' $tmp/foo.s
+check 'dead static elimination'
+
+# Inlining
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+grep -q '^p:' $tmp/foo.s && ! grep -q '^f2:' $tmp/foo.s && ! grep -q 'call' $tmp/foo.s
+check 'inlining'
+
+# -fcodegen-threads
+for i in 1 2 3 4 5 6 7 8; do echo "int f$i(int x) { return x ? x * $i : -x; }"; done > $tmp/foo.c
+$chibicc -fcodegen-threads=1 -S -o $tmp/foo1.s $tmp/foo.c
+$chibicc -fcodegen-threads=4 -S -o $tmp/foo4.s $tmp/foo.c
+cmp -s $tmp/foo1.s $tmp/foo4.s
+check -fcodegen-threads
+
+# -fstream-codegen
+cat <<EOF > $tmp/foo.c
+int printf(char *, ...);
+static int twice(int x);
+int later(int x);
+static void *label(void) { static void *p = &&L; goto *p; L: return p; }
+int main() { printf("%d %d %d\n", twice(3), later(4), label() != 0); }
+static int twice(int x) { return x * 2; }
+int later(int x) { return x + 1; }
+EOF
+$chibicc -fstream-codegen -o $tmp/foo $tmp/foo.c
+$tmp/foo | grep -q '^6 5 1$'
+check -fstream-codegen
+
+# --dump-format=binary
+echo 'int f(int x) { return x + 1; }' > $tmp/foo.c
+$chibicc --dump-ast --dump-format=binary -S -o /dev/null $tmp/foo.c > $tmp/foo.bin
+head -c 4 $tmp/foo.bin | grep -q '^CBIN$' && grep -q ND_ADD $tmp/foo.bin
+check '--dump-format=binary'
+
+$chibicc --dump-ast --dump-format=xml -S -o /dev/null $tmp/foo.c 2>&1 | grep -q 'unknown dump format'
+check '--dump-format=xml'
+
+$chibicc --dump-ast --dump-ast-depth=2 -S -o /dev/null $tmp/foo.c > $tmp/foo.json
+grep -q '"lhs":{"id":2,"kind":"ND_ADD","collapsed":true}' $tmp/foo.json &&
+  grep -q '"nodes":5}' $tmp/foo.json
+check '--dump-ast-depth'
+
+$chibicc --dump-ast --dump-ast-node=2 -S -o /dev/null $tmp/foo.c |
+  grep -q '^{"id":2,"kind":"ND_ADD",.*"rhs":{"id":4,"kind":"ND_NUM"'
+check '--dump-ast-node'
+
+# -O1
+cat <<EOF > $tmp/foo.c
+int printf(char *, ...);
+int main() {
+  long a[100], sum = 0;
+  for (int i = 0; i < 100; i++)
+    a[i] = i * i - 3 * i;
+  for (int i = 0; i < 100; i += 2)
+    sum += a[i] / 7 + (a[i + 1] << 2) % 5;
+  printf("%ld\n", sum);
+}
+EOF
+$chibicc -O0 -o $tmp/foo0 $tmp/foo.c
+$chibicc -O1 -o $tmp/foo1 $tmp/foo.c
+$chibicc -O1 -S -o $tmp/foo.s $tmp/foo.c
+[ "$($tmp/foo0)" = "$($tmp/foo1)" ] && grep -q '%rbx' $tmp/foo.s
+check -O1
+
+# -mlong-double-64
+cat <<EOF > $tmp/foo.c
+long double f(long double x, int n) { return x * n + 0.5L; }
+int main() {
+  long double x = f(3.0L, 4);
+  return (long)(x * 2) != 25 || sizeof(x) != 8 || !__LONG_DOUBLE_64__;
+}
+EOF
+$chibicc -mlong-double-64 -S -o $tmp/foo.s $tmp/foo.c
+$chibicc -mlong-double-64 -o $tmp/foo $tmp/foo.c
+$tmp/foo && ! grep -qE 'fld|fstp|fist' $tmp/foo.s
+check -mlong-double-64
+
+# Sparse initializers of large arrays
+echo 'char x[1 << 28] = {[5] = 1, [1 << 27] = 2};' > $tmp/foo.c
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+grep -q '.zero 134217720' $tmp/foo.s && [ $(grep -c '^  \.quad' $tmp/foo.s) = 2 ]
+check 'sparse initializer'
+
+# Peephole optimizer
+echo 'int f(int *p, int x) { if (x == 3) return p[x] * x; return 0; }' > $tmp/foo.c
+$chibicc -O0 -S -o $tmp/foo0.s $tmp/foo.c
+$chibicc -O1 -S -o $tmp/foo1.s $tmp/foo.c
+grep -q 'push %rax' $tmp/foo0.s && ! grep -q 'push %rax' $tmp/foo1.s &&
+  grep -q 'xor %eax, %eax' $tmp/foo1.s && ! grep -q 'sete' $tmp/foo1.s
+check 'peephole'
+
+# Common subexpressions
+cat <<EOF > $tmp/foo.c
+struct B { int b, c; };
+struct A { struct B *a; };
+int f(struct A *p) { int x = p->a->b; return x + p->a->c; }
+int g(struct A *p, int *q) { int x = p->a->b; *q = 1; return x + p->a->c; }
+int v(volatile int *p) { return *p + *p; }
+int main() { struct B b = {3, 4}; struct A a = {&b}; int n = 5; int r = f(&a); r += g(&a, &n); return r + v(&n) != 16; }
+EOF
+$chibicc -O1 -o $tmp/foo $tmp/foo.c
+$chibicc -O1 -S -o $tmp/foo.s $tmp/foo.c
+$tmp/foo &&
+  [ $(sed -n '/^f:/,/ret$/p' $tmp/foo.s | grep -c 'mov (%rax), %rax') = 1 ] &&
+  [ $(sed -n '/^g:/,/ret$/p' $tmp/foo.s | grep -c 'mov (%rax), %rax') = 2 ] &&
+  [ $(sed -n '/^v:/,/ret$/p' $tmp/foo.s | grep -c 'movsxd (%rax), %rax') = 2 ]
+check 'common subexpressions'
+
+$chibicc -O1 -fno-cse -S -o $tmp/foo.s $tmp/foo.c
+[ $(sed -n '/^f:/,/ret$/p' $tmp/foo.s | grep -c 'mov (%rax), %rax') = 2 ]
+check -fno-cse
+
+# Builtin string functions
+cat <<EOF > $tmp/foo.c
+void *memcpy(void *, const void *, unsigned long);
+int f(char *p, char *q) { memcpy(p, q, 24); return 0; }
+EOF
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+! grep -q memcpy $tmp/foo.s
+check 'inline memcpy'
+
+$chibicc -fno-builtin -S -o $tmp/foo.s $tmp/foo.c
+grep -q memcpy $tmp/foo.s
+check -fno-builtin
+
+# Loop vectorization
+cat <<EOF > $tmp/foo.c
+void add(int *a, int *b, int *c, int n) { for (int i = 0; i < n; i++) a[i] = b[i] + c[i]; }
+int sum(int *a, int n) { int s = 0; for (int i = 0; i < n; i++) s += a[i]; return s; }
+int find(char *p, int n) { int i; for (i = 0; i < n; i++) if (p[i] == 'x') break; return i; }
+int main() {
+  int a[40], b[40];
+  char s[40] = "abcdefghijklmnopqrstuvwxyz";
+  for (int i = 0; i < 40; i++) b[i] = i + 1;
+  add(a, b, b, 37);
+  add(b + 1, b, b, 30);
+  return a[36] != 74 || b[30] != 1 << 30 || sum(a, 37) != 37 * 38 || find(s, 40) != 23;
+}
+EOF
+$chibicc -O2 -S -o $tmp/foo.s $tmp/foo.c
+$chibicc -O2 -o $tmp/foo $tmp/foo.c
+sed -n '/^add:/,/ret$/p' $tmp/foo.s | grep -q 'paddd' &&
+  sed -n '/^sum:/,/ret$/p' $tmp/foo.s | grep -q 'paddd' &&
+  sed -n '/^find:/,/ret$/p' $tmp/foo.s | grep -q 'pcmpeqb' &&
+  $tmp/foo
+check 'loop vectorization'
+
+$chibicc -O2 -fno-tree-vectorize -S -o $tmp/foo.s $tmp/foo.c
+! grep -q 'paddd' $tmp/foo.s
+check -fno-tree-vectorize
+
+# Frameless leaf functions
+cat <<EOF > $tmp/foo.c
+long leaf(long *a, int n) { long s = 0; for (int i = 0; i < n; i++) s += a[i] * 3; return s; }
+long nonleaf(long *a, int n) { return leaf(a, n) + 1; }
+int main() { long a[] = {1, 2, 3}; return nonleaf(a, 3) != 19; }
+EOF
+$chibicc -O1 -S -o $tmp/foo.s $tmp/foo.c
+$chibicc -O1 -o $tmp/foo $tmp/foo.c
+sed -n '/^leaf:/,/ret$/p' $tmp/foo.s | grep -q '(%rsp)' &&
+  ! sed -n '/^leaf:/,/ret$/p' $tmp/foo.s | grep -q '%rbp' &&
+  sed -n '/^nonleaf:/,/ret$/p' $tmp/foo.s | grep -q 'push %rbp' &&
+  $tmp/foo
+check 'red zone'
+
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+[ $(grep -c 'mov %rsp, -' $tmp/foo.s) = 0 ]
+check 'no alloca bookkeeping'
+
+# Tail calls
+cat <<EOF > $tmp/foo.c
+long sum(long n, long acc) { if (n == 0) return acc; return sum(n - 1, acc + n); }
+int even(long n);
+int odd(long n) { if (n == 0) return 0; return even(n - 1); }
+int even(long n) { if (n == 0) return 1; return odd(n - 1); }
+int main() { return sum(100000000, 0) != 5000000050000000 || !even(100000000); }
+EOF
+$chibicc -O1 -o $tmp/foo $tmp/foo.c
+$chibicc -O1 -S -o $tmp/foo.s $tmp/foo.c
+$tmp/foo && grep -q 'jmp \*%r10' $tmp/foo.s && grep -q 'jmp .L.tail.sum' $tmp/foo.s
+check 'tail call'
+
+# Switch dispatch
+cat <<EOF > $tmp/foo.c
+int dense(int x) { switch (x) { case 0: return 5; case 1: return 6; case 2 ... 4: return 7; case 6: return 8; } return 0; }
+int sparse(int x) { switch (x) { case 1: return 5; case 100: return 6; case 10000: return 7; case 1000000: return 8; } return 0; }
+EOF
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+grep -q 'jtab.dense' $tmp/foo.s && ! grep -q 'jtab.sparse' $tmp/foo.s
+check 'switch jump table'
+
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q 'br_table' $tmp/foo.wat
+check 'switch br_table'
+
+# Struct copies
+cat <<EOF > $tmp/foo.c
+struct S { char a[40]; } s, t;
+struct L { char a[4096]; } l, m;
+void f(void) { s = t; l = m; }
+EOF
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+grep -q 'movdqu' $tmp/foo.s && grep -q 'rep movsb' $tmp/foo.s &&
+  [ $(grep -c 'mov.*%r8b' $tmp/foo.s) = 0 ]
+check 'struct copy'
+
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q 'memory.copy' $tmp/foo.wat
+check 'struct memory.copy'
+
+# Pass manager
+echo 'int main() { return 0; }' > $tmp/foo.c
+$chibicc -fdump-passes -S -o $tmp/foo.s $tmp/foo.c 2>&1 | tr '\n' ' ' | grep -q '^fold inline $'
+check '-fdump-passes'
+
+$chibicc -fdump-passes -fno-inline -S -o $tmp/foo.s $tmp/foo.c 2>&1 | tr '\n' ' ' | grep -q '^fold $'
+check '-fdump-passes -fno-inline'
+
+$chibicc -O1 -fdump-passes -S -o $tmp/foo.s $tmp/foo.c 2>&1 | tr '\n' ' ' | grep -q '^fold inline cse $'
+check '-O1 -fdump-passes'
+
+$chibicc -O2 -fdump-passes -S -o $tmp/foo.s $tmp/foo.c 2>&1 | tr '\n' ' ' | grep -q '^fold inline vectorize cse $'
+check '-O2 -fdump-passes'
+
+# Atomic read-modify-write
+echo '_Atomic int x; int f(int v) { x |= v; return x += v; }' > $tmp/foo.c
+$chibicc -S -o $tmp/foo.s $tmp/foo.c
+grep -q 'lock or' $tmp/foo.s && grep -q 'lock xadd' $tmp/foo.s &&
+  ! grep -q cmpxchg $tmp/foo.s
+check 'lock xadd'
+
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q 'i32.atomic.rmw.or' $tmp/foo.wat && grep -q 'i32.atomic.rmw.add' $tmp/foo.wat
+check 'atomic.rmw'
+
+# Binary wasm
+# Checks the header of a module and, if node is installed, that it
+# compiles. The rest of the arguments are passed to node.
+wasm_valid() {
+  local wasm=$1
+  shift
+  [ "$(head -c 8 $wasm | od -An -tx1 | tr -d ' ')" = 0061736d01000000 ] || return 1
+  ! command -v node > /dev/null ||
+    node "$@" -e 'new WebAssembly.Module(require("fs").readFileSync(process.argv[1]))' $wasm
+}
+cat <<EOF > $tmp/foo.c
+int ext(int x);
+int sq(int x) { return x * x; }
+int main() { return ext(sq(3)); }
+EOF
+$chibicc --emit-wasm -S -o $tmp/foo.wasm $tmp/foo.c
+wasm_valid $tmp/foo.wasm
+check '--emit-wasm'
+
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q '(import "env" "ext" (func $ext (param i32) (result i32)))' $tmp/foo.wat &&
+  [ $(wc -c < $tmp/foo.wasm) -lt $(wc -c < $tmp/foo.wat) ]
+check 'wasm import'
+
+# Scalar locals live in wasm locals
+cat <<EOF > $tmp/foo.c
+int f(int a) { int x = a + 1; return x * x; }
+int g(int a) { int x = a; int *p = &x; return *p; }
+EOF
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+sed -n '/func \$f /,/func \$g /p' $tmp/foo.wat > $tmp/f.wat
+grep -q '(local \$l' $tmp/f.wat && ! grep -q '__sp' $tmp/f.wat &&
+  sed -n '/func \$g /,$p' $tmp/foo.wat | grep -q 'global.set \$__sp'
+check 'wasm locals'
+
+# Bulk memory
+cat <<EOF > $tmp/foo.c
+void *memcpy(void *dst, void *src, unsigned long n);
+struct S { int a[5]; } s;
+struct S f(void) { return s; }
+void g(char *p) { memcpy(p, p + 1, 3); s = f(); }
+EOF
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q 'memory.copy' $tmp/foo.wat && ! grep -q 'import' $tmp/foo.wat
+check 'wasm memory.copy'
+
+$chibicc -mno-bulk-memory --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+! grep -q 'memory.copy' $tmp/foo.wat && grep -q '(import "env" "memcpy"' $tmp/foo.wat
+check '-mno-bulk-memory'
+
+# SIMD128
+cat <<EOF > $tmp/foo.c
+#include <wasm_simd128.h>
+v128_t f(v128_t a, v128_t b) { return wasm_i32x4_add(a, b); }
+__f32x4 g(__f32x4 *p) { return *p * p[1]; }
+EOF
+$chibicc -Iinclude --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q 'i32x4.add' $tmp/foo.wat && grep -q 'f32x4.mul' $tmp/foo.wat &&
+  grep -q 'v128.load' $tmp/foo.wat
+check 'wasm simd'
+
+$chibicc -Iinclude --emit-wasm -S -o $tmp/foo.wasm $tmp/foo.c
+wasm_valid $tmp/foo.wasm
+check '--emit-wasm simd'
+
+# LP64 and memory64
+cat <<EOF > $tmp/foo.c
+long g = 1L << 40;
+long f(long a, char *p) { return a * g + (p - (char *)0); }
+EOF
+$chibicc --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q '(param $p_a i64) (param $p_p i32) (result i64)' $tmp/foo.wat &&
+  grep -q 'i64.mul' $tmp/foo.wat && grep -q 'i64.load' $tmp/foo.wat
+check 'wasm long'
+
+$chibicc --emit-wasm -S -o $tmp/foo.wasm $tmp/foo.c
+wasm_valid $tmp/foo.wasm
+check '--emit-wasm long'
+
+$chibicc -mmemory64 --emit-wat -S -o $tmp/foo.wat $tmp/foo.c
+grep -q '(param $p_a i64) (param $p_p i64) (result i64)' $tmp/foo.wat &&
+  grep -q '(memory (export "memory") i64 ' $tmp/foo.wat
+check '-mmemory64'
+
+$chibicc -mmemory64 --emit-wasm -S -o $tmp/foo.wasm $tmp/foo.c
+wasm_valid $tmp/foo.wasm --experimental-wasm-memory64
+check '--emit-wasm -mmemory64'
+
+# --serve
+job() {
+  printf -- "$1" > $tmp/job
+  echo $(wc -c < $tmp/job)
+  cat $tmp/job
+}
+{ job '-E\0-cc1-input\0x.c\0x.c\0\0#define A 42\nA\n'
+  job '-cc1-input\0y.c\0y.c\0\0int x = ;\n'
+  job '-E\0-cc1-input\0x.c\0x.c\0\0A\n'; } > $tmp/jobs
+$chibicc --serve < $tmp/jobs > $tmp/out
+head -3 $tmp/out | tr '\n' ' ' | grep -q '^+3 42 0 0 $' &&
+  sed -n 4p $tmp/out | grep -q '^1 [1-9]' && grep -q 'expected an expression' $tmp/out &&
+  tail -4 $tmp/out | tr '\n' ' ' | grep -q '^+12 # 1 "x.c" A 0 0 $'
+check '--serve'
+
 echo OK
@@ -38,6 +38,11 @@ int main() {
   ASSERT(35, (unsigned long)(double)35);
 
   ASSERT(-2147483648, (double)(unsigned long)(long)-1);
+  ASSERT(1, ({ volatile double d=1e19; (unsigned long)d==10000000000000000000UL; }));
+  ASSERT(1, ({ volatile float f=1e19f; (unsigned long)f==9999999980506447872UL; }));
+  ASSERT(1, ({ volatile double d=9e18; (unsigned long)d==9000000000000000000UL; }));
+  ASSERT(1, ({ volatile unsigned long u=-1; (float)u==18446744073709551616.0f; }));
+  ASSERT(1, ({ volatile unsigned long u=(1UL<<63)+1; (float)u==9223372036854775808.0f; }));
 
   ASSERT(1, 2e3==2e3);
   ASSERT(0, 2e3==2e5);
@@ -209,6 +209,18 @@ long double to_ldouble(int x) {
   return x;
 }
 
+long tail_sum(long n, long acc) { if (n == 0) return acc; return tail_sum(n - 1, acc + n); }
+
+int tail_even(unsigned n);
+int tail_odd(unsigned n) { return n == 0 ? 0 : tail_even(n - 1); }
+int tail_even(unsigned n) { if (n == 0) return 1; return tail_odd(n - 1); }
+
+int tail_deref(int *p, int n) { return *p + n; }
+int tail_local(int n) { int x = n * 2; return tail_deref(&x, n); }
+
+char tail_char(int n) { return n + 200; }
+int tail_widen(int n) { return tail_char(n); }
+
 int main() {
   ASSERT(3, ret3());
   ASSERT(8, add2(3, 5));
@@ -390,5 +402,11 @@ int main() {
   ASSERT(1, to_ldouble(5.0) == 5.0);
   ASSERT(0, to_ldouble(5.0) == 5.2);
 
+  ASSERT(50005000, tail_sum(10000, 0));
+  ASSERT(1, tail_even(10000));
+  ASSERT(0, tail_odd(10000));
+  ASSERT(15, tail_local(5));
+  ASSERT(-51, tail_widen(5));
+
   printf("OK\n");
 }
@@ -6,6 +6,10 @@ int main() {
   ASSERT(2, _Generic((int[3]){}, double: 1, int *: 2, int: 3, float: 4));
   ASSERT(3, _Generic(100, double: 1, int *: 2, int: 3, float: 4));
   ASSERT(4, _Generic(100f, double: 1, int *: 2, int: 3, float: 4));
+  ASSERT(2, _Generic((char (*)[3])0, char (*)[4]: 1, char (*)[3]: 2));
+  ASSERT(1, ({ struct G1 *p = 0; struct G1 { int x[4]; }; _Generic(p, struct G1 *: 1, default: 2); }));
+  ASSERT(16, ({ struct G2 *p; struct G2 { int x[4]; }; sizeof(*p); }));
+  ASSERT(48, ({ struct G3 { int x[4]; }; struct G3 a[3]; sizeof(a); }));
 
   printf("OK\n");
   return 0;
@@ -38,6 +38,11 @@ typedef struct { char a, b[]; } T65;
 T65 g65 = {'f','o','o',0};
 T65 g66 = {'f','o','o','b','a','r',0};
 
+char g70[1 << 20] = {[5] = 1, [1 << 19] = 2};
+char *g71[] = {[2] = g17, [0] = g17 + 1, [2] = 0, [1] = g17 + 2};
+struct { union { char *a; long b; } u; } g72 = {.u.a = g17, .u.b = 3};
+struct { int c; int a : 3, b : 5; } g73[2] = {[1].b = 3, [1] = {1, 2, 3}, [1].a = 2};
+
 int main() {
   ASSERT(1, ({ int x[3]={1,2,3}; x[0]; }));
   ASSERT(2, ({ int x[3]={1,2,3}; x[1]; }));
@@ -262,6 +267,21 @@ int main() {
   ASSERT(16, ({ char x[]={[2 ... 10]='a', [7]='b', [15 ... 15]='c', [3 ... 5]='d'}; sizeof(x); }));
   ASSERT(0, ({ char x[]={[2 ... 10]='a', [7]='b', [15 ... 15]='c', [3 ... 5]='d'}; memcmp(x, "\0\0adddabaaa\0\0\0\0c", 16); }));
 
+  ASSERT(1, g70[5]);
+  ASSERT(2, g70[1 << 19]);
+  ASSERT(0, g70[6]);
+  ASSERT(0, g70[(1 << 20) - 1]);
+  ASSERT(1048576, sizeof(g70));
+  ASSERT(3, sizeof(g71) / sizeof(*g71));
+  ASSERT('o', *g71[0]);
+  ASSERT('o', *g71[1]);
+  ASSERT(0, (long)g71[2]);
+  ASSERT(3, g72.u.b);
+  ASSERT(2, sizeof(g73) / sizeof(*g73));
+  ASSERT(2, g73[1].a);
+  ASSERT(3, g73[1].b);
+  ASSERT(1, g73[1].c);
+
   printf("OK\n");
   return 0;
 }
@@ -0,0 +1,84 @@
+#include "test.h"
+
+typedef struct { int x, y; } Point;
+
+static inline int add(int a, int b) { return a + b; }
+static int twice(int a) { a *= 2; return a; }
+static double half(double d) { return d / 2; }
+static char *skip_space(char *p) { while (*p == ' ') p++; return p; }
+static int sum_point(Point p) { p.x += p.y; return p.x; }
+static void set(int *p, int v) { *p = v; }
+static void clear(int *p) { if (!p) return; *p = 0; }
+static int counter(void) { static int n; return ++n; }
+static int quad(int a) { return twice(twice(a)); }
+static short narrow(int a) { return a; }
+
+static int find(int *a, int n, int v) {
+  int i;
+  for (i = 0; i < n; i++)
+    if (a[i] == v)
+      break;
+  return i;
+}
+
+static int classify(int c) {
+  int r = 0;
+  switch (c) {
+  case 0: r = 10; break;
+  case 1 ... 3: r = 20; break;
+  default: r = 30;
+  }
+  return r;
+}
+
+static int fact(int n) { return n <= 1 ? 1 : n * fact(n - 1); }
+
+int calls;
+int next(void) { return ++calls; }
+
+int main() {
+  ASSERT(7, add(3, 4));
+  ASSERT(10, add(add(1, 2), add(3, 4)));
+
+  int x = 5;
+  ASSERT(10, twice(x));
+  ASSERT(5, x);
+  ASSERT(20, quad(x));
+
+  ASSERT(1, half(3) == 1.5);
+  ASSERT(0, strcmp(skip_space("   abc"), "abc"));
+
+  Point pt = {3, 4};
+  ASSERT(7, sum_point(pt));
+  ASSERT(3, pt.x);
+
+  set(&x, 9);
+  ASSERT(9, x);
+  clear(&x);
+  ASSERT(0, x);
+  clear(0);
+
+  ASSERT(1, counter());
+  ASSERT(2, counter());
+  ASSERT(3, counter());
+
+  ASSERT(3, narrow(65539));
+
+  int a[] = {5, 6, 7, 8};
+  ASSERT(2, find(a, 4, 7));
+  ASSERT(4, find(a, 4, 9));
+  ASSERT(0, find(a, 4, 5));
+
+  ASSERT(10, classify(0));
+  ASSERT(20, classify(2));
+  ASSERT(30, classify(5));
+  ASSERT(20, classify(3));
+
+  ASSERT(120, fact(5));
+
+  ASSERT(3, add(next(), next()));
+  ASSERT(2, calls);
+
+  printf("OK\n");
+  return 0;
+}
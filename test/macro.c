@@ -205,6 +205,20 @@ int main() {
 #else
 #endif
 
+  m = 0;
+#if 0
+  it's an unterminated quote
+  "#endif"
+  /*
+#endif
+  */
+  // #endif
+  m = 1;
+#else
+  m = 2;
+#endif
+  ASSERT(2, m);
+
 #define M7() 1
   int M7 = 5;
   ASSERT(1, M7());
@@ -67,6 +67,15 @@ int main() {
   ASSERT(L'c', ("a" "b" L"c")[2]);
   ASSERT(0, ("a" "b" L"c")[3]);
 
+  ASSERT(5, sizeof(u8"ab" "cd"));
+  ASSERT(5, sizeof("ab" u8"cd"));
+  ASSERT(3, sizeof(u8"a" u8"b"));
+  ASSERT(1, sizeof((u8"a" "b")[0]));
+  ASSERT(0, strcmp(u8"ab" "cd", "abcd"));
+  ASSERT(0, strcmp("a" u8"b" "c", "abc"));
+  ASSERT(5, sizeof(u8"日" "x"));
+  ASSERT(0, strcmp(u8"日" "x", "\346\227\245x"));
+
   printf("OK\n");
   return 0;
 }
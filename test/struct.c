@@ -1,5 +1,14 @@
 #include "test.h"
 
+typedef struct { char a[7]; } S7;
+typedef struct { char a[23]; } S23;
+typedef struct { char a[300]; } S300;
+
+S23 s23_ret(char c) { S23 x; for (int i=0; i<23; i++) x.a[i]=c+i; return x; }
+S300 s300_ret(char c) { S300 x; for (int i=0; i<300; i++) x.a[i]=c+i; return x; }
+int s23_sum(S23 x) { int n=0; for (int i=0; i<23; i++) n+=x.a[i]; return n; }
+int s300_sum(S300 x) { int n=0; for (int i=0; i<300; i++) n+=x.a[i]; return n; }
+
 int main() {
   ASSERT(1, ({ struct {int a; int b;} x; x.a=1; x.b=2; x.a; }));
   ASSERT(2, ({ struct {int a; int b;} x; x.a=1; x.b=2; x.b; }));
@@ -61,6 +70,15 @@ int main() {
   ASSERT(1, ({ struct {int a;} x={1}, y={2}; (1?x:y).a; }));
   ASSERT(2, ({ struct {int a;} x={1}, y={2}; (0?x:y).a; }));
 
+  ASSERT(6, ({ struct { S7 s; char c; } x, y; y.s.a[6]=6; x.c=9; x.s=y.s; x.s.a[6]; }));
+  ASSERT(9, ({ struct { S7 s; char c; } x, y; y.s.a[6]=6; x.c=9; x.s=y.s; x.c; }));
+  ASSERT(22, ({ S23 x, y; for (int i=0; i<23; i++) y.a[i]=i; x=y; x.a[22]; }));
+  ASSERT(196, ({ S300 x, y; for (int i=0; i<300; i++) y.a[i]=i%101; x=y; x.a[299]-x.a[1]+x.a[201]; }));
+  ASSERT(25, s23_ret(3).a[22]);
+  ASSERT(44, s300_ret(-100).a[144]);
+  ASSERT(253, s23_sum(s23_ret(0)));
+  ASSERT(774, s300_sum(s300_ret(-1)));
+
   printf("OK\n");
   return 0;
 }
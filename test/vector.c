@@ -0,0 +1,52 @@
+#include "test.h"
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef unsigned v4su __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+typedef double __attribute__((vector_size(16))) v2df;
+typedef long v2di __attribute__((vector_size(16)));
+
+v4si g1 = {1, 2, 3, 4};
+v2df g2 = {0.5};
+
+static v4si add_g1(void) { v4si a = {10, 20, 30, 40}; return a + g1; }
+
+int main() {
+  ASSERT(16, sizeof(v4si));
+  ASSERT(16, _Alignof(v2df));
+  ASSERT(4, sizeof(g1[0]));
+  ASSERT(8, sizeof(((v2di){})[1]));
+
+  ASSERT(3, g1[2]);
+  ASSERT(0, ({ v4si a = {1}; a[3]; }));
+  ASSERT(7, ({ v4si a; a[1] = 7; a[1]; }));
+  ASSERT(44, add_g1()[3]);
+
+  ASSERT(32, ({ v4si a = {1, 2, 3, 4}, b = {5, 6, 7, 8}; v4si c = a * b - a + g1; c[3]; }));
+  ASSERT(6, ({ v4si a = g1; a += g1 + g1; a[1]; }));
+  ASSERT(5, ({ v4si a = {1}, b = {5}; v4si n = ~a ^ -b; n[0]; }));
+  ASSERT(2, ({ v4si a = {6}, b = {3}; (a & b)[0]; }));
+  ASSERT(7, ({ v4si a = {6}, b = {3}; (a | b)[0]; }));
+
+  ASSERT(-4, ({ v8hi s = {1, -2}; s = (s << 2) >> 1; s[1]; }));
+  ASSERT(0x7fffffff, ({ v4su u = {-1}; (u >> 1)[0]; }));
+  ASSERT(-1, ({ v4si u = {-1}; (u >> 1)[0]; }));
+  ASSERT(4, ({ v16qu q = {250, 1}; q = q + (v16qu){10, 1}; q[0]; }));
+  ASSERT(6, ({ v2di d = {2, 3}; v2di e = d + d; e[1]; }));
+
+  ASSERT(-3, ({ v4sf f = {1.5f, 3}, h = {2, 2}; f = -(f * h) / h; (int)f[1]; }));
+  ASSERT(4, ({ v2df d = {1, 2}; d = d * d; (int)d[1]; }));
+  ASSERT(1, ({ v2df d = g2 + g2; (int)d[0]; }));
+  ASSERT(3, ({ v4si a = {1, 2, 3}; v4sf bits = (v4sf)a; ((v4si)bits)[2]; }));
+
+  ASSERT(-1, ({ v4si a = {1, 2}, b = {1, 3}; (a == b)[0]; }));
+  ASSERT(0, ({ v4si a = {1, 2}, b = {1, 3}; (a == b)[1]; }));
+  ASSERT(-1, ({ v16qu a = {1, 2}, b = {1, 3}; (a != b)[1]; }));
+  ASSERT(0, ({ v2di a = {5, 6}, b = {5, 6}; (a != b)[1]; }));
+  ASSERT(8, ({ v8hi a = {1}; sizeof((a == a)[0]) * 4; }));
+
+  printf("OK\n");
+  return 0;
+}
@@ -1,8 +1,17 @@
 #include "chibicc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Input file
 static File *current_file;
 
+// End of the input file
+static char *input_end;
+
 // A list of all input files.
 static File **input_files;
 
@@ -75,11 +84,53 @@ void warn_tok(Token *tok, char *fmt, ...) {
   va_end(ap);
 }
 
+// Returns the column of a token, counting characters of its line
+// from 1.
+int column_of(Token *tok) {
+  int col = 1;
+  for (char *p = tok->loc; tok->file->contents < p && p[-1] != '\n'; p--)
+    col++;
+  return col;
+}
+
 // Consumes the current token if it matches `op`.
 bool equal(Token *tok, char *op) {
+  // Most calls are made against a chain of alternatives and fail, so
+  // reject on the first character before calling memcmp.
+  if (tok->loc[0] != op[0])
+    return tok->len == 0 && op[0] == '\0';
   return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
 }
 
+static HashMap atoms;
+
+static void init_keywords(void);
+
+// Returns the Atom for a spelling, creating it on first use.
+Atom *intern_atom(char *name, int len) {
+  static bool initialized;
+  if (!initialized) {
+    initialized = true;
+    init_keywords();
+  }
+
+  Atom *a = hashmap_get2(&atoms, name, len);
+  if (a)
+    return a;
+
+  a = arena_alloc(ARENA_MISC, sizeof(Atom));
+  a->name = strndup(name, len);
+  a->len = len;
+  hashmap_put2(&atoms, a->name, len, a);
+  return a;
+}
+
+// Iterates over all atoms in no particular order.
+Atom *next_atom(int *idx) {
+  HashEntry *ent = hashmap_next(&atoms, idx);
+  return ent ? ent->val : NULL;
+}
+
 // Ensure that the current token is `op`.
 Token *skip(Token *tok, char *op) {
   if (!equal(tok, op))
@@ -98,7 +149,10 @@ bool consume(Token **rest, Token *tok, char *str) {
 
 // Create a new token.
 static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
+  Token *tok = arena_alloc(ARENA_TOKEN, sizeof(Token));
+  counters.tokens++;
+  if (kind != TK_EOF && kind != TK_LAZY)
+    current_file->ntokens++;
   tok->kind = kind;
   tok->loc = start;
   tok->len = end - start;
@@ -111,10 +165,136 @@ static Token *new_token(TokenKind kind, char *start, char *end) {
   return tok;
 }
 
+// Attaches a new Literal to a number or string literal token.
+static void new_literal(Token *tok) {
+  tok->lit = arena_alloc(ARENA_LITERAL, sizeof(Literal));
+}
+
 static bool startswith(char *p, char *q) {
   return strncmp(p, q, strlen(q)) == 0;
 }
 
+// Fast-path scanners
+//
+// The functions below skip a run of bytes of a certain class 16 bytes
+// at a time using SSE2, which every x86-64 CPU has. They may stop
+// before the actual end of a run, so callers still need their own
+// byte-at-a-time loops; the scanners only make the loops shorter.
+// Non-ASCII bytes stop skip_ident(), so Unicode identifiers are still
+// handled by decode_utf8().
+
+#ifdef __SSE2__
+static int match_byte(__m128i v, char c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static int match_range(__m128i v, char lo, char hi) {
+  __m128i ge = _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1));
+  __m128i le = _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1));
+  return _mm_movemask_epi8(_mm_and_si128(ge, le));
+}
+
+static int stop_blank(__m128i v) {
+  return ~(match_byte(v, ' ') | match_byte(v, '\t')) & 0xffff;
+}
+
+static int stop_line(__m128i v) {
+  return match_byte(v, '\n') | match_byte(v, '\0');
+}
+
+static int stop_comment(__m128i v) {
+  return match_byte(v, '*') | match_byte(v, '\0');
+}
+
+static int stop_ident(__m128i v) {
+  int mask = match_range(v, 'a', 'z') | match_range(v, 'A', 'Z') |
+             match_range(v, '0', '9') | match_byte(v, '_') | match_byte(v, '$');
+  return ~mask & 0xffff;
+}
+
+static int stop_string(__m128i v) {
+  return match_byte(v, '"') | match_byte(v, '\\') | match_byte(v, '\n') |
+         match_byte(v, '\0');
+}
+
+static int stop_raw(__m128i v) {
+  return match_byte(v, '/') | match_byte(v, '"') | match_byte(v, '\'') |
+         match_byte(v, '\n') | match_byte(v, '\0');
+}
+
+// Returns the position of the first byte for which `stop` sets a bit.
+// Never reads past the end of the input.
+static char *scan16(char *p, int (*stop)(__m128i)) {
+  while (p + 16 <= input_end) {
+    int mask = stop(_mm_loadu_si128((__m128i *)p));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return p;
+}
+
+static char *skip_blanks(char *p) {
+  return scan16(p, stop_blank);
+}
+
+static char *skip_to_newline(char *p) {
+  return scan16(p, stop_line);
+}
+
+static char *skip_comment(char *p) {
+  return scan16(p, stop_comment);
+}
+
+static char *skip_ident(char *p) {
+  return scan16(p, stop_ident);
+}
+
+static char *skip_string(char *p) {
+  return scan16(p, stop_string);
+}
+
+static char *skip_raw_text(char *p) {
+  return scan16(p, stop_raw);
+}
+#else
+static char *skip_blanks(char *p) {
+  return p;
+}
+
+static char *skip_to_newline(char *p) {
+  return p;
+}
+
+static char *skip_comment(char *p) {
+  return p;
+}
+
+static char *skip_ident(char *p) {
+  return p;
+}
+
+static char *skip_string(char *p) {
+  return p;
+}
+
+static char *skip_raw_text(char *p) {
+  return p;
+}
+#endif
+
+// Returns the position after the end of a block comment at p.
+static char *skip_block_comment(char *p) {
+  char *q = p + 2;
+  for (;; q++) {
+    q = skip_comment(q);
+    if (*q == '\0')
+      error_at(p, "unclosed block comment");
+    if (q[0] == '*' && q[1] == '/')
+      return q + 2;
+  }
+}
+
 // Read an identifier and returns the length of it.
 // If p does not point to a valid identifier, 0 is returned.
 static int read_ident(char *start) {
@@ -124,6 +304,7 @@ static int read_ident(char *start) {
     return 0;
 
   for (;;) {
+    p = skip_ident(p);
     char *q;
     c = decode_utf8(&q, p);
     if (!is_ident2(c))
@@ -141,40 +322,76 @@ static int from_hex(char c) {
 }
 
 // Read a punctuator token from p and returns its length.
+//
+// Multi-letter punctuators are recognized by looking at the first
+// letter and then at most two more letters.
 static int read_punct(char *p) {
-  static char *kw[] = {
-    "<<=", ">>=", "...", "==", "!=", "<=", ">=", "->", "+=",
-    "-=", "*=", "/=", "++", "--", "%=", "&=", "|=", "^=", "&&",
-    "||", "<<", ">>", "##",
-  };
-
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (startswith(p, kw[i]))
-      return strlen(kw[i]);
+  switch (*p) {
+  case '<':
+  case '>':
+    // "<<=", ">>=", "<<", ">>", "<=" and ">="
+    if (p[1] == p[0])
+      return (p[2] == '=') ? 3 : 2;
+    return (p[1] == '=') ? 2 : 1;
+  case '.':
+    // "..."
+    return (p[1] == '.' && p[2] == '.') ? 3 : 1;
+  case '=':
+  case '!':
+  case '*':
+  case '/':
+  case '%':
+  case '^':
+    // "==", "!=", "*=", "/=", "%=" and "^="
+    return (p[1] == '=') ? 2 : 1;
+  case '+':
+  case '&':
+  case '|':
+    // "++", "+=", "&&", "&=", "||" and "|="
+    return (p[1] == p[0] || p[1] == '=') ? 2 : 1;
+  case '-':
+    // "--", "-=" and "->"
+    return (p[1] == '-' || p[1] == '=' || p[1] == '>') ? 2 : 1;
+  case '#':
+    // "##"
+    return (p[1] == '#') ? 2 : 1;
+  }
 
   return ispunct(*p) ? 1 : 0;
 }
 
-static bool is_keyword(Token *tok) {
-  static HashMap map;
+// Most punctuators are one character long, so their atoms are kept
+// in a table to save a hash lookup.
+static Atom *punct_atom(char *p, int len) {
+  static Atom *table[128];
+  if (len > 1 || (unsigned char)*p >= 128)
+    return intern_atom(p, len);
+  Atom **a = &table[(unsigned char)*p];
+  if (!*a)
+    *a = intern_atom(p, 1);
+  return *a;
+}
 
-  if (map.capacity == 0) {
-    static char *kw[] = {
-      "return", "if", "else", "for", "while", "int", "sizeof", "char",
-      "struct", "union", "short", "long", "void", "typedef", "_Bool",
-      "enum", "static", "goto", "break", "continue", "switch", "case",
-      "default", "extern", "_Alignof", "_Alignas", "do", "signed",
-      "unsigned", "const", "volatile", "auto", "register", "restrict",
-      "__restrict", "__restrict__", "_Noreturn", "float", "double",
-      "typeof", "asm", "_Thread_local", "__thread", "_Atomic",
-      "__attribute__",
-    };
+// Keywords are marked in their atoms, so that telling if a token is
+// a keyword doesn't need a lookup.
+static void init_keywords(void) {
+  static char *kw[] = {
+    "return", "if", "else", "for", "while", "int", "sizeof", "char",
+    "struct", "union", "short", "long", "void", "typedef", "_Bool",
+    "enum", "static", "goto", "break", "continue", "switch", "case",
+    "default", "extern", "_Alignof", "_Alignas", "do", "signed",
+    "unsigned", "const", "volatile", "auto", "register", "restrict",
+    "__restrict", "__restrict__", "_Noreturn", "float", "double",
+    "typeof", "asm", "_Thread_local", "__thread", "_Atomic",
+    "__attribute__",
+  };
 
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-      hashmap_put(&map, kw[i], (void *)1);
-  }
+  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
+    intern_atom(kw[i], strlen(kw[i]))->is_keyword = true;
+}
 
-  return hashmap_get2(&map, tok->loc, tok->len);
+static bool is_keyword(Token *tok) {
+  return tok->kind == TK_IDENT && tok->atom->is_keyword;
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -233,18 +450,20 @@ static int read_escaped_char(char **new_pos, char *p) {
 // Find a closing double-quote.
 static char *string_literal_end(char *p) {
   char *start = p;
-  for (; *p != '"'; p++) {
+  for (;; p++) {
+    p = skip_string(p);
+    if (*p == '"')
+      return p;
     if (*p == '\n' || *p == '\0')
       error_at(start, "unclosed string literal");
     if (*p == '\\')
       p++;
   }
-  return p;
 }
 
 static Token *read_string_literal(char *start, char *quote) {
   char *end = string_literal_end(quote + 1);
-  char *buf = calloc(1, end - quote);
+  char *buf = arena_alloc(ARENA_MISC, end - quote);
   int len = 0;
 
   for (char *p = quote + 1; p < end;) {
@@ -255,8 +474,9 @@ static Token *read_string_literal(char *start, char *quote) {
   }
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_char, len + 1);
-  tok->str = buf;
+  new_literal(tok);
+  tok->lit->ty = array_of(ty_char, len + 1);
+  tok->lit->str = buf;
   return tok;
 }
 
@@ -267,12 +487,9 @@ static Token *read_string_literal(char *start, char *quote) {
 // equal to or larger than that are encoded in 4 bytes. Each 2 bytes
 // in the 4 byte sequence is called "surrogate", and a 4 byte sequence
 // is called a "surrogate pair".
-static Token *read_utf16_string_literal(char *start, char *quote) {
-  char *end = string_literal_end(quote + 1);
-  uint16_t *buf = calloc(2, end - start);
+static int encode_utf16(char *p, char *end, uint16_t *buf) {
   int len = 0;
-
-  for (char *p = quote + 1; p < end;) {
+  while (p < end) {
     if (*p == '\\') {
       buf[len++] = read_escaped_char(&p, p + 1);
       continue;
@@ -289,10 +506,18 @@ static Token *read_utf16_string_literal(char *start, char *quote) {
       buf[len++] = 0xdc00 + (c & 0x3ff);
     }
   }
+  return len;
+}
+
+static Token *read_utf16_string_literal(char *start, char *quote) {
+  char *end = string_literal_end(quote + 1);
+  uint16_t *buf = arena_alloc(ARENA_MISC, 2 * (end - start));
+  int len = encode_utf16(quote + 1, end, buf);
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_ushort, len + 1);
-  tok->str = (char *)buf;
+  new_literal(tok);
+  tok->lit->ty = array_of(ty_ushort, len + 1);
+  tok->lit->str = (char *)buf;
   return tok;
 }
 
@@ -300,21 +525,26 @@ static Token *read_utf16_string_literal(char *start, char *quote) {
 //
 // UTF-32 is a fixed-width encoding for Unicode. Each code point is
 // encoded in 4 bytes.
-static Token *read_utf32_string_literal(char *start, char *quote, Type *ty) {
-  char *end = string_literal_end(quote + 1);
-  uint32_t *buf = calloc(4, end - quote);
+static int encode_utf32(char *p, char *end, uint32_t *buf) {
   int len = 0;
-
-  for (char *p = quote + 1; p < end;) {
+  while (p < end) {
     if (*p == '\\')
       buf[len++] = read_escaped_char(&p, p + 1);
     else
       buf[len++] = decode_utf8(&p, p);
   }
+  return len;
+}
+
+static Token *read_utf32_string_literal(char *start, char *quote, Type *ty) {
+  char *end = string_literal_end(quote + 1);
+  uint32_t *buf = arena_alloc(ARENA_MISC, 4 * (end - quote));
+  int len = encode_utf32(quote + 1, end, buf);
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty, len + 1);
-  tok->str = (char *)buf;
+  new_literal(tok);
+  tok->lit->ty = array_of(ty, len + 1);
+  tok->lit->str = (char *)buf;
   return tok;
 }
 
@@ -334,8 +564,9 @@ static Token *read_char_literal(char *start, char *quote, Type *ty) {
     error_at(p, "unclosed char literal");
 
   Token *tok = new_token(TK_NUM, start, end + 1);
-  tok->val = c;
-  tok->ty = ty;
+  new_literal(tok);
+  tok->lit->val = c;
+  tok->lit->ty = ty;
   return tok;
 }
 
@@ -412,8 +643,9 @@ static bool convert_pp_int(Token *tok) {
   }
 
   tok->kind = TK_NUM;
-  tok->val = val;
-  tok->ty = ty;
+  new_literal(tok);
+  tok->lit->val = val;
+  tok->lit->ty = ty;
   return true;
 }
 
@@ -448,8 +680,9 @@ static void convert_pp_number(Token *tok) {
     error_tok(tok, "invalid numeric constant");
 
   tok->kind = TK_NUM;
-  tok->fval = val;
-  tok->ty = ty;
+  new_literal(tok);
+  tok->lit->fval = val;
+  tok->lit->ty = ty;
 }
 
 void convert_pp_tokens(Token *tok) {
@@ -462,37 +695,72 @@ void convert_pp_tokens(Token *tok) {
 }
 
 // Initialize line info for all tokens.
-static void add_line_numbers(Token *tok) {
-  char *p = current_file->contents;
-  int n = 1;
-
-  do {
+// Assigns line numbers to tokens. `p` is the position of the first
+// token's line and `n` is its line number.
+static void add_line_numbers(Token *tok, char *p, int n) {
+  while (tok) {
     if (p == tok->loc) {
       tok->line_no = n;
       tok = tok->next;
+      continue;
     }
     if (*p == '\n')
       n++;
-  } while (*p++);
+    p++;
+  }
 }
 
-Token *tokenize_string_literal(Token *tok, Type *basety) {
-  Token *t;
+// Re-reads a regular string literal as a string of a wider character
+// type, writing its characters (without the terminating NUL) to `buf`.
+// Returns the number of characters written, which never exceeds the
+// length of the original literal.
+int transcode_string_literal(Token *tok, Type *basety, void *buf) {
+  char *end = string_literal_end(tok->loc + 1);
   if (basety->size == 2)
-    t = read_utf16_string_literal(tok->loc, tok->loc);
-  else
-    t = read_utf32_string_literal(tok->loc, tok->loc, basety);
-  t->next = tok->next;
-  return t;
+    return encode_utf16(tok->loc + 1, end, buf);
+  return encode_utf32(tok->loc + 1, end, buf);
 }
 
-// Tokenize a given string and returns new tokens.
-Token *tokenize(File *file) {
+// Returns true if a given line is a conditional directive.
+static bool is_cond_directive(Token *tok) {
+  if (!tok || !tok->at_bol || !equal(tok, "#") || !tok->next)
+    return false;
+
+  static char *kw[] = {"if", "ifdef", "ifndef", "elif", "else", "endif"};
+  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
+    if (equal(tok->next, kw[i]))
+      return true;
+  return false;
+}
+
+// Returns a TK_LAZY token that represents the rest of the current
+// file from `p`, which must be at the beginning of a line.
+static Token *new_lazy_token(char *p, Token *rest) {
+  at_bol = true;
+  has_space = false;
+  Token *tok = new_token(TK_LAZY, p, p);
+  tok->rest = rest;
+  return tok;
+}
+
+// Tokenizes `file` from `p`, which is at the beginning of line `line_no`,
+// and appends `rest` after the end of the file.
+//
+// If `lazy` is true, tokenization stops after each conditional
+// directive line, and the rest of the file is represented by a TK_LAZY
+// token. The preprocessor then either resumes tokenization with
+// tokenize_rest() or, if the following group is inactive, skips it with
+// skip_cond_text() without making tokens for it.
+static Token *tokenize2(File *file, char *p, int line_no, bool lazy, Token *rest) {
   current_file = file;
+  if (!file->end)
+    file->end = file->contents + strlen(file->contents);
+  input_end = file->end;
 
-  char *p = file->contents;
+  char *start = p;
   Token head = {};
   Token *cur = &head;
+  Token *line = &head; // The last token before the current line
 
   at_bol = true;
   has_space = false;
@@ -500,7 +768,7 @@ Token *tokenize(File *file) {
   while (*p) {
     // Skip line comments.
     if (startswith(p, "//")) {
-      p += 2;
+      p = skip_to_newline(p + 2);
       while (*p != '\n')
         p++;
       has_space = true;
@@ -509,10 +777,7 @@ Token *tokenize(File *file) {
 
     // Skip block comments.
     if (startswith(p, "/*")) {
-      char *q = strstr(p + 2, "*/");
-      if (!q)
-        error_at(p, "unclosed block comment");
-      p = q + 2;
+      p = skip_block_comment(p);
       has_space = true;
       continue;
     }
@@ -520,6 +785,12 @@ Token *tokenize(File *file) {
     // Skip newline.
     if (*p == '\n') {
       p++;
+      if (lazy && *p && is_cond_directive(line->next)) {
+        cur = cur->next = new_lazy_token(p, rest);
+        add_line_numbers(head.next, start, line_no);
+        return head.next;
+      }
+      line = cur;
       at_bol = true;
       has_space = false;
       continue;
@@ -527,7 +798,7 @@ Token *tokenize(File *file) {
 
     // Skip whitespace characters.
     if (isspace(*p)) {
-      p++;
+      p = skip_blanks(p + 1);
       has_space = true;
       continue;
     }
@@ -585,7 +856,7 @@ Token *tokenize(File *file) {
     // Character literal
     if (*p == '\'') {
       cur = cur->next = read_char_literal(p, p, ty_int);
-      cur->val = (char)cur->val;
+      cur->lit->val = (char)cur->lit->val;
       p += cur->len;
       continue;
     }
@@ -593,7 +864,7 @@ Token *tokenize(File *file) {
     // UTF-16 character literal
     if (startswith(p, "u'")) {
       cur = cur->next = read_char_literal(p, p + 1, ty_ushort);
-      cur->val &= 0xffff;
+      cur->lit->val &= 0xffff;
       p += cur->len;
       continue;
     }
@@ -616,6 +887,7 @@ Token *tokenize(File *file) {
     int ident_len = read_ident(p);
     if (ident_len) {
       cur = cur->next = new_token(TK_IDENT, p, p + ident_len);
+      cur->atom = intern_atom(p, ident_len);
       p += cur->len;
       continue;
     }
@@ -624,6 +896,7 @@ Token *tokenize(File *file) {
     int punct_len = read_punct(p);
     if (punct_len) {
       cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
+      cur->atom = punct_atom(p, punct_len);
       p += cur->len;
       continue;
     }
@@ -631,47 +904,237 @@ Token *tokenize(File *file) {
     error_at(p, "invalid token");
   }
 
-  cur = cur->next = new_token(TK_EOF, p, p);
-  add_line_numbers(head.next);
+  if (!rest)
+    cur = cur->next = new_token(TK_EOF, p, p);
+  add_line_numbers(head.next, start, line_no);
+  cur->next = rest;
   return head.next;
 }
 
-// Returns the contents of a given file.
-static char *read_file(char *path) {
-  FILE *fp;
+// Tokenize a given string and returns new tokens.
+Token *tokenize(File *file) {
+  return tokenize2(file, file->contents, 1, false, NULL);
+}
 
-  if (strcmp(path, "-") == 0) {
-    // By convention, read from stdin if a given filename is "-".
-    fp = stdin;
-  } else {
-    fp = fopen(path, "r");
-    if (!fp)
-      return NULL;
+// Files that are included more than once, such as X-macro tables,
+// are tokenized only once. The preprocessor modifies tokens in place,
+// so we keep a pristine copy of each part of such files, keyed by its
+// position in the file contents, and hand out copies of it.
+static HashMap token_cache;
+
+// Files that have been read, keyed by path.
+static HashMap file_cache;
+
+// If true, the tokens of all files are cached, not only of files that
+// are included more than once. Set by --serve.
+bool cache_all_tokens;
+
+// Copies a cached token list for `file` and links it to `rest`.
+static Token *copy_cached_tokens(Token *tok, File *file, Token *rest) {
+  Token head = {};
+  Token *cur = &head;
+
+  for (; tok && !(tok->kind == TK_EOF && rest); tok = tok->next) {
+    Token *t = arena_alloc(ARENA_TOKEN, sizeof(Token));
+    counters.tokens++;
+    *t = *tok;
+    t->file = file;
+    t->filename = file->display_name;
+    if (t->kind == TK_LAZY)
+      t->rest = rest;
+    cur = cur->next = t;
   }
 
-  char *buf;
-  size_t buflen;
-  FILE *out = open_memstream(&buf, &buflen);
+  if (cur->kind != TK_LAZY)
+    cur->next = rest;
+  return head.next;
+}
+
+static Token *tokenize_lazy(File *file, char *p, int line_no, Token *rest) {
+  if (!file->cache_tokens)
+    return tokenize2(file, p, line_no, true, rest);
 
-  // Read the entire file.
+  Token *tok = hashmap_get2(&token_cache, (char *)&p, sizeof(p));
+  if (!tok) {
+    tok = tokenize2(file, p, line_no, true, NULL);
+    char **key = arena_alloc(ARENA_MISC, sizeof(p));
+    *key = p;
+    hashmap_put2(&token_cache, (char *)key, sizeof(p), tok);
+  }
+  return copy_cached_tokens(tok, file, rest);
+}
+
+// Tokenizes the rest of a file represented by a TK_LAZY token.
+Token *tokenize_rest(Token *tok) {
+  Phase prev = phase_enter(PHASE_TOKENIZE);
+  tok = tokenize_lazy(tok->file, tok->loc, tok->line_no, tok->rest);
+  phase_leave(prev);
+  return tok;
+}
+
+// Appends tok2 to the end of tok1 without copying tokens. If tok1 has
+// not been tokenized to the end, tok2 follows the rest of the file.
+Token *append_tokens(Token *tok1, Token *tok2) {
+  if (!tok1 || tok1->kind == TK_EOF)
+    return tok2;
+
+  for (Token *t = tok1;; t = t->next) {
+    if (t->kind == TK_LAZY) {
+      t->rest = append_tokens(t->rest, tok2);
+      return tok1;
+    }
+    if (t->next->kind == TK_EOF) {
+      t->next = tok2;
+      return tok1;
+    }
+  }
+}
+
+// Raw text scanner
+//
+// Inactive conditional groups may contain anything, and we don't need
+// tokens for them. The functions below skip such groups by looking
+// only at the beginning of each line for directives. Comments and
+// quotes are still recognized so that a `#` in them is not mistaken
+// for a directive.
+
+// Skips whitespace other than newlines and comments.
+static char *skip_raw_blanks(char *p) {
   for (;;) {
-    char buf2[4096];
-    int n = fread(buf2, 1, sizeof(buf2), fp);
-    if (n == 0)
+    if (startswith(p, "//")) {
+      p = skip_to_newline(p + 2);
+      while (*p && *p != '\n')
+        p++;
+    } else if (startswith(p, "/*")) {
+      p = skip_block_comment(p);
+    } else if (*p != '\n' && isspace(*p)) {
+      p++;
+    } else {
+      return p;
+    }
+  }
+}
+
+// Skips to the beginning of the next line.
+static char *skip_raw_line(char *p) {
+  for (;;) {
+    p = skip_raw_text(p);
+    switch (*p) {
+    case '\0':
+      return p;
+    case '\n':
+      return p + 1;
+    case '/':
+      if (p[1] == '/' || p[1] == '*')
+        p = skip_raw_blanks(p);
+      else
+        p++;
       break;
-    fwrite(buf2, 1, n, out);
+    case '"':
+    case '\'': {
+      // An unterminated quote ends at the end of the line.
+      char *q = p + 1;
+      for (; *q && *q != *p && *q != '\n'; q++)
+        if (*q == '\\' && q[1])
+          q++;
+      p = (*q == *p) ? q + 1 : q;
+      break;
+    }
+    default:
+      p++;
+    }
   }
+}
 
-  if (fp != stdin)
-    fclose(fp);
+// If a given line is a directive, returns its name. Otherwise,
+// returns NULL.
+static char *raw_directive(char *p) {
+  p = skip_raw_blanks(p);
+  if (*p != '#')
+    return NULL;
+  return skip_raw_blanks(p + 1);
+}
 
-  // Make sure that the last line is properly terminated with '\n'.
-  fflush(out);
-  if (buflen == 0 || buf[buflen - 1] != '\n')
-    fputc('\n', out);
-  fputc('\0', out);
-  fclose(out);
-  return buf;
+static bool is_raw_word(char *p, char *word) {
+  int len = strlen(word);
+  return !strncmp(p, word, len) && read_ident(p) == len;
+}
+
+// Skips lines until a `#elif`, `#else` or `#endif` that is not nested
+// in another conditional group. Returns the beginning of that line or
+// the end of the file.
+static char *skip_raw_group(char *p) {
+  int depth = 0;
+  for (; *p; p = skip_raw_line(p)) {
+    char *dir = raw_directive(p);
+    if (!dir)
+      continue;
+
+    if (is_raw_word(dir, "if") || is_raw_word(dir, "ifdef") ||
+        is_raw_word(dir, "ifndef"))
+      depth++;
+    else if (depth == 0 && (is_raw_word(dir, "elif") ||
+                            is_raw_word(dir, "else") ||
+                            is_raw_word(dir, "endif")))
+      return p;
+    else if (is_raw_word(dir, "endif"))
+      depth--;
+  }
+  return p;
+}
+
+static int count_lines(char *p, char *end) {
+  int n = 0;
+  while ((p = memchr(p, '\n', end - p))) {
+    n++;
+    p++;
+  }
+  return n;
+}
+
+static void start_raw_scan(Token *tok) {
+  current_file = tok->file;
+  input_end = tok->file->end;
+}
+
+// Skips an inactive conditional group without tokenizing it. `tok`
+// is a TK_LAZY token at the beginning of the group. Returns a TK_LAZY
+// token at the `#elif`, `#else` or `#endif` that ends the group.
+Token *skip_cond_text(Token *tok) {
+  start_raw_scan(tok);
+  char *p = skip_raw_group(tok->loc);
+  Token *tok2 = new_lazy_token(p, tok->rest);
+  tok2->line_no = tok->line_no + count_lines(tok->loc, p);
+  return tok2;
+}
+
+// Returns true if the rest of a file represented by a TK_LAZY token
+// starts with `#define <macro>` and ends with the `#endif` that closes
+// the current group. Used to detect include guards without
+// tokenizing the whole file.
+bool is_include_guard(Token *tok, char *macro) {
+  start_raw_scan(tok);
+
+  char *p = tok->loc;
+  while (*(p = skip_raw_blanks(p)) == '\n')
+    p++;
+
+  char *dir = raw_directive(p);
+  if (!dir || !is_raw_word(dir, "define"))
+    return false;
+  dir = skip_raw_blanks(dir + 6);
+  if (!is_raw_word(dir, macro))
+    return false;
+
+  p = skip_raw_group(skip_raw_line(p));
+  if (!*p || !is_raw_word(raw_directive(p), "endif"))
+    return false;
+
+  for (p = skip_raw_line(p);; p++) {
+    p = skip_raw_blanks(p);
+    if (*p != '\n')
+      return *p == '\0';
+  }
 }
 
 File **get_input_files(void) {
@@ -679,7 +1142,7 @@ File **get_input_files(void) {
 }
 
 File *new_file(char *name, int file_no, char *contents) {
-  File *file = calloc(1, sizeof(File));
+  File *file = arena_alloc(ARENA_FILE, sizeof(File));
   file->name = name;
   file->display_name = name;
   file->file_no = file_no;
@@ -687,50 +1150,21 @@ File *new_file(char *name, int file_no, char *contents) {
   return file;
 }
 
-// Replaces \r or \r\n with \n.
-static void canonicalize_newline(char *p) {
-  int i = 0, j = 0;
-
-  while (p[i]) {
-    if (p[i] == '\r' && p[i + 1] == '\n') {
-      i += 2;
-      p[j++] = '\n';
-    } else if (p[i] == '\r') {
-      i++;
-      p[j++] = '\n';
-    } else {
-      p[j++] = p[i++];
-    }
-  }
-
-  p[j] = '\0';
-}
-
-// Removes backslashes followed by a newline.
-static void remove_backslash_newline(char *p) {
-  int i = 0, j = 0;
-
-  // We want to keep the number of newline characters so that
-  // the logical line number matches the physical one.
-  // This counter maintain the number of newlines we have removed.
-  int n = 0;
+// Reads the entire contents of a stream.
+static char *read_stream(FILE *fp, size_t *len) {
+  char *buf;
+  FILE *out = open_memstream(&buf, len);
 
-  while (p[i]) {
-    if (p[i] == '\\' && p[i + 1] == '\n') {
-      i += 2;
-      n++;
-    } else if (p[i] == '\n') {
-      p[j++] = p[i++];
-      for (; n > 0; n--)
-        p[j++] = '\n';
-    } else {
-      p[j++] = p[i++];
-    }
+  for (;;) {
+    char buf2[4096];
+    int n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
   }
 
-  for (; n > 0; n--)
-    p[j++] = '\n';
-  p[j] = '\0';
+  fclose(out);
+  return buf;
 }
 
 static uint32_t read_universal_char(char *p, int len) {
@@ -743,42 +1177,234 @@ static uint32_t read_universal_char(char *p, int len) {
   return c;
 }
 
-// Replace \u or \U escape sequences with corresponding UTF-8 bytes.
-static void convert_universal_chars(char *p) {
-  char *q = p;
-
-  while (*p) {
-    if (startswith(p, "\\u")) {
-      uint32_t c = read_universal_char(p + 2, 4);
-      if (c) {
-        p += 6;
-        q += encode_utf8(q, c);
-      } else {
-        *q++ = *p++;
-      }
-    } else if (startswith(p, "\\U")) {
-      uint32_t c = read_universal_char(p + 2, 8);
-      if (c) {
-        p += 10;
-        q += encode_utf8(q, c);
-      } else {
-        *q++ = *p++;
-      }
-    } else if (p[0] == '\\') {
-      *q++ = *p++;
+// Converts a \u or \U escape sequence at buf[*r] to UTF-8 and writes
+// it to buf[*w]. Other characters are copied as-is. buf[*r] must be
+// followed by at least ten characters or a NUL.
+static void convert_universal_char(char *buf, size_t *r, size_t *w) {
+  char *p = buf + *r;
+  char *q = buf + *w;
+
+  if (startswith(p, "\\u")) {
+    uint32_t c = read_universal_char(p + 2, 4);
+    if (c) {
+      p += 6;
+      q += encode_utf8(q, c);
+    } else {
       *q++ = *p++;
+    }
+  } else if (startswith(p, "\\U")) {
+    uint32_t c = read_universal_char(p + 2, 8);
+    if (c) {
+      p += 10;
+      q += encode_utf8(q, c);
     } else {
       *q++ = *p++;
     }
+  } else if (p[0] == '\\') {
+    *q++ = *p++;
+    *q++ = *p++;
+  } else {
+    *q++ = *p++;
+  }
+
+  *r = p - buf;
+  *w = q - buf;
+}
+
+// Returns true if a given buffer contains '\r', a backslash-newline
+// or something that looks like a \u or \U escape sequence.
+static bool needs_normalization(char *p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] == '\r')
+      return true;
+    if (p[i] == '\\') {
+      if (i + 1 == len)
+        return true;
+      char c = p[i + 1];
+      if (c == '\n' || c == '\r' || c == 'u' || c == 'U')
+        return true;
+    }
+  }
+  return false;
+}
+
+// Returns the i'th character of a buffer, as if the buffer were
+// terminated by '\n' followed by '\0'.
+static char char_at(char *p, size_t len, size_t i) {
+  if (i < len)
+    return p[i];
+  if (i == len && (len == 0 || p[len - 1] != '\n'))
+    return '\n';
+  return '\0';
+}
+
+// Returns a copy of a given buffer with the following conversions,
+// all done in a single pass:
+//
+//  - "\r\n" and "\r" are replaced with "\n".
+//  - Backslash-newlines are removed. To keep the logical line
+//    numbers the same as the physical ones, the removed newlines
+//    are added back at the end of the logical line.
+//  - \u and \U escape sequences are converted to UTF-8.
+//  - If the last line is not terminated by '\n', '\n' is appended.
+//
+// A backslash-newline can appear in the middle of an escape sequence,
+// so escape sequences are converted in place, ten characters behind
+// the other conversions.
+static char *normalize(char *p, size_t len) {
+  // The result is never longer than the input plus "\n\0".
+  char *buf = malloc(len + 2);
+  if (!buf)
+    error("out of memory");
+
+  size_t j = 0; // Write position of the newline conversions
+  size_t r = 0; // Read position of the escape sequence conversion
+  size_t w = 0; // Write position of the escape sequence conversion
+  int n = 0;    // Number of removed newlines
+
+  for (size_t i = 0;;) {
+    char c = char_at(p, len, i++);
+    if (c == '\0')
+      break;
+
+    if (c == '\r') {
+      c = '\n';
+      if (char_at(p, len, i) == '\n')
+        i++;
+    }
+
+    if (c == '\\') {
+      char d = char_at(p, len, i);
+      if (d == '\n' || d == '\r') {
+        i += (d == '\r' && char_at(p, len, i + 1) == '\n') ? 2 : 1;
+        n++;
+        continue;
+      }
+    }
+
+    buf[j++] = c;
+    if (c == '\n')
+      for (; n > 0; n--)
+        buf[j++] = '\n';
+
+    while (j - r > 10)
+      convert_universal_char(buf, &r, &w);
+  }
+
+  for (; n > 0; n--)
+    buf[j++] = '\n';
+  buf[j] = '\0';
+
+  while (r < j)
+    convert_universal_char(buf, &r, &w);
+  buf[w] = '\0';
+  return buf;
+}
+
+// Returns the contents of a given file as a string that ends with
+// "\n\0". Regular files are memory-mapped, and if they don't need
+// any normalization, the mapped memory is returned as-is.
+static char *read_file(char *path) {
+  // By convention, read from stdin if a given filename is "-".
+  if (strcmp(path, "-") == 0) {
+    size_t len;
+    char *buf = read_stream(stdin, &len);
+    return normalize(buf, len);
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    FILE *fp = fdopen(fd, "r");
+    size_t len;
+    char *buf = read_stream(fp, &len);
+    fclose(fp);
+    return normalize(buf, len);
+  }
+
+  size_t len = st.st_size;
+  char *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  // The rest of the last page of a mapping is zero-filled, so if
+  // there's room, we can use it for the terminating "\n\0".
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t room = (len % pagesize) ? pagesize - len % pagesize : 0;
+
+  if (!needs_normalization(p, len)) {
+    if (p[len - 1] == '\n' && room >= 1)
+      return p;
+    if (p[len - 1] != '\n' && room >= 2) {
+      p[len] = '\n';
+      return p;
+    }
   }
 
-  *q = '\0';
+  char *buf = normalize(p, len);
+  munmap(p, len);
+  return buf;
+}
+
+// Creates a new File and saves it for assembler .file directive.
+File *add_input_file(char *path, char *contents) {
+  static int file_no;
+  File *file = new_file(path, file_no + 1, contents);
+
+  input_files = realloc(input_files, sizeof(char *) * (file_no + 2));
+  input_files[file_no] = file;
+  input_files[file_no + 1] = NULL;
+  file_no++;
+  return file;
+}
+
+// Returns the modification time of a file in nanoseconds, or 0 if it
+// cannot be determined.
+static long file_mtime(char *path) {
+  struct stat st;
+  if (stat(path, &st))
+    return 0;
+  return st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+}
+
+// Returns the file read from `path` before, unless the file has been
+// modified since then. The file cache outlives a compilation in
+// batch mode and with --serve, so that can happen.
+static File *find_cached_file(char *path) {
+  File *file = hashmap_get(&file_cache, path);
+  if (file && file->mtime && file->mtime != file_mtime(path)) {
+    hashmap_delete(&file_cache, path);
+    return NULL;
+  }
+  return file;
 }
 
 Token *tokenize_file(char *path) {
+  Phase prev = phase_enter(PHASE_TOKENIZE);
+
+  // If we have read the same file before, reuse its contents and
+  // tokens.
+  File *orig = find_cached_file(path);
+  if (orig) {
+    File *file = add_input_file(path, orig->contents);
+    file->end = orig->end;
+    file->cache_tokens = true;
+    Token *tok = tokenize_lazy(file, file->contents, 1, NULL);
+    orig->end = file->end;
+    phase_leave(prev);
+    return tok;
+  }
+
+  long mtime = file_mtime(path);
   char *p = read_file(path);
-  if (!p)
+  if (!p) {
+    phase_leave(prev);
     return NULL;
+  }
 
   // UTF-8 texts may start with a 3-byte "BOM" marker sequence.
   // If exists, just skip them because they are useless bytes.
@@ -787,19 +1413,64 @@ Token *tokenize_file(char *path) {
   if (!memcmp(p, "\xef\xbb\xbf", 3))
     p += 3;
 
-  canonicalize_newline(p);
-  remove_backslash_newline(p);
-  convert_universal_chars(p);
+  File *file = add_input_file(path, p);
+  file->cache_tokens = cache_all_tokens;
+  file->mtime = mtime;
+  hashmap_put(&file_cache, path, file);
+  Token *tok = tokenize_lazy(file, p, 1, NULL);
+  phase_leave(prev);
+  return tok;
+}
 
-  // Save the filename for assembler .file directive.
-  static int file_no;
-  File *file = new_file(path, file_no + 1, p);
+// Makes the given text the contents of `path`, as if it had been read
+// from the file.
+void set_file_contents(char *path, char *p, size_t len) {
+  hashmap_put(&file_cache, path, new_file(path, 0, normalize(p, len)));
+}
 
-  // Save the filename for assembler .file directive.
-  input_files = realloc(input_files, sizeof(char *) * (file_no + 2));
-  input_files[file_no] = file;
-  input_files[file_no + 1] = NULL;
-  file_no++;
+// Prints the parts of files in the token cache for which `filter`
+// returns true, as lines of "<offset> <path>".
+void print_token_cache(FILE *out, bool (*filter)(char *path)) {
+  int idx = 0;
+  for (HashEntry *ent; (ent = hashmap_next(&token_cache, &idx));) {
+    Token *tok = ent->val;
+    char *p = *(char **)ent->key;
+    if (tok && filter(tok->file->name))
+      fprintf(out, "%ld %s\n", (long)(p - tok->file->contents), tok->file->name);
+  }
+}
+
+// Tokenizes the part of a file starting at `offset` into the token
+// cache, so that it is not tokenized again by this process or the
+// processes forked from it.
+void preload_tokens(char *path, long offset) {
+  File *file = find_cached_file(path);
+  if (!file) {
+    long mtime = file_mtime(path);
+    char *p = read_file(path);
+    if (!p)
+      return;
+    if (!memcmp(p, "\xef\xbb\xbf", 3))
+      p += 3;
+    file = new_file(strdup(path), 0, p);
+    file->cache_tokens = true;
+    file->mtime = mtime;
+    hashmap_put(&file_cache, file->name, file);
+  }
+
+  // The file may have changed since it was read.
+  if (!file->end)
+    file->end = file->contents + strlen(file->contents);
+  if (!file->cache_tokens || offset < 0 || offset >= file->end - file->contents)
+    return;
 
-  return tokenize(file);
+  char *p = file->contents + offset;
+  if (hashmap_get2(&token_cache, (char *)&p, sizeof(p)))
+    return;
+
+  int line_no = 1;
+  for (char *q = file->contents; q < p; q++)
+    if (*q == '\n')
+      line_no++;
+  tokenize_lazy(file, p, line_no, NULL);
 }
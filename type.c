@@ -18,7 +18,7 @@ Type *ty_double = &(Type){TY_DOUBLE, 8, 8};
 Type *ty_ldouble = &(Type){TY_LDOUBLE, 16, 16};
 
 static Type *new_type(TypeKind kind, int size, int align) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(ARENA_TYPE, sizeof(Type));
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
@@ -83,21 +83,46 @@ bool is_compatible(Type *t1, Type *t2) {
       return false;
     return t1->array_len < 0 && t2->array_len < 0 &&
            t1->array_len == t2->array_len;
+  case TY_VECTOR:
+    return t1->size == t2->size && is_compatible(t1->elem, t2->elem);
   }
   return false;
 }
 
 Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
+  Type *ret = arena_alloc(ARENA_TYPE, sizeof(Type));
   *ret = *ty;
   ret->origin = ty;
+  ret->pointer = NULL;
   return ret;
 }
 
+// Returns a volatile-qualified copy of a given type. Incomplete
+// structs and unions are returned as they are, because a copy would
+// not see their completion.
+Type *volatile_of(Type *ty) {
+  if (ty->is_volatile || ty->size < 0)
+    return ty;
+  ty = copy_type(ty);
+  ty->is_volatile = true;
+  return ty;
+}
+
+// Derived types are hash-consed, so that pointer_to() and array_of()
+// return the same object for the same arguments. That saves memory
+// and lets is_compatible() return early by pointer comparison.
+//
+// Callers must not modify a returned type other than its name and
+// name_pos, which are only read right after a declarator is parsed.
+// Use copy_type() to get a type that can be modified.
 Type *pointer_to(Type *base) {
+  if (base->pointer)
+    return base->pointer;
+
   Type *ty = new_type(TY_PTR, 8, 8);
   ty->base = base;
   ty->is_unsigned = true;
+  base->pointer = ty;
   return ty;
 }
 
@@ -109,10 +134,33 @@ Type *func_type(Type *return_ty) {
   return ty;
 }
 
+typedef struct {
+  Type *base;
+  long len;
+} ArrayKey;
+
+static HashMap array_types;
+
 Type *array_of(Type *base, int len) {
+  // An array of an incomplete type is not cached because its size
+  // would be stale once the element type is completed.
+  ArrayKey key = {base, len};
+  bool cache = (base->size >= 0);
+  if (cache) {
+    Type *ty = hashmap_get2(&array_types, (char *)&key, sizeof(key));
+    if (ty)
+      return ty;
+  }
+
   Type *ty = new_type(TY_ARRAY, base->size * len, base->align);
   ty->base = base;
   ty->array_len = len;
+
+  if (cache) {
+    ArrayKey *k = arena_alloc(ARENA_TYPE, sizeof(ArrayKey));
+    *k = key;
+    hashmap_put2(&array_types, (char *)k, sizeof(*k), ty);
+  }
   return ty;
 }
 
@@ -123,6 +171,13 @@ Type *vla_of(Type *base, Node *len) {
   return ty;
 }
 
+Type *vector_of(Type *elem, int size) {
+  Type *ty = new_type(TY_VECTOR, size, size);
+  ty->elem = elem;
+  ty->array_len = size / elem->size;
+  return ty;
+}
+
 Type *enum_type(void) {
   return new_type(TY_ENUM, 4, 4);
 }
@@ -173,22 +228,115 @@ static void usual_arith_conv(Node **lhs, Node **rhs) {
   *rhs = new_cast(*rhs, ty);
 }
 
+// Operators on vectors apply to each element. Both operands must
+// have the same vector type, except that the shift count is a scalar.
+static void vector_op_type(Node *node) {
+  Type *ty = node->lhs->ty;
+  Type *elem = ty->kind == TY_VECTOR ? ty->elem : NULL;
+
+  switch (node->kind) {
+  case ND_NEG:
+    break;
+  case ND_BITNOT:
+    if (is_flonum(elem))
+      error_tok(node->tok, "invalid operand to vector operation");
+    break;
+  case ND_SHL:
+  case ND_SHR:
+    if (!elem || !is_integer(elem) || !is_integer(node->rhs->ty))
+      error_tok(node->tok, "invalid operands to vector shift");
+    break;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+    if (!elem || !is_compatible(ty, node->rhs->ty))
+      error_tok(node->tok, "invalid operands to vector operation");
+    if (node->kind == ND_MOD && is_flonum(elem))
+      error_tok(node->tok, "invalid operands to vector operation");
+    break;
+  case ND_EQ:
+  case ND_NE: {
+    // A comparison yields a vector of signed integers of the same
+    // size, whose lanes are -1 if the comparison holds and 0 otherwise.
+    if (!elem || !is_compatible(ty, node->rhs->ty))
+      error_tok(node->tok, "invalid operands to vector comparison");
+    int sz = elem->size;
+    Type *lane = (sz == 1) ? ty_char : (sz == 2) ? ty_short : (sz == 4) ? ty_int : ty_long;
+    node->ty = vector_of(lane, ty->size);
+    return;
+  }
+  default:
+    error_tok(node->tok, "vector operation is not supported");
+  }
+
+  node->ty = ty;
+}
+
+static bool has_vector_operand(Node *node) {
+  return node->lhs->ty->kind == TY_VECTOR ||
+         (node->rhs && node->rhs->ty->kind == TY_VECTOR);
+}
+
 void add_type(Node *node) {
   if (!node || node->ty)
     return;
 
   add_type(node->lhs);
   add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
 
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    add_type(node->cond);
+    add_type(node->then);
+    add_type(node->els);
+    add_type(node->init);
+    add_type(node->inc);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      add_type(n);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      add_type(n);
+    break;
+  }
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_NEG:
+  case ND_BITNOT:
+  case ND_NOT:
+  case ND_LOGAND:
+  case ND_LOGOR:
+    if (has_vector_operand(node)) {
+      vector_op_type(node);
+      return;
+    }
+  }
 
   switch (node->kind) {
   case ND_NUM:
@@ -245,6 +393,10 @@ void add_type(Node *node) {
   case ND_COND:
     if (node->then->ty->kind == TY_VOID || node->els->ty->kind == TY_VOID) {
       node->ty = ty_void;
+    } else if (node->then->ty->kind == TY_VECTOR) {
+      if (!is_compatible(node->then->ty, node->els->ty))
+        error_tok(node->tok, "type mismatch in conditional expression");
+      node->ty = node->then->ty;
     } else {
       usual_arith_conv(&node->then, &node->els);
       node->ty = node->then->ty;
@@ -298,6 +450,9 @@ void add_type(Node *node) {
     if (node->cas_old->ty->kind != TY_PTR)
       error_tok(node->cas_old->tok, "pointer expected");
     return;
+  case ND_ATOMIC_OP:
+    node->ty = node->lhs->ty->base;
+    return;
   case ND_EXCH:
     if (node->lhs->ty->kind != TY_PTR)
       error_tok(node->cas_addr->tok, "pointer expected");
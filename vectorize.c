@@ -0,0 +1,1098 @@
+// This file implements a loop vectorizer for the x86-64 backend, which
+// runs with -O2 after the inliner.
+//
+// An innermost loop that walks arrays with a unit stride, such as
+//
+//   for (init; i < n; i++)
+//     a[i] = b[i] + c[i];
+//
+// is rewritten with the vector types of the GCC vector extension, so
+// that the code generator processes 16 bytes of elements at once with
+// SSE2 instructions such as `paddd` or `addps`:
+//
+//   init;
+//   if (i < n && n - i >= W && a[i..n) doesn't overlap b[i..n) or c[i..n)) {
+//     for (; i < n && n - i >= W; i += W)
+//       *(V *)&a[i] = *(V *)&b[i] + *(V *)&c[i];
+//   }
+//   for (; i < n; i++)
+//     a[i] = b[i] + c[i];
+//
+// where V is a 16-byte vector of W elements. The original loop runs
+// the remaining iterations and everything if the arrays overlap, in
+// which case a store could change an element that a later iteration
+// loads. The accesses to the same array at the same index don't need
+// the check.
+//
+// The body of a loop may consist of the following statements, whose
+// elements all have the same size:
+//
+//  - `a[i] = x` and `a[i] op= x`, where x is built from elements at
+//    index i, loop-invariant values and operators that SSE2 provides
+//    for the element type. 32-bit and 64-bit integer multiplication
+//    isn't vectorized, since SSE2 has no instruction for it.
+//
+//  - `s += x`, `s -= x`, `s |= x` and `s ^= x` for a local integer
+//    variable s. Such a reduction is computed in the lanes of a vector,
+//    which are combined after the loop. Floating-point reductions
+//    aren't vectorized because that would change the order of the
+//    additions.
+//
+//  - `if (p[i] == c) break;` or `!=` for 1, 2 or 4-byte elements, as
+//    the only statement. The vector loop leaves at the first vector
+//    that contains a match, which the original loop then finds. The
+//    original loop may stop long before `n`, so we read only vectors
+//    at aligned addresses, which never cross a page boundary, and run
+//    the first iterations until we get there in a copy of the loop.
+//
+// C promotes integers narrower than int before arithmetic, but the low
+// bits of a sum, a difference, a product or a bitwise operation don't
+// depend on how wide the operands were extended, so we compute such
+// expressions in lanes of the element's width.
+
+#include "chibicc.h"
+
+#define VECTOR_SIZE 16
+#define MAX_STMTS 8
+#define MAX_ACCESSES 8
+
+typedef enum {
+  VS_STORE,
+  VS_REDUCE,
+  VS_SCAN,
+} StmtKind;
+
+typedef struct {
+  StmtKind kind;
+  Node *addr;   // Element stored to or scanned
+  Node *val;    // Value stored or accumulated
+  Obj *var;     // Accumulator, or the pointer of `a[i] op= x`
+  NodeKind op;  // Operator of a reduction or a scan
+  Node *key;    // Invariant operand of a scan
+  Type *key_ty; // Type the key is compared in
+  Type *elem;   // Type that the element is extended from in a scan
+} Stmt;
+
+typedef struct {
+  Node *base;
+  Node *addr;
+  bool is_store;
+} Access;
+
+static Obj *current_fn;
+
+// The loop being vectorized and its induction variable
+static Node *loop;
+static Obj *iv;
+
+static Stmt stmts[MAX_STMTS];
+static int nstmts;
+
+static Access accesses[MAX_ACCESSES];
+static int naccesses;
+
+// Element type and vector type of the statement being vectorized
+static Type *lane;
+static Type *vty;
+
+// Statements run before the vector loop, e.g. broadcasts of invariants
+static Node setup;
+static Node *setup_cur;
+
+// Calls visit() for each node of a given tree.
+static void walk(Node *node, void (*visit)(Node *)) {
+  if (!node)
+    return;
+
+  visit(node);
+  walk(node->lhs, visit);
+  walk(node->rhs, visit);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+  case ND_COND:
+    walk(node->cond, visit);
+    walk(node->then, visit);
+    walk(node->els, visit);
+    walk(node->init, visit);
+    walk(node->inc, visit);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      walk(n, visit);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      walk(n, visit);
+    break;
+  case ND_CAS:
+    walk(node->cas_addr, visit);
+    walk(node->cas_old, visit);
+    walk(node->cas_new, visit);
+    break;
+  }
+}
+
+static void take_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    node->var->is_addr_taken = true;
+    return;
+  case ND_MEMBER:
+    take_addr(node->lhs);
+    return;
+  case ND_COMMA:
+    take_addr(node->rhs);
+    return;
+  case ND_COND:
+    take_addr(node->then);
+    take_addr(node->els);
+    return;
+  }
+}
+
+static void find_addr_taken(Node *node) {
+  if (node->kind == ND_ADDR)
+    take_addr(node->lhs);
+}
+
+static bool is_qualified(Type *ty) {
+  return ty && (ty->is_volatile || ty->is_atomic);
+}
+
+// Returns true if a variable can't be modified through a pointer.
+static bool is_private(Obj *var) {
+  Type *ty = var->ty;
+  return var->is_local && !var->is_addr_taken && !is_qualified(ty) &&
+         (is_numeric(ty) || ty->kind == TY_PTR);
+}
+
+// Returns the type of the lanes of a vector of elements of a given
+// type, or NULL if it can't be vectorized. A pointer is copied as an
+// unsigned long.
+static Type *lane_type(Type *ty) {
+  switch (ty->kind) {
+  case TY_CHAR:
+    return ty->is_unsigned ? ty_uchar : ty_char;
+  case TY_SHORT:
+    return ty->is_unsigned ? ty_ushort : ty_short;
+  case TY_INT:
+  case TY_ENUM:
+    return ty->is_unsigned ? ty_uint : ty_int;
+  case TY_LONG:
+    return ty->is_unsigned ? ty_ulong : ty_long;
+  case TY_PTR:
+    return ty_ulong;
+  case TY_FLOAT:
+    return ty_float;
+  case TY_DOUBLE:
+    return ty_double;
+  }
+  return NULL;
+}
+
+static Node *skip_casts(Node *node) {
+  while (node->kind == ND_CAST)
+    node = node->lhs;
+  return node;
+}
+
+//
+// Node constructors
+//
+
+static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Type *ty) {
+  Node *node = new_node(kind, lhs->tok);
+  node->lhs = lhs;
+  node->rhs = rhs;
+  node->ty = ty;
+  return node;
+}
+
+static Node *new_unary(NodeKind kind, Node *expr, Type *ty) {
+  return new_binary(kind, expr, NULL, ty);
+}
+
+static Node *new_num(int64_t val, Type *ty) {
+  Node *node = new_node(ND_NUM, loop->tok);
+  node->val = val;
+  node->ty = ty;
+  return node;
+}
+
+static Node *new_var(Obj *var) {
+  Node *node = new_node(ND_VAR, loop->tok);
+  node->var = var;
+  node->ty = var->ty;
+  return node;
+}
+
+static Node *new_cast_to(Node *expr, Type *ty) {
+  return new_unary(ND_CAST, expr, ty);
+}
+
+static Node *new_assign(Node *lhs, Node *rhs) {
+  return new_binary(ND_ASSIGN, lhs, rhs, lhs->ty);
+}
+
+static Node *new_stmt(NodeKind kind, Node *expr) {
+  Node *node = new_node(kind, loop->tok);
+  node->lhs = expr;
+  return node;
+}
+
+static Node *new_block(Node *body) {
+  Node *node = new_node(ND_BLOCK, loop->tok);
+  node->body = body;
+  return node;
+}
+
+static Node *new_loop(Node *cond, Node *inc, Node *then) {
+  static int id;
+
+  Node *node = new_node(ND_FOR, loop->tok);
+  node->cond = cond;
+  node->inc = inc;
+  node->then = then;
+  node->brk_label = format(".L..vec.%d", id++);
+  node->cont_label = format(".L..vec.%d", id++);
+  return node;
+}
+
+static Obj *new_lvar(Type *ty) {
+  Obj *var = arena_alloc(ARENA_OBJ, sizeof(Obj));
+  var->name = "";
+  var->ty = ty;
+  var->tok = loop->tok;
+  var->is_local = true;
+  var->align = ty->align;
+  var->next = current_fn->locals;
+  current_fn->locals = var;
+  return var;
+}
+
+// Copies an expression that has passed the checks below.
+static Node *copy_expr(Node *node) {
+  if (!node)
+    return NULL;
+
+  Node *n = new_node(node->kind, node->tok);
+  n->ty = node->ty;
+  n->lhs = copy_expr(node->lhs);
+  n->rhs = copy_expr(node->rhs);
+
+  switch (node->kind) {
+  case ND_NUM:
+    n->val = node->val;
+    n->fval = node->fval;
+    break;
+  case ND_MEMBER:
+    n->member = node->member;
+    break;
+  case ND_VAR:
+    n->var = node->var;
+    break;
+  }
+  return n;
+}
+
+// `*(T *)((char *)&var + off)`
+static Node *var_part(Obj *var, Type *ty, int off) {
+  Node *addr = new_unary(ND_ADDR, new_var(var), pointer_to(var->ty));
+  addr = new_cast_to(addr, pointer_to(ty));
+  addr = new_binary(ND_ADD, addr, new_num(off, ty_long), addr->ty);
+  return new_unary(ND_DEREF, addr, ty);
+}
+
+//
+// Analysis
+//
+
+static bool is_assigned(Obj *var) {
+  if (var == iv)
+    return true;
+  for (int i = 0; i < nstmts; i++)
+    if (stmts[i].var == var)
+      return true;
+  return false;
+}
+
+// Returns true if a given expression has the same value throughout
+// the loop and has no side effects. It may not load from memory,
+// because the loop may store to the same location.
+static bool is_invariant(Node *node) {
+  if (is_qualified(node->ty))
+    return false;
+
+  switch (node->kind) {
+  case ND_NUM:
+    return true;
+  case ND_VAR:
+    if (node->ty->kind == TY_ARRAY)
+      return true;
+    return is_private(node->var) && !is_assigned(node->var);
+  case ND_MEMBER:
+    // The address of an array member of an object
+    return node->ty->kind == TY_ARRAY && !node->member->is_bitfield &&
+           (node->lhs->kind == ND_VAR || is_invariant(node->lhs));
+  case ND_DEREF:
+    return node->ty->kind == TY_STRUCT && is_invariant(node->lhs);
+  case ND_CAST:
+  case ND_NEG:
+  case ND_BITNOT:
+    return is_invariant(node->lhs);
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_SHL:
+  case ND_SHR:
+    return is_invariant(node->lhs) && is_invariant(node->rhs);
+  }
+  return false;
+}
+
+// Returns true if a given expression is the induction variable
+// extended in a way that keeps consecutive values consecutive.
+static bool is_index(Node *node) {
+  if (node->kind == ND_VAR)
+    return node->var == iv;
+  if (node->kind != ND_CAST || !is_integer(node->ty) ||
+      !is_integer(node->lhs->ty))
+    return false;
+
+  Type *from = node->lhs->ty;
+  if (node->ty->size < from->size ||
+      (node->ty->size == from->size && node->ty->is_unsigned != from->is_unsigned))
+    return false;
+  return is_index(node->lhs);
+}
+
+// If a given expression is the address of the i-th element of an
+// array of `size`-byte elements, returns the address of the array.
+static Node *access_base(Node *addr, int size) {
+  if (addr->kind != ND_ADD || addr->ty->kind != TY_PTR)
+    return NULL;
+
+  Node *idx = skip_casts(addr->rhs);
+  if (size > 1) {
+    if (idx->kind != ND_MUL || idx->ty->size != 8 || idx->rhs->kind != ND_NUM ||
+        idx->rhs->val != size)
+      return NULL;
+    idx = idx->lhs;
+  }
+  if (!is_index(idx))
+    return NULL;
+
+  Node *base = addr->lhs;
+  if (!is_invariant(base))
+    return NULL;
+  return base;
+}
+
+static bool same_expr(Node *a, Node *b) {
+  if (!a || !b)
+    return a == b;
+  if (a->kind != b->kind || a->ty->kind != b->ty->kind ||
+      a->ty->size != b->ty->size)
+    return false;
+
+  switch (a->kind) {
+  case ND_NUM:
+    return a->val == b->val && a->fval == b->fval;
+  case ND_VAR:
+    return a->var == b->var;
+  case ND_MEMBER:
+    if (a->member != b->member)
+      return false;
+    break;
+  }
+  return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+}
+
+static bool add_access(Node *base, Node *addr, bool is_store) {
+  for (int i = 0; i < naccesses; i++) {
+    if (same_expr(accesses[i].base, base)) {
+      accesses[i].is_store |= is_store;
+      return true;
+    }
+  }
+
+  if (naccesses == MAX_ACCESSES)
+    return false;
+  accesses[naccesses++] = (Access){base, addr, is_store};
+  return true;
+}
+
+// Returns true if an element of a given type can be held in a lane
+// of the current vector type.
+static bool is_lane(Type *ty) {
+  if (is_qualified(ty))
+    return false;
+  if (is_flonum(lane))
+    return ty->kind == lane->kind;
+  return (is_integer(ty) || ty->kind == TY_PTR) && ty->kind != TY_BOOL &&
+         ty->size == lane->size;
+}
+
+// Returns true if the low bits of an integer of a given type can be
+// computed in a lane of the current vector type.
+static bool is_wide_lane(Type *ty) {
+  if (is_flonum(lane))
+    return ty->kind == lane->kind;
+  return is_integer(ty) && ty->kind != TY_BOOL && ty->size >= lane->size;
+}
+
+//
+// Vectorization of expressions
+//
+
+// Returns a variable whose lanes are all set to a given invariant.
+static Node *splat(Node *expr) {
+  Obj *var = new_lvar(vty);
+  int n = VECTOR_SIZE / lane->size;
+
+  if (is_flonum(lane)) {
+    Obj *tmp = new_lvar(lane);
+    setup_cur = setup_cur->next =
+      new_stmt(ND_EXPR_STMT, new_assign(new_var(tmp), new_cast_to(expr, lane)));
+    for (int i = 0; i < n; i++)
+      setup_cur = setup_cur->next =
+        new_stmt(ND_EXPR_STMT, new_assign(var_part(var, lane, i * lane->size),
+                                          new_var(tmp)));
+    return new_var(var);
+  }
+
+  // Replicate the low bytes to 8 bytes by a multiplication.
+  uint64_t ones = (lane->size == 1) ? 0x0101010101010101 :
+                  (lane->size == 2) ? 0x0001000100010001 :
+                  (lane->size == 4) ? 0x0000000100000001 : 1;
+  Type *uty = (lane->size == 1) ? ty_uchar : (lane->size == 2) ? ty_ushort :
+              (lane->size == 4) ? ty_uint : ty_ulong;
+
+  Node *val;
+  if (expr->kind == ND_NUM) {
+    uint64_t x = expr->val;
+    if (lane->size < 8)
+      x &= (1UL << (lane->size * 8)) - 1;
+    val = new_num(x * ones, ty_ulong);
+  } else {
+    val = new_cast_to(new_cast_to(expr, uty), ty_ulong);
+    val = new_binary(ND_MUL, val, new_num(ones, ty_ulong), ty_ulong);
+  }
+
+  Obj *tmp = new_lvar(ty_ulong);
+  setup_cur = setup_cur->next =
+    new_stmt(ND_EXPR_STMT, new_assign(new_var(tmp), val));
+  for (int i = 0; i < 2; i++)
+    setup_cur = setup_cur->next =
+      new_stmt(ND_EXPR_STMT, new_assign(var_part(var, ty_ulong, i * 8),
+                                        new_var(tmp)));
+  return new_var(var);
+}
+
+// Returns a vector of the elements at a given address and i+1..i+W-1.
+static Node *vec_access(Node *addr, bool is_store) {
+  Node *base = access_base(addr, lane->size);
+  if (!base || !add_access(base, addr, is_store))
+    return NULL;
+  return new_unary(ND_DEREF, new_cast_to(copy_expr(addr), pointer_to(vty)), vty);
+}
+
+static Node *vec_expr(Node *node, Stmt *s);
+
+static Node *vec_binary(Node *node, Stmt *s) {
+  Node *lhs = vec_expr(node->lhs, s);
+  Node *rhs = lhs ? vec_expr(node->rhs, s) : NULL;
+  if (!rhs)
+    return NULL;
+  return new_binary(node->kind, lhs, rhs, vty);
+}
+
+// Returns an expression that computes a given scalar expression for
+// the elements i..i+W-1 in the lanes of a vector, or NULL.
+static Node *vec_expr(Node *node, Stmt *s) {
+  Type *ty = node->ty;
+  bool is_float = is_flonum(lane);
+
+  if (is_invariant(node)) {
+    if (!is_wide_lane(ty) && !(ty->kind == TY_PTR && is_lane(ty)))
+      return NULL;
+    return splat(node);
+  }
+
+  switch (node->kind) {
+  case ND_DEREF:
+    if (!is_lane(ty))
+      return NULL;
+    // `*tmp` in the expansion of `a[i] op= x`
+    if (node->lhs->kind == ND_VAR && s->var && node->lhs->var == s->var)
+      return vec_access(s->addr, false);
+    return vec_access(node->lhs, false);
+  case ND_CAST:
+    if (!is_wide_lane(ty) && !is_lane(ty))
+      return NULL;
+    if (!is_wide_lane(node->lhs->ty) && !is_lane(node->lhs->ty))
+      return NULL;
+    return vec_expr(node->lhs, s);
+  case ND_NEG:
+  case ND_BITNOT: {
+    if (!is_wide_lane(ty) || (is_float && node->kind == ND_BITNOT))
+      return NULL;
+    Node *lhs = vec_expr(node->lhs, s);
+    return lhs ? new_unary(node->kind, lhs, vty) : NULL;
+  }
+  case ND_ADD:
+  case ND_SUB:
+    if (!is_wide_lane(ty))
+      return NULL;
+    return vec_binary(node, s);
+  case ND_MUL:
+    if (!is_wide_lane(ty) || (!is_float && lane->size != 2))
+      return NULL;
+    return vec_binary(node, s);
+  case ND_DIV:
+    if (!is_float || !is_wide_lane(ty))
+      return NULL;
+    return vec_binary(node, s);
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+    if (is_float || !is_wide_lane(ty))
+      return NULL;
+    return vec_binary(node, s);
+  case ND_SHL:
+  case ND_SHR: {
+    // Shifts by a constant. A right shift needs the exact value of
+    // its operand, so it must be of the element's width.
+    if (is_float || lane->size == 1 || !is_wide_lane(ty))
+      return NULL;
+    if (node->kind == ND_SHR &&
+        (ty->size != lane->size || ty->is_unsigned != lane->is_unsigned))
+      return NULL;
+
+    Node *cnt = skip_casts(node->rhs);
+    if (cnt->kind != ND_NUM || cnt->val < 0 || cnt->val >= lane->size * 8)
+      return NULL;
+
+    Node *lhs = vec_expr(node->lhs, s);
+    return lhs ? new_binary(node->kind, lhs, new_num(cnt->val, ty_int), vty) : NULL;
+  }
+  }
+  return NULL;
+}
+
+//
+// Recognizing loops
+//
+
+// Returns true if a given expression is `i++`, `++i`, `i += 1` or
+// `i = i + 1`, and sets `iv` to i.
+static bool is_increment(Node *node) {
+  // The value of `i++` is `(i += 1) - 1`, which is discarded.
+  node = skip_casts(node);
+  if (node->kind == ND_ADD && node->rhs->kind == ND_NUM)
+    node = skip_casts(node->lhs);
+
+  if (node->kind != ND_ASSIGN || node->lhs->kind != ND_VAR)
+    return false;
+
+  Obj *var = node->lhs->var;
+  Node *rhs = skip_casts(node->rhs);
+  if (rhs->kind != ND_ADD || skip_casts(rhs->lhs)->kind != ND_VAR ||
+      skip_casts(rhs->lhs)->var != var || rhs->rhs->kind != ND_NUM ||
+      rhs->rhs->val != 1)
+    return false;
+
+  if (!is_private(var) || !is_integer(var->ty) || var->ty->size < 4)
+    return false;
+  iv = var;
+  return true;
+}
+
+// Adds the statements of a loop body to `stmts`.
+static bool collect_stmts(Node *node) {
+  if (node->kind == ND_BLOCK) {
+    for (Node *n = node->body; n; n = n->next)
+      if (!collect_stmts(n))
+        return false;
+    return true;
+  }
+
+  if (nstmts == MAX_STMTS)
+    return false;
+  Stmt *s = &stmts[nstmts++];
+  *s = (Stmt){};
+
+  // `if (x == y) break;`
+  if (node->kind == ND_IF) {
+    Node *then = node->then;
+    if (then->kind == ND_BLOCK && then->body && !then->body->next)
+      then = then->body;
+    if (node->els || then->kind != ND_GOTO ||
+        strcmp(then->unique_label, loop->brk_label))
+      return false;
+
+    s->kind = VS_SCAN;
+    s->val = node->cond;
+    return true;
+  }
+
+  if (node->kind != ND_EXPR_STMT)
+    return false;
+  Node *expr = node->lhs;
+
+  // `a[i] op= x` is `tmp = &a[i], *tmp = *tmp op x`.
+  if (expr->kind == ND_COMMA && expr->lhs->kind == ND_ASSIGN &&
+      expr->lhs->lhs->kind == ND_VAR && expr->rhs->kind == ND_ASSIGN &&
+      expr->rhs->lhs->kind == ND_DEREF && expr->rhs->lhs->lhs->kind == ND_VAR &&
+      expr->rhs->lhs->lhs->var == expr->lhs->lhs->var) {
+    Node *addr = skip_casts(expr->lhs->rhs);
+    if (addr->kind == ND_ADDR && addr->lhs->kind == ND_DEREF)
+      addr = addr->lhs->lhs;
+
+    s->kind = VS_STORE;
+    s->addr = addr;
+    s->val = expr->rhs->rhs;
+    s->var = expr->lhs->lhs->var;
+    return s->var->is_local && !s->var->is_addr_taken;
+  }
+
+  if (expr->kind != ND_ASSIGN)
+    return false;
+
+  // `a[i] = x`
+  if (expr->lhs->kind == ND_DEREF) {
+    s->kind = VS_STORE;
+    s->addr = expr->lhs->lhs;
+    s->val = expr->rhs;
+    return true;
+  }
+
+  // `s = s op x`
+  if (expr->lhs->kind != ND_VAR)
+    return false;
+
+  Obj *var = expr->lhs->var;
+  Node *rhs = skip_casts(expr->rhs);
+  if (!is_private(var) || !is_integer(var->ty) || var->ty->kind == TY_BOOL)
+    return false;
+
+  switch (rhs->kind) {
+  case ND_ADD:
+  case ND_BITOR:
+  case ND_BITXOR:
+    if (skip_casts(rhs->rhs)->kind == ND_VAR && skip_casts(rhs->rhs)->var == var) {
+      s->val = rhs->lhs;
+      break;
+    }
+    // fallthrough
+  case ND_SUB:
+    if (skip_casts(rhs->lhs)->kind != ND_VAR || skip_casts(rhs->lhs)->var != var)
+      return false;
+    s->val = rhs->rhs;
+    break;
+  default:
+    return false;
+  }
+
+  for (int i = 0; i < nstmts - 1; i++)
+    if (stmts[i].var == var)
+      return false;
+
+  s->kind = VS_REDUCE;
+  s->var = var;
+  s->op = rhs->kind;
+  return true;
+}
+
+// Checks the operands of `x == y` or `x != y` in a scan. One of them
+// must be an element, possibly extended, and the other an invariant.
+static bool check_scan(Stmt *s) {
+  Node *cond = s->val;
+  if (cond->kind == ND_NOT) {
+    s->op = ND_EQ;
+    s->addr = cond->lhs;
+    s->key = new_num(0, cond->lhs->ty);
+  } else if (cond->kind == ND_EQ || cond->kind == ND_NE) {
+    s->op = cond->kind;
+    s->addr = cond->lhs;
+    s->key = cond->rhs;
+    if (!is_invariant(s->key)) {
+      s->addr = cond->rhs;
+      s->key = cond->lhs;
+    }
+  } else {
+    return false;
+  }
+
+  s->key_ty = s->addr->ty;
+  if (!is_integer(s->key_ty) || !is_invariant(s->key))
+    return false;
+
+  // At most a change of signedness and an extension
+  Node *elem = s->addr;
+  if (elem->kind == ND_CAST)
+    elem = elem->lhs;
+  s->elem = elem->ty;
+  if (elem->kind == ND_CAST && elem->ty->size == elem->lhs->ty->size &&
+      is_integer(elem->ty))
+    elem = elem->lhs;
+
+  if (elem->kind != ND_DEREF || !is_integer(elem->ty) || elem->ty->size > 4 ||
+      !is_integer(s->elem) || s->elem->size != elem->ty->size)
+    return false;
+  s->addr = elem->lhs;
+  return true;
+}
+
+// Wraps a value to a given integer type.
+static int64_t wrap(Type *ty, int64_t val) {
+  if (ty->size == 8)
+    return val;
+  int bits = ty->size * 8;
+  uint64_t mask = (1UL << bits) - 1;
+  uint64_t x = val & mask;
+  if (!ty->is_unsigned && (x >> (bits - 1)))
+    x |= ~mask;
+  return x;
+}
+
+//
+// Rewriting loops
+//
+
+static Node *new_and(Node *lhs, Node *rhs) {
+  if (!lhs)
+    return rhs;
+  if (!rhs)
+    return lhs;
+  return new_binary(ND_LOGAND, lhs, rhs, ty_int);
+}
+
+static Type *unsigned_of(Type *ty) {
+  return (ty->size == 8) ? ty_ulong : ty_uint;
+}
+
+// `i < n && n - i >= W`, computed so that it doesn't overflow.
+static Node *vector_cond(int width) {
+  Node *cond = loop->cond;
+  Type *uty = unsigned_of(cond->lhs->ty);
+  Node *rem = new_binary(ND_SUB, new_cast_to(copy_expr(cond->rhs), uty),
+                         new_cast_to(copy_expr(cond->lhs), uty), uty);
+  return new_and(copy_expr(cond),
+                 new_binary(ND_LE, new_num(width, uty), rem, ty_int));
+}
+
+// Returns a condition that holds if the elements that the vector
+// loop accesses through different arrays don't overlap.
+static Node *no_overlap(Node *guard) {
+  Node *cond = loop->cond;
+  Type *uty = unsigned_of(cond->lhs->ty);
+
+  for (int i = 0; i < naccesses; i++) {
+    for (int j = i + 1; j < naccesses; j++) {
+      Access *a = &accesses[i];
+      Access *b = &accesses[j];
+      if (!a->is_store && !b->is_store)
+        continue;
+
+      // Distinct array variables never overlap.
+      Node *x = skip_casts(a->base);
+      Node *y = skip_casts(b->base);
+      if (x->kind == ND_VAR && y->kind == ND_VAR && x->var != y->var &&
+          x->ty->kind == TY_ARRAY && y->ty->kind == TY_ARRAY)
+        continue;
+
+      int size = a->addr->ty->base->size;
+      Node *rem = new_binary(ND_SUB, new_cast_to(copy_expr(cond->rhs), uty),
+                             new_cast_to(copy_expr(cond->lhs), uty), uty);
+      rem = new_binary(ND_MUL, new_cast_to(rem, ty_ulong),
+                       new_num(size, ty_ulong), ty_ulong);
+
+      Node *p = new_cast_to(copy_expr(a->addr), ty_ulong);
+      Node *q = new_cast_to(copy_expr(b->addr), ty_ulong);
+      Node *p_end = new_binary(ND_ADD, p, rem, ty_ulong);
+      Node *q_end = new_binary(ND_ADD, q, copy_expr(rem), ty_ulong);
+
+      Node *same = new_binary(ND_EQ, copy_expr(p), copy_expr(q), ty_int);
+      Node *before = new_binary(ND_LE, p_end, copy_expr(q), ty_int);
+      Node *after = new_binary(ND_LE, q_end, copy_expr(p), ty_int);
+      Node *ok = new_binary(ND_LOGOR, same, new_binary(ND_LOGOR, before, after, ty_int),
+                            ty_int);
+      guard = new_and(guard, ok);
+    }
+  }
+  return guard;
+}
+
+// Returns `for (; i < n && n - i >= W; i += W)` without a body.
+static Node *vector_loop(int width) {
+  Node *inc = new_binary(ND_ADD, new_var(iv), new_num(width, iv->ty), iv->ty);
+  return new_loop(vector_cond(width), new_assign(new_var(iv), inc), NULL);
+}
+
+// Replaces the loop with
+//
+//   { init; pre; if (guard) { setup; vloop; post; } loop }
+//
+// where the original loop no longer has an initializer.
+static void rewrite(Node *guard, Node *pre, Node *vloop, Node *post) {
+  int width = VECTOR_SIZE / lane->size;
+
+  setup_cur = setup_cur->next = vloop;
+  setup_cur->next = post;
+
+  Node *node = new_node(ND_IF, loop->tok);
+  node->cond = new_and(vector_cond(width), guard);
+  node->then = new_block(setup.next);
+
+  Node *scalar = new_node(ND_FOR, loop->tok);
+  *scalar = *loop;
+  scalar->init = NULL;
+  scalar->next = NULL;
+
+  Node head = {};
+  Node *cur = &head;
+  if (loop->init)
+    cur = cur->next = loop->init;
+  if (pre)
+    cur = cur->next = pre;
+  cur = cur->next = node;
+  cur = cur->next = scalar;
+
+  loop->kind = ND_BLOCK;
+  loop->body = head.next;
+}
+
+// Vectorizes `if (p[i] == c) break;`.
+static bool vectorize_scan(Stmt *s) {
+  if (!check_scan(s))
+    return false;
+
+  lane = lane_type(s->elem);
+  Type *ety = s->addr->ty->base;
+  if (!lane || ety->size != lane->size || is_qualified(ety))
+    return false;
+  vty = vector_of(lane, VECTOR_SIZE);
+
+  Node *key = s->key;
+  Node *guard = NULL;
+
+  // An element can be equal to the key only if the key is in the
+  // range of the element type.
+  if (key->kind == ND_NUM) {
+    if (wrap(s->key_ty, wrap(lane, key->val)) != wrap(s->key_ty, key->val))
+      return false;
+  } else {
+    Node *k = new_cast_to(new_cast_to(copy_expr(key), lane), s->key_ty);
+    guard = new_binary(ND_EQ, k, copy_expr(key), ty_int);
+  }
+
+  Node *x = vec_access(s->addr, false);
+  if (!x)
+    return false;
+
+  // Compare the lanes and test whether any of them matched.
+  Type *mty = vector_of((lane->size == 1) ? ty_char :
+                        (lane->size == 2) ? ty_short : ty_int, VECTOR_SIZE);
+  Node *mask = new_binary(ND_EQ, x, splat(key), mty);
+  if (s->op == ND_NE)
+    mask = new_unary(ND_BITNOT, mask, mty);
+
+  Type *lty = vector_of(ty_long, VECTOR_SIZE);
+  Obj *m = new_lvar(lty);
+  Node *set = new_assign(new_var(m), new_cast_to(mask, lty));
+  Node *any = new_binary(ND_BITOR, var_part(m, ty_long, 0),
+                         var_part(m, ty_long, 8), ty_long);
+
+  Node *vloop = vector_loop(VECTOR_SIZE / lane->size);
+  vloop->then = new_node(ND_IF, loop->tok);
+  vloop->then->cond = new_binary(ND_COMMA, set, any, ty_long);
+  vloop->then->then = new_node(ND_GOTO, loop->tok);
+  vloop->then->then->unique_label = vloop->brk_label;
+
+  // Run the original loop until the element is aligned.
+  Node *addr = new_cast_to(copy_expr(s->addr), ty_ulong);
+  Node *misaligned = new_binary(ND_BITAND, addr,
+                                new_num(VECTOR_SIZE - 1, ty_ulong), ty_ulong);
+  Node *body = new_node(ND_IF, loop->tok);
+  body->cond = copy_expr(s->val);
+  body->then = new_node(ND_GOTO, loop->tok);
+  body->then->unique_label = loop->brk_label;
+  Node *peel = new_loop(new_and(copy_expr(loop->cond), misaligned),
+                        copy_expr(loop->inc), body);
+
+  rewrite(guard, peel, vloop, NULL);
+  return true;
+}
+
+// Vectorizes stores and reductions.
+static bool vectorize_body(void) {
+  Node head = {};
+  Node *cur = &head;
+  Node post = {};
+  Node *post_cur = &post;
+  int size = 0;
+
+  for (int i = 0; i < nstmts; i++) {
+    Stmt *s = &stmts[i];
+    if (s->kind == VS_SCAN || (s->kind == VS_STORE && s->addr->ty->kind != TY_PTR))
+      return false;
+
+    Type *ty = (s->kind == VS_STORE) ? s->addr->ty->base : s->var->ty;
+    if (!ty || is_qualified(ty) || ty->kind == TY_BOOL)
+      return false;
+    lane = lane_type(ty);
+    if (!lane || (size && lane->size != size))
+      return false;
+    if (s->kind == VS_REDUCE && !is_integer(lane))
+      return false;
+    size = lane->size;
+    vty = vector_of(lane, VECTOR_SIZE);
+
+    Node *val = vec_expr(s->val, s);
+    if (!val)
+      return false;
+
+    if (s->kind == VS_STORE) {
+      Node *lhs = vec_access(s->addr, true);
+      if (!lhs)
+        return false;
+      cur = cur->next = new_stmt(ND_EXPR_STMT, new_assign(lhs, val));
+      continue;
+    }
+
+    // Accumulate in the lanes of a vector and combine them after
+    // the loop. `s -= x` subtracts the sum of the x's.
+    Obj *acc = new_lvar(vty);
+    Node *zero = new_node(ND_MEMZERO, loop->tok);
+    zero->var = acc;
+    setup_cur = setup_cur->next = new_stmt(ND_EXPR_STMT, zero);
+
+    NodeKind op = (s->op == ND_SUB) ? ND_ADD : s->op;
+    Node *expr = new_binary(op, new_var(acc), val, vty);
+    cur = cur->next = new_stmt(ND_EXPR_STMT, new_assign(new_var(acc), expr));
+
+    Type *sty = (lane->size < 4) ? ty_int : lane;
+    Node *sum = new_cast_to(var_part(acc, lane, 0), sty);
+    for (int j = 1; j < VECTOR_SIZE / size; j++)
+      sum = new_binary(op, sum, new_cast_to(var_part(acc, lane, j * size), sty), sty);
+    sum = new_binary(s->op, new_cast_to(new_var(s->var), sty), sum, sty);
+    post_cur = post_cur->next =
+      new_stmt(ND_EXPR_STMT, new_assign(new_var(s->var), new_cast_to(sum, s->var->ty)));
+  }
+
+  Node *vloop = vector_loop(VECTOR_SIZE / size);
+  vloop->then = new_block(head.next);
+  rewrite(no_overlap(NULL), NULL, vloop, post.next);
+  return true;
+}
+
+static bool vectorize_loop(Node *node) {
+  loop = node;
+  iv = NULL;
+  nstmts = 0;
+  naccesses = 0;
+  setup.next = NULL;
+  setup_cur = &setup;
+
+  Node *cond = node->cond;
+  if (!cond || cond->kind != ND_LT || !node->inc || !is_increment(node->inc))
+    return false;
+  if (!is_index(cond->lhs) || !is_integer(cond->lhs->ty) || cond->lhs->ty->size < 4)
+    return false;
+  if (!collect_stmts(node->then) || !nstmts || !is_invariant(cond->rhs))
+    return false;
+
+  if (nstmts == 1 && stmts[0].kind == VS_SCAN)
+    return vectorize_scan(&stmts[0]);
+  return vectorize_body();
+}
+
+static void vectorize_expr(Node *node);
+
+// Looks for loops in a given statement.
+static void vectorize_stmt(Node *node) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      vectorize_stmt(n);
+    return;
+  case ND_IF:
+    vectorize_stmt(node->then);
+    vectorize_stmt(node->els);
+    return;
+  case ND_FOR: {
+    vectorize_stmt(node->then);
+
+    // Drop the variables created for a loop that we gave up on.
+    Obj *locals = current_fn->locals;
+    if (!vectorize_loop(node))
+      current_fn->locals = locals;
+    return;
+  }
+  case ND_DO:
+  case ND_SWITCH:
+    vectorize_stmt(node->then);
+    return;
+  case ND_CASE:
+  case ND_LABEL:
+    vectorize_stmt(node->lhs);
+    return;
+  case ND_EXPR_STMT:
+  case ND_RETURN:
+    vectorize_expr(node->lhs);
+    return;
+  }
+}
+
+// Looks for loops in the statement expressions in a given expression,
+// which include the bodies of inlined functions.
+static void vectorize_expr(Node *node) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      vectorize_stmt(n);
+    return;
+  case ND_COND:
+    vectorize_expr(node->cond);
+    vectorize_expr(node->then);
+    vectorize_expr(node->els);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      vectorize_expr(n);
+    break;
+  }
+  vectorize_expr(node->lhs);
+  vectorize_expr(node->rhs);
+}
+
+void vectorize_function(Obj *fn) {
+  current_fn = fn;
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->is_addr_taken = false;
+  walk(fn->body, find_addr_taken);
+  vectorize_stmt(fn->body);
+}
+
+void vectorize(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && fn->body)
+      vectorize_function(fn);
+}